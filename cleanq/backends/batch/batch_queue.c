@@ -0,0 +1,778 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/batch_queue.h>
+#include <cleanq_backend.h>
+#include <region_pool.h>
+
+
+/*
+ * BATCH QUEUE
+ * ===========
+ *
+ * This queue is stacked on top of another one. Single enqueues are collected in the transmit
+ * buffer and sent to the queue below with cleanq_enqueue_batch() once the buffer is full, the
+ * oldest entry has been kept back for longer than the flush deadline, or the queue is notified.
+ * Dequeues are served from the receive cache, which is refilled with cleanq_dequeue_batch().
+ *
+ * The public functions of the queue below are used, its statistics and histograms stay
+ * meaningful, and it flushes its queued registration acknowledgements when it runs empty. The
+ * region pool is shared with the queue below: regions registered on either queue, or by the
+ * other side, are known to both.
+ *
+ * The buffers kept back are always sent before anything else is enqueued into the queue below,
+ * chains and inline messages wait until the transmit buffer could be emptied.
+ */
+
+
+///< the default number of buffers sent together
+#define BATCHQ_DEFAULT_BATCH 16
+
+///< the default time a buffer may be kept back
+#define BATCHQ_DEFAULT_FLUSH_US 50
+
+///< the default number of buffers dequeued at once
+#define BATCHQ_DEFAULT_RX_BATCH 16
+
+
+struct cleanq_batchq
+{
+    ///< generic cleanq part
+    struct cleanq my_q;
+
+    ///< the queue below
+    struct cleanq *q;
+
+    ///< the attributes with the defaults filled in
+    struct cleanq_batchq_attr attr;
+
+    ///< the buffers kept back, attr.batch entries
+    struct cleanq_buf *tx;
+
+    ///< the number of buffers kept back
+    size_t tx_num;
+
+    ///< the time in microseconds by which the buffers kept back are sent
+    uint64_t tx_deadline;
+
+    ///< the dequeued buffers not handed out yet, attr.rx_batch entries
+    struct cleanq_buf *rx;
+
+    ///< the next buffer of the receive cache to be handed out
+    size_t rx_head;
+
+    ///< the number of buffers in the receive cache
+    size_t rx_num;
+};
+
+
+/*
+ * ================================================================================================
+ * Transmit Buffer and Receive Cache
+ * ================================================================================================
+ */
+
+
+static inline uint64_t batchq_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief sends the buffers kept back to the queue below
+ *
+ * @param que   the batch queue
+ *
+ * @returns CLEANQ_ERR_OK if all buffers have been sent, the error of the queue below otherwise
+ *
+ * The buffers that did not fit stay in the transmit buffer, in order.
+ */
+static errval_t batchq_flush(struct cleanq_batchq *que)
+{
+    errval_t err = CLEANQ_ERR_OK;
+    size_t sent = 0;
+
+    while (sent < que->tx_num) {
+        size_t num_enq;
+        err = cleanq_enqueue_batch(que->q, que->tx + sent, que->tx_num - sent, &num_enq);
+        if (err_is_fail(err)) {
+            break;
+        }
+        sent += num_enq;
+    }
+
+    if (sent && sent < que->tx_num) {
+        memmove(que->tx, que->tx + sent, (que->tx_num - sent) * sizeof(struct cleanq_buf));
+    }
+    que->tx_num -= sent;
+
+    return err;
+}
+
+
+/**
+ * @brief sends the buffers kept back if the flush deadline has expired
+ *
+ * @param que   the batch queue
+ */
+static inline void batchq_check_deadline(struct cleanq_batchq *que)
+{
+    if (que->tx_num && batchq_now_us() >= que->tx_deadline) {
+        batchq_flush(que);
+    }
+}
+
+
+/**
+ * @brief adds buffers to the transmit buffer
+ *
+ * @param que   the batch queue
+ * @param bufs  the buffers
+ * @param num   the number of buffers, at most the free entries of the transmit buffer
+ */
+static inline void batchq_keep_back(struct cleanq_batchq *que, const struct cleanq_buf *bufs,
+                                    size_t num)
+{
+    if (que->tx_num == 0) {
+        que->tx_deadline = batchq_now_us() + que->attr.flush_us;
+    }
+
+    memcpy(que->tx + que->tx_num, bufs, num * sizeof(struct cleanq_buf));
+    que->tx_num += num;
+
+    if (que->tx_num == que->attr.batch) {
+        batchq_flush(que);
+    } else {
+        batchq_check_deadline(que);
+    }
+}
+
+
+/**
+ * @brief refills the receive cache from the queue below
+ *
+ * @param que   the batch queue
+ *
+ * @returns CLEANQ_ERR_OK if the cache holds buffers, the error of the queue below otherwise
+ */
+static errval_t batchq_fill(struct cleanq_batchq *que)
+{
+    size_t num_deq;
+    errval_t err = cleanq_dequeue_batch(que->q, que->rx, que->attr.rx_batch, &num_deq);
+
+    /* invalid buffers have been dropped, the others are still good */
+    if (num_deq == 0) {
+        return err;
+    }
+
+    que->rx_head = 0;
+    que->rx_num = num_deq;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Datapath
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief keeps back a buffer until a batch is complete
+ *
+ * @param q                     The batch queue
+ * @param region_id             Region id of the enqueued buffer
+ * @param offset                Offset into the region where the buffer resides
+ * @param length                Length of the buffer
+ * @param valid_data            Offset into the region where the valid data of the buffer resides
+ * @param valid_length          Length of the valid data of the buffer
+ * @param misc_flags            Miscellaneous flags
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if the transmit buffer is full and the queue below has no room,
+ *          CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_enqueue(struct cleanq *q, regionid_t rid, genoffset_t offset,
+                               genoffset_t length, genoffset_t valid_data,
+                               genoffset_t valid_length, uint64_t flags)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    if (que->tx_num == que->attr.batch) {
+        batchq_flush(que);
+        if (que->tx_num == que->attr.batch) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+    }
+
+    struct cleanq_buf b = {
+        .rid = rid,
+        .offset = offset,
+        .length = length,
+        .valid_data = valid_data,
+        .valid_length = valid_length,
+        .flags = flags,
+    };
+
+    batchq_keep_back(que, &b, 1);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief hands out the next buffer of the receive cache
+ *
+ * @param q             The batch queue
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param length        Return pointer to the length of the dequeued buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns the error of the queue below if the cache is empty and could not be refilled,
+ *          CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_dequeue(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
+                               genoffset_t *length, genoffset_t *valid_data,
+                               genoffset_t *valid_length, uint64_t *flags)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_check_deadline(que);
+
+    if (que->rx_num == 0) {
+        errval_t err = batchq_fill(que);
+        if (err_is_fail(err)) {
+            return err;
+        }
+    }
+
+    struct cleanq_buf *b = &que->rx[que->rx_head++];
+    que->rx_num--;
+
+    *rid = b->rid;
+    *offset = b->offset;
+    *length = b->length;
+    *valid_data = b->valid_data;
+    *valid_length = b->valid_length;
+    *flags = b->flags;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief keeps back a batch of buffers, full batches are passed on directly
+ *
+ * @param q             The batch queue
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no buffer was enqueued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t batchq_enqueue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                     size_t *num_enq)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    if (que->tx_num + num >= que->attr.batch) {
+        batchq_flush(que);
+    }
+
+    /* the caller batches already, nothing to wait for */
+    if (que->tx_num == 0 && num >= que->attr.batch) {
+        return cleanq_enqueue_batch(que->q, bufs, num, num_enq);
+    }
+
+    size_t count = que->attr.batch - que->tx_num;
+    if (count > num) {
+        count = num;
+    }
+
+    *num_enq = count;
+    if (count == 0) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    batchq_keep_back(que, bufs, count);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeues a batch of buffers, from the receive cache first
+ *
+ * @param q             The batch queue
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns the error of the queue below if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t batchq_dequeue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                     size_t *num_deq)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_check_deadline(que);
+
+    size_t count = que->rx_num < num ? que->rx_num : num;
+    memcpy(bufs, que->rx + que->rx_head, count * sizeof(struct cleanq_buf));
+    que->rx_head += count;
+    que->rx_num -= count;
+
+    /* the rest comes directly from the queue below, without another copy */
+    errval_t err = CLEANQ_ERR_OK;
+    if (count < num) {
+        size_t n;
+        err = cleanq_dequeue_batch(que->q, bufs + count, num - count, &n);
+        count += n;
+    }
+
+    *num_deq = count;
+
+    return (count == 0) ? err : CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief enqueues a chain into the queue below once the buffers kept back have been sent
+ *
+ * @param q             The batch queue
+ * @param bufs          The segments of the chain
+ * @param num           The number of segments
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if the chain does not fit, or CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_enqueue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    if (err_is_fail(batchq_flush(que))) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    return cleanq_enqueue_chain(que->q, bufs, num);
+}
+
+
+/**
+ * @brief dequeues a chain, its first segments may be in the receive cache
+ *
+ * @param q             The batch queue
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if the queue was empty, CLEANQ_ERR_CHAIN_TOO_LONG if the chain
+ *          does not fit into the array, or CLEANQ_ERR_OK on success
+ *
+ * A chain is never taken apart. If the segments in the cache alone don't fit, the length
+ * returned with CLEANQ_ERR_CHAIN_TOO_LONG may be short of the rest of the chain.
+ */
+static errval_t batchq_dequeue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                     size_t *num_deq)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_check_deadline(que);
+
+    if (que->rx_num == 0) {
+        return cleanq_dequeue_chain(que->q, bufs, num, num_deq);
+    }
+
+    /* the chain ends with the last segment, or with the last cached buffer */
+    struct cleanq_buf *cached = que->rx + que->rx_head;
+    size_t count = 0;
+    while (count < que->rx_num) {
+        if (cached[count++].flags & CLEANQ_FLAG_LAST) {
+            break;
+        }
+    }
+
+    if (count > num) {
+        *num_deq = count;
+        return CLEANQ_ERR_CHAIN_TOO_LONG;
+    }
+
+    memcpy(bufs, cached, count * sizeof(struct cleanq_buf));
+
+    /* the rest of the chain is still in the queue below */
+    size_t n = 0;
+    if (!(cached[count - 1].flags & CLEANQ_FLAG_LAST)) {
+        errval_t err = cleanq_dequeue_chain(que->q, bufs + count, num - count, &n);
+        if (err == CLEANQ_ERR_CHAIN_TOO_LONG) {
+            *num_deq = count + n;
+            return err;
+        }
+        if (err_is_fail(err)) {
+            n = 0;
+        }
+    }
+
+    que->rx_head += count;
+    que->rx_num -= count;
+
+    *num_deq = count + n;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief enqueues an inline message once the buffers kept back have been sent
+ *
+ * @param q             The batch queue
+ * @param data          The data of the message
+ * @param len           The length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_enqueue_inline(struct cleanq *q, const void *data, size_t len)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    if (err_is_fail(batchq_flush(que))) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    return cleanq_enqueue_inline(que->q, data, len);
+}
+
+
+/**
+ * @brief dequeues an inline message from the queue below
+ *
+ * @param q             The batch queue
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns CLEANQ_ERR_BUFFER_PENDING if there are buffers in the receive cache, the result of
+ *          the queue below otherwise
+ */
+static errval_t batchq_dequeue_inline(struct cleanq *q, void *data, size_t size, size_t *len)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_check_deadline(que);
+
+    /* the cached buffers came before the message */
+    if (que->rx_num) {
+        return CLEANQ_ERR_BUFFER_PENDING;
+    }
+
+    return cleanq_dequeue_inline(que->q, data, size, len);
+}
+
+
+/**
+ * @brief sends the buffers kept back and notifies the other side
+ *
+ * @param q      The batch queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The buffers that don't fit into the queue below are sent with a later call.
+ */
+static errval_t batchq_notify(struct cleanq *q)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_flush(que);
+
+    return cleanq_notify(que->q);
+}
+
+
+/**
+ * @brief waits until there is something to dequeue on the queue below
+ *
+ * @param q             The batch queue
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ *
+ * The buffers kept back are sent first, the other side may be waiting for them.
+ */
+static errval_t batchq_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    if (que->rx_num) {
+        return CLEANQ_ERR_OK;
+    }
+
+    if (que->tx_num) {
+        batchq_flush(que);
+        cleanq_notify(que->q);
+    }
+
+    return cleanq_wait(que->q, timeout_us);
+}
+
+
+/**
+ * @brief Sets the doorbell of the queue below
+ *
+ * @param q         The batch queue
+ * @param name      The name of the doorbell object, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_doorbell(struct cleanq *q, const char *name, uint32_t bit)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+    if (que->q->f.doorbell == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+    return que->q->f.doorbell(que->q, name, bit);
+}
+
+
+/*
+ * ================================================================================================
+ * Control Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Send a control message to the queue below
+ *
+ * @param q          The batch queue
+ * @param request    The type of the control message*
+ * @param value      The value for the request
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_control(struct cleanq *q, uint64_t request, uint64_t value,
+                               uint64_t *result)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+    return cleanq_control(que->q, request, value, result);
+}
+
+
+/*
+ * ================================================================================================
+ * Memory Registration and Deregistration
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief passes a new region on to the backend of the queue below
+ *
+ * @param q              The batch queue
+ * @param cap            A Capability for some memory
+ * @param region_id      The region id, already in the shared region pool
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t batchq_register(struct cleanq *q, struct capref cap, regionid_t rid)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+    return que->q->f.reg(que->q, cap, rid);
+}
+
+
+/**
+ * @brief passes the removal of a region on to the backend of the queue below
+ *
+ * @param q              The batch queue
+ * @param region_id      The region id, already removed from the shared region pool
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Buffers of the region that are still kept back can't be sent anymore, they are dropped.
+ */
+static errval_t batchq_deregister(struct cleanq *q, regionid_t rid)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < que->tx_num; i++) {
+        if (que->tx[i].rid != rid) {
+            que->tx[kept++] = que->tx[i];
+        }
+    }
+    que->tx_num = kept;
+
+    return que->q->f.dereg(que->q, rid);
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Destruction and Creation
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Destroys a batch queue, the queue below is left alone
+ *
+ * @param queue The batch queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The buffers kept back are sent if there is room, the buffers in the receive cache are lost.
+ */
+static errval_t batchq_destroy(struct cleanq *q)
+{
+    struct cleanq_batchq *que = (struct cleanq_batchq *)q;
+
+    batchq_flush(que);
+
+    free(que->tx);
+    free(que->rx);
+    free(que);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief creates a batch queue on top of another
+ *
+ * @param q         the created batch queue
+ * @param other_q   the queue below
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_batchq_create(struct cleanq_batchq **q, struct cleanq *other_q)
+{
+    return cleanq_batchq_create_with_attr(q, other_q, NULL);
+}
+
+
+/**
+ * @brief creates a batch queue with the given attributes on top of another
+ *
+ * @param q         the created batch queue
+ * @param other_q   the queue below
+ * @param attr      the attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_batchq_create_with_attr(struct cleanq_batchq **q, struct cleanq *other_q,
+                                        const struct cleanq_batchq_attr *attr)
+{
+    errval_t err;
+
+    assert(q && other_q);
+
+    struct cleanq_batchq *que = calloc(1, sizeof(struct cleanq_batchq));
+    if (que == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    if (attr) {
+        que->attr = *attr;
+    }
+    if (que->attr.batch == 0) {
+        que->attr.batch = BATCHQ_DEFAULT_BATCH;
+    }
+    if (que->attr.flush_us == 0) {
+        que->attr.flush_us = BATCHQ_DEFAULT_FLUSH_US;
+    }
+    if (que->attr.rx_batch == 0) {
+        que->attr.rx_batch = BATCHQ_DEFAULT_RX_BATCH;
+    }
+
+    que->tx = malloc(que->attr.batch * sizeof(struct cleanq_buf));
+    que->rx = malloc(que->attr.rx_batch * sizeof(struct cleanq_buf));
+    if (que->tx == NULL || que->rx == NULL) {
+        err = CLEANQ_ERR_MALLOC_FAIL;
+        goto cleanup;
+    }
+
+    err = cleanq_init(&que->my_q);
+    if (err_is_fail(err)) {
+        goto cleanup;
+    }
+
+    /* both queues check the buffers against the same regions */
+    region_pool_destroy(que->my_q.pool);
+    que->my_q.pool = region_pool_share(other_q->pool, false);
+
+    que->q = other_q;
+
+    que->my_q.f.reg = batchq_register;
+    que->my_q.f.dereg = batchq_deregister;
+    que->my_q.f.ctrl = batchq_control;
+    que->my_q.f.notify = batchq_notify;
+    que->my_q.f.wait = batchq_wait;
+    que->my_q.f.doorbell = batchq_doorbell;
+    que->my_q.f.enq = batchq_enqueue;
+    que->my_q.f.deq = batchq_dequeue;
+    que->my_q.f.enq_batch = batchq_enqueue_batch;
+    que->my_q.f.deq_batch = batchq_dequeue_batch;
+    que->my_q.f.destroy = batchq_destroy;
+
+    /* chains and inline data are only available if the queue below has them */
+    if (other_q->f.enq_chain && other_q->f.deq_chain) {
+        que->my_q.f.enq_chain = batchq_enqueue_chain;
+        que->my_q.f.deq_chain = batchq_dequeue_chain;
+    }
+
+    if (other_q->f.enq_inline && other_q->f.deq_inline) {
+        que->my_q.f.enq_inline = batchq_enqueue_inline;
+        que->my_q.f.deq_inline = batchq_dequeue_inline;
+    }
+
+    *q = que;
+    return CLEANQ_ERR_OK;
+
+cleanup:
+    free(que->tx);
+    free(que->rx);
+    free(que);
+
+    return err;
+}
+
+
+/*
+ * ================================================================================================
+ * Flushing
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief sends the buffers that have been kept back to the queue below
+ *
+ * @param q     the batch queue
+ *
+ * @returns CLEANQ_ERR_OK if all buffers have been sent, CLEANQ_ERR_QUEUE_FULL if the queue
+ *          below had no room for some of them
+ */
+errval_t cleanq_batchq_flush(struct cleanq_batchq *q)
+{
+    return batchq_flush(q);
+}
@@ -13,17 +13,18 @@
 #include <string.h>
 #include <sched.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <cleanq/cleanq.h>
 #include <cleanq/backends/debug_queue.h>
 
 #include <cleanq_backend.h>
+#include <region_table.h>
 #include <slab.h>
 
 
-//#define DQ_ENABLE_HIST
 #define HIST_SIZE 128
-#define MAX_STR_SIZE 128
 
 
 //#define DEBUG_ENABLED 1
@@ -52,38 +53,45 @@ extern char *__progname;
  * A not valid enqueue of a buffer is when the endpoint that enqueues
  * the buffer does not own the buffer.
  *
- * We keep track of the owned buffers as a list of regions which each
- * contains a list of memory chunks.
- * Each chunk specifies a offset within the region and its length.
+ * We keep track of the owned memory of each region as a set of disjoint
+ * memory chunks. Each chunk specifies a offset within the region and its
+ * length. The chunks are kept in a treap ordered by their offset, and
+ * adjacent chunks are always merged. The regions are found through a
+ * region table, the same id table the region pool uses.
  *
  * When a region is registered, we add one memory chunk that describes
  * the whole region i.e. offset=0 length= length of region
  *
  * If a a buffer is enqueued, it has to be contained in one of these
- * memory chunks. The memory chunk is then altered according how
- * the buffer is contained in the chunk. If it is at the beginning or
- * end of the chunk, the offset/length of the chunk is changed accordingly
- * If the buffer is in the middle of the chunk, we split the memory chunk
- * into two new memory chunks that do not contain the buffer.
- *
- * If a buffer is dequeued the buffer is added to the existing memory
- * chunks if possible, otherwise a new memory chunk is added to the
- * list of chunks. If a buffer is dequeued that is in between two
- * memory chunks, the memory chunks are merged to one big chunk.
- * We might fail to find the region id in our list of regions. In this
+ * memory chunks. The only candidate is the chunk with the highest offset
+ * not above the offset of the buffer. The memory chunk is then altered
+ * according how the buffer is contained in the chunk. If it is at the
+ * beginning or end of the chunk, the offset/length of the chunk is changed
+ * accordingly. If the buffer is in the middle of the chunk, we split the
+ * memory chunk into two new memory chunks that do not contain the buffer.
+ *
+ * If a buffer is dequeued, it must not overlap with its neighbouring
+ * chunks. The buffer is merged with the neighbours it touches, otherwise
+ * a new memory chunk is added. Both operations are O(log n) in the number
+ * of chunks of the region.
+ * We might fail to find the region id in our table of regions. In this
  * case we add the region with the deqeued offset+length as a size.
  * We can be sure that this region exists since the cleanq library itself
  * does these checks if the region is known to the endpoint. This simply
  * means the debugging queue on top of the other queue does not have a
  * consistant view of the registered regions (but the queue below does)
  *
- * When a region is deregistered, the list of chunks has to only
+ * When a region is deregistered, the set of chunks has to only
  * contain a single chunk that descirbes the whole region. Otherwise
  * the call will fail since some of the buffers are still in use.
  *
  */
 
-///< represents a memory element in a doubly linked list
+///< defines the initial size of the region table, must be a power of two
+#define INIT_REGION_TABLE_SIZE 16
+
+
+///< represents a memory element in the tree of owned memory
 struct memory_ele
 {
     ///< the offset
@@ -92,14 +100,17 @@ struct memory_ele
     ///< the length
     genoffset_t length;
 
-    ///< the next memory element
-    struct memory_ele *next;
+    ///< the priority of the element in the tree
+    uint32_t prio;
+
+    ///< the elements with a lower offset
+    struct memory_ele *left;
 
-    ///< the previous element
-    struct memory_ele *prev;
+    ///< the elements with a higher offset
+    struct memory_ele *right;
 };
 
-///< represents a memory list
+///< represents the owned memory of a region
 struct memory_list
 {
     ///< the region id
@@ -111,19 +122,22 @@ struct memory_list
     ///< this is a region the other side registered
     bool not_consistent;
 
-    ///< the buffer elements
-    struct memory_ele *buffers;
+    ///< the number of buffer elements
+    size_t num_buffers;
 
-    ///< next element in the list
-    struct memory_list *next;
+    ///< the root of the tree of buffer elements
+    struct memory_ele *buffers;
 };
 
 
-///< represents an operation
+///< represents an operation in the history
 struct operation
 {
-    ///< operation name
-    char str[MAX_STR_SIZE];
+    ///< operation name, a static string
+    const char *str;
+
+    ///< the region of the buffer
+    regionid_t rid;
 
     ///< the offset of the buffer
     genoffset_t offset;
@@ -133,6 +147,54 @@ struct operation
 };
 
 
+///< the default number of entries in the operation log of the async mode
+#define DEFAULT_LOG_SIZE 4096
+
+///< the types of the operations in the log
+enum debug_op_type {
+    DEBUG_OP_ENQ,
+    DEBUG_OP_DEQ,
+    DEBUG_OP_REG,
+    DEBUG_OP_DEREG,
+};
+
+///< represents an operation in the log of the async mode
+struct debug_op
+{
+    ///< the type of the operation
+    uint32_t type;
+
+    ///< the region of the buffer
+    regionid_t rid;
+
+    ///< the offset of the buffer
+    genoffset_t offset;
+
+    ///< the length of the buffer, or the region
+    genoffset_t length;
+};
+
+
+///< represents a buffer tracked by the sampled mode
+struct sampled_buf
+{
+    ///< the region of the buffer
+    regionid_t rid;
+
+    ///< whether the slot in the table is used
+    uint32_t used;
+
+    ///< the offset of the buffer
+    genoffset_t offset;
+
+    ///< the length of the buffer
+    genoffset_t length;
+
+    ///< the operation count when the buffer was enqueued
+    uint64_t seq;
+};
+
+
 ///< defines a debug queue
 struct cleanq_debugq
 {
@@ -142,8 +204,17 @@ struct cleanq_debugq
     ///< this is the other queue, the debug queue wraps
     struct cleanq *q;
 
-    ///< list of regions to track
-    struct memory_list *regions;  // list of lists
+    ///< the attributes of the queue
+    struct cleanq_debugq_attr attr;
+
+    ///< the number of ownership violations
+    volatile uint64_t errors;
+
+    ///< the regions to track by their id
+    struct region_table regions;
+
+    ///< state of the generator for the priorities of the buffer elements
+    uint32_t prio_state;
 
     ///< slab allocator for tracking ownership
     struct slab_allocator alloc;
@@ -151,49 +222,105 @@ struct cleanq_debugq
     ///< slab allocator for the lists
     struct slab_allocator alloc_list;
 
+    ///< sampled: buffers whose hash is below the threshold are tracked
+    uint64_t sample_threshold;
+
+    ///< sampled: open addressed table of the outstanding sampled buffers
+    struct sampled_buf *sampled;
+
+    ///< sampled: the size of the table, always a power of two
+    size_t sampled_size;
+
+    ///< sampled: the number of buffers in the table
+    size_t num_sampled;
 
-#ifdef DQ_ENABLE_HIST
+    ///< sampled: the number of enqueue and dequeue operations
+    uint64_t seq;
+
+    ///< async: the operation log
+    struct debug_op *log;
+
+    ///< async: the next entry to be written, only written by the datapath
+    struct __attribute__((aligned(64)))
+    {
+        volatile uint64_t log_head;
+    };
+
+    ///< async: the next entry to be checked, only written by the checker thread
+    struct __attribute__((aligned(64)))
+    {
+        volatile uint64_t log_tail;
+    };
+
+    ///< async: tells the checker thread to stop once the log is empty
+    volatile bool stop;
+
+    ///< async: the checker thread
+    pthread_t checker;
+
+    ///< the next entry in the history
     uint16_t hist_head;
+
+    ///< the recent operations
     struct operation history[HIST_SIZE];
-#endif
 };
 
+
+static void dump_tree(struct memory_ele *ele, int *index)
+{
+    if (ele == NULL) {
+        return;
+    }
+
+    dump_tree(ele->left, index);
+    printf("Idx=%d offset=%lu length=%lu \n", *index, ele->offset, ele->length);
+    (*index)++;
+    dump_tree(ele->right, index);
+}
+
 static void dump_list(struct memory_list *region)
 {
-    struct memory_ele *ele = region->buffers;
     int index = 0;
     printf("================================================ \n");
-    while (ele != NULL) {
-        printf("Idx=%d offset=%lu length=%lu", index, ele->offset, ele->length);
-        if (ele->prev != NULL) {
-            printf(" prev->offset=%lu prev->length=%lu", ele->prev->offset, ele->prev->length);
-        }
-        printf(" \n");
-        ele = ele->next;
-        index++;
-    }
+    dump_tree(region->buffers, &index);
     printf("================================================ \n");
 }
 
-#ifdef DQ_ENABLE_HIST
-static void add_to_history(struct cleanq_debugq *q, genoffset_t offset, genoffset_t length, char *s)
+// records an operation in the history, cheap enough to be always on
+static inline void add_to_history(struct cleanq_debugq *q, regionid_t rid, genoffset_t offset,
+                                  genoffset_t length, const char *s)
 {
-    q->history[q->hist_head].offset = offset;
-    q->history[q->hist_head].length = length;
-    strncpy(q->history[q->hist_head].str, s, MAX_STR_SIZE);
+    if (!q->attr.record) {
+        return;
+    }
+
+    struct operation *op = &q->history[q->hist_head];
+    op->str = s;
+    op->rid = rid;
+    op->offset = offset;
+    op->length = length;
     q->hist_head = (q->hist_head + 1) % HIST_SIZE;
 }
 
 static void dump_history(struct cleanq_debugq *q)
 {
+    // from the oldest to the newest operation
     for (int i = 0; i < HIST_SIZE; i++) {
-        printf("offset=%lu length=%lu %s\n", q->history[q->hist_head].offset,
-               q->history[q->hist_head].length, q->history[q->hist_head].str);
+        struct operation *op = &q->history[(q->hist_head + i) % HIST_SIZE];
+        if (op->str == NULL) {
+            continue;
+        }
+        printf("rid=%u offset=%lu length=%lu %s\n", op->rid, op->offset, op->length, op->str);
+    }
+}
 
-        q->hist_head = (q->hist_head + 1) % HIST_SIZE;
+static void report_error(struct cleanq_debugq *q)
+{
+    __sync_fetch_and_add(&q->errors, 1);
+    if (q->attr.record) {
+        dump_history(q);
     }
 }
-#endif /* DQ_ENABLE_HIST */
 
 
 // is b1 in bounds of b2?
@@ -204,332 +331,962 @@ static bool buffer_in_bounds(genoffset_t offset_b1, genoffset_t len_b1, genoffse
            && ((offset_b1 + len_b1) <= offset_b2 + len_b2);
 }
 
+
+/*
+ * ================================================================================================
+ * Tree of Owned Memory
+ * ================================================================================================
+ */
+
+
+/*
+ * The memory chunks of a region do not overlap, so they are kept in a treap ordered by their
+ * offset. Changing the offset of a chunk within its own bounds keeps the order intact. The
+ * priorities come from a xorshift generator, as buffers are typically enqueued and dequeued in
+ * offset order.
+ */
+
+
+static inline uint32_t ele_tree_prio(struct cleanq_debugq *que)
+{
+    uint32_t x = que->prio_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    que->prio_state = x;
+    return x;
+}
+
+
+/**
+ * @brief finds the element with the highest offset not above the given offset
+ *
+ * @param node      the root of the tree
+ * @param offset    the offset
+ *
+ * @returns the element, or NULL if all elements are above the offset
+ */
+static struct memory_ele *ele_tree_floor(struct memory_ele *node, genoffset_t offset)
+{
+    struct memory_ele *floor = NULL;
+    while (node != NULL) {
+        if (node->offset <= offset) {
+            floor = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return floor;
+}
+
+
+/**
+ * @brief finds the element with the lowest offset above the given offset
+ *
+ * @param node      the root of the tree
+ * @param offset    the offset
+ *
+ * @returns the element, or NULL if all elements are at or below the offset
+ */
+static struct memory_ele *ele_tree_above(struct memory_ele *node, genoffset_t offset)
+{
+    struct memory_ele *above = NULL;
+    while (node != NULL) {
+        if (node->offset > offset) {
+            above = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return above;
+}
+
+
+/**
+ * @brief inserts an element into the tree
+ *
+ * @param node      the root of the (sub)tree
+ * @param ele       the element to insert
+ *
+ * @returns the new root of the (sub)tree
+ */
+static struct memory_ele *ele_tree_insert(struct memory_ele *node, struct memory_ele *ele)
+{
+    if (node == NULL) {
+        return ele;
+    }
+
+    if (ele->offset < node->offset) {
+        node->left = ele_tree_insert(node->left, ele);
+        if (node->left->prio > node->prio) {
+            // rotate right
+            struct memory_ele *l = node->left;
+            node->left = l->right;
+            l->right = node;
+            return l;
+        }
+    } else {
+        node->right = ele_tree_insert(node->right, ele);
+        if (node->right->prio > node->prio) {
+            // rotate left
+            struct memory_ele *r = node->right;
+            node->right = r->left;
+            r->left = node;
+            return r;
+        }
+    }
+
+    return node;
+}
+
+
+/**
+ * @brief merges two trees, all elements in the left tree are below the ones in the right tree
+ *
+ * @param left      the left tree
+ * @param right     the right tree
+ *
+ * @returns the root of the merged tree
+ */
+static struct memory_ele *ele_tree_merge(struct memory_ele *left, struct memory_ele *right)
+{
+    if (left == NULL) {
+        return right;
+    }
+
+    if (right == NULL) {
+        return left;
+    }
+
+    if (left->prio > right->prio) {
+        left->right = ele_tree_merge(left->right, right);
+        return left;
+    }
+
+    right->left = ele_tree_merge(left, right->left);
+    return right;
+}
+
+
+/**
+ * @brief removes an element from the tree
+ *
+ * @param node      the root of the (sub)tree
+ * @param ele       the element to remove, must be in the tree
+ *
+ * @returns the new root of the (sub)tree
+ */
+static struct memory_ele *ele_tree_remove(struct memory_ele *node, struct memory_ele *ele)
+{
+    if (node == ele) {
+        return ele_tree_merge(node->left, node->right);
+    }
+
+    if (ele->offset < node->offset) {
+        node->left = ele_tree_remove(node->left, ele);
+    } else {
+        node->right = ele_tree_remove(node->right, ele);
+    }
+
+    return node;
+}
+
+
+/**
+ * @brief frees all elements of a tree
+ *
+ * @param que       the debug queue
+ * @param node      the root of the tree
+ */
+static void ele_tree_free(struct cleanq_debugq *que, struct memory_ele *node)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    ele_tree_free(que, node->left);
+    ele_tree_free(que, node->right);
+    slab_free(&que->alloc, node);
+}
+
+
+/**
+ * @brief adds a new element to the owned memory of a region
+ *
+ * @param que       the debug queue
+ * @param region    the region
+ * @param offset    the offset of the element
+ * @param length    the length of the element
+ */
+static void add_buffer(struct cleanq_debugq *que, struct memory_list *region, genoffset_t offset,
+                       genoffset_t length)
+{
+    struct memory_ele *ele = (struct memory_ele *)slab_alloc(&que->alloc);
+    assert(ele != NULL);
+
+    ele->offset = offset;
+    ele->length = length;
+    ele->prio = ele_tree_prio(que);
+    ele->left = NULL;
+    ele->right = NULL;
+
+    region->buffers = ele_tree_insert(region->buffers, ele);
+    region->num_buffers++;
+}
+
+
+/**
+ * @brief removes an element from the owned memory of a region and frees it
+ *
+ * @param que       the debug queue
+ * @param region    the region
+ * @param ele       the element to remove
+ */
+static void remove_buffer(struct cleanq_debugq *que, struct memory_list *region,
+                          struct memory_ele *ele)
+{
+    region->buffers = ele_tree_remove(region->buffers, ele);
+    region->num_buffers--;
+    slab_free(&que->alloc, ele);
+}
+
+
 // assumes that the buffer described by offset and length is contained
 // in the buffer that is given as a struct
 static void remove_split_buffer(struct cleanq_debugq *que, struct memory_list *region,
                                 struct memory_ele *buffer, genoffset_t offset, genoffset_t length)
 {
-    // split the buffer
-    // insert half before the buffer
-
     DEBUG("enqueue offset=%" PRIu64 " length=%" PRIu64 " buf->offset=%lu "
           "buf->length %lu \n",
           offset, length, buffer->offset, buffer->length);
 
-    // check if buffer at beginning of region
+    // the whole buffer
+    if (buffer->offset == offset && buffer->length == length) {
+        add_to_history(que, region->rid, offset, length, "enq remove");
+        DEBUG("enqueue remove buffer from tree\n");
+        remove_buffer(que, region, buffer);
+        return;
+    }
+
+    // check if buffer at beginning of the chunk
     if (buffer->offset == offset) {
         buffer->offset += length;
         buffer->length -= length;
 
-        if (buffer->length == 0) {
-#ifdef DQ_ENABLE_HIST
-            add_to_history(que, offset, length, "enq cut of beginning remove");
-#endif
-            DEBUG("enqueue remove buffer from list\n");
-            // remove
-            if (buffer->prev != NULL) {
-                buffer->prev->next = buffer->next;
-            } else {
-                region->buffers = buffer->next;
-            }
-
-            if (buffer->next != NULL) {
-                buffer->next->prev = buffer->prev;
-            }
-            slab_free(&que->alloc, buffer);
-        } else {
-#ifdef DQ_ENABLE_HIST
-            add_to_history(que, offset, length, "enq cut of beginning");
-#endif
-        }
-
+        add_to_history(que, region->rid, offset, length, "enq cut of beginning");
         DEBUG("enqueue first cut off begining results in offset=%" PRIu64 " "
               "length=%" PRIu64 "\n",
               buffer->offset, buffer->length);
         return;
     }
 
-    // check if buffer at end of region
+    // check if buffer at end of the chunk
     if ((buffer->offset + buffer->length) == (offset + length)) {
         buffer->length -= length;
 
-        if (buffer->length == 0) {
-#ifdef DQ_ENABLE_HIST
-            add_to_history(que, offset, length, "enq cut of end remove");
-#endif
-            // remove
-            if (buffer->prev != NULL) {
-                buffer->prev = buffer->next;
-            }
-
-            if (buffer->next != NULL) {
-                buffer->next->prev = buffer->prev;
-            }
-            slab_free(&que->alloc, buffer);
-        } else {
-#ifdef DQ_ENABLE_HIST
-            add_to_history(que, offset, length, "enq cut of end");
-#endif
-        }
-
+        add_to_history(que, region->rid, offset, length, "enq cut of end");
         DEBUG("enqueue first cut off end results in offset=%" PRIu64 " "
               "length=%" PRIu64 "\n",
               buffer->offset, buffer->length);
         return;
     }
 
-    // now if this did not work need to split buffer that contains the
-    // enqueued buffer into two buffers (might also result only in one)
-
-    // inset half before buffer
+    // the buffer is in the middle, split the chunk into two
     genoffset_t old_len = buffer->length;
-
     buffer->length = offset - buffer->offset;
+    add_buffer(que, region, offset + length, old_len - buffer->length - length);
+
+    add_to_history(que, region->rid, offset, length, "enq split buffer");
 
-    struct memory_ele *after = NULL;
-    after = (struct memory_ele *)slab_alloc(&que->alloc);
-    assert(after != NULL);
+    DEBUG("Split buffer length=%lu to "
+          "offset=%" PRIu64 " length=%" PRIu64 " and "
+          "offset=%lu length=%lu \n",
+          old_len, buffer->offset, buffer->length, offset + length,
+          old_len - buffer->length - length);
+}
 
-    memset(after, 0, sizeof(*after));
-    after->offset = buffer->offset + buffer->length + length;
-    after->length = old_len - buffer->length - length;
+/*
+ * Inserts a buffer into the owned memory of the region, merging it with the neighbouring
+ * chunks if they are adjacent.
+ */
+static errval_t insert_merge_buffer(struct cleanq_debugq *que, struct memory_list *region,
+                                    genoffset_t offset, genoffset_t length)
+{
+    assert(region != NULL);
 
-    // insert after buffer
-    after->prev = buffer;
-    after->next = buffer->next;
+    struct memory_ele *prev = ele_tree_floor(region->buffers, offset);
+    struct memory_ele *next = ele_tree_above(region->buffers, offset);
 
-    if (buffer->next != NULL) {
-        buffer->next->prev = after;
+    // we must not own any part of the buffer already
+    if ((prev != NULL && prev->offset + prev->length > offset)
+        || (next != NULL && next->offset < offset + length)) {
+        return CLEANQ_ERR_BUFFER_NOT_IN_USE;
     }
 
-    buffer->next = after;
+    bool merge_prev = (prev != NULL && prev->offset + prev->length == offset);
+    bool merge_next = (next != NULL && next->offset == offset + length);
+
+    if (merge_prev && merge_next) {
+        prev->length += length + next->length;
+        remove_buffer(que, region, next);
+        add_to_history(que, region->rid, offset, length, "deq insert and merge both");
+    } else if (merge_prev) {
+        prev->length += length;
+        add_to_history(que, region->rid, offset, length, "deq insert after lower boundary");
+    } else if (merge_next) {
+        next->offset = offset;
+        next->length += length;
+        add_to_history(que, region->rid, offset, length, "deq insert before higher boundary");
+    } else {
+        add_buffer(que, region, offset, length);
+        add_to_history(que, region->rid, offset, length, "deq insert in between");
+    }
 
-#ifdef DQ_ENABLE_HIST
-    add_to_history(que, offset, length, "enq split buffer");
-#endif
+    DEBUG("dequeue inserted offset=%" PRIu64 " length=%" PRIu64 " chunks=%zu\n", offset, length,
+          region->num_buffers);
 
-    DEBUG("Split buffer length=%lu to "
-          "offset=%" PRIu64 " length=%" PRIu64 " and "
-          "offset=%lu length=%lu \n",
-          old_len, buffer->offset, buffer->length, after->offset, after->length);
+    return CLEANQ_ERR_OK;
 }
 
+
 /*
- * Inserts a buffer either before or after an existing buffer into the queue
- * Checks for merges of prev/next buffer in the queue
+ * ================================================================================================
+ * Region Table
+ * ================================================================================================
  */
-static void insert_merge_buffer(struct cleanq_debugq *que, struct memory_list *region,
-                                struct memory_ele *buffer, genoffset_t offset, genoffset_t length)
+
+
+static errval_t find_region(struct cleanq_debugq *que, struct memory_list **list, regionid_t rid)
 {
-    assert(buffer != NULL);
-    assert(region != NULL);
+    *list = region_table_lookup(&que->regions, rid);
+    if (*list == NULL) {
+        return CLEANQ_ERR_INVALID_REGION_ID;
+    }
 
-    if (offset >= buffer->offset + buffer->length) {  // insert after
-        // buffer is on lower boundary
-        //
-        if (buffer->offset + length == offset) {
-            buffer->length += length;
-            DEBUG("dequeue merge after "
-                  "offset=%" PRIu64 " length=%" PRIu64 " to offset=%" PRIu64 " "
-                  "length=%" PRIu64 "\n",
-                  offset, length, buffer->offset, buffer->length);
-            // check other boundary for merge
-            if (buffer->next != NULL && (buffer->offset + buffer->length == buffer->next->offset)) {
-                buffer->length += buffer->next->length;
-                struct memory_ele *next = buffer->next;
-                if (buffer->next->next != NULL) {
-                    buffer->next = buffer->next->next;
-                    buffer->next->next->prev = buffer;
-                }
-
-                DEBUG("dequeue merge after more offset=%" PRIu64 " "
-                      "length=%" PRIu64 " to offset=%" PRIu64 " length=%" PRIu64 " \n ",
-                      next->offset, next->length, buffer->offset, buffer->length);
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert after"
-                               " on lower boundary and merge");
-#endif
-                slab_free(&que->alloc, next);
-            } else {
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length, "deq insert after on lower boundary");
-#endif
-            }
-        } else {
-            // check higher boundary
-            if (buffer->next != NULL && buffer->next->offset == offset + length) {
-                buffer->next->offset = offset;
-                buffer->next->length += length;
-
-                DEBUG("dequeue merge after more offset=%" PRIu64 " "
-                      "length=%" PRIu64 " to offset=%" PRIu64 " length=%" PRIu64 " \n ",
-                      offset, length, buffer->next->offset, buffer->next->length);
-
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert after"
-                               " on higer boundary");
-#endif
-            } else {
-                // buffer->next can be null and the newly inserted buffer
-                // is the inserted at the end -> check boundary
-                if (buffer->next == NULL && buffer->offset + buffer->length == offset) {
-                    buffer->length += length;
-
-#ifdef DQ_ENABLE_HIST
-                    add_to_history(que, offset, length,
-                                   "deq insert after"
-                                   " on higer boundary end");
-#endif
-                    DEBUG("dequeue insert after merged offset=%" PRIu64 " "
-                          "length=%" PRIu64 " "
-                          "to offset=%" PRIu64 " length=%" PRIu64 " \n",
-                          offset, length, buffer->offset, buffer->length);
-                } else {
-                    // insert in between
-                    struct memory_ele *ele = (struct memory_ele *)slab_alloc(&que->alloc);
-                    assert(ele != NULL);
-
-                    ele->offset = offset;
-                    ele->length = length;
-                    ele->next = buffer->next;
-                    ele->prev = buffer;
-
-                    if (buffer->next != NULL) {
-                        buffer->next->prev = ele;
-                    }
-
-                    buffer->next = ele;
-
-#ifdef DQ_ENABLE_HIST
-                    add_to_history(que, offset, length,
-                                   "deq insert after"
-                                   " in between");
-#endif
-                    DEBUG("dequeue insert after offset=%" PRIu64 " length=%" PRIu64 " "
-                          "after offset=%" PRIu64 " length=%" PRIu64 " \n",
-                          offset, length, buffer->offset, buffer->length);
-                }
-            }
-        }
-    } else {  // insert before buffer
-        // buffer is on lower boundary
-        if (buffer->offset == offset + length) {
-            buffer->length += length;
-            buffer->offset = offset;
-
-            // check other boundary
-            if (buffer->prev != NULL
-                && (buffer->prev->offset + buffer->prev->length == buffer->offset)) {
-                struct memory_ele *prev = buffer->prev;
-                prev->length += buffer->length;
-                prev->next = buffer->next;
-
-                if (buffer->next != NULL) {
-                    buffer->next->prev = prev;
-                }
-
-                slab_free(&que->alloc, buffer);
-
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert buffer"
-                               " before lower boundary merge");
-#endif
-                DEBUG("dequeue merge before more offset=%" PRIu64 " "
-                      "length=%" PRIu64 " to offset=%" PRIu64 " length=%" PRIu64 " \n ",
-                      offset, length, prev->offset, prev->length);
-            } else {
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert buffer"
-                               " before lower boundary");
-#endif
-            }
-        } else {
-            // check lower boundary
-            if (buffer->prev != NULL && (buffer->prev->offset + buffer->prev->length == offset)) {
-                if (length == 0) {
-                    printf("Length is 0 \n");
-                    buffer->prev->length += 2048;
-                }
-
-                buffer->prev->length += length;
-
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert buffer"
-                               " before prev lower boundary merge");
-#endif
-                DEBUG("dequeue merge before more offset=%" PRIu64 " "
-                      "length=%" PRIu64 " to offset=%" PRIu64 " length=%" PRIu64 " \n ",
-                      offset, length, buffer->prev->offset, buffer->prev->length);
-            } else {  // insert in between
-
-                // insert in between
-                struct memory_ele *ele = (struct memory_ele *)slab_alloc(&que->alloc);
-                assert(ele != NULL);
-
-                memset(ele, 0, sizeof(*ele));
-                ele->offset = offset;
-                ele->length = length;
-                ele->next = buffer;
-                ele->prev = buffer->prev;
-
-                if (buffer->prev != NULL) {
-                    buffer->prev->next = ele;
-                } else {
-                    region->buffers = ele;
-                }
-
-                buffer->prev = ele;
-
-#ifdef DQ_ENABLE_HIST
-                add_to_history(que, offset, length,
-                               "deq insert buffer"
-                               " before in between");
-#endif
-                DEBUG("dequeue insert before offset=%" PRIu64 " length=%" PRIu64 " "
-                      "next is offset=%" PRIu64 " length=%" PRIu64 " \n",
-                      offset, length, buffer->offset, buffer->length);
-            }
-        }
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief adds a region to the tracked regions, owning the memory [0, length)
+ *
+ * @param que               the debug queue
+ * @param rid               the region id
+ * @param length            the length of the region
+ * @param not_consistent    the region has been registered by the other side
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t add_region(struct cleanq_debugq *que, regionid_t rid, genoffset_t length,
+                           bool not_consistent)
+{
+    struct memory_list *region = (struct memory_list *)slab_alloc(&que->alloc_list);
+    if (region == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    region->rid = rid;
+    region->length = length;
+    region->not_consistent = not_consistent;
+    region->num_buffers = 0;
+    region->buffers = NULL;
+
+    errval_t err = region_table_insert(&que->regions, rid, region);
+    if (err_is_fail(err)) {
+        slab_free(&que->alloc_list, region);
+        return err;
+    }
+
+    // add the whole regions as a buffer
+    add_buffer(que, region, 0, length);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Ownership Checks
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief finds the owned memory chunk containing a buffer
+ *
+ * @param que       the debug queue
+ * @param rid       the region id of the buffer
+ * @param offset    the offset of the buffer
+ * @param length    the length of the buffer
+ * @param region    returns the region of the buffer
+ * @param buffer    returns the chunk containing the buffer
+ *
+ * @returns error if we don't own the buffer or CLEANQ_ERR_OK on success
+ */
+static errval_t find_owned(struct cleanq_debugq *que, regionid_t rid, genoffset_t offset,
+                           genoffset_t length, struct memory_list **region,
+                           struct memory_ele **buffer)
+{
+    errval_t err;
+
+    err = find_region(que, region, rid);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    if ((*region)->buffers == NULL) {
+        return CLEANQ_ERR_BUFFER_ALREADY_IN_USE;
+    }
+
+    // the only chunk that can contain the buffer
+    *buffer = ele_tree_floor((*region)->buffers, offset);
+    if (*buffer != NULL
+        && buffer_in_bounds(offset, length, (*buffer)->offset, (*buffer)->length)) {
+        return CLEANQ_ERR_OK;
+    }
+
+    printf("Did not find region offset=%ld length=%ld \n", offset, length);
+    add_to_history(que, rid, offset, length, "enq not owned");
+    dump_list(*region);
+
+    return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+}
+
+
+/**
+ * @brief takes back the ownership of a dequeued buffer
+ *
+ * @param que       the debug queue
+ * @param rid       the region id of the buffer
+ * @param offset    the offset of the buffer
+ * @param length    the length of the buffer
+ *
+ * @returns error if we already own the buffer or CLEANQ_ERR_OK on success
+ */
+static errval_t track_dequeue(struct cleanq_debugq *que, regionid_t rid, genoffset_t offset,
+                              genoffset_t length)
+{
+    errval_t err;
+    struct memory_list *region = NULL;
+
+    err = find_region(que, &region, rid);
+    if (err_is_fail(err)) {
+        // region ids are checked bythe cleanq library, if we do not find
+        // the region id when dequeueing here we do not have a consistant
+        // view of two endpoints
+        //
+        // Add region, it is at least offset + length
+        printf("Adding region %u %lu len \n", rid, offset + length);
+        return add_region(que, rid, offset + length, true);
+    }
+
+    if (region->not_consistent) {
+        if ((offset + length) > region->length) {
+            region->length = offset + length;
+        }
+    }
+
+    err = insert_merge_buffer(que, region, offset, length);
+    if (err_is_fail(err)) {
+        add_to_history(que, rid, offset, length, "deq not in use");
+    }
+
+    return err;
+}
+
+
+/**
+ * @brief checks that we own the whole region
+ *
+ * @param que       the debug queue
+ * @param rid       the region id
+ * @param region    returns the region
+ *
+ * @returns error if buffers of the region are in use or CLEANQ_ERR_OK on success
+ */
+static errval_t check_region_owned(struct cleanq_debugq *que, regionid_t rid,
+                                   struct memory_list **region)
+{
+    errval_t err;
+
+    err = find_region(que, region, rid);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    // there should only be a single element in the tree
+    // i.e. the whole region
+    struct memory_ele *buffer = (*region)->buffers;
+    if ((*region)->num_buffers != 1 || buffer->offset != 0
+        || buffer->length != (*region)->length) {
+        DEBUG("Destroy error rid=%d chunks=%zu should be offset=0 length=%" PRIu64 "\n",
+              (*region)->rid, (*region)->num_buffers, (*region)->length);
+        dump_list(*region);
+        return CLEANQ_ERR_REGION_DESTROY;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes a region from the tracked regions
+ *
+ * @param que       the debug queue
+ * @param region    the region to remove
+ */
+static void remove_region(struct cleanq_debugq *que, struct memory_list *region)
+{
+    DEBUG("removed region rid=%" PRIu32 " size=%" PRIu64 " \n", region->rid, region->length);
+
+    region_table_remove(&que->regions, region->rid);
+    ele_tree_free(que, region->buffers);
+    slab_free(&que->alloc_list, region);
+}
+
+
+/*
+ * ================================================================================================
+ * Sampled Buffers
+ * ================================================================================================
+ */
+
+
+/*
+ * The sampled mode decides by the region id and the offset of a buffer if it is tracked. A
+ * buffer is either tracked from its enqueue to its dequeue or not at all, which keeps the state
+ * consistent without looking at the other buffers. The tracked buffers are kept in an open
+ * addressed table, which is kept at most half full.
+ */
+
+
+///< the initial size of the table of sampled buffers, must be a power of two
+#define INIT_SAMPLED_SIZE 64
+
+
+static inline uint64_t sampled_hash(regionid_t rid, genoffset_t offset)
+{
+    // the finalizer of MurmurHash3
+    uint64_t h = offset ^ ((uint64_t)rid << 40) ^ rid;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+static inline bool sampled_selected(struct cleanq_debugq *que, uint64_t hash)
+{
+    return (hash >> 32) < que->sample_threshold;
+}
+
+
+static struct sampled_buf *sampled_lookup(struct cleanq_debugq *que, uint64_t hash,
+                                          regionid_t rid, genoffset_t offset)
+{
+    size_t mask = que->sampled_size - 1;
+    size_t index = hash & mask;
+    while (que->sampled[index].used) {
+        struct sampled_buf *buf = &que->sampled[index];
+        if (buf->rid == rid && buf->offset == offset) {
+            return buf;
+        }
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+
+static void sampled_table_insert(struct sampled_buf *table, size_t size, struct sampled_buf *buf)
+{
+    size_t mask = size - 1;
+    size_t index = sampled_hash(buf->rid, buf->offset) & mask;
+    while (table[index].used) {
+        index = (index + 1) & mask;
+    }
+
+    table[index] = *buf;
+    table[index].used = 1;
+}
+
+
+static errval_t sampled_insert(struct cleanq_debugq *que, regionid_t rid, genoffset_t offset,
+                               genoffset_t length)
+{
+    if ((que->num_sampled + 1) * 2 > que->sampled_size) {
+        size_t size = que->sampled_size * 2;
+        struct sampled_buf *table = calloc(size, sizeof(struct sampled_buf));
+        if (table == NULL) {
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+
+        for (size_t i = 0; i < que->sampled_size; i++) {
+            if (que->sampled[i].used) {
+                sampled_table_insert(table, size, &que->sampled[i]);
+            }
+        }
+
+        free(que->sampled);
+        que->sampled = table;
+        que->sampled_size = size;
+    }
+
+    struct sampled_buf buf = {
+        .rid = rid,
+        .offset = offset,
+        .length = length,
+        .seq = que->seq,
+    };
+    sampled_table_insert(que->sampled, que->sampled_size, &buf);
+    que->num_sampled++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static void sampled_remove(struct cleanq_debugq *que, struct sampled_buf *buf)
+{
+    size_t mask = que->sampled_size - 1;
+    size_t hole = buf - que->sampled;
+
+    que->sampled[hole].used = 0;
+    que->num_sampled--;
+
+    // move back the following entries that can't be found anymore
+    size_t index = hole;
+    while (true) {
+        index = (index + 1) & mask;
+        struct sampled_buf *tmp = &que->sampled[index];
+        if (!tmp->used) {
+            break;
+        }
+
+        size_t home = sampled_hash(tmp->rid, tmp->offset) & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            que->sampled[hole] = *tmp;
+            tmp->used = 0;
+            hole = index;
+        }
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Operation Log
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief appends an operation to the log of the async mode, waits while the log is full
+ *
+ * @param que       the debug queue
+ * @param type      the type of the operation
+ * @param rid       the region id
+ * @param offset    the offset of the buffer
+ * @param length    the length of the buffer or the region
+ */
+static void log_append(struct cleanq_debugq *que, uint32_t type, regionid_t rid,
+                       genoffset_t offset, genoffset_t length)
+{
+    uint64_t head = que->log_head;
+    while (head - __atomic_load_n(&que->log_tail, __ATOMIC_ACQUIRE) == que->attr.log_size) {
+        sched_yield();
+    }
+
+    struct debug_op *op = &que->log[head & (que->attr.log_size - 1)];
+    op->type = type;
+    op->rid = rid;
+    op->offset = offset;
+    op->length = length;
+
+    __atomic_store_n(&que->log_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief checks an operation of the log
+ *
+ * @param que       the debug queue
+ * @param op        the operation
+ */
+static void log_check(struct cleanq_debugq *que, struct debug_op *op)
+{
+    errval_t err;
+    struct memory_list *region;
+    struct memory_ele *buffer;
+
+    switch (op->type) {
+    case DEBUG_OP_ENQ:
+        err = find_owned(que, op->rid, op->offset, op->length, &region, &buffer);
+        if (err_is_fail(err)) {
+            printf("DEBUGQ: enqueue of a buffer not owned rid=%u offset=%lu length=%lu\n",
+                   op->rid, op->offset, op->length);
+            report_error(que);
+            break;
+        }
+        remove_split_buffer(que, region, buffer, op->offset, op->length);
+        break;
+    case DEBUG_OP_DEQ:
+        err = track_dequeue(que, op->rid, op->offset, op->length);
+        if (err_is_fail(err)) {
+            printf("DEBUGQ: dequeue of a buffer already owned rid=%u offset=%lu length=%lu\n",
+                   op->rid, op->offset, op->length);
+            report_error(que);
+        }
+        break;
+    case DEBUG_OP_REG:
+        add_to_history(que, op->rid, 0, op->length, "register");
+        err = add_region(que, op->rid, op->length, false);
+        if (err_is_fail(err)) {
+            printf("DEBUGQ: could not track region rid=%u\n", op->rid);
+        }
+        break;
+    case DEBUG_OP_DEREG:
+        add_to_history(que, op->rid, 0, 0, "deregister");
+        err = check_region_owned(que, op->rid, &region);
+        if (err == CLEANQ_ERR_REGION_DESTROY) {
+            printf("DEBUGQ: deregistered region with buffers in use rid=%u\n", op->rid);
+            report_error(que);
+        }
+        // the region is gone in the queue below
+        if (err_is_ok(err) || err == CLEANQ_ERR_REGION_DESTROY) {
+            remove_region(que, region);
+        }
+        break;
+    default:
+        assert(!"unknown operation");
+    }
+}
+
+
+/**
+ * @brief the thread checking the log of the async mode
+ *
+ * @param arg       the debug queue
+ *
+ * @returns NULL
+ */
+static void *log_checker(void *arg)
+{
+    struct cleanq_debugq *que = arg;
+    uint32_t idle = 0;
+
+    while (true) {
+        uint64_t tail = que->log_tail;
+        uint64_t head = __atomic_load_n(&que->log_head, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            if (que->stop) {
+                break;
+            }
+
+            // nothing to do, back off to not take the core from the datapath
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                usleep(100);
+            }
+            continue;
+        }
+
+        idle = 0;
+        for (; tail != head; tail++) {
+            log_check(que, &que->log[tail & (que->attr.log_size - 1)]);
+        }
+
+        __atomic_store_n(&que->log_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * ================================================================================================
+ * Datapath functions
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Enqueue a descriptor (as seperate fields) into the descriptor queue
+ *
+ * @param q                     The descriptor queue
+ * @param region_id             Region id of the enqueued buffer
+ * @param offset                Offset into the region where the buffer resides
+ * @param length                Length of the buffer
+ * @param valid_data            Offset into the region where the valid data of the buffer resides
+ * @param valid_length          Length of the valid data of the buffer
+ * @param misc_flags            Miscellaneous flags
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_enqueue(struct cleanq *q, regionid_t rid, genoffset_t offset,
+                              genoffset_t length, genoffset_t valid_data, genoffset_t valid_length,
+                              uint64_t flags)
+{
+    assert(length > 0);
+    DEBUG("enqueue offset %" PRIu64 " \n", offset);
+    errval_t err;
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+
+    struct memory_list *region;
+    struct memory_ele *buffer;
+    err = find_owned(que, rid, offset, length, &region, &buffer);
+    if (err_is_fail(err)) {
+        report_error(que);
+        return err;
+    }
+
+    err = que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    remove_split_buffer(que, region, buffer, offset, length);
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a buffer from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_dequeue(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
+                              genoffset_t *length, genoffset_t *valid_data,
+                              genoffset_t *valid_length, uint64_t *flags)
+{
+    errval_t err;
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    assert(que->q->f.deq != NULL);
+    err = que->q->f.deq(que->q, rid, offset, length, valid_data, valid_length, flags);
+    if (err_is_fail(err)) {
+        return err;
+    }
+    DEBUG("dequeued offset=%lu \n", *offset);
+
+    err = track_dequeue(que, *rid, *offset, *length);
+    if (err_is_fail(err)) {
+        report_error(que);
+    }
+
+    return err;
+}
+
+
+/**
+ * @brief Enqueue a descriptor, checking only the sampled buffers
+ *
+ * @param q                     The descriptor queue
+ * @param region_id             Region id of the enqueued buffer
+ * @param offset                Offset into the region where the buffer resides
+ * @param length                Length of the buffer
+ * @param valid_data            Offset into the region where the valid data of the buffer resides
+ * @param valid_length          Length of the valid data of the buffer
+ * @param misc_flags            Miscellaneous flags
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_enqueue_sampled(struct cleanq *q, regionid_t rid, genoffset_t offset,
+                                      genoffset_t length, genoffset_t valid_data,
+                                      genoffset_t valid_length, uint64_t flags)
+{
+    errval_t err;
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+
+    que->seq++;
+
+    uint64_t hash = sampled_hash(rid, offset);
+    if (!sampled_selected(que, hash)) {
+        add_to_history(que, rid, offset, length, "enq");
+        return que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
+    }
+
+    if (sampled_lookup(que, hash, rid, offset) != NULL) {
+        printf("DEBUGQ: double enqueue of rid=%u offset=%lu length=%lu\n", rid, offset, length);
+        add_to_history(que, rid, offset, length, "enq sampled already in use");
+        report_error(que);
+        return CLEANQ_ERR_BUFFER_ALREADY_IN_USE;
+    }
+
+    err = que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    add_to_history(que, rid, offset, length, "enq sampled");
+
+    // failing to track the buffer only loses the sample
+    sampled_insert(que, rid, offset, length);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a buffer from the queue, checking only the sampled buffers
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_dequeue_sampled(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
+                                      genoffset_t *length, genoffset_t *valid_data,
+                                      genoffset_t *valid_length, uint64_t *flags)
+{
+    errval_t err;
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    err = que->q->f.deq(que->q, rid, offset, length, valid_data, valid_length, flags);
+    if (err_is_fail(err)) {
+        return err;
     }
-}
 
+    que->seq++;
 
-static errval_t find_region(struct cleanq_debugq *que, struct memory_list **list, regionid_t rid)
-{
-    // find region
-    struct memory_list *region = que->regions;
-
-    while (region != NULL) {
-        if (region->rid == rid) {
-            break;
-        }
-        region = region->next;
+    uint64_t hash = sampled_hash(*rid, *offset);
+    if (!sampled_selected(que, hash)) {
+        add_to_history(que, *rid, *offset, *length, "deq");
+        return CLEANQ_ERR_OK;
     }
 
-    // check if we found the region
-    if (region == NULL) {
-        return CLEANQ_ERR_INVALID_REGION_ID;
+    // buffers we have not enqueued may belong to the other side
+    struct sampled_buf *buf = sampled_lookup(que, hash, *rid, *offset);
+    if (buf != NULL) {
+        add_to_history(que, *rid, *offset, *length, "deq sampled");
+        sampled_remove(que, buf);
+    } else {
+        add_to_history(que, *rid, *offset, *length, "deq sampled not tracked");
     }
 
-    *list = region;
     return CLEANQ_ERR_OK;
 }
 
 
-/*
- * ================================================================================================
- * Datapath functions
- * ================================================================================================
- */
-
-
 /**
- * @brief Enqueue a descriptor (as seperate fields) into the descriptor queue
+ * @brief Enqueue a descriptor and log it for the checker thread
  *
  * @param q                     The descriptor queue
  * @param region_id             Region id of the enqueued buffer
@@ -541,81 +1298,26 @@ static errval_t find_region(struct cleanq_debugq *que, struct memory_list **list
  *
  * @returns error if queue is full or CLEANQ_ERR_OK on success
  */
-static errval_t debug_enqueue(struct cleanq *q, regionid_t rid, genoffset_t offset,
-                              genoffset_t length, genoffset_t valid_data, genoffset_t valid_length,
-                              uint64_t flags)
+static errval_t debug_enqueue_async(struct cleanq *q, regionid_t rid, genoffset_t offset,
+                                    genoffset_t length, genoffset_t valid_data,
+                                    genoffset_t valid_length, uint64_t flags)
 {
-    assert(length > 0);
-    DEBUG("enqueue offset %" PRIu64 " \n", offset);
     errval_t err;
     struct cleanq_debugq *que = (struct cleanq_debugq *)q;
 
-    // find region
-    struct memory_list *region = NULL;
-
-    err = find_region(que, &region, rid);
+    err = que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
     if (err_is_fail(err)) {
         return err;
     }
 
-    // check_consistency(region);
-
-    // find the buffer
-    struct memory_ele *buffer = region->buffers;
-
-    if (region->buffers == NULL) {
-        return CLEANQ_ERR_BUFFER_ALREADY_IN_USE;
-    }
-
-    // the only buffer
-    if (buffer->next == NULL) {
-        if (buffer_in_bounds(offset, length, buffer->offset, buffer->length)) {
-            err = que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
-            if (err_is_fail(err)) {
-                return err;
-            }
-
-            remove_split_buffer(que, region, buffer, offset, length);
-            return CLEANQ_ERR_OK;
-        } else {
-            printf("Bounds check failed only buffer offset=%lu length=%lu "
-                   " buf->offset=%lu buf->len=%lu\n",
-                   offset, length, buffer->offset, buffer->length);
-#ifdef DQ_ENABLE_HIST
-            dump_history(que);
-#endif
-            dump_list(region);
-            return CLEANQ_ERR_INVALID_BUFFER_ARGS;
-        }
-    }
-
+    log_append(que, DEBUG_OP_ENQ, rid, offset, length);
 
-    // more than one buffer
-    while (buffer != NULL) {
-        if (buffer_in_bounds(offset, length, buffer->offset, buffer->length)) {
-            err = que->q->f.enq(que->q, rid, offset, length, valid_data, valid_length, flags);
-            if (err_is_fail(err)) {
-                return err;
-            }
-
-            remove_split_buffer(que, region, buffer, offset, length);
-            return CLEANQ_ERR_OK;
-        }
-        buffer = buffer->next;
-    }
-
-    printf("Did not find region offset=%ld length=%ld \n", offset, length);
-#ifdef DQ_ENABLE_HIST
-    dump_history(que);
-#endif
-    dump_list(region);
-
-    return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    return CLEANQ_ERR_OK;
 }
 
 
 /**
- * @brief dequeue a buffer from the queue
+ * @brief dequeue a buffer from the queue and log it for the checker thread
  *
  * @param q             The queue to call the operation on
  * @param region_id     Return pointer to the id of the memory region the buffer belongs to
@@ -627,129 +1329,55 @@ static errval_t debug_enqueue(struct cleanq *q, regionid_t rid, genoffset_t offs
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
  */
-static errval_t debug_dequeue(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
-                              genoffset_t *length, genoffset_t *valid_data,
-                              genoffset_t *valid_length, uint64_t *flags)
+static errval_t debug_dequeue_async(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
+                                    genoffset_t *length, genoffset_t *valid_data,
+                                    genoffset_t *valid_length, uint64_t *flags)
 {
     errval_t err;
     struct cleanq_debugq *que = (struct cleanq_debugq *)q;
-    assert(que->q->f.deq != NULL);
     err = que->q->f.deq(que->q, rid, offset, length, valid_data, valid_length, flags);
     if (err_is_fail(err)) {
         return err;
     }
-    DEBUG("dequeued offset=%lu \n", *offset);
-
-    struct memory_list *region = NULL;
-
-    err = find_region(que, &region, *rid);
-    if (err_is_fail(err)) {
-        // region ids are checked bythe cleanq library, if we do not find
-        // the region id when dequeueing here we do not have a consistant
-        // view of two endpoints
-        //
-        // Add region
-        if (que->regions == NULL) {
-            printf("Adding region frirst %lu len \n", *offset + *length);
-
-            que->regions = (struct memory_list *)slab_alloc(&que->alloc_list);
-            assert(que->regions != NULL);
-
-            que->regions->rid = *rid;
-            que->regions->not_consistent = true;
-            // region is at least offset + length
-            que->regions->length = *offset + *length;
-            que->regions->next = NULL;
-            // add the whole regions as a buffer
-            que->regions->buffers = (struct memory_ele *)slab_alloc(&que->alloc);
-            assert(que->regions->buffers != NULL);
-
-            memset(que->regions->buffers, 0, sizeof(*que->regions->buffers));
-            que->regions->buffers->offset = 0;
-            que->regions->buffers->length = *offset + *length;
-            que->regions->buffers->next = NULL;
-            return CLEANQ_ERR_OK;
-        }
-
-        struct memory_list *ele = que->regions;
-        while (ele->next != NULL) {
-            ele = ele->next;
-        }
-
-        printf("Adding region second %lu len \n", *offset + *length);
-        // add the reigon
-        ele->next = (struct memory_list *)slab_alloc(&que->alloc_list);
-        assert(ele->next != NULL);
-
-        memset(que->regions->buffers, 0, sizeof(ele->next));
-        ele = ele->next;
-
-        ele->rid = *rid;
-        ele->next = NULL;
-        ele->not_consistent = true;
-        ele->length = *offset + *length;
-        // add the whole regions as a buffer
-        ele->buffers = (struct memory_ele *)slab_alloc(&que->alloc);
-        assert(ele->buffers != NULL);
-
-        memset(ele->buffers, 0, sizeof(*ele->buffers));
-        ele->buffers->offset = 0;
-        ele->buffers->length = *offset + *length;
-        ele->buffers->next = NULL;
-        return CLEANQ_ERR_OK;
-    }
-
-    if (region->not_consistent) {
-        if ((*offset + *length) > region->length) {
-            region->length = *offset + *length;
-        }
-    }
-
-    // check_consistency(region);
 
-    // find the buffer
-    struct memory_ele *buffer = region->buffers;
-    if (buffer == NULL) {
-        region->buffers = (struct memory_ele *)slab_alloc(&que->alloc);
-        assert(region->buffers != NULL);
+    log_append(que, DEBUG_OP_DEQ, *rid, *offset, *length);
 
-        region->buffers->offset = *offset;
-        region->buffers->length = *length;
-        region->buffers->next = NULL;
-        region->buffers->prev = NULL;
-        return CLEANQ_ERR_OK;
-    }
-
-    if (buffer->next == NULL) {
-        if (!buffer_in_bounds(*offset, *length, buffer->offset, buffer->length)) {
-            insert_merge_buffer(que, region, buffer, *offset, *length);
-            return CLEANQ_ERR_OK;
-        } else {
-            return CLEANQ_ERR_BUFFER_NOT_IN_USE;
-        }
-    }
+    return CLEANQ_ERR_OK;
+}
 
 
-    while (buffer->next != NULL) {
-        if (*offset >= buffer->offset) {
-            buffer = buffer->next;
-        } else {
-            if (!buffer_in_bounds(*offset, *length, buffer->offset, buffer->length)) {
-                insert_merge_buffer(que, region, buffer, *offset, *length);
-                return CLEANQ_ERR_OK;
-            } else {
-                return CLEANQ_ERR_BUFFER_NOT_IN_USE;
-            }
-        }
-    }
+/**
+ * @brief Enqueue a message with inline data into the underlying queue
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The data of the message
+ * @param len           The length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Inline messages don't carry buffers, there is nothing to check.
+ */
+static errval_t debug_enqueue_inline(struct cleanq *q, const void *data, size_t len)
+{
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    return que->q->f.enq_inline(que->q, data, len);
+}
 
-    // insert after the last buffer
-    if (!buffer_in_bounds(*offset, *length, buffer->offset, buffer->length)) {
-        insert_merge_buffer(que, region, buffer, *offset, *length);
-        return CLEANQ_ERR_OK;
-    }
 
-    return CLEANQ_ERR_BUFFER_NOT_IN_USE;
+/**
+ * @brief Dequeue a message with inline data from the underlying queue
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_dequeue_inline(struct cleanq *q, void *data, size_t size, size_t *len)
+{
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    return que->q->f.deq_inline(que->q, data, size, len);
 }
 
 
@@ -768,6 +1396,41 @@ static errval_t debug_notify(struct cleanq *q)
 }
 
 
+/**
+ * @brief Waits until there is something to dequeue on the underlying queue
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ */
+static errval_t debug_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    return cleanq_wait(que->q, timeout_us);
+}
+
+
+/**
+ * @brief Sets the doorbell of the underlying queue
+ *
+ * @param q         The queue to call the operation on
+ * @param name      The name of the doorbell object, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t debug_doorbell(struct cleanq *q, const char *name, uint32_t bit)
+{
+    struct cleanq_debugq *que = (struct cleanq_debugq *)q;
+    if (que->q->f.doorbell == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+    return que->q->f.doorbell(que->q, name, bit);
+}
+
+
 /*
  * ================================================================================================
  * Control Path
@@ -815,61 +1478,30 @@ static errval_t debug_register(struct cleanq *q, struct capref cap, regionid_t r
     struct cleanq_debugq *que = (struct cleanq_debugq *)q;
     DEBUG("Register \n");
 
-    // queue of regions is empty
-    if (que->regions == NULL) {
-        // add the reigon
-        err = que->q->f.reg(que->q, cap, rid);
-        if (err_is_fail(err)) {
-            return err;
-        }
-
-        que->regions = (struct memory_list *)slab_alloc(&que->alloc_list);
-        assert(que->regions != NULL);
-
-        que->regions->rid = rid;
-        que->regions->length = cap.len;
-        que->regions->not_consistent = false;
-        que->regions->next = NULL;
-        // add the whole regions as a buffer
-        que->regions->buffers = (struct memory_ele *)slab_alloc(&que->alloc);
-        assert(que->regions->buffers != NULL);
-
-        memset(que->regions->buffers, 0, sizeof(*que->regions->buffers));
-        que->regions->buffers->offset = 0;
-        que->regions->buffers->length = cap.len;
-        que->regions->buffers->next = NULL;
-        DEBUG("Register rid=%" PRIu32 " size=%" PRIu64 " \n", rid, id.bytes);
-        return CLEANQ_ERR_OK;
+    err = que->q->f.reg(que->q, cap, rid);
+    if (err_is_fail(err)) {
+        return err;
     }
 
-    struct memory_list *ele = que->regions;
-    while (ele->next != NULL) {
-        ele = ele->next;
+    // with the async mode, only the checker thread writes the history
+    switch (que->attr.mode) {
+    case CLEANQ_DEBUGQ_CHECK_ALL:
+        add_to_history(que, rid, 0, cap.len, "register");
+        err = add_region(que, rid, cap.len, false);
+        break;
+    case CLEANQ_DEBUGQ_CHECK_ASYNC:
+        log_append(que, DEBUG_OP_REG, rid, 0, cap.len);
+        break;
+    default:
+        add_to_history(que, rid, 0, cap.len, "register");
+        break;
     }
 
-    err = que->q->f.reg(que->q, cap, rid);
     if (err_is_fail(err)) {
         return err;
     }
 
-    // add the reigon
-    ele->next = (struct memory_list *)slab_alloc(&que->alloc_list);
-    assert(ele->next != NULL);
-
-    ele = ele->next;
-    ele->rid = rid;
-    ele->next = NULL;
-    ele->length = cap.len;
-    ele->not_consistent = false;
-    // add the whole regions as a buffer
-    ele->buffers = (struct memory_ele *)slab_alloc(&que->alloc);
-    assert(ele->buffers != NULL);
-
-    memset(ele->buffers, 0, sizeof(*ele->buffers));
-    ele->buffers->offset = 0;
-    ele->buffers->length = cap.len;
-    ele->buffers->next = NULL;
-    DEBUG("Register rid=%" PRIu32 " size=%" PRIu64 " \n", rid, id.bytes);
+    DEBUG("Register rid=%" PRIu32 " size=%" PRIu64 " \n", rid, cap.len);
 
     return CLEANQ_ERR_OK;
 }
@@ -890,72 +1522,39 @@ static errval_t debug_deregister(struct cleanq *q, regionid_t rid)
     struct cleanq_debugq *que = (struct cleanq_debugq *)q;
     errval_t err;
 
-    struct memory_list *ele = que->regions;
-    if (ele == NULL) {
-        return CLEANQ_ERR_INVALID_REGION_ID;
-    }
-
-    // remove head
-    if (ele->rid == rid) {
-        // there should only be a single element in the list
-        // i.e. the whole region
-        if (ele->buffers->offset == 0 && ele->buffers->length == ele->length
-            && ele->buffers->next == NULL) {
-            err = que->q->f.dereg(que->q, rid);
-            if (err_is_fail(err)) {
-                return err;
+    struct memory_list *region = NULL;
+    if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_ALL) {
+        err = check_region_owned(que, rid, &region);
+        if (err_is_fail(err)) {
+            return err;
+        }
+    } else if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_SAMPLED) {
+        for (size_t i = 0; i < que->sampled_size; i++) {
+            if (que->sampled[i].used && que->sampled[i].rid == rid) {
+                printf("DEBUGQ: deregistering region with buffers in use rid=%u\n", rid);
+                report_error(que);
+                return CLEANQ_ERR_REGION_DESTROY;
             }
-            que->regions = ele->next;
-
-            DEBUG("removed region rid=%" PRIu32 " size=%" PRIu64 " \n", rid, ele->length);
-
-            slab_free(&que->alloc, ele->buffers);
-            slab_free(&que->alloc_list, ele);
-
-            return CLEANQ_ERR_OK;
-        } else {
-            DEBUG("Destroy error rid=%d offset=%" PRIu64 " length=%" PRIu64 " "
-                  "should be offset=0 length=%" PRIu64 "\n",
-                  ele->rid, ele->buffers->offset, ele->buffers->length, ele->length);
-            dump_list(ele);
-            return CLEANQ_ERR_REGION_DESTROY;
         }
     }
 
-    while (ele->next != NULL) {
-        if (ele->next->rid == rid) {
-            if (ele->next->buffers->offset == 0 && ele->next->buffers->length == ele->next->length
-                && ele->next->buffers->next == NULL) {
-                err = que->q->f.dereg(que->q, rid);
-                if (err_is_fail(err)) {
-                    return err;
-                }
-                // remove from queue
-                struct memory_list *next = ele->next;
-                ele->next = ele->next->next;
-
-                DEBUG("removed region rid=%" PRIu32 " size=%" PRIu64 " \n", rid, next->length);
+    err = que->q->f.dereg(que->q, rid);
+    if (err_is_fail(err)) {
+        return err;
+    }
 
-                slab_free(&que->alloc, next->buffers);
-                slab_free(&que->alloc_list, next);
+    if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_ASYNC) {
+        log_append(que, DEBUG_OP_DEREG, rid, 0, 0);
+        return CLEANQ_ERR_OK;
+    }
 
-                return CLEANQ_ERR_OK;
-            } else {
-                DEBUG("Destroy error rid=%d offset=%" PRIu64 " length=%" PRIu64 " "
-                      "should be offset=0 length=%" PRIu64 "\n",
-                      ele->next->rid, ele->next->buffers->offset, ele->next->buffers->length,
-                      ele->next->length);
+    add_to_history(que, rid, 0, 0, "deregister");
 
-                dump_list(ele);
-                return CLEANQ_ERR_REGION_DESTROY;
-            }
-        } else {
-            ele = ele->next;
-        }
+    if (region != NULL) {
+        remove_region(que, region);
     }
 
-
-    return CLEANQ_ERR_INVALID_REGION_ID;
+    return CLEANQ_ERR_OK;
 }
 
 
@@ -975,46 +1574,179 @@ static errval_t debug_deregister(struct cleanq *q, regionid_t rid)
  */
 static errval_t debug_destroy(struct cleanq *cleanq)
 {
-    (void)(cleanq);
-    // TODO cleanup
+    struct cleanq_debugq *que = (struct cleanq_debugq *)cleanq;
+
+    if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_ASYNC) {
+        que->stop = true;
+        pthread_join(que->checker, NULL);
+        free(que->log);
+    }
+
+    for (uint32_t i = 0; i < que->regions.size; i++) {
+        struct memory_list *region = que->regions.slots[i].value;
+        if (region != NULL) {
+            ele_tree_free(que, region->buffers);
+        }
+    }
+
+    slab_destroy(&que->alloc);
+    slab_destroy(&que->alloc_list);
+    region_table_destroy(&que->regions);
+    free(que->sampled);
+    free(que);
+
     return CLEANQ_ERR_OK;
 }
 
+
 /**
- * @brief initialized a the IPCQ backend
+ * @brief creates a debug queue as a wrapper around another
  *
- * @param q         Return pointer to the descriptor queue
- * @param name      Name of the memory use for sending messages
- * @param clear     Write 0 to memory
+ * @param q         the created debug queue
+ * @param other_q   the other queue to be wrapped
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
  */
 errval_t cleanq_debugq_create(struct cleanq_debugq **q, struct cleanq *other_q)
+{
+    return cleanq_debugq_create_with_attr(q, other_q, NULL);
+}
+
+
+/**
+ * @brief creates a debug queue with the given attributes as a wrapper around another
+ *
+ * @param q         the created debug queue
+ * @param other_q   the other queue to be wrapped
+ * @param attr      the attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_debugq_create_with_attr(struct cleanq_debugq **q, struct cleanq *other_q,
+                                        const struct cleanq_debugq_attr *attr)
 {
     errval_t err;
     struct cleanq_debugq *que;
-    que = (struct cleanq_debugq *)calloc(1, sizeof(struct cleanq_debugq));
-    assert(que);
+    que = (struct cleanq_debugq *)aligned_alloc(64, sizeof(struct cleanq_debugq));
+    if (que == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+    memset(que, 0, sizeof(*que));
+
+    if (attr) {
+        que->attr = *attr;
+    }
+
+    switch (que->attr.mode) {
+    case CLEANQ_DEBUGQ_CHECK_ALL:
+        break;
+    case CLEANQ_DEBUGQ_CHECK_SAMPLED:
+        if (que->attr.sample_fraction > 0 && que->attr.sample_fraction < 1) {
+            que->sample_threshold = (uint64_t)(que->attr.sample_fraction * (1UL << 32));
+        } else if (que->attr.sample_period > 1) {
+            que->sample_threshold = (1UL << 32) / que->attr.sample_period;
+        } else {
+            que->sample_threshold = 1UL << 32;
+        }
+        break;
+    case CLEANQ_DEBUGQ_CHECK_ASYNC:
+        if (que->attr.log_size == 0) {
+            que->attr.log_size = DEFAULT_LOG_SIZE;
+        }
+        if (que->attr.log_size & (que->attr.log_size - 1)) {
+            free(que);
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+        break;
+    default:
+        free(que);
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    if (err_is_fail(region_table_init(&que->regions, INIT_REGION_TABLE_SIZE))) {
+        free(que);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_SAMPLED) {
+        que->sampled_size = INIT_SAMPLED_SIZE;
+        que->sampled = calloc(que->sampled_size, sizeof(struct sampled_buf));
+        if (que->sampled == NULL) {
+            err = CLEANQ_ERR_MALLOC_FAIL;
+            goto cleanup1;
+        }
+    }
+
+    que->prio_state = 2463534242U;
 
-    slab_init(&que->alloc, sizeof(struct memory_ele), slab_default_refill);
+    // all fields of the elements are set when they are added
+    slab_init_with_flags(&que->alloc, sizeof(struct memory_ele), slab_default_refill,
+                         SLAB_FLAG_NO_ZERO);
 
-    slab_init(&que->alloc_list, sizeof(struct memory_list), slab_default_refill);
+    slab_init_with_flags(&que->alloc_list, sizeof(struct memory_list), slab_default_refill,
+                         SLAB_FLAG_NO_ZERO);
 
     que->q = other_q;
     err = cleanq_init(&que->my_q);
     if (err_is_fail(err)) {
-        return err;
+        goto cleanup2;
     }
 
     que->my_q.f.reg = debug_register;
     que->my_q.f.dereg = debug_deregister;
     que->my_q.f.ctrl = debug_control;
     que->my_q.f.notify = debug_notify;
-    que->my_q.f.enq = debug_enqueue;
-    que->my_q.f.deq = debug_dequeue;
+    que->my_q.f.wait = debug_wait;
+    que->my_q.f.doorbell = debug_doorbell;
     que->my_q.f.destroy = debug_destroy;
+
+    /* inline data does not need checking, it is only available if the other queue has it */
+    if (other_q->f.enq_inline && other_q->f.deq_inline) {
+        que->my_q.f.enq_inline = debug_enqueue_inline;
+        que->my_q.f.deq_inline = debug_dequeue_inline;
+    }
+
+    switch (que->attr.mode) {
+    case CLEANQ_DEBUGQ_CHECK_SAMPLED:
+        que->my_q.f.enq = debug_enqueue_sampled;
+        que->my_q.f.deq = debug_dequeue_sampled;
+        break;
+    case CLEANQ_DEBUGQ_CHECK_ASYNC:
+        que->my_q.f.enq = debug_enqueue_async;
+        que->my_q.f.deq = debug_dequeue_async;
+        break;
+    default:
+        que->my_q.f.enq = debug_enqueue;
+        que->my_q.f.deq = debug_dequeue;
+        break;
+    }
+
+    if (que->attr.mode == CLEANQ_DEBUGQ_CHECK_ASYNC) {
+        que->log = malloc(que->attr.log_size * sizeof(struct debug_op));
+        if (que->log == NULL) {
+            err = CLEANQ_ERR_MALLOC_FAIL;
+            goto cleanup2;
+        }
+
+        if (pthread_create(&que->checker, NULL, log_checker, que)) {
+            free(que->log);
+            err = CLEANQ_ERR_INIT_QUEUE;
+            goto cleanup2;
+        }
+    }
+
     *q = que;
     return CLEANQ_ERR_OK;
+
+cleanup2:
+    slab_destroy(&que->alloc);
+    slab_destroy(&que->alloc_list);
+cleanup1:
+    free(que->sampled);
+    region_table_destroy(&que->regions);
+    free(que);
+
+    return err;
 }
 
 
@@ -1037,9 +1769,12 @@ void cleanq_debugq_dump_region(struct cleanq_debugq *que, regionid_t rid)
     // find region
     struct memory_list *region = NULL;
 
+    cleanq_debugq_sync(que);
+
     err = find_region(que, &region, rid);
     if (err_is_fail(err)) {
         printf("did not find region to dump\n");
+        return;
     }
 
     dump_list(region);
@@ -1055,10 +1790,63 @@ void cleanq_debugq_dump_region(struct cleanq_debugq *que, regionid_t rid)
  */
 void cleanq_debugq_dump_history(struct cleanq_debugq *q)
 {
-    (void)(q);
-#ifdef DQ_ENABLE_HIST
+    cleanq_debugq_sync(q);
     dump_history(q);
-#endif
+}
+
+
+/**
+ * @brief obtains the number of ownership violations detected so far
+ *
+ * @param q     the debug queue
+ *
+ * @returns the number of violations
+ */
+uint64_t cleanq_debugq_get_errors(struct cleanq_debugq *q)
+{
+    return q->errors;
+}
+
+
+/**
+ * @brief waits until the async checker has processed all logged operations
+ *
+ * @param q     the debug queue
+ */
+void cleanq_debugq_sync(struct cleanq_debugq *q)
+{
+    if (q->attr.mode != CLEANQ_DEBUGQ_CHECK_ASYNC) {
+        return;
+    }
+
+    uint64_t head = q->log_head;
+    while (__atomic_load_n(&q->log_tail, __ATOMIC_ACQUIRE) != head) {
+        sched_yield();
+    }
+}
+
+
+/**
+ * @brief reports the sampled buffers that have been enqueued a long time ago
+ *
+ * @param q         the debug queue
+ * @param max_age   the number of operations after which a buffer is considered lost
+ *
+ * @returns the number of buffers that are outstanding for more than max_age operations
+ */
+size_t cleanq_debugq_check_lost(struct cleanq_debugq *q, uint64_t max_age)
+{
+    size_t lost = 0;
+    for (size_t i = 0; i < q->sampled_size; i++) {
+        struct sampled_buf *buf = &q->sampled[i];
+        if (buf->used && q->seq - buf->seq > max_age) {
+            printf("DEBUGQ: buffer rid=%u offset=%lu length=%lu outstanding for %lu ops\n",
+                   buf->rid, buf->offset, buf->length, q->seq - buf->seq);
+            lost++;
+        }
+    }
+
+    return lost;
 }
 
 
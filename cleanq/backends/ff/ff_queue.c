@@ -21,10 +21,11 @@
 
 #include <cleanq/cleanq.h>
 #include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ff_queue_fast.h>
+#include <cleanq/backends/ffq_impl.h>
 #include <cleanq_backend.h>
-
-
-#include "ffq_impl.h"
+#include <cleanq_shm.h>
+#include <cleanq_memfd.h>
 
 
 /*
@@ -59,11 +60,48 @@ extern char *__progname;
 ///< this is the default size of the one-directional queue in message slots
 #define FFQ_DEFAULT_SIZE 64
 
-///< the size of a FFQ one-directional channel
-#define FFQ_CHAN_SIZE (FFQ_DEFAULT_SIZE * FFQ_MSG_BYTES)
+/*
+ * Shared Memory Layout
+ * --------------------
+ *
+ *  +--------+-------+----------------------+-------+----------------------+
+ *  | header | ctrl0 | message slots chan 0 | ctrl1 | message slots chan 1 |
+ *  +--------+-------+----------------------+-------+----------------------+
+ *
+ * The creator receives on channel 0 and transmits on channel 1. The control line of a channel
+ * is written by the receiver of that channel and holds the futex word it sleeps on as well as the
+ * doorbell of the pollset it may be part of. The
+ * geometry and the slot format are stored in the header, the attaching side uses those values.
+ * The header area also holds the statistics of both endpoints, see cleanq/stats.h, and the
+ * command channels, see cleanq_shm.h. Registering and deregistering regions does not take slots
+ * of the channels, the flags word of a message only ever holds the flags of the buffer.
+ *
+ * With the compact format, slots are 32 bytes with 32-bit words and two of them share a cache
+ * line. Messages whose fields do not fit in 32 bits take two consecutive slots. The second slot
+ * holds the upper halves of the fields.
+ *
+ * Inline messages carry their data in the slots instead of a buffer. The first word of the first
+ * slot holds the length with FFQ_SLOT_INLINE set, which no region id has, the other seven words
+ * hold data. Each following slot holds seven words of data as well, its first word is set to a
+ * non-empty marker before the barrier. The first slot publishes the message. Compact queues have
+ * no inline messages.
+ */
 
-///< the total size of the bi-directional FFQ
-#define FFQ_MEM_SIZE (2 * FFQ_CHAN_SIZE)
+
+///< the control line at the start of each channel
+union __attribute__((aligned(FFQ_MSG_ALIGNMENT))) ffq_chan_ctrl
+{
+    struct {
+        ///< futex word, set while the receiver of the channel sleeps
+        volatile uint32_t waiters;
+
+        ///< the doorbell the sender rings on a notification
+        struct cleanq_shm_doorbell doorbell;
+    };
+
+    ///< padding to a full cache line
+    uint8_t pad[FFQ_MSG_ALIGNMENT];
+};
 
 
 ///< defines a FFQ CleanQ backend
@@ -78,57 +116,144 @@ struct cleanq_ffq
     ///< receive FFQ channel
     struct ffq_chan rxq;
 
-    ///< name of the queue
-    char *name;
+    ///< control line of the transmit channel
+    union ffq_chan_ctrl *tx_ctrl;
+
+    ///< control line of the receive channel
+    union ffq_chan_ctrl *rx_ctrl;
+
+    ///< the maximum length of an inline message
+    size_t inline_max;
 
-    ///< backing memory for descriptors
-    void *rxtx_mem;
+    ///< the number of microseconds to spin in ff_wait() before sleeping
+    uint64_t wait_spin_us;
 
-    ///< size of the backing memory
-    size_t memsize;
+    ///< the doorbell of the other side
+    struct cleanq_shm_doorbell_state doorbell;
+
+    ///< backing shared memory for descriptors
+    struct cleanq_shm shm;
 };
 
 
 /*
  * ================================================================================================
- * Special Command Messages
+ * Statistics
  * ================================================================================================
  */
 
-#define FFQ_CMD_REGISTER 1
-#define FFQ_CMD_DEREGISTER 2
 
-static errval_t handle_register_command(struct cleanq_ffq *q, struct capref cap, uint32_t rid)
+/**
+ * @brief samples the occupancy of the transmit channel once per round through the ring
+ *
+ * @param q         the FFQ
+ * @param oldpos    the position before the enqueue
+ * @param sent      the number of slots that have been sent
+ */
+static inline void ff_stats_sent(struct cleanq_ffq *q, ffq_idx_t oldpos, size_t sent)
 {
-    errval_t err;
-    err = cleanq_add_region((struct cleanq *)q, cap, rid);
-    if (err_is_fail(err)) {
-        return err;
+    if (sent == 0) {
+        cleanq_stats_occupancy(&q->q, q->txq.size);
+    } else if (q->txq.pos <= oldpos) {
+        cleanq_stats_occupancy(&q->q, ffq_impl_tx_occupancy(&q->txq));
     }
+}
+
+
+/*
+ * ================================================================================================
+ * Inline Messages
+ * ================================================================================================
+ */
+
 
-    if (q->q.callbacks.reg) {
-        return q->q.callbacks.reg(&q->q, cap, rid);
+///< the number of data bytes in the first slot of an inline message
+#define FFQ_INLINE_FIRST_BYTES (7 * sizeof(ffq_payload_t))
+
+///< the number of data bytes in the following slots of an inline message
+#define FFQ_INLINE_NEXT_BYTES (7 * sizeof(ffq_payload_t))
+
+///< the first word of the following slots of an inline message
+#define FFQ_INLINE_NEXT_MARKER 0
+
+
+/**
+ * @brief returns the number of slots an inline message occupies
+ *
+ * @param len   the length of the message
+ *
+ * @returns the number of slots
+ */
+static inline size_t ff_inline_slots(size_t len)
+{
+    if (len <= FFQ_INLINE_FIRST_BYTES) {
+        return 1;
     }
 
-    return CLEANQ_ERR_OK;
+    return 1 + (len - FFQ_INLINE_FIRST_BYTES + FFQ_INLINE_NEXT_BYTES - 1) / FFQ_INLINE_NEXT_BYTES;
+}
+
+
+/**
+ * @brief checks if the next message of the receive channel is an inline message
+ *
+ * @param rxq   the receive channel
+ *
+ * @returns TRUE if there is a message and it carries inline data
+ */
+static inline bool ff_inline_pending(struct ffq_chan *rxq)
+{
+    return ffq_impl_can_recv(rxq) && ffq_impl_slot_is_inline(ffq_impl_get_slot(rxq));
 }
 
-static errval_t handle_deregister_command(struct cleanq_ffq *q, regionid_t rid)
+
+/**
+ * @brief copies data into the words of a slot
+ *
+ * @param s         the slot
+ * @param words     the indices of the words to use
+ * @param data      the data
+ * @param len       the number of bytes to copy, at most 8 per word
+ */
+static inline void ff_inline_copy_to(volatile struct ffq_slot *s, const uint8_t *words,
+                                     const uint8_t *data, size_t len)
 {
-    errval_t err;
-    err = cleanq_remove_region((struct cleanq *)q, rid);
-    if (err_is_fail(err)) {
-        return err;
+    for (size_t i = 0; len; i++) {
+        ffq_payload_t w = 0;
+        size_t n = len < sizeof(w) ? len : sizeof(w);
+        memcpy(&w, data, n);
+        s->data[words[i]] = w;
+        data += n;
+        len -= n;
     }
+}
 
-    if (q->q.callbacks.dereg) {
-        return q->q.callbacks.dereg(&q->q, rid);
-    }
 
-    return CLEANQ_ERR_OK;
+/**
+ * @brief copies data out of the words of a slot
+ *
+ * @param s         the slot
+ * @param words     the indices of the words to use
+ * @param data      the buffer to copy the data into
+ * @param len       the number of bytes to copy, at most 8 per word
+ */
+static inline void ff_inline_copy_from(volatile struct ffq_slot *s, const uint8_t *words,
+                                       uint8_t *data, size_t len)
+{
+    for (size_t i = 0; len; i++) {
+        ffq_payload_t w = s->data[words[i]];
+        size_t n = len < sizeof(w) ? len : sizeof(w);
+        memcpy(data, &w, n);
+        data += n;
+        len -= n;
+    }
 }
 
 
+///< the data words of the slots of an inline message, the first word publishes the slot
+static const uint8_t ff_inline_words[] = { 1, 2, 3, 4, 5, 6, 7 };
+
+
 /*
  * ================================================================================================
  * Datapath functions
@@ -154,8 +279,10 @@ static errval_t ff_enqueue(struct cleanq *queue, regionid_t region_id, genoffset
                            uint64_t misc_flags)
 {
     struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    ffq_idx_t oldpos = q->txq.pos;
     bool sent = ffq_impl_send(&q->txq, region_id, offset, length, valid_data, valid_length,
                               misc_flags);
+    ff_stats_sent(q, oldpos, sent);
     return sent ? CLEANQ_ERR_OK : CLEANQ_ERR_QUEUE_FULL;
 }
 
@@ -177,39 +304,709 @@ static errval_t ff_dequeue(struct cleanq *queue, regionid_t *region_id, genoffse
                            genoffset_t *length, genoffset_t *valid_data, genoffset_t *valid_length,
                            uint64_t *misc_flags)
 {
-    errval_t err;
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    errval_t err = CLEANQ_ERR_QUEUE_EMPTY;
+
+    uint64_t rid;
+    if (ff_inline_pending(&q->rxq)) {
+        /* inline messages are received with cleanq_dequeue_inline() */
+        err = CLEANQ_ERR_INLINE_PENDING;
+    } else if (ffq_impl_recv(&q->rxq, &rid, offset, length, valid_data, valid_length,
+                             misc_flags)) {
+        *region_id = (regionid_t)rid;
+        err = CLEANQ_ERR_OK;
+    }
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    return err;
+}
+
+
+/**
+ * @brief enqueue a batch of buffers into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if nothing could be enqueued, CLEANQ_ERR_OK otherwise
+ *
+ * The payload of all slots is written first, then a single barrier is issued before the first
+ * words of the slots are set to publish the messages.
+ */
+static errval_t ff_enqueue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                 size_t *num_enq)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *txq = &q->txq;
+
+    if (num > txq->size) {
+        num = txq->size;
+    }
+
+    /* write the data words of all free slots */
+    size_t count;
+    for (count = 0; count < num; count++) {
+        volatile struct ffq_slot *s = ffq_impl_get_slot_at(txq, count);
+        if (s->data[0] != FFQ_SLOT_EMPTY) {
+            break;
+        }
+
+        s->data[1] = bufs[count].offset;
+        s->data[2] = bufs[count].length;
+        s->data[3] = bufs[count].valid_data;
+        s->data[4] = bufs[count].valid_length;
+        s->data[5] = bufs[count].flags;
+    }
+
+    *num_enq = count;
+    if (count == 0) {
+        ff_stats_sent(q, txq->pos, 0);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    /* insert memory barrier, once for the entire batch */
+    __sync_synchronize();
+
+    /* set the first words, signalling the new messages */
+    for (size_t i = 0; i < count; i++) {
+        ffq_impl_get_slot_at(txq, i)->data[0] = bufs[i].rid;
+    }
+
+    ffq_idx_t oldpos = txq->pos;
+    ffq_impl_advance(txq, count);
+    ff_stats_sent(q, oldpos, count);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a batch of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ *
+ * All slots are copied out before a single barrier, then the slots are released. With a
+ * release batch set via CLEANQ_CTRL_ACK_BATCH, releasing is deferred until enough slots are
+ * pending or the channel has been drained.
+ */
+static errval_t ff_dequeue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                 size_t *num_deq)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *rxq = &q->rxq;
+
+    size_t count = 0;
+    while (count < num) {
+        /* copy out the messages out of the slots */
+        size_t n;
+        size_t avail = rxq->size - ffq_impl_pending(rxq);
+        for (n = 0; n < num - count && n < avail; n++) {
+            volatile struct ffq_slot *s = ffq_impl_get_slot_at(rxq, n);
+            ffq_payload_t rid = s->data[0];
+            if (rid == FFQ_SLOT_EMPTY || ffq_impl_slot_is_inline(s)) {
+                break;
+            }
+
+            struct cleanq_buf *b = &bufs[count + n];
+            b->rid = (regionid_t)rid;
+            b->offset = s->data[1];
+            b->length = s->data[2];
+            b->valid_data = s->data[3];
+            b->valid_length = s->data[4];
+            b->flags = s->data[5];
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        /* the slots get released with a single barrier, possibly later */
+        ffq_impl_recv_advance(rxq, n);
+        count += n;
+    }
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    *num_deq = count;
+    if (count == 0) {
+        return ff_inline_pending(rxq) ? CLEANQ_ERR_INLINE_PENDING : CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
 
+/**
+ * @brief enqueue a message with inline data into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The data of the message
+ * @param len           The length of the data
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_enqueue_inline(struct cleanq *queue, const void *data, size_t len)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *txq = &q->txq;
+
+    if (len > q->inline_max) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* the receiver releases the slots in order, if the last one is free so are the others */
+    size_t n = ff_inline_slots(len);
+    if (ffq_impl_get_slot_at(txq, n - 1)->data[0] != FFQ_SLOT_EMPTY) {
+        ff_stats_sent(q, txq->pos, 0);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    const uint8_t *bytes = data;
+    size_t first = len < FFQ_INLINE_FIRST_BYTES ? len : FFQ_INLINE_FIRST_BYTES;
+
+    volatile struct ffq_slot *s = ffq_impl_get_slot(txq);
+    ff_inline_copy_to(s, ff_inline_words, bytes, first);
+
+    /* the following slots are published with the first one */
+    for (size_t i = 1, done = first; i < n; i++) {
+        volatile struct ffq_slot *x = ffq_impl_get_slot_at(txq, i);
+        size_t chunk = (len - done) < FFQ_INLINE_NEXT_BYTES ? (len - done) : FFQ_INLINE_NEXT_BYTES;
+        ff_inline_copy_to(x, ff_inline_words, bytes + done, chunk);
+        x->data[0] = FFQ_INLINE_NEXT_MARKER;
+        done += chunk;
+    }
+
+    /* insert memory barrier */
+    __sync_synchronize();
+
+    /* set the first word to the tagged length, signalling the new message */
+    s->data[0] = FFQ_SLOT_INLINE | len;
+
+    ffq_idx_t oldpos = txq->pos;
+    ffq_impl_advance(txq, n);
+    ff_stats_sent(q, oldpos, n);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a message with inline data from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_BUFFER_PENDING if the
+ *          next message is a buffer, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ff_dequeue_inline(struct cleanq *queue, void *data, size_t size, size_t *len)
+{
     struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *rxq = &q->rxq;
 
-    bool received = ffq_impl_recv(&q->rxq, (uint64_t *)region_id, offset, length, valid_data,
-                                  valid_length, misc_flags);
-    if (!received) {
+    if (!ffq_impl_can_recv(rxq)) {
+        cleanq_shm_cmd_poll(&q->shm);
         return CLEANQ_ERR_QUEUE_EMPTY;
     }
 
-    /* we don't support any flags for now */
-    if (*misc_flags == 0) {
-        return CLEANQ_ERR_OK;
+    volatile struct ffq_slot *s = ffq_impl_get_slot(rxq);
+    if (!ffq_impl_slot_is_inline(s)) {
+        return CLEANQ_ERR_BUFFER_PENDING;
     }
 
-    /* handle the case where the flags are register / deregister commands */
-    if (*misc_flags == FFQ_CMD_REGISTER) {
-        struct capref cap;
-        cap.len = (size_t)*length;
-        cap.vaddr = (void *)*offset;
-        cap.paddr = (uint64_t)*valid_data;
-        err = handle_register_command(q, cap, *region_id);
-    } else {
-        err = handle_deregister_command(q, *region_id);
+    size_t l = s->data[0] & ~FFQ_SLOT_INLINE;
+    if (l > size) {
+        *len = l;
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
     }
 
-    /* TODO: should reply to the other side that operatin has failed */
+    uint8_t *bytes = data;
+    size_t first = l < FFQ_INLINE_FIRST_BYTES ? l : FFQ_INLINE_FIRST_BYTES;
+    ff_inline_copy_from(s, ff_inline_words, bytes, first);
+
+    size_t n = ff_inline_slots(l);
+    for (size_t i = 1, done = first; i < n; i++) {
+        size_t chunk = (l - done) < FFQ_INLINE_NEXT_BYTES ? (l - done) : FFQ_INLINE_NEXT_BYTES;
+        ff_inline_copy_from(ffq_impl_get_slot_at(rxq, i), ff_inline_words, bytes + done, chunk);
+        done += chunk;
+    }
+
+    /* the slots get released with a single barrier, possibly later */
+    ffq_impl_recv_advance(rxq, n);
+
+    *len = l;
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Compact Datapath functions
+ * ================================================================================================
+ */
+
+
+///< compact layout only: word of the first slot marking that the next slot holds upper halves
+#define FFQ_COMPACT_WIDE_WORD 6
+
+
+/**
+ * @brief returns the number of compact slots a buffer occupies
+ *
+ * @param b     the buffer
+ *
+ * @returns 1 if all fields fit in 32 bits, 2 otherwise
+ */
+static inline size_t ff_compact_slots(struct cleanq_buf *b)
+{
+    return ((b->offset | b->length | b->valid_data | b->valid_length | b->flags) >> 32) ? 2 : 1;
+}
+
+
+/**
+ * @brief writes a buffer into compact slots, except for the first word
+ *
+ * @param txq   the transmit channel
+ * @param i     the distance of the first slot from the current position
+ * @param b     the buffer
+ *
+ * @returns the number of slots used
+ */
+static inline size_t ff_compact_write(struct ffq_chan *txq, size_t i, struct cleanq_buf *b)
+{
+    volatile struct ffq_slot_compact *s = (void *)ffq_impl_get_slot_at(txq, i);
+    s->data[1] = (uint32_t)b->offset;
+    s->data[2] = (uint32_t)b->length;
+    s->data[3] = (uint32_t)b->valid_data;
+    s->data[4] = (uint32_t)b->valid_length;
+    s->data[5] = (uint32_t)b->flags;
+
+    if (ff_compact_slots(b) == 1) {
+        s->data[FFQ_COMPACT_WIDE_WORD] = 0;
+        return 1;
+    }
+
+    /* the extension slot holds the upper halves, it is published with the first one */
+    volatile struct ffq_slot_compact *x = (void *)ffq_impl_get_slot_at(txq, i + 1);
+    x->data[0] = 0;
+    x->data[1] = (uint32_t)(b->offset >> 32);
+    x->data[2] = (uint32_t)(b->length >> 32);
+    x->data[3] = (uint32_t)(b->valid_data >> 32);
+    x->data[4] = (uint32_t)(b->valid_length >> 32);
+    x->data[5] = (uint32_t)(b->flags >> 32);
+
+    s->data[FFQ_COMPACT_WIDE_WORD] = 1;
+
+    return 2;
+}
+
+
+/**
+ * @brief reads a buffer from compact slots
+ *
+ * @param rxq   the receive channel
+ * @param i     the distance of the first slot from the current position
+ * @param b     returns the buffer
+ *
+ * @returns the number of slots used, 0 if the slot was empty
+ */
+static inline size_t ff_compact_read(struct ffq_chan *rxq, size_t i, struct cleanq_buf *b)
+{
+    volatile struct ffq_slot_compact *s = (void *)ffq_impl_get_slot_at(rxq, i);
+    uint32_t rid = s->data[0];
+    if (rid == FFQ_COMPACT_SLOT_EMPTY) {
+        return 0;
+    }
+
+    b->rid = rid;
+    b->offset = s->data[1];
+    b->length = s->data[2];
+    b->valid_data = s->data[3];
+    b->valid_length = s->data[4];
+    b->flags = s->data[5];
+
+    if (!s->data[FFQ_COMPACT_WIDE_WORD]) {
+        return 1;
+    }
+
+    volatile struct ffq_slot_compact *x = (void *)ffq_impl_get_slot_at(rxq, i + 1);
+    b->offset |= (genoffset_t)x->data[1] << 32;
+    b->length |= (genoffset_t)x->data[2] << 32;
+    b->valid_data |= (genoffset_t)x->data[3] << 32;
+    b->valid_length |= (genoffset_t)x->data[4] << 32;
+    b->flags |= (uint64_t)x->data[5] << 32;
+
+    return 2;
+}
+
+
+/**
+ * @brief enqueue a batch of buffers into a queue with compact slots
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if nothing could be enqueued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ff_enqueue_batch_compact(struct cleanq *queue, struct cleanq_buf *bufs,
+                                         size_t num, size_t *num_enq)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *txq = &q->txq;
+
+    /* write all but the first words of the free slots */
+    size_t count, used = 0;
+    for (count = 0; count < num; count++) {
+        size_t n = ff_compact_slots(&bufs[count]);
+        if (used + n > txq->size) {
+            break;
+        }
+
+        if (!ffq_impl_slot_is_empty(txq, ffq_impl_get_slot_at(txq, used))
+            || (n == 2 && !ffq_impl_slot_is_empty(txq, ffq_impl_get_slot_at(txq, used + 1)))) {
+            break;
+        }
+
+        assert(bufs[count].rid != FFQ_COMPACT_SLOT_EMPTY);
+        used += ff_compact_write(txq, used, &bufs[count]);
+    }
+
+    *num_enq = count;
+    if (count == 0) {
+        ff_stats_sent(q, txq->pos, 0);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    /* insert memory barrier, once for the entire batch */
+    __sync_synchronize();
+
+    /* set the first words, signalling the new messages */
+    used = 0;
+    for (size_t i = 0; i < count; i++) {
+        ((volatile struct ffq_slot_compact *)ffq_impl_get_slot_at(txq, used))->data[0] =
+            bufs[i].rid;
+        used += ff_compact_slots(&bufs[i]);
+    }
+
+    ffq_idx_t oldpos = txq->pos;
+    ffq_impl_advance(txq, used);
+    ff_stats_sent(q, oldpos, used);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a batch of buffers from a queue with compact slots
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ff_dequeue_batch_compact(struct cleanq *queue, struct cleanq_buf *bufs,
+                                         size_t num, size_t *num_deq)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *rxq = &q->rxq;
+
+    size_t count = 0;
+    while (count < num) {
+        /* copy out the messages out of the slots */
+        size_t avail = rxq->size - ffq_impl_pending(rxq);
+        size_t n, used = 0;
+        for (n = 0; n < num - count && used < avail; n++) {
+            size_t k = ff_compact_read(rxq, used, &bufs[count + n]);
+            if (k == 0) {
+                break;
+            }
+            used += k;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        /* the slots get released with a single barrier, possibly later */
+        ffq_impl_recv_advance(rxq, used);
+        count += n;
+    }
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    *num_deq = count;
+    return (count == 0) ? CLEANQ_ERR_QUEUE_EMPTY : CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief enqueue a buffer into a queue with compact slots
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Id of the memory region the buffer belongs to
+ * @param offset        Offset into the region i.e. where the buffer starts that is enqueued
+ * @param lenght        Lenght of the enqueued buffer
+ * @param valid_data    Offset into the buffer where the valid data of this buffer starts
+ * @param valid_length  Length of the valid data of this buffer
+ * @param misc_flags    Any other argument that makes sense to the queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_enqueue_compact(struct cleanq *queue, regionid_t region_id, genoffset_t offset,
+                                   genoffset_t length, genoffset_t valid_data,
+                                   genoffset_t valid_length, uint64_t misc_flags)
+{
+    struct cleanq_buf b = {
+        .offset = offset,
+        .length = length,
+        .valid_data = valid_data,
+        .valid_length = valid_length,
+        .flags = misc_flags,
+        .rid = region_id,
+    };
+
+    size_t n;
+    return ff_enqueue_batch_compact(queue, &b, 1, &n);
+}
+
+
+/**
+ * @brief dequeue a buffer from a queue with compact slots
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_dequeue_compact(struct cleanq *queue, regionid_t *region_id,
+                                   genoffset_t *offset, genoffset_t *length,
+                                   genoffset_t *valid_data, genoffset_t *valid_length,
+                                   uint64_t *misc_flags)
+{
+    struct cleanq_buf b;
+    size_t n;
+
+    errval_t err = ff_dequeue_batch_compact(queue, &b, 1, &n);
     if (err_is_fail(err)) {
-        printf("TODO: report failed outcome to other side\n");
+        return err;
     }
 
-    /* we handled the commands now retry to receive again */
-    return ff_dequeue(queue, region_id, offset, length, valid_data, valid_length, misc_flags);
+    *region_id = b.rid;
+    *offset = b.offset;
+    *length = b.length;
+    *valid_data = b.valid_data;
+    *valid_length = b.valid_length;
+    *misc_flags = b.flags;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Buffer Chains
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief writes the first word of a slot, this publishes the message
+ *
+ * @param txq   the transmit channel
+ * @param i     the distance of the slot from the current position
+ * @param rid   the region id of the buffer
+ */
+static inline void ff_chain_publish(struct ffq_chan *txq, size_t i, regionid_t rid)
+{
+    if (txq->compact) {
+        ((volatile struct ffq_slot_compact *)ffq_impl_get_slot_at(txq, i))->data[0] = rid;
+    } else {
+        ffq_impl_get_slot_at(txq, i)->data[0] = rid;
+    }
+}
+
+
+/**
+ * @brief reads a buffer from the slots of either format
+ *
+ * @param rxq   the receive channel
+ * @param i     the distance of the first slot from the current position
+ * @param b     returns the buffer
+ *
+ * @returns the number of slots used, 0 if the slot was empty or holds inline data
+ */
+static inline size_t ff_chain_read(struct ffq_chan *rxq, size_t i, struct cleanq_buf *b)
+{
+    if (rxq->compact) {
+        return ff_compact_read(rxq, i, b);
+    }
+
+    volatile struct ffq_slot *s = ffq_impl_get_slot_at(rxq, i);
+    ffq_payload_t rid = s->data[0];
+    if (rid == FFQ_SLOT_EMPTY || ffq_impl_slot_is_inline(s)) {
+        return 0;
+    }
+
+    b->rid = (regionid_t)rid;
+    b->offset = s->data[1];
+    b->length = s->data[2];
+    b->valid_data = s->data[3];
+    b->valid_length = s->data[4];
+    b->flags = s->data[5];
+
+    return 1;
+}
+
+
+/**
+ * @brief enqueue a chain of buffers into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          The segments of the chain
+ * @param num           The number of segments
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ *
+ * The first words of the segments after the first one are set before the barrier, the receiver
+ * does not look at them before it has seen the first one.
+ */
+static errval_t ff_enqueue_chain(struct cleanq *queue, struct cleanq_buf *bufs, size_t num)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *txq = &q->txq;
+
+    size_t n = 0;
+    for (size_t i = 0; i < num; i++) {
+        n += txq->compact ? ff_compact_slots(&bufs[i]) : 1;
+    }
+
+    /* this chain would never fit */
+    if (n > txq->size) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* the receiver releases the slots in order, if the last one is free so are the others */
+    if (!ffq_impl_slot_is_empty(txq, ffq_impl_get_slot_at(txq, n - 1))) {
+        ff_stats_sent(q, txq->pos, 0);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    /* write the segments */
+    size_t used = 0;
+    for (size_t i = 0; i < num; i++) {
+        size_t k = 1;
+        if (txq->compact) {
+            assert(bufs[i].rid != FFQ_COMPACT_SLOT_EMPTY);
+            k = ff_compact_write(txq, used, &bufs[i]);
+        } else {
+            volatile struct ffq_slot *s = ffq_impl_get_slot_at(txq, used);
+            s->data[1] = bufs[i].offset;
+            s->data[2] = bufs[i].length;
+            s->data[3] = bufs[i].valid_data;
+            s->data[4] = bufs[i].valid_length;
+            s->data[5] = bufs[i].flags;
+        }
+
+        if (i > 0) {
+            ff_chain_publish(txq, used, bufs[i].rid);
+        }
+        used += k;
+    }
+
+    /* insert memory barrier, once for the entire chain */
+    __sync_synchronize();
+
+    /* set the first word of the first segment, signalling the chain */
+    ff_chain_publish(txq, 0, bufs[0].rid);
+
+    ffq_idx_t oldpos = txq->pos;
+    ffq_impl_advance(txq, n);
+    ff_stats_sent(q, oldpos, n);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a chain of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_CHAIN_TOO_LONG if the
+ *          chain does not fit into the array, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ff_dequeue_chain(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                 size_t *num_deq)
+{
+    struct cleanq_ffq *q = (struct cleanq_ffq *)queue;
+    struct ffq_chan *rxq = &q->rxq;
+
+    /* the slots past the pending ones have not been released yet */
+    size_t avail = rxq->size - ffq_impl_pending(rxq);
+
+    struct cleanq_buf b;
+    size_t used = ff_chain_read(rxq, 0, &b);
+    if (used == 0) {
+        if (!rxq->compact && ff_inline_pending(rxq)) {
+            return CLEANQ_ERR_INLINE_PENDING;
+        }
+        cleanq_shm_cmd_poll(&q->shm);
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    /* collect the segments up to the last one, or up to what has been published */
+    size_t n = 0;
+    while (true) {
+        if (n < num) {
+            bufs[n] = b;
+        }
+        n++;
+
+        if ((b.flags & CLEANQ_FLAG_LAST) || used >= avail) {
+            break;
+        }
+
+        size_t k = ff_chain_read(rxq, used, &b);
+        if (k == 0) {
+            break;
+        }
+        used += k;
+    }
+
+    if (n > num) {
+        *num_deq = n;
+        return CLEANQ_ERR_CHAIN_TOO_LONG;
+    }
+
+    /* the slots get released with a single barrier, possibly later */
+    ffq_impl_recv_advance(rxq, used);
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    *num_deq = n;
+    return CLEANQ_ERR_OK;
 }
 
 
@@ -222,8 +1019,57 @@ static errval_t ff_dequeue(struct cleanq *queue, regionid_t *region_id, genoffse
  */
 static errval_t ff_notify(struct cleanq *q)
 {
-    (void)(q);
-    return CLEANQ_ERR_OK;
+    struct cleanq_ffq *ffq = (struct cleanq_ffq *)q;
+
+    errval_t err = cleanq_shm_wake(&ffq->tx_ctrl->waiters);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the receiver may also wait for the queue in a pollset */
+    return cleanq_shm_doorbell_ring(&ffq->tx_ctrl->doorbell, &ffq->doorbell);
+}
+
+
+static bool ff_wait_can_recv(void *arg)
+{
+    struct cleanq_ffq *ffq = arg;
+    return ffq_impl_can_recv(&ffq->rxq) || cleanq_shm_cmd_pending(&ffq->shm);
+}
+
+
+/**
+ * @brief Waits until there is something to dequeue or the timeout expires
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ */
+static errval_t ff_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    struct cleanq_ffq *ffq = (struct cleanq_ffq *)q;
+
+    return cleanq_shm_wait(&ffq->rx_ctrl->waiters, ff_wait_can_recv, ffq, ffq->wait_spin_us,
+                           timeout_us);
+}
+
+
+/**
+ * @brief Sets the doorbell the other side rings on a notification
+ *
+ * @param q         The queue to call the operation on
+ * @param name      The name of the doorbell object, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_doorbell(struct cleanq *q, const char *name, uint32_t bit)
+{
+    struct cleanq_ffq *ffq = (struct cleanq_ffq *)q;
+
+    return cleanq_shm_doorbell_announce(&ffq->rx_ctrl->doorbell, name, bit);
 }
 
 
@@ -246,11 +1092,45 @@ static errval_t ff_notify(struct cleanq *q)
  */
 static errval_t ff_register(struct cleanq *q, struct capref cap, regionid_t rid)
 {
-    /* we for the registration, we send a register command to the other side */
-    return ff_enqueue(q, rid, (genoffset_t)cap.vaddr, (genoffset_t)cap.len, (genoffset_t)cap.paddr,
-                      0, FFQ_CMD_REGISTER);
+    return cleanq_shm_register(&((struct cleanq_ffq *)q)->shm, cap, rid);
 }
 
+/**
+ * @brief Add several memory regions without waiting for the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param caps          The capabilities of the memory regions
+ * @param rids          The region ids
+ * @param num           The number of regions
+ * @param token         The token of the batch
+ * @param num_reg       Return pointer to the number of regions that have been sent
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_register_batch(struct cleanq *q, const struct capref *caps,
+                                  const regionid_t *rids, size_t num, uint64_t token,
+                                  size_t *num_reg)
+{
+    return cleanq_shm_register_batch(&((struct cleanq_ffq *)q)->shm, caps, rids, num, token,
+                                     num_reg);
+}
+
+
+/**
+ * @brief Acknowledges a batch of registrations of the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param token         The token of the batch
+ * @param err           The outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ */
+static errval_t ff_register_ack(struct cleanq *q, uint64_t token, errval_t err)
+{
+    return cleanq_shm_register_ack(&((struct cleanq_ffq *)q)->shm, token, err);
+}
+
+
 /**
  * @brief Remove a memory region
  *
@@ -262,8 +1142,7 @@ static errval_t ff_register(struct cleanq *q, struct capref cap, regionid_t rid)
  */
 static errval_t ff_deregister(struct cleanq *q, regionid_t rid)
 {
-    /* we for the de-registration, we send a register command to the other side */
-    return ff_enqueue(q, rid, 0, 0, 0, 0, FFQ_CMD_DEREGISTER);
+    return cleanq_shm_deregister(&((struct cleanq_ffq *)q)->shm, rid);
 }
 
 
@@ -285,10 +1164,76 @@ static errval_t ff_deregister(struct cleanq *q, regionid_t rid)
  */
 errval_t ff_control(struct cleanq *q, uint64_t request, uint64_t value, uint64_t *result)
 {
-    (void)(q);
-    (void)(request);
-    (void)(value);
-    (void)(result);
+    struct cleanq_ffq *ffq = (struct cleanq_ffq *)q;
+
+    switch (request) {
+    case CLEANQ_CTRL_WAIT_SPIN_US:
+        if (result) {
+            *result = ffq->wait_spin_us;
+        }
+        ffq->wait_spin_us = value;
+        break;
+    case CLEANQ_CTRL_ACK_BATCH:
+        if (result) {
+            *result = ffq->rxq.release_batch;
+        }
+        ffq_impl_set_release_batch(&ffq->rxq, value);
+        ffq_impl_release(&ffq->rxq);
+        break;
+    case CLEANQ_CTRL_INLINE_MAX:
+        if (result) {
+            *result = ffq->inline_max;
+        }
+        break;
+    case CLEANQ_CTRL_RING_NODE: {
+        /* the rings start with their control line, they are on the same page */
+        int node;
+        void *ring = value ? (void *)ffq->tx_ctrl : (void *)ffq->rx_ctrl;
+        errval_t err = cleanq_numa_memory_node(ring, &node);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        if (result) {
+            *result = (uint64_t)node;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Fast Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains a fast path handle of a FFQ
+ *
+ * @param q         The FFQ
+ * @param fq        The handle to initialize
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED for compact queues
+ */
+errval_t cleanq_ffq_get_fast(struct cleanq_ffq *q, struct cleanq_ffq_fast *fq)
+{
+    /* compact messages may span two slots, they always go through the generic path */
+    if (q->txq.compact) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    cleanq_fast_init(&fq->f, &q->q);
+    fq->f.cmd_sent = &q->shm.cmd_rx->sent;
+    fq->f.cmd_handled = &q->shm.cmd_handled;
+    fq->txq = &q->txq;
+    fq->rxq = &q->rxq;
+
     return CLEANQ_ERR_OK;
 }
 
@@ -311,20 +1256,12 @@ errval_t ff_destroy(struct cleanq *q)
 {
     struct cleanq_ffq *ffq = (struct cleanq_ffq *)q;
 
-    errval_t err = CLEANQ_ERR_OK;
-
-    if (ffq->rxtx_mem && munmap(ffq->rxtx_mem, ffq->memsize) == -1) {
-        printf("WARNING: FFQ destroy failed. (munmap)\n");
-    }
-
-    if (ffq->name && shm_unlink(ffq->name) == -1) {
-        printf("WARNING: FFQ destroy failed. (shm_unlink)\n");
-    }
+    cleanq_shm_doorbell_unmap(&ffq->doorbell);
+    cleanq_shm_close(&ffq->shm);
 
-    free(ffq->name);
     free(q);
 
-    return err;
+    return CLEANQ_ERR_OK;
 }
 
 
@@ -338,78 +1275,164 @@ errval_t ff_destroy(struct cleanq *q)
  * @returns error on failure or CLEANQ_ERR_OK on success
  */
 errval_t cleanq_ffq_create(struct cleanq_ffq **q, const char *qname, bool clear)
+{
+    return cleanq_ffq_create_with_attr(q, qname, clear, NULL);
+}
+
+
+/**
+ * @brief initialized a the ffq backend with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_ffq_create_with_attr(struct cleanq_ffq **q, const char *qname, bool clear,
+                                     const struct cleanq_ffq_attr *attr)
 {
     errval_t err;
     struct cleanq_ffq *newq;
 
     FFQ_DEBUG("create start\n");
 
-    newq = (struct cleanq_ffq *)calloc(sizeof(struct cleanq_ffq), 1);
-    if (newq == NULL) {
-        return CLEANQ_ERR_MALLOC_FAIL;
+    /* the geometry the creator will use */
+    struct cleanq_shm_header geometry;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.backend = CLEANQ_SHM_BACKEND_FFQ;
+    geometry.slots = FFQ_DEFAULT_SIZE;
+    geometry.desc_size = FFQ_MSG_BYTES;
+    geometry.desc_align = FFQ_MSG_ALIGNMENT;
+    geometry.flags = CLEANQ_SHM_FLAG_STATS;
+
+    geometry.inline_max = FFQ_INLINE_FIRST_BYTES;
+
+    if (attr && attr->compact) {
+        /* compact slots have no room for inline data */
+        if (attr->inline_max) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+        geometry.flags |= CLEANQ_SHM_FLAG_COMPACT;
+        geometry.desc_size = FFQ_COMPACT_MSG_BYTES;
+        geometry.inline_max = 0;
     }
 
-    newq->name = strdup(qname);
-    if (newq->name == NULL) {
-        goto cleanup1;
+    if (attr) {
+        geometry.slots = attr->slots ? attr->slots : geometry.slots;
+        geometry.desc_size = attr->desc_size ? attr->desc_size : geometry.desc_size;
+        geometry.desc_align = attr->desc_align ? attr->desc_align : geometry.desc_align;
+        geometry.inline_max = attr->inline_max ? attr->inline_max : geometry.inline_max;
     }
 
-    bool creator = true;
-
-    /* try to create the memobj with exclusive first */
-    int fd = shm_open(newq->name, O_RDWR | O_CREAT | O_EXCL, 0600);
-    if (fd == -1) {
-        /* we're not the creator of the queue */
-        creator = false;
-        clear = false;
+    if (!cleanq_shm_is_pow2(geometry.slots) || geometry.slots > UINT32_MAX
+        || !cleanq_shm_is_pow2(geometry.desc_align) || geometry.desc_align < FFQ_MSG_ALIGNMENT) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
 
-        /* try again without the exclusive flag */
-        fd = shm_open(newq->name, O_RDWR | O_CREAT, 0600);
-        if (fd == -1) {
-            goto cleanup2;
+    if (geometry.flags & CLEANQ_SHM_FLAG_COMPACT) {
+        /* compact slots share the cache lines, wide messages need two slots */
+        if (!cleanq_shm_is_pow2(geometry.desc_size) || geometry.desc_size < FFQ_COMPACT_MSG_BYTES
+            || geometry.slots < 2) {
+            return CLEANQ_ERR_INIT_QUEUE;
         }
+    } else if ((geometry.desc_size % FFQ_MSG_BYTES)
+               || (geometry.desc_size & (geometry.desc_align - 1))
+               || ff_inline_slots(geometry.inline_max) > geometry.slots) {
+        /* an inline message of the maximum length must fit into the ring */
+        return CLEANQ_ERR_INIT_QUEUE;
     }
 
-    if (creator && ftruncate(fd, FFQ_MEM_SIZE)) {
-        goto cleanup3;
+    /* the creator receives on channel 0, this is where it places the rings */
+    err = cleanq_shm_set_placement(&geometry, attr ? attr->numa : CLEANQ_NUMA_FIRST_TOUCH,
+                                   attr ? attr->numa_node : 0, 0);
+    if (err_is_fail(err)) {
+        return err;
     }
 
-    FFQ_DEBUG("Mapping queue frame\n");
-    void *buf = mmap(NULL, FFQ_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
-        err = CLEANQ_ERR_MALLOC_FAIL;
-        goto cleanup3;
+    /* the object lives somewhere else, the attaching side has to know where to look */
+    uint32_t mem_flags = attr ? attr->mem_flags : 0;
+    if (mem_flags & CLEANQ_MEM_HUGETLB) {
+        geometry.flags |= CLEANQ_SHM_FLAG_HUGETLB;
     }
 
-    if (clear) {
-        memset(buf, 0, FFQ_MEM_SIZE);
+    cleanq_shm_layout(&geometry);
+
+    newq = (struct cleanq_ffq *)calloc(sizeof(struct cleanq_ffq), 1);
+    if (newq == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    /* create or attach to the shared memory, this gets us the geometry of the creator */
+    err = cleanq_shm_open(&newq->shm, qname, clear, &geometry, mem_flags, false);
+    if (err_is_fail(err)) {
+        goto cleanup1;
     }
+    cleanq_shm_cmd_bind(&newq->shm, &newq->q);
 
-    newq->rxtx_mem = buf;
-    newq->memsize = FFQ_MEM_SIZE;
+    /* without the socket, regions can't be shared with the other side but the queue works */
+    if (err_is_fail(cleanq_shm_fd_open(&newq->shm))) {
+        FFQ_DEBUG("no socket for passing file descriptors on %s\n", qname);
+    }
 
+    bool creator = newq->shm.creator;
+    bool compact = (geometry.flags & CLEANQ_SHM_FLAG_COMPACT) != 0;
+    size_t chan_size = cleanq_shm_chan_size(&geometry);
+    uint8_t *chan0 = (uint8_t *)newq->shm.mem + geometry.hdrsize;
+    uint8_t *chan1 = chan0 + chan_size;
 
-    /* initialize the ffq rx/tx channels */
-    buf = creator ? newq->rxtx_mem : newq->rxtx_mem + FFQ_CHAN_SIZE;
-    ffq_impl_init_rx(&newq->rxq, buf, FFQ_DEFAULT_SIZE, creator);
+    newq->rx_ctrl = (union ffq_chan_ctrl *)(creator ? chan0 : chan1);
+    newq->tx_ctrl = (union ffq_chan_ctrl *)(creator ? chan1 : chan0);
+    newq->wait_spin_us = CLEANQ_WAIT_DEFAULT_SPIN_US;
+    newq->inline_max = compact ? 0 : geometry.inline_max;
 
-    buf = creator ? newq->rxtx_mem + FFQ_CHAN_SIZE: newq->rxtx_mem;
-    ffq_impl_init_tx(&newq->txq, buf, FFQ_DEFAULT_SIZE, creator);
+    /* initialize the ffq rx/tx channels, the slots start after the control line */
+    ffq_impl_init_rx(&newq->rxq, (uint8_t *)newq->rx_ctrl + geometry.desc_align, geometry.slots,
+                     geometry.desc_size, compact, creator);
+    ffq_impl_init_tx(&newq->txq, (uint8_t *)newq->tx_ctrl + geometry.desc_align, geometry.slots,
+                     geometry.desc_size, compact, creator);
 
     /* initializing  the generic cleanq part */
     err = cleanq_init(&newq->q);
     if (err_is_fail(err)) {
-        goto cleanup4;
+        goto cleanup2;
+    }
+
+    /* the statistics live next to the channels, where others can read them */
+    struct cleanq_stats *stats = cleanq_shm_stats(&newq->shm);
+    if (stats) {
+        cleanq_init_stats(&newq->q, stats, geometry.slots);
     }
 
     /* setting the function pointers */
-    newq->q.f.enq = ff_enqueue;
-    newq->q.f.deq = ff_dequeue;
+    if (compact) {
+        newq->q.f.enq = ff_enqueue_compact;
+        newq->q.f.deq = ff_dequeue_compact;
+        newq->q.f.enq_batch = ff_enqueue_batch_compact;
+        newq->q.f.deq_batch = ff_dequeue_batch_compact;
+    } else {
+        newq->q.f.enq = ff_enqueue;
+        newq->q.f.deq = ff_dequeue;
+        newq->q.f.enq_batch = ff_enqueue_batch;
+        newq->q.f.deq_batch = ff_dequeue_batch;
+        newq->q.f.enq_inline = ff_enqueue_inline;
+        newq->q.f.deq_inline = ff_dequeue_inline;
+    }
     newq->q.f.reg = ff_register;
     newq->q.f.dereg = ff_deregister;
+    newq->q.f.reg_batch = ff_register_batch;
+    newq->q.f.reg_ack = ff_register_ack;
     newq->q.f.notify = ff_notify;
+    newq->q.f.wait = ff_wait;
+    newq->q.f.doorbell = ff_doorbell;
     newq->q.f.ctrl = ff_control;
     newq->q.f.destroy = ff_destroy;
+    newq->q.f.enq_chain = ff_enqueue_chain;
+    newq->q.f.deq_chain = ff_dequeue_chain;
+
+    /* the queue is ready to be used by the other side */
+    cleanq_shm_publish(&newq->shm);
 
     *q = newq;
 
@@ -417,12 +1440,8 @@ errval_t cleanq_ffq_create(struct cleanq_ffq **q, const char *qname, bool clear)
 
     return CLEANQ_ERR_OK;
 
-cleanup4:
-    munmap(newq->rxtx_mem, newq->memsize);
-cleanup3:
-    shm_unlink(newq->name);
 cleanup2:
-    free(newq->name);
+    cleanq_shm_close(&newq->shm);
 cleanup1:
     free(newq);
 
@@ -19,7 +19,11 @@
 
 #include <cleanq/cleanq.h>
 #include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/ipc_queue_fast.h>
 #include <cleanq_backend.h>
+#include <cleanq_shm.h>
+#include <cleanq_memfd.h>
+#include <region_pool.h>
 
 /*
  * ================================================================================================
@@ -48,58 +52,111 @@ extern char *__progname;
  * ================================================================================================
  */
 
-///< this is the size of the one-directional queue in message slotes
+///< this is the default size of the one-directional queue in message slotes
 #define IPCQ_DEFAULT_SIZE 64
 
-///< this is the alignment of descriptors
-#define IPCQ_DESCRIPTOR_ALIGNMENT 64
-
 ///< the size of a IPCQ message
 #define IPCQ_MESSAGE_SIZE 64
 
-///< size of a one-direction IPCQ channel
-#define IPCQ_CHAN_SIZE (IPCQ_DEFAULT_SIZE * IPCQ_MESSAGE_SIZE)
+/*
+ * Shared Memory Layout
+ * --------------------
+ *
+ *  +--------+------+----------------------+------+----------------------+
+ *  | header | ack0 | descriptors chan 0   | ack1 | descriptors chan 1   |
+ *  +--------+------+----------------------+------+----------------------+
+ *
+ * The creator transmits on channel 0 and receives on channel 1. The acknowledgement line of a
+ * channel is written by the receiver of that channel, it also holds the futex word the receiver
+ * sleeps on and the doorbell of the pollset it may be part of. The geometry (number of slots,
+ * descriptor size and alignment) and the descriptor format are stored in the header, the
+ * attaching side uses those values.
+ * The header area also holds the statistics of both endpoints, see cleanq/stats.h, and the
+ * command channels, see cleanq_shm.h. Registering and deregistering regions does not take slots
+ * of the descriptor rings.
+ *
+ * With the compact format, descriptors are 32 bytes and two of them share a cache line. Buffers
+ * whose fields do not fit in 32 bits take two consecutive slots. The second slot holds the upper
+ * halves of the fields.
+ *
+ * Inline messages carry their data in the ring instead of a buffer. The first slot holds the
+ * length and up to 44 bytes, each following slot its sequence number and desc_size - 8 bytes.
+ * The following slots are written before the barrier, the first one publishes the message. The
+ * creator stores the maximum length in the header. Compact queues have no inline messages.
+ *
+ * A descriptor is valid once its sequence number is written. Several producer threads of an
+ * endpoint can therefore claim slots with an atomic update of the transmit sequence number and
+ * publish them independently, the receiver consumes them in order. Likewise, several consumer
+ * threads can claim received descriptors. This does not change the layout, it is a property of
+ * the local endpoint only.
+ */
 
-///< total memory for the backing descriptor queues
-#define IPCQ_MEM_SIZE (2 * IPCQ_CHAN_SIZE)
 
+/* struct ipcq_desc is defined in cleanq/backends/ipc_queue_fast.h, the fast path accesses it */
 
-///< defines an IPC queue descriptor
-struct __attribute__((aligned(IPCQ_DESCRIPTOR_ALIGNMENT))) ipcq_desc
+///< defines a compact IPC queue descriptor, the fields are the lower 32 bits of the values
+struct ipcq_desc_compact
 {
-    ///< sequence ID (flow control)
-    uint64_t seq;
+    ///< lower 32 bits of the sequence ID (flow control)
+    uint32_t seq;
 
     ///< region ID
     regionid_t rid;
 
-    ///< padding
-    uint8_t pad[4];
-
     ////< offset into the memory region
-    genoffset_t offset;
+    uint32_t offset;
 
     ///< length of the buffer
-    genoffset_t length;
+    uint32_t length;
 
     ///< start of valid data
-    genoffset_t valid_data;
+    uint32_t valid_data;
 
     ///< length of valid data
-    genoffset_t valid_length;
+    uint32_t valid_length;
 
     ///< the flags
-    uint64_t flags;
+    uint32_t flags;
+
+    ///< IPCQ_CMD_WIDE if the next slot holds the upper halves, 0 otherwise
+    uint32_t cmd;
+};
+
+///< the size of a compact descriptor
+#define IPCQ_COMPACT_DESC_SIZE sizeof(struct ipcq_desc_compact)
+
+///< the number of data bytes in the first slot of an inline message
+#define IPCQ_INLINE_FIRST_BYTES 44
+
+///< the first slot of an inline message, it overlays struct ipcq_desc
+struct ipcq_desc_inline
+{
+    ///< sequence ID (flow control)
+    uint64_t seq;
+
+    ///< the length of the message
+    uint32_t len;
 
-    ///< command
+    ///< the first bytes of the message
+    uint8_t data[IPCQ_INLINE_FIRST_BYTES];
+
+    ///< command, IPCQ_CMD_INLINE
     uint64_t cmd;
 };
 
 ///< sequence numbers
 union __attribute__((aligned(IPCQ_DESCRIPTOR_ALIGNMENT))) ipcq_seqnum
 {
-    ///< the squence number value
-    volatile size_t value;
+    struct {
+        ///< the squence number value
+        volatile size_t value;
+
+        ///< futex word, set while the receiver of the channel sleeps
+        volatile uint32_t waiters;
+
+        ///< the doorbell the sender rings on a notification
+        struct cleanq_shm_doorbell doorbell;
+    };
 
     ///< padding to IPCQ_MESSAGE_SIZE
     uint8_t pad[IPCQ_MESSAGE_SIZE];
@@ -111,14 +168,26 @@ struct cleanq_ipcq
     ///< general cleanq type
     struct cleanq q;
 
-    ///< the name of this queue
-    char *name;
-
     ///< the number of slots in the descriptor ring
     size_t slots;
 
+    ///< the size of a descriptor slot in bytes
+    size_t desc_size;
+
+    ///< whether the descriptors use the compact format
+    bool compact;
+
+    ///< whether several threads enqueue concurrently
+    bool multi_producer;
+
+    ///< whether several threads dequeue concurrently
+    bool multi_consumer;
+
+    ///< the maximum length of an inline message
+    size_t inline_max;
+
     ///< receive descriptors
-    struct ipcq_desc *rx_descs;
+    void *rx_descs;
 
     ///< the receive sequence number for flow control
     uint64_t rx_seq;
@@ -126,8 +195,11 @@ struct cleanq_ipcq
     ///< the receive sequence acknowledgements
     union ipcq_seqnum *rx_seq_ack;
 
+    ///< publish the receive acknowledgement every this many descriptors
+    uint64_t ack_batch;
+
     ///< transmit descriptors
-    struct ipcq_desc *tx_descs;
+    void *tx_descs;
 
     ///< the transmit sequence number for flow control
     uint64_t tx_seq;
@@ -135,14 +207,35 @@ struct cleanq_ipcq
     ///< the transmit sequence acknowledgements
     union ipcq_seqnum *tx_seq_ack;
 
-    ///< pointer to the backing memory for the rx/tx descriptors
-    void *rxtx_mem;
+    ///< cached copy of the transmit acknowledgement of the other side
+    uint64_t tx_seq_ack_cached;
+
+    ///< the number of microseconds to spin in ipcq_wait() before sleeping
+    uint64_t wait_spin_us;
+
+    ///< the doorbell of the other side
+    struct cleanq_shm_doorbell_state doorbell;
 
-    ///< the memory size of the backing memory
-    size_t memsize;
+    ///< the backing shared memory for the rx/tx descriptors
+    struct cleanq_shm shm;
 };
 
 
+/**
+ * @brief returns the descriptor slot for the given sequence number
+ *
+ * @param q     the IPC queue
+ * @param descs the descriptor ring
+ * @param seq   the sequence number
+ *
+ * @returns pointer to the descriptor slot
+ */
+static inline void *ipcq_get_slot(struct cleanq_ipcq *q, void *descs, uint64_t seq)
+{
+    return (uint8_t *)descs + (seq & (q->slots - 1)) * q->desc_size;
+}
+
+
 /*
  * ================================================================================================
  * Special Command Messages
@@ -150,71 +243,292 @@ struct cleanq_ipcq
  */
 
 
-#define IPCQ_CMD_REGISTER 1
-#define IPCQ_CMD_DEREGISTER 2
+///< the command field of a descriptor starting an inline message, the region commands of the
+///< command channels are CLEANQ_SHM_CMD_*
+#define IPCQ_CMD_INLINE 3
+
+///< compact layout only: the following slot holds the upper halves of the fields
+#define IPCQ_CMD_WIDE (1U << 31)
+
+
+/*
+ * ================================================================================================
+ * Descriptor Encoding
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if the buffer fields fit into a single compact descriptor
+ *
+ * @param b     the buffer fields
+ *
+ * @returns TRUE if all fields fit in 32 bits
+ */
+static inline bool ipcq_fits_compact(struct cleanq_buf *b)
+{
+    return ((b->offset | b->length | b->valid_data | b->valid_length | b->flags) >> 32) == 0;
+}
 
 
-static errval_t handle_register_command(struct cleanq_ipcq *q, struct capref cap, uint32_t rid)
+/**
+ * @brief returns the number of slots a descriptor occupies in the ring
+ *
+ * @param q     the IPC queue
+ * @param b     the buffer fields
+ *
+ * @returns 1 or 2 slots
+ */
+static inline size_t ipcq_desc_slots(struct cleanq_ipcq *q, struct cleanq_buf *b)
 {
-    errval_t err;
-    err = cleanq_add_region((struct cleanq *)q, cap, rid);
-    if (err_is_fail(err)) {
-        return err;
+    if (!q->compact) {
+        return 1;
     }
 
-    if (q->q.callbacks.reg) {
-        return q->q.callbacks.reg(&q->q, cap, rid);
+    return ipcq_fits_compact(b) ? 1 : 2;
+}
+
+
+/**
+ * @brief writes a descriptor into the transmit ring, except for its sequence number
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number of the (first) slot
+ * @param b     the buffer fields
+ *
+ * @returns the number of slots used
+ */
+static inline size_t ipcq_write_desc(struct cleanq_ipcq *q, uint64_t seq, struct cleanq_buf *b)
+{
+    if (!q->compact) {
+        struct ipcq_desc *d = ipcq_get_slot(q, q->tx_descs, seq);
+        d->rid = b->rid;
+        d->offset = b->offset;
+        d->length = b->length;
+        d->valid_data = b->valid_data;
+        d->valid_length = b->valid_length;
+        d->flags = b->flags;
+        d->cmd = 0;
+        return 1;
     }
 
-    return CLEANQ_ERR_OK;
+    struct ipcq_desc_compact *d = ipcq_get_slot(q, q->tx_descs, seq);
+    d->rid = b->rid;
+    d->offset = (uint32_t)b->offset;
+    d->length = (uint32_t)b->length;
+    d->valid_data = (uint32_t)b->valid_data;
+    d->valid_length = (uint32_t)b->valid_length;
+    d->flags = (uint32_t)b->flags;
+
+    if (ipcq_fits_compact(b)) {
+        d->cmd = 0;
+        return 1;
+    }
+
+    /* the extension slot carries the upper halves, it is published with the first one */
+    struct ipcq_desc_compact *x = ipcq_get_slot(q, q->tx_descs, seq + 1);
+    x->rid = 0;
+    x->offset = (uint32_t)(b->offset >> 32);
+    x->length = (uint32_t)(b->length >> 32);
+    x->valid_data = (uint32_t)(b->valid_data >> 32);
+    x->valid_length = (uint32_t)(b->valid_length >> 32);
+    x->flags = (uint32_t)(b->flags >> 32);
+    x->cmd = 0;
+    x->seq = (uint32_t)(seq + 1);
+
+    d->cmd = IPCQ_CMD_WIDE;
+
+    return 2;
 }
 
-static errval_t handle_register_decommand(struct cleanq_ipcq *q, regionid_t rid)
+
+/**
+ * @brief publishes a written descriptor by setting its sequence number
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number of the (first) slot
+ */
+static inline void ipcq_publish_desc(struct cleanq_ipcq *q, uint64_t seq)
 {
-    errval_t err;
-    err = cleanq_remove_region((struct cleanq *)q, rid);
-    if (err_is_fail(err)) {
-        return err;
+    if (q->compact) {
+        ((struct ipcq_desc_compact *)ipcq_get_slot(q, q->tx_descs, seq))->seq = (uint32_t)seq;
+    } else {
+        ((struct ipcq_desc *)ipcq_get_slot(q, q->tx_descs, seq))->seq = seq;
     }
+}
 
-    if (q->q.callbacks.dereg) {
-        return q->q.callbacks.dereg(&q->q, rid);
+
+/**
+ * @brief reads a descriptor from the receive ring
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number of the (first) slot
+ * @param b     returns the buffer fields
+ *
+ * @returns the number of slots used
+ */
+static inline size_t ipcq_read_desc(struct cleanq_ipcq *q, uint64_t seq, struct cleanq_buf *b)
+{
+    if (!q->compact) {
+        struct ipcq_desc *d = ipcq_get_slot(q, q->rx_descs, seq);
+        b->rid = d->rid;
+        b->offset = d->offset;
+        b->length = d->length;
+        b->valid_data = d->valid_data;
+        b->valid_length = d->valid_length;
+        b->flags = d->flags;
+        return 1;
     }
 
-    return CLEANQ_ERR_OK;
+    struct ipcq_desc_compact *d = ipcq_get_slot(q, q->rx_descs, seq);
+    b->rid = d->rid;
+    b->offset = d->offset;
+    b->length = d->length;
+    b->valid_data = d->valid_data;
+    b->valid_length = d->valid_length;
+    b->flags = d->flags;
+
+    if (!(d->cmd & IPCQ_CMD_WIDE)) {
+        return 1;
+    }
+
+    struct ipcq_desc_compact *x = ipcq_get_slot(q, q->rx_descs, seq + 1);
+    b->offset |= (genoffset_t)x->offset << 32;
+    b->length |= (genoffset_t)x->length << 32;
+    b->valid_data |= (genoffset_t)x->valid_data << 32;
+    b->valid_length |= (genoffset_t)x->valid_length << 32;
+    b->flags |= (uint64_t)x->flags << 32;
+
+    return 2;
 }
 
 
 /*
  * ================================================================================================
- * TX Path
+ * Inline Messages
  * ================================================================================================
  */
 
 
 /**
- * @brief returns a pointer to the head descriptor
+ * @brief returns the number of slots an inline message occupies in the ring
+ *
+ * @param desc_size     the size of a descriptor slot
+ * @param len           the length of the message
+ *
+ * @returns the number of slots
+ */
+static inline size_t ipcq_inline_slots(size_t desc_size, size_t len)
+{
+    if (len <= IPCQ_INLINE_FIRST_BYTES) {
+        return 1;
+    }
+
+    size_t per_slot = desc_size - sizeof(uint64_t);
+    return 1 + (len - IPCQ_INLINE_FIRST_BYTES + per_slot - 1) / per_slot;
+}
+
+
+/**
+ * @brief checks if the descriptor with the given sequence number is an inline message
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number, the descriptor must have been published
+ *
+ * @returns TRUE if the descriptor is the first slot of an inline message
+ */
+static inline bool ipcq_is_inline(struct cleanq_ipcq *q, uint64_t seq)
+{
+    return !q->compact && ((struct ipcq_desc *)ipcq_get_slot(q, q->rx_descs, seq))->cmd
+                              == IPCQ_CMD_INLINE;
+}
+
+
+/**
+ * @brief writes an inline message into the transmit ring, except for its sequence number
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number of the first slot
+ * @param data  the data of the message
+ * @param len   the length of the message
+ */
+static void ipcq_write_inline(struct cleanq_ipcq *q, uint64_t seq, const void *data, size_t len)
+{
+    struct ipcq_desc_inline *d = ipcq_get_slot(q, q->tx_descs, seq);
+    size_t n = len < IPCQ_INLINE_FIRST_BYTES ? len : IPCQ_INLINE_FIRST_BYTES;
+    d->len = (uint32_t)len;
+    memcpy(d->data, data, n);
+    d->cmd = IPCQ_CMD_INLINE;
+
+    /* the following slots are published with the first one */
+    size_t per_slot = q->desc_size - sizeof(uint64_t);
+    for (uint64_t i = 1; n < len; i++) {
+        struct ipcq_desc *x = ipcq_get_slot(q, q->tx_descs, seq + i);
+        size_t chunk = (len - n) < per_slot ? (len - n) : per_slot;
+        memcpy((uint8_t *)x + sizeof(uint64_t), (const uint8_t *)data + n, chunk);
+        x->seq = seq + i;
+        n += chunk;
+    }
+}
+
+
+/**
+ * @brief reads an inline message from the receive ring
  *
  * @param q     the IPC queue
+ * @param seq   the sequence number of the first slot
+ * @param data  the buffer to copy the data into
+ * @param len   the length of the message
  *
- * @returns pointer to the head desc
+ * @returns the number of slots used
  */
-static inline struct ipcq_desc *ipcq_get_tx_desc_head(struct cleanq_ipcq *q)
+static size_t ipcq_read_inline(struct cleanq_ipcq *q, uint64_t seq, void *data, size_t len)
 {
-    return &q->tx_descs[q->tx_seq % q->slots];
+    struct ipcq_desc_inline *d = ipcq_get_slot(q, q->rx_descs, seq);
+    size_t n = len < IPCQ_INLINE_FIRST_BYTES ? len : IPCQ_INLINE_FIRST_BYTES;
+    memcpy(data, d->data, n);
+
+    size_t per_slot = q->desc_size - sizeof(uint64_t);
+    uint64_t i;
+    for (i = 1; n < len; i++) {
+        struct ipcq_desc *x = ipcq_get_slot(q, q->rx_descs, seq + i);
+        size_t chunk = (len - n) < per_slot ? (len - n) : per_slot;
+        memcpy((uint8_t *)data + n, (uint8_t *)x + sizeof(uint64_t), chunk);
+        n += chunk;
+    }
+
+    return i;
 }
 
 
+/*
+ * ================================================================================================
+ * TX Path
+ * ================================================================================================
+ */
+
+
 /**
- * @brief checks if the queue can be written
+ * @brief returns the number of free slots in the transmit ring
  *
  * @param q     the ipcq to check
+ * @param num   the number of slots we would like to have
  *
- * @returns TRUE if a message can be written, FALSE otherwise
+ * @returns the number of free slots
  */
-static inline bool ipcq_can_send(struct cleanq_ipcq *q)
+static inline size_t ipcq_tx_free_slots(struct cleanq_ipcq *q, size_t num)
 {
-    return (q->tx_seq - q->tx_seq_ack->value) < q->slots;
+    /* only touch the line of the other side if the cached value says the ring is full */
+    size_t free_slots = q->slots - (q->tx_seq - q->tx_seq_ack_cached);
+    if (free_slots < num) {
+        q->tx_seq_ack_cached = q->tx_seq_ack->value;
+        free_slots = q->slots - (q->tx_seq - q->tx_seq_ack_cached);
+
+        /* this is the only time we see the actual occupancy of the ring */
+        cleanq_stats_occupancy(&q->q, q->slots - free_slots);
+    }
+
+    return free_slots;
 }
 
 
@@ -228,40 +542,41 @@ static inline bool ipcq_can_send(struct cleanq_ipcq *q)
  * @param valid_data    offset of valid data
  * @param valid_length  length of valid data
  * @param misc_flags    flags to transmitt
- * @param cmd           the command
  *
  * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if queue was full
  */
 static inline errval_t ipcq_enqueue_internal(struct cleanq_ipcq *q, regionid_t region_id,
                                              genoffset_t offset, genoffset_t length,
                                              genoffset_t valid_data, genoffset_t valid_length,
-                                             uint64_t misc_flags, uint64_t cmd)
+                                             uint64_t misc_flags)
 {
     assert(q);
 
-    if (!ipcq_can_send(q)) {
+    struct cleanq_buf b = {
+        .offset = offset,
+        .length = length,
+        .valid_data = valid_data,
+        .valid_length = valid_length,
+        .flags = misc_flags,
+        .rid = region_id,
+    };
+
+    size_t n = ipcq_desc_slots(q, &b);
+    if (ipcq_tx_free_slots(q, n) < n) {
         return CLEANQ_ERR_QUEUE_FULL;
     }
 
-    struct ipcq_desc *head = ipcq_get_tx_desc_head(q);
-
     /* write the descriptor */
-    head->rid = region_id;
-    head->offset = offset;
-    head->length = length;
-    head->valid_data = valid_data;
-    head->valid_length = valid_length;
-    head->flags = misc_flags;
-    head->cmd = cmd;
+    ipcq_write_desc(q, q->tx_seq, &b);
 
     /* barrier */
     __sync_synchronize();
 
     /* write the sequence pointer */
-    head->seq = q->tx_seq;
+    ipcq_publish_desc(q, q->tx_seq);
 
     /* bump local tx sequence number */
-    q->tx_seq++;
+    q->tx_seq += n;
 
     IPCQ_DEBUG("tx_seq=%lu tx_seq_ack=%lu rx_seq_ack=%lu \n", q->tx_seq, q->tx_seq_ack->value,
                q->rx_seq_ack->value);
@@ -270,201 +585,984 @@ static inline errval_t ipcq_enqueue_internal(struct cleanq_ipcq *q, regionid_t r
 }
 
 
-/*
- * ================================================================================================
- * RX Path
- * ================================================================================================
- */
-
-
 /**
- * @brief returns a pointer to the tail descriptor
+ * @brief sends a batch of messages over the IPCQ with a single barrier
  *
- * @param q     the IPC queue
+ * @param q             the ipc queue
+ * @param bufs          the buffers to be sent
+ * @param num           the number of buffers
  *
- * @returns pointer to the tail desc
+ * @returns the number of buffers that have been sent
  */
-static inline struct ipcq_desc *ipcq_get_rx_desc_tail(struct cleanq_ipcq *q)
+static inline size_t ipcq_enqueue_batch_internal(struct cleanq_ipcq *q, struct cleanq_buf *bufs,
+                                                 size_t num)
 {
-    return &q->rx_descs[q->rx_seq % q->slots];
-}
+    assert(q);
 
+    /* wide descriptors take two slots, a stale cached value must not hold back the first one */
+    size_t need = num * ipcq_desc_slots(q, &bufs[0]);
+    if (need > q->slots) {
+        need = q->slots;
+    }
+    size_t free_slots = ipcq_tx_free_slots(q, need);
 
-/**
- * @brief checks if there is a message to be received
- *
- * @param q     the IPC queue to check
- *
- * @returns TRUE if there is a message, FALSE otherwise *
- */
-static bool ipcq_can_recv(struct cleanq_ipcq *q)
-{
-    return (q->rx_seq <= ipcq_get_rx_desc_tail(q)->seq);
-}
+    /* write the descriptors */
+    size_t count, used = 0;
+    for (count = 0; count < num; count++) {
+        if (used + ipcq_desc_slots(q, &bufs[count]) > free_slots) {
+            break;
+        }
+        used += ipcq_write_desc(q, q->tx_seq + used, &bufs[count]);
+    }
 
+    /* barrier, once for the entire batch */
+    __sync_synchronize();
 
-/*
- * ================================================================================================
- * Datapath functions
- * ================================================================================================
- */
+    /* write the sequence numbers */
+    used = 0;
+    for (size_t i = 0; i < count; i++) {
+        ipcq_publish_desc(q, q->tx_seq + used);
+        used += ipcq_desc_slots(q, &bufs[i]);
+    }
 
+    /* bump local tx sequence number */
+    q->tx_seq += used;
 
-/**
- * @brief Enqueue a descriptor (as seperate fields) into the descriptor queue
- *
- * @param q                     The descriptor queue
- * @param region_id             Region id of the enqueued buffer
- * @param offset                Offset into the region where the buffer resides
- * @param length                Length of the buffer
- * @param valid_data            Offset into the region where the valid data of the buffer resides
- * @param valid_length          Length of the valid data of the buffer
- * @param misc_flags            Miscellaneous flags
- *
- * @returns error if queue is full or CLEANQ_ERR_OK on success
- */
-static errval_t ipcq_enqueue(struct cleanq *queue, regionid_t region_id, genoffset_t offset,
-                             genoffset_t length, genoffset_t valid_data, genoffset_t valid_length,
-                             uint64_t misc_flags)
-{
-    return ipcq_enqueue_internal((struct cleanq_ipcq *)queue, region_id, offset, length,
-                                 valid_data, valid_length, misc_flags, 0);
+    IPCQ_DEBUG("batch num=%zu tx_seq=%lu tx_seq_ack=%lu\n", count, q->tx_seq,
+               q->tx_seq_ack->value);
+
+    return count;
 }
 
 
 /**
- * @brief dequeue a buffer from the queue
+ * @brief sends a batch of messages over the IPCQ from one of several producer threads
  *
- * @param q             The queue to call the operation on
- * @param region_id     Return pointer to the id of the memory region the buffer belongs to
- * @param region_offset Return pointer to the offset into the region where this buffer starts.
- * @param lenght        Return pointer to the lenght of the dequeue buffer
- * @param valid_data    Return pointer to where the valid data of this buffer starts
- * @param valid_length  Return pointer to the length of the valid data of this buffer
- * @param misc_flags    Return value from other endpoint
+ * @param q             the ipc queue
+ * @param bufs          the buffers to be sent
+ * @param num           the number of buffers
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns the number of buffers that have been sent
+ *
+ * The slots are claimed by advancing the transmit sequence number with a compare-and-swap. Each
+ * producer publishes its own descriptors, the receiver waits for them in order.
  */
-static errval_t ipcq_dequeue(struct cleanq *queue, regionid_t *region_id, genoffset_t *offset,
-                             genoffset_t *length, genoffset_t *valid_data,
-                             genoffset_t *valid_length, uint64_t *misc_flags)
+static size_t ipcq_mp_enqueue_internal(struct cleanq_ipcq *q, struct cleanq_buf *bufs,
+                                       size_t num)
 {
-    errval_t err;
+    assert(q);
 
-    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+    uint64_t seq;
+    size_t count, used;
+    do {
+        seq = __atomic_load_n(&q->tx_seq, __ATOMIC_RELAXED);
+        count = 0;
+        used = 0;
+
+        /* only touch the line of the other side if the cached value says the ring is full. The
+         * producers update the cached value concurrently, it may lag behind by any amount. */
+        size_t need = num * ipcq_desc_slots(q, &bufs[0]);
+        if (need > q->slots) {
+            need = q->slots;
+        }
 
-    if (!ipcq_can_recv(q)) {
-        return CLEANQ_ERR_QUEUE_EMPTY;
-    }
+        uint64_t ack = __atomic_load_n(&q->tx_seq_ack_cached, __ATOMIC_RELAXED);
+        if (seq - ack > q->slots - need) {
+            ack = q->tx_seq_ack->value;
+            __atomic_store_n(&q->tx_seq_ack_cached, ack, __ATOMIC_RELAXED);
+            cleanq_stats_occupancy(&q->q, seq - ack);
+        }
 
-    struct ipcq_desc *tail = ipcq_get_rx_desc_tail(q);
+        /* seq is stale if the other side has acknowledged more, the swap below fails then */
+        if ((int64_t)(seq - ack) < 0) {
+            continue;
+        }
 
-    /* normal case, no command */
-    if (tail->cmd == 0) {
-        *region_id = tail->rid;
-        *offset = tail->offset;
-        *length = tail->length;
-        *valid_data = tail->valid_data;
-        *valid_length = tail->valid_length;
-        *misc_flags = tail->flags;
+        size_t free_slots = q->slots - (seq - ack);
 
-        IPCQ_DEBUG("rx_seq_ack=%lu tx_seq_ack=%lu \n", q->rx_seq_ack->value, q->tx_seq_ack->value);
+        for (count = 0; count < num; count++) {
+            size_t n = ipcq_desc_slots(q, &bufs[count]);
+            if (used + n > free_slots) {
+                break;
+            }
+            used += n;
+        }
 
-        q->rx_seq++;
-        q->rx_seq_ack->value = q->rx_seq;
+        if (count == 0) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&q->tx_seq, seq, seq + used));
 
-        return CLEANQ_ERR_OK;
+    /* write the descriptors into the claimed slots */
+    used = 0;
+    for (size_t i = 0; i < count; i++) {
+        used += ipcq_write_desc(q, seq + used, &bufs[i]);
     }
 
-    /* handle the case where the flags are register / deregister commands */
-    if (tail->cmd == IPCQ_CMD_REGISTER) {
-        struct capref cap;
-        cap.len = tail->length;
-        cap.vaddr = (void *)tail->offset;
-        cap.paddr = (uint64_t)tail->valid_data;
-        err = handle_register_command((struct cleanq_ipcq *)queue, cap, tail->rid);
-    } else {
-        err = handle_register_decommand((struct cleanq_ipcq *)queue, tail->rid);
-    }
+    /* barrier, once for the entire batch */
+    __sync_synchronize();
 
-    /* TODO: should reply to the other side that operatin has failed */
-    if (err_is_fail(err)) {
-        printf("TODO: report failed outcome to other side\n");
+    /* write the sequence numbers */
+    used = 0;
+    for (size_t i = 0; i < count; i++) {
+        ipcq_publish_desc(q, seq + used);
+        used += ipcq_desc_slots(q, &bufs[i]);
     }
 
-    q->rx_seq++;
-    q->rx_seq_ack->value = q->rx_seq;
-
-    IPCQ_DEBUG("rx_seq_ack=%lu tx_seq_ack=%lu reg/dereg\n", q->rx_seq_ack->value,
-               q->tx_seq_ack->value);
+    IPCQ_DEBUG("mp batch num=%zu seq=%lu tx_seq_ack=%lu\n", count, seq, q->tx_seq_ack->value);
 
-    /* commands handled, receive again */
-    return ipcq_dequeue(queue, region_id, offset, length, valid_data, valid_length, misc_flags);
+    return count;
 }
 
 
 /**
- * @brief Send a notification about new buffers on the queue
+ * @brief claims consecutive slots of the transmit ring as one of several producer threads
  *
- * @param q      The queue to call the operation on
+ * @param q     the ipc queue
+ * @param n     the number of slots, at most the size of the ring
+ * @param seq   returns the sequence number of the first claimed slot
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns TRUE if the slots have been claimed, FALSE if the ring is full
  */
-static errval_t ipcq_notify(struct cleanq *q)
+static bool ipcq_mp_claim_slots(struct cleanq_ipcq *q, size_t n, uint64_t *seq)
 {
-    (void)(q);
-    return CLEANQ_ERR_OK;
+    uint64_t s;
+    do {
+        s = __atomic_load_n(&q->tx_seq, __ATOMIC_RELAXED);
+
+        uint64_t ack = __atomic_load_n(&q->tx_seq_ack_cached, __ATOMIC_RELAXED);
+        if (s - ack > q->slots - n) {
+            ack = q->tx_seq_ack->value;
+            __atomic_store_n(&q->tx_seq_ack_cached, ack, __ATOMIC_RELAXED);
+            cleanq_stats_occupancy(&q->q, s - ack);
+        }
+
+        /* s is stale if the other side has acknowledged more, the swap below fails then */
+        if ((int64_t)(s - ack) < 0) {
+            continue;
+        }
+
+        if (s - ack > q->slots - n) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&q->tx_seq, s, s + n));
+
+    *seq = s;
+    return true;
 }
 
 
 /*
  * ================================================================================================
- * Memory Registration and Deregistration
+ * RX Path
  * ================================================================================================
  */
 
 
 /**
- * @brief Add a memory region that can be used as buffers to the queue
+ * @brief checks if the descriptor with the given sequence number has been published
  *
- * @param q              The queue to call the operation on
- * @param cap            A Capability for some memory
- * @param region_id      Return pointer to a region id that is assigned
- *                       to the memory
+ * @param q     the IPC queue to check
+ * @param seq   the sequence number
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns TRUE if there is a message, FALSE otherwise
  */
-static errval_t ipcq_register(struct cleanq *q, struct capref cap, regionid_t rid)
+static inline bool ipcq_can_recv_seq(struct cleanq_ipcq *q, uint64_t seq)
 {
-    struct cleanq_ipcq *queue = (struct cleanq_ipcq *)q;
-
-    /* busy wait until we can send a command message */
-    while (!ipcq_can_send(queue))
-        ;
+    if (q->compact) {
+        /* the compact sequence numbers wrap around, compare the distance */
+        struct ipcq_desc_compact *d = ipcq_get_slot(q, q->rx_descs, seq);
+        return (int32_t)(d->seq - (uint32_t)seq) >= 0;
+    }
 
-    return ipcq_enqueue_internal(queue, rid, (genoffset_t)cap.vaddr, (genoffset_t)cap.len,
-                                 (genoffset_t)cap.paddr, 0, 0, IPCQ_CMD_REGISTER);
+    return (seq <= ((struct ipcq_desc *)ipcq_get_slot(q, q->rx_descs, seq))->seq);
 }
 
 
 /**
- * @brief Remove a memory region
+ * @brief checks if there is a message to be received
  *
- * @param q              The queue to call the operation on
- * @param region_id      The region id to remove from the queues memory
- * @param cap            The capability to the removed memory
+ * @param q     the IPC queue to check
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns TRUE if there is a message, FALSE otherwise *
+ */
+static bool ipcq_can_recv(struct cleanq_ipcq *q)
+{
+    return ipcq_can_recv_seq(q, q->rx_seq);
+}
+
+
+/**
+ * @brief returns why nothing could be dequeued at the given sequence number
+ *
+ * @param q     the IPC queue
+ * @param seq   the receive sequence number
+ *
+ * @returns CLEANQ_ERR_INLINE_PENDING if the next message is inline, CLEANQ_ERR_QUEUE_EMPTY
+ */
+static inline errval_t ipcq_dequeue_empty(struct cleanq_ipcq *q, uint64_t seq)
+{
+    if (ipcq_can_recv_seq(q, seq)) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ipcq_is_inline(q, seq)) {
+            return CLEANQ_ERR_INLINE_PENDING;
+        }
+    }
+
+    return CLEANQ_ERR_QUEUE_EMPTY;
+}
+
+
+/**
+ * @brief publishes the receive acknowledgement if needed
+ *
+ * @param q     the IPC queue
+ *
+ * The acknowledgement is written once ack_batch descriptors have been received since the last
+ * one, or when there is nothing more to receive so the sender never waits on slots that we have
+ * already consumed.
+ */
+static inline void ipcq_rx_ack(struct cleanq_ipcq *q)
+{
+    if (q->rx_seq - q->rx_seq_ack->value >= q->ack_batch || !ipcq_can_recv(q)) {
+        q->rx_seq_ack->value = q->rx_seq;
+    }
+}
+
+
+/**
+ * @brief publishes the receive acknowledgement of one of several consumer threads if needed
+ *
+ * @param q     the IPC queue
+ *
+ * The acknowledgement only ever moves forward, a consumer that is late does not overwrite the
+ * value of a consumer that has claimed more descriptors in the meantime.
+ */
+static inline void ipcq_mc_rx_ack(struct cleanq_ipcq *q)
+{
+    uint64_t seq = __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE);
+    uint64_t ack = q->rx_seq_ack->value;
+
+    if (seq - ack >= q->ack_batch || !ipcq_can_recv_seq(q, seq)) {
+        while ((int64_t)(seq - ack) > 0
+               && !__sync_bool_compare_and_swap(&q->rx_seq_ack->value, ack, seq)) {
+            ack = q->rx_seq_ack->value;
+        }
+    }
+}
+
+
+/**
+ * @brief consumes the slots of a message that has been read and acknowledges them
+ *
+ * @param q     the IPC queue
+ * @param seq   the receive sequence number the message was read at
+ * @param n     the number of slots of the message
+ *
+ * @returns TRUE if the slots have been consumed, FALSE if another consumer thread was faster
+ */
+static inline bool ipcq_rx_claim(struct cleanq_ipcq *q, uint64_t seq, size_t n)
+{
+    if (q->multi_consumer) {
+        if (!__sync_bool_compare_and_swap(&q->rx_seq, seq, seq + n)) {
+            return false;
+        }
+        ipcq_mc_rx_ack(q);
+    } else {
+        q->rx_seq = seq + n;
+        ipcq_rx_ack(q);
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief receives a batch of messages from the IPCQ as one of several consumer threads
+ *
+ * @param q     the IPC queue
+ * @param bufs  the buffers to be filled in
+ * @param num   the maximum number of buffers
+ *
+ * @returns the number of buffers that have been received
+ *
+ * The descriptors are read first and then claimed by advancing the receive sequence number with
+ * a compare-and-swap. The slots can't be reused by the sender before they are claimed, so the
+ * read is consistent if the swap succeeds. Otherwise another consumer was faster and we retry.
+ */
+static size_t ipcq_mc_dequeue_internal(struct cleanq_ipcq *q, struct cleanq_buf *bufs, size_t num)
+{
+    size_t count = 0;
+    while (count < num) {
+        uint64_t seq = __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE);
+        size_t n = 0, used = 0;
+
+        while (count + n < num && ipcq_can_recv_seq(q, seq + used)) {
+            /* the descriptor must not be read before its sequence number */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            /* inline messages end the run, they are received with cleanq_dequeue_inline() */
+            if (ipcq_is_inline(q, seq + used)) {
+                break;
+            }
+
+            used += ipcq_read_desc(q, seq + used, &bufs[count + n]);
+            n++;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        if (!__sync_bool_compare_and_swap(&q->rx_seq, seq, seq + used)) {
+            continue;
+        }
+
+        count += n;
+    }
+
+    ipcq_mc_rx_ack(q);
+    cleanq_shm_cmd_poll(&q->shm);
+
+    IPCQ_DEBUG("mc batch num=%zu rx_seq_ack=%lu\n", count, q->rx_seq_ack->value);
+
+    return count;
+}
+
+
+/*
+ * ================================================================================================
+ * Datapath functions
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Enqueue a descriptor (as seperate fields) into the descriptor queue
+ *
+ * @param q                     The descriptor queue
+ * @param region_id             Region id of the enqueued buffer
+ * @param offset                Offset into the region where the buffer resides
+ * @param length                Length of the buffer
+ * @param valid_data            Offset into the region where the valid data of the buffer resides
+ * @param valid_length          Length of the valid data of the buffer
+ * @param misc_flags            Miscellaneous flags
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_enqueue(struct cleanq *queue, regionid_t region_id, genoffset_t offset,
+                             genoffset_t length, genoffset_t valid_data, genoffset_t valid_length,
+                             uint64_t misc_flags)
+{
+    return ipcq_enqueue_internal((struct cleanq_ipcq *)queue, region_id, offset, length,
+                                 valid_data, valid_length, misc_flags);
+}
+
+
+/**
+ * @brief dequeue a buffer from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_dequeue(struct cleanq *queue, regionid_t *region_id, genoffset_t *offset,
+                             genoffset_t *length, genoffset_t *valid_data,
+                             genoffset_t *valid_length, uint64_t *misc_flags)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+    errval_t err = CLEANQ_ERR_QUEUE_EMPTY;
+
+    if (ipcq_can_recv(q)) {
+        /* inline messages are received with cleanq_dequeue_inline() */
+        if (ipcq_is_inline(q, q->rx_seq)) {
+            err = CLEANQ_ERR_INLINE_PENDING;
+        } else {
+            struct cleanq_buf b;
+            q->rx_seq += ipcq_read_desc(q, q->rx_seq, &b);
+
+            *region_id = b.rid;
+            *offset = b.offset;
+            *length = b.length;
+            *valid_data = b.valid_data;
+            *valid_length = b.valid_length;
+            *misc_flags = b.flags;
+
+            ipcq_rx_ack(q);
+
+            IPCQ_DEBUG("rx_seq_ack=%lu tx_seq_ack=%lu \n", q->rx_seq_ack->value,
+                       q->tx_seq_ack->value);
+
+            err = CLEANQ_ERR_OK;
+        }
+    }
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    return err;
+}
+
+
+/**
+ * @brief Enqueue a batch of buffers into the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if nothing could be enqueued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ipcq_enqueue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                   size_t *num_enq)
+{
+    *num_enq = ipcq_enqueue_batch_internal((struct cleanq_ipcq *)queue, bufs, num);
+    return (*num_enq == 0) ? CLEANQ_ERR_QUEUE_FULL : CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Dequeue a batch of buffers from the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ *
+ * The acknowledgement is published at most once for the entire batch.
+ */
+static errval_t ipcq_dequeue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                   size_t *num_deq)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    size_t count = 0;
+    while (count < num && ipcq_can_recv(q) && !ipcq_is_inline(q, q->rx_seq)) {
+        q->rx_seq += ipcq_read_desc(q, q->rx_seq, &bufs[count]);
+        count++;
+    }
+
+    /* publish the acknowledgement at most once for the entire batch */
+    ipcq_rx_ack(q);
+    cleanq_shm_cmd_poll(&q->shm);
+
+    IPCQ_DEBUG("batch num=%zu rx_seq_ack=%lu\n", count, q->rx_seq_ack->value);
+
+    *num_deq = count;
+    return (count == 0) ? ipcq_dequeue_empty(q, q->rx_seq) : CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Enqueue a descriptor into the descriptor queue with several producer threads
+ *
+ * @param q                     The descriptor queue
+ * @param region_id             Region id of the enqueued buffer
+ * @param offset                Offset into the region where the buffer resides
+ * @param length                Length of the buffer
+ * @param valid_data            Offset into the region where the valid data of the buffer resides
+ * @param valid_length          Length of the valid data of the buffer
+ * @param misc_flags            Miscellaneous flags
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_enqueue_mp(struct cleanq *queue, regionid_t region_id, genoffset_t offset,
+                                genoffset_t length, genoffset_t valid_data,
+                                genoffset_t valid_length, uint64_t misc_flags)
+{
+    struct cleanq_buf b = {
+        .offset = offset,
+        .length = length,
+        .valid_data = valid_data,
+        .valid_length = valid_length,
+        .flags = misc_flags,
+        .rid = region_id,
+    };
+
+    if (ipcq_mp_enqueue_internal((struct cleanq_ipcq *)queue, &b, 1) == 0) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Enqueue a batch of buffers into the descriptor queue with several producer threads
+ *
+ * @param q             The descriptor queue
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if nothing could be enqueued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ipcq_enqueue_batch_mp(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                      size_t *num_enq)
+{
+    *num_enq = ipcq_mp_enqueue_internal((struct cleanq_ipcq *)queue, bufs, num);
+    return (*num_enq == 0) ? CLEANQ_ERR_QUEUE_FULL : CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a buffer from the queue with several consumer threads
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_dequeue_mc(struct cleanq *queue, regionid_t *region_id, genoffset_t *offset,
+                                genoffset_t *length, genoffset_t *valid_data,
+                                genoffset_t *valid_length, uint64_t *misc_flags)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+    struct cleanq_buf b;
+
+    if (ipcq_mc_dequeue_internal(q, &b, 1) == 0) {
+        return ipcq_dequeue_empty(q, __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE));
+    }
+
+    *region_id = b.rid;
+    *offset = b.offset;
+    *length = b.length;
+    *valid_data = b.valid_data;
+    *valid_length = b.valid_length;
+    *misc_flags = b.flags;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Dequeue a batch of buffers from the descriptor queue with several consumer threads
+ *
+ * @param q             The descriptor queue
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ */
+static errval_t ipcq_dequeue_batch_mc(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                      size_t *num_deq)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    *num_deq = ipcq_mc_dequeue_internal(q, bufs, num);
+    if (*num_deq == 0) {
+        return ipcq_dequeue_empty(q, __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE));
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Enqueue a chain of buffers into the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param bufs          The segments of the chain
+ * @param num           The number of segments
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ *
+ * The slots of all segments are claimed at once. The segments after the first one are published
+ * before the barrier, the receiver does not look at them before the first one.
+ */
+static errval_t ipcq_enqueue_chain(struct cleanq *queue, struct cleanq_buf *bufs, size_t num)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    size_t n = 0;
+    for (size_t i = 0; i < num; i++) {
+        n += ipcq_desc_slots(q, &bufs[i]);
+    }
+
+    /* this chain would never fit */
+    if (n > q->slots) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    uint64_t seq;
+    if (q->multi_producer) {
+        if (!ipcq_mp_claim_slots(q, n, &seq)) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+    } else {
+        if (ipcq_tx_free_slots(q, n) < n) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+        seq = q->tx_seq;
+    }
+
+    /* write the segments */
+    size_t used = ipcq_write_desc(q, seq, &bufs[0]);
+    for (size_t i = 1; i < num; i++) {
+        size_t k = ipcq_write_desc(q, seq + used, &bufs[i]);
+        ipcq_publish_desc(q, seq + used);
+        used += k;
+    }
+
+    /* barrier, once for the entire chain */
+    __sync_synchronize();
+
+    /* write the sequence number of the first segment, this publishes the chain */
+    ipcq_publish_desc(q, seq);
+
+    if (!q->multi_producer) {
+        q->tx_seq += n;
+    }
+
+    IPCQ_DEBUG("chain num=%zu slots=%zu seq=%lu\n", num, n, seq);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Dequeue a chain of buffers from the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_CHAIN_TOO_LONG if the
+ *          chain does not fit into the array, CLEANQ_ERR_OK otherwise
+ *
+ * The segments are read first and then consumed at once, with several consumer threads this is
+ * the claim of ipcq_mc_dequeue_internal().
+ */
+static errval_t ipcq_dequeue_chain(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                   size_t *num_deq)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    while (true) {
+        uint64_t seq = __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE);
+        if (!ipcq_can_recv_seq(q, seq)) {
+            cleanq_shm_cmd_poll(&q->shm);
+            return CLEANQ_ERR_QUEUE_EMPTY;
+        }
+
+        /* the descriptor must not be read before its sequence number */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (ipcq_is_inline(q, seq)) {
+            return CLEANQ_ERR_INLINE_PENDING;
+        }
+
+        struct cleanq_buf b;
+        size_t used = ipcq_read_desc(q, seq, &b);
+
+        /* collect the segments up to the last one, or up to what has been published */
+        size_t n = 0;
+        while (true) {
+            if (n < num) {
+                bufs[n] = b;
+            }
+            n++;
+
+            if ((b.flags & CLEANQ_FLAG_LAST) || !ipcq_can_recv_seq(q, seq + used)) {
+                break;
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (ipcq_is_inline(q, seq + used)) {
+                break;
+            }
+
+            used += ipcq_read_desc(q, seq + used, &b);
+        }
+
+        if (n > num) {
+            *num_deq = n;
+            return CLEANQ_ERR_CHAIN_TOO_LONG;
+        }
+
+        if (!ipcq_rx_claim(q, seq, used)) {
+            continue;
+        }
+
+        IPCQ_DEBUG("chain num=%zu rx_seq_ack=%lu\n", n, q->rx_seq_ack->value);
+
+        cleanq_shm_cmd_poll(&q->shm);
+
+        *num_deq = n;
+        return CLEANQ_ERR_OK;
+    }
+}
+
+
+/**
+ * @brief Enqueue a message with inline data into the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param data          The data of the message
+ * @param len           The length of the data
+ *
+ * @returns error if queue is full or CLEANQ_ERR_OK on success
+ *
+ * With several producer threads, the slots are claimed like those of a batch.
+ */
+static errval_t ipcq_enqueue_inline(struct cleanq *queue, const void *data, size_t len)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    if (len > q->inline_max) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    size_t n = ipcq_inline_slots(q->desc_size, len);
+
+    uint64_t seq;
+    if (q->multi_producer) {
+        if (!ipcq_mp_claim_slots(q, n, &seq)) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+    } else {
+        if (ipcq_tx_free_slots(q, n) < n) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+        seq = q->tx_seq;
+    }
+
+    /* write the message */
+    ipcq_write_inline(q, seq, data, len);
+
+    /* barrier */
+    __sync_synchronize();
+
+    /* write the sequence number of the first slot, this publishes all of them */
+    ipcq_publish_desc(q, seq);
+
+    if (!q->multi_producer) {
+        q->tx_seq += n;
+    }
+
+    IPCQ_DEBUG("inline len=%zu slots=%zu seq=%lu\n", len, n, seq);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Dequeue a message with inline data from the descriptor queue
+ *
+ * @param q             The descriptor queue
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_BUFFER_PENDING if the
+ *          next message is a buffer, CLEANQ_ERR_OK otherwise
+ *
+ * With several consumer threads, the message is read first and then claimed as in
+ * ipcq_mc_dequeue_internal().
+ */
+static errval_t ipcq_dequeue_inline(struct cleanq *queue, void *data, size_t size, size_t *len)
+{
+    struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
+
+    while (true) {
+        uint64_t seq = __atomic_load_n(&q->rx_seq, __ATOMIC_ACQUIRE);
+        if (!ipcq_can_recv_seq(q, seq)) {
+            cleanq_shm_cmd_poll(&q->shm);
+            return CLEANQ_ERR_QUEUE_EMPTY;
+        }
+
+        /* the descriptor must not be read before its sequence number */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        struct ipcq_desc_inline *d = ipcq_get_slot(q, q->rx_descs, seq);
+        uint64_t cmd = d->cmd;
+
+        /* a consumer that is late may read a reused slot, the swap below fails then */
+        size_t l = d->len < q->inline_max ? d->len : q->inline_max;
+
+        /* the answer is only valid if no other consumer took the slot meanwhile */
+        if (cmd != IPCQ_CMD_INLINE || l > size) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&q->rx_seq, __ATOMIC_RELAXED) != seq) {
+                continue;
+            }
+        }
+
+        if (cmd != IPCQ_CMD_INLINE) {
+            return CLEANQ_ERR_BUFFER_PENDING;
+        }
+
+        if (l > size) {
+            *len = l;
+            return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+        }
+
+        size_t n = ipcq_read_inline(q, seq, data, l);
+        if (!ipcq_rx_claim(q, seq, n)) {
+            continue;
+        }
+
+        *len = l;
+
+        IPCQ_DEBUG("inline len=%zu rx_seq_ack=%lu\n", l, q->rx_seq_ack->value);
+
+        return CLEANQ_ERR_OK;
+    }
+}
+
+
+/**
+ * @brief Send a notification about new buffers on the queue
+ *
+ * @param q      The queue to call the operation on
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_notify(struct cleanq *q)
+{
+    struct cleanq_ipcq *queue = (struct cleanq_ipcq *)q;
+
+    /* the receiver of our tx channel sleeps on its acknowledgement line */
+    errval_t err = cleanq_shm_wake(&queue->tx_seq_ack->waiters);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* it may also wait for the queue in a pollset */
+    return cleanq_shm_doorbell_ring(&queue->tx_seq_ack->doorbell, &queue->doorbell);
+}
+
+
+static bool ipcq_wait_can_recv(void *arg)
+{
+    struct cleanq_ipcq *q = arg;
+    return ipcq_can_recv(q) || cleanq_shm_cmd_pending(&q->shm);
+}
+
+
+/**
+ * @brief Waits until there is something to dequeue or the timeout expires
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
  */
-static errval_t ipcq_deregister(struct cleanq *q, regionid_t rid)
+static errval_t ipcq_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    struct cleanq_ipcq *queue = (struct cleanq_ipcq *)q;
+
+    return cleanq_shm_wait(&queue->rx_seq_ack->waiters, ipcq_wait_can_recv, queue,
+                           queue->wait_spin_us, timeout_us);
+}
+
+
+/**
+ * @brief Sets the doorbell the other side rings on a notification
+ *
+ * @param q         The queue to call the operation on
+ * @param name      The name of the doorbell object, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_doorbell(struct cleanq *q, const char *name, uint32_t bit)
 {
     struct cleanq_ipcq *queue = (struct cleanq_ipcq *)q;
 
-    /* busy wait until we can send a command message */
-    while (!ipcq_can_send(queue))
-        ;
+    /* the announcement is in our acknowledgement line, the sender reads it on notify */
+    return cleanq_shm_doorbell_announce(&queue->rx_seq_ack->doorbell, name, bit);
+}
+
+
+/*
+ * ================================================================================================
+ * Memory Registration and Deregistration
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Add a memory region that can be used as buffers to the queue
+ *
+ * @param q              The queue to call the operation on
+ * @param cap            A Capability for some memory
+ * @param region_id      Return pointer to a region id that is assigned
+ *                       to the memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_register(struct cleanq *q, struct capref cap, regionid_t rid)
+{
+    return cleanq_shm_register(&((struct cleanq_ipcq *)q)->shm, cap, rid);
+}
+
+
+/**
+ * @brief Add several memory regions without waiting for the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param caps          The capabilities of the memory regions
+ * @param rids          The region ids
+ * @param num           The number of regions
+ * @param token         The token of the batch
+ * @param num_reg       Return pointer to the number of regions that have been sent
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_register_batch(struct cleanq *q, const struct capref *caps,
+                                    const regionid_t *rids, size_t num, uint64_t token,
+                                    size_t *num_reg)
+{
+    return cleanq_shm_register_batch(&((struct cleanq_ipcq *)q)->shm, caps, rids, num, token,
+                                     num_reg);
+}
+
+
+/**
+ * @brief Acknowledges a batch of registrations of the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param token         The token of the batch
+ * @param err           The outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_register_ack(struct cleanq *q, uint64_t token, errval_t err)
+{
+    return cleanq_shm_register_ack(&((struct cleanq_ipcq *)q)->shm, token, err);
+}
+
 
-    return ipcq_enqueue_internal(queue, rid, 0, 0, 0, 0, 0, IPCQ_CMD_DEREGISTER);
+/**
+ * @brief Remove a memory region
+ *
+ * @param q              The queue to call the operation on
+ * @param region_id      The region id to remove from the queues memory
+ * @param cap            The capability to the removed memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t ipcq_deregister(struct cleanq *q, regionid_t rid)
+{
+    return cleanq_shm_deregister(&((struct cleanq_ipcq *)q)->shm, rid);
 }
 
 
@@ -486,14 +1584,320 @@ static errval_t ipcq_deregister(struct cleanq *q, regionid_t rid)
  */
 static errval_t ipcq_control(struct cleanq *q, uint64_t request, uint64_t value, uint64_t *result)
 {
-    (void)(q);
-    (void)(request);
-    (void)(value);
-    (void)(result);
+    struct cleanq_ipcq *queue = (struct cleanq_ipcq *)q;
+
+    switch (request) {
+    case CLEANQ_CTRL_WAIT_SPIN_US:
+        if (result) {
+            *result = queue->wait_spin_us;
+        }
+        queue->wait_spin_us = value;
+        break;
+    case CLEANQ_CTRL_ACK_BATCH:
+        if (result) {
+            *result = queue->ack_batch;
+        }
+        queue->ack_batch = value ? value : 1;
+        /* the other consumers may have moved the acknowledgement forward already */
+        if (queue->multi_consumer) {
+            ipcq_mc_rx_ack(queue);
+        } else {
+            ipcq_rx_ack(queue);
+        }
+        break;
+    case CLEANQ_CTRL_INLINE_MAX:
+        if (result) {
+            *result = queue->inline_max;
+        }
+        break;
+    case CLEANQ_CTRL_RING_NODE: {
+        /* the rings start with their control line, they are on the same page */
+        int node;
+        void *ring = value ? (void *)queue->tx_seq_ack : (void *)queue->rx_seq_ack;
+        errval_t err = cleanq_numa_memory_node(ring, &node);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        if (result) {
+            *result = (uint64_t)node;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Fast Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains a fast path handle of an IPC queue
+ *
+ * @param q         The IPC queue
+ * @param iq        The handle to initialize
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED for compact queues and endpoints
+ *          with several producer or consumer threads
+ */
+errval_t cleanq_ipcq_get_fast(struct cleanq_ipcq *q, struct cleanq_ipcq_fast *iq)
+{
+    if (q->compact || q->multi_producer || q->multi_consumer) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    cleanq_fast_init(&iq->f, &q->q);
+    iq->f.cmd_sent = &q->shm.cmd_rx->sent;
+    iq->f.cmd_handled = &q->shm.cmd_handled;
+    iq->slots = q->slots;
+    iq->desc_size = q->desc_size;
+    iq->tx_descs = q->tx_descs;
+    iq->tx_seq = &q->tx_seq;
+    iq->tx_seq_ack_cached = &q->tx_seq_ack_cached;
+    iq->tx_seq_ack = &q->tx_seq_ack->value;
+    iq->rx_descs = q->rx_descs;
+    iq->rx_seq = &q->rx_seq;
+    iq->rx_seq_ack = &q->rx_seq_ack->value;
+    iq->ack_batch = &q->ack_batch;
+
     return CLEANQ_ERR_OK;
 }
 
 
+/*
+ * ================================================================================================
+ * Reattaching
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if a slot of the transmit ring carries the given sequence number
+ *
+ * @param q     the IPC queue
+ * @param seq   the sequence number
+ *
+ * @returns TRUE if the slot has been published with this sequence number
+ */
+static bool ipcq_tx_published(struct cleanq_ipcq *q, uint64_t seq)
+{
+    /* every slot of a message has its sequence number, also the following ones */
+    if (q->compact) {
+        return ((struct ipcq_desc_compact *)ipcq_get_slot(q, q->tx_descs, seq))->seq
+               == (uint32_t)seq;
+    }
+
+    return ((struct ipcq_desc *)ipcq_get_slot(q, q->tx_descs, seq))->seq == seq;
+}
+
+
+/**
+ * @brief continues the sequence numbers of an endpoint whose process has died
+ *
+ * @param q     the IPC queue, it has taken over the role of the endpoint
+ *
+ * We receive from the last descriptor we have acknowledged on. The transmit ring is scanned
+ * from the acknowledgement of the other side up to the first slot that has not been published,
+ * a message the endpoint has not published completely is overwritten.
+ */
+static void ipcq_resume_seq(struct cleanq_ipcq *q)
+{
+    q->rx_seq = q->rx_seq_ack->value;
+
+    uint64_t ack = q->tx_seq_ack->value;
+    uint64_t seq = ack;
+    while (seq - ack < q->slots && ipcq_tx_published(q, seq)) {
+        seq++;
+    }
+
+    q->tx_seq = seq;
+    q->tx_seq_ack_cached = ack;
+
+    /* the process may have died while it was sleeping, or with its queue in a pollset */
+    q->rx_seq_ack->waiters = 0;
+    cleanq_shm_doorbell_announce(&q->rx_seq_ack->doorbell, NULL, 0);
+
+    IPCQ_DEBUG("resume rx_seq=%lu tx_seq=%lu tx_seq_ack=%lu\n", q->rx_seq, q->tx_seq, ack);
+}
+
+
+/**
+ * @brief finds the record of a region
+ *
+ * @param regions   the records of an endpoint
+ * @param rid       the region id
+ *
+ * @returns the record, NULL if there is none
+ */
+static struct cleanq_shm_region *ipcq_resume_find(struct cleanq_shm_region *regions,
+                                                  regionid_t rid)
+{
+    for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+        if ((regions[i].flags & CLEANQ_SHM_REGION_USED) && regions[i].rid == rid) {
+            return &regions[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief adds the regions recorded in the shared memory object to the pool
+ *
+ * @param q     the IPC queue, it has taken over the role of an endpoint
+ *
+ * The regions of the other side are added again, the memory files among them are passed to us
+ * once more. Of the regions the endpoint had registered itself, only those backed by a memory
+ * file survived the process, the other side hands them back. The remaining ones are
+ * deregistered on the other side.
+ */
+static void ipcq_resume_regions(struct cleanq_ipcq *q)
+{
+    struct cleanq_shm_region *local = cleanq_shm_regions(&q->shm, true);
+    struct cleanq_shm_region *remote = cleanq_shm_regions(&q->shm, false);
+    uint32_t fd_flags = CLEANQ_SHM_REGION_USED | CLEANQ_SHM_REGION_FD;
+
+    size_t num_fds = 0;
+    for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+        num_fds += (local[i].flags == fd_flags) + (remote[i].flags == fd_flags);
+    }
+
+    /* the other side sends the memory files once it handles the command */
+    if (num_fds) {
+        struct cleanq_shm_cmd cmd = { .cmd = CLEANQ_SHM_CMD_RESUME };
+        cleanq_shm_cmd_send_regions(&q->shm, &cmd, 1);
+    }
+
+    for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+        if (remote[i].flags == CLEANQ_SHM_REGION_USED) {
+            struct capref cap = {
+                .vaddr = (void *)remote[i].vaddr,
+                .paddr = remote[i].paddr,
+                .len = remote[i].len,
+            };
+            if (err_is_fail(cleanq_add_region(&q->q, cap, remote[i].rid))) {
+                printf("WARNING: could not restore region %u\n", remote[i].rid);
+            }
+        }
+
+        if (local[i].flags == CLEANQ_SHM_REGION_USED) {
+            struct cleanq_shm_cmd cmd = { .cmd = CLEANQ_SHM_CMD_DEREGISTER, .rid = local[i].rid };
+            cleanq_shm_cmd_send_regions(&q->shm, &cmd, 1);
+            local[i].flags = 0;
+        }
+    }
+
+    while (num_fds) {
+        regionid_t rid;
+        int fd;
+        if (err_is_fail(cleanq_shm_recv_any_fd(&q->shm, &rid, &fd))) {
+            printf("WARNING: the other side did not pass %zu regions\n", num_fds);
+            return;
+        }
+
+        bool own = true;
+        struct cleanq_shm_region *r = ipcq_resume_find(local, rid);
+        if (r == NULL) {
+            own = false;
+            r = ipcq_resume_find(remote, rid);
+        }
+        if (r == NULL || !(r->flags & CLEANQ_SHM_REGION_FD)) {
+            close(fd);
+            continue;
+        }
+        num_fds--;
+
+        struct capref cap = {
+            .vaddr = (void *)r->vaddr,
+            .paddr = r->paddr,
+            .len = r->len,
+        };
+
+        /* our own regions are ours again, also to be freed with cleanq_memfd_free() */
+        errval_t err = own ? cleanq_memfd_adopt(&cap, fd) : cleanq_memfd_import(&cap, fd);
+        if (err_is_ok(err)) {
+            err = cleanq_add_region(&q->q, cap, rid);
+        }
+        if (err_is_fail(err)) {
+            printf("WARNING: could not restore region %u\n", rid);
+            continue;
+        }
+
+        if (own) {
+            r->vaddr = (uint64_t)cap.vaddr;
+            r->paddr = cap.paddr;
+        }
+    }
+}
+
+
+/**
+ * @brief checks if the endpoint has taken over the role of an endpoint whose process has died
+ *
+ * @param q         The IPC queue
+ *
+ * @returns TRUE if the queue has been reattached with the resume attribute
+ */
+bool cleanq_ipcq_resumed(struct cleanq_ipcq *q)
+{
+    return q->shm.resumed;
+}
+
+
+/**
+ * @brief obtains the regions known to both endpoints of an IPC queue
+ *
+ * @param q         The IPC queue
+ * @param rids      Returns the region ids
+ * @param caps      Returns the memory of the regions, mapped locally
+ * @param num       The size of the arrays
+ * @param count     Returns the number of regions
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the arrays are too small,
+ *          *count is set to the number of regions then
+ */
+errval_t cleanq_ipcq_get_regions(struct cleanq_ipcq *q, regionid_t *rids, struct capref *caps,
+                                 size_t num, size_t *count)
+{
+    assert(count);
+
+    *count = 0;
+    if (q->shm.resume == NULL) {
+        return CLEANQ_ERR_OK;
+    }
+
+    size_t n = 0;
+    for (int local = 1; local >= 0; local--) {
+        struct cleanq_shm_region *regions = cleanq_shm_regions(&q->shm, local);
+        for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+            struct capref cap;
+            if (!(regions[i].flags & CLEANQ_SHM_REGION_USED)
+                || !region_pool_get_cap(q->q.pool, regions[i].rid, &cap)) {
+                continue;
+            }
+
+            if (n < num) {
+                rids[n] = regions[i].rid;
+                caps[n] = cap;
+            }
+            n++;
+        }
+    }
+
+    *count = n;
+
+    return (n > num) ? CLEANQ_ERR_INVALID_BUFFER_ARGS : CLEANQ_ERR_OK;
+}
+
+
 /*
  * ================================================================================================
  * Queue Destruction and Creation
@@ -512,15 +1916,9 @@ errval_t ipcq_destroy(struct cleanq *queue)
 {
     struct cleanq_ipcq *q = (struct cleanq_ipcq *)queue;
 
-    if (q->rxtx_mem && munmap(q->rxtx_mem, q->memsize) == -1) {
-        printf("WARNING: IPCQ destroy failed. (munmap)\n");
-    }
-
-    if (q->name && shm_unlink(q->name) == -1) {
-        printf("WARNING: IPCQ destroy failed. (shm_unlink)\n");
-    }
+    cleanq_shm_doorbell_unmap(&q->doorbell);
+    cleanq_shm_close(&q->shm);
 
-    free(q->name);
     free(q);
 
     return CLEANQ_ERR_OK;
@@ -537,109 +1935,219 @@ errval_t ipcq_destroy(struct cleanq *queue)
  * @returns error on failure or CLEANQ_ERR_OK on success
  */
 errval_t cleanq_ipcq_create(struct cleanq_ipcq **q, char *name, bool clear)
+{
+    return cleanq_ipcq_create_with_attr(q, name, clear, NULL);
+}
+
+
+/**
+ * @brief initialized a the IPCQ backend with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_ipcq_create_with_attr(struct cleanq_ipcq **q, char *name, bool clear,
+                                      const struct cleanq_ipcq_attr *attr)
 {
     errval_t err;
     struct cleanq_ipcq *newq;
 
     IPCQ_DEBUG("create start\n");
 
-    newq = (struct cleanq_ipcq *)calloc(sizeof(struct cleanq_ipcq), 1);
-    if (newq == NULL) {
-        return CLEANQ_ERR_MALLOC_FAIL;
-    }
-
-    newq->name = strdup(name);
-    if (newq->name == NULL) {
-        goto cleanup1;
+    /* the geometry the creator will use */
+    struct cleanq_shm_header geometry;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.backend = CLEANQ_SHM_BACKEND_IPCQ;
+    geometry.slots = IPCQ_DEFAULT_SIZE;
+    geometry.desc_size = IPCQ_MESSAGE_SIZE;
+    geometry.desc_align = IPCQ_DESCRIPTOR_ALIGNMENT;
+    geometry.flags = CLEANQ_SHM_FLAG_STATS;
+
+    /* the endpoints and their regions are recorded, so that a restarted endpoint can resume */
+    if (attr && attr->resume) {
+        geometry.flags |= CLEANQ_SHM_FLAG_RESUME;
     }
 
-    bool creator = true;
-
-    /* try to create the memobj with exclusive first */
-    int fd = shm_open(newq->name, O_RDWR | O_CREAT | O_EXCL, 0600);
-    if (fd == -1) {
-        /* we're not the creator of the queue */
-        creator = false;
-        clear = false;
+    geometry.inline_max = IPCQ_INLINE_FIRST_BYTES;
 
-        /* try again without the exclusive flag */
-        fd = shm_open(newq->name, O_RDWR | O_CREAT, 0600);
-        if (fd == -1) {
-            goto cleanup2;
+    if (attr && attr->compact) {
+        /* compact descriptors have no room for inline data */
+        if (attr->inline_max) {
+            return CLEANQ_ERR_INIT_QUEUE;
         }
+        geometry.flags |= CLEANQ_SHM_FLAG_COMPACT;
+        geometry.desc_size = IPCQ_COMPACT_DESC_SIZE;
+        geometry.inline_max = 0;
     }
 
-    if (creator && ftruncate(fd, IPCQ_MEM_SIZE)) {
-        goto cleanup3;
+    if (attr) {
+        geometry.slots = attr->slots ? attr->slots : geometry.slots;
+        geometry.desc_size = attr->desc_size ? attr->desc_size : geometry.desc_size;
+        geometry.desc_align = attr->desc_align ? attr->desc_align : geometry.desc_align;
+        geometry.inline_max = attr->inline_max ? attr->inline_max : geometry.inline_max;
     }
 
-
-    IPCQ_DEBUG("Mapping queue frame\n");
-    void *buf = mmap(NULL, IPCQ_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
-        err = CLEANQ_ERR_MALLOC_FAIL;
-        goto cleanup3;
+    if (!cleanq_shm_is_pow2(geometry.slots) || !cleanq_shm_is_pow2(geometry.desc_align)
+        || geometry.desc_align < IPCQ_DESCRIPTOR_ALIGNMENT) {
+        return CLEANQ_ERR_INIT_QUEUE;
     }
 
-    if (clear) {
-        memset(buf, 0, IPCQ_MEM_SIZE);
+    if (geometry.flags & CLEANQ_SHM_FLAG_COMPACT) {
+        /* compact descriptors share the cache lines, the ring is still aligned. Wide
+         * descriptors need two slots and the 32-bit sequence numbers must not alias. */
+        if (!cleanq_shm_is_pow2(geometry.desc_size) || geometry.desc_size < IPCQ_COMPACT_DESC_SIZE
+            || geometry.slots < 2 || geometry.slots > (1UL << 30)) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+    } else if (geometry.desc_size < IPCQ_MESSAGE_SIZE
+               || (geometry.desc_size & (geometry.desc_align - 1))
+               || geometry.inline_max > UINT32_MAX
+               || ipcq_inline_slots(geometry.desc_size, geometry.inline_max) > geometry.slots) {
+        /* an inline message of the maximum length must fit into the ring */
+        return CLEANQ_ERR_INIT_QUEUE;
     }
 
-    newq->rxtx_mem = buf;
-    newq->memsize = IPCQ_MEM_SIZE;
+    /* the creator receives on channel 1, this is where it places the rings */
+    err = cleanq_shm_set_placement(&geometry, attr ? attr->numa : CLEANQ_NUMA_FIRST_TOUCH,
+                                   attr ? attr->numa_node : 0, 1);
+    if (err_is_fail(err)) {
+        return err;
+    }
 
+    /* the object lives somewhere else, the attaching side has to know where to look */
+    uint32_t mem_flags = attr ? attr->mem_flags : 0;
+    if (mem_flags & CLEANQ_MEM_HUGETLB) {
+        geometry.flags |= CLEANQ_SHM_FLAG_HUGETLB;
+    }
 
-    if (creator) {
-        newq->tx_seq_ack = newq->rxtx_mem;
-        newq->rx_seq_ack = newq->rxtx_mem + IPCQ_CHAN_SIZE;
+    cleanq_shm_layout(&geometry);
 
-        newq->tx_descs = newq->rxtx_mem + IPCQ_MESSAGE_SIZE;
-        newq->rx_descs = newq->rxtx_mem + IPCQ_CHAN_SIZE + IPCQ_CHAN_SIZE;
-    } else {
-        newq->tx_seq_ack = newq->rxtx_mem + IPCQ_CHAN_SIZE;
-        newq->rx_seq_ack = newq->rxtx_mem;
+    newq = (struct cleanq_ipcq *)calloc(sizeof(struct cleanq_ipcq), 1);
+    if (newq == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
 
-        newq->tx_descs = newq->rxtx_mem + IPCQ_CHAN_SIZE + IPCQ_MESSAGE_SIZE;
-        newq->rx_descs = newq->rxtx_mem + IPCQ_MESSAGE_SIZE;
+    /* create or attach to the shared memory, this gets us the geometry of the creator */
+    err = cleanq_shm_open(&newq->shm, name, clear, &geometry, mem_flags, attr && attr->resume);
+    if (err_is_fail(err)) {
+        goto cleanup1;
     }
+    cleanq_shm_cmd_bind(&newq->shm, &newq->q);
 
-    /* set the number of slots, this is the size - 1 to hold the tx|rx_seq_ack */
-    newq->slots = IPCQ_DEFAULT_SIZE - 1;
+    /* without the socket, regions can't be shared with the other side but the queue works */
+    if (err_is_fail(cleanq_shm_fd_open(&newq->shm))) {
+        IPCQ_DEBUG("no socket for passing file descriptors on %s\n", name);
+    }
 
-    /* set the values of the sequence acknowledges */
-    newq->tx_seq_ack->value = 0;
-    newq->rx_seq_ack->value = 0;
+    /* set the number of slots of the descriptor rings */
+    newq->slots = geometry.slots;
+    newq->desc_size = geometry.desc_size;
+    newq->compact = (geometry.flags & CLEANQ_SHM_FLAG_COMPACT) != 0;
+    newq->inline_max = newq->compact ? 0 : geometry.inline_max;
+
+    /* calculate the channel layout */
+    size_t chan_size = cleanq_shm_chan_size(&geometry);
+    void *chan0 = (uint8_t *)newq->shm.mem + geometry.hdrsize;
+    void *chan1 = (uint8_t *)chan0 + chan_size;
+
+    if (newq->shm.creator) {
+        newq->tx_seq_ack = chan0;
+        newq->tx_descs = (void *)((uint8_t *)chan0 + geometry.desc_align);
+        newq->rx_seq_ack = chan1;
+        newq->rx_descs = (void *)((uint8_t *)chan1 + geometry.desc_align);
+
+        /* set the values of the sequence acknowledges, nothing received yet */
+        if (!newq->shm.resumed) {
+            newq->tx_seq_ack->value = 1;
+            newq->rx_seq_ack->value = 1;
+        }
+    } else {
+        newq->tx_seq_ack = chan1;
+        newq->tx_descs = (void *)((uint8_t *)chan1 + geometry.desc_align);
+        newq->rx_seq_ack = chan0;
+        newq->rx_descs = (void *)((uint8_t *)chan0 + geometry.desc_align);
+    }
 
     /* initialize the sequece numbers */
     newq->rx_seq = 1;
     newq->tx_seq = 1;
+    newq->tx_seq_ack_cached = 1;
+    newq->ack_batch = 1;
+
+    if (newq->shm.resumed) {
+        ipcq_resume_seq(newq);
+    }
+
+    newq->wait_spin_us = CLEANQ_WAIT_DEFAULT_SPIN_US;
+
+    /* the threading model is local to this endpoint, the other side does not need to know */
+    newq->multi_producer = attr && attr->multi_producer;
+    newq->multi_consumer = attr && attr->multi_consumer;
 
     /* initialize generic part */
     err = cleanq_init(&newq->q);
     if (err_is_fail(err)) {
-        goto cleanup4;
+        goto cleanup2;
+    }
+
+    /* the statistics live next to the channels, where others can read them */
+    struct cleanq_stats *stats = cleanq_shm_stats(&newq->shm);
+    if (stats) {
+        cleanq_init_stats(&newq->q, stats, geometry.slots);
     }
 
     /* setting the functions */
     newq->q.f.enq = ipcq_enqueue;
     newq->q.f.deq = ipcq_dequeue;
+    newq->q.f.enq_batch = ipcq_enqueue_batch;
+    newq->q.f.deq_batch = ipcq_dequeue_batch;
     newq->q.f.reg = ipcq_register;
     newq->q.f.dereg = ipcq_deregister;
+    newq->q.f.reg_batch = ipcq_register_batch;
+    newq->q.f.reg_ack = ipcq_register_ack;
     newq->q.f.notify = ipcq_notify;
+    newq->q.f.wait = ipcq_wait;
+    newq->q.f.doorbell = ipcq_doorbell;
     newq->q.f.ctrl = ipcq_control;
+    newq->q.f.destroy = ipcq_destroy;
+    newq->q.f.enq_chain = ipcq_enqueue_chain;
+    newq->q.f.deq_chain = ipcq_dequeue_chain;
+
+    if (!newq->compact) {
+        newq->q.f.enq_inline = ipcq_enqueue_inline;
+        newq->q.f.deq_inline = ipcq_dequeue_inline;
+    }
+
+    if (newq->multi_producer) {
+        newq->q.f.enq = ipcq_enqueue_mp;
+        newq->q.f.enq_batch = ipcq_enqueue_batch_mp;
+    }
+
+    if (newq->multi_consumer) {
+        newq->q.f.deq = ipcq_dequeue_mc;
+        newq->q.f.deq_batch = ipcq_dequeue_batch_mc;
+    }
+
+    /* the regions of the endpoint we take over, the other side must be polling */
+    if (newq->shm.resumed) {
+        ipcq_resume_regions(newq);
+    }
+
+    /* the queue is ready to be used by the other side */
+    cleanq_shm_publish(&newq->shm);
 
     *q = newq;
 
-    IPCQ_DEBUG("create end %p \n", *q);
+    IPCQ_DEBUG("create end %p slots=%zu\n", *q, newq->slots);
 
     return CLEANQ_ERR_OK;
 
-cleanup4:
-    munmap(newq->rxtx_mem, newq->memsize);
-cleanup3:
-    shm_unlink(newq->name);
 cleanup2:
-    free(newq->name);
+    cleanq_shm_close(&newq->shm);
 cleanup1:
     free(newq);
 
@@ -121,6 +121,105 @@ static errval_t loopback_dequeue(struct cleanq *q, regionid_t *rid, genoffset_t
     return CLEANQ_ERR_OK;
 }
 
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Batched Enqueue() / Dequeue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t loopback_enqueue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                       size_t *num_enq)
+{
+    assert(q);
+
+    struct cleanq_loopbackq *lq = (struct cleanq_loopbackq *)q;
+
+    size_t count = LOOPBACK_QUEUE_SIZE - lq->num_ele;
+    if (count > num) {
+        count = num;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        lq->queue[lq->head] = bufs[i];
+        lq->head = (lq->head + 1) % LOOPBACK_QUEUE_SIZE;
+    }
+    lq->num_ele += count;
+
+    *num_enq = count;
+    return (count == 0) ? CLEANQ_ERR_QUEUE_FULL : CLEANQ_ERR_OK;
+}
+
+static errval_t loopback_dequeue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                       size_t *num_deq)
+{
+    assert(q);
+
+    struct cleanq_loopbackq *lq = (struct cleanq_loopbackq *)q;
+
+    size_t count = lq->num_ele;
+    if (count > num) {
+        count = num;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        bufs[i] = lq->queue[lq->tail];
+        lq->tail = (lq->tail + 1) % LOOPBACK_QUEUE_SIZE;
+    }
+    lq->num_ele -= count;
+
+    *num_deq = count;
+    return (count == 0) ? CLEANQ_ERR_QUEUE_EMPTY : CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Chained Enqueue() / Dequeue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t loopback_enqueue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num)
+{
+    assert(q);
+
+    struct cleanq_loopbackq *lq = (struct cleanq_loopbackq *)q;
+
+    if (num > LOOPBACK_QUEUE_SIZE) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    if (num > LOOPBACK_QUEUE_SIZE - lq->num_ele) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    size_t num_enq;
+    return loopback_enqueue_batch(q, bufs, num, &num_enq);
+}
+
+static errval_t loopback_dequeue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                       size_t *num_deq)
+{
+    assert(q);
+
+    struct cleanq_loopbackq *lq = (struct cleanq_loopbackq *)q;
+
+    /* the chain ends with the last segment, or with the last element */
+    size_t count = 0;
+    while (count < lq->num_ele) {
+        struct cleanq_buf *b = &lq->queue[(lq->tail + count) % LOOPBACK_QUEUE_SIZE];
+        count++;
+        if (b->flags & CLEANQ_FLAG_LAST) {
+            break;
+        }
+    }
+
+    if (count > num) {
+        *num_deq = count;
+        return CLEANQ_ERR_CHAIN_TOO_LONG;
+    }
+
+    return loopback_dequeue_batch(q, bufs, count, num_deq);
+}
+
 /*
  * ------------------------------------------------------------------------------------------------
  * Notify()
@@ -245,6 +344,10 @@ errval_t loopback_queue_create(struct cleanq_loopbackq **q)
     /* setting the function pointers */
     lq->q.f.enq = loopback_enqueue;
     lq->q.f.deq = loopback_dequeue;
+    lq->q.f.enq_batch = loopback_enqueue_batch;
+    lq->q.f.deq_batch = loopback_dequeue_batch;
+    lq->q.f.enq_chain = loopback_enqueue_chain;
+    lq->q.f.deq_chain = loopback_dequeue_chain;
     lq->q.f.reg = loopback_register;
     lq->q.f.dereg = loopback_deregister;
     lq->q.f.ctrl = loopback_control;
@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/thread_queue.h>
+#include <cleanq_backend.h>
+#include <region_pool.h>
+
+
+/*
+ * THREAD QUEUE
+ * ============
+ *
+ * This backend connects two threads of the same process. Each direction is a ring of buffer
+ * descriptors with a power of two number of slots, written by one thread and read by the other.
+ *
+ * The producer index (head) and the consumer index (tail) are on separate cache lines, each
+ * together with the copy of the other index its owner has seen last. The owner only reloads
+ * the other index when the copy says the ring is full or empty, so in the steady state every
+ * line is written by one thread only. The slots are published with a release store of the
+ * index and taken over with an acquire load of it.
+ *
+ * Both ends share one region pool, registering a region doesn't involve the other thread. The
+ * pool is locked, as a region may be registered while the other thread checks its buffers.
+ */
+
+
+///< the default number of slots per direction
+#define THREADQ_DEFAULT_SIZE 64
+
+///< the size of a cache line
+#define THREADQ_CACHELINE 64
+
+
+///< one direction of the queue
+struct threadq_ring
+{
+    ///< the slots, read-only for both threads after creation
+    struct cleanq_buf *slots;
+
+    ///< the number of slots minus one
+    uint64_t mask;
+
+    ///< the next slot to be written, owned by the producer
+    __attribute__((aligned(THREADQ_CACHELINE))) _Atomic uint64_t head;
+
+    ///< the consumer index as last seen by the producer
+    uint64_t tail_cache;
+
+    ///< the next slot to be read, owned by the consumer
+    __attribute__((aligned(THREADQ_CACHELINE))) _Atomic uint64_t tail;
+
+    ///< the producer index as last seen by the consumer
+    uint64_t head_cache;
+};
+
+
+///< the state shared by both ends
+struct threadq_shared
+{
+    ///< the two directions, end a transmits on ring 0
+    struct threadq_ring rings[2];
+
+    ///< the number of ends that have not been destroyed yet
+    _Atomic uint32_t refs;
+};
+
+
+///< defines the thread queue backend
+struct cleanq_threadq
+{
+    ///< generic cleanq part
+    struct cleanq q;
+
+    ///< the ring this end enqueues into
+    struct threadq_ring *tx;
+
+    ///< the ring this end dequeues from
+    struct threadq_ring *rx;
+
+    ///< the state shared with the other end
+    struct threadq_shared *shared;
+};
+
+
+/*
+ * ================================================================================================
+ * Ring Operations
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the number of free slots of the transmit ring
+ *
+ * @param r     the ring
+ * @param head  the producer index
+ * @param need  the number of slots the producer wants
+ *
+ * @returns the number of free slots, the consumer index is reloaded if there are fewer than need
+ */
+static inline uint64_t threadq_tx_space(struct threadq_ring *r, uint64_t head, uint64_t need)
+{
+    uint64_t space = r->mask + 1 - (head - r->tail_cache);
+    if (space < need) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        space = r->mask + 1 - (head - r->tail_cache);
+    }
+
+    return space;
+}
+
+
+/**
+ * @brief obtains the number of used slots of the receive ring
+ *
+ * @param r     the ring
+ * @param tail  the consumer index
+ * @param need  the number of slots the consumer wants
+ *
+ * @returns the number of used slots, the producer index is reloaded if there are fewer than need
+ */
+static inline uint64_t threadq_rx_avail(struct threadq_ring *r, uint64_t tail, uint64_t need)
+{
+    uint64_t avail = r->head_cache - tail;
+    if (avail < need) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        avail = r->head_cache - tail;
+    }
+
+    return avail;
+}
+
+
+/**
+ * @brief publishes the slots written by the producer
+ *
+ * @param q     the queue
+ * @param head  the new producer index
+ */
+static inline void threadq_tx_publish(struct cleanq_threadq *q, uint64_t head)
+{
+    atomic_store_explicit(&q->tx->head, head, memory_order_release);
+    cleanq_stats_occupancy(&q->q, head - q->tx->tail_cache);
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Operations
+ * ================================================================================================
+ */
+
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Enqueue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_enqueue(struct cleanq *q, regionid_t rid, genoffset_t offset,
+                                genoffset_t length, genoffset_t valid_data,
+                                genoffset_t valid_length, uint64_t flags)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->tx;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (threadq_tx_space(r, head, 1) == 0) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    struct cleanq_buf *b = &r->slots[head & r->mask];
+    b->rid = rid;
+    b->offset = offset;
+    b->length = length;
+    b->valid_data = valid_data;
+    b->valid_length = valid_length;
+    b->flags = flags;
+
+    threadq_tx_publish(tq, head + 1);
+
+    return CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Dequeue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_dequeue(struct cleanq *q, regionid_t *rid, genoffset_t *offset,
+                                genoffset_t *length, genoffset_t *valid_data,
+                                genoffset_t *valid_length, uint64_t *flags)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->rx;
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (threadq_rx_avail(r, tail, 1) == 0) {
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    struct cleanq_buf *b = &r->slots[tail & r->mask];
+    *rid = b->rid;
+    *offset = b->offset;
+    *length = b->length;
+    *valid_data = b->valid_data;
+    *valid_length = b->valid_length;
+    *flags = b->flags;
+
+    /* the slot must be read before the producer may reuse it */
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    return CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Batched Enqueue() / Dequeue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_enqueue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                      size_t *num_enq)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->tx;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t count = threadq_tx_space(r, head, num);
+    if (count > num) {
+        count = num;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        r->slots[(head + i) & r->mask] = bufs[i];
+    }
+
+    if (count) {
+        threadq_tx_publish(tq, head + count);
+    }
+
+    *num_enq = count;
+    return (count == 0) ? CLEANQ_ERR_QUEUE_FULL : CLEANQ_ERR_OK;
+}
+
+static errval_t threadq_dequeue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                      size_t *num_deq)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->rx;
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t count = threadq_rx_avail(r, tail, num);
+    if (count > num) {
+        count = num;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        bufs[i] = r->slots[(tail + i) & r->mask];
+    }
+
+    if (count) {
+        atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+    }
+
+    *num_deq = count;
+    return (count == 0) ? CLEANQ_ERR_QUEUE_EMPTY : CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Chained Enqueue() / Dequeue()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_enqueue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->tx;
+
+    if (num > r->mask + 1) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* the segments are published with a single store of the producer index */
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (threadq_tx_space(r, head, num) < num) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    size_t num_enq;
+    return threadq_enqueue_batch(q, bufs, num, &num_enq);
+}
+
+static errval_t threadq_dequeue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                      size_t *num_deq)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_ring *r = tq->rx;
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t avail = threadq_rx_avail(r, tail, r->mask + 1);
+    if (avail == 0) {
+        *num_deq = 0;
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    /* chains are published at once, the chain ends with the last segment */
+    uint64_t count = 0;
+    while (count < avail) {
+        struct cleanq_buf *b = &r->slots[(tail + count) & r->mask];
+        count++;
+        if (b->flags & CLEANQ_FLAG_LAST) {
+            break;
+        }
+    }
+
+    if (count > num) {
+        *num_deq = count;
+        return CLEANQ_ERR_CHAIN_TOO_LONG;
+    }
+
+    return threadq_dequeue_batch(q, bufs, count, num_deq);
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Notify()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_notify(struct cleanq *q)
+{
+    (void)(q);
+
+    /* the other thread polls the ring */
+    return CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Register() / Deregister()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_register(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)(q);
+    (void)(cap);
+    (void)(region_id);
+
+    /* the region pool is shared, the other end already has the region */
+    return CLEANQ_ERR_OK;
+}
+
+static errval_t threadq_deregister(struct cleanq *q, regionid_t region_id)
+{
+    (void)(q);
+    (void)(region_id);
+
+    return CLEANQ_ERR_OK;
+}
+
+/*
+ * ------------------------------------------------------------------------------------------------
+ * Control()
+ * ------------------------------------------------------------------------------------------------
+ */
+
+static errval_t threadq_control(struct cleanq *q, uint64_t request, uint64_t value,
+                                uint64_t *result)
+{
+    (void)(q);
+    (void)(request);
+    (void)(value);
+    (void)(result);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Destruction
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief destroys one end of a thread queue, the rings are freed with the last end
+ *
+ * @param q    the end of the thread queue
+ */
+static errval_t threadq_destroy(struct cleanq *q)
+{
+    assert(q);
+
+    struct cleanq_threadq *tq = (struct cleanq_threadq *)q;
+    struct threadq_shared *shared = tq->shared;
+
+    if (atomic_fetch_sub_explicit(&shared->refs, 1, memory_order_acq_rel) == 1) {
+        free(shared->rings[0].slots);
+        free(shared->rings[1].slots);
+        free(shared);
+    }
+
+    free(tq);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Creation
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief allocates and initializes one end of a thread queue
+ *
+ * @param shared    the state shared by both ends
+ * @param tx        the ring the end enqueues into
+ * @param rx        the ring the end dequeues from
+ * @param pool      the region pool of the other end, NULL for the first end
+ *
+ * @returns the end, NULL if it could not be initialized
+ */
+static struct cleanq_threadq *threadq_create_end(struct threadq_shared *shared,
+                                                 struct threadq_ring *tx, struct threadq_ring *rx,
+                                                 struct region_pool *pool)
+{
+    struct cleanq_threadq *tq = calloc(1, sizeof(struct cleanq_threadq));
+    if (tq == NULL) {
+        return NULL;
+    }
+
+    /* initialize generic part */
+    errval_t err = cleanq_init(&tq->q);
+    if (err_is_fail(err)) {
+        free(tq);
+        return NULL;
+    }
+
+    /* both ends share the regions, each end is used by its own thread */
+    if (pool) {
+        region_pool_destroy(tq->q.pool);
+        tq->q.pool = region_pool_share(pool, true);
+    }
+
+    cleanq_init_stats(&tq->q, &tq->q.local_stats, tx->mask + 1);
+
+    tq->tx = tx;
+    tq->rx = rx;
+    tq->shared = shared;
+
+    /* setting the function pointers */
+    tq->q.f.enq = threadq_enqueue;
+    tq->q.f.deq = threadq_dequeue;
+    tq->q.f.enq_batch = threadq_enqueue_batch;
+    tq->q.f.deq_batch = threadq_dequeue_batch;
+    tq->q.f.enq_chain = threadq_enqueue_chain;
+    tq->q.f.deq_chain = threadq_dequeue_chain;
+    tq->q.f.reg = threadq_register;
+    tq->q.f.dereg = threadq_deregister;
+    tq->q.f.ctrl = threadq_control;
+    tq->q.f.notify = threadq_notify;
+    tq->q.f.destroy = threadq_destroy;
+
+    atomic_fetch_add_explicit(&shared->refs, 1, memory_order_relaxed);
+
+    return tq;
+}
+
+
+/**
+ * @brief creates the two ends of a thread queue
+ *
+ * @param a         Return pointer to the first end
+ * @param b         Return pointer to the second end
+ * @param slots     The number of buffers per direction, a power of two, 0 selects the default
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the number of slots is invalid,
+ *          CLEANQ_ERR_MALLOC_FAIL if the queue could not be allocated
+ */
+errval_t cleanq_threadq_create(struct cleanq_threadq **a, struct cleanq_threadq **b, size_t slots)
+{
+    assert(a && b);
+
+    if (slots == 0) {
+        slots = THREADQ_DEFAULT_SIZE;
+    }
+
+    if ((slots & (slots - 1)) || slots > UINT32_MAX) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    /* the indices of the rings must not share a cache line with anything else */
+    struct threadq_shared *shared = aligned_alloc(THREADQ_CACHELINE,
+                                                  sizeof(struct threadq_shared));
+    if (shared == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    atomic_init(&shared->refs, 0);
+
+    size_t size = slots * sizeof(struct cleanq_buf);
+    size = (size + THREADQ_CACHELINE - 1) & ~((size_t)THREADQ_CACHELINE - 1);
+
+    for (int i = 0; i < 2; i++) {
+        struct threadq_ring *r = &shared->rings[i];
+        r->slots = aligned_alloc(THREADQ_CACHELINE, size);
+        r->mask = slots - 1;
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        r->tail_cache = 0;
+        r->head_cache = 0;
+    }
+
+    if (shared->rings[0].slots == NULL || shared->rings[1].slots == NULL) {
+        goto err_free;
+    }
+
+    struct cleanq_threadq *qa = threadq_create_end(shared, &shared->rings[0], &shared->rings[1],
+                                                   NULL);
+    if (qa == NULL) {
+        goto err_free;
+    }
+
+    struct cleanq_threadq *qb = threadq_create_end(shared, &shared->rings[1], &shared->rings[0],
+                                                   qa->q.pool);
+    if (qb == NULL) {
+        /* frees the rings as well */
+        cleanq_destroy(&qa->q);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    /* setting the return pointers */
+    *a = qa;
+    *b = qb;
+
+    return CLEANQ_ERR_OK;
+
+err_free:
+    free(shared->rings[0].slots);
+    free(shared->rings[1].slots);
+    free(shared);
+    return CLEANQ_ERR_MALLOC_FAIL;
+}
@@ -0,0 +1,1241 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/virtio_queue.h>
+#include <cleanq_backend.h>
+#include <cleanq_shm.h>
+#include <cleanq_memfd.h>
+#include <region_pool.h>
+
+
+/*
+ * ================================================================================================
+ * Debugging Facility
+ * ================================================================================================
+ */
+
+///< enable or disable debugging of this backend
+//#define VIRTQ_DEBUG_ENABLED 1
+
+///< the name of this programm
+extern char *__progname;
+
+#if defined(VIRTQ_DEBUG_ENABLED)
+#    define VIRTQ_DEBUG(x...)                                                                     \
+        do {                                                                                      \
+            printf("VIRTQ:%s:%s:%d: ", __progname, __func__, __LINE__);                           \
+            printf(x);                                                                            \
+        } while (0)
+#else
+#    define VIRTQ_DEBUG(x...) ((void)0)
+#endif
+
+
+/*
+ * ================================================================================================
+ * Virtio Queue Type Definitions
+ * ================================================================================================
+ */
+
+///< this is the default number of descriptors of a virtqueue, as for virtio-net
+#define VIRTQ_DEFAULT_SIZE 256
+
+///< the largest number of descriptors of a packed virtqueue
+#define VIRTQ_MAX_SIZE 32768
+
+///< the size of the control line at the start of each channel
+#define VIRTQ_CTRL_SIZE 64
+
+
+///< descriptor flag: the buffer continues in the next descriptor, not used
+#define VIRTQ_DESC_F_NEXT (1U << 0)
+
+///< descriptor flag: the buffer is write-only for the device, set for buffers without valid data
+#define VIRTQ_DESC_F_WRITE (1U << 1)
+
+///< descriptor flag: available, equal to the wrap counter of the driver when made available
+#define VIRTQ_DESC_F_AVAIL (1U << 7)
+
+///< descriptor flag: used, differs from AVAIL while available, equal to it once used
+#define VIRTQ_DESC_F_USED (1U << 15)
+
+///< the descriptor flags carrying the wrap counters
+#define VIRTQ_DESC_F_WRAP (VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED)
+
+
+///< event suppression flag: notifications are disabled
+#define VIRTQ_EVENT_F_DISABLE 0x1
+
+
+/*
+ * Shared Memory Layout
+ * --------------------
+ *
+ *  +--------+-------+-------------+-------------+-------+-------------+-------------+
+ *  | header | ctrl0 | desc ring 0 | ext table 0 | ctrl1 | desc ring 1 | ext table 1 |
+ *  +--------+-------+-------------+-------------+-------+-------------+-------------+
+ *
+ * Each channel is a virtio 1.1 packed virtqueue. The creator receives on channel 0 and transmits
+ * on channel 1. The control line holds the driver and device event suppression structures of the
+ * virtqueue, both disabled as the endpoints poll, followed by the futex word the receiver of the
+ * channel sleeps on and the doorbell of the pollset it may be part of.
+ *
+ * The descriptor ring is laid out as the virtio specification has it, in little endian. The
+ * sender makes a buffer available in the next descriptor with its address, its length and the
+ * index of the descriptor as buffer id, and publishes it with the avail and used flags set to
+ * its wrap counter and its inverse. The receiver takes the descriptors in order. It returns them
+ * as VIRTIO_F_IN_ORDER allows: a single used descriptor in place of the first one of a batch,
+ * carrying the buffer id of the last one, frees all of them. A buffer is owned by the receiver
+ * once it has been dequeued, the used descriptors only free the slots.
+ *
+ * The address of a buffer is the physical base address of its region plus the offset, the region
+ * pool of the receiver maps it back. The extension table holds the valid part and the flags of
+ * the buffer for the descriptor with the same index, other virtio implementations ignore it.
+ * Regions are registered over the command channels, see cleanq_shm.h.
+ */
+
+
+///< a descriptor of a packed virtqueue
+struct virtq_desc
+{
+    ///< the address of the buffer
+    uint64_t addr;
+
+    ///< the length of the buffer
+    uint32_t len;
+
+    ///< the buffer id, the index of the descriptor
+    uint16_t id;
+
+    ///< the flags, VIRTQ_DESC_F_*, written last
+    volatile uint16_t flags;
+};
+
+
+///< the part of a buffer not covered by the descriptor
+struct virtq_desc_ext
+{
+    ///< the offset of the valid data into the buffer
+    uint64_t valid_data;
+
+    ///< the length of the valid data
+    uint64_t valid_length;
+
+    ///< the flags of the buffer
+    uint64_t flags;
+
+    ///< padding
+    uint64_t reserved;
+};
+
+
+///< the event suppression structure of the driver or the device
+struct virtq_event
+{
+    ///< the descriptor to be notified about, with the wrap counter in the top bit
+    volatile uint16_t desc;
+
+    ///< VIRTQ_EVENT_F_*
+    volatile uint16_t flags;
+};
+
+
+///< the control line at the start of each channel
+union __attribute__((aligned(VIRTQ_CTRL_SIZE))) virtq_chan_ctrl
+{
+    struct {
+        ///< written by the driver, whether it wants to be notified of used descriptors
+        struct virtq_event driver_event;
+
+        ///< written by the device, whether it wants to be notified of available descriptors
+        struct virtq_event device_event;
+
+        ///< futex word, set while the receiver of the channel sleeps
+        volatile uint32_t waiters;
+
+        ///< the doorbell the sender rings on a notification
+        struct cleanq_shm_doorbell doorbell;
+    };
+
+    ///< padding to a full cache line
+    uint8_t pad[VIRTQ_CTRL_SIZE];
+};
+
+
+///< the sending side of a virtqueue
+struct virtq_driver
+{
+    ///< the descriptor ring
+    struct virtq_desc *ring;
+
+    ///< the extension table
+    struct virtq_desc_ext *ext;
+
+    ///< the number of descriptors minus one
+    uint32_t mask;
+
+    ///< the next descriptor to make available
+    uint32_t avail_idx;
+
+    ///< the avail and used flags of descriptors made available in this round
+    uint16_t avail_flags;
+
+    ///< the avail and used flags of a used descriptor in this round
+    uint16_t used_flags;
+
+    ///< the next descriptor the device returns
+    uint32_t used_idx;
+
+    ///< the number of free descriptors, as of the last check for used ones
+    uint32_t num_free;
+};
+
+
+///< the receiving side of a virtqueue
+struct virtq_device
+{
+    ///< the descriptor ring
+    struct virtq_desc *ring;
+
+    ///< the extension table
+    struct virtq_desc_ext *ext;
+
+    ///< the number of descriptors minus one
+    uint32_t mask;
+
+    ///< the next descriptor to take
+    uint32_t avail_idx;
+
+    ///< the avail and used flags of an available descriptor in this round
+    uint16_t avail_flags;
+
+    ///< the avail and used flags to write into a used descriptor in this round
+    uint16_t used_flags;
+
+    ///< the descriptor the next used descriptor is written to
+    uint32_t used_idx;
+
+    ///< the number of descriptors taken but not returned yet
+    uint32_t pending;
+
+    ///< the buffer id of the last descriptor taken
+    uint16_t last_id;
+
+    ///< return the descriptors once this many are pending
+    uint32_t ack_batch;
+};
+
+
+///< the last region an address was translated for
+struct virtq_region_cache
+{
+    ///< the generation of the region pool the entry is valid for
+    uint64_t gen;
+
+    ///< the region
+    regionid_t rid;
+
+    ///< the base address of the region
+    uint64_t base;
+
+    ///< the length of the region, 0 if the entry is unused
+    uint64_t len;
+};
+
+
+///< defines a virtio queue CleanQ backend
+struct cleanq_virtq
+{
+    ///< generic cleanq part
+    struct cleanq q;
+
+    ///< the virtqueue we send on
+    struct virtq_driver tx;
+
+    ///< the virtqueue we receive on
+    struct virtq_device rx;
+
+    ///< control line of the transmit channel
+    union virtq_chan_ctrl *tx_ctrl;
+
+    ///< control line of the receive channel
+    union virtq_chan_ctrl *rx_ctrl;
+
+    ///< the number of descriptors per virtqueue
+    uint32_t slots;
+
+    ///< the generation of the region pool, the caches are dropped when it changes
+    const uint64_t *pool_gen;
+
+    ///< the region of the last buffer sent
+    struct virtq_region_cache tx_cache;
+
+    ///< the region of the last buffer received
+    struct virtq_region_cache rx_cache;
+
+    ///< the number of microseconds to spin in virtq_wait() before sleeping
+    uint64_t wait_spin_us;
+
+    ///< the doorbell of the other side
+    struct cleanq_shm_doorbell_state doorbell;
+
+    ///< backing shared memory for descriptors
+    struct cleanq_shm shm;
+};
+
+
+/*
+ * ================================================================================================
+ * Address Translation
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief translates a buffer into the address of its descriptor
+ *
+ * @param q         the virtio queue
+ * @param rid       the region of the buffer
+ * @param offset    the offset of the buffer into the region
+ * @param addr      returns the address of the buffer
+ *
+ * @returns true on success, false if the region is not known
+ */
+static inline bool virtq_buf_to_addr(struct cleanq_virtq *q, regionid_t rid, genoffset_t offset,
+                                     uint64_t *addr)
+{
+    struct virtq_region_cache *c = &q->tx_cache;
+
+    if (c->rid != rid || c->gen != *q->pool_gen || c->len == 0) {
+        struct capref cap;
+        if (!region_pool_get_cap(q->q.pool, rid, &cap)) {
+            return false;
+        }
+        c->gen = *q->pool_gen;
+        c->rid = rid;
+        c->base = cap.paddr;
+        c->len = cap.len;
+    }
+
+    *addr = c->base + offset;
+
+    return true;
+}
+
+
+/**
+ * @brief translates the address of a descriptor into a region and an offset
+ *
+ * @param q         the virtio queue
+ * @param addr      the address of the buffer
+ * @param rid       returns the region of the buffer
+ * @param offset    returns the offset of the buffer into the region
+ *
+ * @returns true on success, false if no region contains the address
+ */
+static inline bool virtq_addr_to_buf(struct cleanq_virtq *q, uint64_t addr, regionid_t *rid,
+                                     genoffset_t *offset)
+{
+    struct virtq_region_cache *c = &q->rx_cache;
+
+    /* buffers of the same region usually follow each other */
+    if (c->gen != *q->pool_gen || addr - c->base >= c->len) {
+        struct capref cap;
+        if (!region_pool_find_addr(q->q.pool, addr, rid, offset)
+            || !region_pool_get_cap(q->q.pool, *rid, &cap)) {
+            return false;
+        }
+        c->gen = *q->pool_gen;
+        c->rid = *rid;
+        c->base = cap.paddr;
+        c->len = cap.len;
+    }
+
+    *rid = c->rid;
+    *offset = addr - c->base;
+
+    return true;
+}
+
+
+/*
+ * ================================================================================================
+ * Virtqueue Operations
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief initializes the sending side of a virtqueue
+ *
+ * @param d         the driver state
+ * @param ring      the descriptor ring
+ * @param slots     the number of descriptors
+ */
+static void virtq_driver_init(struct virtq_driver *d, void *ring, uint32_t slots)
+{
+    d->ring = ring;
+    d->ext = (struct virtq_desc_ext *)(d->ring + slots);
+    d->mask = slots - 1;
+    d->avail_idx = 0;
+    d->used_idx = 0;
+    d->num_free = slots;
+
+    /* both wrap counters start at 1 */
+    d->avail_flags = VIRTQ_DESC_F_AVAIL;
+    d->used_flags = VIRTQ_DESC_F_WRAP;
+}
+
+
+/**
+ * @brief initializes the receiving side of a virtqueue
+ *
+ * @param v         the device state
+ * @param ring      the descriptor ring
+ * @param slots     the number of descriptors
+ */
+static void virtq_device_init(struct virtq_device *v, void *ring, uint32_t slots)
+{
+    v->ring = ring;
+    v->ext = (struct virtq_desc_ext *)(v->ring + slots);
+    v->mask = slots - 1;
+    v->avail_idx = 0;
+    v->used_idx = 0;
+    v->pending = 0;
+    v->last_id = 0;
+    v->ack_batch = 1;
+
+    v->avail_flags = VIRTQ_DESC_F_AVAIL;
+    v->used_flags = VIRTQ_DESC_F_WRAP;
+}
+
+
+/**
+ * @brief collects the descriptors the device has returned
+ *
+ * @param d     the driver state
+ *
+ * @returns the number of free descriptors
+ */
+static inline uint32_t virtq_driver_reclaim(struct virtq_driver *d)
+{
+    uint32_t slots = d->mask + 1;
+
+    while (d->num_free < slots) {
+        struct virtq_desc *u = &d->ring[d->used_idx];
+        uint16_t flags = __atomic_load_n(&u->flags, __ATOMIC_ACQUIRE);
+        if ((flags & VIRTQ_DESC_F_WRAP) != d->used_flags) {
+            break;
+        }
+
+        /* in order, the used descriptor frees everything up to the buffer id it carries */
+        uint32_t n = ((u->id - d->used_idx) & d->mask) + 1;
+        if (n > slots - d->num_free) {
+            n = slots - d->num_free;
+        }
+
+        d->num_free += n;
+        d->used_idx += n;
+        if (d->used_idx > d->mask) {
+            d->used_idx -= slots;
+            d->used_flags ^= VIRTQ_DESC_F_WRAP;
+        }
+    }
+
+    return d->num_free;
+}
+
+
+/**
+ * @brief fills in the next descriptor to be made available, without publishing it
+ *
+ * @param q     the virtio queue
+ * @param b     the buffer
+ *
+ * @returns the flags that publish the descriptor, 0 if the region is not known
+ */
+static inline uint16_t virtq_driver_fill(struct cleanq_virtq *q, const struct cleanq_buf *b)
+{
+    struct virtq_driver *d = &q->tx;
+
+    uint64_t addr;
+    if (!virtq_buf_to_addr(q, b->rid, b->offset, &addr)) {
+        return 0;
+    }
+
+    uint32_t i = d->avail_idx;
+    struct virtq_desc_ext *x = &d->ext[i];
+    x->valid_data = b->valid_data;
+    x->valid_length = b->valid_length;
+    x->flags = b->flags;
+
+    struct virtq_desc *desc = &d->ring[i];
+    desc->addr = addr;
+    desc->len = (uint32_t)b->length;
+    desc->id = (uint16_t)i;
+
+    uint16_t flags = d->avail_flags;
+    if (b->valid_length == 0) {
+        flags |= VIRTQ_DESC_F_WRITE;
+    }
+
+    d->avail_idx++;
+    d->num_free--;
+    if (d->avail_idx > d->mask) {
+        d->avail_idx = 0;
+        d->avail_flags ^= VIRTQ_DESC_F_WRAP;
+    }
+
+    return flags;
+}
+
+
+/**
+ * @brief checks if the next descriptor is available
+ *
+ * @param v     the device state
+ *
+ * @returns true if the descriptor has been made available
+ */
+static inline bool virtq_device_avail(struct virtq_device *v)
+{
+    uint16_t flags = __atomic_load_n(&v->ring[v->avail_idx].flags, __ATOMIC_ACQUIRE);
+    return (flags & VIRTQ_DESC_F_WRAP) == v->avail_flags;
+}
+
+
+/**
+ * @brief takes the next available descriptor, it must be available
+ *
+ * @param v     the device state
+ * @param b     returns the buffer with its address in the offset
+ */
+static inline void virtq_device_take(struct virtq_device *v, struct cleanq_buf *b)
+{
+    struct virtq_desc *desc = &v->ring[v->avail_idx];
+    b->offset = desc->addr;
+    b->length = desc->len;
+
+    /* a driver that isn't a CleanQ endpoint leaves the table alone, the ids are ours then */
+    struct virtq_desc_ext *x = &v->ext[desc->id & v->mask];
+    b->valid_data = x->valid_data;
+    b->valid_length = x->valid_length;
+    b->flags = x->flags;
+
+    v->last_id = desc->id;
+    v->pending++;
+    v->avail_idx++;
+    if (v->avail_idx > v->mask) {
+        v->avail_idx = 0;
+        v->avail_flags ^= VIRTQ_DESC_F_WRAP;
+    }
+}
+
+
+/**
+ * @brief puts back the descriptors taken last, they are taken again next time
+ *
+ * @param v     the device state
+ * @param num   the number of descriptors to put back, at most the pending ones
+ */
+static inline void virtq_device_untake(struct virtq_device *v, uint32_t num)
+{
+    if (num == 0) {
+        return;
+    }
+
+    if (v->avail_idx < num) {
+        v->avail_idx += v->mask + 1;
+        v->avail_flags ^= VIRTQ_DESC_F_WRAP;
+    }
+    v->avail_idx -= num;
+    v->pending -= num;
+
+    /* the descriptors before the pending ones have not been returned, they are still intact */
+    v->last_id = v->ring[(v->avail_idx - 1) & v->mask].id;
+}
+
+
+/**
+ * @brief returns the descriptors that have been taken with a single used descriptor
+ *
+ * @param v     the device state
+ *
+ * The descriptors must have been read completely, the driver reuses them right away.
+ */
+static inline void virtq_device_return(struct virtq_device *v)
+{
+    if (v->pending == 0) {
+        return;
+    }
+
+    struct virtq_desc *u = &v->ring[v->used_idx];
+    u->id = v->last_id;
+    u->len = 0;
+    __atomic_store_n(&u->flags, v->used_flags, __ATOMIC_RELEASE);
+
+    v->used_idx += v->pending;
+    v->pending = 0;
+    if (v->used_idx > v->mask) {
+        v->used_idx -= v->mask + 1;
+        v->used_flags ^= VIRTQ_DESC_F_WRAP;
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Statistics
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief samples the occupancy of the transmit virtqueue once per round through the ring
+ *
+ * @param q         the virtio queue
+ * @param oldidx    the next descriptor before the enqueue
+ * @param sent      the number of descriptors that have been made available
+ */
+static inline void virtq_stats_sent(struct cleanq_virtq *q, uint32_t oldidx, size_t sent)
+{
+    if (sent == 0) {
+        cleanq_stats_occupancy(&q->q, q->slots);
+    } else if (q->tx.avail_idx <= oldidx) {
+        cleanq_stats_occupancy(&q->q, q->slots - virtq_driver_reclaim(&q->tx));
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Datapath functions
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief enqueue a buffer into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Id of the memory region the buffer belongs to
+ * @param offset        Offset into the region i.e. where the buffer starts that is enqueued
+ * @param lenght        Lenght of the enqueued buffer
+ * @param valid_data    Offset into the buffer where the valid data of this buffer starts
+ * @param valid_length  Length of the valid data of this buffer
+ * @param misc_flags    Any other argument that makes sense to the queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_enqueue(struct cleanq *queue, regionid_t region_id, genoffset_t offset,
+                              genoffset_t length, genoffset_t valid_data,
+                              genoffset_t valid_length, uint64_t misc_flags)
+{
+    struct cleanq_virtq *q = (struct cleanq_virtq *)queue;
+    struct virtq_driver *d = &q->tx;
+
+    if (length > UINT32_MAX) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    if (d->num_free == 0 && virtq_driver_reclaim(d) == 0) {
+        virtq_stats_sent(q, d->avail_idx, 0);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    struct cleanq_buf b = {
+        .rid = region_id,
+        .offset = offset,
+        .length = length,
+        .valid_data = valid_data,
+        .valid_length = valid_length,
+        .flags = misc_flags,
+    };
+
+    uint32_t oldidx = d->avail_idx;
+    uint32_t i = d->avail_idx;
+    uint16_t flags = virtq_driver_fill(q, &b);
+    if (flags == 0) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* the body of the descriptor must be visible before it is available */
+    __atomic_store_n(&d->ring[i].flags, flags, __ATOMIC_RELEASE);
+
+    virtq_stats_sent(q, oldidx, 1);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a buffer from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param region_offset Return pointer to the offset into the region where this buffer starts.
+ * @param lenght        Return pointer to the lenght of the dequeue buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_dequeue(struct cleanq *queue, regionid_t *region_id, genoffset_t *offset,
+                              genoffset_t *length, genoffset_t *valid_data,
+                              genoffset_t *valid_length, uint64_t *misc_flags)
+{
+    struct cleanq_virtq *q = (struct cleanq_virtq *)queue;
+    struct virtq_device *v = &q->rx;
+
+    if (!virtq_device_avail(v)) {
+        /* the sender must not wait for descriptors we hold back */
+        virtq_device_return(v);
+        cleanq_shm_cmd_poll(&q->shm);
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    struct cleanq_buf b;
+    virtq_device_take(v, &b);
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    if (!virtq_addr_to_buf(q, b.offset, region_id, offset)) {
+        /* drop the descriptor, as the other backends drop invalid buffers, and hand it back */
+        VIRTQ_DEBUG("no region for address %lx\n", b.offset);
+        virtq_device_return(v);
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    if (v->pending >= v->ack_batch) {
+        virtq_device_return(v);
+    }
+
+    *length = b.length;
+    *valid_data = b.valid_data;
+    *valid_length = b.valid_length;
+    *misc_flags = b.flags;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief enqueue a batch of buffers into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of buffers that have been enqueued
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no buffer could be enqueued, CLEANQ_ERR_OK otherwise
+ *
+ * The descriptors after the first one are made available before the first one, which publishes
+ * the entire batch to the receiver with a single barrier.
+ */
+static errval_t virtq_enqueue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                    size_t *num_enq)
+{
+    struct cleanq_virtq *q = (struct cleanq_virtq *)queue;
+    struct virtq_driver *d = &q->tx;
+
+    size_t n = virtq_driver_reclaim(d);
+    if (n > num) {
+        n = num;
+    }
+
+    uint32_t first = d->avail_idx;
+    uint16_t first_flags = 0;
+
+    size_t count;
+    for (count = 0; count < n; count++) {
+        if (bufs[count].length > UINT32_MAX) {
+            break;
+        }
+
+        uint32_t i = d->avail_idx;
+        uint16_t flags = virtq_driver_fill(q, &bufs[count]);
+        if (flags == 0) {
+            break;
+        }
+
+        if (count == 0) {
+            first_flags = flags;
+        } else {
+            __atomic_store_n(&d->ring[i].flags, flags, __ATOMIC_RELAXED);
+        }
+    }
+
+    *num_enq = count;
+    if (count) {
+        __atomic_store_n(&d->ring[first].flags, first_flags, __ATOMIC_RELEASE);
+    }
+
+    virtq_stats_sent(q, first, count);
+
+    if (count == 0) {
+        return (n == 0) ? CLEANQ_ERR_QUEUE_FULL : CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a batch of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if nothing was dequeued, CLEANQ_ERR_OK otherwise
+ *
+ * All descriptors are read before they are returned with a single used descriptor. With a
+ * batch set via CLEANQ_CTRL_ACK_BATCH, returning is deferred until enough descriptors are
+ * pending or the virtqueue has been drained. The batch stops before the first buffer whose
+ * address belongs to no region. If that is the first one, its descriptor is dropped and returned
+ * to the driver, and CLEANQ_ERR_INVALID_BUFFER_ARGS is returned. Otherwise the descriptor stays
+ * in the queue for the next dequeue, which drops it and reports the error once.
+ */
+static errval_t virtq_dequeue_batch(struct cleanq *queue, struct cleanq_buf *bufs, size_t num,
+                                    size_t *num_deq)
+{
+    struct cleanq_virtq *q = (struct cleanq_virtq *)queue;
+    struct virtq_device *v = &q->rx;
+
+    size_t n;
+    for (n = 0; n < num; n++) {
+        if (!virtq_device_avail(v)) {
+            break;
+        }
+        virtq_device_take(v, &bufs[n]);
+    }
+
+    cleanq_shm_cmd_poll(&q->shm);
+
+    size_t count;
+    for (count = 0; count < n; count++) {
+        struct cleanq_buf *b = &bufs[count];
+        uint64_t addr = b->offset;
+        if (!virtq_addr_to_buf(q, addr, &b->rid, &b->offset)) {
+            VIRTQ_DEBUG("no region for address %lx\n", addr);
+            break;
+        }
+    }
+
+    /* a leading buffer without a region is dropped, the buffers after it are left in the queue */
+    bool drop = (count == 0 && n > 0);
+    virtq_device_untake(v, n - count - drop);
+
+    if (drop || count < num || v->pending >= v->ack_batch) {
+        virtq_device_return(v);
+    }
+
+    *num_deq = count;
+    if (count == 0) {
+        return n ? CLEANQ_ERR_INVALID_BUFFER_ARGS : CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Send a notification about new buffers on the queue
+ *
+ * @param q      The queue to call the operation on
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_notify(struct cleanq *q)
+{
+    struct cleanq_virtq *vq = (struct cleanq_virtq *)q;
+
+    errval_t err = cleanq_shm_wake(&vq->tx_ctrl->waiters);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the receiver may also wait for the queue in a pollset */
+    return cleanq_shm_doorbell_ring(&vq->tx_ctrl->doorbell, &vq->doorbell);
+}
+
+
+static bool virtq_wait_can_recv(void *arg)
+{
+    struct cleanq_virtq *vq = arg;
+    return virtq_device_avail(&vq->rx) || cleanq_shm_cmd_pending(&vq->shm);
+}
+
+
+/**
+ * @brief Waits until there is something to dequeue or the timeout expires
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ */
+static errval_t virtq_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    struct cleanq_virtq *vq = (struct cleanq_virtq *)q;
+
+    /* the sender may be waiting for the descriptors we hold back */
+    virtq_device_return(&vq->rx);
+
+    return cleanq_shm_wait(&vq->rx_ctrl->waiters, virtq_wait_can_recv, vq, vq->wait_spin_us,
+                           timeout_us);
+}
+
+
+/**
+ * @brief Sets the doorbell the other side rings on a notification
+ *
+ * @param q         The queue to call the operation on
+ * @param name      The name of the doorbell object, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_doorbell(struct cleanq *q, const char *name, uint32_t bit)
+{
+    struct cleanq_virtq *vq = (struct cleanq_virtq *)q;
+
+    return cleanq_shm_doorbell_announce(&vq->rx_ctrl->doorbell, name, bit);
+}
+
+
+/*
+ * ================================================================================================
+ * Memory Registration and Deregistration
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Add a memory region that can be used as buffers to the queue
+ *
+ * @param q              The queue to call the operation on
+ * @param cap            A Capability for some memory
+ * @param region_id      Return pointer to a region id that is assigned
+ *                       to the memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_register(struct cleanq *q, struct capref cap, regionid_t rid)
+{
+    return cleanq_shm_register(&((struct cleanq_virtq *)q)->shm, cap, rid);
+}
+
+/**
+ * @brief Add several memory regions without waiting for the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param caps          The capabilities of the memory regions
+ * @param rids          The region ids
+ * @param num           The number of regions
+ * @param token         The token of the batch
+ * @param num_reg       Return pointer to the number of regions that have been sent
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_register_batch(struct cleanq *q, const struct capref *caps,
+                                     const regionid_t *rids, size_t num, uint64_t token,
+                                     size_t *num_reg)
+{
+    return cleanq_shm_register_batch(&((struct cleanq_virtq *)q)->shm, caps, rids, num, token,
+                                     num_reg);
+}
+
+
+/**
+ * @brief Acknowledges a batch of registrations of the other side
+ *
+ * @param q             The queue to call the operation on
+ * @param token         The token of the batch
+ * @param err           The outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_register_ack(struct cleanq *q, uint64_t token, errval_t err)
+{
+    return cleanq_shm_register_ack(&((struct cleanq_virtq *)q)->shm, token, err);
+}
+
+
+/**
+ * @brief Remove a memory region
+ *
+ * @param q              The queue to call the operation on
+ * @param region_id      The region id to remove from the queues memory
+ * @param cap            The capability to the removed memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_deregister(struct cleanq *q, regionid_t rid)
+{
+    return cleanq_shm_deregister(&((struct cleanq_virtq *)q)->shm, rid);
+}
+
+
+/*
+ * ================================================================================================
+ * Control Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Send a control message to the queue
+ *
+ * @param q          The queue to call the operation on
+ * @param request    The type of the control message*
+ * @param value      The value for the request
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_control(struct cleanq *q, uint64_t request, uint64_t value,
+                              uint64_t *result)
+{
+    struct cleanq_virtq *vq = (struct cleanq_virtq *)q;
+
+    switch (request) {
+    case CLEANQ_CTRL_WAIT_SPIN_US:
+        if (result) {
+            *result = vq->wait_spin_us;
+        }
+        vq->wait_spin_us = value;
+        break;
+    case CLEANQ_CTRL_ACK_BATCH:
+        if (result) {
+            *result = vq->rx.ack_batch;
+        }
+        /* the descriptors held back must not be more than there are */
+        vq->rx.ack_batch = (value == 0) ? 1 : (value > vq->slots) ? vq->slots : (uint32_t)value;
+        virtq_device_return(&vq->rx);
+        break;
+    case CLEANQ_CTRL_INLINE_MAX:
+        if (result) {
+            *result = 0;
+        }
+        break;
+    case CLEANQ_CTRL_RING_NODE: {
+        /* the rings start with their control line, they are on the same page */
+        int node;
+        errval_t err = cleanq_numa_memory_node(value ? (void *)vq->tx_ctrl : (void *)vq->rx_ctrl,
+                                               &node);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        if (result) {
+            *result = (uint64_t)node;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Destruction and Creation
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief destroys the queue
+ *
+ * @param q     The queue state to free (and the queue to be shut down)
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t virtq_destroy(struct cleanq *q)
+{
+    struct cleanq_virtq *vq = (struct cleanq_virtq *)q;
+
+    cleanq_shm_doorbell_unmap(&vq->doorbell);
+    cleanq_shm_close(&vq->shm);
+
+    free(q);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief initializes a virtio queue
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_virtq_create(struct cleanq_virtq **q, const char *name, bool clear)
+{
+    return cleanq_virtq_create_with_attr(q, name, clear, NULL);
+}
+
+
+/**
+ * @brief initializes a virtio queue with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_virtq_create_with_attr(struct cleanq_virtq **q, const char *name, bool clear,
+                                       const struct cleanq_virtq_attr *attr)
+{
+    errval_t err;
+    struct cleanq_virtq *newq;
+
+    VIRTQ_DEBUG("create start\n");
+
+    /* the geometry the creator will use, a slot is a descriptor and its extension */
+    struct cleanq_shm_header geometry;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.backend = CLEANQ_SHM_BACKEND_VIRTQ;
+    geometry.slots = (attr && attr->slots) ? attr->slots : VIRTQ_DEFAULT_SIZE;
+    geometry.desc_size = sizeof(struct virtq_desc) + sizeof(struct virtq_desc_ext);
+    geometry.desc_align = VIRTQ_CTRL_SIZE;
+    geometry.flags = CLEANQ_SHM_FLAG_STATS;
+
+    /* the buffer ids are the indices of the descriptors */
+    if (!cleanq_shm_is_pow2(geometry.slots) || geometry.slots > VIRTQ_MAX_SIZE) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    /* the creator receives on channel 0, this is where it places the rings */
+    err = cleanq_shm_set_placement(&geometry, attr ? attr->numa : CLEANQ_NUMA_FIRST_TOUCH,
+                                   attr ? attr->numa_node : 0, 0);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the object lives somewhere else, the attaching side has to know where to look */
+    uint32_t mem_flags = attr ? attr->mem_flags : 0;
+    if (mem_flags & CLEANQ_MEM_HUGETLB) {
+        geometry.flags |= CLEANQ_SHM_FLAG_HUGETLB;
+    }
+
+    cleanq_shm_layout(&geometry);
+
+    newq = (struct cleanq_virtq *)calloc(sizeof(struct cleanq_virtq), 1);
+    if (newq == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    /* create or attach to the shared memory, this gets us the geometry of the creator */
+    err = cleanq_shm_open(&newq->shm, name, clear, &geometry, mem_flags, false);
+    if (err_is_fail(err)) {
+        goto cleanup1;
+    }
+    cleanq_shm_cmd_bind(&newq->shm, &newq->q);
+
+    /* the layout of another version of this backend would be misread */
+    if (geometry.desc_size != sizeof(struct virtq_desc) + sizeof(struct virtq_desc_ext)
+        || geometry.desc_align != VIRTQ_CTRL_SIZE || !cleanq_shm_is_pow2(geometry.slots)
+        || geometry.slots > VIRTQ_MAX_SIZE) {
+        printf("WARNING: shared memory object %s has an incompatible layout.\n", name);
+        goto cleanup2;
+    }
+
+    /* without the socket, regions can't be shared with the other side but the queue works */
+    if (err_is_fail(cleanq_shm_fd_open(&newq->shm))) {
+        VIRTQ_DEBUG("no socket for passing file descriptors on %s\n", name);
+    }
+
+    bool creator = newq->shm.creator;
+    size_t chan_size = cleanq_shm_chan_size(&geometry);
+    uint8_t *chan0 = (uint8_t *)newq->shm.mem + geometry.hdrsize;
+    uint8_t *chan1 = chan0 + chan_size;
+
+    /* the descriptors are unused until the flags say otherwise, whatever the clear argument */
+    if (creator) {
+        memset(chan0, 0, 2 * chan_size);
+        for (int i = 0; i < 2; i++) {
+            union virtq_chan_ctrl *ctrl = (union virtq_chan_ctrl *)(i ? chan1 : chan0);
+            ctrl->driver_event.flags = VIRTQ_EVENT_F_DISABLE;
+            ctrl->device_event.flags = VIRTQ_EVENT_F_DISABLE;
+        }
+    }
+
+    newq->slots = (uint32_t)geometry.slots;
+    newq->rx_ctrl = (union virtq_chan_ctrl *)(creator ? chan0 : chan1);
+    newq->tx_ctrl = (union virtq_chan_ctrl *)(creator ? chan1 : chan0);
+    newq->wait_spin_us = CLEANQ_WAIT_DEFAULT_SPIN_US;
+
+    /* the descriptor rings start after the control line */
+    virtq_device_init(&newq->rx, (uint8_t *)newq->rx_ctrl + geometry.desc_align, newq->slots);
+    virtq_driver_init(&newq->tx, (uint8_t *)newq->tx_ctrl + geometry.desc_align, newq->slots);
+
+    /* initializing  the generic cleanq part */
+    err = cleanq_init(&newq->q);
+    if (err_is_fail(err)) {
+        goto cleanup2;
+    }
+
+    newq->pool_gen = region_pool_generation(newq->q.pool);
+
+    /* the statistics live next to the channels, where others can read them */
+    struct cleanq_stats *stats = cleanq_shm_stats(&newq->shm);
+    if (stats) {
+        cleanq_init_stats(&newq->q, stats, geometry.slots);
+    }
+
+    /* setting the function pointers */
+    newq->q.f.enq = virtq_enqueue;
+    newq->q.f.deq = virtq_dequeue;
+    newq->q.f.enq_batch = virtq_enqueue_batch;
+    newq->q.f.deq_batch = virtq_dequeue_batch;
+    newq->q.f.reg = virtq_register;
+    newq->q.f.dereg = virtq_deregister;
+    newq->q.f.reg_batch = virtq_register_batch;
+    newq->q.f.reg_ack = virtq_register_ack;
+    newq->q.f.notify = virtq_notify;
+    newq->q.f.wait = virtq_wait;
+    newq->q.f.doorbell = virtq_doorbell;
+    newq->q.f.ctrl = virtq_control;
+    newq->q.f.destroy = virtq_destroy;
+
+    /* the queue is ready to be used by the other side */
+    cleanq_shm_publish(&newq->shm);
+
+    *q = newq;
+
+    VIRTQ_DEBUG("create end %p \n", *q);
+
+    return CLEANQ_ERR_OK;
+
+cleanup2:
+    cleanq_shm_close(&newq->shm);
+cleanup1:
+    free(newq);
+
+    return CLEANQ_ERR_INIT_QUEUE;
+}
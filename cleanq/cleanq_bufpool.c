@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/bufpool.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Type Definitions
+ * ================================================================================================
+ */
+
+
+///< marks the end of the free list
+#define BUFPOOL_NIL UINT32_MAX
+
+///< the number of buffers a per-core cache holds
+#define BUFPOOL_CACHE_SIZE 32
+
+///< the head of the free list is the index of the top buffer and a tag against ABA
+#define BUFPOOL_HEAD(tag, idx) (((uint64_t)(tag) << 32) | (idx))
+#define BUFPOOL_HEAD_IDX(head) ((uint32_t)(head))
+#define BUFPOOL_HEAD_TAG(head) ((uint32_t)((head) >> 32))
+
+
+///< the free buffers cached by a core
+struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT))) bufpool_cache
+{
+    ///< taken by the thread using the cache
+    volatile uint32_t lock;
+
+    ///< the number of cached buffers
+    uint32_t count;
+
+    ///< the indices of the cached buffers
+    uint32_t bufs[BUFPOOL_CACHE_SIZE];
+};
+
+
+///< the buffer pool type
+struct cleanq_bufpool
+{
+    ///< the head of the free list, written by all threads
+    struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT)))
+    {
+        volatile uint64_t head;
+    };
+
+    ///< the next buffer in the free list, indexed by buffer
+    volatile uint32_t *next;
+
+    ///< the per-core caches, NULL without CLEANQ_BUFPOOL_FLAG_PERCPU
+    struct bufpool_cache *caches;
+
+    ///< the number of per-core caches
+    uint32_t num_caches;
+
+    ///< the number of buffers in the pool
+    uint32_t num_bufs;
+
+    ///< the offset of the first buffer into the region
+    genoffset_t base;
+
+    ///< the size of a buffer
+    genoffset_t bufsize;
+
+    ///< the region the buffers belong to
+    regionid_t rid;
+
+    ///< the memory of the region
+    struct capref cap;
+};
+
+
+/*
+ * ================================================================================================
+ * Free List
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief pushes a chain of buffers onto the free list
+ *
+ * @param bp        The buffer pool
+ * @param first     The first buffer of the chain
+ * @param last      The last buffer of the chain, its next is overwritten
+ */
+static void bufpool_push(struct cleanq_bufpool *bp, uint32_t first, uint32_t last)
+{
+    uint64_t head = bp->head;
+    uint64_t new_head;
+    do {
+        bp->next[last] = BUFPOOL_HEAD_IDX(head);
+        new_head = BUFPOOL_HEAD(BUFPOOL_HEAD_TAG(head) + 1, first);
+    } while (!__atomic_compare_exchange_n(&bp->head, &head, new_head, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+
+/**
+ * @brief pops a buffer from the free list
+ *
+ * @param bp        The buffer pool
+ *
+ * @returns the index of the buffer, or BUFPOOL_NIL if the list is empty
+ */
+static uint32_t bufpool_pop(struct cleanq_bufpool *bp)
+{
+    uint64_t head = __atomic_load_n(&bp->head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    do {
+        uint32_t idx = BUFPOOL_HEAD_IDX(head);
+        if (idx == BUFPOOL_NIL) {
+            return BUFPOOL_NIL;
+        }
+
+        /* the next index may be stale if the buffer got taken, the tag rejects the exchange */
+        new_head = BUFPOOL_HEAD(BUFPOOL_HEAD_TAG(head) + 1, bp->next[idx]);
+    } while (!__atomic_compare_exchange_n(&bp->head, &head, new_head, true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    return BUFPOOL_HEAD_IDX(head);
+}
+
+
+/*
+ * ================================================================================================
+ * Per-Core Caches
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief takes the cache of the current core
+ *
+ * @param bp        The buffer pool
+ *
+ * @returns pointer to the locked cache, or NULL if there is none or it is in use
+ */
+static struct bufpool_cache *bufpool_cache_get(struct cleanq_bufpool *bp)
+{
+    if (bp->caches == NULL) {
+        return NULL;
+    }
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (uint32_t)cpu >= bp->num_caches) {
+        return NULL;
+    }
+
+    /* another thread on the same core holds it, use the shared list instead */
+    struct bufpool_cache *cache = &bp->caches[cpu];
+    if (__sync_lock_test_and_set(&cache->lock, 1)) {
+        return NULL;
+    }
+
+    return cache;
+}
+
+
+/**
+ * @brief releases a cache taken with bufpool_cache_get()
+ *
+ * @param cache     The cache
+ */
+static inline void bufpool_cache_put(struct bufpool_cache *cache)
+{
+    __sync_lock_release(&cache->lock);
+}
+
+
+/**
+ * @brief takes a buffer from the caches of the other cores, the shared list is empty
+ *
+ * @param bp        The buffer pool
+ *
+ * @returns the index of the buffer, or BUFPOOL_NIL if all buffers are in use
+ */
+static uint32_t bufpool_cache_steal(struct cleanq_bufpool *bp)
+{
+    for (uint32_t i = 0; i < bp->num_caches; i++) {
+        struct bufpool_cache *cache = &bp->caches[i];
+        if (cache->count == 0) {
+            continue;
+        }
+
+        while (__sync_lock_test_and_set(&cache->lock, 1)) {
+            sched_yield();
+        }
+
+        uint32_t idx = BUFPOOL_NIL;
+        if (cache->count > 0) {
+            idx = cache->bufs[--cache->count];
+        }
+        bufpool_cache_put(cache);
+
+        if (idx != BUFPOOL_NIL) {
+            return idx;
+        }
+    }
+
+    return BUFPOOL_NIL;
+}
+
+
+/*
+ * ================================================================================================
+ * Buffer Pool Creation and Destruction
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief creates a new buffer pool on a registered region
+ *
+ * @param bp        Return pointer to the buffer pool
+ * @param cap       The memory of the region
+ * @param rid       The region id the memory has been registered with
+ * @param bufsize   The size of the buffers, rounded up to CLEANQ_BUFFER_ALIGNMENT
+ * @param flags     The flags of the pool, CLEANQ_BUFPOOL_FLAG_*
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_bufpool_create(struct cleanq_bufpool **bp, struct capref cap, regionid_t rid,
+                               size_t bufsize, uint32_t flags)
+{
+    if (bufsize == 0) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* the buffers are aligned in virtual memory */
+    uintptr_t vaddr = (uintptr_t)cap.vaddr;
+    genoffset_t base = ((vaddr + CLEANQ_BUFFER_ALIGNMENT - 1) & ~(CLEANQ_BUFFER_ALIGNMENT - 1))
+                       - vaddr;
+    bufsize = (bufsize + CLEANQ_BUFFER_ALIGNMENT - 1) & ~(CLEANQ_BUFFER_ALIGNMENT - 1);
+
+    if (cap.len < base + bufsize) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    size_t num_bufs = (cap.len - base) / bufsize;
+    if (num_bufs >= BUFPOOL_NIL) {
+        num_bufs = BUFPOOL_NIL - 1;
+    }
+
+    struct cleanq_bufpool *newbp = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT,
+                                                 sizeof(struct cleanq_bufpool));
+    if (newbp == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+    memset(newbp, 0, sizeof(*newbp));
+
+    newbp->next = malloc(num_bufs * sizeof(uint32_t));
+    if (newbp->next == NULL) {
+        free(newbp);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    if (flags & CLEANQ_BUFPOOL_FLAG_PERCPU) {
+        long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+        newbp->num_caches = (ncpus > 0) ? (uint32_t)ncpus : 1;
+        newbp->caches = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT,
+                                      newbp->num_caches * sizeof(struct bufpool_cache));
+        if (newbp->caches == NULL) {
+            free((void *)newbp->next);
+            free(newbp);
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+        memset(newbp->caches, 0, newbp->num_caches * sizeof(struct bufpool_cache));
+    }
+
+    newbp->num_bufs = num_bufs;
+    newbp->base = base;
+    newbp->bufsize = bufsize;
+    newbp->rid = rid;
+    newbp->cap = cap;
+
+    /* the buffers are handed out from the start of the region */
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        newbp->next[i] = i + 1;
+    }
+    newbp->next[num_bufs - 1] = BUFPOOL_NIL;
+    newbp->head = BUFPOOL_HEAD(0, 0);
+
+    *bp = newbp;
+
+    DQI_DEBUG("Created buffer pool rid=%u bufs=%zu bufsize=%zu\n", rid, num_bufs, bufsize);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief destroys a buffer pool, the region is not deregistered
+ *
+ * @param bp        The buffer pool to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_bufpool_destroy(struct cleanq_bufpool *bp)
+{
+    free(bp->caches);
+    free((void *)bp->next);
+    free(bp);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Allocating and Freeing Buffers
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief allocates a buffer from the pool
+ *
+ * @param bp        The buffer pool
+ * @param rid       Return pointer to the region id of the buffer
+ * @param offset    Return pointer to the offset of the buffer into the region
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_EMPTY if all buffers are in use
+ */
+errval_t cleanq_bufpool_alloc(struct cleanq_bufpool *bp, regionid_t *rid, genoffset_t *offset)
+{
+    uint32_t idx;
+
+    struct bufpool_cache *cache = bufpool_cache_get(bp);
+    if (cache) {
+        if (cache->count == 0) {
+            /* fill half of the cache, so a following free doesn't need to flush */
+            while (cache->count < BUFPOOL_CACHE_SIZE / 2) {
+                idx = bufpool_pop(bp);
+                if (idx == BUFPOOL_NIL) {
+                    break;
+                }
+                cache->bufs[cache->count++] = idx;
+            }
+        }
+
+        idx = (cache->count > 0) ? cache->bufs[--cache->count] : BUFPOOL_NIL;
+        bufpool_cache_put(cache);
+    } else {
+        idx = bufpool_pop(bp);
+    }
+
+    if (idx == BUFPOOL_NIL && bp->caches) {
+        idx = bufpool_cache_steal(bp);
+    }
+
+    if (idx == BUFPOOL_NIL) {
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    *rid = bp->rid;
+    *offset = bp->base + (genoffset_t)idx * bp->bufsize;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief returns a buffer to the pool
+ *
+ * @param bp        The buffer pool
+ * @param rid       The region id of the buffer
+ * @param offset    The offset of the buffer into the region
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_bufpool_free(struct cleanq_bufpool *bp, regionid_t rid, genoffset_t offset)
+{
+    if (rid != bp->rid) {
+        return CLEANQ_ERR_INVALID_REGION_ID;
+    }
+
+    if (offset < bp->base || (offset - bp->base) % bp->bufsize != 0
+        || (offset - bp->base) / bp->bufsize >= bp->num_bufs) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    uint32_t idx = (offset - bp->base) / bp->bufsize;
+
+    struct bufpool_cache *cache = bufpool_cache_get(bp);
+    if (cache == NULL) {
+        bufpool_push(bp, idx, idx);
+        return CLEANQ_ERR_OK;
+    }
+
+    if (cache->count == BUFPOOL_CACHE_SIZE) {
+        /* return the older half of the cache as one chain */
+        for (uint32_t i = 0; i < BUFPOOL_CACHE_SIZE / 2 - 1; i++) {
+            bp->next[cache->bufs[i]] = cache->bufs[i + 1];
+        }
+        bufpool_push(bp, cache->bufs[0], cache->bufs[BUFPOOL_CACHE_SIZE / 2 - 1]);
+
+        memmove(cache->bufs, cache->bufs + BUFPOOL_CACHE_SIZE / 2,
+                (BUFPOOL_CACHE_SIZE / 2) * sizeof(uint32_t));
+        cache->count = BUFPOOL_CACHE_SIZE / 2;
+    }
+
+    cache->bufs[cache->count++] = idx;
+    bufpool_cache_put(cache);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Getters
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the size of the buffers of the pool
+ *
+ * @param bp        The buffer pool
+ *
+ * @returns the buffer size in bytes
+ */
+size_t cleanq_bufpool_get_bufsize(struct cleanq_bufpool *bp)
+{
+    return bp->bufsize;
+}
+
+
+/**
+ * @brief obtains the virtual address of a buffer
+ *
+ * @param bp        The buffer pool
+ * @param offset    The offset of the buffer into the region
+ *
+ * @returns pointer to the buffer
+ */
+void *cleanq_bufpool_get_vaddr(struct cleanq_bufpool *bp, genoffset_t offset)
+{
+    return (uint8_t *)bp->cap.vaddr + offset;
+}
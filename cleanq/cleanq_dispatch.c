@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/dispatch.h>
+#include <cleanq_backend.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Type Definitions
+ * ================================================================================================
+ */
+
+
+///< the default number of buffers in a worker deque
+#define DISPATCH_DEFAULT_SLOTS 256
+
+///< the default number of buffers dequeued from the queue at once
+#define DISPATCH_DEFAULT_BATCH 32
+
+///< the default number of completed buffers enqueued into the queue at once
+#define DISPATCH_DEFAULT_RETURN_BATCH 32
+
+
+///< the state of a worker
+struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT))) dispatch_worker
+{
+    ///< the oldest buffer of the deque, advanced by the thieves and the owner
+    struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT)))
+    {
+        volatile int64_t top;
+    };
+
+    ///< the end of the deque after the newest buffer, written by the owner only
+    struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT)))
+    {
+        volatile int64_t bottom;
+    };
+
+    ///< the buffers of the deque, indexed modulo the number of slots
+    struct cleanq_buf *slots;
+
+    ///< the buffers dequeued from the queue before they go into the deque
+    struct cleanq_buf *in;
+
+    ///< the completed buffers to be enqueued into the queue
+    struct cleanq_buf *done;
+
+    ///< the number of completed buffers
+    size_t num_done;
+};
+
+
+///< the dispatcher type
+struct cleanq_dispatch
+{
+    ///< taken by the worker that uses the queue
+    struct __attribute__((aligned(CLEANQ_BUFFER_ALIGNMENT)))
+    {
+        volatile uint32_t busy;
+    };
+
+    ///< the queue the buffers are received from and returned to
+    struct cleanq *q;
+
+    ///< the workers
+    struct dispatch_worker *workers;
+
+    ///< the number of workers
+    size_t num_workers;
+
+    ///< the number of slots of a deque minus one
+    size_t mask;
+
+    ///< the maximum number of buffers dequeued at once
+    size_t batch;
+
+    ///< the number of completed buffers enqueued at once
+    size_t return_batch;
+
+    ///< called with the buffers the queue rejects, may be NULL
+    cleanq_dispatch_dropped_callback_t dropped;
+
+    ///< the first argument of the dropped callback
+    void *dropped_arg;
+};
+
+
+/*
+ * ================================================================================================
+ * Worker Deques
+ * ================================================================================================
+ */
+
+
+/*
+ * The deques are the work-stealing deques of Chase and Lev with a fixed number of slots. The
+ * owner pushes and pops at the bottom, the thieves take from the top. Only the last buffer is
+ * contended, whoever advances top first gets it. A slot is only reused once top has passed it,
+ * so a thief that has read a slot being overwritten fails to advance top and discards it.
+ */
+
+
+/**
+ * @brief pushes a buffer onto the bottom of the deque of a worker, called by the owner
+ *
+ * @param d         The dispatcher
+ * @param w         The worker
+ * @param buf       The buffer
+ *
+ * @returns true on success, false if the deque is full
+ */
+static bool dispatch_push(struct cleanq_dispatch *d, struct dispatch_worker *w,
+                          const struct cleanq_buf *buf)
+{
+    int64_t b = w->bottom;
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if ((size_t)(b - t) > d->mask) {
+        return false;
+    }
+
+    w->slots[b & d->mask] = *buf;
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/**
+ * @brief pops the newest buffer from the deque of a worker, called by the owner
+ *
+ * @param d         The dispatcher
+ * @param w         The worker
+ * @param buf       Return pointer to the buffer
+ *
+ * @returns true on success, false if the deque is empty
+ */
+static bool dispatch_pop(struct cleanq_dispatch *d, struct dispatch_worker *w,
+                         struct cleanq_buf *buf)
+{
+    int64_t b = w->bottom - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        /* empty */
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    *buf = w->slots[b & d->mask];
+    if (t < b) {
+        return true;
+    }
+
+    /* the last buffer, race the thieves for it */
+    bool won = __atomic_compare_exchange_n(&w->top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                           __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+
+    return won;
+}
+
+
+/**
+ * @brief steals the oldest buffer from the deque of a worker
+ *
+ * @param d         The dispatcher
+ * @param w         The worker to steal from
+ * @param buf       Return pointer to the buffer
+ *
+ * @returns true on success, false if the deque is empty or another thread got the buffer
+ */
+static bool dispatch_steal(struct cleanq_dispatch *d, struct dispatch_worker *w,
+                           struct cleanq_buf *buf)
+{
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) {
+        return false;
+    }
+
+    *buf = w->slots[t & d->mask];
+
+    return __atomic_compare_exchange_n(&w->top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED);
+}
+
+
+/*
+ * ================================================================================================
+ * Queue Access
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief takes the queue for the calling worker
+ *
+ * @param d         The dispatcher
+ * @param wait      Wait until the other worker has released the queue
+ *
+ * @returns true if the queue has been taken, false if it is in use
+ */
+static bool dispatch_lock(struct cleanq_dispatch *d, bool wait)
+{
+    while (__sync_lock_test_and_set(&d->busy, 1)) {
+        if (!wait) {
+            return false;
+        }
+        sched_yield();
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief releases the queue taken with dispatch_lock()
+ *
+ * @param d         The dispatcher
+ */
+static inline void dispatch_unlock(struct cleanq_dispatch *d)
+{
+    __sync_lock_release(&d->busy);
+}
+
+
+/**
+ * @brief enqueues the completed buffers of a worker into the queue, the queue is taken
+ *
+ * @param d         The dispatcher
+ * @param w         The worker
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if some buffers did not fit, or the
+ *          error of the queue if it rejected buffers, which have been handed to the callback
+ */
+static errval_t dispatch_return(struct cleanq_dispatch *d, struct dispatch_worker *w)
+{
+    errval_t ret = CLEANQ_ERR_OK;
+
+    while (w->num_done) {
+        size_t num_enq = 0;
+        errval_t err = cleanq_enqueue_batch(d->q, w->done, w->num_done, &num_enq);
+        if (num_enq == 0 && err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+            /* a single rejected buffer fails the batch, try the first one on its own */
+            struct cleanq_buf *b = &w->done[0];
+            err = cleanq_enqueue(d->q, b->rid, b->offset, b->length, b->valid_data,
+                                 b->valid_length, b->flags);
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                DQI_DEBUG("dispatch dropped buffer rid=%u offset=%lu err=%d\n", b->rid,
+                          b->offset, err);
+                if (d->dropped) {
+                    d->dropped(d->dropped_arg, b, err);
+                }
+                ret = err;
+            }
+            num_enq = (err == CLEANQ_ERR_QUEUE_FULL) ? 0 : 1;
+        }
+
+        w->num_done -= num_enq;
+        memmove(w->done, w->done + num_enq, w->num_done * sizeof(struct cleanq_buf));
+
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            return err_is_ok(ret) ? err : ret;
+        }
+    }
+
+    return ret;
+}
+
+
+/**
+ * @brief dequeues a batch from the queue into the deque of a worker, the queue is taken
+ *
+ * @param d         The dispatcher
+ * @param w         The worker, its deque is empty
+ * @param buf       Return pointer to the oldest buffer of the batch
+ *
+ * @returns CLEANQ_ERR_OK on success, or the error of the queue
+ */
+static errval_t dispatch_refill(struct cleanq_dispatch *d, struct dispatch_worker *w,
+                                struct cleanq_buf *buf)
+{
+    size_t num_deq = 0;
+    errval_t err = cleanq_dequeue_batch(d->q, w->in, d->batch, &num_deq);
+    if (num_deq == 0) {
+        return err;
+    }
+
+    /* the owner pops from the bottom, push the oldest last so that it goes first */
+    for (size_t i = num_deq - 1; i > 0; i--) {
+        bool pushed = dispatch_push(d, w, &w->in[i]);
+        assert(pushed);
+        (void)pushed;
+    }
+    *buf = w->in[0];
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Dispatcher Creation and Destruction
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief creates a new dispatcher on a queue
+ *
+ * @param d         Return pointer to the dispatcher
+ * @param q         The queue to receive the buffers from and to return them to
+ * @param workers   The number of workers
+ * @param attr      The attributes of the dispatcher, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_dispatch_create(struct cleanq_dispatch **d, struct cleanq *q, size_t workers,
+                                const struct cleanq_dispatch_attr *attr)
+{
+    assert(d);
+    assert(q);
+
+    struct cleanq_dispatch_attr a = { 0 };
+    if (attr) {
+        a = *attr;
+    }
+    if (a.slots == 0) {
+        a.slots = DISPATCH_DEFAULT_SLOTS;
+    }
+    if (a.batch == 0) {
+        a.batch = (a.slots < DISPATCH_DEFAULT_BATCH) ? a.slots : DISPATCH_DEFAULT_BATCH;
+    }
+    if (a.return_batch == 0) {
+        a.return_batch = DISPATCH_DEFAULT_RETURN_BATCH;
+    }
+
+    if (workers == 0 || (a.slots & (a.slots - 1)) || a.batch > a.slots) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    struct cleanq_dispatch *disp = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT,
+                                                 sizeof(struct cleanq_dispatch));
+    if (disp == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+    memset(disp, 0, sizeof(struct cleanq_dispatch));
+
+    disp->workers = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT,
+                                  workers * sizeof(struct dispatch_worker));
+    if (disp->workers == NULL) {
+        free(disp);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+    memset(disp->workers, 0, workers * sizeof(struct dispatch_worker));
+
+    disp->q = q;
+    disp->num_workers = workers;
+    disp->mask = a.slots - 1;
+    disp->batch = a.batch;
+    disp->return_batch = a.return_batch;
+    disp->dropped = a.dropped;
+    disp->dropped_arg = a.dropped_arg;
+
+    for (size_t i = 0; i < workers; i++) {
+        struct dispatch_worker *w = &disp->workers[i];
+        w->slots = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT, a.slots * sizeof(struct cleanq_buf));
+        w->in = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT, a.batch * sizeof(struct cleanq_buf));
+        w->done = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT,
+                                2 * a.return_batch * sizeof(struct cleanq_buf));
+        if (w->slots == NULL || w->in == NULL || w->done == NULL) {
+            disp->num_workers = i + 1;
+            cleanq_dispatch_destroy(disp);
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+    }
+
+    DQI_DEBUG("dispatch create q=%p workers=%zu slots=%zu batch=%zu\n", (void *)q, workers,
+              a.slots, a.batch);
+
+    *d = disp;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief destroys a dispatcher, the queue is not destroyed
+ *
+ * @param d         The dispatcher to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_dispatch_destroy(struct cleanq_dispatch *d)
+{
+    assert(d);
+
+    errval_t ret = CLEANQ_ERR_OK;
+    for (size_t i = 0; i < d->num_workers; i++) {
+        struct dispatch_worker *w = &d->workers[i];
+        if (w->done) {
+            errval_t err = dispatch_return(d, w);
+            if (err_is_fail(err)) {
+                ret = err;
+            }
+
+            /* the queue is full, the buffers won't get another chance */
+            for (size_t j = 0; d->dropped && j < w->num_done; j++) {
+                d->dropped(d->dropped_arg, &w->done[j], CLEANQ_ERR_QUEUE_FULL);
+            }
+        }
+
+        free(w->slots);
+        free(w->in);
+        free(w->done);
+    }
+
+    free(d->workers);
+    free(d);
+
+    return ret;
+}
+
+
+/*
+ * ================================================================================================
+ * Dispatching Buffers
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the next buffer for a worker
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ * @param buf       Return pointer to the buffer
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_EMPTY if there is nothing to process
+ */
+errval_t cleanq_dispatch_get(struct cleanq_dispatch *d, size_t worker, struct cleanq_buf *buf)
+{
+    assert(d);
+    assert(buf);
+    assert(worker < d->num_workers);
+
+    struct dispatch_worker *w = &d->workers[worker];
+    if (dispatch_pop(d, w, buf)) {
+        return CLEANQ_ERR_OK;
+    }
+
+    /* take the work that has been dequeued already before dequeueing more */
+    for (size_t i = 1; i < d->num_workers; i++) {
+        struct dispatch_worker *victim = &d->workers[(worker + i) % d->num_workers];
+        if (dispatch_steal(d, victim, buf)) {
+            return CLEANQ_ERR_OK;
+        }
+    }
+
+    if (!dispatch_lock(d, false)) {
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    /* the queue is ours anyway, return the completed buffers on the way */
+    if (w->num_done) {
+        dispatch_return(d, w);
+    }
+    errval_t err = dispatch_refill(d, w, buf);
+
+    dispatch_unlock(d);
+
+    return err;
+}
+
+
+/**
+ * @brief returns a buffer the worker is done with
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ * @param buf       The buffer to be enqueued into the queue
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if the buffer could not be taken
+ */
+errval_t cleanq_dispatch_put(struct cleanq_dispatch *d, size_t worker,
+                             const struct cleanq_buf *buf)
+{
+    assert(d);
+    assert(buf);
+    assert(worker < d->num_workers);
+
+    struct dispatch_worker *w = &d->workers[worker];
+    errval_t err = CLEANQ_ERR_OK;
+
+    if (w->num_done == 2 * d->return_batch) {
+        /* there is no room left, the buffers have to go now */
+        dispatch_lock(d, true);
+        err = dispatch_return(d, w);
+        dispatch_unlock(d);
+
+        if (w->num_done == 2 * d->return_batch) {
+            return err_is_fail(err) ? err : CLEANQ_ERR_QUEUE_FULL;
+        }
+    }
+
+    w->done[w->num_done++] = *buf;
+
+    if (w->num_done >= d->return_batch && dispatch_lock(d, false)) {
+        errval_t ret = dispatch_return(d, w);
+        dispatch_unlock(d);
+        if (err_is_ok(err)) {
+            err = ret;
+        }
+    }
+
+    /* the buffer has been taken, a full queue is retried with the next batch */
+    return (err == CLEANQ_ERR_QUEUE_FULL) ? CLEANQ_ERR_OK : err;
+}
+
+
+/**
+ * @brief enqueues the completed buffers of a worker into the queue right away
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if some buffers did not fit, or the
+ *          error of the queue if it rejected buffers, which have been handed to the callback
+ */
+errval_t cleanq_dispatch_flush(struct cleanq_dispatch *d, size_t worker)
+{
+    assert(d);
+    assert(worker < d->num_workers);
+
+    struct dispatch_worker *w = &d->workers[worker];
+    if (w->num_done == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    dispatch_lock(d, true);
+    errval_t err = dispatch_return(d, w);
+    dispatch_unlock(d);
+
+    return err;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/fastpath.h>
+#include <cleanq_backend.h>
+#include <region_pool.h>
+
+
+/*
+ * ================================================================================================
+ * Fast Path Handles
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief initializes the backend independent part of a fast path handle
+ *
+ * @param f     the fast path handle
+ * @param q     the queue
+ */
+void cleanq_fast_init(struct cleanq_fast *f, struct cleanq *q)
+{
+    memset(f, 0, sizeof(struct cleanq_fast));
+
+    f->q = q;
+    f->stats = q->stats;
+    f->generation = region_pool_generation(q->pool);
+
+    /* the pool never reaches this generation, so the entries miss until they are filled */
+    for (size_t i = 0; i < CLEANQ_FAST_REGIONS; i++) {
+        f->regions[i].generation = UINT64_MAX;
+    }
+}
+
+
+/**
+ * @brief looks up a region of the queue and caches it in the fast path handle
+ *
+ * @param f     The fast path handle
+ * @param rid   The id of the region
+ *
+ * @returns true if the region is registered with the queue
+ */
+bool cleanq_fast_lookup_region(struct cleanq_fast *f, regionid_t rid)
+{
+    assert(f);
+
+    size_t len;
+    if (!region_pool_get_length(f->q->pool, rid, &len)) {
+        return false;
+    }
+
+    struct cleanq_fast_region *r = &f->regions[rid & (CLEANQ_FAST_REGIONS - 1)];
+    r->rid = rid;
+    r->len = len;
+    r->generation = *f->generation;
+
+    return true;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/histogram.h>
+#include <cleanq_backend.h>
+#include <cleanq_histogram.h>
+
+
+/*
+ * ================================================================================================
+ * Allocation and Reset
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief allocates and clears the histograms of a queue
+ *
+ * @returns pointer to the histograms, NULL on allocation failure
+ */
+struct cleanq_histograms *cleanq_histograms_alloc(void)
+{
+    struct cleanq_histograms *hist = malloc(sizeof(struct cleanq_histograms));
+    if (hist == NULL) {
+        return NULL;
+    }
+
+    memset(hist, 0, sizeof(struct cleanq_histograms));
+    for (size_t i = 0; i < CLEANQ_HIST_NUM_OPS; i++) {
+        hist->h[i].min = UINT64_MAX;
+    }
+
+    return hist;
+}
+
+
+/**
+ * @brief clears the histograms of a queue
+ *
+ * @param hist      the histograms to clear
+ *
+ * Values recorded concurrently with the reset may or may not be kept.
+ */
+void cleanq_histograms_reset(struct cleanq_histograms *hist)
+{
+    for (size_t i = 0; i < CLEANQ_HIST_NUM_OPS; i++) {
+        struct cleanq_histogram *h = &hist->h[i];
+        for (size_t b = 0; b < CLEANQ_HIST_NUM_BUCKETS; b++) {
+            __atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->min, UINT64_MAX, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Reading Percentiles
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the largest value that falls into a bucket
+ *
+ * @param idx   the index of the bucket
+ *
+ * @returns the upper bound of the bucket
+ */
+static uint64_t cleanq_histogram_bucket_max(size_t idx)
+{
+    if (idx < CLEANQ_HIST_SUB_BUCKETS) {
+        return idx;
+    }
+
+    if (idx == CLEANQ_HIST_NUM_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    size_t shift = (idx >> CLEANQ_HIST_SUB_BITS) - 1;
+    uint64_t sub = CLEANQ_HIST_SUB_BUCKETS + (idx & (CLEANQ_HIST_SUB_BUCKETS - 1));
+
+    return ((sub + 1) << shift) - 1;
+}
+
+
+/**
+ * @brief calculates several percentiles of a histogram in one pass
+ *
+ * @param h         the histogram
+ * @param pcts      the percentiles in ascending order
+ * @param values    returns the values of the percentiles
+ * @param num       the number of percentiles
+ *
+ * The reported value is the upper bound of the bucket, but never more than the recorded maximum.
+ */
+static void cleanq_histogram_percentiles(struct cleanq_histogram *h, const double *pcts,
+                                         uint64_t *values, size_t num)
+{
+    uint64_t counts[CLEANQ_HIST_NUM_BUCKETS];
+    uint64_t total = 0;
+
+    /* take a snapshot, the writer may continue while we are reading */
+    for (size_t b = 0; b < CLEANQ_HIST_NUM_BUCKETS; b++) {
+        counts[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        total += counts[b];
+    }
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    size_t b = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < num; i++) {
+        if (total == 0) {
+            values[i] = 0;
+            continue;
+        }
+
+        uint64_t rank = (uint64_t)(pcts[i] / 100.0 * (double)total + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        } else if (rank > total) {
+            rank = total;
+        }
+
+        while (seen + counts[b] < rank) {
+            seen += counts[b++];
+        }
+
+        uint64_t v = cleanq_histogram_bucket_max(b);
+        values[i] = (v > max) ? max : v;
+    }
+}
+
+
+/**
+ * @brief obtains the latency summary of an operation on the queue
+ *
+ * @param q         The queue
+ * @param op        The operation, CLEANQ_HIST_*
+ * @param lat       Return pointer to the summary
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_get_latency(struct cleanq *q, cleanq_hist_op_t op, struct cleanq_latency *lat)
+{
+    assert(q);
+    assert(lat);
+
+    if (op >= CLEANQ_HIST_NUM_OPS) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    memset(lat, 0, sizeof(struct cleanq_latency));
+
+    struct cleanq_histograms *hist = __atomic_load_n(&q->hist, __ATOMIC_ACQUIRE);
+    if (hist == NULL) {
+        return CLEANQ_ERR_OK;
+    }
+
+    struct cleanq_histogram *h = &hist->h[op];
+
+    lat->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (lat->count == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    lat->min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    lat->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    lat->mean = __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / lat->count;
+
+    const double pcts[3] = { 50.0, 99.0, 99.9 };
+    uint64_t values[3];
+    cleanq_histogram_percentiles(h, pcts, values, 3);
+
+    lat->p50 = values[0];
+    lat->p99 = values[1];
+    lat->p999 = values[2];
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief obtains an arbitrary percentile of the latency of an operation on the queue
+ *
+ * @param q         The queue
+ * @param op        The operation, CLEANQ_HIST_*
+ * @param pct       The percentile between 0 and 100, e.g. 99.99
+ *
+ * @returns the latency in cycles, 0 if nothing has been recorded yet
+ */
+uint64_t cleanq_get_latency_percentile(struct cleanq *q, cleanq_hist_op_t op, double pct)
+{
+    assert(q);
+
+    struct cleanq_histograms *hist = __atomic_load_n(&q->hist, __ATOMIC_ACQUIRE);
+    if (hist == NULL || op >= CLEANQ_HIST_NUM_OPS) {
+        return 0;
+    }
+
+    uint64_t value;
+    cleanq_histogram_percentiles(&hist->h[op], &pct, &value, 1);
+
+    return value;
+}
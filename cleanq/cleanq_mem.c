@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <mntent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq_mem.h>
+#include <debug.h>
+
+
+#ifndef MADV_POPULATE_WRITE
+///< prefaults writable page tables, since Linux 5.14
+#    define MADV_POPULATE_WRITE 23
+#endif
+
+///< the huge page size if the kernel doesn't tell
+#define MEM_DEFAULT_HUGE_PAGE_SIZE (2UL << 20)
+
+
+/**
+ * @brief obtains the size of the default huge pages
+ *
+ * @returns the size of a huge page in bytes
+ */
+size_t cleanq_mem_huge_page_size(void)
+{
+    static size_t huge_page_size;
+
+    size_t size = __atomic_load_n(&huge_page_size, __ATOMIC_RELAXED);
+    if (size) {
+        return size;
+    }
+
+    size = MEM_DEFAULT_HUGE_PAGE_SIZE;
+
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb) {
+                size = kb << 10;
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    __atomic_store_n(&huge_page_size, size, __ATOMIC_RELAXED);
+
+    return size;
+}
+
+
+/**
+ * @brief builds the path of a file on the hugetlbfs mount
+ *
+ * @param path      returns the path
+ * @param size      the size of the path buffer
+ * @param name      the name of the file, a leading slash is skipped
+ *
+ * @returns true on success, false if there is no hugetlbfs mounted or the name is too long
+ */
+bool cleanq_mem_hugetlbfs_path(char *path, size_t size, const char *name)
+{
+    FILE *f = setmntent("/proc/mounts", "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    /* take the first mount, it has the default page size unless configured otherwise */
+    bool found = false;
+    struct mntent *m;
+    while ((m = getmntent(f)) != NULL) {
+        if (strcmp(m->mnt_type, "hugetlbfs") == 0) {
+            int len = snprintf(path, size, "%s/%s", m->mnt_dir, name[0] == '/' ? name + 1 : name);
+            found = len > 0 && (size_t)len < size;
+            break;
+        }
+    }
+
+    endmntent(f);
+
+    return found;
+}
+
+
+/**
+ * @brief applies the page size hints of the memory flags to a fresh mapping
+ *
+ * @param addr      the start of the mapping, not touched yet
+ * @param len       the size of the mapping
+ * @param flags     the memory flags, CLEANQ_MEM_*
+ *
+ * Huge pages are only a hint, the mapping works even if the kernel has no transparent huge pages.
+ */
+void cleanq_mem_advise(void *addr, size_t len, uint32_t flags)
+{
+    if ((flags & CLEANQ_MEM_THP) && madvise(addr, len, MADV_HUGEPAGE)) {
+        DQI_DEBUG("no transparent huge pages for %p len=%zu\n", addr, len);
+    }
+}
+
+
+/**
+ * @brief prefaults and locks a mapping according to the memory flags
+ *
+ * @param addr      the start of the mapping
+ * @param len       the size of the mapping
+ * @param flags     the memory flags, CLEANQ_MEM_*
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_MALLOC_FAIL if the memory could not be locked
+ *
+ * The contents of the memory are not changed, the other side may already use it.
+ */
+errval_t cleanq_mem_populate(void *addr, size_t len, uint32_t flags)
+{
+    if (!(flags & (CLEANQ_MEM_PREFAULT | CLEANQ_MEM_LOCK))) {
+        return CLEANQ_ERR_OK;
+    }
+
+    /* older kernels don't have it, write faults without changing the memory instead */
+    if (madvise(addr, len, MADV_POPULATE_WRITE)) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < len; off += page) {
+            __atomic_fetch_add((uint8_t *)addr + off, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    if ((flags & CLEANQ_MEM_LOCK) && mlock(addr, len)) {
+        DQI_DEBUG("could not lock %p len=%zu\n", addr, len);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    return CLEANQ_ERR_OK;
+}
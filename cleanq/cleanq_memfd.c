@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq_mem.h>
+#include <cleanq_memfd.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Type Definitions
+ * ================================================================================================
+ */
+
+
+///< a region backed by a memory file, allocated here or mapped from the other side of a queue
+struct memfd_region
+{
+    ///< the start of the mapping
+    void *vaddr;
+
+    ///< the size of the mapping
+    size_t len;
+
+    ///< the file descriptor of the memory
+    int fd;
+
+    ///< the next region in the list
+    struct memfd_region *next;
+};
+
+
+///< the seals of the memory files, their size never changes
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+
+///< the regions allocated by this process
+static struct memfd_region *memfd_allocated;
+
+///< the regions mapped from the other side of a queue
+static struct memfd_region *memfd_imported;
+
+///< protects both lists, they are only used on the control path
+static pthread_mutex_t memfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * @brief adds a region to a list
+ *
+ * @param list  the list to add the region to
+ * @param vaddr the start of the mapping
+ * @param len   the size of the mapping
+ * @param fd    the file descriptor of the memory
+ *
+ * @returns CLEANQ_ERR_MALLOC_FAIL if there is no memory, CLEANQ_ERR_OK on success
+ */
+static errval_t memfd_insert(struct memfd_region **list, void *vaddr, size_t len, int fd)
+{
+    struct memfd_region *r = malloc(sizeof(*r));
+    if (r == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    r->vaddr = vaddr;
+    r->len = len;
+    r->fd = fd;
+
+    pthread_mutex_lock(&memfd_lock);
+    r->next = *list;
+    *list = r;
+    pthread_mutex_unlock(&memfd_lock);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes the region starting at an address from a list
+ *
+ * @param list  the list to remove the region from
+ * @param vaddr the start of the mapping
+ *
+ * @returns the removed region, NULL if there is none
+ */
+static struct memfd_region *memfd_remove(struct memfd_region **list, void *vaddr)
+{
+    pthread_mutex_lock(&memfd_lock);
+
+    struct memfd_region **prev = list;
+    struct memfd_region *r = *list;
+    while (r && r->vaddr != vaddr) {
+        prev = &r->next;
+        r = r->next;
+    }
+
+    if (r) {
+        *prev = r->next;
+    }
+
+    pthread_mutex_unlock(&memfd_lock);
+
+    return r;
+}
+
+
+/*
+ * ================================================================================================
+ * Allocation
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief allocates a region that can be shared with the other side of a queue
+ *
+ * @param cap   Return pointer to the memory of the region
+ * @param len   The size of the region in bytes, rounded up to the page size
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_memfd_alloc(struct capref *cap, size_t len)
+{
+    return cleanq_memfd_alloc_with_flags(cap, len, 0);
+}
+
+
+/**
+ * @brief allocates a region that can be shared with the other side of a queue
+ *
+ * @param cap   Return pointer to the memory of the region
+ * @param len   The size of the region in bytes, rounded up to the (huge) page size
+ * @param flags The backing of the region, CLEANQ_MEM_*
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_memfd_alloc_with_flags(struct capref *cap, size_t len, uint32_t flags)
+{
+    errval_t err;
+
+    assert(cap);
+
+    if (len == 0) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    unsigned int mfd_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (flags & CLEANQ_MEM_HUGETLB) {
+        mfd_flags |= MFD_HUGETLB;
+        page = cleanq_mem_huge_page_size();
+    } else if (flags & CLEANQ_MEM_THP) {
+        page = cleanq_mem_huge_page_size();
+    }
+
+    len = (len + page - 1) & ~(page - 1);
+
+    int fd = memfd_create("cleanq", mfd_flags);
+    if (fd == -1) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    /* the size is sealed, the other side can rely on the memory being there */
+    if (ftruncate(fd, (off_t)len) || fcntl(fd, F_ADD_SEALS, MEMFD_SEALS)) {
+        err = CLEANQ_ERR_MALLOC_FAIL;
+        goto cleanup1;
+    }
+
+    void *vaddr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vaddr == MAP_FAILED) {
+        err = CLEANQ_ERR_MALLOC_FAIL;
+        goto cleanup1;
+    }
+
+    /* the huge pages are reserved by mmap(), it fails if the pool doesn't have enough */
+    cleanq_mem_advise(vaddr, len, flags);
+    err = cleanq_mem_populate(vaddr, len, flags);
+    if (err_is_fail(err)) {
+        goto cleanup2;
+    }
+
+    err = memfd_insert(&memfd_allocated, vaddr, len, fd);
+    if (err_is_fail(err)) {
+        goto cleanup2;
+    }
+
+    /* like ordinary regions, the address keeps the regions of a queue apart in the pool */
+    cap->vaddr = vaddr;
+    cap->paddr = (uint64_t)vaddr;
+    cap->len = len;
+
+    DQI_DEBUG("memfd alloc vaddr=%p len=%zu fd=%d flags=%x\n", vaddr, len, fd, flags);
+
+    return CLEANQ_ERR_OK;
+
+cleanup2:
+    munmap(vaddr, len);
+cleanup1:
+    close(fd);
+
+    return err;
+}
+
+
+/**
+ * @brief frees a region allocated with cleanq_memfd_alloc()
+ *
+ * @param cap   The memory of the region, it must not be registered with a queue anymore
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the region was not allocated with
+ *          cleanq_memfd_alloc(), CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_memfd_free(struct capref *cap)
+{
+    assert(cap);
+
+    struct memfd_region *r = memfd_remove(&memfd_allocated, cap->vaddr);
+    if (r == NULL) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    /* the other side keeps its mapping of the memory until it unmaps it */
+    munmap(r->vaddr, r->len);
+    close(r->fd);
+    free(r);
+
+    cap->vaddr = NULL;
+    cap->len = 0;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Sharing with the other Side
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief looks up the file descriptor of a region in a list
+ *
+ * @param list  the list of regions
+ * @param cap   the memory of the region
+ * @param fd    returns the file descriptor backing the memory
+ *
+ * @returns TRUE if the region starts at an entry of the list and lies within it
+ */
+static bool memfd_lookup(struct memfd_region *list, struct capref cap, int *fd)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&memfd_lock);
+
+    for (struct memfd_region *r = list; r; r = r->next) {
+        if (r->vaddr == cap.vaddr && cap.len <= r->len) {
+            *fd = r->fd;
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&memfd_lock);
+
+    return found;
+}
+
+
+/**
+ * @brief checks if the memory of a region has been allocated with cleanq_memfd_alloc()
+ *
+ * @param cap   the memory of the region
+ * @param fd    returns the file descriptor backing the memory
+ *
+ * @returns TRUE if the region starts at an allocation and lies within it
+ */
+bool cleanq_memfd_lookup(struct capref cap, int *fd)
+{
+    return memfd_lookup(memfd_allocated, cap, fd);
+}
+
+
+/**
+ * @brief checks if the memory of a region has been mapped by cleanq_memfd_import()
+ *
+ * @param cap   the memory of the region as recorded in the region pool
+ * @param fd    returns the file descriptor backing the memory
+ *
+ * @returns TRUE if the region starts at an imported mapping and lies within it
+ */
+bool cleanq_memfd_lookup_imported(struct capref cap, int *fd)
+{
+    return memfd_lookup(memfd_imported, cap, fd);
+}
+
+
+/**
+ * @brief maps the memory file of a region and adds it to a list
+ *
+ * @param list  the list of regions
+ * @param cap   the region, the virtual address is replaced with the local mapping
+ * @param fd    the file descriptor, it is kept with the mapping or closed on failure
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the memory could not be mapped, CLEANQ_ERR_OK
+ *          on success
+ */
+static errval_t memfd_map(struct memfd_region **list, struct capref *cap, int fd)
+{
+    /* the buffers must not reach past the end of the memory, accessing them would fault */
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || (seals & MEMFD_SEALS) != MEMFD_SEALS || fstat(fd, &st)
+        || (size_t)st.st_size < cap->len || cap->len == 0) {
+        close(fd);
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    /* the whole file is mapped, mappings of huge pages can't end in the middle of a page */
+    size_t len = (size_t)st.st_size;
+    void *vaddr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vaddr == MAP_FAILED) {
+        close(fd);
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    errval_t err = memfd_insert(list, vaddr, len, fd);
+    if (err_is_fail(err)) {
+        munmap(vaddr, len);
+        close(fd);
+        return err;
+    }
+
+    DQI_DEBUG("memfd map vaddr=%p (remote %p) len=%zu\n", vaddr, cap->vaddr, cap->len);
+
+    cap->vaddr = vaddr;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief maps a region the other side of a queue has passed the file descriptor of
+ *
+ * @param cap   the region, the virtual address is replaced with the local mapping
+ * @param fd    the file descriptor, it is kept until the region is unimported
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the memory could not be mapped, CLEANQ_ERR_OK
+ *          on success
+ *
+ * The file descriptor lets us hand the memory back to the other side if it restarts.
+ */
+errval_t cleanq_memfd_import(struct capref *cap, int fd)
+{
+    return memfd_map(&memfd_imported, cap, fd);
+}
+
+
+/**
+ * @brief maps a region this endpoint has allocated before it restarted
+ *
+ * @param cap   the region, the virtual address is replaced with the local mapping
+ * @param fd    the file descriptor as handed back by the other side
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the memory could not be mapped, CLEANQ_ERR_OK
+ *          on success
+ *
+ * The region counts as allocated with cleanq_memfd_alloc(), it is freed with cleanq_memfd_free().
+ */
+errval_t cleanq_memfd_adopt(struct capref *cap, int fd)
+{
+    errval_t err = memfd_map(&memfd_allocated, cap, fd);
+    if (err_is_ok(err)) {
+        cap->paddr = (uint64_t)cap->vaddr;
+    }
+
+    return err;
+}
+
+
+/**
+ * @brief unmaps a region if it has been mapped by cleanq_memfd_import()
+ *
+ * @param cap   the region as recorded in the region pool
+ */
+void cleanq_memfd_unimport(struct capref cap)
+{
+    struct memfd_region *r = memfd_remove(&memfd_imported, cap.vaddr);
+    if (r == NULL) {
+        return;
+    }
+
+    munmap(r->vaddr, r->len);
+    close(r->fd);
+    free(r);
+}
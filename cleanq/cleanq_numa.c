@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
+#include <debug.h>
+
+
+///< the number of nodes the node masks can hold
+#define NUMA_MAX_NODES 1024
+
+///< the number of words of a node mask
+#define NUMA_MASK_WORDS (NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
+
+
+/**
+ * @brief converts the error of a memory policy system call
+ *
+ * @returns CLEANQ_ERR_NOT_SUPPORTED without NUMA support, CLEANQ_ERR_INVALID_REGION_ARGS otherwise
+ */
+static errval_t numa_error(void)
+{
+    return (errno == ENOSYS) ? CLEANQ_ERR_NOT_SUPPORTED : CLEANQ_ERR_INVALID_REGION_ARGS;
+}
+
+
+/**
+ * @brief obtains the NUMA node the calling thread currently runs on
+ *
+ * @returns the node, 0 if it is unknown
+ */
+int cleanq_numa_current_node(void)
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL)) {
+        return 0;
+    }
+
+    return (int)node;
+}
+
+
+/**
+ * @brief binds memory to a NUMA node, pages already there are migrated if possible
+ *
+ * @param addr      the start of the memory
+ * @param len       the size of the memory, the range is extended to full pages
+ * @param node      the node to bind the memory to
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the node does not exist,
+ *          CLEANQ_ERR_NOT_SUPPORTED if the kernel has no NUMA support
+ */
+errval_t cleanq_numa_bind_memory(void *addr, size_t len, int node)
+{
+    if (node < 0 || node >= NUMA_MAX_NODES || len == 0) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+
+    unsigned long mask[NUMA_MASK_WORDS];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    /* the kernel expects one more than the number of bits in the mask */
+    if (syscall(SYS_mbind, start, end - start, MPOL_BIND, mask, NUMA_MAX_NODES + 1,
+                MPOL_MF_MOVE)) {
+        return numa_error();
+    }
+
+    DQI_DEBUG("numa bind %p..%p to node %d\n", (void *)start, (void *)end, node);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief obtains the NUMA node of the page containing an address
+ *
+ * @param addr      the address, the page is faulted in if it isn't present yet
+ * @param node      returns the node of the page
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the address is not
+ *          mapped, CLEANQ_ERR_NOT_SUPPORTED if the kernel has no NUMA support
+ */
+errval_t cleanq_numa_memory_node(const void *addr, int *node)
+{
+    int mode;
+    if (syscall(SYS_get_mempolicy, &mode, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR)) {
+        return numa_error();
+    }
+
+    *node = mode;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief obtains the cpus of a NUMA node from sysfs
+ *
+ * @param set   returns the cpus
+ * @param node  the NUMA node
+ *
+ * @returns true if the node has cpus
+ */
+static bool numa_node_cpus(cpu_set_t *set, int node)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    char list[1024];
+    bool ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+
+    CPU_ZERO(set);
+
+    /* the list has the form 0-3,8,10-11 */
+    char *p = list;
+    while (ok && *p && *p != '\n') {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p) {
+            return false;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return ok && CPU_COUNT(set) > 0;
+}
+
+
+/**
+ * @brief pins the calling thread to the cpus of a NUMA node and prefers its memory
+ *
+ * @param node      the node to run on
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the node does not exist
+ *          or has no cpus
+ */
+errval_t cleanq_numa_bind_thread(int node)
+{
+    cpu_set_t cpus;
+    if (node < 0 || node >= NUMA_MAX_NODES || !numa_node_cpus(&cpus, node)) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    /* allocations of the thread fall back to other nodes if this one is full */
+    unsigned long mask[NUMA_MASK_WORDS];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1) && errno != ENOSYS) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    return CLEANQ_ERR_OK;
+}
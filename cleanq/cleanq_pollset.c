@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/pollset.h>
+#include <cleanq_backend.h>
+#include <cleanq_shm.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Type Definitions
+ * ================================================================================================
+ */
+
+
+///< the pollset type
+struct cleanq_pollset
+{
+    ///< the name of the doorbell object
+    char *name;
+
+    ///< the backing shared memory of the doorbell
+    struct cleanq_shm shm;
+
+    ///< the doorbell in the shared memory
+    struct cleanq_shm_bell *bell;
+
+    ///< the maximum number of queues
+    size_t capacity;
+
+    ///< the number of words in the doorbell bitmap
+    size_t words;
+
+    ///< the queues indexed by their bit, NULL for unused bits
+    struct cleanq **queues;
+
+    ///< the number of queues in the pollset
+    size_t num_queues;
+
+    ///< the word of the bitmap where the next scan starts
+    size_t next_word;
+
+    ///< the number of microseconds to spin before sleeping
+    uint64_t wait_spin_us;
+};
+
+
+/*
+ * ================================================================================================
+ * Pollset Creation and Destruction
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief creates a new pollset
+ *
+ * @param ps        Return pointer to the pollset
+ * @param name      Name of the shared memory doorbell object
+ * @param capacity  The maximum number of queues in the pollset
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_create(struct cleanq_pollset **ps, const char *name, size_t capacity)
+{
+    errval_t err;
+
+    if (capacity == 0 || capacity > UINT32_MAX || strlen(name) >= CLEANQ_SHM_DOORBELL_NAME_LEN) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    struct cleanq_pollset *newps = calloc(1, sizeof(struct cleanq_pollset));
+    if (newps == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    newps->capacity = capacity;
+    newps->words = (capacity + 63) / 64;
+    newps->wait_spin_us = CLEANQ_WAIT_DEFAULT_SPIN_US;
+
+    newps->queues = calloc(capacity, sizeof(struct cleanq *));
+    newps->name = strdup(name);
+    if (newps->queues == NULL || newps->name == NULL) {
+        err = CLEANQ_ERR_MALLOC_FAIL;
+        goto cleanup1;
+    }
+
+    struct cleanq_shm_header geometry;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.backend = CLEANQ_SHM_BACKEND_BELL;
+    geometry.slots = capacity;
+    geometry.desc_size = sizeof(uint64_t);
+    geometry.desc_align = CLEANQ_SHM_ALIGNMENT;
+    geometry.hdrsize = sizeof(struct cleanq_shm_header);
+    geometry.memsize = geometry.hdrsize + sizeof(struct cleanq_shm_bell)
+                       + newps->words * sizeof(uint64_t);
+
+    err = cleanq_shm_open(&newps->shm, name, true, &geometry, 0, false);
+    if (err_is_fail(err)) {
+        goto cleanup1;
+    }
+
+    /* the doorbell belongs to exactly one pollset */
+    if (!newps->shm.creator) {
+        printf("WARNING: doorbell object %s already exists.\n", name);
+        err = CLEANQ_ERR_INIT_QUEUE;
+        goto cleanup2;
+    }
+
+    newps->bell = (struct cleanq_shm_bell *)((uint8_t *)newps->shm.mem + geometry.hdrsize);
+
+    cleanq_shm_publish(&newps->shm);
+
+    *ps = newps;
+
+    DQI_DEBUG("Created pollset %s capacity=%zu\n", name, capacity);
+
+    return CLEANQ_ERR_OK;
+
+cleanup2:
+    /* don't unlink the object of someone else */
+    free(newps->shm.name);
+    newps->shm.name = NULL;
+    cleanq_shm_close(&newps->shm);
+cleanup1:
+    free(newps->name);
+    free(newps->queues);
+    free(newps);
+
+    return err;
+}
+
+
+/**
+ * @brief destroys a pollset, the queues in it are removed
+ *
+ * @param ps        The pollset to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_destroy(struct cleanq_pollset *ps)
+{
+    for (size_t i = 0; i < ps->capacity && ps->num_queues > 0; i++) {
+        if (ps->queues[i]) {
+            cleanq_pollset_remove(ps, ps->queues[i]);
+        }
+    }
+
+    cleanq_shm_close(&ps->shm);
+
+    free(ps->name);
+    free(ps->queues);
+    free(ps);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Adding and Removing Queues
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief adds a queue to the pollset
+ *
+ * @param ps        The pollset
+ * @param q         The queue to add
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_add(struct cleanq_pollset *ps, struct cleanq *q)
+{
+    errval_t err;
+
+    assert(ps);
+    assert(q);
+
+    if (q->f.doorbell == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    if (ps->num_queues == ps->capacity) {
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    /* removals leave holes, the queue may be in any slot after the first free one */
+    size_t bit = ps->capacity;
+    for (size_t i = 0; i < ps->capacity; i++) {
+        if (ps->queues[i] == q) {
+            return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+        }
+        if (ps->queues[i] == NULL && bit == ps->capacity) {
+            bit = i;
+        }
+    }
+
+    err = q->f.doorbell(q, ps->name, (uint32_t)bit);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    ps->queues[bit] = q;
+    ps->num_queues++;
+
+    /* the queue may already have something to dequeue, report it once */
+    __sync_fetch_and_or(&ps->bell->bits[bit / 64], 1UL << (bit % 64));
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes a queue from the pollset
+ *
+ * @param ps        The pollset
+ * @param q         The queue to remove
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_remove(struct cleanq_pollset *ps, struct cleanq *q)
+{
+    assert(ps);
+    assert(q);
+
+    size_t bit;
+    for (bit = 0; bit < ps->capacity; bit++) {
+        if (ps->queues[bit] == q) {
+            break;
+        }
+    }
+
+    if (bit == ps->capacity) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    errval_t err = q->f.doorbell(q, NULL, 0);
+
+    ps->queues[bit] = NULL;
+    ps->num_queues--;
+
+    /* the other side may still ring the bit until it sees the removal, it is ignored */
+    __sync_fetch_and_and(&ps->bell->bits[bit / 64], ~(1UL << (bit % 64)));
+
+    return err;
+}
+
+
+/*
+ * ================================================================================================
+ * Waiting
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief takes the bits of the ready queues from the doorbell
+ *
+ * @param ps        The pollset
+ * @param ready     Array to be filled in with the ready queues
+ * @param max       The size of the array
+ *
+ * @returns the number of ready queues
+ */
+static size_t cleanq_pollset_collect(struct cleanq_pollset *ps, struct cleanq **ready, size_t max)
+{
+    size_t count = 0;
+    size_t w = ps->next_word;
+
+    for (size_t i = 0; i < ps->words && count < max; i++, w = (w + 1) % ps->words) {
+        uint64_t bits = ps->bell->bits[w];
+        if (bits == 0) {
+            continue;
+        }
+
+        /* only take the bits we can report, the others stay for the next call */
+        uint64_t taken = 0;
+        while (bits && count < max) {
+            size_t b = __builtin_ctzl(bits);
+            bits &= bits - 1;
+            taken |= 1UL << b;
+
+            struct cleanq *q = ps->queues[w * 64 + b];
+            if (q) {
+                ready[count++] = q;
+            }
+        }
+
+        __sync_fetch_and_and(&ps->bell->bits[w], ~taken);
+    }
+
+    /* start after the last word we have looked at the next time */
+    ps->next_word = w;
+
+    return count;
+}
+
+
+static bool cleanq_pollset_can_recv(void *arg)
+{
+    struct cleanq_pollset *ps = arg;
+    for (size_t w = 0; w < ps->words; w++) {
+        if (ps->bell->bits[w]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief returns the queues that have been notified, waits if there are none
+ *
+ * @param ps            The pollset
+ * @param ready         Array to be filled in with the ready queues
+ * @param max           The size of the array
+ * @param num_ready     Return pointer to the number of ready queues
+ * @param timeout_us    The timeout in microseconds, 0 to poll, CLEANQ_WAIT_FOREVER to block
+ *
+ * @returns CLEANQ_ERR_OK if queues have been returned or there was a spurious wakeup,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ */
+errval_t cleanq_pollset_wait(struct cleanq_pollset *ps, struct cleanq **ready, size_t max,
+                             size_t *num_ready, uint64_t timeout_us)
+{
+    errval_t err;
+
+    assert(ps);
+    assert(ready);
+    assert(num_ready);
+
+    *num_ready = cleanq_pollset_collect(ps, ready, max);
+    if (*num_ready > 0 || max == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    err = cleanq_shm_wait(&ps->bell->waiters, cleanq_pollset_can_recv, ps, ps->wait_spin_us,
+                          timeout_us);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    *num_ready = cleanq_pollset_collect(ps, ready, max);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief sets the spin budget of cleanq_pollset_wait()
+ *
+ * @param ps        The pollset
+ * @param spin_us   The number of microseconds to spin before going to sleep
+ *
+ * @returns the previous spin budget
+ */
+uint64_t cleanq_pollset_set_wait_spin(struct cleanq_pollset *ps, uint64_t spin_us)
+{
+    uint64_t old = ps->wait_spin_us;
+    ps->wait_spin_us = spin_us;
+    return old;
+}
@@ -0,0 +1,1786 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
+
+#include <cleanq_backend.h>
+#include <cleanq_shm.h>
+#include <cleanq_mem.h>
+#include <cleanq_memfd.h>
+#include <region_pool.h>
+#include <debug.h>
+
+
+///< the interval in which the attaching side polls for the creator
+#define CLEANQ_SHM_POLL_INTERVAL_US 100
+
+
+/**
+ * @brief waits for the creator to initialize the shared memory object
+ *
+ * @param fd        the file descriptor of the shared memory object
+ * @param geometry  returns the geometry found in the header
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE on failure
+ */
+static errval_t cleanq_shm_wait_header(int fd, struct cleanq_shm_header *geometry)
+{
+    struct stat st;
+    size_t waited = 0;
+
+    /* wait until the creator has set the size of the object */
+    while (true) {
+        if (fstat(fd, &st)) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+
+        if ((size_t)st.st_size >= sizeof(struct cleanq_shm_header)) {
+            break;
+        }
+
+        if (waited >= CLEANQ_SHM_ATTACH_TIMEOUT_US) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+
+        usleep(CLEANQ_SHM_POLL_INTERVAL_US);
+        waited += CLEANQ_SHM_POLL_INTERVAL_US;
+    }
+
+    /* objects on hugetlbfs can't be mapped partially, read the header instead */
+    struct cleanq_shm_header hdr;
+
+    /* wait until the creator has published the header */
+    while (true) {
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+
+        if (hdr.magic == CLEANQ_SHM_MAGIC) {
+            break;
+        }
+
+        if (waited >= CLEANQ_SHM_ATTACH_TIMEOUT_US) {
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+
+        usleep(CLEANQ_SHM_POLL_INTERVAL_US);
+        waited += CLEANQ_SHM_POLL_INTERVAL_US;
+    }
+
+    __sync_synchronize();
+
+    /* the copy may have raced with the magic, the header doesn't change once published */
+    if (pread(fd, geometry, sizeof(*geometry), 0) != sizeof(*geometry)) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief obtains the size of the pages backing a queue object
+ *
+ * @param geometry  the geometry of the queue
+ *
+ * @returns the page size in bytes
+ */
+static uint64_t cleanq_shm_page_size(const struct cleanq_shm_header *geometry)
+{
+    if (geometry->flags & CLEANQ_SHM_FLAG_HUGETLB) {
+        return cleanq_mem_huge_page_size();
+    }
+
+    return (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+
+/**
+ * @brief calculates the size of a channel, the control line followed by the descriptors
+ *
+ * @param geometry  the geometry of the queue
+ *
+ * @returns the size of a channel in bytes, a multiple of the page size with CLEANQ_SHM_FLAG_NUMA
+ */
+uint64_t cleanq_shm_chan_size(const struct cleanq_shm_header *geometry)
+{
+    uint64_t size = geometry->desc_align + geometry->slots * geometry->desc_size;
+
+    /* the channels must not share pages, otherwise they can't be on different nodes */
+    if (geometry->flags & CLEANQ_SHM_FLAG_NUMA) {
+        size = cleanq_shm_align(size, cleanq_shm_page_size(geometry));
+    }
+
+    return size;
+}
+
+
+/**
+ * @brief sets the NUMA nodes of the channels of a queue the creator is about to set up
+ *
+ * @param geometry  the geometry of the queue, must be laid out afterwards
+ * @param numa      the placement of the channels
+ * @param node      the node of CLEANQ_NUMA_NODE, or the node of the attaching side
+ * @param rx_chan   the channel the creator receives on, 0 or 1
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the placement is invalid
+ */
+errval_t cleanq_shm_set_placement(struct cleanq_shm_header *geometry, cleanq_numa_t numa,
+                                  int node, unsigned rx_chan)
+{
+    int local = cleanq_numa_current_node();
+
+    geometry->chan_node[0] = -1;
+    geometry->chan_node[1] = -1;
+
+    if (numa == CLEANQ_NUMA_FIRST_TOUCH) {
+        return CLEANQ_ERR_OK;
+    }
+
+    if (node < 0 || rx_chan > 1) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    /* the creator consumes its receive channel and produces on the other one */
+    switch (numa) {
+    case CLEANQ_NUMA_NODE:
+        geometry->chan_node[0] = node;
+        geometry->chan_node[1] = node;
+        break;
+    case CLEANQ_NUMA_CONSUMER:
+        geometry->chan_node[rx_chan] = local;
+        geometry->chan_node[1 - rx_chan] = node;
+        break;
+    case CLEANQ_NUMA_PRODUCER:
+        geometry->chan_node[rx_chan] = node;
+        geometry->chan_node[1 - rx_chan] = local;
+        break;
+    default:
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    geometry->flags |= CLEANQ_SHM_FLAG_NUMA;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief calculates the header size and the total size of a queue object with two channels
+ *
+ * @param geometry  the geometry of the queue, hdrsize and memsize are updated
+ */
+void cleanq_shm_layout(struct cleanq_shm_header *geometry)
+{
+    uint64_t align = geometry->desc_align;
+    if (geometry->flags & CLEANQ_SHM_FLAG_NUMA) {
+        align = cleanq_shm_page_size(geometry);
+    }
+
+    uint64_t hdrsize = sizeof(struct cleanq_shm_header) + CLEANQ_SHM_STATS_SIZE
+                       + CLEANQ_SHM_CMD_SIZE;
+    if (geometry->flags & CLEANQ_SHM_FLAG_RESUME) {
+        hdrsize += CLEANQ_SHM_RESUME_SIZE;
+    }
+
+    geometry->hdrsize = cleanq_shm_align(hdrsize, align);
+    geometry->memsize = geometry->hdrsize + 2 * cleanq_shm_chan_size(geometry);
+
+    if (geometry->flags & CLEANQ_SHM_FLAG_HUGETLB) {
+        geometry->memsize = cleanq_shm_align(geometry->memsize, cleanq_shm_page_size(geometry));
+    }
+}
+
+
+/**
+ * @brief binds the channels of a new queue object to their NUMA nodes
+ *
+ * @param mem       the mapped memory, not touched yet
+ * @param geometry  the geometry of the queue
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if a node does not exist
+ */
+static errval_t cleanq_shm_place(void *mem, const struct cleanq_shm_header *geometry)
+{
+    if (!(geometry->flags & CLEANQ_SHM_FLAG_NUMA)) {
+        return CLEANQ_ERR_OK;
+    }
+
+    uint64_t chan_size = cleanq_shm_chan_size(geometry);
+    for (int i = 0; i < 2; i++) {
+        if (geometry->chan_node[i] < 0) {
+            continue;
+        }
+
+        uint8_t *chan = (uint8_t *)mem + geometry->hdrsize + i * chan_size;
+        if (err_is_fail(cleanq_numa_bind_memory(chan, chan_size, geometry->chan_node[i]))) {
+            printf("WARNING: could not place channel %d on NUMA node %d.\n", i,
+                   geometry->chan_node[i]);
+            return CLEANQ_ERR_INIT_QUEUE;
+        }
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief sets up the command channels of a mapped queue object
+ *
+ * @param shm       the shared memory state, the header must be mapped
+ */
+static void cleanq_shm_cmd_init(struct cleanq_shm *shm)
+{
+    struct cleanq_shm_cmd_chan *chans;
+    chans = (struct cleanq_shm_cmd_chan *)((uint8_t *)(shm->hdr + 1) + CLEANQ_SHM_STATS_SIZE);
+
+    /* nobody has attached yet, the channels start out empty */
+    if (shm->creator && !shm->resumed) {
+        memset(chans, 0, CLEANQ_SHM_CMD_SIZE);
+    }
+
+    shm->cmd_tx = shm->creator ? &chans[0] : &chans[1];
+    shm->cmd_rx = shm->creator ? &chans[1] : &chans[0];
+    shm->cmd_handled = shm->cmd_rx->handled;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&shm->cmd_rx_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_init(&shm->cmd_tx_lock, NULL);
+}
+
+
+/**
+ * @brief checks if the process of an endpoint is alive
+ *
+ * @param pid       the process id, 0 if there is no endpoint
+ *
+ * @returns true if the process exists
+ */
+static bool cleanq_shm_pid_alive(int32_t pid)
+{
+    /* a process of another user can't be signalled, but it exists */
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+
+/**
+ * @brief records the local endpoint, taking over the role of a dead one if asked to
+ *
+ * @param shm       the shared memory state, the object must be mapped
+ * @param fresh     whether we have just created the object
+ * @param resume    whether to take over the role of an endpoint whose process has died
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if both endpoints are alive
+ */
+static errval_t cleanq_shm_claim(struct cleanq_shm *shm, bool fresh, bool resume)
+{
+    struct cleanq_shm_resume *r = shm->resume;
+    int32_t self = (int32_t)getpid();
+
+    if (fresh) {
+        /* nobody has attached yet, this holds even if the memory isn't cleared */
+        memset(r, 0, CLEANQ_SHM_RESUME_SIZE);
+        r->pid[0] = self;
+        return CLEANQ_ERR_OK;
+    }
+
+    if (!resume) {
+        /* the slot of a dead attaching endpoint is reused, the one of a live endpoint is not */
+        int32_t pid = r->pid[1];
+        if (!cleanq_shm_pid_alive(pid) && __sync_bool_compare_and_swap(&r->pid[1], pid, self)) {
+            return CLEANQ_ERR_OK;
+        }
+
+        printf("WARNING: shared memory object %s has an attached endpoint.\n", shm->name);
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    /* the attaching endpoint usually restarts, the creator only if the attaching one is alive */
+    for (int i = 1; i >= 0; i--) {
+        int32_t pid = r->pid[i];
+        if (i == 1 && pid == 0) {
+            if (__sync_bool_compare_and_swap(&r->pid[1], 0, self)) {
+                return CLEANQ_ERR_OK;
+            }
+            pid = r->pid[1];
+        }
+
+        /* another process may be taking over the same role right now */
+        if (!cleanq_shm_pid_alive(pid) && __sync_bool_compare_and_swap(&r->pid[i], pid, self)) {
+            shm->creator = (i == 0);
+            shm->resumed = true;
+            DQI_DEBUG("resuming %s of %s, process %d has died\n", i ? "attacher" : "creator",
+                      shm->name, pid);
+            return CLEANQ_ERR_OK;
+        }
+    }
+
+    printf("WARNING: both endpoints of shared memory object %s are alive.\n", shm->name);
+
+    return CLEANQ_ERR_INIT_QUEUE;
+}
+
+
+/**
+ * @brief opens the file of a shared memory queue object
+ *
+ * @param shm       the shared memory state
+ * @param oflags    the flags to open the file with
+ *
+ * @returns the file descriptor, -1 on failure
+ */
+static int cleanq_shm_obj_open(struct cleanq_shm *shm, int oflags)
+{
+    if (!shm->hugetlb) {
+        return shm_open(shm->name, oflags, 0600);
+    }
+
+    char path[PATH_MAX];
+    if (!cleanq_mem_hugetlbfs_path(path, sizeof(path), shm->name)) {
+        return -1;
+    }
+
+    return open(path, oflags | O_CLOEXEC, 0600);
+}
+
+
+/**
+ * @brief removes the file of a shared memory queue object
+ *
+ * @param shm       the shared memory state
+ *
+ * @returns 0 on success, -1 on failure
+ */
+static int cleanq_shm_obj_unlink(struct cleanq_shm *shm)
+{
+    if (!shm->hugetlb) {
+        return shm_unlink(shm->name);
+    }
+
+    char path[PATH_MAX];
+    if (!cleanq_mem_hugetlbfs_path(path, sizeof(path), shm->name)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return unlink(path);
+}
+
+
+/**
+ * @brief creates or attaches to a shared memory queue object
+ *
+ * @param shm       the shared memory state to initialize
+ * @param name      the name of the shared memory object
+ * @param clear     zero the memory if we are the creator
+ * @param geometry  the geometry of the queue. The creator sets up the object using the supplied
+ *                  geometry, an attaching endpoint gets the geometry of the creator returned.
+ * @param mem_flags the backing of the local mapping, CLEANQ_MEM_*. CLEANQ_MEM_HUGETLB must be
+ *                  reflected in the geometry flags as well.
+ * @param resume    take over the role of an endpoint whose process has died, if there is one
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE on failure
+ */
+errval_t cleanq_shm_open(struct cleanq_shm *shm, const char *name, bool clear,
+                         struct cleanq_shm_header *geometry, uint32_t mem_flags, bool resume)
+{
+    errval_t err;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->sock = -1;
+
+    shm->name = strdup(name);
+    if (shm->name == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    shm->creator = true;
+    shm->hugetlb = (geometry->flags & CLEANQ_SHM_FLAG_HUGETLB) != 0;
+
+    /* try to create the memobj with exclusive first */
+    int fd = cleanq_shm_obj_open(shm, O_RDWR | O_CREAT | O_EXCL);
+    if (fd == -1) {
+        /* we're not the creator of the queue */
+        shm->creator = false;
+
+        fd = cleanq_shm_obj_open(shm, O_RDWR);
+        if (fd == -1) {
+            goto cleanup1;
+        }
+
+        cleanq_shm_backend_t backend = geometry->backend;
+        err = cleanq_shm_wait_header(fd, geometry);
+        if (err_is_fail(err)) {
+            goto cleanup2;
+        }
+
+        if (geometry->version != CLEANQ_SHM_VERSION || geometry->backend != backend) {
+            printf("WARNING: shared memory object %s has an incompatible layout.\n", name);
+            goto cleanup2;
+        }
+    } else {
+        /* transparent huge pages need the object to consist of full huge pages */
+        if (mem_flags & CLEANQ_MEM_THP) {
+            geometry->memsize = cleanq_shm_align(geometry->memsize, cleanq_mem_huge_page_size());
+        }
+
+        if (ftruncate(fd, geometry->memsize)) {
+            goto cleanup3;
+        }
+    }
+
+    DQI_DEBUG("Mapping queue frame %s size=%lu\n", name, geometry->memsize);
+    void *buf = mmap(NULL, geometry->memsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        goto cleanup3;
+    }
+
+    /* the pages are allocated on the first touch, the hints must be given before */
+    cleanq_mem_advise(buf, geometry->memsize, mem_flags);
+    if (shm->creator && err_is_fail(cleanq_shm_place(buf, geometry))) {
+        munmap(buf, geometry->memsize);
+        goto cleanup3;
+    }
+
+    /* the memory object stays around, we don't need the file descriptor anymore */
+    close(fd);
+
+    if (shm->creator) {
+        if (clear) {
+            memset(buf, 0, geometry->memsize);
+        }
+
+        /* write the header, magic is written once the queue is initialized */
+        struct cleanq_shm_header *hdr = buf;
+        hdr->magic = 0;
+        hdr->version = CLEANQ_SHM_VERSION;
+        hdr->backend = geometry->backend;
+        hdr->memsize = geometry->memsize;
+        hdr->hdrsize = geometry->hdrsize;
+        hdr->slots = geometry->slots;
+        hdr->desc_size = geometry->desc_size;
+        hdr->desc_align = geometry->desc_align;
+        hdr->flags = geometry->flags;
+        hdr->inline_max = geometry->inline_max;
+        hdr->chan_node[0] = geometry->chan_node[0];
+        hdr->chan_node[1] = geometry->chan_node[1];
+
+        /* nobody has attached yet, this holds even if the memory isn't cleared */
+        if (hdr->flags & CLEANQ_SHM_FLAG_STATS) {
+            memset(hdr + 1, 0, CLEANQ_SHM_STATS_SIZE);
+        }
+    }
+
+    /* the other side may already use the memory, this doesn't change its contents */
+    if (err_is_fail(cleanq_mem_populate(buf, geometry->memsize, mem_flags))) {
+        printf("WARNING: could not lock shared memory object %s.\n", name);
+        munmap(buf, geometry->memsize);
+        if (shm->creator) {
+            cleanq_shm_obj_unlink(shm);
+        }
+        goto cleanup1;
+    }
+
+    shm->mem = buf;
+    shm->memsize = geometry->memsize;
+    shm->hdr = buf;
+
+    /* the records follow the command channels, this decides which endpoint we are */
+    if (geometry->flags & CLEANQ_SHM_FLAG_RESUME) {
+        shm->resume = (struct cleanq_shm_resume *)((uint8_t *)(shm->hdr + 1)
+                                                   + CLEANQ_SHM_STATS_SIZE + CLEANQ_SHM_CMD_SIZE);
+        if (err_is_fail(cleanq_shm_claim(shm, shm->creator, resume))) {
+            munmap(buf, geometry->memsize);
+            goto cleanup1;
+        }
+    }
+
+    /* the doorbell objects of pollsets don't take commands */
+    if (geometry->backend != CLEANQ_SHM_BACKEND_BELL) {
+        cleanq_shm_cmd_init(shm);
+    }
+
+    return CLEANQ_ERR_OK;
+
+cleanup3:
+    if (shm->creator) {
+        cleanq_shm_obj_unlink(shm);
+    }
+cleanup2:
+    close(fd);
+cleanup1:
+    free(shm->name);
+    shm->name = NULL;
+
+    return CLEANQ_ERR_INIT_QUEUE;
+}
+
+
+/**
+ * @brief marks the shared memory queue object as initialized
+ *
+ * @param shm       the shared memory state
+ */
+void cleanq_shm_publish(struct cleanq_shm *shm)
+{
+    if (!shm->creator) {
+        return;
+    }
+
+    /* barrier, all initialization must be visible before the magic */
+    __sync_synchronize();
+
+    shm->hdr->magic = CLEANQ_SHM_MAGIC;
+}
+
+
+/**
+ * @brief unmaps and unlinks the shared memory queue object
+ *
+ * @param shm       the shared memory state
+ */
+void cleanq_shm_close(struct cleanq_shm *shm)
+{
+    /* a process that opens the object later must not take our role for a live one */
+    if (shm->resume) {
+        __sync_bool_compare_and_swap(&shm->resume->pid[shm->creator ? 0 : 1], (int32_t)getpid(),
+                                     0);
+    }
+
+    if (shm->mem && munmap(shm->mem, shm->memsize) == -1) {
+        printf("WARNING: shared memory queue destroy failed. (munmap)\n");
+    }
+
+    /* both endpoints unlink the object, the one that comes second finds it gone */
+    if (shm->name && cleanq_shm_obj_unlink(shm) == -1 && errno != ENOENT) {
+        printf("WARNING: shared memory queue destroy failed. (shm_unlink)\n");
+    }
+
+    if (shm->sock != -1) {
+        close(shm->sock);
+    }
+
+    if (shm->cmd_tx) {
+        pthread_mutex_destroy(&shm->cmd_tx_lock);
+        pthread_mutex_destroy(&shm->cmd_rx_lock);
+    }
+
+    free(shm->name);
+
+    shm->name = NULL;
+    shm->mem = NULL;
+    shm->hdr = NULL;
+    shm->sock = -1;
+    shm->cmd_tx = NULL;
+    shm->cmd_rx = NULL;
+    shm->resume = NULL;
+}
+
+
+/*
+ * ================================================================================================
+ * Region Records
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief records a region the local endpoint registers with the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ * @param cap       the memory of the region
+ * @param fd        whether its memory file is passed to the other side
+ *
+ * @returns CLEANQ_ERR_OK on success or if the endpoints don't resume, CLEANQ_ERR_TOO_MANY_REGIONS
+ *          if all records are used
+ */
+errval_t cleanq_shm_region_record(struct cleanq_shm *shm, regionid_t rid, struct capref cap,
+                                  bool fd)
+{
+    if (shm->resume == NULL) {
+        return CLEANQ_ERR_OK;
+    }
+
+    struct cleanq_shm_region *regions = cleanq_shm_regions(shm, true);
+    for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+        if (regions[i].flags & CLEANQ_SHM_REGION_USED) {
+            continue;
+        }
+
+        regions[i].rid = rid;
+        regions[i].vaddr = (uint64_t)cap.vaddr;
+        regions[i].paddr = cap.paddr;
+        regions[i].len = cap.len;
+
+        /* the other side reads the records when we restart, the flags mark a complete one */
+        __sync_synchronize();
+        regions[i].flags = CLEANQ_SHM_REGION_USED | (fd ? CLEANQ_SHM_REGION_FD : 0);
+
+        return CLEANQ_ERR_OK;
+    }
+
+    /* a restarted endpoint would not know the region */
+    DQI_DEBUG("no room to record region %u of %s\n", rid, shm->name);
+
+    return CLEANQ_ERR_TOO_MANY_REGIONS;
+}
+
+
+/**
+ * @brief removes the record of a region of the local endpoint
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ */
+void cleanq_shm_region_forget(struct cleanq_shm *shm, regionid_t rid)
+{
+    if (shm->resume == NULL) {
+        return;
+    }
+
+    struct cleanq_shm_region *regions = cleanq_shm_regions(shm, true);
+    for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+        if ((regions[i].flags & CLEANQ_SHM_REGION_USED) && regions[i].rid == rid) {
+            regions[i].flags = 0;
+            return;
+        }
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Waiting and Notification
+ * ================================================================================================
+ */
+
+
+///< the number of spin iterations between checking the clock
+#define CLEANQ_SHM_SPIN_CHECK_INTERVAL 64
+
+
+static inline void cleanq_shm_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+static inline uint64_t cleanq_shm_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief spins and then sleeps on a futex word until there is something to receive
+ *
+ * @param waiters       the futex word in shared memory, owned by the waiting side
+ * @param can_recv      function checking whether there is something to receive
+ * @param arg           argument to the can_recv function
+ * @param spin_us       the number of microseconds to spin before going to sleep
+ * @param timeout_us    the timeout in microseconds, or CLEANQ_WAIT_FOREVER
+ *
+ * @returns CLEANQ_ERR_OK if there may be something to receive, CLEANQ_ERR_TIMEOUT on timeout
+ */
+errval_t cleanq_shm_wait(volatile uint32_t *waiters, cleanq_shm_can_recv_t can_recv, void *arg,
+                         uint64_t spin_us, uint64_t timeout_us)
+{
+    if (can_recv(arg)) {
+        return CLEANQ_ERR_OK;
+    }
+
+    if (timeout_us == 0) {
+        return CLEANQ_ERR_TIMEOUT;
+    }
+
+    uint64_t now = cleanq_shm_now_us();
+    uint64_t deadline = UINT64_MAX;
+    if (timeout_us != CLEANQ_WAIT_FOREVER) {
+        deadline = now + timeout_us;
+    }
+
+    /* phase 1: spin for the budget, the other side is likely to send something soon */
+    if (spin_us > timeout_us) {
+        spin_us = timeout_us;
+    }
+
+    uint64_t spin_end = now + spin_us;
+    size_t iter = 0;
+    while (spin_us) {
+        if (can_recv(arg)) {
+            return CLEANQ_ERR_OK;
+        }
+
+        cleanq_shm_cpu_relax();
+
+        if (++iter % CLEANQ_SHM_SPIN_CHECK_INTERVAL == 0) {
+            now = cleanq_shm_now_us();
+            if (now >= spin_end) {
+                break;
+            }
+        }
+    }
+
+    /* phase 2: announce that we are going to sleep and block on the futex word */
+    while (true) {
+        *waiters = 1;
+
+        /* barrier, the sender must see the flag or we must see the descriptor */
+        __sync_synchronize();
+
+        if (can_recv(arg)) {
+            break;
+        }
+
+        struct timespec ts;
+        struct timespec *tsp = NULL;
+        if (deadline != UINT64_MAX) {
+            now = cleanq_shm_now_us();
+            if (now >= deadline) {
+                *waiters = 0;
+                return CLEANQ_ERR_TIMEOUT;
+            }
+
+            ts.tv_sec = (deadline - now) / 1000000;
+            ts.tv_nsec = ((deadline - now) % 1000000) * 1000;
+            tsp = &ts;
+        }
+
+        /* the word is left at 1 only if nobody woke us up */
+        long r = syscall(SYS_futex, waiters, FUTEX_WAIT, 1, tsp, NULL, 0);
+        if (r == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            break;
+        }
+
+        if (*waiters == 0) {
+            break;
+        }
+    }
+
+    *waiters = 0;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief wakes up the other side if it sleeps on the futex word
+ *
+ * @param waiters       the futex word in shared memory
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED if the wakeup failed
+ */
+errval_t cleanq_shm_wake(volatile uint32_t *waiters)
+{
+    /* barrier, the descriptors must be visible before we check the flag */
+    __sync_synchronize();
+
+    if (*waiters == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    /* only one side issues the wakeup */
+    if (!__sync_bool_compare_and_swap(waiters, 1, 0)) {
+        return CLEANQ_ERR_OK;
+    }
+
+    /* wake all of them, there may be several consumer threads sleeping */
+    if (syscall(SYS_futex, waiters, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) == -1) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Command Channels
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief sends commands to the other side
+ *
+ * @param shm       the shared memory state
+ * @param cmds      the commands to send
+ * @param num       the number of commands
+ * @param num_sent  returns the number of commands sent, the first ones of the array
+ *
+ * @returns CLEANQ_ERR_OK if at least one command was sent, CLEANQ_ERR_QUEUE_FULL otherwise
+ */
+errval_t cleanq_shm_cmd_send(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                             size_t num, size_t *num_sent)
+{
+    struct cleanq_shm_cmd_chan *chan = shm->cmd_tx;
+
+    pthread_mutex_lock(&shm->cmd_tx_lock);
+
+    /* the slots up to the handled counter have been copied out by the other side */
+    uint64_t sent = chan->sent;
+    uint64_t handled = __atomic_load_n(&chan->handled, __ATOMIC_ACQUIRE);
+    size_t n = CLEANQ_SHM_CMD_SLOTS - (size_t)(sent - handled);
+    if (n > num) {
+        n = num;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        chan->slots[(sent + i) % CLEANQ_SHM_CMD_SLOTS] = cmds[i];
+    }
+
+    __atomic_store_n(&chan->sent, sent + n, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&shm->cmd_tx_lock);
+
+    *num_sent = n;
+
+    return n ? CLEANQ_ERR_OK : CLEANQ_ERR_QUEUE_FULL;
+}
+
+
+/**
+ * @brief sends commands to the other side, waiting for room if needed
+ *
+ * @param shm       the shared memory state
+ * @param cmds      the commands to send
+ * @param num       the number of commands
+ * @param handler   handles the commands of the other side while waiting
+ * @param arg       argument to the handler
+ */
+void cleanq_shm_cmd_send_all(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                             size_t num, cleanq_shm_cmd_handler_t handler, void *arg)
+{
+    while (num) {
+        size_t sent;
+        if (err_is_ok(cleanq_shm_cmd_send(shm, cmds, num, &sent))) {
+            cmds += sent;
+            num -= sent;
+            continue;
+        }
+
+        if (cleanq_shm_cmd_pending(shm)) {
+            cleanq_shm_cmd_handle(shm, handler, arg);
+        } else {
+            cleanq_shm_cpu_relax();
+        }
+    }
+}
+
+
+/**
+ * @brief returns the number of commands that can be sent without waiting
+ *
+ * @param shm       the shared memory state
+ *
+ * @returns the number of free command slots, other threads may take them in the meantime
+ */
+size_t cleanq_shm_cmd_free(struct cleanq_shm *shm)
+{
+    /* the handled counter first, the sent counter is at least as large then */
+    uint64_t handled = __atomic_load_n(&shm->cmd_tx->handled, __ATOMIC_ACQUIRE);
+    uint64_t sent = __atomic_load_n(&shm->cmd_tx->sent, __ATOMIC_RELAXED);
+
+    return CLEANQ_SHM_CMD_SLOTS - (size_t)(sent - handled);
+}
+
+
+/**
+ * @brief handles the pending commands of the other side in order
+ *
+ * @param shm       the shared memory state
+ * @param handler   the function handling a command
+ * @param arg       argument to the handler
+ *
+ * Threads handling commands concurrently are serialized. The slot of a command is handed back
+ * to the sender before the handler is called.
+ */
+void cleanq_shm_cmd_handle(struct cleanq_shm *shm, cleanq_shm_cmd_handler_t handler, void *arg)
+{
+    struct cleanq_shm_cmd_chan *chan = shm->cmd_rx;
+
+    pthread_mutex_lock(&shm->cmd_rx_lock);
+
+    uint64_t seq;
+    while ((seq = chan->handled) != __atomic_load_n(&chan->sent, __ATOMIC_ACQUIRE)) {
+        struct cleanq_shm_cmd cmd = chan->slots[seq % CLEANQ_SHM_CMD_SLOTS];
+
+        /* the handler may wait for the other side, which may need the slot for a command */
+        __atomic_store_n(&chan->handled, seq + 1, __ATOMIC_RELEASE);
+
+        handler(arg, &cmd);
+
+        /* other threads see the command pending until it has been handled, a nested call of
+         * the handler may have handled more of them already */
+        __atomic_store_n(&shm->cmd_handled, chan->handled, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&shm->cmd_rx_lock);
+}
+
+
+/*
+ * ================================================================================================
+ * Region Commands
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief sets the queue the region commands of the other side are handled for
+ *
+ * @param shm       the shared memory state
+ * @param q         the queue, its pool receives the regions and its notify wakes the other side
+ */
+void cleanq_shm_cmd_bind(struct cleanq_shm *shm, struct cleanq *q)
+{
+    shm->q = q;
+}
+
+
+/**
+ * @brief hands the memory files of the recorded regions to the other side after it restarted
+ *
+ * @param shm       the shared memory state
+ *
+ * The restarted side waits for them while it is created, the regions of both sides are sent.
+ */
+static void cleanq_shm_resend_fds(struct cleanq_shm *shm)
+{
+    if (shm->resume == NULL) {
+        return;
+    }
+
+    for (int local = 1; local >= 0; local--) {
+        struct cleanq_shm_region *regions = cleanq_shm_regions(shm, local);
+        for (size_t i = 0; i < CLEANQ_SHM_REGION_SLOTS; i++) {
+            struct cleanq_shm_region *r = &regions[i];
+            if (!(r->flags & CLEANQ_SHM_REGION_USED) || !(r->flags & CLEANQ_SHM_REGION_FD)) {
+                continue;
+            }
+
+            /* our own regions were allocated here, those of the other side have been imported */
+            struct capref cap;
+            int fd;
+            if (!region_pool_get_cap(shm->q->pool, r->rid, &cap)
+                || !(cleanq_memfd_lookup(cap, &fd) || cleanq_memfd_lookup_imported(cap, &fd))
+                || err_is_fail(cleanq_shm_send_fd(shm, r->rid, fd))) {
+                printf("WARNING: could not pass region %u to the restarted side\n", r->rid);
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief adds a region of the other side to the pool of the queue
+ *
+ * @param shm       the shared memory state
+ * @param cmd       the register command
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t cleanq_shm_add_region(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmd)
+{
+    struct cleanq *q = shm->q;
+    errval_t err;
+
+    struct capref cap = {
+        .vaddr = (void *)cmd->offset,
+        .paddr = (uint64_t)cmd->valid_data,
+        .len = (size_t)cmd->length,
+    };
+
+    /* the memory is shared with us, map it before it is used. The physical address is kept,
+     * the descriptors of the other side may refer to it */
+    if (cmd->cmd == CLEANQ_SHM_CMD_REGISTER_FD) {
+        err = cleanq_shm_import_region(shm, cmd->rid, &cap);
+        if (err_is_fail(err)) {
+            return err;
+        }
+    }
+
+    err = cleanq_add_region(q, cap, cmd->rid);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    if (q->callbacks.reg) {
+        return q->callbacks.reg(q, cap, cmd->rid);
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes a region of the other side from the pool of the queue
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t cleanq_shm_remove_region(struct cleanq_shm *shm, regionid_t rid)
+{
+    struct cleanq *q = shm->q;
+
+    errval_t err = cleanq_remove_region(q, rid);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    if (q->callbacks.dereg) {
+        return q->callbacks.dereg(q, rid);
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief handles a region command of the other side
+ *
+ * @param arg       the shared memory state
+ * @param cmd       the command
+ */
+static void cleanq_shm_region_command(void *arg, const struct cleanq_shm_cmd *cmd)
+{
+    struct cleanq_shm *shm = arg;
+    errval_t err;
+
+    switch (cmd->cmd) {
+    case CLEANQ_SHM_CMD_REGISTER:
+    case CLEANQ_SHM_CMD_REGISTER_FD:
+        err = cleanq_shm_add_region(shm, cmd);
+
+        /* the valid length carries the token of the batch */
+        cleanq_register_received(shm->q, cmd->valid_length, cmd->flags & CLEANQ_FLAG_LAST, err);
+        break;
+    case CLEANQ_SHM_CMD_REGISTER_ACK:
+        cleanq_register_acked(shm->q, cmd->offset, (errval_t)cmd->valid_data);
+        break;
+    case CLEANQ_SHM_CMD_RESUME:
+        cleanq_shm_resend_fds(shm);
+        break;
+    case CLEANQ_SHM_CMD_DEREGISTER:
+        err = cleanq_shm_remove_region(shm, cmd->rid);
+        if (err_is_fail(err)) {
+            printf("WARNING: could not deregister region %u: %d\n", cmd->rid, err);
+        }
+        break;
+    default:
+        /* a corrupted or newer command, it must not touch the regions */
+        printf("WARNING: skipping unknown command %u\n", cmd->cmd);
+        break;
+    }
+}
+
+
+/**
+ * @brief handles the pending region commands of the other side in order
+ *
+ * @param shm       the shared memory state, bound to a queue
+ */
+void cleanq_shm_cmd_handle_regions(struct cleanq_shm *shm)
+{
+    cleanq_shm_cmd_handle(shm, cleanq_shm_region_command, shm);
+}
+
+
+/**
+ * @brief sends commands to the other side, waiting for room if needed, and notifies it
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param cmds      the commands
+ * @param num       the number of commands
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_cmd_send_regions(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                                     size_t num)
+{
+    cleanq_shm_cmd_send_all(shm, cmds, num, cleanq_shm_region_command, shm);
+
+    /* the other side may be sleeping, make sure it handles the commands */
+    return shm->q->f.notify(shm->q);
+}
+
+
+/**
+ * @brief registers a region with the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param cap       the memory of the region
+ * @param rid       the region id
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_register(struct cleanq_shm *shm, struct capref cap, regionid_t rid)
+{
+    struct cleanq_shm_cmd cmd = {
+        .cmd = CLEANQ_SHM_CMD_REGISTER,
+        .rid = rid,
+        .offset = (uint64_t)cap.vaddr,
+        .length = (uint64_t)cap.len,
+        .valid_data = (uint64_t)cap.paddr,
+    };
+
+    int fd;
+    bool has_fd = cleanq_memfd_lookup(cap, &fd);
+
+    /* a restarted endpoint finds the region in the records */
+    errval_t err = cleanq_shm_region_record(shm, rid, cap, has_fd);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* memory backed by a file is passed to the other side, before the command refering to it */
+    if (has_fd) {
+        err = cleanq_shm_send_fd(shm, rid, fd);
+        if (err_is_fail(err)) {
+            cleanq_shm_region_forget(shm, rid);
+            return err;
+        }
+        cmd.cmd = CLEANQ_SHM_CMD_REGISTER_FD;
+    }
+
+    return cleanq_shm_cmd_send_regions(shm, &cmd, 1);
+}
+
+
+/**
+ * @brief registers several regions with the other side without waiting for it
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param caps      the memory of the regions
+ * @param rids      the region ids
+ * @param num       the number of regions
+ * @param token     the token of the batch
+ * @param num_reg   returns the number of regions that have been sent
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_register_batch(struct cleanq_shm *shm, const struct capref *caps,
+                                   const regionid_t *rids, size_t num, uint64_t token,
+                                   size_t *num_reg)
+{
+    struct cleanq_shm_cmd cmds[CLEANQ_SHM_CMD_SLOTS];
+    size_t n = cleanq_shm_cmd_free(shm);
+    if (n > num) {
+        n = num;
+    }
+
+    errval_t err = CLEANQ_ERR_QUEUE_FULL;
+    size_t count;
+    for (count = 0; count < n; count++) {
+        cmds[count] = (struct cleanq_shm_cmd) {
+            .cmd = CLEANQ_SHM_CMD_REGISTER,
+            .rid = rids[count],
+            .offset = (uint64_t)caps[count].vaddr,
+            .length = (uint64_t)caps[count].len,
+            .valid_data = (uint64_t)caps[count].paddr,
+            .valid_length = token,
+        };
+
+        int fd;
+        bool has_fd = cleanq_memfd_lookup(caps[count], &fd);
+        err = cleanq_shm_region_record(shm, rids[count], caps[count], has_fd);
+        if (err_is_fail(err)) {
+            break;
+        }
+
+        if (has_fd) {
+            err = cleanq_shm_try_send_fd(shm, rids[count], fd);
+            if (err_is_fail(err)) {
+                cleanq_shm_region_forget(shm, rids[count]);
+                break;
+            }
+            cmds[count].cmd = CLEANQ_SHM_CMD_REGISTER_FD;
+        }
+    }
+
+    DQI_DEBUG("register batch num=%zu sent=%zu token=%lu\n", num, count, token);
+
+    *num_reg = count;
+    if (count == 0) {
+        return err;
+    }
+
+    cmds[count - 1].flags = CLEANQ_FLAG_LAST;
+
+    return cleanq_shm_cmd_send_regions(shm, cmds, count);
+}
+
+
+/**
+ * @brief acknowledges a batch of registrations of the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param token     the token of the batch
+ * @param err       the outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_register_ack(struct cleanq_shm *shm, uint64_t token, errval_t err)
+{
+    struct cleanq_shm_cmd cmd = {
+        .cmd = CLEANQ_SHM_CMD_REGISTER_ACK,
+        .offset = token,
+        .valid_data = (uint64_t)err,
+    };
+
+    /* this is called while handling commands, it must not wait for the other side */
+    size_t sent;
+    err = cleanq_shm_cmd_send(shm, &cmd, 1, &sent);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    return shm->q->f.notify(shm->q);
+}
+
+
+/**
+ * @brief deregisters a region with the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param rid       the region id
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_deregister(struct cleanq_shm *shm, regionid_t rid)
+{
+    struct cleanq_shm_cmd cmd = {
+        .cmd = CLEANQ_SHM_CMD_DEREGISTER,
+        .rid = rid,
+    };
+
+    cleanq_shm_region_forget(shm, rid);
+
+    return cleanq_shm_cmd_send_regions(shm, &cmd, 1);
+}
+
+
+/*
+ * ================================================================================================
+ * Passing File Descriptors
+ * ================================================================================================
+ */
+
+
+///< the message carrying a file descriptor
+struct cleanq_shm_fd_msg
+{
+    ///< the region id the descriptor belongs to
+    regionid_t rid;
+};
+
+
+/**
+ * @brief obtains the socket address of an endpoint
+ *
+ * @param shm       the shared memory state
+ * @param creator   the address of the creator or the attaching side
+ * @param addr      returns the address
+ *
+ * @returns the length of the address, 0 if the name is too long
+ */
+static socklen_t cleanq_shm_fd_addr(struct cleanq_shm *shm, bool creator, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    /* the abstract namespace starts with a zero byte, the name is not zero terminated */
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "cleanq%s.%c", shm->name,
+                       creator ? 'c' : 'a');
+    if (len < 0 || (size_t)len >= sizeof(addr->sun_path) - 1) {
+        return 0;
+    }
+
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+
+/**
+ * @brief binds the socket receiving file descriptors from the other side
+ *
+ * @param shm       the shared memory state, the object must have been opened
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the socket could not be bound
+ */
+errval_t cleanq_shm_fd_open(struct cleanq_shm *shm)
+{
+    struct sockaddr_un addr;
+    socklen_t len = cleanq_shm_fd_addr(shm, shm->creator, &addr);
+    if (len == 0) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    /* we want to know who sent a descriptor */
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on))
+        || bind(sock, (struct sockaddr *)&addr, len)) {
+        close(sock);
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    shm->sock = sock;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief sends a file descriptor to the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        the file descriptor, it stays open
+ * @param wait      whether to wait if the socket of the other side is full
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if the other side has not attached
+ *          within CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_QUEUE_FULL if the socket is full and
+ *          we don't wait, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+static errval_t cleanq_shm_send_fd_internal(struct cleanq_shm *shm, regionid_t rid, int fd,
+                                            bool wait)
+{
+    if (shm->sock == -1) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t addrlen = cleanq_shm_fd_addr(shm, !shm->creator, &addr);
+
+    struct cleanq_shm_fd_msg msg = { .rid = rid };
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+
+    struct msghdr mh = {
+        .msg_name = &addr,
+        .msg_namelen = addrlen,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    /* the other side may not have attached yet, or its socket is full */
+    size_t waited = 0;
+    while (sendmsg(shm->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        if (errno != ECONNREFUSED && errno != ENOENT && errno != EAGAIN && errno != EINTR) {
+            return CLEANQ_ERR_NOT_SUPPORTED;
+        }
+
+        if (errno == EAGAIN && !wait) {
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+
+        if (waited >= CLEANQ_SHM_ATTACH_TIMEOUT_US) {
+            return CLEANQ_ERR_TIMEOUT;
+        }
+
+        usleep(CLEANQ_SHM_POLL_INTERVAL_US);
+        waited += CLEANQ_SHM_POLL_INTERVAL_US;
+    }
+
+    DQI_DEBUG("sent fd %d of region %u over %s\n", fd, rid, shm->name);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief sends a file descriptor to the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        the file descriptor, it stays open
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if the other side has not attached
+ *          within CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+errval_t cleanq_shm_send_fd(struct cleanq_shm *shm, regionid_t rid, int fd)
+{
+    return cleanq_shm_send_fd_internal(shm, rid, fd, true);
+}
+
+
+/**
+ * @brief sends a file descriptor to the other side, unless its socket is full
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        the file descriptor, it stays open
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if the socket of the other side is
+ *          full, CLEANQ_ERR_TIMEOUT if the other side has not attached within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ *
+ * The other side takes the descriptors off its socket while it handles the commands, a batch of
+ * commands must not wait for room before they have been sent.
+ */
+errval_t cleanq_shm_try_send_fd(struct cleanq_shm *shm, regionid_t rid, int fd)
+{
+    return cleanq_shm_send_fd_internal(shm, rid, fd, false);
+}
+
+
+/**
+ * @brief receives the file descriptor of a region from the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to, returns it if any is true
+ * @param any       accept the descriptor of any region
+ * @param fd        returns the file descriptor
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if it did not arrive within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+static errval_t cleanq_shm_recv_fd_internal(struct cleanq_shm *shm, regionid_t *rid, bool any,
+                                            int *fd)
+{
+    if (shm->sock == -1) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    uint64_t deadline = cleanq_shm_now_us() + CLEANQ_SHM_ATTACH_TIMEOUT_US;
+
+    while (true) {
+        struct cleanq_shm_fd_msg msg;
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct ucred))];
+        } ctrl;
+
+        struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = ctrl.buf,
+            .msg_controllen = sizeof(ctrl.buf),
+        };
+
+        ssize_t ret = recvmsg(shm->sock, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (ret == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                return CLEANQ_ERR_NOT_SUPPORTED;
+            }
+
+            uint64_t now = cleanq_shm_now_us();
+            if (now >= deadline) {
+                return CLEANQ_ERR_TIMEOUT;
+            }
+
+            struct pollfd pfd = { .fd = shm->sock, .events = POLLIN };
+            poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+            continue;
+        }
+
+        int rfd = -1;
+        bool trusted = false;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+
+            if (c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+                memcpy(&rfd, CMSG_DATA(c), sizeof(int));
+            } else if (c->cmsg_type == SCM_CREDENTIALS) {
+                struct ucred cred;
+                memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+                trusted = (cred.uid == geteuid());
+            }
+        }
+
+        if (rfd != -1 && trusted && ret == sizeof(msg) && !(mh.msg_flags & MSG_CTRUNC)
+            && (any || msg.rid == *rid)) {
+            *rid = msg.rid;
+            *fd = rfd;
+            return CLEANQ_ERR_OK;
+        }
+
+        /* left over from a failed registration, or not from the other side at all */
+        if (rfd != -1) {
+            close(rfd);
+        }
+    }
+}
+
+
+/**
+ * @brief receives the file descriptor of a region from the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        returns the file descriptor
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if it did not arrive within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ *
+ * Descriptors of other regions are left over from failed registrations, they are closed.
+ */
+errval_t cleanq_shm_recv_fd(struct cleanq_shm *shm, regionid_t rid, int *fd)
+{
+    return cleanq_shm_recv_fd_internal(shm, &rid, false, fd);
+}
+
+
+/**
+ * @brief receives the file descriptor of any region from the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       returns the region id the descriptor belongs to
+ * @param fd        returns the file descriptor
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if nothing arrived within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+errval_t cleanq_shm_recv_any_fd(struct cleanq_shm *shm, regionid_t *rid, int *fd)
+{
+    return cleanq_shm_recv_fd_internal(shm, rid, true, fd);
+}
+
+
+/**
+ * @brief maps a region of the other side that is backed by a file descriptor
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ * @param cap       the region as sent by the other side, returns the local mapping
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_import_region(struct cleanq_shm *shm, regionid_t rid, struct capref *cap)
+{
+    int fd;
+    errval_t err = cleanq_shm_recv_fd(shm, rid, &fd);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    return cleanq_memfd_import(cap, fd);
+}
+
+
+/*
+ * ================================================================================================
+ * Doorbells
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief announces a doorbell to the sender of a channel
+ *
+ * @param db        the doorbell announcement in the control line of the channel
+ * @param name      the name of the doorbell object, NULL to remove the doorbell
+ * @param bit       the bit the sender should set
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the name is too long
+ */
+errval_t cleanq_shm_doorbell_announce(struct cleanq_shm_doorbell *db, const char *name,
+                                      uint32_t bit)
+{
+    if (name && strlen(name) >= CLEANQ_SHM_DOORBELL_NAME_LEN) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* odd generation, the sender must not use the values */
+    db->gen++;
+    __sync_synchronize();
+
+    db->bit = bit;
+    memset(db->name, 0, CLEANQ_SHM_DOORBELL_NAME_LEN);
+    if (name) {
+        strcpy(db->name, name);
+    }
+
+    __sync_synchronize();
+    db->gen++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief maps a doorbell object
+ *
+ * @param name      the name of the doorbell object
+ * @param bit       the bit to be set
+ *
+ * @returns the new mapping, or NULL on failure
+ */
+static struct cleanq_shm_bell_mapping *cleanq_shm_doorbell_map(const char *name, uint32_t bit)
+{
+    /* the owner creates the object, we only ever attach to it */
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cleanq_shm_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct cleanq_shm_header *hdr = mem;
+    if (hdr->magic != CLEANQ_SHM_MAGIC || hdr->version != CLEANQ_SHM_VERSION
+        || hdr->backend != CLEANQ_SHM_BACKEND_BELL || bit >= hdr->slots
+        || hdr->hdrsize + sizeof(struct cleanq_shm_bell) + (bit / 64 + 1) * sizeof(uint64_t)
+               > (size_t)st.st_size) {
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+
+    struct cleanq_shm_bell_mapping *m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+
+    m->mem = mem;
+    m->memsize = st.st_size;
+    m->bell = (struct cleanq_shm_bell *)((uint8_t *)mem + hdr->hdrsize);
+    m->bit = bit;
+
+    return m;
+}
+
+
+/**
+ * @brief maps the doorbell announced by the receiver, slow path of cleanq_shm_doorbell_ring()
+ *
+ * @param db        the doorbell announcement in the control line of the channel
+ * @param state     the sending side state of the doorbell
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if it could not be mapped
+ *
+ * Other threads may still use the current mapping, it is kept until the endpoint is destroyed.
+ * The doorbell is only changed when the other side adds the queue to or removes it from a
+ * pollset, so there are only a few of them.
+ */
+errval_t cleanq_shm_doorbell_remap(struct cleanq_shm_doorbell *db,
+                                   struct cleanq_shm_doorbell_state *state)
+{
+    while (!__sync_bool_compare_and_swap(&state->lock, 0, 1)) {
+        cleanq_shm_cpu_relax();
+    }
+
+    /* take a consistent snapshot of the announcement */
+    uint32_t gen, bit;
+    char name[CLEANQ_SHM_DOORBELL_NAME_LEN];
+    do {
+        gen = db->gen;
+        __sync_synchronize();
+        bit = db->bit;
+        memcpy(name, db->name, CLEANQ_SHM_DOORBELL_NAME_LEN);
+        __sync_synchronize();
+    } while ((gen & 1) || gen != db->gen);
+
+    name[CLEANQ_SHM_DOORBELL_NAME_LEN - 1] = 0;
+
+    errval_t err = CLEANQ_ERR_OK;
+    if (gen != state->gen) {
+        struct cleanq_shm_bell_mapping *m = NULL;
+        if (name[0]) {
+            m = cleanq_shm_doorbell_map(name, bit);
+            if (m == NULL) {
+                /* report it once, then continue without a doorbell */
+                printf("WARNING: could not map doorbell %s\n", name);
+                err = CLEANQ_ERR_INIT_QUEUE;
+            } else {
+                m->next = state->mappings;
+                state->mappings = m;
+            }
+        }
+
+        __atomic_store_n(&state->current, m, __ATOMIC_RELEASE);
+        state->gen = gen;
+    }
+
+    __sync_lock_release(&state->lock);
+
+    return err;
+}
+
+
+/**
+ * @brief unmaps all doorbell objects of the sending side
+ *
+ * @param state     the sending side state of the doorbell
+ */
+void cleanq_shm_doorbell_unmap(struct cleanq_shm_doorbell_state *state)
+{
+    struct cleanq_shm_bell_mapping *m = state->mappings;
+    while (m) {
+        struct cleanq_shm_bell_mapping *next = m->next;
+        munmap(m->mem, m->memsize);
+        free(m);
+        m = next;
+    }
+
+    state->mappings = NULL;
+    state->current = NULL;
+    state->gen = 0;
+}
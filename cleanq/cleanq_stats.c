@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+#include <cleanq_shm.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Reading the Statistics of Other Processes
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the name of a shared memory backend
+ *
+ * @param backend   the backend
+ *
+ * @returns the name of the backend
+ */
+static const char *cleanq_stats_backend_name(uint32_t backend)
+{
+    switch (backend) {
+    case CLEANQ_SHM_BACKEND_IPCQ:
+        return "ipcq";
+    case CLEANQ_SHM_BACKEND_FFQ:
+        return "ffq";
+    case CLEANQ_SHM_BACKEND_VIRTQ:
+        return "virtq";
+    default:
+        return "unknown";
+    }
+}
+
+
+/**
+ * @brief maps the statistics of a shared memory queue read-only
+ *
+ * @param view      The view to initialize
+ * @param name      The name of the shared memory object of the queue
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the object does not exist, is
+ *          not yet initialized or does not hold statistics
+ */
+errval_t cleanq_stats_attach(struct cleanq_stats_view *view, const char *name)
+{
+    struct stat st;
+
+    memset(view, 0, sizeof(*view));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cleanq_shm_header)) {
+        goto cleanup1;
+    }
+
+    /* only the header area is mapped, the descriptors are none of our business */
+    struct cleanq_shm_header *hdr = mmap(NULL, sizeof(struct cleanq_shm_header), PROT_READ,
+                                         MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        goto cleanup1;
+    }
+
+    bool valid = hdr->magic == CLEANQ_SHM_MAGIC && hdr->version == CLEANQ_SHM_VERSION
+                 && (hdr->flags & CLEANQ_SHM_FLAG_STATS)
+                 && hdr->hdrsize >= sizeof(struct cleanq_shm_header) + CLEANQ_SHM_STATS_SIZE
+                 && hdr->hdrsize <= (uint64_t)st.st_size;
+    size_t memsize = hdr->hdrsize;
+    uint32_t backend = hdr->backend;
+
+    munmap(hdr, sizeof(struct cleanq_shm_header));
+
+    if (!valid) {
+        goto cleanup1;
+    }
+
+    view->mem = mmap(NULL, memsize, PROT_READ, MAP_SHARED, fd, 0);
+    if (view->mem == MAP_FAILED) {
+        view->mem = NULL;
+        goto cleanup1;
+    }
+
+    close(fd);
+
+    view->name = strdup(name);
+    if (view->name == NULL) {
+        munmap(view->mem, memsize);
+        view->mem = NULL;
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    const volatile struct cleanq_stats *stats =
+        (const volatile struct cleanq_stats *)((struct cleanq_shm_header *)view->mem + 1);
+
+    view->memsize = memsize;
+    view->backend = cleanq_stats_backend_name(backend);
+    view->endpoint[CLEANQ_STATS_CREATOR] = &stats[CLEANQ_STATS_CREATOR];
+    view->endpoint[CLEANQ_STATS_ATTACHER] = &stats[CLEANQ_STATS_ATTACHER];
+
+    DQI_DEBUG("Attached to the statistics of %s backend=%s\n", name, view->backend);
+
+    return CLEANQ_ERR_OK;
+
+cleanup1:
+    close(fd);
+
+    return CLEANQ_ERR_INIT_QUEUE;
+}
+
+
+/**
+ * @brief unmaps the statistics of a shared memory queue
+ *
+ * @param view      The view to unmap
+ */
+void cleanq_stats_detach(struct cleanq_stats_view *view)
+{
+    if (view->mem) {
+        munmap(view->mem, view->memsize);
+    }
+
+    free(view->name);
+
+    memset(view, 0, sizeof(*view));
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/trace.h>
+
+#include <bench.h>
+#include <cleanq_backend.h>
+#include <cleanq_trace.h>
+#include <debug.h>
+
+
+/*
+ * ================================================================================================
+ * Clocks
+ * ================================================================================================
+ */
+
+
+///< the thread id of the calling thread as recorded in the events, 0 if not known yet
+__thread uint16_t cleanq_trace_tid;
+
+///< the measured frequency of the timestamp counter, 0 if not measured yet
+static uint64_t cleanq_trace_tsc_hz;
+
+
+/**
+ * @brief reads CLOCK_MONOTONIC
+ *
+ * @returns the time in nanoseconds
+ */
+static uint64_t cleanq_trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+ * @brief measures the frequency of the timestamp counter against CLOCK_MONOTONIC
+ *
+ * @returns the frequency in Hz
+ *
+ * The measurement takes 10ms once per process.
+ */
+static uint64_t cleanq_trace_measure_tsc_hz(void)
+{
+    uint64_t hz = __atomic_load_n(&cleanq_trace_tsc_hz, __ATOMIC_RELAXED);
+    if (hz) {
+        return hz;
+    }
+
+    uint64_t t0 = cleanq_trace_now_ns();
+    uint64_t c0 = rdtsc();
+    uint64_t t1;
+    do {
+        t1 = cleanq_trace_now_ns();
+    } while (t1 - t0 < 10000000UL);
+    uint64_t c1 = rdtsc();
+
+    hz = (uint64_t)((double)(c1 - c0) * 1e9 / (double)(t1 - t0));
+    __atomic_store_n(&cleanq_trace_tsc_hz, hz, __ATOMIC_RELAXED);
+
+    return hz;
+}
+
+
+/**
+ * @brief obtains the thread id of the calling thread for the events
+ *
+ * @returns the low bits of the thread id
+ */
+uint16_t cleanq_trace_thread_id(void)
+{
+    /* 0 marks the id as unknown, a thread whose low bits are 0 asks every time */
+    cleanq_trace_tid = (uint16_t)syscall(SYS_gettid);
+    return cleanq_trace_tid;
+}
+
+
+/*
+ * ================================================================================================
+ * Starting and Stopping
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief starts recording the operations of a queue
+ *
+ * @param q         The queue
+ * @param attr      The attributes of the trace ring, NULL selects the defaults
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the number of events is
+ *          not a power of two, CLEANQ_ERR_MALLOC_FAIL if the ring could not be allocated
+ */
+errval_t cleanq_trace_start(struct cleanq *q, const struct cleanq_trace_attr *attr)
+{
+    assert(q);
+
+    struct cleanq_trace_attr a = { 0 };
+    if (attr) {
+        a = *attr;
+    }
+    if (a.events == 0) {
+        a.events = CLEANQ_TRACE_DEFAULT_EVENTS;
+    }
+    if (a.events & (a.events - 1)) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+    if (a.label == NULL) {
+        a.label = a.shm_name ? a.shm_name : "cleanq";
+    }
+
+    cleanq_trace_stop(q);
+
+    struct cleanq_trace *t = calloc(1, sizeof(struct cleanq_trace));
+    if (t == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    t->size = sizeof(struct cleanq_trace_hdr) + a.events * sizeof(struct cleanq_trace_event);
+
+    void *mem;
+    if (a.shm_name) {
+        int fd = shm_open(a.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            free(t);
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+        if (ftruncate(fd, t->size)) {
+            close(fd);
+            shm_unlink(a.shm_name);
+            free(t);
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+        mem = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        mem = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (mem == MAP_FAILED) {
+        if (a.shm_name) {
+            shm_unlink(a.shm_name);
+        }
+        free(t);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    /* the mapping is zeroed, the events are unused until head passes them */
+    struct cleanq_trace_hdr *hdr = mem;
+    hdr->version = CLEANQ_TRACE_VERSION;
+    hdr->event_size = sizeof(struct cleanq_trace_event);
+    hdr->events = a.events;
+    hdr->pid = (uint64_t)getpid();
+    hdr->tsc_hz = cleanq_trace_measure_tsc_hz();
+    hdr->mono_ns = cleanq_trace_now_ns();
+    hdr->tsc_base = rdtsc();
+    strncpy(hdr->label, a.label, sizeof(hdr->label) - 1);
+    __atomic_store_n(&hdr->magic, CLEANQ_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    t->hdr = hdr;
+    t->events = (struct cleanq_trace_event *)(hdr + 1);
+    t->mask = a.events - 1;
+
+    DQI_DEBUG("trace start q=%p events=%zu shm=%s\n", (void *)q, a.events,
+              a.shm_name ? a.shm_name : "-");
+
+    __atomic_store_n(&q->trace, t, __ATOMIC_RELEASE);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief frees the trace ring of a queue
+ *
+ * @param q     the queue
+ */
+void cleanq_trace_free(struct cleanq *q)
+{
+    struct cleanq_trace *t = q->trace;
+    if (t == NULL) {
+        return;
+    }
+
+    q->trace = NULL;
+    munmap(t->hdr, t->size);
+    free(t);
+}
+
+
+/**
+ * @brief stops recording and frees the trace ring
+ *
+ * @param q         The queue
+ *
+ * @returns CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_trace_stop(struct cleanq *q)
+{
+    assert(q);
+
+    cleanq_trace_free(q);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief writes the trace ring of a queue to a file
+ *
+ * @param q         The queue
+ * @param path      The path of the file, it is replaced
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the queue is not traced or
+ *          the file could not be written
+ */
+errval_t cleanq_trace_save(struct cleanq *q, const char *path)
+{
+    assert(q);
+    assert(path);
+
+    struct cleanq_trace *t = q->trace;
+    if (t == NULL) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    size_t written = fwrite(t->hdr, 1, t->size, f);
+    if (fclose(f) || written != t->size) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    return CLEANQ_ERR_OK;
+}
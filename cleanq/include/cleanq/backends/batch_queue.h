@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef CLEANQ_BATCHQ_H_
+#define CLEANQ_BATCHQ_H_ 1
+
+#include <stdint.h>
+#include <cleanq/cleanq.h>
+
+///< forward declaration of opaque type
+struct cleanq_batchq;
+
+
+/*
+ * The batch queue is stacked on top of another queue and turns single enqueues and dequeues into
+ * batches of the queue below. Enqueued buffers are kept back until a batch is complete, the
+ * oldest of them is older than the flush deadline, or cleanq_notify() is called. Dequeues take
+ * a batch from the queue below and hand it out one by one.
+ *
+ * There is no timer: the deadline is checked by the enqueue, dequeue and wait calls of the
+ * batch queue. Both queues share their regions, register them through the batch queue. Regions
+ * registered by the other side are reported by the callbacks of the queue below. The batch
+ * queue must only be used by a single thread, and the queue below must not be used directly
+ * while it is stacked. It is not destroyed together with the batch queue.
+ */
+
+
+///< attributes of a batch queue, zero values select the defaults
+struct cleanq_batchq_attr
+{
+    ///< the number of enqueued buffers that are sent together (default 16)
+    size_t batch;
+
+    ///< the time in microseconds a buffer may be kept back (default 50)
+    uint64_t flush_us;
+
+    ///< the maximum number of buffers dequeued from the queue below at once (default 16)
+    size_t rx_batch;
+};
+
+
+/**
+ * @brief creates a batch queue on top of another
+ *
+ * @param q         the created batch queue
+ * @param other_q   the queue below
+ *
+ * @returns CLEANQ_ERR_OK on success, errval on failure
+ */
+errval_t cleanq_batchq_create(struct cleanq_batchq **q, struct cleanq *other_q);
+
+
+/**
+ * @brief creates a batch queue with the given attributes on top of another
+ *
+ * @param q         the created batch queue
+ * @param other_q   the queue below
+ * @param attr      the attributes of the queue, NULL selects the defaults
+ *
+ * @returns CLEANQ_ERR_OK on success, errval on failure
+ */
+errval_t cleanq_batchq_create_with_attr(struct cleanq_batchq **q, struct cleanq *other_q,
+                                        const struct cleanq_batchq_attr *attr);
+
+
+/**
+ * @brief sends the buffers that have been kept back to the queue below
+ *
+ * @param q     the batch queue
+ *
+ * @returns CLEANQ_ERR_OK if all buffers have been sent, CLEANQ_ERR_QUEUE_FULL if the queue
+ *          below had no room for some of them
+ *
+ * Unlike cleanq_notify(), the other side is not notified.
+ */
+errval_t cleanq_batchq_flush(struct cleanq_batchq *q);
+
+#endif /* CLEANQ_BATCHQ_H_ */
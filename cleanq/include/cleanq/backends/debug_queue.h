@@ -10,12 +10,46 @@
 #ifndef CLEANQ_DEBUGQ_H_
 #define CLEANQ_DEBUGQ_H_ 1
 
+#include <stdbool.h>
 #include <cleanq/cleanq.h>
 
 ///< forward declaration of opaque type
 struct cleanq_debugq;
 
 
+///< how the debug queue checks the ownership of the buffers
+typedef enum {
+    ///< every operation is checked against the owned memory, errors are returned
+    CLEANQ_DEBUGQ_CHECK_ALL = 0,
+
+    ///< only a sample of the buffers is tracked, detects double enqueues and lost buffers
+    CLEANQ_DEBUGQ_CHECK_SAMPLED = 1,
+
+    ///< the operations are logged and checked on a separate thread, errors are counted
+    CLEANQ_DEBUGQ_CHECK_ASYNC = 2,
+} cleanq_debugq_mode_t;
+
+
+///< attributes of a debug queue, zero values select the defaults
+struct cleanq_debugq_attr
+{
+    ///< how the buffers are checked
+    cleanq_debugq_mode_t mode;
+
+    ///< sampled: track one in sample_period buffers, selected by their region id and offset
+    uint32_t sample_period;
+
+    ///< sampled: the fraction of buffers to track instead, used if it is between 0 and 1
+    double sample_fraction;
+
+    ///< async: the number of entries in the operation log, a power of two
+    size_t log_size;
+
+    ///< record the recent operations in the history, see cleanq_debugq_dump_history()
+    bool record;
+};
+
+
 /**
  * @brief creates a debug queue as a wrapper around another
  *
@@ -27,6 +61,57 @@ struct cleanq_debugq;
 errval_t cleanq_debugq_create(struct cleanq_debugq **q, struct cleanq *other_q);
 
 
+/**
+ * @brief creates a debug queue with the given attributes as a wrapper around another
+ *
+ * @param q         the created debug queue
+ * @param other_q   the other queue to be wrapped
+ * @param attr      the attributes of the queue, NULL selects the defaults
+ *
+ * @returns CLEANQ_ERR_OK on success, errval on failure
+ *
+ * A sampled queue tracks a buffer by its region id and offset, from its enqueue until it is
+ * dequeued again. Buffers that are not sampled are passed through unchecked. With the async
+ * mode, the operation log is checked in order by a thread of the debug queue. The datapath
+ * waits if the log is full. The queue must only be used by a single thread.
+ */
+errval_t cleanq_debugq_create_with_attr(struct cleanq_debugq **q, struct cleanq *other_q,
+                                        const struct cleanq_debugq_attr *attr);
+
+
+/**
+ * @brief obtains the number of ownership violations detected so far
+ *
+ * @param q     the debug queue
+ *
+ * @returns the number of violations
+ */
+uint64_t cleanq_debugq_get_errors(struct cleanq_debugq *q);
+
+
+/**
+ * @brief waits until the async checker has processed all logged operations
+ *
+ * @param q     the debug queue
+ *
+ * Returns immediately for the other modes.
+ */
+void cleanq_debugq_sync(struct cleanq_debugq *q);
+
+
+/**
+ * @brief reports the sampled buffers that have been enqueued a long time ago
+ *
+ * @param q         the debug queue
+ * @param max_age   the number of operations after which a buffer is considered lost
+ *
+ * @returns the number of buffers that are outstanding for more than max_age operations
+ *
+ * Only the sampled mode keeps the age of the buffers, the other modes return 0.
+ */
+size_t cleanq_debugq_check_lost(struct cleanq_debugq *q, uint64_t max_age);
+
+
 /**
  * @brief dumps the information about a memory region
  *
@@ -41,6 +126,7 @@ void cleanq_debugq_dump_region(struct cleanq_debugq *q, regionid_t rid);
  *
  * @param q     the debug queue
  *
+ * The history is only recorded if the queue has been created with the record attribute.
  */
 void cleanq_debugq_dump_history(struct cleanq_debugq *q);
 
@@ -11,11 +11,41 @@
 
 #include <stdbool.h>
 #include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
 
 ///< forward declaration
 struct cleanq_ffq;
 
 
+///< attributes of a FFQ, zero values select the defaults
+struct cleanq_ffq_attr
+{
+    ///< the number of message slots per direction, must be a power of two
+    size_t slots;
+
+    ///< the size of a message slot in bytes, a multiple of 64 bytes (32 bytes if compact)
+    size_t desc_size;
+
+    ///< the alignment of the message slots, a power of two dividing desc_size
+    size_t desc_align;
+
+    ///< use 32-byte message slots with 32-bit fields, two per cache line
+    bool compact;
+
+    ///< the maximum length of an inline message in bytes (default 56, one slot), not if compact
+    size_t inline_max;
+
+    ///< the placement of the descriptor rings on NUMA nodes, only used by the creator
+    cleanq_numa_t numa;
+
+    ///< the node of CLEANQ_NUMA_NODE, or the node of the attaching side otherwise
+    int numa_node;
+
+    ///< the backing of the descriptor rings, CLEANQ_MEM_*. Both sides must agree on HUGETLB.
+    uint32_t mem_flags;
+};
+
+
 /**
  * @brief initialized a the ffq backend
  *
@@ -27,4 +57,21 @@ struct cleanq_ffq;
  */
 errval_t cleanq_ffq_create(struct cleanq_ffq **q, const char *name, bool clear);
 
+
+/**
+ * @brief initialized a the ffq backend with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The attributes are only used by the creator of the queue and stored in the header of the
+ * shared memory object. The attaching side takes the geometry from there and ignores attr.
+ */
+errval_t cleanq_ffq_create_with_attr(struct cleanq_ffq **q, const char *name, bool clear,
+                                     const struct cleanq_ffq_attr *attr);
+
 #endif /* CLEANQ_FF_QUEUE_H_ */
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_FF_QUEUE_FAST_H_
+#define CLEANQ_FF_QUEUE_FAST_H_ 1
+
+#include <cleanq/cleanq.h>
+#include <cleanq/fastpath.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ffq_impl.h>
+
+
+/*
+ * ================================================================================================
+ * FFQ Fast Path
+ * ================================================================================================
+ */
+
+
+///< a fast path handle of a FFQ, see cleanq/fastpath.h
+struct cleanq_ffq_fast
+{
+    ///< the backend independent part
+    struct cleanq_fast f;
+
+    ///< the transmit channel of the queue
+    struct ffq_chan *txq;
+
+    ///< the receive channel of the queue
+    struct ffq_chan *rxq;
+};
+
+
+/**
+ * @brief obtains a fast path handle of a FFQ
+ *
+ * @param q         The FFQ
+ * @param fq        The handle to initialize
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED for compact queues
+ */
+errval_t cleanq_ffq_get_fast(struct cleanq_ffq *q, struct cleanq_ffq_fast *fq);
+
+
+/**
+ * @brief enqueues a buffer into a FFQ, like cleanq_enqueue()
+ *
+ * @param fq            The fast path handle of the queue
+ * @param region_id     Id of the memory region the buffer belongs to
+ * @param offset        Offset into the region i.e. where the buffer starts that is enqueued
+ * @param length        Length of the enqueued buffer
+ * @param valid_data    Offset into the buffer where the valid data of this buffer starts
+ * @param valid_length  Length of the valid data of this buffer
+ * @param misc_flags    Any other argument that makes sense to the queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static inline errval_t cleanq_ffq_enqueue_fast(struct cleanq_ffq_fast *fq, regionid_t region_id,
+                                               genoffset_t offset, genoffset_t length,
+                                               genoffset_t valid_data, genoffset_t valid_length,
+                                               uint64_t misc_flags)
+{
+    struct ffq_chan *txq = fq->txq;
+    struct cleanq_stats *stats = fq->f.stats;
+
+    if (!cleanq_fast_check_bounds(&fq->f, region_id, offset, length, valid_data, valid_length)) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    ffq_idx_t oldpos = txq->pos;
+    if (!ffq_impl_send(txq, region_id, offset, length, valid_data, valid_length, misc_flags)) {
+        stats->enqueue_full++;
+        cleanq_fast_occupancy(&fq->f, txq->size);
+        return CLEANQ_ERR_QUEUE_FULL;
+    }
+
+    stats->enqueues++;
+    stats->enqueue_bytes += valid_length;
+
+    /* sample the occupancy once per round through the ring, like the generic path */
+    if (txq->pos <= oldpos) {
+        cleanq_fast_occupancy(&fq->f, ffq_impl_tx_occupancy(txq));
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeues a buffer from a FFQ, like cleanq_dequeue()
+ *
+ * @param fq            The fast path handle of the queue
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param offset        Return pointer to the offset into the region where this buffer starts
+ * @param length        Return pointer to the length of the dequeued buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static inline errval_t cleanq_ffq_dequeue_fast(struct cleanq_ffq_fast *fq, regionid_t *region_id,
+                                               genoffset_t *offset, genoffset_t *length,
+                                               genoffset_t *valid_data, genoffset_t *valid_length,
+                                               uint64_t *misc_flags)
+{
+    struct ffq_chan *rxq = fq->rxq;
+    struct cleanq_stats *stats = fq->f.stats;
+
+    /* commands of the other side and inline messages take the generic path */
+    if (!ffq_impl_can_recv(rxq)) {
+        if (cleanq_fast_cmd_pending(&fq->f)) {
+            return cleanq_dequeue(fq->f.q, region_id, offset, length, valid_data, valid_length,
+                                  misc_flags);
+        }
+        stats->dequeue_empty++;
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    if (ffq_impl_slot_is_inline(ffq_impl_get_slot(rxq)) || cleanq_fast_cmd_pending(&fq->f)) {
+        return cleanq_dequeue(fq->f.q, region_id, offset, length, valid_data, valid_length,
+                              misc_flags);
+    }
+
+    uint64_t rid = 0;
+    ffq_impl_recv(rxq, &rid, offset, length, valid_data, valid_length, misc_flags);
+    *region_id = (regionid_t)rid;
+
+    stats->dequeues++;
+    stats->dequeue_bytes += *valid_length;
+
+    if (!cleanq_fast_check_bounds(&fq->f, *region_id, *offset, *length, *valid_data,
+                                  *valid_length)) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+#endif /* CLEANQ_FF_QUEUE_FAST_H_ */
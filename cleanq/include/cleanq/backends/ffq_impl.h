@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef FFQ_QUEUE_H_
+#define FFQ_QUEUE_H_ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+
+///< this is the cacheline size, adapt for your architecture
+#define ARCH_CACHELINE_SIZE 64
+
+///< index into the FFQ channel
+typedef uint32_t ffq_idx_t;
+
+///< payload type of the FFQ message payload
+typedef uint64_t ffq_payload_t;
+
+///< an empty FFQ slot has this value
+#define FFQ_SLOT_EMPTY ((ffq_payload_t)-1)
+
+///< set in the first word of a slot starting an inline message, region ids have 32 bits
+#define FFQ_SLOT_INLINE ((ffq_payload_t)1 << 32)
+
+///< size of a message in bytes (multiple of architectures cacheline size)
+#define FFQ_MSG_BYTES (1 * ARCH_CACHELINE_SIZE)
+
+///< the alignment of the FFQ messages
+#define FFQ_MSG_ALIGNMENT ARCH_CACHELINE_SIZE
+
+///< the number of words of a message
+#define FFQ_MSG_WORDS (FFQ_MSG_BYTES / sizeof(ffq_payload_t))
+
+///< this is a FFQ message slot, should be aligned to a cache line
+struct __attribute__((aligned(FFQ_MSG_ALIGNMENT))) ffq_slot
+{
+    ///< the message data
+    ffq_payload_t data[FFQ_MSG_WORDS];
+};
+
+///< an empty compact FFQ slot has this value
+#define FFQ_COMPACT_SLOT_EMPTY ((uint32_t)-1)
+
+///< size of a compact message in bytes, two of them share a cache line
+#define FFQ_COMPACT_MSG_BYTES (ARCH_CACHELINE_SIZE / 2)
+
+///< the number of words of a compact message
+#define FFQ_COMPACT_MSG_WORDS (FFQ_COMPACT_MSG_BYTES / sizeof(uint32_t))
+
+///< this is a compact FFQ message slot with 32-bit words
+struct ffq_slot_compact
+{
+    ///< the message data
+    uint32_t data[FFQ_COMPACT_MSG_WORDS];
+};
+
+///< defines a direction of the FFQ channel
+typedef enum { FFQ_DIRECTION_SEND, FFQ_DIRECTION_RECV } ffq_direction_t;
+
+
+///< this is a one directional FFQ channel
+struct ffq_chan
+{
+    ///< pointer to the message slots
+    volatile struct ffq_slot *slots;
+
+    ///< the distance between two message slots in bytes
+    size_t stride;
+
+    ///< the number of slots available in this FFQ channel, a power of two
+    ffq_idx_t size;
+
+    ///< the current position to send/receive from
+    ffq_idx_t pos;
+
+    ///< receive only: the first slot that has been received but not yet released
+    ffq_idx_t release;
+
+    ///< receive only: the number of slots that have been received but not yet released
+    ffq_idx_t pending;
+
+    ///< receive only: release the received slots once this many are pending
+    ffq_idx_t release_batch;
+
+    ///< the directin of this queue
+    ffq_direction_t direction;
+
+    ///< the slots are compact slots
+    bool compact;
+};
+
+
+/*
+ * ================================================================================================
+ * Slot State
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if a slot is empty
+ *
+ * @param q     the FFQ channel
+ * @param s     the slot to check
+ *
+ * @returns TRUE if the slot is empty
+ */
+static inline bool ffq_impl_slot_is_empty(struct ffq_chan *q, volatile struct ffq_slot *s)
+{
+    if (q->compact) {
+        return ((volatile struct ffq_slot_compact *)s)->data[0] == FFQ_COMPACT_SLOT_EMPTY;
+    }
+    return s->data[0] == FFQ_SLOT_EMPTY;
+}
+
+
+/**
+ * @brief checks if a slot holds the start of an inline message
+ *
+ * @param s     the slot to check, not compact
+ *
+ * @returns TRUE if the slot is not empty and its first word has FFQ_SLOT_INLINE set
+ */
+static inline bool ffq_impl_slot_is_inline(volatile struct ffq_slot *s)
+{
+    ffq_payload_t w = s->data[0];
+    return w != FFQ_SLOT_EMPTY && (w & FFQ_SLOT_INLINE);
+}
+
+
+/**
+ * @brief marks a slot as empty
+ *
+ * @param q     the FFQ channel
+ * @param s     the slot to clear
+ */
+static inline void ffq_impl_slot_clear(struct ffq_chan *q, volatile struct ffq_slot *s)
+{
+    if (q->compact) {
+        ((volatile struct ffq_slot_compact *)s)->data[0] = FFQ_COMPACT_SLOT_EMPTY;
+    } else {
+        s->data[0] = FFQ_SLOT_EMPTY;
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Channel Initialization
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief Initialize FF transmit queue state
+ *
+ * @param q       Pointer to queue-state structure to initialize.
+ * @param buf     Pointer to ring buffer for the queue.
+ * @param slots   Size (in slots) of buffer, must be a power of two.
+ * @param stride  Size of a slot in bytes, a multiple of FFQ_MSG_BYTES.
+ * @param compact the slots are compact slots
+ * @param init    initialize the queue message slots
+ *
+ * The state structure and buffer must already be allocated and appropriately
+ * aligned.
+ */
+static inline void ffq_impl_init_tx(struct ffq_chan *q, void *buf, ffq_idx_t slots, size_t stride,
+                                    bool compact, bool init)
+{
+    assert(((uintptr_t)buf & (ARCH_CACHELINE_SIZE - 1)) == 0);
+    assert(slots && !(slots & (slots - 1)));
+    q->direction = FFQ_DIRECTION_SEND;
+    q->size = slots;
+    q->stride = stride;
+    q->slots = (volatile struct ffq_slot *)buf;
+    q->pos = 0;
+    q->compact = compact;
+
+    for (ffq_idx_t i = 0; i < slots && init; i++) {
+        ffq_impl_slot_clear(q, (volatile struct ffq_slot *)((uintptr_t)buf + i * stride));
+    }
+}
+
+
+/**
+ * @brief Initialize FF receive queue state
+ *
+ * @param q       Pointer to queue-state structure to initialize.
+ * @param buf     Pointer to ring buffer for the queue.
+ * @param slots   Size (in slots) of buffer, must be a power of two.
+ * @param stride  Size of a slot in bytes, a multiple of FFQ_MSG_BYTES.
+ * @param compact the slots are compact slots
+ * @param init    initialize the queue message slots
+ *
+ * The state structure and buffer must already be allocated and appropriately
+ * aligned.
+ */
+static inline void ffq_impl_init_rx(struct ffq_chan *q, void *buf, ffq_idx_t slots, size_t stride,
+                                    bool compact, bool init)
+{
+    assert(((uintptr_t)buf & (ARCH_CACHELINE_SIZE - 1)) == 0);
+    assert(slots && !(slots & (slots - 1)));
+    q->direction = FFQ_DIRECTION_RECV;
+    q->size = slots;
+    q->stride = stride;
+    q->slots = (volatile struct ffq_slot *)buf;
+    q->pos = 0;
+    q->release = 0;
+    q->pending = 0;
+    q->release_batch = 1;
+    q->compact = compact;
+
+    for (ffq_idx_t i = 0; i < slots && init; i++) {
+        ffq_impl_slot_clear(q, (volatile struct ffq_slot *)((uintptr_t)buf + i * stride));
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Helper Functions
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains a pointer to the next message slot
+ *
+ * @param q     the FFQ channel
+ *
+ * @return pointer to a message slot
+ */
+static inline volatile struct ffq_slot *ffq_impl_get_slot(struct ffq_chan *q)
+{
+    return (volatile struct ffq_slot *)((uintptr_t)q->slots + q->pos * q->stride);
+}
+
+
+/**
+ * @brief obtains a pointer to the message slot i positions after the current one
+ *
+ * @param q     the FFQ channel
+ * @param i     the distance from the current position
+ *
+ * @return pointer to a message slot
+ */
+static inline volatile struct ffq_slot *ffq_impl_get_slot_at(struct ffq_chan *q, size_t i)
+{
+    size_t idx = (q->pos + i) & (q->size - 1);
+    return (volatile struct ffq_slot *)((uintptr_t)q->slots + idx * q->stride);
+}
+
+
+/**
+ * @brief advances the current position by a number of slots
+ *
+ * @param q     the FFQ channel
+ * @param n     the number of slots to advance
+ */
+static inline void ffq_impl_advance(struct ffq_chan *q, size_t n)
+{
+    q->pos = (q->pos + n) & (q->size - 1);
+}
+
+
+/**
+ * @brief returns the number of received slots that have not been released yet
+ *
+ * @param q     the FFQ receive channel
+ *
+ * @returns the number of pending slots
+ */
+static inline ffq_idx_t ffq_impl_pending(struct ffq_chan *q)
+{
+    return q->pending;
+}
+
+
+/**
+ * @brief sets the number of received slots after which they are released to the sender
+ *
+ * @param q         the FFQ receive channel
+ * @param batch     the number of slots, 0 or 1 releases every slot immediately
+ *
+ * The batch is capped to size - 1, a full ring of pending slots is always released.
+ */
+static inline void ffq_impl_set_release_batch(struct ffq_chan *q, uint64_t batch)
+{
+    if (batch == 0) {
+        batch = 1;
+    }
+
+    if (q->size > 1 && batch > q->size - 1) {
+        batch = q->size - 1;
+    }
+
+    q->release_batch = (ffq_idx_t)batch;
+}
+
+
+/**
+ * @brief releases all received slots to the sender
+ *
+ * @param q     the FFQ receive channel
+ */
+static inline void ffq_impl_release(struct ffq_chan *q)
+{
+    if (q->pending == 0) {
+        return;
+    }
+
+    /* barrier, the slots must be read before they get released */
+    __sync_synchronize();
+
+    /* clear the first data words in order, the sender fills them in the same order */
+    for (ffq_idx_t i = 0; i < q->pending; i++) {
+        ffq_idx_t idx = (q->release + i) & (q->size - 1);
+        uintptr_t slot = (uintptr_t)q->slots + idx * q->stride;
+        ffq_impl_slot_clear(q, (volatile struct ffq_slot *)slot);
+    }
+
+    q->release = q->pos;
+    q->pending = 0;
+}
+
+
+/**
+ * @brief advances the receive position and releases the slots if needed
+ *
+ * @param q     the FFQ receive channel
+ * @param n     the number of slots that have been received, at most size - pending
+ *
+ * The slots are released once release_batch of them are pending, or when there is nothing
+ * more to receive so the sender never waits on slots we have already consumed.
+ */
+static inline void ffq_impl_recv_advance(struct ffq_chan *q, size_t n)
+{
+    ffq_impl_advance(q, n);
+    q->pending += n;
+
+    if (q->pending >= q->release_batch
+        || ffq_impl_slot_is_empty(q, ffq_impl_get_slot(q))) {
+        ffq_impl_release(q);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * TX Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if a message can be sent on that queue-state
+ *
+ * @param q     the FFQ channel to be polled
+ *
+ * @returns TRUE iff a message can be sent, FALSE otherwise
+ */
+static inline bool ffq_impl_can_send(struct ffq_chan *q)
+{
+    assert(q->direction == FFQ_DIRECTION_SEND);
+
+    volatile struct ffq_slot *slot = ffq_impl_get_slot(q);
+    return ffq_impl_slot_is_empty(q, slot);
+}
+
+
+/**
+ * @brief calculates the number of slots the receiver has not released yet
+ *
+ * @param q     the FFQ channel to be polled
+ *
+ * @returns the number of used slots
+ *
+ * The slots are released in order, so the used slots are the ones right before the current
+ * position. This finds the first empty one with a binary search, reading log2(size) slots of
+ * the receiver. The result is approximate as the receiver continues concurrently.
+ */
+static inline ffq_idx_t ffq_impl_tx_occupancy(struct ffq_chan *q)
+{
+    assert(q->direction == FFQ_DIRECTION_SEND);
+
+    ffq_idx_t lo = 0, hi = q->size;
+    while (lo < hi) {
+        ffq_idx_t mid = hi - (hi - lo) / 2;
+        if (ffq_impl_slot_is_empty(q, ffq_impl_get_slot_at(q, q->size - mid))) {
+            hi = mid - 1;
+        } else {
+            lo = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+/**
+ * @brief sends a message on the FFQ channel
+ *
+ * @param q     the FFQ channel to send on
+ * @param arg1  message payload argument
+ * @param arg2  message payload argument
+ * @param arg3  message payload argument
+ * @param arg4  message payload argument
+ * @param arg5  message payload argument
+ * @param arg6  message payload argument
+ *
+ * @returns TRUE if the message is sent, FALSE otherwise
+ */
+static inline bool ffq_impl_send(struct ffq_chan *q, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                                 uint64_t arg4, uint64_t arg5, uint64_t arg6)
+{
+    assert(!q->compact);
+
+    /* check if we can send something */
+    if (!ffq_impl_can_send(q)) {
+        return false;
+    }
+
+    volatile struct ffq_slot *s = ffq_impl_get_slot(q);
+
+    /* write the data words */
+    s->data[1] = arg2;
+    s->data[2] = arg3;
+    s->data[3] = arg4;
+    s->data[4] = arg5;
+    s->data[5] = arg6;
+
+    /* insert memory barrier */
+    __sync_synchronize();
+
+    /* set the first word, signalling the new message */
+    assert(arg1 != FFQ_SLOT_EMPTY);
+    s->data[0] = arg1;
+
+    /* bump the position */
+    q->pos = (q->pos + 1) & (q->size - 1);
+
+    return true;
+}
+
+
+/*
+ * ================================================================================================
+ * RX Path
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if there is a message to be received
+ *
+ * @param q     the FFQ channel to be polled
+ *
+ * @returns TRUE if there is a pending message, false otherwise
+ */
+static inline bool ffq_impl_can_recv(struct ffq_chan *q)
+{
+    assert(q->direction == FFQ_DIRECTION_RECV);
+
+    volatile struct ffq_slot *slot = ffq_impl_get_slot(q);
+    return !ffq_impl_slot_is_empty(q, slot);
+}
+
+
+/**
+ * @brief Receives a message on the FFQ channel
+ *
+ * @param q     the FFQ channel to be received on
+ * @param arg1  returns the payload argument
+ * @param arg2  returns the payload argument
+ * @param arg3  returns the payload argument
+ * @param arg4  returns the payload argument
+ * @param arg5  returns the payload argument
+ * @param arg6  returns the payload argument
+ *
+ * @returns TRUE if a message is received, FALSE otherwise
+ */
+static inline bool ffq_impl_recv(struct ffq_chan *q, uint64_t *arg1, uint64_t *arg2,
+                                 uint64_t *arg3, uint64_t *arg4, uint64_t *arg5, uint64_t *arg6)
+{
+    assert(!q->compact);
+
+    /* check if we can actually receive something */
+    if (!ffq_impl_can_recv(q)) {
+        return false;
+    }
+
+    volatile struct ffq_slot *s = ffq_impl_get_slot(q);
+
+    /* copy the message out of the slot */
+    *arg1 = s->data[0];
+    *arg2 = s->data[1];
+    *arg3 = s->data[2];
+    *arg4 = s->data[3];
+    *arg5 = s->data[4];
+    *arg6 = s->data[5];
+
+    /* bump the position, this releases the slot to the sender eventually */
+    ffq_impl_recv_advance(q, 1);
+
+    return true;
+}
+
+
+#endif /* FFQ_QUEUE_H_ */
@@ -11,11 +11,51 @@
 
 #include <stdbool.h>
 #include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
 
 ///< forwrd declaration
 struct cleanq_ipcq;
 
 
+///< attributes of an IPC queue, zero values select the defaults
+struct cleanq_ipcq_attr
+{
+    ///< the number of descriptor slots per direction, must be a power of two
+    size_t slots;
+
+    ///< the size of a descriptor slot in bytes, at least 64 bytes (32 bytes if compact)
+    size_t desc_size;
+
+    ///< the alignment of the descriptor slots, a power of two dividing desc_size
+    size_t desc_align;
+
+    ///< use 32-byte descriptors with 32-bit fields, two per cache line
+    bool compact;
+
+    ///< the maximum length of an inline message in bytes (default 44, one slot), not if compact
+    size_t inline_max;
+
+    ///< allow several threads to enqueue concurrently on this endpoint
+    bool multi_producer;
+
+    ///< allow several threads to dequeue concurrently on this endpoint
+    bool multi_consumer;
+
+    ///< the placement of the descriptor rings on NUMA nodes, only used by the creator
+    cleanq_numa_t numa;
+
+    ///< the node of CLEANQ_NUMA_NODE, or the node of the attaching side otherwise
+    int numa_node;
+
+    ///< the backing of the descriptor rings, CLEANQ_MEM_*. Both sides must agree on HUGETLB.
+    uint32_t mem_flags;
+
+    ///< the creator records the endpoints so that they can be resumed, an attaching endpoint
+    ///< takes over the role of an endpoint whose process has died, see cleanq_ipcq_resumed()
+    bool resume;
+};
+
+
 /**
  * @brief initialized a ipc descriptor queue
  *
@@ -29,4 +69,75 @@ struct cleanq_ipcq;
 
 errval_t cleanq_ipcq_create(struct cleanq_ipcq **q, char *name, bool clear);
 
+
+/**
+ * @brief initialized a ipc descriptor queue with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending/receiving messages
+ * @param clear     Clear the backing memory by zeroing
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The geometry attributes are only used by the creator of the queue and stored in the header of
+ * the shared memory object. The attaching side takes the geometry from there. The threading
+ * attributes (multi_producer, multi_consumer) apply to the local endpoint and are used by both
+ * sides. Registering and deregistering regions must not run concurrently with the datapath.
+ */
+errval_t cleanq_ipcq_create_with_attr(struct cleanq_ipcq **q, char *name, bool clear,
+                                      const struct cleanq_ipcq_attr *attr);
+
+
+/*
+ * An endpoint that restarts after its process died can reattach without setting up the queue
+ * again. The shared memory object of a queue created with the resume attribute records the
+ * process of each endpoint and the regions they have registered. With the resume attribute,
+ * cleanq_ipcq_create_with_attr() takes over the role of an endpoint whose process is gone
+ * instead of attaching as a second one; without such an endpoint it attaches as usual, and it
+ * fails if both processes are alive.
+ *
+ * The rings are kept: the new endpoint receives from its last acknowledgement on, so the buffers
+ * the other side has sent are not lost, and it sends after the last descriptor the old process
+ * has published. With an acknowledgement batch larger than one, up to that many descriptors are
+ * received twice. The regions of the other side are added to the pool again. Of its own regions,
+ * those allocated with cleanq_memfd_alloc() are handed back by the other side and mapped again,
+ * the others died with the process and are deregistered. An endpoint records at most
+ * CLEANQ_SHM_REGION_SLOTS regions, registering another one fails with
+ * CLEANQ_ERR_TOO_MANY_REGIONS. The other side must be polling while the endpoint is
+ * created, it passes the memory files when it handles the commands.
+ *
+ * Buffers the old process had dequeued and not yet given back are lost, as is the state of
+ * pending asynchronous registrations.
+ */
+
+
+/**
+ * @brief checks if the endpoint has taken over the role of an endpoint whose process has died
+ *
+ * @param q         The IPC queue
+ *
+ * @returns TRUE if the queue has been reattached with the resume attribute
+ */
+bool cleanq_ipcq_resumed(struct cleanq_ipcq *q);
+
+
+/**
+ * @brief obtains the regions known to both endpoints of an IPC queue
+ *
+ * @param q         The IPC queue
+ * @param rids      Returns the region ids
+ * @param caps      Returns the memory of the regions, mapped locally
+ * @param num       The size of the arrays
+ * @param count     Returns the number of regions
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the arrays are too small,
+ *          *count is set to the number of regions then
+ *
+ * A resumed endpoint finds the regions it has restored here, its register callback is not
+ * called for them.
+ */
+errval_t cleanq_ipcq_get_regions(struct cleanq_ipcq *q, regionid_t *rids, struct capref *caps,
+                                 size_t num, size_t *count);
+
 #endif /* CLEANQ_IPCQ_H_ */
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_IPCQ_FAST_H_
+#define CLEANQ_IPCQ_FAST_H_ 1
+
+#include <stdint.h>
+#include <cleanq/cleanq.h>
+#include <cleanq/fastpath.h>
+#include <cleanq/backends/ipc_queue.h>
+
+
+/*
+ * ================================================================================================
+ * IPCQ Descriptor Layout
+ * ================================================================================================
+ */
+
+
+///< this is the alignment of descriptors
+#define IPCQ_DESCRIPTOR_ALIGNMENT 64
+
+
+///< defines an IPC queue descriptor
+struct __attribute__((aligned(IPCQ_DESCRIPTOR_ALIGNMENT))) ipcq_desc
+{
+    ///< sequence ID (flow control)
+    uint64_t seq;
+
+    ///< region ID
+    regionid_t rid;
+
+    ///< padding
+    uint8_t pad[4];
+
+    ////< offset into the memory region
+    genoffset_t offset;
+
+    ///< length of the buffer
+    genoffset_t length;
+
+    ///< start of valid data
+    genoffset_t valid_data;
+
+    ///< length of valid data
+    genoffset_t valid_length;
+
+    ///< the flags
+    uint64_t flags;
+
+    ///< IPCQ_CMD_INLINE for the first slot of an inline message, 0 otherwise
+    uint64_t cmd;
+};
+
+
+/*
+ * ================================================================================================
+ * IPCQ Fast Path
+ * ================================================================================================
+ */
+
+
+///< a fast path handle of an IPC queue, see cleanq/fastpath.h
+struct cleanq_ipcq_fast
+{
+    ///< the backend independent part
+    struct cleanq_fast f;
+
+    ///< the number of slots in the descriptor rings
+    size_t slots;
+
+    ///< the size of a descriptor slot in bytes
+    size_t desc_size;
+
+    ///< transmit descriptors
+    uint8_t *tx_descs;
+
+    ///< the transmit sequence number of the queue
+    uint64_t *tx_seq;
+
+    ///< the cached transmit acknowledgement of the queue
+    uint64_t *tx_seq_ack_cached;
+
+    ///< the transmit acknowledgement written by the other side
+    const volatile size_t *tx_seq_ack;
+
+    ///< receive descriptors
+    uint8_t *rx_descs;
+
+    ///< the receive sequence number of the queue
+    uint64_t *rx_seq;
+
+    ///< the receive acknowledgement read by the other side
+    volatile size_t *rx_seq_ack;
+
+    ///< publish the receive acknowledgement every this many descriptors
+    const uint64_t *ack_batch;
+};
+
+
+/**
+ * @brief obtains a fast path handle of an IPC queue
+ *
+ * @param q         The IPC queue
+ * @param iq        The handle to initialize
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED for compact queues and endpoints
+ *          with several producer or consumer threads
+ */
+errval_t cleanq_ipcq_get_fast(struct cleanq_ipcq *q, struct cleanq_ipcq_fast *iq);
+
+
+/**
+ * @brief returns the descriptor slot for the given sequence number
+ *
+ * @param iq    the fast path handle
+ * @param descs the descriptor ring
+ * @param seq   the sequence number
+ *
+ * @returns pointer to the descriptor slot
+ */
+static inline struct ipcq_desc *cleanq_ipcq_fast_slot(struct cleanq_ipcq_fast *iq, uint8_t *descs,
+                                                      uint64_t seq)
+{
+    return (struct ipcq_desc *)(descs + (seq & (iq->slots - 1)) * iq->desc_size);
+}
+
+
+/**
+ * @brief enqueues a buffer into an IPC queue, like cleanq_enqueue()
+ *
+ * @param iq            The fast path handle of the queue
+ * @param region_id     Id of the memory region the buffer belongs to
+ * @param offset        Offset into the region i.e. where the buffer starts that is enqueued
+ * @param length        Length of the enqueued buffer
+ * @param valid_data    Offset into the buffer where the valid data of this buffer starts
+ * @param valid_length  Length of the valid data of this buffer
+ * @param misc_flags    Any other argument that makes sense to the queue
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static inline errval_t cleanq_ipcq_enqueue_fast(struct cleanq_ipcq_fast *iq, regionid_t region_id,
+                                                genoffset_t offset, genoffset_t length,
+                                                genoffset_t valid_data, genoffset_t valid_length,
+                                                uint64_t misc_flags)
+{
+    struct cleanq_stats *stats = iq->f.stats;
+
+    if (!cleanq_fast_check_bounds(&iq->f, region_id, offset, length, valid_data, valid_length)) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    /* only touch the line of the other side if the cached value says the ring is full */
+    uint64_t seq = *iq->tx_seq;
+    if (seq - *iq->tx_seq_ack_cached == iq->slots) {
+        *iq->tx_seq_ack_cached = *iq->tx_seq_ack;
+        cleanq_fast_occupancy(&iq->f, seq - *iq->tx_seq_ack_cached);
+
+        if (seq - *iq->tx_seq_ack_cached == iq->slots) {
+            stats->enqueue_full++;
+            return CLEANQ_ERR_QUEUE_FULL;
+        }
+    }
+
+    struct ipcq_desc *d = cleanq_ipcq_fast_slot(iq, iq->tx_descs, seq);
+    d->rid = region_id;
+    d->offset = offset;
+    d->length = length;
+    d->valid_data = valid_data;
+    d->valid_length = valid_length;
+    d->flags = misc_flags;
+    d->cmd = 0;
+
+    /* barrier */
+    __sync_synchronize();
+
+    /* write the sequence number, this publishes the descriptor */
+    d->seq = seq;
+    *iq->tx_seq = seq + 1;
+
+    stats->enqueues++;
+    stats->enqueue_bytes += valid_length;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeues a buffer from an IPC queue, like cleanq_dequeue()
+ *
+ * @param iq            The fast path handle of the queue
+ * @param region_id     Return pointer to the id of the memory region the buffer belongs to
+ * @param offset        Return pointer to the offset into the region where this buffer starts
+ * @param length        Return pointer to the length of the dequeued buffer
+ * @param valid_data    Return pointer to where the valid data of this buffer starts
+ * @param valid_length  Return pointer to the length of the valid data of this buffer
+ * @param misc_flags    Return value from other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static inline errval_t cleanq_ipcq_dequeue_fast(struct cleanq_ipcq_fast *iq, regionid_t *region_id,
+                                                genoffset_t *offset, genoffset_t *length,
+                                                genoffset_t *valid_data, genoffset_t *valid_length,
+                                                uint64_t *misc_flags)
+{
+    struct cleanq_stats *stats = iq->f.stats;
+
+    uint64_t seq = *iq->rx_seq;
+    struct ipcq_desc *d = cleanq_ipcq_fast_slot(iq, iq->rx_descs, seq);
+    /* commands of the other side and inline messages take the generic path */
+    if (__atomic_load_n(&d->seq, __ATOMIC_ACQUIRE) < seq) {
+        if (cleanq_fast_cmd_pending(&iq->f)) {
+            return cleanq_dequeue(iq->f.q, region_id, offset, length, valid_data, valid_length,
+                                  misc_flags);
+        }
+        stats->dequeue_empty++;
+        return CLEANQ_ERR_QUEUE_EMPTY;
+    }
+
+    if (d->cmd != 0 || cleanq_fast_cmd_pending(&iq->f)) {
+        return cleanq_dequeue(iq->f.q, region_id, offset, length, valid_data, valid_length,
+                              misc_flags);
+    }
+
+    *region_id = d->rid;
+    *offset = d->offset;
+    *length = d->length;
+    *valid_data = d->valid_data;
+    *valid_length = d->valid_length;
+    *misc_flags = d->flags;
+
+    *iq->rx_seq = ++seq;
+
+    /* publish the acknowledgement every ack_batch descriptors or when the ring is drained */
+    struct ipcq_desc *next = cleanq_ipcq_fast_slot(iq, iq->rx_descs, seq);
+    if (seq - *iq->rx_seq_ack >= *iq->ack_batch
+        || __atomic_load_n(&next->seq, __ATOMIC_ACQUIRE) < seq) {
+        *iq->rx_seq_ack = seq;
+    }
+
+    stats->dequeues++;
+    stats->dequeue_bytes += *valid_length;
+
+    if (!cleanq_fast_check_bounds(&iq->f, *region_id, *offset, *length, *valid_data,
+                                  *valid_length)) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+#endif /* CLEANQ_IPCQ_FAST_H_ */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_THREAD_QUEUE_H_
+#define CLEANQ_THREAD_QUEUE_H_ 1
+
+#include <cleanq/cleanq.h>
+
+///< forward declaration
+struct cleanq_threadq;
+
+
+/*
+ * The thread queue connects two threads of the same process. Each direction is a single
+ * producer, single consumer ring on the heap, there is no shared memory object involved.
+ *
+ * Both ends share their regions: a region registered on one end can be used on the other end
+ * right away, with the same region id. Either thread may register and deregister regions at
+ * any time, the region pool is protected by a lock. A region is only deregistered once the
+ * other thread doesn't use its buffers anymore.
+ */
+
+
+/**
+ * @brief creates the two ends of a thread queue
+ *
+ * @param a         Return pointer to the first end
+ * @param b         Return pointer to the second end
+ * @param slots     The number of buffers per direction, a power of two, 0 selects the default
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the number of slots is invalid,
+ *          CLEANQ_ERR_MALLOC_FAIL if the queue could not be allocated
+ *
+ * Each end is used by one thread at a time and destroyed with cleanq_destroy().
+ */
+errval_t cleanq_threadq_create(struct cleanq_threadq **a, struct cleanq_threadq **b, size_t slots);
+
+#endif /* CLEANQ_THREAD_QUEUE_H_ */
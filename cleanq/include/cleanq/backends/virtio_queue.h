@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_VIRTIO_QUEUE_H_
+#define CLEANQ_VIRTIO_QUEUE_H_ 1
+
+#include <stdbool.h>
+#include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
+
+///< forward declaration
+struct cleanq_virtq;
+
+
+/*
+ * The virtio queue keeps its descriptors in two virtio 1.1 packed virtqueues in a shared memory
+ * object, one per direction. The sending side is the driver of its virtqueue, the receiving side
+ * the device. A buffer is described by the address of its region plus its offset, the base
+ * address being the physical address the region has been registered with, and the receiver finds
+ * the region by that address. The virtqueues run in order: the receiver returns the descriptors
+ * it has taken with a single used descriptor per batch, which frees their slots for the sender.
+ * There is no separate acknowledgement.
+ *
+ * Regions must therefore not overlap in physical address space, also with those of the other
+ * side. The offset and length of a buffer are in the descriptor, the length must fit into 32 bits.
+ * The valid part and the flags travel in a table next to the ring, which other virtio
+ * implementations ignore. There are no inline messages or buffer chains.
+ */
+
+
+///< attributes of a virtio queue, zero values select the defaults
+struct cleanq_virtq_attr
+{
+    ///< the number of descriptors per virtqueue, a power of two up to 32768 (default 256)
+    size_t slots;
+
+    ///< the placement of the virtqueues on NUMA nodes, only used by the creator
+    cleanq_numa_t numa;
+
+    ///< the node of CLEANQ_NUMA_NODE, or the node of the attaching side otherwise
+    int numa_node;
+
+    ///< the backing of the virtqueues, CLEANQ_MEM_*. Both sides must agree on HUGETLB.
+    uint32_t mem_flags;
+};
+
+
+/**
+ * @brief initializes a virtio queue
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_virtq_create(struct cleanq_virtq **q, const char *name, bool clear);
+
+
+/**
+ * @brief initializes a virtio queue with the given attributes
+ *
+ * @param q         Return pointer to the descriptor queue
+ * @param name      Name of the memory use for sending messages
+ * @param clear     Write 0 to memory
+ * @param attr      The attributes of the queue, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The attributes are only used by the creator of the queue and stored in the header of the
+ * shared memory object. The attaching side takes the geometry from there and ignores attr.
+ */
+errval_t cleanq_virtq_create_with_attr(struct cleanq_virtq **q, const char *name, bool clear,
+                                       const struct cleanq_virtq_attr *attr);
+
+#endif /* CLEANQ_VIRTIO_QUEUE_H_ */
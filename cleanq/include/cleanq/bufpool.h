@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_BUFPOOL_H_
+#define CLEANQ_BUFPOOL_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Buffer Pools
+ * ================================================================================================
+ */
+
+
+/*
+ * A buffer pool carves a registered region into fixed-size buffers aligned to
+ * CLEANQ_BUFFER_ALIGNMENT and hands them out as (region id, offset) pairs. The free buffers are
+ * kept in a lock-free LIFO list, so the most recently freed buffer is reused first. Allocating
+ * and freeing may be done by several threads concurrently.
+ *
+ * With CLEANQ_BUFPOOL_FLAG_PERCPU, each core additionally caches a few buffers, which keeps
+ * threads on different cores from contending on the shared list.
+ */
+
+
+///< keep a cache of free buffers per core
+#define CLEANQ_BUFPOOL_FLAG_PERCPU (1U << 0)
+
+
+///< forward declaration of the buffer pool
+struct cleanq_bufpool;
+
+
+/**
+ * @brief creates a new buffer pool on a registered region
+ *
+ * @param bp        Return pointer to the buffer pool
+ * @param cap       The memory of the region
+ * @param rid       The region id the memory has been registered with
+ * @param bufsize   The size of the buffers, rounded up to CLEANQ_BUFFER_ALIGNMENT
+ * @param flags     The flags of the pool, CLEANQ_BUFPOOL_FLAG_*
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Returns CLEANQ_ERR_INVALID_REGION_ARGS if the region does not hold a single buffer. The
+ * region must stay registered as long as the pool is used.
+ */
+errval_t cleanq_bufpool_create(struct cleanq_bufpool **bp, struct capref cap, regionid_t rid,
+                               size_t bufsize, uint32_t flags);
+
+
+/**
+ * @brief destroys a buffer pool, the region is not deregistered
+ *
+ * @param bp        The buffer pool to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_bufpool_destroy(struct cleanq_bufpool *bp);
+
+
+/**
+ * @brief allocates a buffer from the pool
+ *
+ * @param bp        The buffer pool
+ * @param rid       Return pointer to the region id of the buffer
+ * @param offset    Return pointer to the offset of the buffer into the region
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_EMPTY if all buffers are in use
+ */
+errval_t cleanq_bufpool_alloc(struct cleanq_bufpool *bp, regionid_t *rid, genoffset_t *offset);
+
+
+/**
+ * @brief returns a buffer to the pool
+ *
+ * @param bp        The buffer pool
+ * @param rid       The region id of the buffer
+ * @param offset    The offset of the buffer into the region
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Returns CLEANQ_ERR_INVALID_REGION_ID if the buffer belongs to another region and
+ * CLEANQ_ERR_INVALID_BUFFER_ARGS if the offset is not the start of a buffer of the pool.
+ */
+errval_t cleanq_bufpool_free(struct cleanq_bufpool *bp, regionid_t rid, genoffset_t offset);
+
+
+/**
+ * @brief obtains the size of the buffers of the pool
+ *
+ * @param bp        The buffer pool
+ *
+ * @returns the buffer size in bytes
+ */
+size_t cleanq_bufpool_get_bufsize(struct cleanq_bufpool *bp);
+
+
+/**
+ * @brief obtains the virtual address of a buffer
+ *
+ * @param bp        The buffer pool
+ * @param offset    The offset of the buffer into the region
+ *
+ * @returns pointer to the buffer
+ */
+void *cleanq_bufpool_get_vaddr(struct cleanq_bufpool *bp, genoffset_t offset);
+
+#endif /* CLEANQ_BUFPOOL_H_ */
@@ -51,6 +51,19 @@ struct capref
 };
 
 
+///< memory flag: back the memory with pages of the hugetlb pool, fails if there are none
+#define CLEANQ_MEM_HUGETLB (1U << 0)
+
+///< memory flag: ask for transparent huge pages, small pages are used if there are none
+#define CLEANQ_MEM_THP (1U << 1)
+
+///< memory flag: fault in all pages when the memory is set up
+#define CLEANQ_MEM_PREFAULT (1U << 2)
+
+///< memory flag: lock the pages in memory so they never get paged out, implies prefaulting
+#define CLEANQ_MEM_LOCK (1U << 3)
+
+
 /*
  * ================================================================================================
  * CleanQ Buffer
@@ -108,7 +121,14 @@ typedef enum {
     CLEANQ_ERR_QUEUE_EMPTY,            ///< the queue was emtpy
     CLEANQ_ERR_QUEUE_FULL,             ///< the queue was full
     CLEANQ_ERR_BUFFER_NOT_IN_USE,      ///< the buffer was not in use
-    CLEANQ_ERR_MALLOC_FAIL             ///< memory allocation faiiled
+    CLEANQ_ERR_MALLOC_FAIL,            ///< memory allocation faiiled
+    CLEANQ_ERR_TIMEOUT,                ///< the operation timed out
+    CLEANQ_ERR_NOT_SUPPORTED,          ///< the operation is not supported by the queue
+    CLEANQ_ERR_INLINE_PENDING,         ///< the next message carries inline data, not a buffer
+    CLEANQ_ERR_BUFFER_PENDING,         ///< the next message is a buffer, not inline data
+    CLEANQ_ERR_CHAIN_TOO_LONG,         ///< the chain has more buffers than there is room for
+    CLEANQ_ERR_REGISTER_PENDING,       ///< the other side has not completed the registration yet
+    CLEANQ_ERR_TOO_MANY_REGIONS        ///< a resumable endpoint can't record another region
 } errval_t;
 
 
@@ -181,6 +201,182 @@ errval_t cleanq_dequeue(struct cleanq *q, regionid_t *region_id, genoffset_t *of
                         uint64_t *misc_flags);
 
 
+/**
+ * @brief enqueue a batch of buffers into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of buffers that have been enqueued
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was enqueued
+ *
+ * The buffers are enqueued in array order. If the queue does not have enough space, only the
+ * first *num_enq buffers are enqueued. If none could be enqueued, CLEANQ_ERR_QUEUE_FULL is
+ * returned. All buffers are checked before anything is enqueued, a single invalid buffer
+ * rejects the entire batch.
+ */
+errval_t cleanq_enqueue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_enq);
+
+
+/**
+ * @brief dequeue a batch of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of buffers that have been dequeued
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was dequeued
+ *
+ * Returns CLEANQ_ERR_QUEUE_EMPTY if there was nothing to dequeue. Invalid buffers are dropped
+ * as with cleanq_dequeue(), the valid ones are still returned in the first *num_deq elements
+ * together with CLEANQ_ERR_INVALID_BUFFER_ARGS. The batch ends before an inline message, see
+ * cleanq_dequeue_inline().
+ */
+errval_t cleanq_dequeue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_deq);
+
+
+/**
+ * @brief prefetches the first cache lines of the data of a buffer
+ *
+ * @param data          The address of the data
+ * @param len           The length of the data
+ * @param lines         The maximum number of cache lines to prefetch
+ *
+ * Prefetches the cache lines of CLEANQ_BUFFER_ALIGNMENT bytes that hold the first bytes of the
+ * data, at most lines of them and none past the end of the data. Prefetching never faults.
+ */
+static inline void cleanq_prefetch(const void *data, genoffset_t len, size_t lines)
+{
+    uintptr_t line = (uintptr_t)data & ~((uintptr_t)CLEANQ_BUFFER_ALIGNMENT - 1);
+    uintptr_t end = (uintptr_t)data + len;
+    for (size_t i = 0; i < lines && line < end; i++, line += CLEANQ_BUFFER_ALIGNMENT) {
+        __builtin_prefetch((const void *)line, 0, 3);
+    }
+}
+
+
+/**
+ * @brief dequeue a buffer and obtain the address of its valid data
+ *
+ * @param q             The queue to call the operation on
+ * @param buf           Return pointer to the buffer
+ * @param data          Return pointer to the address of the valid data of the buffer
+ * @param prefetch      The number of cache lines of the valid data to prefetch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Works like cleanq_dequeue(). The address is taken from the region the buffer belongs to, as it
+ * has been passed to the register callback, and is only meaningful if the region is mapped in
+ * this process. The first lines of the valid data are prefetched with cleanq_prefetch() before
+ * the buffer is returned.
+ */
+errval_t cleanq_dequeue_data(struct cleanq *q, struct cleanq_buf *buf, void **data,
+                             size_t prefetch);
+
+
+/**
+ * @brief dequeue a batch of buffers and obtain the addresses of their valid data
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param data          Array of the addresses of the valid data to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of buffers that have been dequeued
+ * @param prefetch      The number of cache lines of the valid data to prefetch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was dequeued
+ *
+ * Works like cleanq_dequeue_batch(), data[i] is the address of the valid data of bufs[i]. Only
+ * the first buffer is prefetched, so that the prefetches don't evict each other in large
+ * batches. The application prefetches the next buffer while it processes the current one:
+ *
+ *     for (size_t i = 0; i < num_deq; i++) {
+ *         if (i + 1 < num_deq) {
+ *             cleanq_prefetch(data[i + 1], bufs[i + 1].valid_length, prefetch);
+ *         }
+ *         process(data[i], bufs[i].valid_length);
+ *     }
+ */
+errval_t cleanq_dequeue_batch_data(struct cleanq *q, struct cleanq_buf *bufs, void **data,
+                                   size_t num, size_t *num_deq, size_t prefetch);
+
+
+/**
+ * @brief enqueue a chain of buffers into the queue atomically
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          The segments of the chain, e.g. a header and the payload
+ * @param num           The number of segments
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The other side sees either the entire chain or nothing. If the queue does not have space for
+ * all segments, nothing is enqueued and CLEANQ_ERR_QUEUE_FULL is returned. CLEANQ_FLAG_LAST is
+ * set in the flags of the last segment and cleared in the others. The segments can be in
+ * different regions.
+ */
+errval_t cleanq_enqueue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num);
+
+
+/**
+ * @brief dequeue a chain of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in with the segments
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Dequeues the buffers up to and including the next one with CLEANQ_FLAG_LAST. Buffers that
+ * have not been enqueued as a chain end before anything that is not a buffer, or at the last
+ * one received so far. If the chain does not fit into the array, it stays in the queue, *num_deq
+ * is set to its length and CLEANQ_ERR_CHAIN_TOO_LONG is returned. If a segment is invalid, the
+ * entire chain is dropped and CLEANQ_ERR_INVALID_BUFFER_ARGS is returned.
+ */
+errval_t cleanq_dequeue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_deq);
+
+
+/**
+ * @brief enqueue a message that carries its data inline in the descriptor ring
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The data of the message
+ * @param len           The length of the data, at most CLEANQ_CTRL_INLINE_MAX bytes
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The data is copied into the descriptor slots, no buffer is needed. Small messages take a
+ * single slot, larger ones a few consecutive slots that are published together. Returns
+ * CLEANQ_ERR_NOT_SUPPORTED if the queue can't carry inline data, and
+ * CLEANQ_ERR_INVALID_BUFFER_ARGS if the message is too large.
+ */
+errval_t cleanq_enqueue_inline(struct cleanq *q, const void *data, size_t len);
+
+
+/**
+ * @brief dequeue a message that carries its data inline in the descriptor ring
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Messages are received in order. If the next message is a buffer, CLEANQ_ERR_BUFFER_PENDING is
+ * returned and it has to be dequeued with cleanq_dequeue(), which in turn returns
+ * CLEANQ_ERR_INLINE_PENDING for inline messages. If the buffer is too small, the message stays
+ * in the queue, *len is set to its length and CLEANQ_ERR_INVALID_BUFFER_ARGS is returned.
+ */
+errval_t cleanq_dequeue_inline(struct cleanq *q, void *data, size_t size, size_t *len);
+
+
 /**
  * @brief Send a notification about new buffers on the queue
  *
@@ -191,6 +387,29 @@ errval_t cleanq_dequeue(struct cleanq *q, regionid_t *region_id, genoffset_t *of
 errval_t cleanq_notify(struct cleanq *q);
 
 
+///< wait without a timeout
+#define CLEANQ_WAIT_FOREVER UINT64_MAX
+
+///< the default number of microseconds cleanq_wait() spins before going to sleep
+#define CLEANQ_WAIT_DEFAULT_SPIN_US 50
+
+
+/**
+ * @brief Waits until there is something to dequeue or the timeout expires
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds, 0 to poll, CLEANQ_WAIT_FOREVER to block
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ *
+ * The caller spins for the budget set with CLEANQ_CTRL_WAIT_SPIN_US, then goes to sleep until
+ * the other side calls cleanq_notify(). Wakeups may be spurious. Queues without support for
+ * waiting return CLEANQ_ERR_OK immediately.
+ */
+errval_t cleanq_wait(struct cleanq *q, uint64_t timeout_us);
+
+
 /*
  * ================================================================================================
  * Memory Registration and Deregistration
@@ -222,6 +441,50 @@ errval_t cleanq_register(struct cleanq *q, struct capref cap, regionid_t *region
 errval_t cleanq_deregister(struct cleanq *q, regionid_t region_id, struct capref *cap);
 
 
+///< identifies a batch of asynchronous registrations, 0 is never handed out
+typedef uint64_t cleanq_reg_token_t;
+
+
+/**
+ * @brief Add several memory regions to the queue without waiting for the other side
+ *
+ * @param q              The queue to call the operation on
+ * @param caps           The capabilities of the memory regions
+ * @param num            The number of regions
+ * @param region_ids     Return array of the region ids assigned to the memory
+ * @param num_reg        Return pointer to the number of regions that have been registered
+ * @param token          Return pointer to the token of the batch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one region was registered
+ *
+ * The regions are sent to the other side in one go, as many as there is room for in the queue.
+ * CLEANQ_ERR_QUEUE_FULL is returned if there was no room for any of them. The regions after
+ * num_reg are not registered, they can be passed again in a new batch.
+ *
+ * The other side acknowledges the batch once it has added all regions. The outcome is polled
+ * with cleanq_register_status(), or reported to the callback set with
+ * cleanq_set_register_done_callback(). The acknowledgement arrives like a command while
+ * dequeueing from the queue. Backends without a remote side complete the batch right away.
+ */
+errval_t cleanq_register_batch(struct cleanq *q, const struct capref *caps, size_t num,
+                               regionid_t *region_ids, size_t *num_reg, cleanq_reg_token_t *token);
+
+
+/**
+ * @brief Checks if the other side has completed a batch of asynchronous registrations
+ *
+ * @param q              The queue to call the operation on
+ * @param token          The token returned by cleanq_register_batch()
+ *
+ * @returns CLEANQ_ERR_OK if all regions have been registered on the other side,
+ *          CLEANQ_ERR_REGISTER_PENDING if the other side has not acknowledged the batch yet,
+ *          CLEANQ_ERR_INVALID_REGION_ARGS if the token is unknown, or the first error of the
+ *          other side. The regions of a failed batch stay registered locally, they should be
+ *          deregistered.
+ */
+errval_t cleanq_register_status(struct cleanq *q, cleanq_reg_token_t token);
+
+
 /*
  * ================================================================================================
  * Control Path
@@ -229,6 +492,34 @@ errval_t cleanq_deregister(struct cleanq *q, regionid_t region_id, struct capref
  */
 
 
+///< sets the spin budget of cleanq_wait() in microseconds, returns the old value
+#define CLEANQ_CTRL_WAIT_SPIN_US 1
+
+///< acknowledge received descriptors every N descriptors or when drained, returns the old value
+#define CLEANQ_CTRL_ACK_BATCH 2
+
+///< enables (1) or disables (0) the latency histograms of the queue, returns the old value
+#define CLEANQ_CTRL_HISTOGRAM 3
+
+///< clears the latency histograms of the queue
+#define CLEANQ_CTRL_HISTOGRAM_RESET 4
+
+///< reads the counter CLEANQ_STAT_* given as value from the statistics of the endpoint
+#define CLEANQ_CTRL_STATS 5
+
+///< returns the maximum length of an inline message in bytes, 0 if the queue has none
+#define CLEANQ_CTRL_INLINE_MAX 6
+
+///< returns the NUMA node of the first page of the region given as value
+#define CLEANQ_CTRL_REGION_NODE 7
+
+///< returns the NUMA node of the receive (value 0) or send (value 1) descriptor ring
+#define CLEANQ_CTRL_RING_NODE 8
+
+///< returns the number of asynchronous registrations the other side has not acknowledged yet
+#define CLEANQ_CTRL_REGISTER_PENDING 9
+
+
 /**
  * @brief Send a control message to the queue
  *
@@ -320,4 +611,21 @@ typedef errval_t (*cleanq_deregister_callback_t)(struct cleanq *q, regionid_t re
  */
 void cleanq_set_deregister_callback(struct cleanq *q, cleanq_deregister_callback_t cb);
 
+
+///< defines the signature of a callback function in the event of a completed registration
+typedef void (*cleanq_register_done_callback_t)(struct cleanq *q, cleanq_reg_token_t token,
+                                                errval_t err);
+
+
+/**
+ * @brief sets the callback function for completed asynchronous registrations
+ *
+ * @param q     the cleanq queue state
+ * @param cb    callback function to be called
+ *
+ * The callback is called with the token of the batch and the outcome on the other side. A failed
+ * cleanq_register() is reported with token 0, without a callback a warning is printed instead.
+ */
+void cleanq_set_register_done_callback(struct cleanq *q, cleanq_register_done_callback_t cb);
+
 #endif /* CLEAN_QUEUE_H_ */
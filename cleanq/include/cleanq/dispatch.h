@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_DISPATCH_H_
+#define CLEANQ_DISPATCH_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Dispatchers
+ * ================================================================================================
+ */
+
+
+/*
+ * A dispatcher spreads the buffers received on one queue over a pool of worker threads. Every
+ * worker has a local deque of buffers. A worker takes buffers from the bottom of its own deque,
+ * an idle worker steals them from the top of the deques of the others, and a worker whose deque
+ * is empty and finds nothing to steal dequeues the next batch from the queue into its deque.
+ * A slow buffer therefore only holds up the worker processing it.
+ *
+ * The workers hand the buffers they are done with back to the dispatcher, which enqueues them
+ * into the queue in batches per worker. The queue itself has a single consumer and a single
+ * producer, it is used by one worker at a time: a worker that finds it in use by another one
+ * steals or keeps its completed buffers for the next batch instead of waiting.
+ *
+ * The threads are created by the application, each passes its own worker index to the
+ * dispatcher functions. No other thread may use the queue while the dispatcher is in use.
+ */
+
+
+///< forward declaration of the dispatcher
+struct cleanq_dispatch;
+
+
+///< defines the signature of the function that is handed the buffers the dispatcher drops
+typedef void (*cleanq_dispatch_dropped_callback_t)(void *arg, const struct cleanq_buf *buf,
+                                                   errval_t err);
+
+
+///< attributes of a dispatcher, zero values select the defaults
+struct cleanq_dispatch_attr
+{
+    ///< the number of buffers a worker deque holds, a power of two (default 256)
+    size_t slots;
+
+    ///< the maximum number of buffers dequeued from the queue at once, at most slots (default 32)
+    size_t batch;
+
+    ///< the number of completed buffers a worker enqueues into the queue at once (default 32)
+    size_t return_batch;
+
+    ///< called with every buffer the queue rejects and the error of the queue (default none)
+    cleanq_dispatch_dropped_callback_t dropped;
+
+    ///< the first argument of the dropped callback
+    void *dropped_arg;
+};
+
+
+/**
+ * @brief creates a new dispatcher on a queue
+ *
+ * @param d         Return pointer to the dispatcher
+ * @param q         The queue to receive the buffers from and to return them to
+ * @param workers   The number of workers
+ * @param attr      The attributes of the dispatcher, NULL selects the defaults
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Returns CLEANQ_ERR_INVALID_BUFFER_ARGS if there are no workers, the number of slots is not a
+ * power of two or the batch is larger than the deques.
+ */
+errval_t cleanq_dispatch_create(struct cleanq_dispatch **d, struct cleanq *q, size_t workers,
+                                const struct cleanq_dispatch_attr *attr);
+
+
+/**
+ * @brief destroys a dispatcher, the queue is not destroyed
+ *
+ * @param d         The dispatcher to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The workers must have stopped. The completed buffers are enqueued into the queue one last
+ * time, CLEANQ_ERR_QUEUE_FULL is returned if some of them did not fit, they are handed to the
+ * dropped callback with this error. Buffers still in the deques have not been processed, they
+ * are dropped.
+ */
+errval_t cleanq_dispatch_destroy(struct cleanq_dispatch *d);
+
+
+/**
+ * @brief obtains the next buffer for a worker
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ * @param buf       Return pointer to the buffer
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_EMPTY if there is nothing to process
+ *
+ * Takes a buffer from the deque of the worker, steals one from another worker, or dequeues a
+ * batch from the queue, in this order. Errors of the queue are passed on.
+ */
+errval_t cleanq_dispatch_get(struct cleanq_dispatch *d, size_t worker, struct cleanq_buf *buf);
+
+
+/**
+ * @brief returns a buffer the worker is done with
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ * @param buf       The buffer to be enqueued into the queue
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if the buffer could not be taken
+ *
+ * The buffer is kept until the worker has return_batch of them, which are then enqueued with
+ * cleanq_enqueue_batch(). If the queue is in use, the worker keeps up to twice as many before
+ * it waits for the queue. CLEANQ_ERR_QUEUE_FULL is returned if the queue is full as well, the
+ * buffer should be returned again later.
+ *
+ * Buffers the queue rejects are taken out of the batch one by one without holding up the others.
+ * Each of them is handed to the dropped callback of the attributes, and the error of the queue
+ * is returned once. The callback runs while the worker uses the queue, it must not call into the
+ * dispatcher. Rejected buffers are handed over the same way when cleanq_dispatch_get() or
+ * cleanq_dispatch_flush() return the completed buffers.
+ */
+errval_t cleanq_dispatch_put(struct cleanq_dispatch *d, size_t worker,
+                             const struct cleanq_buf *buf);
+
+
+/**
+ * @brief enqueues the completed buffers of a worker into the queue right away
+ *
+ * @param d         The dispatcher
+ * @param worker    The index of the calling worker
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if some buffers did not fit, or the
+ *          error of the queue if it rejected buffers, see cleanq_dispatch_put()
+ *
+ * Waits until the queue is no longer in use by another worker.
+ */
+errval_t cleanq_dispatch_flush(struct cleanq_dispatch *d, size_t worker);
+
+#endif /* CLEANQ_DISPATCH_H_ */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_FASTPATH_H_
+#define CLEANQ_FASTPATH_H_ 1
+
+#include <stdbool.h>
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+
+
+/*
+ * ================================================================================================
+ * Fast Path
+ * ================================================================================================
+ */
+
+
+/*
+ * An application that knows which backend it uses can bypass the generic cleanq_enqueue() and
+ * cleanq_dequeue() with the typed inline functions of the backend, e.g. those in
+ * cleanq/backends/ff_queue_fast.h. They operate on a fast path handle obtained from the queue
+ * and compile down to the ring accesses of the backend: there is no indirect call, and the
+ * region of a buffer is checked against a small per-handle cache instead of the region pool.
+ *
+ * The cache is keyed by the region id and invalidated whenever a region is registered or
+ * deregistered on the queue. The statistics are updated as usual, but the fast path does not
+ * record into the latency histograms, and it skips the trace hooks: buffers that go through the
+ * fast path don't show up in a trace started with cleanq_trace_start() of cleanq/trace.h, only
+ * the operations the fast path hands over to the generic path do. Only dequeues check the command counter of the other
+ * side, once per call, and hand over to the generic path while there are commands (e.g.
+ * registrations) to handle. A handle belongs to the thread(s) using the endpoint, and must not
+ * be used concurrently with registering or deregistering regions.
+ */
+
+
+///< the number of regions cached by a fast path handle, a power of two
+#define CLEANQ_FAST_REGIONS 4
+
+
+///< a region cached by a fast path handle
+struct cleanq_fast_region
+{
+    ///< the id of the region
+    regionid_t rid;
+
+    ///< the generation of the region pool the entry is valid for
+    uint64_t generation;
+
+    ///< the length of the region
+    genoffset_t len;
+};
+
+
+///< the backend independent part of a fast path handle
+struct cleanq_fast
+{
+    ///< the queue, used for everything the fast path does not handle
+    struct cleanq *q;
+
+    ///< the statistics of the endpoint
+    struct cleanq_stats *stats;
+
+    ///< the generation of the region pool of the queue
+    const uint64_t *generation;
+
+    ///< the number of commands the other side has sent, set by the backend
+    const volatile uint64_t *cmd_sent;
+
+    ///< the number of commands of the other side that have been handled, set by the backend
+    const uint64_t *cmd_handled;
+
+    ///< the cached regions, indexed by the lower bits of the region id
+    struct cleanq_fast_region regions[CLEANQ_FAST_REGIONS];
+};
+
+
+/**
+ * @brief looks up a region of the queue and caches it in the fast path handle
+ *
+ * @param f     The fast path handle
+ * @param rid   The id of the region
+ *
+ * @returns true if the region is registered with the queue
+ */
+bool cleanq_fast_lookup_region(struct cleanq_fast *f, regionid_t rid);
+
+
+/**
+ * @brief checks if a buffer is valid
+ *
+ * @param f             The fast path handle
+ * @param rid           Id of the memory region the buffer belongs to
+ * @param offset        Offset into the region where the buffer starts
+ * @param length        Length of the buffer
+ * @param valid_data    Offset into the buffer where the valid data starts
+ * @param valid_length  Length of the valid data
+ *
+ * @returns true if the buffer lies within a registered region
+ */
+static inline bool cleanq_fast_check_bounds(struct cleanq_fast *f, regionid_t rid,
+                                            genoffset_t offset, genoffset_t length,
+                                            genoffset_t valid_data, genoffset_t valid_length)
+{
+    struct cleanq_fast_region *r = &f->regions[rid & (CLEANQ_FAST_REGIONS - 1)];
+    if (__builtin_expect(r->rid != rid || r->generation != *f->generation, 0)) {
+        if (!cleanq_fast_lookup_region(f, rid)) {
+            return false;
+        }
+    }
+
+    return (length + offset <= r->len) && (valid_data + valid_length <= length);
+}
+
+
+/**
+ * @brief checks if the other side has sent commands that have not been handled yet
+ *
+ * @param f     The fast path handle
+ *
+ * @returns true if the generic path must handle commands first
+ */
+static inline bool cleanq_fast_cmd_pending(struct cleanq_fast *f)
+{
+    return __atomic_load_n(f->cmd_sent, __ATOMIC_ACQUIRE)
+           != __atomic_load_n(f->cmd_handled, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief updates the occupancy high-water mark of the endpoint
+ *
+ * @param f     The fast path handle
+ * @param used  the number of transmit slots in use
+ */
+static inline void cleanq_fast_occupancy(struct cleanq_fast *f, uint64_t used)
+{
+    if (used > f->stats->occupancy_hwm) {
+        f->stats->occupancy_hwm = used;
+    }
+}
+
+#endif /* CLEANQ_FASTPATH_H_ */
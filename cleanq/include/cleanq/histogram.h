@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_HISTOGRAM_H_
+#define CLEANQ_HISTOGRAM_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Latency Histograms
+ * ================================================================================================
+ */
+
+
+/*
+ * Each queue can record the latency of its operations in log-linear histograms of fixed size:
+ * every power of two is split into 32 linear buckets, which bounds the error of any reported
+ * value to about 3%. Recording is a few instructions on the datapath and never allocates.
+ *
+ * The histograms are disabled by default and are switched on and off at runtime with
+ * CLEANQ_CTRL_HISTOGRAM. They can be read while the queue is in use, the values are measured
+ * in timestamp counter cycles. Records of a histogram must not come from more than one thread
+ * at a time, which matches the single producer and single consumer of a queue.
+ */
+
+
+///< the operations that are recorded
+typedef enum {
+    CLEANQ_HIST_ENQUEUE = 0,
+    CLEANQ_HIST_DEQUEUE = 1,
+    CLEANQ_HIST_REGISTER = 2,
+    CLEANQ_HIST_DEREGISTER = 3,
+    CLEANQ_HIST_NUM_OPS = 4,
+} cleanq_hist_op_t;
+
+
+///< summary of the latency of an operation in cycles
+struct cleanq_latency
+{
+    ///< the number of recorded operations
+    uint64_t count;
+
+    ///< the smallest recorded latency
+    uint64_t min;
+
+    ///< the largest recorded latency
+    uint64_t max;
+
+    ///< the average latency
+    uint64_t mean;
+
+    ///< the median latency
+    uint64_t p50;
+
+    ///< the 99th percentile of the latency
+    uint64_t p99;
+
+    ///< the 99.9th percentile of the latency
+    uint64_t p999;
+};
+
+
+/**
+ * @brief obtains the latency summary of an operation on the queue
+ *
+ * @param q         The queue
+ * @param op        The operation, CLEANQ_HIST_*
+ * @param lat       Return pointer to the summary
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The summary is all zeros if nothing has been recorded yet.
+ */
+errval_t cleanq_get_latency(struct cleanq *q, cleanq_hist_op_t op, struct cleanq_latency *lat);
+
+
+/**
+ * @brief obtains an arbitrary percentile of the latency of an operation on the queue
+ *
+ * @param q         The queue
+ * @param op        The operation, CLEANQ_HIST_*
+ * @param pct       The percentile between 0 and 100, e.g. 99.99
+ *
+ * @returns the latency in cycles, 0 if nothing has been recorded yet
+ */
+uint64_t cleanq_get_latency_percentile(struct cleanq *q, cleanq_hist_op_t op, double pct);
+
+#endif /* CLEANQ_HISTOGRAM_H_ */
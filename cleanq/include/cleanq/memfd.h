@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_MEMFD_H_
+#define CLEANQ_MEMFD_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Shared Regions
+ * ================================================================================================
+ */
+
+
+/*
+ * The virtual address of an ordinary region means nothing in another process. A region
+ * allocated with cleanq_memfd_alloc() is backed by an anonymous memory file instead: when it is
+ * registered with an IPC or FastForward queue, the file descriptor is passed to the other side
+ * over a Unix socket next to the queue, and the other side maps the same memory and records its
+ * own mapping in the region pool of its endpoint. Buffers of the region are then shared between
+ * the two processes without any copies. Deregistering the region unmaps it on the other side.
+ *
+ * Registering such a region waits for the other side to attach to the queue, at most
+ * CLEANQ_SHM_ATTACH_TIMEOUT_US, and returns CLEANQ_ERR_TIMEOUT otherwise. Other backends treat
+ * it like any other region.
+ */
+
+
+/**
+ * @brief allocates a region that can be shared with the other side of a queue
+ *
+ * @param cap   Return pointer to the memory of the region
+ * @param len   The size of the region in bytes, rounded up to the page size
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_memfd_alloc(struct capref *cap, size_t len);
+
+
+/**
+ * @brief allocates a region that can be shared with the other side of a queue
+ *
+ * @param cap   Return pointer to the memory of the region
+ * @param len   The size of the region in bytes, rounded up to the (huge) page size
+ * @param flags The backing of the region, CLEANQ_MEM_*
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * With CLEANQ_MEM_HUGETLB, the allocation fails with CLEANQ_ERR_MALLOC_FAIL if the hugetlb pool
+ * doesn't have enough free pages. CLEANQ_MEM_LOCK fails the same way above RLIMIT_MEMLOCK.
+ */
+errval_t cleanq_memfd_alloc_with_flags(struct capref *cap, size_t len, uint32_t flags);
+
+
+/**
+ * @brief frees a region allocated with cleanq_memfd_alloc()
+ *
+ * @param cap   The memory of the region, it must not be registered with a queue anymore
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the region was not allocated with
+ *          cleanq_memfd_alloc(), CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_memfd_free(struct capref *cap);
+
+#endif /* CLEANQ_MEMFD_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_NUMA_H_
+#define CLEANQ_NUMA_H_ 1
+
+#include <stddef.h>
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * NUMA Placement
+ * ================================================================================================
+ */
+
+
+/*
+ * The descriptor rings of the IPC and FastForward queues are written by one side and read by the
+ * other. By default their pages end up on the node of the creator, which touches them first. The
+ * creator can place the rings instead: all of them on one node, or each ring on the node of the
+ * side that reads it (consumer) or writes it (producer). The rings are then page aligned and
+ * bound with mbind() before they are initialized. The attaching side uses the placement of the
+ * creator, CLEANQ_CTRL_RING_NODE tells where the rings ended up.
+ *
+ * Regions are placed by the application, e.g. with cleanq_numa_bind_memory() before the region
+ * is registered. CLEANQ_CTRL_REGION_NODE returns the node of a registered region. The polling
+ * threads should run on the same node, see cleanq_numa_bind_thread().
+ */
+
+
+///< the placement of the descriptor rings of a queue
+typedef enum {
+    CLEANQ_NUMA_FIRST_TOUCH = 0,  ///< don't place the rings, they follow the creator
+    CLEANQ_NUMA_NODE = 1,         ///< place both rings on the given node
+    CLEANQ_NUMA_CONSUMER = 2,     ///< place each ring on the node of its consumer
+    CLEANQ_NUMA_PRODUCER = 3,     ///< place each ring on the node of its producer
+} cleanq_numa_t;
+
+
+/**
+ * @brief obtains the NUMA node the calling thread currently runs on
+ *
+ * @returns the node, 0 if it is unknown
+ */
+int cleanq_numa_current_node(void);
+
+
+/**
+ * @brief binds memory to a NUMA node, pages already there are migrated if possible
+ *
+ * @param addr      the start of the memory
+ * @param len       the size of the memory, the range is extended to full pages
+ * @param node      the node to bind the memory to
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the node does not exist,
+ *          CLEANQ_ERR_NOT_SUPPORTED if the kernel has no NUMA support
+ *
+ * Pages mapped by other processes as well are not migrated, the binding only applies to pages
+ * allocated later.
+ */
+errval_t cleanq_numa_bind_memory(void *addr, size_t len, int node);
+
+
+/**
+ * @brief obtains the NUMA node of the page containing an address
+ *
+ * @param addr      the address, the page is faulted in if it isn't present yet
+ * @param node      returns the node of the page
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the address is not
+ *          mapped, CLEANQ_ERR_NOT_SUPPORTED if the kernel has no NUMA support
+ */
+errval_t cleanq_numa_memory_node(const void *addr, int *node);
+
+
+/**
+ * @brief pins the calling thread to the cpus of a NUMA node and prefers its memory
+ *
+ * @param node      the node to run on
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_REGION_ARGS if the node does not exist
+ *          or has no cpus
+ */
+errval_t cleanq_numa_bind_thread(int node);
+
+#endif /* CLEANQ_NUMA_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_POLLSET_H_
+#define CLEANQ_POLLSET_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Poll Sets
+ * ================================================================================================
+ */
+
+
+/*
+ * A pollset multiplexes the receive side of many queues. It owns a shared memory doorbell
+ * object with one bit per queue. When the other side of a queue calls cleanq_notify(), it sets
+ * the bit of the queue and wakes up the owner of the pollset if it sleeps. Finding the queues
+ * with work is therefore a scan of the bitmap instead of a dequeue attempt on every queue.
+ *
+ * The readiness is edge triggered: a queue is reported once per notification, the caller
+ * should dequeue until the queue is empty before waiting again. A newly added queue is reported
+ * once, as it may already have descriptors.
+ */
+
+
+///< forward declaration of the pollset
+struct cleanq_pollset;
+
+
+/**
+ * @brief creates a new pollset
+ *
+ * @param ps        Return pointer to the pollset
+ * @param name      Name of the shared memory doorbell object
+ * @param capacity  The maximum number of queues in the pollset
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_create(struct cleanq_pollset **ps, const char *name, size_t capacity);
+
+
+/**
+ * @brief destroys a pollset, the queues in it are removed
+ *
+ * @param ps        The pollset to destroy
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_destroy(struct cleanq_pollset *ps);
+
+
+/**
+ * @brief adds a queue to the pollset
+ *
+ * @param ps        The pollset
+ * @param q         The queue to add
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * Returns CLEANQ_ERR_NOT_SUPPORTED if the backend of the queue does not support doorbells, and
+ * CLEANQ_ERR_QUEUE_FULL if the pollset has reached its capacity.
+ */
+errval_t cleanq_pollset_add(struct cleanq_pollset *ps, struct cleanq *q);
+
+
+/**
+ * @brief removes a queue from the pollset
+ *
+ * @param ps        The pollset
+ * @param q         The queue to remove
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_pollset_remove(struct cleanq_pollset *ps, struct cleanq *q);
+
+
+/**
+ * @brief returns the queues that have been notified, waits if there are none
+ *
+ * @param ps            The pollset
+ * @param ready         Array to be filled in with the ready queues
+ * @param max           The size of the array
+ * @param num_ready     Return pointer to the number of ready queues
+ * @param timeout_us    The timeout in microseconds, 0 to poll, CLEANQ_WAIT_FOREVER to block
+ *
+ * @returns CLEANQ_ERR_OK if queues have been returned or there was a spurious wakeup,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ *
+ * As with cleanq_wait(), the caller spins for a short while and then goes to sleep. The queues
+ * are returned in a round-robin fashion if there are more than max of them.
+ */
+errval_t cleanq_pollset_wait(struct cleanq_pollset *ps, struct cleanq **ready, size_t max,
+                             size_t *num_ready, uint64_t timeout_us);
+
+
+/**
+ * @brief sets the spin budget of cleanq_pollset_wait()
+ *
+ * @param ps        The pollset
+ * @param spin_us   The number of microseconds to spin before going to sleep
+ *
+ * @returns the previous spin budget
+ */
+uint64_t cleanq_pollset_set_wait_spin(struct cleanq_pollset *ps, uint64_t spin_us);
+
+#endif /* CLEANQ_POLLSET_H_ */
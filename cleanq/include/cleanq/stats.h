@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_STATS_H_
+#define CLEANQ_STATS_H_ 1
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Queue Statistics
+ * ================================================================================================
+ */
+
+
+/*
+ * Every queue endpoint counts its operations. The counters are plain increments done by the
+ * owner of the endpoint, so they cost next to nothing but are only exact if a single thread
+ * enqueues and a single thread dequeues. The shared memory backends (IPCQ and FFQ) keep the
+ * counters of both endpoints in the header area of the queue object, where other processes such
+ * as cleanq-top can read them without disturbing the queue.
+ *
+ * The occupancy high-water mark is the largest number of transmit slots found in use. It is
+ * sampled on paths the backend takes anyway, e.g. when the cached state of the other side is
+ * refreshed, so short peaks may be missed. A value equal to the ring size means the sender has
+ * run into backpressure.
+ */
+
+
+///< the statistics of a queue endpoint
+struct __attribute__((aligned(64))) cleanq_stats
+{
+    ///< the number of enqueued buffers
+    uint64_t enqueues;
+
+    ///< the number of dequeued buffers
+    uint64_t dequeues;
+
+    ///< the number of enqueue calls that returned CLEANQ_ERR_QUEUE_FULL
+    uint64_t enqueue_full;
+
+    ///< the number of dequeue calls that returned CLEANQ_ERR_QUEUE_EMPTY
+    uint64_t dequeue_empty;
+
+    ///< the sum of the valid length of the enqueued buffers
+    uint64_t enqueue_bytes;
+
+    ///< the sum of the valid length of the dequeued buffers
+    uint64_t dequeue_bytes;
+
+    ///< the largest number of transmit slots found in use
+    uint64_t occupancy_hwm;
+
+    ///< the number of transmit slots, 0 if the backend has no ring
+    uint64_t slots;
+
+    ///< the process owning the endpoint, 0 if nobody has attached yet
+    uint64_t pid;
+};
+
+
+///< the counters that can be read with CLEANQ_CTRL_STATS
+typedef enum {
+    CLEANQ_STAT_ENQUEUES = 0,
+    CLEANQ_STAT_DEQUEUES = 1,
+    CLEANQ_STAT_ENQUEUE_FULL = 2,
+    CLEANQ_STAT_DEQUEUE_EMPTY = 3,
+    CLEANQ_STAT_ENQUEUE_BYTES = 4,
+    CLEANQ_STAT_DEQUEUE_BYTES = 5,
+    CLEANQ_STAT_OCCUPANCY_HWM = 6,
+    CLEANQ_STAT_SLOTS = 7,
+} cleanq_stat_t;
+
+
+/**
+ * @brief obtains a copy of the statistics of the queue endpoint
+ *
+ * @param q         The queue
+ * @param stats     Return pointer to the statistics
+ */
+void cleanq_get_stats(struct cleanq *q, struct cleanq_stats *stats);
+
+
+/*
+ * ================================================================================================
+ * Reading the Statistics of Other Processes
+ * ================================================================================================
+ */
+
+
+///< the index of the endpoint that has created the queue
+#define CLEANQ_STATS_CREATOR 0
+
+///< the index of the endpoint that has attached to the queue
+#define CLEANQ_STATS_ATTACHER 1
+
+
+///< a read-only mapping of the statistics of a shared memory queue
+struct cleanq_stats_view
+{
+    ///< the name of the shared memory object
+    char *name;
+
+    ///< the name of the backend
+    const char *backend;
+
+    ///< the statistics of the endpoints, CLEANQ_STATS_CREATOR and CLEANQ_STATS_ATTACHER
+    const volatile struct cleanq_stats *endpoint[2];
+
+    ///< the mapped memory
+    void *mem;
+
+    ///< the size of the mapping
+    size_t memsize;
+};
+
+
+/**
+ * @brief maps the statistics of a shared memory queue read-only
+ *
+ * @param view      The view to initialize
+ * @param name      The name of the shared memory object of the queue
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the object does not exist, is
+ *          not yet initialized or does not hold statistics
+ *
+ * The queue itself is not affected. The mapping stays valid after the queue is destroyed, the
+ * values do not change anymore then.
+ */
+errval_t cleanq_stats_attach(struct cleanq_stats_view *view, const char *name);
+
+
+/**
+ * @brief unmaps the statistics of a shared memory queue
+ *
+ * @param view      The view to unmap
+ */
+void cleanq_stats_detach(struct cleanq_stats_view *view);
+
+#endif /* CLEANQ_STATS_H_ */
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_TRACE_H_
+#define CLEANQ_TRACE_H_ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Event Tracing
+ * ================================================================================================
+ */
+
+
+/*
+ * A queue can record its operations in a binary trace ring: every enqueue, dequeue, register and
+ * deregister, and every time it was found full or empty, is one fixed size event with the
+ * timestamp counter at its start, its duration, the buffer and the outcome. Recording is a few
+ * stores and nothing is formatted, the ring overwrites the oldest events when it wraps.
+ *
+ * The ring is either in the memory of the process, to be written to a file with
+ * cleanq_trace_save(), or in a shared memory object that outlives the process and can be read
+ * while the queue is in use. cleanq-trace converts the rings of several processes into one
+ * trace in the Chrome JSON format, which Perfetto opens as well. The timestamps are converted
+ * to CLOCK_MONOTONIC, traces of processes on the same machine line up.
+ *
+ * A disabled trace costs a single predictable branch per operation. The fast path functions of
+ * cleanq/fastpath.h bypass the library and are not traced.
+ */
+
+
+///< the magic number at the start of a trace ring, "CLNQTRCE"
+#define CLEANQ_TRACE_MAGIC 0x45435254514e4c43UL
+
+///< the version of the trace format
+#define CLEANQ_TRACE_VERSION 1
+
+///< the default number of events of a trace ring
+#define CLEANQ_TRACE_DEFAULT_EVENTS (1UL << 16)
+
+
+///< the recorded operations
+typedef enum {
+    CLEANQ_TRACE_ENQUEUE = 1,     ///< a buffer or inline message was enqueued
+    CLEANQ_TRACE_DEQUEUE = 2,     ///< a buffer or inline message was dequeued
+    CLEANQ_TRACE_REGISTER = 3,    ///< a region was registered, length is its size
+    CLEANQ_TRACE_DEREGISTER = 4,  ///< a region was deregistered
+    CLEANQ_TRACE_FULL = 5,        ///< an enqueue found the queue full
+    CLEANQ_TRACE_EMPTY = 6,       ///< a dequeue found the queue empty
+} cleanq_trace_op_t;
+
+
+///< a recorded event, two per cache line
+struct cleanq_trace_event
+{
+    ///< the timestamp counter at the start of the operation
+    uint64_t tsc;
+
+    ///< the offset of the buffer, 0 for inline messages and regions
+    uint64_t offset;
+
+    ///< the valid length of the buffer, or the length of the inline message or region
+    uint32_t length;
+
+    ///< the region of the buffer, 0 for inline messages
+    regionid_t rid;
+
+    ///< the duration of the operation in cycles, that of the entire batch for batches
+    uint32_t cycles;
+
+    ///< the thread that called the operation, the low bits of its thread id
+    uint16_t tid;
+
+    ///< the operation, CLEANQ_TRACE_*
+    uint8_t op;
+
+    ///< the outcome of the operation, an errval_t
+    uint8_t err;
+};
+
+
+///< the header of a trace ring, followed by the events
+struct cleanq_trace_hdr
+{
+    ///< CLEANQ_TRACE_MAGIC
+    uint64_t magic;
+
+    ///< CLEANQ_TRACE_VERSION
+    uint32_t version;
+
+    ///< the size of an event in bytes
+    uint32_t event_size;
+
+    ///< the number of events of the ring, a power of two
+    uint64_t events;
+
+    ///< the process that recorded the events
+    uint64_t pid;
+
+    ///< the frequency of the timestamp counter in Hz
+    uint64_t tsc_hz;
+
+    ///< the timestamp counter at CLOCK_MONOTONIC time mono_ns
+    uint64_t tsc_base;
+
+    ///< CLOCK_MONOTONIC time in nanoseconds at tsc_base
+    uint64_t mono_ns;
+
+    ///< the label of the queue
+    char label[64];
+
+    ///< the number of events recorded so far, the ring holds the last ones
+    __attribute__((aligned(64))) uint64_t head;
+} __attribute__((aligned(64)));
+
+
+///< attributes of a trace ring, zero values select the defaults
+struct cleanq_trace_attr
+{
+    ///< the number of events, a power of two (default CLEANQ_TRACE_DEFAULT_EVENTS)
+    size_t events;
+
+    ///< the name of a shared memory object for the ring, NULL keeps it in process memory
+    const char *shm_name;
+
+    ///< the label of the queue in the trace (default the name of the object or "cleanq")
+    const char *label;
+};
+
+
+/**
+ * @brief starts recording the operations of a queue
+ *
+ * @param q         The queue
+ * @param attr      The attributes of the trace ring, NULL selects the defaults
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the number of events is
+ *          not a power of two, CLEANQ_ERR_MALLOC_FAIL if the ring could not be allocated
+ *
+ * A trace that is already running is stopped first. A shared memory object of the same name is
+ * replaced, it stays after the trace is stopped and is removed with shm_unlink().
+ */
+errval_t cleanq_trace_start(struct cleanq *q, const struct cleanq_trace_attr *attr);
+
+
+/**
+ * @brief stops recording and frees the trace ring
+ *
+ * @param q         The queue
+ *
+ * @returns CLEANQ_ERR_OK on success
+ *
+ * No other thread must use the queue meanwhile. Rings in process memory are lost, save them
+ * before.
+ */
+errval_t cleanq_trace_stop(struct cleanq *q);
+
+
+/**
+ * @brief writes the trace ring of a queue to a file
+ *
+ * @param q         The queue
+ * @param path      The path of the file, it is replaced
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the queue is not traced or
+ *          the file could not be written
+ *
+ * The file has the same format as the shared memory object. Events recorded meanwhile may be
+ * written only partially.
+ */
+errval_t cleanq_trace_save(struct cleanq *q, const char *path);
+
+#endif /* CLEANQ_TRACE_H_ */
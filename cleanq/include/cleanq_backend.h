@@ -12,8 +12,17 @@
 #define CLEANQ_BACKEND_H_ 1
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+
+///< forward declaration of the latency histograms
+struct cleanq_histograms;
+
+///< forward declaration of the trace ring
+struct cleanq_trace;
+struct cleanq_fast;
 
 
 /*
@@ -66,6 +75,104 @@ typedef errval_t (*cleanq_dequeue_t)(struct cleanq *q, regionid_t *region_id, ge
                                      genoffset_t *valid_length, uint64_t *misc_flags);
 
 
+/**
+ * @brief Enqueues a batch of buffers into the queue. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of enqueued buffers
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was enqueued
+ *
+ * The buffers have been checked by the library before. The backend should publish the entire
+ * batch with a single barrier. If not implemented, the library falls back to cleanq_enqueue_t.
+ */
+typedef errval_t (*cleanq_enqueue_batch_t)(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                           size_t *num_enq);
+
+
+/**
+ * @brief Dequeues a batch of buffers from the queue. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of dequeued buffers
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if the queue was empty, or CLEANQ_ERR_OK on success
+ *
+ * The backend should acknowledge the entire batch at once. If not implemented, the library
+ * falls back to cleanq_dequeue_t.
+ */
+typedef errval_t (*cleanq_dequeue_batch_t)(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                           size_t *num_deq);
+
+
+/**
+ * @brief Enqueues a chain of buffers into the queue atomically. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param bufs          The segments of the chain, CLEANQ_FLAG_LAST is set in the last one
+ * @param num           The number of segments, at least one
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if not all segments fit, or CLEANQ_ERR_OK on success
+ *
+ * The buffers have been checked by the library before. The other side must never see a part of
+ * the chain: the backend publishes the segments with a single barrier after which the first
+ * one becomes visible. If not implemented, the queue does not support chains.
+ */
+typedef errval_t (*cleanq_enqueue_chain_t)(struct cleanq *q, struct cleanq_buf *bufs, size_t num);
+
+
+/**
+ * @brief Dequeues a chain of buffers from the queue. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if the queue was empty, CLEANQ_ERR_CHAIN_TOO_LONG if the chain
+ *          does not fit into the array, or CLEANQ_ERR_OK on success
+ */
+typedef errval_t (*cleanq_dequeue_chain_t)(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                           size_t *num_deq);
+
+
+/**
+ * @brief Enqueues a message with inline data into the queue. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param data          The data of the message
+ * @param len           The length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The backend checks the length against the negotiated maximum. If not implemented, the queue
+ * does not support inline data.
+ */
+typedef errval_t (*cleanq_enqueue_inline_t)(struct cleanq *q, const void *data, size_t len);
+
+
+/**
+ * @brief Dequeues a message with inline data from the queue. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns CLEANQ_ERR_QUEUE_EMPTY if the queue was empty, CLEANQ_ERR_BUFFER_PENDING if the next
+ *          message is a buffer, or CLEANQ_ERR_OK on success
+ *
+ * Backends implementing this must return CLEANQ_ERR_INLINE_PENDING from cleanq_dequeue_t and
+ * end a batch of cleanq_dequeue_batch_t before an inline message.
+ */
+typedef errval_t (*cleanq_dequeue_inline_t)(struct cleanq *q, void *data, size_t size,
+                                            size_t *len);
+
+
 /**
  * @brief Notifies the device of new descriptors in the queue.
  *
@@ -80,6 +187,31 @@ typedef errval_t (*cleanq_dequeue_t)(struct cleanq *q, regionid_t *region_id, ge
 typedef errval_t (*cleanq_notify_t)(struct cleanq *q);
 
 
+/**
+ * @brief Waits for descriptors to arrive on the queue. Optional for backends
+ *
+ * @param q             The device queue
+ * @param timeout_us    The timeout in microseconds
+ *
+ * @returns CLEANQ_ERR_OK if there may be descriptors, CLEANQ_ERR_TIMEOUT on timeout
+ */
+typedef errval_t (*cleanq_wait_t)(struct cleanq *q, uint64_t timeout_us);
+
+
+/**
+ * @brief Sets the doorbell the other side rings on a notification. Optional for backends
+ *
+ * @param q         The device queue
+ * @param name      The name of the doorbell object of the pollset, NULL to remove it
+ * @param bit       The bit of the queue in the doorbell bitmap
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The other side sets the bit and wakes up the pollset when it notifies about new descriptors.
+ */
+typedef errval_t (*cleanq_doorbell_t)(struct cleanq *q, const char *name, uint32_t bit);
+
+
 /*
  * ------------------------------------------------------------------------------------------------
  * Memory Registration and Deregistration
@@ -113,6 +245,43 @@ typedef errval_t (*cleanq_register_t)(struct cleanq *q, struct capref cap, regio
 typedef errval_t (*cleanq_deregister_t)(struct cleanq *q, regionid_t region_id);
 
 
+/**
+ * @brief Registers several memory regions without waiting for the other side. Optional
+ *
+ * @param q             The device queue handle
+ * @param caps          The capabilities of the memory regions
+ * @param region_ids    The region ids
+ * @param num           The number of regions, at least one
+ * @param token         The token of the batch, to be passed back with cleanq_register_acked()
+ * @param num_reg       Return pointer to the number of regions that have been sent, also on
+ *                      failure, the library deregisters them again
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ *
+ * The other side passes the token of each region to cleanq_register_received(), the last region
+ * that was sent is marked with last. If not implemented, the library falls back to
+ * cleanq_register_t and completes the batch right away.
+ */
+typedef errval_t (*cleanq_register_batch_t)(struct cleanq *q, const struct capref *caps,
+                                            const regionid_t *region_ids, size_t num,
+                                            uint64_t token, size_t *num_reg);
+
+
+/**
+ * @brief Sends the acknowledgement of a batch of registrations. Optional for backends
+ *
+ * @param q             The device queue handle
+ * @param token         The token of the batch
+ * @param err           The outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ *
+ * The other side passes the token and the outcome to cleanq_register_acked(). Required if the
+ * backend implements cleanq_register_batch_t.
+ */
+typedef errval_t (*cleanq_register_ack_t)(struct cleanq *q, uint64_t token, errval_t err);
+
+
 /*
  * ------------------------------------------------------------------------------------------------
  * Memory Registration and Deregistration
@@ -173,18 +342,48 @@ struct cleanq
         ///< region deregistration()
         cleanq_deregister_t dereg;
 
+        ///< batched region registration(), optional
+        cleanq_register_batch_t reg_batch;
+
+        ///< registration acknowledgement(), optional
+        cleanq_register_ack_t reg_ack;
+
         ///< queue control()
         cleanq_control_t ctrl;
 
         ///< queue notify()
         cleanq_notify_t notify;
 
+        ///< queue wait(), optional
+        cleanq_wait_t wait;
+
+        ///< queue doorbell(), optional
+        cleanq_doorbell_t doorbell;
+
         ///< buffer enqueue()
         cleanq_enqueue_t enq;
 
         ///< buffer dequeue()
         cleanq_dequeue_t deq;
 
+        ///< batched buffer enqueue(), optional
+        cleanq_enqueue_batch_t enq_batch;
+
+        ///< batched buffer dequeue(), optional
+        cleanq_dequeue_batch_t deq_batch;
+
+        ///< buffer chain enqueue(), optional
+        cleanq_enqueue_chain_t enq_chain;
+
+        ///< buffer chain dequeue(), optional
+        cleanq_dequeue_chain_t deq_chain;
+
+        ///< inline data enqueue(), optional
+        cleanq_enqueue_inline_t enq_inline;
+
+        ///< inline data dequeue(), optional
+        cleanq_dequeue_inline_t deq_inline;
+
         ///< queue destroy()
         cleanq_destroy_t destroy;
     } f;
@@ -192,6 +391,21 @@ struct cleanq
     ///< use sate pointer
     void *state;
 
+    ///< latency histograms, allocated when first enabled
+    struct cleanq_histograms *hist;
+
+    ///< whether the operations are recorded in the histograms
+    bool hist_enabled;
+
+    ///< the trace ring, NULL if the operations are not traced
+    struct cleanq_trace *trace;
+
+    ///< the statistics of the endpoint, may point into shared memory
+    struct cleanq_stats *stats;
+
+    ///< the statistics of endpoints that don't have shared memory for them
+    struct cleanq_stats local_stats;
+
     ///< event callbacks
     struct {
         ///< event register()
@@ -199,7 +413,46 @@ struct cleanq
 
         ///< event deregister()
         cleanq_deregister_callback_t dereg;
+
+        ///< event registration completed()
+        cleanq_register_done_callback_t reg_done;
     } callbacks;
+
+    ///< asynchronous registrations, see cleanq_register_batch()
+    struct {
+        ///< protects the state, the acknowledgements arrive on the dequeueing threads
+        pthread_mutex_t lock;
+
+        ///< the token of the previous batch
+        uint64_t token;
+
+        ///< the batches that are pending or have failed on the other side
+        struct cleanq_reg_batch *batches;
+
+        ///< the number of pending batches
+        uint64_t num_pending;
+
+        ///< the batch that is being received from the other side
+        uint64_t rx_token;
+
+        ///< the first error of the batch that is being received
+        errval_t rx_err;
+
+        ///< the acknowledgements to be sent once there is room
+        struct cleanq_reg_ack *acks;
+
+        ///< the first acknowledgement to be sent
+        size_t acks_head;
+
+        ///< the number of entries of the acknowledgements
+        size_t acks_num;
+
+        ///< the size of the acknowledgement array
+        size_t acks_size;
+
+        ///< set while there are acknowledgements to be sent
+        bool acks_queued;
+    } reg;
 };
 
 
@@ -220,6 +473,41 @@ struct cleanq
 errval_t cleanq_init(struct cleanq *q);
 
 
+/**
+ * @brief moves the statistics of the queue to the given memory
+ *
+ * @param q         the queue
+ * @param stats     the memory of the statistics, e.g., in the shared memory of the queue
+ * @param slots     the number of transmit slots of the queue
+ *
+ * The statistics are reset and the calling process is recorded as the owner.
+ */
+void cleanq_init_stats(struct cleanq *q, struct cleanq_stats *stats, uint64_t slots);
+
+
+/**
+ * @brief initializes the backend independent part of a fast path handle
+ *
+ * @param f     the fast path handle
+ * @param q     the queue
+ */
+void cleanq_fast_init(struct cleanq_fast *f, struct cleanq *q);
+
+
+/**
+ * @brief records the number of transmit slots in use if it is a new high-water mark
+ *
+ * @param q         the queue
+ * @param used      the number of transmit slots in use
+ */
+static inline void cleanq_stats_occupancy(struct cleanq *q, uint64_t used)
+{
+    if (used > q->stats->occupancy_hwm) {
+        q->stats->occupancy_hwm = used;
+    }
+}
+
+
 /*
  * ================================================================================================
  * Adding and Removing Regions (Internal Functions)
@@ -248,4 +536,116 @@ errval_t cleanq_add_region(struct cleanq *q, struct capref cap, regionid_t rid);
  */
 errval_t cleanq_remove_region(struct cleanq *q, regionid_t rid);
 
+
+/*
+ * ================================================================================================
+ * Asynchronous Registrations (Internal Functions)
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief hands out the token of a new batch of registrations
+ *
+ * @param q      the queue
+ * @param track  whether the batch is pending until the other side acknowledges it
+ * @param token  returns the token
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_MALLOC_FAIL if the batch could not be tracked
+ */
+errval_t cleanq_register_track(struct cleanq *q, bool track, uint64_t *token);
+
+
+/**
+ * @brief removes a batch of registrations that could not be sent
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ */
+void cleanq_register_untrack(struct cleanq *q, uint64_t token);
+
+
+/**
+ * @brief takes back a batch of registrations that has been sent, but failed locally
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ */
+void cleanq_register_revoke(struct cleanq *q, uint64_t token);
+
+
+/**
+ * @brief obtains the state of a batch of registrations
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ *
+ * @returns CLEANQ_ERR_OK if the batch has completed, CLEANQ_ERR_REGISTER_PENDING if it is still
+ *          pending, CLEANQ_ERR_INVALID_REGION_ARGS for unknown tokens, or the error of the batch
+ */
+errval_t cleanq_register_lookup(struct cleanq *q, uint64_t token);
+
+
+/**
+ * @brief obtains the number of pending batches of registrations
+ *
+ * @param q      the queue
+ *
+ * @returns the number of batches the other side has not acknowledged yet
+ */
+uint64_t cleanq_register_num_pending(struct cleanq *q);
+
+
+/**
+ * @brief records the outcome of a region registered by the other side
+ *
+ * @param q      the queue
+ * @param token  the token of the batch, 0 for a region registered with cleanq_register()
+ * @param last   whether this is the last region of the batch
+ * @param err    the outcome of the registration
+ *
+ * The batch is acknowledged after its last region. Single regions are only acknowledged if they
+ * failed.
+ */
+void cleanq_register_received(struct cleanq *q, uint64_t token, bool last, errval_t err);
+
+
+/**
+ * @brief completes a batch of registrations that has been acknowledged by the other side
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ * @param err    the outcome of the batch on the other side
+ */
+void cleanq_register_acked(struct cleanq *q, uint64_t token, errval_t err);
+
+
+/**
+ * @brief sends the acknowledgements that did not fit into the queue before
+ *
+ * @param q      the queue
+ */
+void cleanq_register_flush(struct cleanq *q);
+
+
+/**
+ * @brief sends the queued acknowledgements, if there are any
+ *
+ * @param q      the queue
+ */
+static inline void cleanq_register_flush_queued(struct cleanq *q)
+{
+    if (__atomic_load_n(&q->reg.acks_queued, __ATOMIC_RELAXED)) {
+        cleanq_register_flush(q);
+    }
+}
+
+
+/**
+ * @brief frees the state of the asynchronous registrations
+ *
+ * @param q      the queue
+ */
+void cleanq_register_destroy(struct cleanq *q);
+
 #endif /* CLEANQ_BACKEND_H_ */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_HISTOGRAM_INTERNAL_H_
+#define CLEANQ_HISTOGRAM_INTERNAL_H_ 1
+
+#include <stdint.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/histogram.h>
+
+
+/*
+ * ================================================================================================
+ * Histogram Layout
+ * ================================================================================================
+ */
+
+
+///< the number of bits of a value that select the linear bucket within its power of two
+#define CLEANQ_HIST_SUB_BITS 5
+
+///< the number of linear buckets per power of two
+#define CLEANQ_HIST_SUB_BUCKETS (1UL << CLEANQ_HIST_SUB_BITS)
+
+///< the largest power of two that is resolved, larger values go into the last bucket
+#define CLEANQ_HIST_MAX_MAGNITUDE 40
+
+///< the number of buckets of a histogram
+#define CLEANQ_HIST_NUM_BUCKETS                                                                   \
+    ((CLEANQ_HIST_MAX_MAGNITUDE - CLEANQ_HIST_SUB_BITS + 2) * CLEANQ_HIST_SUB_BUCKETS)
+
+
+///< the histogram of a single operation
+struct cleanq_histogram
+{
+    ///< the number of recorded values
+    uint64_t count;
+
+    ///< the sum of the recorded values
+    uint64_t sum;
+
+    ///< the smallest recorded value
+    uint64_t min;
+
+    ///< the largest recorded value
+    uint64_t max;
+
+    ///< the number of values per bucket
+    uint64_t buckets[CLEANQ_HIST_NUM_BUCKETS];
+};
+
+
+///< the histograms of a queue
+struct cleanq_histograms
+{
+    struct cleanq_histogram h[CLEANQ_HIST_NUM_OPS];
+};
+
+
+/*
+ * ================================================================================================
+ * Recording Values
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief calculates the bucket of a value
+ *
+ * @param value     the value
+ *
+ * @returns index of the bucket
+ *
+ * Values below two times CLEANQ_HIST_SUB_BUCKETS have their own bucket, above that the top
+ * CLEANQ_HIST_SUB_BITS bits after the leading one select the bucket within the power of two.
+ */
+static inline size_t cleanq_histogram_bucket(uint64_t value)
+{
+    if (value < CLEANQ_HIST_SUB_BUCKETS) {
+        return value;
+    }
+
+    size_t mag = 63 - __builtin_clzl(value);
+    if (mag > CLEANQ_HIST_MAX_MAGNITUDE) {
+        return CLEANQ_HIST_NUM_BUCKETS - 1;
+    }
+
+    size_t shift = mag - CLEANQ_HIST_SUB_BITS;
+    return ((shift + 1) << CLEANQ_HIST_SUB_BITS)
+           + ((value >> shift) & (CLEANQ_HIST_SUB_BUCKETS - 1));
+}
+
+
+///< increments a counter that has a single writer but may be read concurrently
+#define CLEANQ_HIST_ADD(field, v)                                                                 \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+
+
+/**
+ * @brief records a value in the histogram
+ *
+ * @param h         the histogram
+ * @param value     the value to record
+ */
+static inline void cleanq_histogram_record(struct cleanq_histogram *h, uint64_t value)
+{
+    CLEANQ_HIST_ADD(h->buckets[cleanq_histogram_bucket(value)], 1);
+    CLEANQ_HIST_ADD(h->count, 1);
+    CLEANQ_HIST_ADD(h->sum, value);
+
+    if (value < __atomic_load_n(&h->min, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Allocation and Reset
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief allocates and clears the histograms of a queue
+ *
+ * @returns pointer to the histograms, NULL on allocation failure
+ */
+struct cleanq_histograms *cleanq_histograms_alloc(void);
+
+
+/**
+ * @brief clears the histograms of a queue
+ *
+ * @param hist      the histograms to clear
+ *
+ * Values recorded concurrently with the reset may or may not be kept.
+ */
+void cleanq_histograms_reset(struct cleanq_histograms *hist);
+
+#endif /* CLEANQ_HISTOGRAM_INTERNAL_H_ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef CLEANQ_MEM_H_
+#define CLEANQ_MEM_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * ================================================================================================
+ * Memory Backing, Library Internal
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief obtains the size of the default huge pages
+ *
+ * @returns the size of a huge page in bytes
+ */
+size_t cleanq_mem_huge_page_size(void);
+
+
+/**
+ * @brief builds the path of a file on the hugetlbfs mount
+ *
+ * @param path      returns the path
+ * @param size      the size of the path buffer
+ * @param name      the name of the file, a leading slash is skipped
+ *
+ * @returns true on success, false if there is no hugetlbfs mounted or the name is too long
+ */
+bool cleanq_mem_hugetlbfs_path(char *path, size_t size, const char *name);
+
+
+/**
+ * @brief applies the page size hints of the memory flags to a fresh mapping
+ *
+ * @param addr      the start of the mapping, not touched yet
+ * @param len       the size of the mapping
+ * @param flags     the memory flags, CLEANQ_MEM_*
+ *
+ * Huge pages are only a hint, the mapping works even if the kernel has no transparent huge pages.
+ */
+void cleanq_mem_advise(void *addr, size_t len, uint32_t flags);
+
+
+/**
+ * @brief prefaults and locks a mapping according to the memory flags
+ *
+ * @param addr      the start of the mapping
+ * @param len       the size of the mapping
+ * @param flags     the memory flags, CLEANQ_MEM_*
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_MALLOC_FAIL if the memory could not be locked
+ *
+ * The contents of the memory are not changed, the other side may already use it.
+ */
+errval_t cleanq_mem_populate(void *addr, size_t len, uint32_t flags);
+
+#endif /* CLEANQ_MEM_H_ */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef CLEANQ_MEMFD_INTERNAL_H_
+#define CLEANQ_MEMFD_INTERNAL_H_ 1
+
+#include <stdbool.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+
+
+/*
+ * ================================================================================================
+ * Shared Regions, Library Internal
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief checks if the memory of a region has been allocated with cleanq_memfd_alloc()
+ *
+ * @param cap   the memory of the region
+ * @param fd    returns the file descriptor backing the memory
+ *
+ * @returns TRUE if the region starts at an allocation and lies within it
+ */
+bool cleanq_memfd_lookup(struct capref cap, int *fd);
+
+
+/**
+ * @brief checks if the memory of a region has been mapped by cleanq_memfd_import()
+ *
+ * @param cap   the memory of the region as recorded in the region pool
+ * @param fd    returns the file descriptor backing the memory
+ *
+ * @returns TRUE if the region starts at an imported mapping and lies within it
+ */
+bool cleanq_memfd_lookup_imported(struct capref cap, int *fd);
+
+
+/**
+ * @brief maps a region the other side of a queue has passed the file descriptor of
+ *
+ * @param cap   the region, the virtual address is replaced with the local mapping
+ * @param fd    the file descriptor, it is kept until the region is unimported
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the memory could not be mapped, CLEANQ_ERR_OK
+ *          on success
+ */
+errval_t cleanq_memfd_import(struct capref *cap, int fd);
+
+
+/**
+ * @brief maps a region this endpoint has allocated before it restarted
+ *
+ * @param cap   the region, the virtual address is replaced with the local mapping
+ * @param fd    the file descriptor as handed back by the other side
+ *
+ * @returns CLEANQ_ERR_INVALID_REGION_ARGS if the memory could not be mapped, CLEANQ_ERR_OK
+ *          on success
+ *
+ * The region counts as allocated with cleanq_memfd_alloc(), it is freed with cleanq_memfd_free().
+ */
+errval_t cleanq_memfd_adopt(struct capref *cap, int fd);
+
+
+/**
+ * @brief unmaps a region if it has been mapped by cleanq_memfd_import()
+ *
+ * @param cap   the region as recorded in the region pool
+ */
+void cleanq_memfd_unimport(struct capref cap);
+
+#endif /* CLEANQ_MEMFD_INTERNAL_H_ */
@@ -0,0 +1,940 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_SHM_H_
+#define CLEANQ_SHM_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
+#include <cleanq/stats.h>
+
+
+/*
+ * ================================================================================================
+ * Shared Memory Header
+ * ================================================================================================
+ */
+
+
+///< magic value of an initialized shared memory queue object ("CLEANQSH")
+#define CLEANQ_SHM_MAGIC 0x4853514e41454c43UL
+
+///< the version of the shared memory layout
+#define CLEANQ_SHM_VERSION 6
+
+///< alignment of the shared memory header and the channels
+#define CLEANQ_SHM_ALIGNMENT 64
+
+///< the number of microseconds the attaching side waits for the creator to initialize the queue
+#define CLEANQ_SHM_ATTACH_TIMEOUT_US (5 * 1000 * 1000)
+
+
+///< layout flag: the descriptors use the compact format of the backend
+#define CLEANQ_SHM_FLAG_COMPACT (1UL << 0)
+
+///< layout flag: the header area holds the statistics of both endpoints after the header
+#define CLEANQ_SHM_FLAG_STATS (1UL << 1)
+
+///< layout flag: the channels are page aligned and placed on the NUMA nodes in the header
+#define CLEANQ_SHM_FLAG_NUMA (1UL << 2)
+
+///< layout flag: the object lives on hugetlbfs, both endpoints must ask for CLEANQ_MEM_HUGETLB
+#define CLEANQ_SHM_FLAG_HUGETLB (1UL << 3)
+
+///< layout flag: the header area records the endpoints and their regions after the commands
+#define CLEANQ_SHM_FLAG_RESUME (1UL << 4)
+
+
+///< the backends using shared memory queue objects
+typedef enum {
+    CLEANQ_SHM_BACKEND_IPCQ = 1,   ///< the IPC queue backend
+    CLEANQ_SHM_BACKEND_FFQ = 2,    ///< the FastForward queue backend
+    CLEANQ_SHM_BACKEND_BELL = 3,   ///< the doorbell bitmap of a pollset
+    CLEANQ_SHM_BACKEND_VIRTQ = 4,  ///< the virtio packed ring backend
+} cleanq_shm_backend_t;
+
+
+///< the self-describing header at the start of a shared memory queue object
+struct __attribute__((aligned(CLEANQ_SHM_ALIGNMENT))) cleanq_shm_header
+{
+    ///< magic value, written last by the creator once the queue is initialized
+    volatile uint64_t magic;
+
+    ///< the version of the layout
+    uint32_t version;
+
+    ///< the backend this shared memory object belongs to
+    uint32_t backend;
+
+    ///< the total size of the shared memory object in bytes
+    uint64_t memsize;
+
+    ///< the size of the header area, this is where the first channel starts
+    uint64_t hdrsize;
+
+    ///< the number of descriptor slots per direction
+    uint64_t slots;
+
+    ///< the size of a descriptor slot in bytes
+    uint64_t desc_size;
+
+    ///< the alignment of the descriptor slots in bytes
+    uint64_t desc_align;
+
+    ///< layout flags, CLEANQ_SHM_FLAG_*
+    uint64_t flags;
+
+    ///< the maximum length of an inline message in bytes, 0 if the backend has none
+    uint64_t inline_max;
+
+    ///< the NUMA node of each channel with CLEANQ_SHM_FLAG_NUMA, -1 if it isn't placed
+    int32_t chan_node[2];
+};
+
+
+///< the size of the statistics area of an object with CLEANQ_SHM_FLAG_STATS
+#define CLEANQ_SHM_STATS_SIZE (2 * sizeof(struct cleanq_stats))
+
+
+/*
+ * Commands to the other side, e.g. registering a region, don't travel through the descriptor
+ * rings. Each direction has a small command channel in the header area after the statistics,
+ * the creator sends on the first one. A command is published before the descriptors refering to
+ * it, so a receiver that checks for commands after it has read descriptors from the ring never
+ * sees a buffer of a region the command has not registered yet. Commands may be sent and handled
+ * by any thread of an endpoint.
+ */
+
+
+///< the number of commands in flight per direction
+#define CLEANQ_SHM_CMD_SLOTS 32
+
+
+///< a command to the other side, the meaning of the fields is defined by the backend
+struct __attribute__((aligned(CLEANQ_SHM_ALIGNMENT))) cleanq_shm_cmd
+{
+    ///< the command
+    uint32_t cmd;
+
+    ///< the region the command refers to
+    regionid_t rid;
+
+    ///< the arguments of the command
+    uint64_t offset;
+    uint64_t length;
+    uint64_t valid_data;
+    uint64_t valid_length;
+    uint64_t flags;
+};
+
+
+///< the command channel of one direction
+struct cleanq_shm_cmd_chan
+{
+    ///< the number of commands sent, written by the sender
+    volatile uint64_t sent __attribute__((aligned(CLEANQ_SHM_ALIGNMENT)));
+
+    ///< the number of commands handled, written by the receiver
+    volatile uint64_t handled __attribute__((aligned(CLEANQ_SHM_ALIGNMENT)));
+
+    ///< the commands, indexed by their sequence number
+    struct cleanq_shm_cmd slots[CLEANQ_SHM_CMD_SLOTS];
+};
+
+
+///< the size of the command channels in the header area
+#define CLEANQ_SHM_CMD_SIZE (2 * sizeof(struct cleanq_shm_cmd_chan))
+
+
+/*
+ * With CLEANQ_SHM_FLAG_RESUME, the header area records the process of each endpoint and the
+ * regions it has registered, following the command channels. A process that opens the object
+ * with resume set takes over the role of an endpoint whose process has died, instead of
+ * attaching as a second endpoint. The rings and the command channels are kept, the backend
+ * continues where the endpoint left off and adds the recorded regions to its pool again.
+ */
+
+
+///< the number of regions recorded per endpoint, later ones are not restored
+#define CLEANQ_SHM_REGION_SLOTS 128
+
+///< region flag: the entry is in use
+#define CLEANQ_SHM_REGION_USED (1U << 0)
+
+///< region flag: the region is backed by a memory file that has been passed to the other side
+#define CLEANQ_SHM_REGION_FD (1U << 1)
+
+
+///< a region recorded by the endpoint that has registered it
+struct cleanq_shm_region
+{
+    ///< the region id
+    regionid_t rid;
+
+    ///< CLEANQ_SHM_REGION_*
+    uint32_t flags;
+
+    ///< the memory of the region, as seen by the endpoint that has registered it
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t len;
+};
+
+
+///< the endpoint records in the header area of an object with CLEANQ_SHM_FLAG_RESUME
+struct __attribute__((aligned(CLEANQ_SHM_ALIGNMENT))) cleanq_shm_resume
+{
+    ///< the process ids of the creator and the attaching endpoint, 0 if there is none
+    volatile int32_t pid[2];
+
+    ///< the regions registered by the creator and the attaching endpoint
+    struct cleanq_shm_region regions[2][CLEANQ_SHM_REGION_SLOTS];
+};
+
+
+///< the size of the endpoint records in the header area
+#define CLEANQ_SHM_RESUME_SIZE sizeof(struct cleanq_shm_resume)
+
+
+///< represents a mapped shared memory queue object
+struct cleanq_shm
+{
+    ///< the name of the shared memory object
+    char *name;
+
+    ///< the mapped memory
+    void *mem;
+
+    ///< the size of the mapped memory
+    size_t memsize;
+
+    ///< whether we have created the shared memory object
+    bool creator;
+
+    ///< whether the object lives on hugetlbfs instead of the posix shared memory directory
+    bool hugetlb;
+
+    ///< pointer to the header at the start of the memory
+    struct cleanq_shm_header *hdr;
+
+    ///< the socket receiving file descriptors from the other side, -1 if there is none
+    int sock;
+
+    ///< the command channel we send on, NULL if the object has none
+    struct cleanq_shm_cmd_chan *cmd_tx;
+
+    ///< the command channel we receive on
+    struct cleanq_shm_cmd_chan *cmd_rx;
+
+    ///< the number of commands we have handled completely, cmd_rx->handled counts them once taken
+    uint64_t cmd_handled;
+
+    ///< serializes the senders of commands
+    pthread_mutex_t cmd_tx_lock;
+
+    ///< serializes the handling of commands, recursive for handlers that dequeue
+    pthread_mutex_t cmd_rx_lock;
+
+    ///< the endpoint records, NULL without CLEANQ_SHM_FLAG_RESUME
+    struct cleanq_shm_resume *resume;
+
+    ///< whether we have taken over the role of an endpoint whose process has died
+    bool resumed;
+
+    ///< the queue the region commands are handled for, see cleanq_shm_cmd_bind()
+    struct cleanq *q;
+};
+
+
+/*
+ * ================================================================================================
+ * Shared Memory Functions
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief rounds up a value to a power of two alignment
+ *
+ * @param val       the value to align
+ * @param align     the alignment, must be a power of two
+ *
+ * @returns the aligned value
+ */
+static inline uint64_t cleanq_shm_align(uint64_t val, uint64_t align)
+{
+    return (val + align - 1) & ~(align - 1);
+}
+
+
+/**
+ * @brief checks if a value is a power of two
+ *
+ * @param val       the value to check
+ *
+ * @returns true if the value is a non-zero power of two
+ */
+static inline bool cleanq_shm_is_pow2(uint64_t val)
+{
+    return val && !(val & (val - 1));
+}
+
+
+/**
+ * @brief calculates the size of a channel, the control line followed by the descriptors
+ *
+ * @param geometry  the geometry of the queue
+ *
+ * @returns the size of a channel in bytes, a multiple of the page size with CLEANQ_SHM_FLAG_NUMA
+ *
+ * The page size is the huge page size with CLEANQ_SHM_FLAG_HUGETLB.
+ */
+uint64_t cleanq_shm_chan_size(const struct cleanq_shm_header *geometry);
+
+
+/**
+ * @brief sets the NUMA nodes of the channels of a queue the creator is about to set up
+ *
+ * @param geometry  the geometry of the queue, must be laid out afterwards
+ * @param numa      the placement of the channels
+ * @param node      the node of CLEANQ_NUMA_NODE, or the node of the attaching side
+ * @param rx_chan   the channel the creator receives on, 0 or 1
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the placement is invalid
+ */
+errval_t cleanq_shm_set_placement(struct cleanq_shm_header *geometry, cleanq_numa_t numa,
+                                  int node, unsigned rx_chan);
+
+
+/**
+ * @brief calculates the header size and the total size of a queue object with two channels
+ *
+ * @param geometry  the geometry of the queue, hdrsize and memsize are updated
+ *
+ * Objects on hugetlbfs consist of full huge pages.
+ */
+void cleanq_shm_layout(struct cleanq_shm_header *geometry);
+
+
+/**
+ * @brief creates or attaches to a shared memory queue object
+ *
+ * @param shm       the shared memory state to initialize
+ * @param name      the name of the shared memory object
+ * @param clear     zero the memory if we are the creator
+ * @param geometry  the geometry of the queue. The creator sets up the object using the supplied
+ *                  geometry, an attaching endpoint gets the geometry of the creator returned.
+ * @param mem_flags the backing of the local mapping, CLEANQ_MEM_*. CLEANQ_MEM_HUGETLB must be
+ *                  reflected in the geometry flags as well.
+ * @param resume    take over the role of an endpoint whose process has died, if there is one
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE on failure
+ *
+ * The creator must call cleanq_shm_publish() once the queue is initialized. Until then, the
+ * attaching side waits up to CLEANQ_SHM_ATTACH_TIMEOUT_US. With CLEANQ_SHM_FLAG_NUMA, the
+ * creator binds the channels to their nodes before the memory is touched.
+ *
+ * With resume and an object that has CLEANQ_SHM_FLAG_RESUME, an endpoint that has never been
+ * attached is attached to as usual. Otherwise the role of the first endpoint whose process has
+ * died is taken over, shm->resumed is set and nothing in the object is changed. Opening fails if
+ * the processes of both endpoints are alive.
+ */
+errval_t cleanq_shm_open(struct cleanq_shm *shm, const char *name, bool clear,
+                         struct cleanq_shm_header *geometry, uint32_t mem_flags, bool resume);
+
+
+/**
+ * @brief obtains the statistics of the local endpoint in the shared memory queue object
+ *
+ * @param shm       the shared memory state
+ *
+ * @returns pointer to the statistics, NULL if the object does not have any
+ *
+ * The creator of the object gets the first entry, the attaching side the second one.
+ */
+static inline struct cleanq_stats *cleanq_shm_stats(struct cleanq_shm *shm)
+{
+    if (!(shm->hdr->flags & CLEANQ_SHM_FLAG_STATS)) {
+        return NULL;
+    }
+
+    struct cleanq_stats *stats = (struct cleanq_stats *)(shm->hdr + 1);
+    return shm->creator ? &stats[CLEANQ_STATS_CREATOR] : &stats[CLEANQ_STATS_ATTACHER];
+}
+
+
+/**
+ * @brief marks the shared memory queue object as initialized
+ *
+ * @param shm       the shared memory state
+ */
+void cleanq_shm_publish(struct cleanq_shm *shm);
+
+
+/**
+ * @brief unmaps and unlinks the shared memory queue object
+ *
+ * @param shm       the shared memory state
+ */
+void cleanq_shm_close(struct cleanq_shm *shm);
+
+
+/*
+ * ================================================================================================
+ * Region Records
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief returns the regions recorded by an endpoint
+ *
+ * @param shm       the shared memory state, the object must have CLEANQ_SHM_FLAG_RESUME
+ * @param local     the local endpoint, or the other side
+ *
+ * @returns the CLEANQ_SHM_REGION_SLOTS records of the endpoint
+ */
+static inline struct cleanq_shm_region *cleanq_shm_regions(struct cleanq_shm *shm, bool local)
+{
+    return shm->resume->regions[shm->creator == local ? 0 : 1];
+}
+
+
+/**
+ * @brief records a region the local endpoint registers with the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ * @param cap       the memory of the region
+ * @param fd        whether its memory file is passed to the other side
+ *
+ * @returns CLEANQ_ERR_OK on success or if the endpoints don't resume, CLEANQ_ERR_TOO_MANY_REGIONS
+ *          if all records are used
+ *
+ * The record is written before the command registering the region is sent.
+ */
+errval_t cleanq_shm_region_record(struct cleanq_shm *shm, regionid_t rid, struct capref cap,
+                                  bool fd);
+
+
+/**
+ * @brief removes the record of a region of the local endpoint
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ */
+void cleanq_shm_region_forget(struct cleanq_shm *shm, regionid_t rid);
+
+
+/*
+ * ================================================================================================
+ * Waiting and Notification
+ * ================================================================================================
+ */
+
+
+///< checks if the waiting side has something to receive
+typedef bool (*cleanq_shm_can_recv_t)(void *arg);
+
+
+/**
+ * @brief spins and then sleeps on a futex word until there is something to receive
+ *
+ * @param waiters       the futex word in shared memory, owned by the waiting side
+ * @param can_recv      function checking whether there is something to receive
+ * @param arg           argument to the can_recv function
+ * @param spin_us       the number of microseconds to spin before going to sleep
+ * @param timeout_us    the timeout in microseconds, or CLEANQ_WAIT_FOREVER
+ *
+ * @returns CLEANQ_ERR_OK if there may be something to receive, CLEANQ_ERR_TIMEOUT on timeout
+ *
+ * The futex word is set while the caller sleeps. Several threads may wait on the same word,
+ * a wakeup wakes all of them.
+ */
+errval_t cleanq_shm_wait(volatile uint32_t *waiters, cleanq_shm_can_recv_t can_recv, void *arg,
+                         uint64_t spin_us, uint64_t timeout_us);
+
+
+/**
+ * @brief wakes up the other side if it sleeps on the futex word
+ *
+ * @param waiters       the futex word in shared memory
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_NOT_SUPPORTED if the wakeup failed
+ *
+ * Must be called after the descriptors have been published. This does not issue a system call
+ * unless the other side is actually sleeping.
+ */
+errval_t cleanq_shm_wake(volatile uint32_t *waiters);
+
+
+
+/*
+ * ================================================================================================
+ * Command Channels
+ * ================================================================================================
+ */
+
+
+///< handles a command of the other side
+typedef void (*cleanq_shm_cmd_handler_t)(void *arg, const struct cleanq_shm_cmd *cmd);
+
+
+/**
+ * @brief sends commands to the other side
+ *
+ * @param shm       the shared memory state
+ * @param cmds      the commands to send
+ * @param num       the number of commands
+ * @param num_sent  returns the number of commands sent, the first ones of the array
+ *
+ * @returns CLEANQ_ERR_OK if at least one command was sent, CLEANQ_ERR_QUEUE_FULL otherwise
+ *
+ * The commands are published together. The caller notifies the other side afterwards.
+ */
+errval_t cleanq_shm_cmd_send(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                             size_t num, size_t *num_sent);
+
+
+/**
+ * @brief sends commands to the other side, waiting for room if needed
+ *
+ * @param shm       the shared memory state
+ * @param cmds      the commands to send
+ * @param num       the number of commands
+ * @param handler   handles the commands of the other side while waiting
+ * @param arg       argument to the handler
+ *
+ * The other side may be waiting for room for its own commands at the same time, we handle them
+ * so neither waits forever. The caller notifies the other side afterwards.
+ */
+void cleanq_shm_cmd_send_all(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                             size_t num, cleanq_shm_cmd_handler_t handler, void *arg);
+
+
+/**
+ * @brief returns the number of commands that can be sent without waiting
+ *
+ * @param shm       the shared memory state
+ *
+ * @returns the number of free command slots, other threads may take them in the meantime
+ */
+size_t cleanq_shm_cmd_free(struct cleanq_shm *shm);
+
+
+/**
+ * @brief checks if the other side has sent commands that have not been handled yet
+ *
+ * @param shm       the shared memory state
+ *
+ * @returns true if there are commands to handle
+ *
+ * This is a single load of the shared counter, the data path calls it once per poll.
+ */
+static inline bool cleanq_shm_cmd_pending(struct cleanq_shm *shm)
+{
+    return __atomic_load_n(&shm->cmd_rx->sent, __ATOMIC_ACQUIRE)
+           != __atomic_load_n(&shm->cmd_handled, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief handles the pending commands of the other side in order
+ *
+ * @param shm       the shared memory state
+ * @param handler   the function handling a command
+ * @param arg       argument to the handler
+ *
+ * Threads handling commands concurrently are serialized. The slot of a command is handed back
+ * to the sender before the handler is called.
+ */
+void cleanq_shm_cmd_handle(struct cleanq_shm *shm, cleanq_shm_cmd_handler_t handler, void *arg);
+
+
+/*
+ * ================================================================================================
+ * Region Commands
+ * ================================================================================================
+ */
+
+
+/*
+ * The backends on a shared memory object register, deregister and acknowledge regions with the
+ * same commands. A region backed by a memory file is passed over the socket before its command,
+ * the receiver maps it and registers the local address. A batch of registrations carries its
+ * token in the valid length, the last command of the batch has CLEANQ_FLAG_LAST set.
+ */
+
+
+///< the region commands, 3 marks inline messages in the descriptors of the IPC queue
+#define CLEANQ_SHM_CMD_REGISTER 1
+#define CLEANQ_SHM_CMD_DEREGISTER 2
+#define CLEANQ_SHM_CMD_REGISTER_FD 4
+#define CLEANQ_SHM_CMD_REGISTER_ACK 5
+#define CLEANQ_SHM_CMD_RESUME 6
+
+
+/**
+ * @brief sets the queue the region commands of the other side are handled for
+ *
+ * @param shm       the shared memory state
+ * @param q         the queue, its pool receives the regions and its notify wakes the other side
+ */
+void cleanq_shm_cmd_bind(struct cleanq_shm *shm, struct cleanq *q);
+
+
+/**
+ * @brief handles the pending region commands of the other side in order
+ *
+ * @param shm       the shared memory state, bound to a queue
+ *
+ * Unknown commands are reported and skipped.
+ */
+void cleanq_shm_cmd_handle_regions(struct cleanq_shm *shm);
+
+
+/**
+ * @brief handles the region commands of the other side, if there are any
+ *
+ * @param shm       the shared memory state, bound to a queue
+ *
+ * Called once per poll, after the descriptors have been read. The commands a buffer depends on
+ * have been sent before it, they are handled before the buffer is returned.
+ */
+static inline void cleanq_shm_cmd_poll(struct cleanq_shm *shm)
+{
+    /* the command counter must not be read before the descriptors */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (cleanq_shm_cmd_pending(shm)) {
+        cleanq_shm_cmd_handle_regions(shm);
+    }
+}
+
+
+/**
+ * @brief sends commands to the other side, waiting for room if needed, and notifies it
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param cmds      the commands
+ * @param num       the number of commands
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The region commands of the other side are handled while waiting, the data path is not
+ * affected.
+ */
+errval_t cleanq_shm_cmd_send_regions(struct cleanq_shm *shm, const struct cleanq_shm_cmd *cmds,
+                                     size_t num);
+
+
+/**
+ * @brief registers a region with the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param cap       the memory of the region
+ * @param rid       the region id
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_register(struct cleanq_shm *shm, struct capref cap, regionid_t rid);
+
+
+/**
+ * @brief registers several regions with the other side without waiting for it
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param caps      the memory of the regions
+ * @param rids      the region ids
+ * @param num       the number of regions
+ * @param token     the token of the batch
+ * @param num_reg   returns the number of regions that have been sent
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if no region could be sent, or CLEANQ_ERR_OK on success
+ *
+ * The commands are sent as far as there is room in the command channel. The file descriptors
+ * go first, and the batch ends where the socket of the other side is full. Once they have been
+ * sent, all commands of the batch must follow, even if another thread has taken the room in the
+ * meantime.
+ */
+errval_t cleanq_shm_register_batch(struct cleanq_shm *shm, const struct capref *caps,
+                                   const regionid_t *rids, size_t num, uint64_t token,
+                                   size_t *num_reg);
+
+
+/**
+ * @brief acknowledges a batch of registrations of the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param token     the token of the batch
+ * @param err       the outcome of the batch
+ *
+ * @returns CLEANQ_ERR_QUEUE_FULL if there is no room, or CLEANQ_ERR_OK on success
+ *
+ * This is called while handling commands, it does not wait for the other side.
+ */
+errval_t cleanq_shm_register_ack(struct cleanq_shm *shm, uint64_t token, errval_t err);
+
+
+/**
+ * @brief deregisters a region with the other side
+ *
+ * @param shm       the shared memory state, bound to a queue
+ * @param rid       the region id
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_deregister(struct cleanq_shm *shm, regionid_t rid);
+
+
+/*
+ * ================================================================================================
+ * Passing File Descriptors
+ * ================================================================================================
+ */
+
+
+/*
+ * Each endpoint of a queue binds a datagram socket in the abstract namespace, named after the
+ * shared memory object and the role of the endpoint. A file descriptor is sent to the socket of
+ * the other side before the command refering to it is sent, so it is there by the time the
+ * command is handled. Descriptors from processes of other users are dropped.
+ */
+
+
+/**
+ * @brief binds the socket receiving file descriptors from the other side
+ *
+ * @param shm       the shared memory state, the object must have been opened
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if the socket could not be bound
+ */
+errval_t cleanq_shm_fd_open(struct cleanq_shm *shm);
+
+
+/**
+ * @brief sends a file descriptor to the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        the file descriptor, it stays open
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if the other side has not attached
+ *          within CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+errval_t cleanq_shm_send_fd(struct cleanq_shm *shm, regionid_t rid, int fd);
+
+
+/**
+ * @brief sends a file descriptor to the other side, unless its socket is full
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        the file descriptor, it stays open
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_QUEUE_FULL if the socket of the other side is
+ *          full, CLEANQ_ERR_TIMEOUT if the other side has not attached within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ *
+ * The other side takes the descriptors off its socket while it handles the commands, a batch of
+ * commands must not wait for room before they have been sent.
+ */
+errval_t cleanq_shm_try_send_fd(struct cleanq_shm *shm, regionid_t rid, int fd);
+
+
+/**
+ * @brief receives the file descriptor of a region from the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id the descriptor belongs to
+ * @param fd        returns the file descriptor
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if it did not arrive within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ *
+ * Descriptors of other regions are left over from failed registrations, they are closed.
+ */
+errval_t cleanq_shm_recv_fd(struct cleanq_shm *shm, regionid_t rid, int *fd);
+
+
+/**
+ * @brief receives the file descriptor of any region from the other side
+ *
+ * @param shm       the shared memory state
+ * @param rid       returns the region id the descriptor belongs to
+ * @param fd        returns the file descriptor
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_TIMEOUT if nothing arrived within
+ *          CLEANQ_SHM_ATTACH_TIMEOUT_US, CLEANQ_ERR_NOT_SUPPORTED without a socket
+ */
+errval_t cleanq_shm_recv_any_fd(struct cleanq_shm *shm, regionid_t *rid, int *fd);
+
+
+/**
+ * @brief maps a region of the other side that is backed by a file descriptor
+ *
+ * @param shm       the shared memory state
+ * @param rid       the region id
+ * @param cap       the region as sent by the other side, returns the local mapping
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_shm_import_region(struct cleanq_shm *shm, regionid_t rid, struct capref *cap);
+
+
+/*
+ * ================================================================================================
+ * Doorbells
+ * ================================================================================================
+ */
+
+
+///< the maximum length of the name of a doorbell object, including the terminating zero
+#define CLEANQ_SHM_DOORBELL_NAME_LEN 40
+
+
+///< the doorbell object of a pollset, placed after the header. The slots are the number of bits
+struct cleanq_shm_bell
+{
+    union {
+        ///< futex word, set while the owner of the pollset sleeps
+        volatile uint32_t waiters;
+
+        ///< padding to a full cache line
+        uint8_t pad[CLEANQ_SHM_ALIGNMENT];
+    };
+
+    ///< the doorbell bitmap, the senders set the bit of their queue
+    volatile uint64_t bits[];
+};
+
+
+///< announces the doorbell of a channel, written by the receiver into its control line
+struct cleanq_shm_doorbell
+{
+    ///< generation counter, odd while the receiver updates the doorbell
+    volatile uint32_t gen;
+
+    ///< the bit to set in the doorbell bitmap
+    uint32_t bit;
+
+    ///< the name of the doorbell object, empty if there is no doorbell
+    char name[CLEANQ_SHM_DOORBELL_NAME_LEN];
+};
+
+
+///< a mapped doorbell object of the other side
+struct cleanq_shm_bell_mapping
+{
+    ///< the mapped shared memory object
+    void *mem;
+
+    ///< the size of the mapping
+    size_t memsize;
+
+    ///< the doorbell in the mapped object
+    struct cleanq_shm_bell *bell;
+
+    ///< the bit to set
+    uint32_t bit;
+
+    ///< the previously used mappings
+    struct cleanq_shm_bell_mapping *next;
+};
+
+
+///< the sending side state of a doorbell
+struct cleanq_shm_doorbell_state
+{
+    ///< the generation of the doorbell that has been mapped
+    volatile uint32_t gen;
+
+    ///< serializes remapping if several threads notify
+    volatile uint32_t lock;
+
+    ///< the current mapping, NULL if there is no doorbell
+    struct cleanq_shm_bell_mapping *current;
+
+    ///< all mappings, they are kept until the endpoint is destroyed
+    struct cleanq_shm_bell_mapping *mappings;
+};
+
+
+/**
+ * @brief announces a doorbell to the sender of a channel
+ *
+ * @param db        the doorbell announcement in the control line of the channel
+ * @param name      the name of the doorbell object, NULL to remove the doorbell
+ * @param bit       the bit the sender should set
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS if the name is too long
+ */
+errval_t cleanq_shm_doorbell_announce(struct cleanq_shm_doorbell *db, const char *name,
+                                      uint32_t bit);
+
+
+/**
+ * @brief maps the doorbell announced by the receiver, slow path of cleanq_shm_doorbell_ring()
+ *
+ * @param db        the doorbell announcement in the control line of the channel
+ * @param state     the sending side state of the doorbell
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INIT_QUEUE if it could not be mapped
+ */
+errval_t cleanq_shm_doorbell_remap(struct cleanq_shm_doorbell *db,
+                                   struct cleanq_shm_doorbell_state *state);
+
+
+/**
+ * @brief rings the doorbell of the receiver of a channel, if it has announced one
+ *
+ * @param db        the doorbell announcement in the control line of the channel
+ * @param state     the sending side state of the doorbell
+ *
+ * @returns CLEANQ_ERR_OK on success, or an error if the doorbell could not be mapped
+ *
+ * Must be called after the descriptors have been published. Without a doorbell, this only
+ * reads the generation from the control line.
+ */
+static inline errval_t cleanq_shm_doorbell_ring(struct cleanq_shm_doorbell *db,
+                                                struct cleanq_shm_doorbell_state *state)
+{
+    if (db->gen != state->gen) {
+        errval_t err = cleanq_shm_doorbell_remap(db, state);
+        if (err_is_fail(err)) {
+            return err;
+        }
+    }
+
+    struct cleanq_shm_bell_mapping *m = __atomic_load_n(&state->current, __ATOMIC_ACQUIRE);
+    if (m == NULL) {
+        return CLEANQ_ERR_OK;
+    }
+
+    /* the previous value tells whether the receiver has taken the bit already */
+    uint64_t mask = 1UL << (m->bit % 64);
+    if (__sync_fetch_and_or(&m->bell->bits[m->bit / 64], mask) & mask) {
+        return CLEANQ_ERR_OK;
+    }
+
+    return cleanq_shm_wake(&m->bell->waiters);
+}
+
+
+/**
+ * @brief unmaps all doorbell objects of the sending side
+ *
+ * @param state     the sending side state of the doorbell
+ */
+void cleanq_shm_doorbell_unmap(struct cleanq_shm_doorbell_state *state);
+
+#endif /* CLEANQ_SHM_H_ */
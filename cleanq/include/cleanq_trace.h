@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef CLEANQ_TRACE_INTERNAL_H_
+#define CLEANQ_TRACE_INTERNAL_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/trace.h>
+
+#include <bench.h>
+#include <cleanq_backend.h>
+
+
+/*
+ * ================================================================================================
+ * Recording Trace Events, Library Internal
+ * ================================================================================================
+ */
+
+
+///< the trace ring of a queue
+struct cleanq_trace
+{
+    ///< the header of the ring, followed by the events
+    struct cleanq_trace_hdr *hdr;
+
+    ///< the events
+    struct cleanq_trace_event *events;
+
+    ///< the number of events minus one
+    uint64_t mask;
+
+    ///< the size of the mapping of the ring
+    size_t size;
+};
+
+
+///< the thread id of the calling thread as recorded in the events, 0 if not known yet
+extern __thread uint16_t cleanq_trace_tid;
+
+
+/**
+ * @brief obtains the thread id of the calling thread for the events
+ *
+ * @returns the low bits of the thread id
+ */
+uint16_t cleanq_trace_thread_id(void);
+
+
+/**
+ * @brief frees the trace ring of a queue
+ *
+ * @param q     the queue
+ */
+void cleanq_trace_free(struct cleanq *q);
+
+
+/**
+ * @brief appends an event to the trace ring of a queue
+ *
+ * @param t         the trace ring
+ * @param op        the operation
+ * @param rid       the region of the buffer
+ * @param offset    the offset of the buffer
+ * @param length    the length of the buffer
+ * @param err       the outcome of the operation
+ * @param start     the timestamp at the start of the operation
+ * @param end       the timestamp at the end of the operation
+ */
+static inline void cleanq_trace_append(struct cleanq_trace *t, cleanq_trace_op_t op,
+                                       regionid_t rid, genoffset_t offset, genoffset_t length,
+                                       errval_t err, uint64_t start, uint64_t end)
+{
+    uint16_t tid = cleanq_trace_tid ? cleanq_trace_tid : cleanq_trace_thread_id();
+
+    /* the enqueueing and the dequeueing thread may record at the same time */
+    uint64_t idx = __atomic_fetch_add(&t->hdr->head, 1, __ATOMIC_RELAXED);
+
+    struct cleanq_trace_event *e = &t->events[idx & t->mask];
+    e->tsc = start;
+    e->offset = offset;
+    e->length = (length > UINT32_MAX) ? UINT32_MAX : (uint32_t)length;
+    e->rid = rid;
+    e->cycles = (end - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(end - start);
+    e->tid = tid;
+    e->op = (uint8_t)op;
+    e->err = (uint8_t)err;
+}
+
+
+/**
+ * @brief records an operation on a single buffer if the queue is traced
+ *
+ * @param q         the queue
+ * @param op        the operation
+ * @param rid       the region of the buffer
+ * @param offset    the offset of the buffer
+ * @param length    the length of the buffer
+ * @param err       the outcome of the operation
+ * @param start     the timestamp at the start of the operation, 0 if none was taken
+ */
+static inline void cleanq_trace_record(struct cleanq *q, cleanq_trace_op_t op, regionid_t rid,
+                                       genoffset_t offset, genoffset_t length, errval_t err,
+                                       uint64_t start)
+{
+    struct cleanq_trace *t = q->trace;
+    if (__builtin_expect(t == NULL, 1)) {
+        return;
+    }
+
+    uint64_t end = rdtsc();
+    cleanq_trace_append(t, op, rid, offset, length, err, start ? start : end, end);
+}
+
+
+/**
+ * @brief records an operation on a batch of buffers if the queue is traced
+ *
+ * @param q         the queue
+ * @param op        the operation
+ * @param bufs      the buffers, one event is recorded for each
+ * @param num       the number of buffers
+ * @param start     the timestamp at the start of the operation, 0 if none was taken
+ */
+static inline void cleanq_trace_record_batch(struct cleanq *q, cleanq_trace_op_t op,
+                                             const struct cleanq_buf *bufs, size_t num,
+                                             uint64_t start)
+{
+    struct cleanq_trace *t = q->trace;
+    if (__builtin_expect(t == NULL, 1)) {
+        return;
+    }
+
+    uint64_t end = rdtsc();
+    for (size_t i = 0; i < num; i++) {
+        cleanq_trace_append(t, op, bufs[i].rid, bufs[i].offset, bufs[i].valid_length,
+                            CLEANQ_ERR_OK, start ? start : end, end);
+    }
+}
+
+#endif /* CLEANQ_TRACE_INTERNAL_H_ */
@@ -9,6 +9,8 @@
 #ifndef REGION_POOL_H_
 #define REGION_POOL_H_ 1
 
+#include <stdbool.h>
+
 #include <cleanq/cleanq.h>
 
 ///< forward declarations
@@ -32,10 +34,27 @@ errval_t region_pool_init(struct region_pool **pool);
  * @param pool  The region pool to free
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * If the pool is shared, only the reference is dropped.
  */
 errval_t region_pool_destroy(struct region_pool *pool);
 
 
+/**
+ * @brief obtains another reference to a region pool
+ *
+ * @param pool          The region pool to share
+ * @param concurrent    The reference is used by another thread than the existing ones
+ *
+ * @returns the region pool
+ *
+ * Every reference is dropped with region_pool_destroy(), the last one frees the pool. Once a
+ * pool is shared with another thread, every operation on it takes its lock. The pool must not
+ * be used by the other threads yet.
+ */
+struct region_pool *region_pool_share(struct region_pool *pool, bool concurrent);
+
+
 /**
  * @brief add a memory region to the region pool
  *
@@ -58,6 +77,9 @@ errval_t region_pool_add_region(struct region_pool *pool, struct capref cap, reg
  * @param region_id     The region id to add to the pool
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The region belongs to the other endpoint, it may overlap with the own regions but not with
+ * the other regions of the other endpoint.
  */
 errval_t region_pool_add_region_with_id(struct region_pool *pool, struct capref cap,
                                         regionid_t region_id);
@@ -92,4 +114,69 @@ bool region_pool_buffer_check_bounds(struct region_pool *pool, regionid_t region
                                      genoffset_t offset, genoffset_t length,
                                      genoffset_t valid_data, genoffset_t valid_length);
 
+
+/**
+ * @brief obtains the length of a region
+ *
+ * @param pool          The pool to get the region from
+ * @param region_id     The id of the region
+ * @param len           Return pointer to the length of the region
+ *
+ * @returns true if the region exists otherwise false
+ */
+bool region_pool_get_length(struct region_pool *pool, regionid_t region_id, size_t *len);
+
+
+/**
+ * @brief obtains the memory of a region
+ *
+ * @param pool          The pool to get the region from
+ * @param region_id     The id of the region
+ * @param cap           Return pointer to the memory of the region
+ *
+ * @returns true if the region exists otherwise false
+ */
+bool region_pool_get_cap(struct region_pool *pool, regionid_t region_id, struct capref *cap);
+
+
+/**
+ * @brief finds the region containing an address
+ *
+ * @param pool          The pool to search
+ * @param addr          The address, relative to the physical base addresses of the regions
+ * @param region_id     Return pointer to the id of the region
+ * @param offset        Return pointer to the offset of the address into the region
+ *
+ * @returns true if a region contains the address otherwise false
+ *
+ * The own regions are searched before the ones of the other endpoint.
+ */
+bool region_pool_find_addr(struct region_pool *pool, uint64_t addr, regionid_t *region_id,
+                           genoffset_t *offset);
+
+
+/**
+ * @brief obtains the generation of the pool, it changes whenever a region is added or removed
+ *
+ * @param pool          The pool
+ *
+ * @returns pointer to the generation counter
+ */
+const uint64_t *region_pool_generation(struct region_pool *pool);
+
+
+/**
+ * @brief check if a batch of buffers is valid
+ *
+ * @param pool          The pool to get the regions from
+ * @param bufs          Array of buffers to check
+ * @param num           The number of buffers in the array
+ *
+ * @returns the number of valid buffers before the first invalid one
+ *
+ * The region lookup is only done when the region id changes between two consecutive buffers.
+ */
+size_t region_pool_buffer_check_bounds_batch(struct region_pool *pool, struct cleanq_buf *bufs,
+                                             size_t num);
+
 #endif /* REGION_POOL_H_ */
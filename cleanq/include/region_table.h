@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+#ifndef REGION_TABLE_H_
+#define REGION_TABLE_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cleanq/cleanq.h>
+
+
+/*
+ * The region table maps region ids to the state kept per region, it is used by the region
+ * pool and by the backends that track the regions themselves.
+ *
+ * The table uses linear probing and is kept at most half full. Region ids are handed out
+ * sequentially, which would result in a single long run of occupied slots. The ids are therefore
+ * spread over the table using Fibonacci hashing, a lookup almost always hits the first slot.
+ * The id is stored next to the value, so a lookup only touches the table.
+ */
+
+
+///< the multiplier for Fibonacci hashing of the region ids
+#define REGION_TABLE_HASH 2654435761U
+
+
+///< a slot of the region table, it is empty if the value is NULL
+struct region_table_slot
+{
+    ///< the region id
+    regionid_t id;
+
+    ///< the state of the region
+    void *value;
+};
+
+
+///< the region table type
+struct region_table
+{
+    ///< the slots, indexed by the hashed region id
+    struct region_table_slot *slots;
+
+    ///< the number of slots, always a power of two
+    uint32_t size;
+
+    ///< the shift to get an index into the slots from the hashed region id
+    uint32_t shift;
+
+    ///< the number of regions in the table
+    uint32_t num;
+};
+
+
+/**
+ * @brief initializes a region table
+ *
+ * @param table     The region table
+ * @param size      The initial number of slots, a power of two
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t region_table_init(struct region_table *table, uint32_t size);
+
+
+/**
+ * @brief frees the slots of a region table, the values are left to the caller
+ *
+ * @param table     The region table
+ */
+void region_table_destroy(struct region_table *table);
+
+
+/**
+ * @brief adds a region to the table, growing it if it is half full
+ *
+ * @param table     The region table
+ * @param id        The id of the region, must not be in the table yet
+ * @param value     The state of the region, not NULL
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t region_table_insert(struct region_table *table, regionid_t id, void *value);
+
+
+/**
+ * @brief removes a region from the table
+ *
+ * @param table     The region table
+ * @param id        The id of the region
+ *
+ * @returns the state of the removed region or NULL if there is no region with this id
+ */
+void *region_table_remove(struct region_table *table, regionid_t id);
+
+
+static inline uint32_t region_table_hash(regionid_t id, uint32_t shift)
+{
+    return (uint32_t)(id * REGION_TABLE_HASH) >> shift;
+}
+
+
+/**
+ * @brief looks up a region by its id
+ *
+ * @param table     The region table
+ * @param id        The id of the region
+ *
+ * @returns the state of the region or NULL if there is no region with this id
+ */
+static inline void *region_table_lookup(const struct region_table *table, regionid_t id)
+{
+    uint32_t mask = table->size - 1;
+    uint32_t index = region_table_hash(id, table->shift);
+
+    // the table is never full, there is always an empty slot to end the search
+    while (true) {
+        struct region_table_slot *slot = &table->slots[index];
+        if (slot->value == NULL || slot->id == id) {
+            return slot->value;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+#endif /* REGION_TABLE_H_ */
@@ -10,6 +10,7 @@
 #ifndef SLAB_ALLOCATOR_H_
 #define SLAB_ALLOCATOR_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/cdefs.h>
 
@@ -18,16 +19,30 @@ __BEGIN_DECLS
 ///< forward delaration
 struct slab_allocator;
 struct slab_head;
+struct slab_depot;
 
 ///< this is the refill function
 typedef int (*slab_refill_func_t)(struct slab_allocator *slabs);
 
+///< the minimum size of a slab, slabs are naturally aligned to their size
+#define SLAB_MIN_SLABSIZE (16 * 1024)
+
+///< don't zero the blocks on allocation
+#define SLAB_FLAG_NO_ZERO (1U << 0)
+
+///< keep a magazine of free blocks per thread, the allocator may be used by several threads
+#define SLAB_FLAG_THREAD_CACHE (1U << 1)
+
 ///< this represents a slab allocator
 struct slab_allocator
 {
     struct slab_head *slabs;         ///< Pointer to list of slabs
+    struct slab_head *partial;       ///< Pointer to list of slabs with free blocks
     size_t blocksize;                ///< Size of blocks managed by this allocator
+    size_t slabsize;                 ///< Size and alignment of the slabs, a power of two
+    uint32_t flags;                  ///< Flags of the allocator, SLAB_FLAG_*
     slab_refill_func_t refill_func;  ///< Refill function
+    struct slab_depot *depot;        ///< Shared state of the thread caches
 };
 
 
@@ -41,6 +56,34 @@ struct slab_allocator
 void slab_init(struct slab_allocator *slabs, size_t blocksize, slab_refill_func_t refill_func);
 
 
+/**
+ * @brief initializes a slab allocator with flags
+ *
+ * @param slabs         the slab allocator to be initialized
+ * @param blocksize     the blocksize of the slabs
+ * @param refill_func   function to be called when the slabs running out of memory
+ * @param flags         the flags of the allocator, SLAB_FLAG_*
+ *
+ * @returns 0 on success, -ENOMEM on failure
+ *
+ * slab_init() zeroes the blocks and is not thread safe. With SLAB_FLAG_THREAD_CACHE, the
+ * allocator must be destroyed with slab_destroy().
+ */
+int slab_init_with_flags(struct slab_allocator *slabs, size_t blocksize,
+                         slab_refill_func_t refill_func, uint32_t flags);
+
+
+/**
+ * @brief destroys a slab allocator
+ *
+ * @param slabs     the slab allocator to be destroyed
+ *
+ * Frees the memory obtained by slab_default_refill(), the memory added with slab_grow() is
+ * owned by the caller. All blocks become invalid.
+ */
+void slab_destroy(struct slab_allocator *slabs);
+
+
 /**
  * @brief allocates a new block from the slab allocator
  *
@@ -78,8 +121,14 @@ int slab_default_refill(struct slab_allocator *slabs);
  * @param slabs     the slab allocator to refill
  * @param buf       pointer to backing memory
  * @param buflen    size of the backing memory in bytes
+ *
+ * @returns 0 on success, -EINVAL if no aligned piece of the buffer holds a block
+ *
+ * The owning slab of a block is found by masking its address, so only the naturally aligned
+ * slabsize pieces of the buffer are used. The buffer should be aligned to the slabsize, a
+ * smaller or unaligned buffer may add nothing.
  */
-void slab_grow(struct slab_allocator *slabs, void *buf, size_t buflen);
+int slab_grow(struct slab_allocator *slabs, void *buf, size_t buflen);
 
 
 __END_DECLS
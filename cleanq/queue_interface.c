@@ -8,11 +8,18 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <cleanq/cleanq.h>
+#include <cleanq/histogram.h>
+#include <cleanq/numa.h>
+#include <cleanq/stats.h>
 
+#include <bench.h>
 #include <cleanq_backend.h>
+#include <cleanq_histogram.h>
+#include <cleanq_trace.h>
 #include <region_pool.h>
 #include <debug.h>
 
@@ -24,75 +31,144 @@
  */
 
 
-#ifdef BENCH_CLEANQ
-#    include <bench.h>
-#    define NUM_ROUNDS 100000
+/*
+ * Every operation is timed if the histograms of the queue are enabled or it is traced. The
+ * timestamp is only taken when one of them is, so a queue without either pays a single
+ * predictable branch per operation.
+ */
 
-/* memory for storing measurement values */
-static cycles_t enq[NUM_ROUNDS];
-static cycles_t deq[NUM_ROUNDS];
-static cycles_t reg[NUM_ROUNDS];
-static cycles_t dereg[NUM_ROUNDS];
 
-/* benchmarking control */
-static bench_ctl_t ctl_enq;
-static bench_ctl_t ctl_deq;
-static bench_ctl_t ctl_reg;
-static bench_ctl_t ctl_dereg;
+/**
+ * @brief takes the start timestamp of an operation
+ *
+ * @param q     the queue
+ *
+ * @returns the timestamp, 0 if the histograms are disabled and the queue is not traced
+ */
+static inline cycles_t bench_start(struct cleanq *q)
+{
+    if (!__atomic_load_n(&q->hist_enabled, __ATOMIC_RELAXED) && q->trace == NULL) {
+        return 0;
+    }
+    return rdtsc();
+}
 
-/* benchmarking init flag */
-static bool bench_init_done;
 
-static void add_bench_entry(bench_ctl_t *ctl, cycles_t diff, const char *prefix)
+/**
+ * @brief records the latency of an operation in the histograms of the queue
+ *
+ * @param q         the queue
+ * @param op        the operation
+ * @param start     the start timestamp taken by bench_start()
+ */
+static inline void bench_end(struct cleanq *q, cleanq_hist_op_t op, cycles_t start)
 {
-    if (!bench_init_done) {
-        memset(enq, 0, sizeof(enq));
-        memset(deq, 0, sizeof(deq));
-        memset(reg, 0, sizeof(reg));
-        memset(dereg, 0, sizeof(dereg));
+    if (start && __atomic_load_n(&q->hist_enabled, __ATOMIC_RELAXED)) {
+        cleanq_histogram_record(&q->hist->h[op], rdtsc() - start);
+    }
+}
 
-        memset(&ctl_enq, 0, sizeof(ctl_enq));
-        memset(&ctl_deq, 0, sizeof(ctl_deq));
-        memset(&ctl_reg, 0, sizeof(ctl_reg));
-        memset(&ctl_dereg, 0, sizeof(ctl_dereg));
+#define BENCH_START() cycles_t bench_cleanq_start = bench_start(q)
+#define BENCH_END(op) bench_end(q, op, bench_cleanq_start)
 
-        ctl_enq.result_dimensions = 1;
-        ctl_enq.min_runs = NUM_ROUNDS;
-        ctl_enq.data = enq;
+/* records the operation in the trace ring, use after BENCH_START() */
+#define TRACE(op, rid, offset, length, err)                                                       \
+    cleanq_trace_record(q, op, rid, offset, length, err, bench_cleanq_start)
+#define TRACE_BATCH(op, bufs, num) cleanq_trace_record_batch(q, op, bufs, num, bench_cleanq_start)
 
-        ctl_deq.result_dimensions = 1;
-        ctl_deq.min_runs = NUM_ROUNDS;
-        ctl_deq.data = deq;
 
-        ctl_reg.result_dimensions = 1;
-        ctl_reg.min_runs = NUM_ROUNDS;
-        ctl_reg.data = reg;
+/*
+ * ================================================================================================
+ * Statistics
+ * ================================================================================================
+ */
 
-        ctl_dereg.result_dimensions = 1;
-        ctl_dereg.min_runs = NUM_ROUNDS;
-        ctl_dereg.data = dereg;
 
-        bench_init_done = true;
+/**
+ * @brief counts the buffers of a batch that have been enqueued
+ *
+ * @param q         the queue
+ * @param bufs      the buffers of the batch
+ * @param num       the number of buffers that have been enqueued
+ * @param err       the outcome of the enqueue
+ */
+static inline void cleanq_stats_enqueued(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                                         errval_t err)
+{
+    if (err == CLEANQ_ERR_QUEUE_FULL) {
+        q->stats->enqueue_full++;
     }
 
-    bench_ctl_add_run(ctl, &diff);
-
-    if (ctl->result_count == NUM_ROUNDS) {
-        bench_ctl_dump_analysis(ctl, 1, prefix, 1);
-        ctl->result_count = 0;
-        memset(ctl->data, 0, sizeof(cycles_t) * NUM_ROUNDS);
+    for (size_t i = 0; i < num; i++) {
+        q->stats->enqueue_bytes += bufs[i].valid_length;
     }
+    q->stats->enqueues += num;
+}
+
+
+/**
+ * @brief obtains a copy of the statistics of the queue endpoint
+ *
+ * @param q         The queue
+ * @param stats     Return pointer to the statistics
+ */
+void cleanq_get_stats(struct cleanq *q, struct cleanq_stats *stats)
+{
+    assert(q);
+    assert(stats);
+
+    *stats = *q->stats;
 }
 
-#    define BENCH_START() cycles_t bench_cleanq_start = bench_tsc();
-#    define BENCH_END(stat)                                                                       \
-        cycles_t bench_cleanq_end = bench_tsc();                                                  \
-        add_bench_entry(stat, bench_cleanq_end - bench_cleanq_start, __FUNCTION__)
 
-#else
-#    define BENCH_START()
-#    define BENCH_END(stat)
-#endif
+/**
+ * @brief reads a single counter of the statistics
+ *
+ * @param q         the queue
+ * @param stat      the counter, CLEANQ_STAT_*
+ * @param result    returns the value of the counter
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_INVALID_BUFFER_ARGS for unknown counters
+ */
+static errval_t cleanq_read_stat(struct cleanq *q, uint64_t stat, uint64_t *result)
+{
+    uint64_t value;
+
+    switch (stat) {
+    case CLEANQ_STAT_ENQUEUES:
+        value = q->stats->enqueues;
+        break;
+    case CLEANQ_STAT_DEQUEUES:
+        value = q->stats->dequeues;
+        break;
+    case CLEANQ_STAT_ENQUEUE_FULL:
+        value = q->stats->enqueue_full;
+        break;
+    case CLEANQ_STAT_DEQUEUE_EMPTY:
+        value = q->stats->dequeue_empty;
+        break;
+    case CLEANQ_STAT_ENQUEUE_BYTES:
+        value = q->stats->enqueue_bytes;
+        break;
+    case CLEANQ_STAT_DEQUEUE_BYTES:
+        value = q->stats->dequeue_bytes;
+        break;
+    case CLEANQ_STAT_OCCUPANCY_HWM:
+        value = q->stats->occupancy_hwm;
+        break;
+    case CLEANQ_STAT_SLOTS:
+        value = q->stats->slots;
+        break;
+    default:
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    if (result) {
+        *result = value;
+    }
+
+    return CLEANQ_ERR_OK;
+}
 
 
 /*
@@ -131,7 +207,16 @@ errval_t cleanq_enqueue(struct cleanq *q, regionid_t region_id, genoffset_t offs
 
     BENCH_START();
     err = q->f.enq(q, region_id, offset, length, valid_data, valid_length, misc_flags);
-    BENCH_END(&ctl_enq);
+    BENCH_END(CLEANQ_HIST_ENQUEUE);
+    TRACE(err == CLEANQ_ERR_QUEUE_FULL ? CLEANQ_TRACE_FULL : CLEANQ_TRACE_ENQUEUE, region_id,
+          offset, valid_length, err);
+
+    if (err_is_ok(err)) {
+        q->stats->enqueues++;
+        q->stats->enqueue_bytes += valid_length;
+    } else if (err == CLEANQ_ERR_QUEUE_FULL) {
+        q->stats->enqueue_full++;
+    }
 
     DQI_DEBUG("Enqueue q=%p rid=%d, offset=%lu, lenght=%lu\n", q, region_id, offset, valid_length);
 
@@ -168,9 +253,18 @@ errval_t cleanq_dequeue(struct cleanq *q, regionid_t *region_id, genoffset_t *of
     BENCH_START();
     err = q->f.deq(q, region_id, offset, length, valid_data, valid_length, misc_flags);
     if (err_is_fail(err)) {
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            TRACE(CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+            q->stats->dequeue_empty++;
+            cleanq_register_flush_queued(q);
+        }
         return err;
     }
-    BENCH_END(&ctl_deq);
+    BENCH_END(CLEANQ_HIST_DEQUEUE);
+    TRACE(CLEANQ_TRACE_DEQUEUE, *region_id, *offset, *valid_length, err);
+
+    q->stats->dequeues++;
+    q->stats->dequeue_bytes += *valid_length;
 
     // check if the dequeue buffer is valid
     if (!region_pool_buffer_check_bounds(q->pool, *region_id, *offset, *length, *valid_data,
@@ -184,6 +278,431 @@ errval_t cleanq_dequeue(struct cleanq *q, regionid_t *region_id, genoffset_t *of
 }
 
 
+/**
+ * @brief enqueue a batch of buffers into the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be enqueued
+ * @param num           The number of buffers in the array
+ * @param num_enq       Return pointer to the number of buffers that have been enqueued
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was enqueued
+ */
+errval_t cleanq_enqueue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_enq)
+{
+    errval_t err;
+
+    assert(q);
+    assert(bufs);
+    assert(num_enq);
+
+    *num_enq = 0;
+
+    if (num == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    // check if all the buffers to enqueue are valid
+    if (region_pool_buffer_check_bounds_batch(q->pool, bufs, num) != num) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    if (q->f.enq_batch) {
+        BENCH_START();
+        err = q->f.enq_batch(q, bufs, num, num_enq);
+        BENCH_END(CLEANQ_HIST_ENQUEUE);
+        TRACE_BATCH(CLEANQ_TRACE_ENQUEUE, bufs, *num_enq);
+        if (err == CLEANQ_ERR_QUEUE_FULL || *num_enq < num) {
+            TRACE(CLEANQ_TRACE_FULL, 0, 0, 0, CLEANQ_ERR_QUEUE_FULL);
+        }
+        cleanq_stats_enqueued(q, bufs, *num_enq, err);
+        return err;
+    }
+
+    /* the backend does not support batching, enqueue one by one */
+    BENCH_START();
+    size_t i;
+    for (i = 0; i < num; i++) {
+        err = q->f.enq(q, bufs[i].rid, bufs[i].offset, bufs[i].length, bufs[i].valid_data,
+                       bufs[i].valid_length, bufs[i].flags);
+        if (err_is_fail(err)) {
+            break;
+        }
+    }
+
+    BENCH_END(CLEANQ_HIST_ENQUEUE);
+    TRACE_BATCH(CLEANQ_TRACE_ENQUEUE, bufs, i);
+    if (i < num && err == CLEANQ_ERR_QUEUE_FULL) {
+        TRACE(CLEANQ_TRACE_FULL, 0, 0, 0, err);
+    }
+
+    *num_enq = i;
+
+    DQI_DEBUG("Enqueue batch q=%p num=%zu enqueued=%zu\n", q, num, i);
+
+    err = (i == 0) ? err : CLEANQ_ERR_OK;
+    cleanq_stats_enqueued(q, bufs, i, err);
+
+    return err;
+}
+
+
+/**
+ * @brief dequeue a batch of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of buffers that have been dequeued
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was dequeued
+ */
+errval_t cleanq_dequeue_batch(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_deq)
+{
+    errval_t err;
+    size_t count = 0;
+
+    assert(q);
+    assert(bufs);
+    assert(num_deq);
+
+    *num_deq = 0;
+
+    if (num == 0) {
+        return CLEANQ_ERR_OK;
+    }
+
+    if (q->f.deq_batch) {
+        BENCH_START();
+        err = q->f.deq_batch(q, bufs, num, &count);
+        if (err_is_fail(err)) {
+            if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+                TRACE(CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+                q->stats->dequeue_empty++;
+                cleanq_register_flush_queued(q);
+            }
+            return err;
+        }
+        BENCH_END(CLEANQ_HIST_DEQUEUE);
+        TRACE_BATCH(CLEANQ_TRACE_DEQUEUE, bufs, count);
+    } else {
+        /* the backend does not support batching, dequeue one by one */
+        BENCH_START();
+        for (count = 0; count < num; count++) {
+            struct cleanq_buf *b = &bufs[count];
+            err = q->f.deq(q, &b->rid, &b->offset, &b->length, &b->valid_data, &b->valid_length,
+                           &b->flags);
+            if (err_is_fail(err)) {
+                break;
+            }
+        }
+
+        if (count == 0) {
+            if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+                TRACE(CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+                q->stats->dequeue_empty++;
+                cleanq_register_flush_queued(q);
+            }
+            return err;
+        }
+        BENCH_END(CLEANQ_HIST_DEQUEUE);
+        TRACE_BATCH(CLEANQ_TRACE_DEQUEUE, bufs, count);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        q->stats->dequeue_bytes += bufs[i].valid_length;
+    }
+    q->stats->dequeues += count;
+
+    // check if the dequeued buffers are valid, drop the invalid ones
+    size_t valid = region_pool_buffer_check_bounds_batch(q->pool, bufs, count);
+    if (valid == count) {
+        *num_deq = count;
+        return CLEANQ_ERR_OK;
+    }
+
+    for (size_t i = valid + 1; i < count; i++) {
+        if (region_pool_buffer_check_bounds(q->pool, bufs[i].rid, bufs[i].offset, bufs[i].length,
+                                            bufs[i].valid_data, bufs[i].valid_length)) {
+            bufs[valid++] = bufs[i];
+        }
+    }
+
+    *num_deq = valid;
+
+    DQI_DEBUG("Dequeue batch q=%p num=%zu dequeued=%zu\n", q, num, valid);
+
+    return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+}
+
+
+/**
+ * @brief dequeue a buffer and obtain the address of its valid data
+ *
+ * @param q             The queue to call the operation on
+ * @param buf           Return pointer to the buffer
+ * @param data          Return pointer to the address of the valid data of the buffer
+ * @param prefetch      The number of cache lines of the valid data to prefetch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_dequeue_data(struct cleanq *q, struct cleanq_buf *buf, void **data,
+                             size_t prefetch)
+{
+    assert(q);
+    assert(buf);
+    assert(data);
+
+    errval_t err = cleanq_dequeue(q, &buf->rid, &buf->offset, &buf->length, &buf->valid_data,
+                                  &buf->valid_length, &buf->flags);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the buffer passed the bounds check, its region is in the pool */
+    struct capref cap;
+    region_pool_get_cap(q->pool, buf->rid, &cap);
+
+    *data = (uint8_t *)cap.vaddr + buf->offset + buf->valid_data;
+    cleanq_prefetch(*data, buf->valid_length, prefetch);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief dequeue a batch of buffers and obtain the addresses of their valid data
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in
+ * @param data          Array of the addresses of the valid data to be filled in
+ * @param num           The maximum number of buffers to be dequeued
+ * @param num_deq       Return pointer to the number of buffers that have been dequeued
+ * @param prefetch      The number of cache lines of the valid data of the first buffer to
+ *                      prefetch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one buffer was dequeued
+ */
+errval_t cleanq_dequeue_batch_data(struct cleanq *q, struct cleanq_buf *bufs, void **data,
+                                   size_t num, size_t *num_deq, size_t prefetch)
+{
+    assert(data);
+
+    errval_t err = cleanq_dequeue_batch(q, bufs, num, num_deq);
+    if (*num_deq == 0) {
+        return err;
+    }
+
+    /* batches mostly come from a single region, look it up once per run */
+    struct capref cap;
+    regionid_t rid = bufs[0].rid;
+    region_pool_get_cap(q->pool, rid, &cap);
+
+    for (size_t i = 0; i < *num_deq; i++) {
+        if (bufs[i].rid != rid) {
+            rid = bufs[i].rid;
+            region_pool_get_cap(q->pool, rid, &cap);
+        }
+        data[i] = (uint8_t *)cap.vaddr + bufs[i].offset + bufs[i].valid_data;
+    }
+
+    cleanq_prefetch(data[0], bufs[0].valid_length, prefetch);
+
+    return err;
+}
+
+
+/**
+ * @brief enqueue a chain of buffers into the queue atomically
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          The segments of the chain
+ * @param num           The number of segments
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_enqueue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num)
+{
+    errval_t err;
+
+    assert(q);
+    assert(bufs);
+
+    if (q->f.enq_chain == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    // check if all the segments are valid
+    if (num == 0 || region_pool_buffer_check_bounds_batch(q->pool, bufs, num) != num) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    for (size_t i = 0; i < num - 1; i++) {
+        bufs[i].flags &= ~CLEANQ_FLAG_LAST;
+    }
+    bufs[num - 1].flags |= CLEANQ_FLAG_LAST;
+
+    BENCH_START();
+    err = q->f.enq_chain(q, bufs, num);
+    BENCH_END(CLEANQ_HIST_ENQUEUE);
+    if (err_is_ok(err)) {
+        TRACE_BATCH(CLEANQ_TRACE_ENQUEUE, bufs, num);
+    } else if (err == CLEANQ_ERR_QUEUE_FULL) {
+        TRACE(CLEANQ_TRACE_FULL, 0, 0, 0, err);
+    }
+
+    cleanq_stats_enqueued(q, bufs, err_is_ok(err) ? num : 0, err);
+
+    DQI_DEBUG("Enqueue chain q=%p num=%zu\n", q, num);
+
+    return err;
+}
+
+
+/**
+ * @brief dequeue a chain of buffers from the queue
+ *
+ * @param q             The queue to call the operation on
+ * @param bufs          Array of buffers to be filled in with the segments
+ * @param num           The size of the array
+ * @param num_deq       Return pointer to the number of segments
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_dequeue_chain(struct cleanq *q, struct cleanq_buf *bufs, size_t num,
+                              size_t *num_deq)
+{
+    errval_t err;
+    size_t count = 0;
+
+    assert(q);
+    assert(bufs);
+    assert(num_deq);
+
+    *num_deq = 0;
+
+    if (q->f.deq_chain == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    BENCH_START();
+    err = q->f.deq_chain(q, bufs, num, &count);
+    if (err_is_fail(err)) {
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            TRACE(CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+            q->stats->dequeue_empty++;
+            cleanq_register_flush_queued(q);
+        } else if (err == CLEANQ_ERR_CHAIN_TOO_LONG) {
+            *num_deq = count;
+        }
+        return err;
+    }
+    BENCH_END(CLEANQ_HIST_DEQUEUE);
+    TRACE_BATCH(CLEANQ_TRACE_DEQUEUE, bufs, count);
+
+    for (size_t i = 0; i < count; i++) {
+        q->stats->dequeue_bytes += bufs[i].valid_length;
+    }
+    q->stats->dequeues += count;
+
+    // a chain with an invalid segment is dropped entirely
+    if (region_pool_buffer_check_bounds_batch(q->pool, bufs, count) != count) {
+        return CLEANQ_ERR_INVALID_BUFFER_ARGS;
+    }
+
+    *num_deq = count;
+
+    DQI_DEBUG("Dequeue chain q=%p num=%zu\n", q, count);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief enqueue a message that carries its data inline in the descriptor ring
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The data of the message
+ * @param len           The length of the data, at most CLEANQ_CTRL_INLINE_MAX bytes
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_enqueue_inline(struct cleanq *q, const void *data, size_t len)
+{
+    errval_t err;
+
+    assert(q);
+    assert(data || len == 0);
+
+    if (q->f.enq_inline == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    BENCH_START();
+    err = q->f.enq_inline(q, data, len);
+    BENCH_END(CLEANQ_HIST_ENQUEUE);
+    TRACE(err == CLEANQ_ERR_QUEUE_FULL ? CLEANQ_TRACE_FULL : CLEANQ_TRACE_ENQUEUE, 0, 0, len,
+          err);
+
+    if (err_is_ok(err)) {
+        q->stats->enqueues++;
+        q->stats->enqueue_bytes += len;
+    } else if (err == CLEANQ_ERR_QUEUE_FULL) {
+        q->stats->enqueue_full++;
+    }
+
+    DQI_DEBUG("Enqueue inline q=%p len=%zu\n", q, len);
+
+    return err;
+}
+
+
+/**
+ * @brief dequeue a message that carries its data inline in the descriptor ring
+ *
+ * @param q             The queue to call the operation on
+ * @param data          The buffer to copy the data into
+ * @param size          The size of the buffer
+ * @param len           Return pointer to the length of the data
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t cleanq_dequeue_inline(struct cleanq *q, void *data, size_t size, size_t *len)
+{
+    errval_t err;
+
+    assert(q);
+    assert(data || size == 0);
+    assert(len);
+
+    if (q->f.deq_inline == NULL) {
+        return CLEANQ_ERR_NOT_SUPPORTED;
+    }
+
+    BENCH_START();
+    err = q->f.deq_inline(q, data, size, len);
+    if (err_is_fail(err)) {
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            TRACE(CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+            q->stats->dequeue_empty++;
+            cleanq_register_flush_queued(q);
+        }
+        return err;
+    }
+    BENCH_END(CLEANQ_HIST_DEQUEUE);
+    TRACE(CLEANQ_TRACE_DEQUEUE, 0, 0, *len, err);
+
+    q->stats->dequeues++;
+    q->stats->dequeue_bytes += *len;
+
+    DQI_DEBUG("Dequeue inline q=%p len=%zu\n", q, *len);
+
+    return CLEANQ_ERR_OK;
+}
+
+
 /**
  * @brief Send a notification about new buffers on the queue
  *
@@ -199,6 +718,31 @@ errval_t cleanq_notify(struct cleanq *q)
 }
 
 
+/**
+ * @brief Waits until there is something to dequeue or the timeout expires
+ *
+ * @param q             The queue to call the operation on
+ * @param timeout_us    The timeout in microseconds, 0 to poll, CLEANQ_WAIT_FOREVER to block
+ *
+ * @returns CLEANQ_ERR_OK if the queue may have something to be dequeued,
+ *          CLEANQ_ERR_TIMEOUT if the timeout expired
+ */
+errval_t cleanq_wait(struct cleanq *q, uint64_t timeout_us)
+{
+    assert(q);
+
+    /* the other side may wait for us to acknowledge its registrations */
+    cleanq_register_flush_queued(q);
+
+    /* the backend can't wait, the caller has to poll */
+    if (q->f.wait == NULL) {
+        return CLEANQ_ERR_OK;
+    }
+
+    return q->f.wait(q, timeout_us);
+}
+
+
 /*
  * ================================================================================================
  * Memory Registration and Deregistration
@@ -230,7 +774,8 @@ errval_t cleanq_register(struct cleanq *q, struct capref cap, regionid_t *region
 
     BENCH_START();
     err = q->f.reg(q, cap, *region_id);
-    BENCH_END(&ctl_reg);
+    BENCH_END(CLEANQ_HIST_REGISTER);
+    TRACE(CLEANQ_TRACE_REGISTER, *region_id, 0, cap.len, err);
 
     return err;
 }
@@ -259,12 +804,141 @@ errval_t cleanq_deregister(struct cleanq *q, regionid_t region_id, struct capref
 
     BENCH_START();
     err = q->f.dereg(q, region_id);
-    BENCH_END(&ctl_dereg);
+    BENCH_END(CLEANQ_HIST_DEREGISTER);
+    TRACE(CLEANQ_TRACE_DEREGISTER, region_id, 0, cap->len, err);
 
     return err;
 }
 
 
+/**
+ * @brief removes regions that have not been registered from the region pool
+ *
+ * @param q              The queue
+ * @param region_ids     The region ids
+ * @param first          The first region to be removed
+ * @param num            The number of region ids
+ */
+static void cleanq_register_rollback(struct cleanq *q, regionid_t *region_ids, size_t first,
+                                     size_t num)
+{
+    struct capref cap;
+    for (size_t i = first; i < num; i++) {
+        region_pool_remove_region(q->pool, region_ids[i], &cap);
+    }
+}
+
+
+/**
+ * @brief Add several memory regions to the queue without waiting for the other side
+ *
+ * @param q              The queue to call the operation on
+ * @param caps           The capabilities of the memory regions
+ * @param num            The number of regions
+ * @param region_ids     Return array of the region ids assigned to the memory
+ * @param num_reg        Return pointer to the number of regions that have been registered
+ * @param token          Return pointer to the token of the batch
+ *
+ * @returns error on failure or CLEANQ_ERR_OK if at least one region was registered
+ */
+errval_t cleanq_register_batch(struct cleanq *q, const struct capref *caps, size_t num,
+                               regionid_t *region_ids, size_t *num_reg, cleanq_reg_token_t *token)
+{
+    assert(q);
+    assert(caps);
+    assert(region_ids);
+    assert(num_reg);
+    assert(token);
+
+    *num_reg = 0;
+
+    if (num == 0) {
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    errval_t err;
+    for (size_t i = 0; i < num; i++) {
+        err = region_pool_add_region(q->pool, caps[i], &region_ids[i]);
+        if (err_is_fail(err)) {
+            cleanq_register_rollback(q, region_ids, 0, i);
+            return err;
+        }
+    }
+
+    uint64_t t;
+    err = cleanq_register_track(q, q->f.reg_batch != NULL, &t);
+    if (err_is_fail(err)) {
+        cleanq_register_rollback(q, region_ids, 0, num);
+        return err;
+    }
+
+    size_t count = 0;
+    BENCH_START();
+    if (q->f.reg_batch) {
+        err = q->f.reg_batch(q, caps, region_ids, num, t, &count);
+        if (err_is_fail(err) && count) {
+            /* the other side adds the regions that have been sent, it has to remove them again */
+            for (size_t i = 0; i < count; i++) {
+                q->f.dereg(q, region_ids[i]);
+            }
+            cleanq_register_revoke(q, t);
+            count = 0;
+        } else if (err_is_fail(err)) {
+            cleanq_register_untrack(q, t);
+        }
+    } else {
+        /* the backend registers one region at a time, the batch is done once they are */
+        while (count < num) {
+            err = q->f.reg(q, caps[count], region_ids[count]);
+            if (err_is_fail(err)) {
+                break;
+            }
+            count++;
+        }
+    }
+    BENCH_END(CLEANQ_HIST_REGISTER);
+    for (size_t i = 0; i < count; i++) {
+        TRACE(CLEANQ_TRACE_REGISTER, region_ids[i], 0, caps[i].len, CLEANQ_ERR_OK);
+    }
+
+    DQI_DEBUG("register batch q=%p, num=%zu, sent=%zu, token=%lu\n", (void *)q, num, count, t);
+
+    /* the regions that have not been sent are not registered */
+    cleanq_register_rollback(q, region_ids, count, num);
+    if (count == 0) {
+        return err;
+    }
+
+    *num_reg = count;
+    *token = t;
+
+    if (q->f.reg_batch == NULL && q->callbacks.reg_done) {
+        q->callbacks.reg_done(q, t, CLEANQ_ERR_OK);
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief Checks if the other side has completed a batch of asynchronous registrations
+ *
+ * @param q              The queue to call the operation on
+ * @param token          The token returned by cleanq_register_batch()
+ *
+ * @returns CLEANQ_ERR_OK if all regions have been registered on the other side,
+ *          CLEANQ_ERR_REGISTER_PENDING if the other side has not acknowledged the batch yet,
+ *          CLEANQ_ERR_INVALID_REGION_ARGS if the token is unknown, or the first error of the
+ *          other side
+ */
+errval_t cleanq_register_status(struct cleanq *q, cleanq_reg_token_t token)
+{
+    assert(q);
+
+    return cleanq_register_lookup(q, token);
+}
+
+
 /*
  * ================================================================================================
  * Control Path
@@ -285,7 +959,57 @@ errval_t cleanq_control(struct cleanq *q, uint64_t request, uint64_t value, uint
 {
     assert(q);
 
-    return q->f.ctrl(q, request, value, result);
+    switch (request) {
+    case CLEANQ_CTRL_HISTOGRAM:
+        /* the histograms stay allocated so that readers never see them go away */
+        if (value && q->hist == NULL) {
+            struct cleanq_histograms *hist = cleanq_histograms_alloc();
+            if (hist == NULL) {
+                return CLEANQ_ERR_MALLOC_FAIL;
+            }
+            __atomic_store_n(&q->hist, hist, __ATOMIC_RELEASE);
+        }
+        if (result) {
+            *result = q->hist_enabled;
+        }
+        __atomic_store_n(&q->hist_enabled, value != 0, __ATOMIC_RELAXED);
+        return CLEANQ_ERR_OK;
+    case CLEANQ_CTRL_HISTOGRAM_RESET:
+        if (q->hist) {
+            cleanq_histograms_reset(q->hist);
+        }
+        return CLEANQ_ERR_OK;
+    case CLEANQ_CTRL_STATS:
+        return cleanq_read_stat(q, value, result);
+    case CLEANQ_CTRL_INLINE_MAX:
+        /* only backends carrying inline data know the negotiated size */
+        if (q->f.enq_inline == NULL) {
+            if (result) {
+                *result = 0;
+            }
+            return CLEANQ_ERR_OK;
+        }
+        return q->f.ctrl(q, request, value, result);
+    case CLEANQ_CTRL_REGION_NODE: {
+        struct capref cap;
+        if (!region_pool_get_cap(q->pool, (regionid_t)value, &cap)) {
+            return CLEANQ_ERR_INVALID_REGION_ID;
+        }
+        int node;
+        errval_t err = cleanq_numa_memory_node(cap.vaddr, &node);
+        if (err_is_ok(err) && result) {
+            *result = (uint64_t)node;
+        }
+        return err;
+    }
+    case CLEANQ_CTRL_REGISTER_PENDING:
+        if (result) {
+            *result = cleanq_register_num_pending(q);
+        }
+        return CLEANQ_ERR_OK;
+    default:
+        return q->f.ctrl(q, request, value, result);
+    }
 }
 
 
@@ -314,8 +1038,20 @@ errval_t cleanq_destroy(struct cleanq *q)
         return err;
     }
 
+    cleanq_register_destroy(q);
+
+    /* the backend frees the queue, keep the histograms until it succeeded */
+    struct cleanq_histograms *hist = q->hist;
+
+    cleanq_trace_free(q);
+
     /* calling the backend specific cleanup function */
-    return q->f.destroy(q);
+    err = q->f.destroy(q);
+    if (err_is_ok(err)) {
+        free(hist);
+    }
+
+    return err;
 }
 
 
@@ -391,3 +1127,17 @@ void cleanq_set_deregister_callback(struct cleanq *q, cleanq_deregister_callback
 
     q->callbacks.dereg = cb;
 }
+
+
+/**
+ * @brief sets the callback function for completed asynchronous registrations
+ *
+ * @param q     the cleanq queue state
+ * @param cb    callback function to be called
+ */
+void cleanq_set_register_done_callback(struct cleanq *q, cleanq_register_done_callback_t cb)
+{
+    assert(q);
+
+    q->callbacks.reg_done = cb;
+}
@@ -7,10 +7,50 @@
  * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include <cleanq/cleanq.h>
 
 #include <cleanq_backend.h>
+#include <cleanq_histogram.h>
 #include <region_pool.h>
+#include <cleanq_memfd.h>
+#include <debug.h>
+
+
+///< a batch of registrations that is pending or has failed on the other side
+struct cleanq_reg_batch
+{
+    ///< the token of the batch
+    uint64_t token;
+
+    ///< the outcome, valid once the batch is done
+    errval_t err;
+
+    ///< whether the other side has acknowledged the batch
+    bool done;
+
+    ///< whether the batch has been taken back after it was sent, its acknowledgement is dropped
+    bool revoked;
+
+    ///< the next batch in the list
+    struct cleanq_reg_batch *next;
+};
+
+
+///< an acknowledgement that could not be sent yet
+struct cleanq_reg_ack
+{
+    ///< the token of the batch
+    uint64_t token;
+
+    ///< the outcome of the batch
+    errval_t err;
+};
 
 
 /*
@@ -29,10 +69,47 @@
  */
 errval_t cleanq_init(struct cleanq *q)
 {
+    q->hist = NULL;
+    q->hist_enabled = false;
+    q->trace = NULL;
+
+    cleanq_init_stats(q, &q->local_stats, 0);
+
+    memset(&q->reg, 0, sizeof(q->reg));
+    pthread_mutex_init(&q->reg.lock, NULL);
+
+#ifdef BENCH_CLEANQ
+    /* benchmark builds record the latencies from the start */
+    q->hist = cleanq_histograms_alloc();
+    if (q->hist == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+    q->hist_enabled = true;
+#endif
+
     return region_pool_init(&(q->pool));
 }
 
 
+/**
+ * @brief moves the statistics of the queue to the given memory
+ *
+ * @param q         the queue
+ * @param stats     the memory of the statistics, e.g., in the shared memory of the queue
+ * @param slots     the number of transmit slots of the queue
+ *
+ * The statistics are reset and the calling process is recorded as the owner.
+ */
+void cleanq_init_stats(struct cleanq *q, struct cleanq_stats *stats, uint64_t slots)
+{
+    memset(stats, 0, sizeof(struct cleanq_stats));
+    stats->slots = slots;
+    stats->pid = (uint64_t)getpid();
+
+    q->stats = stats;
+}
+
+
 /*
  * ================================================================================================
  * Adding and Removing Regions (Internal Functions)
@@ -65,5 +142,336 @@ errval_t cleanq_add_region(struct cleanq *q, struct capref cap, regionid_t rid)
 errval_t cleanq_remove_region(struct cleanq *q, regionid_t rid)
 {
     struct capref cap;
-    return region_pool_remove_region(q->pool, rid, &cap);
+    errval_t err = region_pool_remove_region(q->pool, rid, &cap);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the memory may have been shared with us, then we have mapped it */
+    cleanq_memfd_unimport(cap);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Asynchronous Registrations (Internal Functions)
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief hands out the token of a new batch of registrations
+ *
+ * @param q      the queue
+ * @param track  whether the batch is pending until the other side acknowledges it
+ * @param token  returns the token
+ *
+ * @returns CLEANQ_ERR_OK on success, CLEANQ_ERR_MALLOC_FAIL if the batch could not be tracked
+ */
+errval_t cleanq_register_track(struct cleanq *q, bool track, uint64_t *token)
+{
+    struct cleanq_reg_batch *b = NULL;
+    if (track) {
+        b = calloc(1, sizeof(*b));
+        if (b == NULL) {
+            return CLEANQ_ERR_MALLOC_FAIL;
+        }
+    }
+
+    pthread_mutex_lock(&q->reg.lock);
+    *token = ++q->reg.token;
+    if (b) {
+        /* added before it is sent, the acknowledgement may arrive on another thread right away */
+        b->token = *token;
+        b->next = q->reg.batches;
+        q->reg.batches = b;
+        q->reg.num_pending++;
+    }
+    pthread_mutex_unlock(&q->reg.lock);
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes a batch of registrations that could not be sent
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ */
+void cleanq_register_untrack(struct cleanq *q, uint64_t token)
+{
+    pthread_mutex_lock(&q->reg.lock);
+    struct cleanq_reg_batch **prev = &q->reg.batches;
+    while (*prev && (*prev)->token != token) {
+        prev = &(*prev)->next;
+    }
+
+    struct cleanq_reg_batch *b = *prev;
+    if (b) {
+        *prev = b->next;
+        if (!b->done) {
+            q->reg.num_pending--;
+        }
+    }
+
+    /* hand out the token again, unless another batch has been started in the meantime */
+    if (token == q->reg.token) {
+        q->reg.token--;
+    }
+    pthread_mutex_unlock(&q->reg.lock);
+
+    free(b);
+}
+
+
+/**
+ * @brief takes back a batch of registrations that has been sent, but failed locally
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ *
+ * The other side still acknowledges the batch, so the token is not handed out again and the
+ * batch is kept until the acknowledgement has been dropped.
+ */
+void cleanq_register_revoke(struct cleanq *q, uint64_t token)
+{
+    pthread_mutex_lock(&q->reg.lock);
+    for (struct cleanq_reg_batch *b = q->reg.batches; b; b = b->next) {
+        if (b->token == token) {
+            if (!b->done) {
+                q->reg.num_pending--;
+            }
+            b->done = true;
+            b->revoked = true;
+            b->err = CLEANQ_ERR_INVALID_REGION_ARGS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->reg.lock);
+}
+
+
+/**
+ * @brief obtains the state of a batch of registrations
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ *
+ * @returns CLEANQ_ERR_OK if the batch has completed, CLEANQ_ERR_REGISTER_PENDING if it is still
+ *          pending, CLEANQ_ERR_INVALID_REGION_ARGS for unknown tokens, or the error of the batch
+ */
+errval_t cleanq_register_lookup(struct cleanq *q, uint64_t token)
+{
+    errval_t err = CLEANQ_ERR_OK;
+
+    pthread_mutex_lock(&q->reg.lock);
+    if (token == 0 || token > q->reg.token) {
+        err = CLEANQ_ERR_INVALID_REGION_ARGS;
+    }
+
+    /* completed batches are removed, unless they have failed */
+    for (struct cleanq_reg_batch *b = q->reg.batches; b; b = b->next) {
+        if (b->token == token) {
+            err = b->done ? b->err : CLEANQ_ERR_REGISTER_PENDING;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->reg.lock);
+
+    return err;
+}
+
+
+/**
+ * @brief obtains the number of pending batches of registrations
+ *
+ * @param q      the queue
+ *
+ * @returns the number of batches the other side has not acknowledged yet
+ */
+uint64_t cleanq_register_num_pending(struct cleanq *q)
+{
+    return __atomic_load_n(&q->reg.num_pending, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief queues an acknowledgement and sends what fits into the queue
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ * @param err    the outcome of the batch
+ */
+static void cleanq_register_ack(struct cleanq *q, uint64_t token, errval_t err)
+{
+    if (q->f.reg_ack == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->reg.lock);
+
+    /* acknowledgements are sent in order, the new one goes behind the queued ones */
+    if (q->reg.acks_num == 0 && err_is_ok(q->f.reg_ack(q, token, err))) {
+        pthread_mutex_unlock(&q->reg.lock);
+        return;
+    }
+
+    if (q->reg.acks_num == q->reg.acks_size) {
+        size_t size = q->reg.acks_size ? 2 * q->reg.acks_size : 16;
+        struct cleanq_reg_ack *acks = realloc(q->reg.acks, size * sizeof(*acks));
+        if (acks == NULL) {
+            pthread_mutex_unlock(&q->reg.lock);
+            printf("WARNING: dropping acknowledgement of registration %lu\n", token);
+            return;
+        }
+        q->reg.acks = acks;
+        q->reg.acks_size = size;
+    }
+
+    q->reg.acks[q->reg.acks_num].token = token;
+    q->reg.acks[q->reg.acks_num].err = err;
+    q->reg.acks_num++;
+    __atomic_store_n(&q->reg.acks_queued, true, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&q->reg.lock);
+}
+
+
+/**
+ * @brief sends the acknowledgements that did not fit into the queue before
+ *
+ * @param q      the queue
+ */
+void cleanq_register_flush(struct cleanq *q)
+{
+    pthread_mutex_lock(&q->reg.lock);
+
+    while (q->reg.acks_head < q->reg.acks_num) {
+        struct cleanq_reg_ack *a = &q->reg.acks[q->reg.acks_head];
+        if (err_is_fail(q->f.reg_ack(q, a->token, a->err))) {
+            break;
+        }
+        q->reg.acks_head++;
+    }
+
+    if (q->reg.acks_head == q->reg.acks_num) {
+        q->reg.acks_head = 0;
+        q->reg.acks_num = 0;
+        __atomic_store_n(&q->reg.acks_queued, false, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&q->reg.lock);
+}
+
+
+/**
+ * @brief records the outcome of a region registered by the other side
+ *
+ * @param q      the queue
+ * @param token  the token of the batch, 0 for a region registered with cleanq_register()
+ * @param last   whether this is the last region of the batch
+ * @param err    the outcome of the registration
+ *
+ * The batch is acknowledged after its last region. Single regions are only acknowledged if they
+ * failed.
+ */
+void cleanq_register_received(struct cleanq *q, uint64_t token, bool last, errval_t err)
+{
+    if (token == 0) {
+        if (err_is_fail(err)) {
+            cleanq_register_ack(q, 0, err);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&q->reg.lock);
+    if (token != q->reg.rx_token) {
+        q->reg.rx_token = token;
+        q->reg.rx_err = CLEANQ_ERR_OK;
+    }
+
+    /* the batch reports its first error */
+    if (err_is_fail(err) && err_is_ok(q->reg.rx_err)) {
+        q->reg.rx_err = err;
+    }
+
+    err = q->reg.rx_err;
+    pthread_mutex_unlock(&q->reg.lock);
+
+    if (last) {
+        DQI_DEBUG("register batch %lu received err=%d\n", token, err);
+        cleanq_register_ack(q, token, err);
+    }
+}
+
+
+/**
+ * @brief completes a batch of registrations that has been acknowledged by the other side
+ *
+ * @param q      the queue
+ * @param token  the token of the batch
+ * @param err    the outcome of the batch on the other side
+ */
+void cleanq_register_acked(struct cleanq *q, uint64_t token, errval_t err)
+{
+    DQI_DEBUG("register batch %lu acknowledged err=%d\n", token, err);
+
+    if (token) {
+        pthread_mutex_lock(&q->reg.lock);
+        struct cleanq_reg_batch **prev = &q->reg.batches;
+        while (*prev && (*prev)->token != token) {
+            prev = &(*prev)->next;
+        }
+
+        struct cleanq_reg_batch *b = *prev;
+        if (b && b->revoked) {
+            /* the caller has been told that the batch failed, it never sees the token */
+            *prev = b->next;
+            pthread_mutex_unlock(&q->reg.lock);
+            free(b);
+            return;
+        }
+        if (b && !b->done) {
+            q->reg.num_pending--;
+            if (err_is_ok(err)) {
+                *prev = b->next;
+                free(b);
+            } else {
+                /* failures are kept, so that they can still be polled */
+                b->done = true;
+                b->err = err;
+            }
+        }
+        pthread_mutex_unlock(&q->reg.lock);
+    }
+
+    if (q->callbacks.reg_done) {
+        q->callbacks.reg_done(q, token, err);
+    } else if (err_is_fail(err)) {
+        printf("WARNING: the other side failed to register regions of batch %lu: %d\n", token,
+               err);
+    }
+}
+
+
+/**
+ * @brief frees the state of the asynchronous registrations
+ *
+ * @param q      the queue
+ */
+void cleanq_register_destroy(struct cleanq *q)
+{
+    while (q->reg.batches) {
+        struct cleanq_reg_batch *b = q->reg.batches;
+        q->reg.batches = b->next;
+        free(b);
+    }
+
+    free(q->reg.acks);
+    q->reg.acks = NULL;
+
+    pthread_mutex_destroy(&q->reg.lock);
 }
@@ -11,13 +11,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
 #include <slab.h>
 
 #include "region_pool.h"
+#include "region_table.h"
 #include "debug.h"
 
 
-///< defines the initial pool size
+///< defines the initial pool size, must be a power of two
 #define INIT_POOL_SIZE 16
 
 
@@ -31,23 +33,32 @@
 ///< the region pool type
 struct region_pool
 {
-    ///< IDs are inserted and may have to increase size at some point
-    uint16_t size;
+    ///< the next region id to be handed out, starts at a random offset
+    regionid_t next_id;
 
-    ///< number of regions in pool
-    uint16_t num_regions;
+    ///< region slab allocator
+    struct slab_allocator region_alloc;
 
-    ///< random offset where regions ids start from
-    uint64_t region_offset;
+    ///< the regions by their id
+    struct region_table table;
 
-    ///< if we have to serach for a slot, need an offset
-    uint16_t last_offset;
+    ///< the root of the tree of the own regions ordered by their base address
+    struct region *tree;
 
-    ///< region slab allocator
-    struct slab_allocator region_alloc;
+    ///< the root of the tree of the regions of the other endpoint
+    struct region *remote_tree;
+
+    ///< incremented whenever a region is added or removed, see cleanq/fastpath.h
+    uint64_t generation;
 
-    ///< structure to store regions
-    struct region **pool;
+    ///< the number of queue endpoints sharing the pool
+    uint32_t refs;
+
+    ///< the pool is used by several threads at the same time and must be locked
+    bool concurrent;
+
+    ///< protects the pool if it is used concurrently, lookups take it for reading
+    pthread_rwlock_t lock;
 };
 
 
@@ -57,6 +68,9 @@ struct region
     ///< ID of the region
     regionid_t id;
 
+    ///< the priority of the region in the tree
+    uint32_t prio;
+
     ///< base address of the region
     uint64_t base_addr;
 
@@ -65,9 +79,290 @@ struct region
 
     ///< Lenght of the memory region in bytes
     size_t len;
+
+    ///< the regions with a lower base address
+    struct region *left;
+
+    ///< the regions with a higher base address
+    struct region *right;
+
+    ///< the region has been added with the id of the other endpoint, it is in the remote tree
+    bool remote;
 };
 
 
+/*
+ * ================================================================================================
+ * Region Tree
+ * ================================================================================================
+ */
+
+
+/*
+ * The registered regions do not overlap, so they are kept in a treap ordered by their base
+ * address. Any region overlapping with a new one is either its predecessor or its successor,
+ * both of which are on the search path of the new region. The priorities are derived from the
+ * region id, this keeps the tree balanced even if the regions are registered in address order.
+ *
+ * The regions of the other endpoint are in a tree of their own. Its addresses are the ones of the
+ * other process, a forked process maps its memory at the same addresses as its parent.
+ */
+
+
+static inline uint32_t region_tree_prio(regionid_t id)
+{
+    // must not correlate with the id table index, which uses the upper bits of the same hash
+    return __builtin_bswap32(id * 2246822519U);
+}
+
+
+/**
+ * @brief checks if a range overlaps with any region in the tree
+ *
+ * @param node  the root of the tree
+ * @param base  the base address of the range
+ * @param len   the length of the range
+ *
+ * @returns true if the range overlaps with a region
+ */
+static bool region_tree_overlaps(struct region *node, uint64_t base, size_t len)
+{
+    while (node != NULL) {
+        // check if region is already registered
+        if (node->base_addr == base) {
+            return true;
+        }
+
+        if (base + len <= node->base_addr) {
+            node = node->left;
+        } else if (node->base_addr + node->len <= base) {
+            node = node->right;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief finds the region containing an address
+ *
+ * @param node  the root of the tree
+ * @param addr  the address
+ *
+ * @returns the region containing the address or NULL
+ */
+static struct region *region_tree_find(struct region *node, uint64_t addr)
+{
+    while (node != NULL) {
+        if (addr < node->base_addr) {
+            node = node->left;
+        } else if (addr - node->base_addr >= node->len) {
+            node = node->right;
+        } else {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief inserts a region into the tree
+ *
+ * @param node      the root of the (sub)tree
+ * @param region    the region to insert
+ *
+ * @returns the new root of the (sub)tree
+ */
+static struct region *region_tree_insert(struct region *node, struct region *region)
+{
+    if (node == NULL) {
+        return region;
+    }
+
+    if (region->base_addr < node->base_addr) {
+        node->left = region_tree_insert(node->left, region);
+        if (node->left->prio > node->prio) {
+            // rotate right
+            struct region *l = node->left;
+            node->left = l->right;
+            l->right = node;
+            return l;
+        }
+    } else {
+        node->right = region_tree_insert(node->right, region);
+        if (node->right->prio > node->prio) {
+            // rotate left
+            struct region *r = node->right;
+            node->right = r->left;
+            r->left = node;
+            return r;
+        }
+    }
+
+    return node;
+}
+
+
+/**
+ * @brief merges two trees, all regions in the left tree are below the ones in the right tree
+ *
+ * @param left      the left tree
+ * @param right     the right tree
+ *
+ * @returns the root of the merged tree
+ */
+static struct region *region_tree_merge(struct region *left, struct region *right)
+{
+    if (left == NULL) {
+        return right;
+    }
+
+    if (right == NULL) {
+        return left;
+    }
+
+    if (left->prio > right->prio) {
+        left->right = region_tree_merge(left->right, right);
+        return left;
+    }
+
+    right->left = region_tree_merge(left, right->left);
+    return right;
+}
+
+
+/**
+ * @brief removes a region from the tree
+ *
+ * @param node      the root of the (sub)tree
+ * @param region    the region to remove, must be in the tree
+ *
+ * @returns the new root of the (sub)tree
+ */
+static struct region *region_tree_remove(struct region *node, struct region *region)
+{
+    if (node == region) {
+        return region_tree_merge(node->left, node->right);
+    }
+
+    if (region->base_addr < node->base_addr) {
+        node->left = region_tree_remove(node->left, region);
+    } else {
+        node->right = region_tree_remove(node->right, region);
+    }
+
+    return node;
+}
+
+
+/*
+ * ================================================================================================
+ * Region Lookup
+ * ================================================================================================
+ */
+
+
+/*
+ * A pool shared by endpoints in different threads is protected by a reader-writer lock. Adding
+ * or removing a region may grow the id table or rebalance the trees, so it excludes every
+ * lookup. The lock is only taken once the pool is shared that way, an endpoint used by a single
+ * thread doesn't pay for it.
+ */
+
+
+static inline void region_pool_read_lock(struct region_pool *pool)
+{
+    if (pool->concurrent) {
+        pthread_rwlock_rdlock(&pool->lock);
+    }
+}
+
+
+static inline void region_pool_write_lock(struct region_pool *pool)
+{
+    if (pool->concurrent) {
+        pthread_rwlock_wrlock(&pool->lock);
+    }
+}
+
+
+static inline void region_pool_unlock(struct region_pool *pool)
+{
+    if (pool->concurrent) {
+        pthread_rwlock_unlock(&pool->lock);
+    }
+}
+
+
+/**
+ * @brief looks up a region by its id
+ *
+ * @param pool          The pool to get the region from
+ * @param region_id     The id of the region
+ *
+ * @returns the region or NULL if there is no region with this id
+ */
+static inline struct region *region_pool_lookup(struct region_pool *pool, regionid_t region_id)
+{
+    return region_table_lookup(&pool->table, region_id);
+}
+
+
+/**
+ * @brief inserts a new region into the pool
+ *
+ * @param pool          The pool to add the region to
+ * @param cap           The cap of the region
+ * @param region_id     The id of the region
+ * @param remote        The region belongs to the other endpoint
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t region_pool_insert(struct region_pool *pool, struct capref cap,
+                                   regionid_t region_id, bool remote)
+{
+    struct region *region = (struct region *)slab_alloc(&pool->region_alloc);
+    if (region == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    region->id = region_id;
+    region->prio = region_tree_prio(region_id);
+    region->cap = cap;
+    region->base_addr = cap.paddr;
+    region->len = cap.len;
+    region->left = NULL;
+    region->right = NULL;
+    region->remote = remote;
+
+    errval_t err = region_table_insert(&pool->table, region_id, region);
+    if (err_is_fail(err)) {
+        DQI_DEBUG_REGION("Increasing pool size failed\n");
+        slab_free(&pool->region_alloc, region);
+        return err;
+    }
+
+    if (remote) {
+        pool->remote_tree = region_tree_insert(pool->remote_tree, region);
+    } else {
+        pool->tree = region_tree_insert(pool->tree, region);
+    }
+    pool->generation++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * ================================================================================================
+ * Region Pool
+ * ================================================================================================
+ */
 
 
 /**
@@ -86,22 +381,36 @@ errval_t region_pool_init(struct region_pool **pool)
         return CLEANQ_ERR_MALLOC_FAIL;
     }
 
-    (*pool)->num_regions = 0;
-
     srand(time(NULL));
 
     // Initialize region id offset
-    (*pool)->region_offset = (rand() >> 12);
-    (*pool)->size = INIT_POOL_SIZE;
+    (*pool)->next_id = (rand() >> 12);
+    (*pool)->tree = NULL;
+    (*pool)->remote_tree = NULL;
+    (*pool)->generation = 0;
+    (*pool)->refs = 1;
+    (*pool)->concurrent = false;
+
+    if (pthread_rwlock_init(&(*pool)->lock, NULL)) {
+        free(*pool);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
 
-    (*pool)->pool = (struct region **)calloc(INIT_POOL_SIZE, sizeof(struct region *));
-    if ((*pool)->pool == NULL) {
+    if (err_is_fail(region_table_init(&(*pool)->table, INIT_POOL_SIZE))) {
+        pthread_rwlock_destroy(&(*pool)->lock);
         free(*pool);
         DQI_DEBUG_REGION("Allocationg inital pool failed \n");
         return CLEANQ_ERR_MALLOC_FAIL;
     }
 
-    slab_init(&(*pool)->region_alloc, sizeof(struct region), slab_default_refill);
+    /* all fields of a region are set when it is added */
+    if (slab_init_with_flags(&(*pool)->region_alloc, sizeof(struct region), slab_default_refill,
+                             SLAB_FLAG_NO_ZERO)) {
+        pthread_rwlock_destroy(&(*pool)->lock);
+        region_table_destroy(&(*pool)->table);
+        free(*pool);
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
 
     DQI_DEBUG_REGION("Init region pool size=%d addr=%p\n", INIT_POOL_SIZE, *pool);
     return CLEANQ_ERR_OK;
@@ -114,77 +423,65 @@ errval_t region_pool_init(struct region_pool **pool)
  * @param pool          The region pool to free
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * If the pool is shared, only the reference is dropped.
  */
 errval_t region_pool_destroy(struct region_pool *pool)
 {
     errval_t err;
     struct capref cap;
-    // Check if there are any regions left
-    if (pool->num_regions == 0) {
-        free(pool->pool);
-        free(pool);
+
+    // the other endpoints still use the pool
+    if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) > 0) {
         return CLEANQ_ERR_OK;
-    } else {
-        // There are regions left -> remove them
-        for (int i = 0; i < pool->size; i++) {
-            if ((void *)pool->pool[i] != NULL) {
-                err = region_pool_remove_region(pool, pool->pool[i]->id, &cap);
-                if (err_is_fail(err)) {
-                    printf("Region pool has regions that are still used,"
-                           " can not free them \n");
-                    return err;
-                }
+    }
+
+    // There may be regions left -> remove them
+    struct region_table *table = &pool->table;
+    for (uint32_t i = 0; i < table->size && table->num > 0; i++) {
+        // removing a region may move another one into this slot
+        while (table->slots[i].value != NULL) {
+            err = region_pool_remove_region(pool, table->slots[i].id, &cap);
+            if (err_is_fail(err)) {
+                printf("Region pool has regions that are still used,"
+                       " can not free them \n");
+                return err;
             }
         }
-        free(pool->pool);
-        free(pool);
     }
 
+    slab_destroy(&pool->region_alloc);
+    pthread_rwlock_destroy(&pool->lock);
+    region_table_destroy(&pool->table);
+    free(pool);
+
     return CLEANQ_ERR_OK;
 }
 
+
 /**
- * @brief increase the region pool size by a factor of 2
+ * @brief obtains another reference to a region pool
  *
- * @param pool       the regin pool that has not enough region slots
+ * @param pool          The region pool to share
+ * @param concurrent    The reference is used by another thread than the existing ones
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns the region pool
+ *
+ * Every reference is dropped with region_pool_destroy(), the last one frees the pool. Once a
+ * pool is shared with another thread, every operation on it takes its lock. The pool must not
+ * be used by the other threads yet.
  */
-
-
-static errval_t region_pool_grow(struct region_pool *pool)
+struct region_pool *region_pool_share(struct region_pool *pool, bool concurrent)
 {
-    struct region **tmp;
-
-    uint16_t new_size = (pool->size) * 2;
-    // Allocate new pool twice the size
-    tmp = (struct region **)calloc(new_size, sizeof(struct region *));
-    if (tmp == NULL) {
-        DQI_DEBUG_REGION("Allocationg larger pool failed \n");
-        return CLEANQ_ERR_MALLOC_FAIL;
-    }
-
-    // Copy all the pointers
-    for (int i = 0; i < new_size; i++) {
-        tmp[i] = NULL;
-    }
-
-    struct region *region;
-    for (int i = 0; i < pool->size; i++) {
-        region = pool->pool[i];
-        uint16_t index = region->id & (new_size - 1);
-        tmp[index] = pool->pool[i];
+    __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+    if (concurrent) {
+        pool->concurrent = true;
     }
 
-    free(pool->pool);
-
-    pool->pool = tmp;
-    pool->size = new_size;
-    pool->last_offset = 0;
-
-    return CLEANQ_ERR_OK;
+    return pool;
 }
 
+
 /**
  * @brief add a memory region to the region pool
  *
@@ -197,75 +494,32 @@ static errval_t region_pool_grow(struct region_pool *pool)
  */
 errval_t region_pool_add_region(struct region_pool *pool, struct capref cap, regionid_t *region_id)
 {
-    errval_t err = CLEANQ_ERR_OK;
-    struct region *region;
-
-    // for now just loop over all entries
-    for (int i = 0; i < pool->size; i++) {
-        struct region *tmp;
-        tmp = pool->pool[i];
-
-        if (tmp == NULL) {
-            continue;
-        }
-
-        // check if region is already registered
-        if (tmp->base_addr == cap.paddr) {
-            return CLEANQ_ERR_INVALID_REGION_ARGS;
-        }
-
-        /* if region if entierly before other region or
-           entierly after region, otherwise there is an overlap
-         */
-        if (!((cap.paddr + cap.len <= tmp->base_addr) || (tmp->base_addr + tmp->len <= cap.paddr))) {
-            return CLEANQ_ERR_INVALID_REGION_ARGS;
-        }
-    }
+    errval_t err;
 
+    region_pool_write_lock(pool);
 
-    // Check if pool size is large enough
-    if (!(pool->num_regions < pool->size)) {
-        DQI_DEBUG_REGION("Increasing pool size to %d \n", pool->size * 2);
-        err = region_pool_grow(pool);
-        if (err_is_fail(err)) {
-            DQI_DEBUG_REGION("Increasing pool size failed\n");
-            return err;
-        }
+    /* if region if entierly before other region or
+       entierly after region, otherwise there is an overlap
+     */
+    if (region_tree_overlaps(pool->tree, cap.paddr, cap.len)) {
+        region_pool_unlock(pool);
+        return CLEANQ_ERR_INVALID_REGION_ARGS;
     }
 
-    pool->num_regions++;
-    uint16_t offset = pool->last_offset;
-    uint16_t index = 0;
-
-
-    // find slot
-    while (true) {
-        index = (pool->region_offset + pool->num_regions + offset) & (pool->size - 1);
-        DQI_DEBUG_REGION("Trying insert index %d \n", index);
-        if (pool->pool[index] == NULL) {
-            break;
-        } else {
-            offset++;
-        }
+    // skip ids that are already in use, e.g. added by the other endpoint
+    regionid_t id = pool->next_id++;
+    while (region_pool_lookup(pool, id) != NULL) {
+        id = pool->next_id++;
     }
 
-    pool->last_offset = offset;
-
-    region = (struct region *)slab_alloc(&pool->region_alloc);
-    if (region == NULL) {
-        return CLEANQ_ERR_MALLOC_FAIL;
+    err = region_pool_insert(pool, cap, id, false);
+    region_pool_unlock(pool);
+    if (err_is_fail(err)) {
+        return err;
     }
 
-    region->id = pool->region_offset + pool->num_regions + offset;
-    region->cap = cap;
-    region->base_addr = cap.paddr;
-    region->len = cap.len;
-
-    // insert into pool
-    pool->pool[region->id & (pool->size - 1)] = region;
-    *region_id = region->id;
-    DQI_DEBUG_REGION("Inserting region into pool at %d \n", region->id % pool->size);
-    return err;
+    *region_id = id;
+    return CLEANQ_ERR_OK;
 }
 
 /**
@@ -277,40 +531,27 @@ errval_t region_pool_add_region(struct region_pool *pool, struct capref cap, reg
  * @param region_id     The region id to add to the pool
  *
  * @returns error on failure or CLEANQ_ERR_OK on success
+ *
+ * The region belongs to the other endpoint, it may overlap with the own regions but not with
+ * the other regions of the other endpoint.
  */
 errval_t region_pool_add_region_with_id(struct region_pool *pool, struct capref cap,
                                         regionid_t region_id)
 {
     errval_t err;
-    // Check if pool size is large enough
-    if (!(pool->num_regions < pool->size)) {
-        DQI_DEBUG_REGION("Increasing pool size to %d \n", pool->size * 2);
-        err = region_pool_grow(pool);
-        if (err_is_fail(err)) {
-            DQI_DEBUG_REGION("Increasing pool size failed\n");
-            return err;
-        }
-    }
-
-    struct region *region = pool->pool[region_id & (pool->size - 1)];
-    if (region != NULL) {
-        return CLEANQ_ERR_INVALID_REGION_ID;
-    } else {
-        region = (struct region *)slab_alloc(&pool->region_alloc);
-        if (region == NULL) {
-            return CLEANQ_ERR_MALLOC_FAIL;
-        }
 
-        region->id = region_id;
-        region->cap = cap;
-        region->base_addr = cap.paddr;
-        region->len = cap.len;
+    region_pool_write_lock(pool);
 
-        pool->pool[region_id & (pool->size - 1)] = region;
+    if (region_pool_lookup(pool, region_id) != NULL) {
+        err = CLEANQ_ERR_INVALID_REGION_ID;
+    } else if (region_tree_overlaps(pool->remote_tree, cap.paddr, cap.len)) {
+        err = CLEANQ_ERR_INVALID_REGION_ARGS;
+    } else {
+        err = region_pool_insert(pool, cap, region_id, true);
     }
 
-    pool->num_regions++;
-    return CLEANQ_ERR_OK;
+    region_pool_unlock(pool);
+    return err;
 }
 
 /**
@@ -325,74 +566,182 @@ errval_t region_pool_add_region_with_id(struct region_pool *pool, struct capref
 errval_t region_pool_remove_region(struct region_pool *pool, regionid_t region_id,
                                    struct capref *cap)
 {
-    (void)(cap);
-    // errval_t err;
-    struct region *region;
-    region = pool->pool[region_id & (pool->size - 1)];
+    region_pool_write_lock(pool);
+
+    struct region *region = region_table_remove(&pool->table, region_id);
     if (region == NULL) {
+        region_pool_unlock(pool);
         return CLEANQ_ERR_INVALID_REGION_ID;
     }
 
     *cap = region->cap;
 
+    if (region->remote) {
+        pool->remote_tree = region_tree_remove(pool->remote_tree, region);
+    } else {
+        pool->tree = region_tree_remove(pool->tree, region);
+    }
     slab_free(&pool->region_alloc, region);
-    pool->pool[region_id & (pool->size - 1)] = NULL;
 
-    pool->num_regions--;
+    pool->generation++;
+
+    region_pool_unlock(pool);
     return CLEANQ_ERR_OK;
 }
 
 
 /**
- * @brief get memory region from pool
+ * @brief check if buffer is valid
  *
  * @param pool          The pool to get the region from
- * @param region_id     The id of the region to get
- * @param region        Return pointer to the region
+ * @param region_id     The id of the region
+ * @param offset        offset into the region
+ * @param length        length of the buffer
+ * @param valid_data    offset into the buffer
+ * @param valid_length  length of the valid_data
  *
- * @returns error on failure or CLEANQ_ERR_OK on success
+ * @returns true if the buffer is valid otherwise false
  */
-/*
-static errval_t region_pool_get_region(struct region_pool* pool,
-                                       regionid_t region_id,
-                                       struct region** region)
+bool region_pool_buffer_check_bounds(struct region_pool *pool, regionid_t region_id,
+                                     genoffset_t offset, genoffset_t length,
+                                     genoffset_t valid_data, genoffset_t valid_length)
 {
-    *region = pool->pool[region_id % pool->size];
-    if (*region == NULL) {
-        return CLEANQ_ERR_INVALID_REGION_ID;
+    region_pool_read_lock(pool);
+
+    // check validity of buffer within region
+    // and check validity of valid data values
+    struct region *region = region_pool_lookup(pool, region_id);
+    bool valid = region != NULL && length + offset <= region->len
+                 && valid_data + valid_length <= length;
+
+    region_pool_unlock(pool);
+    return valid;
+}
+
+
+/**
+ * @brief obtains the length of a region
+ *
+ * @param pool          The pool to get the region from
+ * @param region_id     The id of the region
+ * @param len           Return pointer to the length of the region
+ *
+ * @returns true if the region exists otherwise false
+ */
+bool region_pool_get_length(struct region_pool *pool, regionid_t region_id, size_t *len)
+{
+    region_pool_read_lock(pool);
+
+    struct region *region = region_pool_lookup(pool, region_id);
+    if (region != NULL) {
+        *len = region->len;
     }
 
-    return CLEANQ_ERR_OK;
+    region_pool_unlock(pool);
+    return region != NULL;
 }
-*/
+
 
 /**
- * @brief check if buffer is valid
+ * @brief obtains the memory of a region
  *
  * @param pool          The pool to get the region from
  * @param region_id     The id of the region
- * @param offset        offset into the region
- * @param length        length of the buffer
- * @param valid_data    offset into the buffer
- * @param valid_length  length of the valid_data
+ * @param cap           Return pointer to the memory of the region
  *
- * @returns true if the buffer is valid otherwise false
+ * @returns true if the region exists otherwise false
  */
-bool region_pool_buffer_check_bounds(struct region_pool *pool, regionid_t region_id,
-                                     genoffset_t offset, genoffset_t length,
-                                     genoffset_t valid_data, genoffset_t valid_length)
+bool region_pool_get_cap(struct region_pool *pool, regionid_t region_id, struct capref *cap)
+{
+    region_pool_read_lock(pool);
+
+    struct region *region = region_pool_lookup(pool, region_id);
+    if (region != NULL) {
+        *cap = region->cap;
+    }
+
+    region_pool_unlock(pool);
+    return region != NULL;
+}
+
+
+/**
+ * @brief finds the region containing an address
+ *
+ * @param pool          The pool to search
+ * @param addr          The address, relative to the physical base addresses of the regions
+ * @param region_id     Return pointer to the id of the region
+ * @param offset        Return pointer to the offset of the address into the region
+ *
+ * @returns true if a region contains the address otherwise false
+ *
+ * The own regions are searched before the ones of the other endpoint.
+ */
+bool region_pool_find_addr(struct region_pool *pool, uint64_t addr, regionid_t *region_id,
+                           genoffset_t *offset)
 {
-    struct region *region;
-    region = pool->pool[region_id & (pool->size - 1)];
+    region_pool_read_lock(pool);
+
+    struct region *region = region_tree_find(pool->tree, addr);
     if (region == NULL) {
-        return false;
+        region = region_tree_find(pool->remote_tree, addr);
+    }
+    if (region != NULL) {
+        *region_id = region->id;
+        *offset = addr - region->base_addr;
     }
 
-    // check validity of buffer within region
-    // and check validity of valid data values
-    if ((length + offset > region->len) || (valid_data + valid_length > length)) {
-        return false;
+    region_pool_unlock(pool);
+    return region != NULL;
+}
+
+
+/**
+ * @brief obtains the generation of the pool, it changes whenever a region is added or removed
+ *
+ * @param pool          The pool
+ *
+ * @returns pointer to the generation counter
+ */
+const uint64_t *region_pool_generation(struct region_pool *pool)
+{
+    return &pool->generation;
+}
+
+
+/**
+ * @brief check if a batch of buffers is valid
+ *
+ * @param pool          The pool to get the regions from
+ * @param bufs          Array of buffers to check
+ * @param num           The number of buffers in the array
+ *
+ * @returns the number of valid buffers before the first invalid one
+ */
+size_t region_pool_buffer_check_bounds_batch(struct region_pool *pool, struct cleanq_buf *bufs,
+                                             size_t num)
+{
+    region_pool_read_lock(pool);
+
+    struct region *region = NULL;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        struct cleanq_buf *b = &bufs[i];
+
+        // only do the lookup if the region changes
+        if (region == NULL || region->id != b->rid) {
+            region = region_pool_lookup(pool, b->rid);
+            if (region == NULL) {
+                break;
+            }
+        }
+
+        if ((b->length + b->offset > region->len)
+            || (b->valid_data + b->valid_length > b->length)) {
+            break;
+        }
     }
 
-    return true;
+    region_pool_unlock(pool);
+    return i;
 }
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "region_table.h"
+#include "debug.h"
+
+
+///< the largest size of the table, the region ids are 32-bit
+#define MAX_TABLE_SIZE (1UL << 31)
+
+
+/**
+ * @brief puts a region into a free slot
+ *
+ * @param slots     the slots of the table
+ * @param size      the number of slots
+ * @param shift     the hash shift of the table
+ * @param id        the id of the region
+ * @param value     the state of the region
+ */
+static void region_table_place(struct region_table_slot *slots, uint32_t size, uint32_t shift,
+                               regionid_t id, void *value)
+{
+    uint32_t mask = size - 1;
+    uint32_t index = region_table_hash(id, shift);
+    while (slots[index].value != NULL) {
+        index = (index + 1) & mask;
+    }
+
+    DQI_DEBUG_REGION("Inserting region into table at %u \n", index);
+    slots[index].id = id;
+    slots[index].value = value;
+}
+
+
+/**
+ * @brief doubles the number of slots of the table
+ *
+ * @param table     the region table
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+static errval_t region_table_grow(struct region_table *table)
+{
+    if (table->size >= MAX_TABLE_SIZE) {
+        DQI_DEBUG_REGION("Table has reached its maximum size \n");
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    uint32_t size = table->size * 2;
+    uint32_t shift = table->shift - 1;
+    struct region_table_slot *slots = calloc(size, sizeof(struct region_table_slot));
+    if (slots == NULL) {
+        DQI_DEBUG_REGION("Allocating larger table failed \n");
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    for (uint32_t i = 0; i < table->size; i++) {
+        if (table->slots[i].value != NULL) {
+            region_table_place(slots, size, shift, table->slots[i].id, table->slots[i].value);
+        }
+    }
+
+    free(table->slots);
+
+    table->slots = slots;
+    table->size = size;
+    table->shift = shift;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief initializes a region table
+ *
+ * @param table     The region table
+ * @param size      The initial number of slots, a power of two
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t region_table_init(struct region_table *table, uint32_t size)
+{
+    table->slots = calloc(size, sizeof(struct region_table_slot));
+    if (table->slots == NULL) {
+        return CLEANQ_ERR_MALLOC_FAIL;
+    }
+
+    table->size = size;
+    table->shift = 32 - __builtin_ctz(size);
+    table->num = 0;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief frees the slots of a region table, the values are left to the caller
+ *
+ * @param table     The region table
+ */
+void region_table_destroy(struct region_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+}
+
+
+/**
+ * @brief adds a region to the table, growing it if it is half full
+ *
+ * @param table     The region table
+ * @param id        The id of the region, must not be in the table yet
+ * @param value     The state of the region, not NULL
+ *
+ * @returns error on failure or CLEANQ_ERR_OK on success
+ */
+errval_t region_table_insert(struct region_table *table, regionid_t id, void *value)
+{
+    // keep the table at most half full
+    if (2 * ((uint64_t)table->num + 1) > table->size) {
+        DQI_DEBUG_REGION("Increasing table size to %u \n", table->size * 2);
+        errval_t err = region_table_grow(table);
+        if (err_is_fail(err)) {
+            return err;
+        }
+    }
+
+    region_table_place(table->slots, table->size, table->shift, id, value);
+    table->num++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief removes a region from the table
+ *
+ * @param table     The region table
+ * @param id        The id of the region
+ *
+ * @returns the state of the removed region or NULL if there is no region with this id
+ */
+void *region_table_remove(struct region_table *table, regionid_t id)
+{
+    uint32_t mask = table->size - 1;
+    uint32_t hole = region_table_hash(id, table->shift);
+    while (table->slots[hole].value != NULL && table->slots[hole].id != id) {
+        hole = (hole + 1) & mask;
+    }
+
+    void *value = table->slots[hole].value;
+    if (value == NULL) {
+        return NULL;
+    }
+
+    table->slots[hole].value = NULL;
+    table->num--;
+
+    // move back the following entries that can't be found anymore, no tombstones needed
+    uint32_t index = hole;
+    while (true) {
+        index = (index + 1) & mask;
+        struct region_table_slot *slot = &table->slots[index];
+        if (slot->value == NULL) {
+            break;
+        }
+
+        uint32_t home = region_table_hash(slot->id, table->shift);
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            table->slots[hole] = *slot;
+            slot->value = NULL;
+            hole = index;
+        }
+    }
+
+    return value;
+}
@@ -9,14 +9,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #include <linux/errno.h>
 
 #include <slab.h>
 
-#define DEFAULT_REFIL_SIZE (16 * 1024)
-
 
 // size of block header
 #define SLAB_BLOCK_HDRSIZE (sizeof(void *))
@@ -24,6 +24,12 @@
 #define SLAB_REAL_BLOCKSIZE(blocksize)                                                            \
     (((blocksize) > SLAB_BLOCK_HDRSIZE) ? (blocksize) : SLAB_BLOCK_HDRSIZE)
 
+// the minimum number of blocks in a slab
+#define SLAB_MIN_BLOCKS 8
+
+// the number of blocks a thread cache holds
+#define SLAB_MAGAZINE_SIZE 32
+
 
 ///< this is the definition of block in the free list
 struct block_head
@@ -37,57 +43,97 @@ struct slab_head
     ///< Next slab in the allocator
     struct slab_head *next;
 
+    ///< Next slab with free blocks
+    struct slab_head *next_partial;
+
     ///< Count of total and free blocks in this slab
     uint32_t total, free;
 
+    ///< Whether the memory of the slab has been allocated by slab_default_refill()
+    bool owned;
+
     ///< Pointer to free block list
     struct block_head *blocks;
 };
 
+// the size of the slab head, the first block starts after it
+#define SLAB_HEAD_SIZE                                                                            \
+    ((sizeof(struct slab_head) + SLAB_BLOCK_HDRSIZE - 1) & ~(SLAB_BLOCK_HDRSIZE - 1))
+
+
+///< the blocks cached by a thread
+struct slab_magazine
+{
+    ///< the allocator this magazine belongs to
+    struct slab_allocator *slabs;
+
+    ///< the list of magazines of the allocator
+    struct slab_magazine *next, *prev;
+
+    ///< the number of cached blocks
+    uint32_t count;
+
+    ///< the cached blocks
+    void *blocks[SLAB_MAGAZINE_SIZE];
+};
+
+///< the shared state of the thread caches
+struct slab_depot
+{
+    ///< protects the slabs and the list of magazines
+    pthread_mutex_t lock;
+
+    ///< the key of the magazine of the thread
+    pthread_key_t key;
+
+    ///< the magazines of all threads
+    struct slab_magazine *magazines;
+};
+
+
+/*
+ * ================================================================================================
+ * Slab Management
+ * ================================================================================================
+ */
+
 
 /**
- * @brief initializes a slab allocator
+ * @brief obtains the slab a block belongs to
  *
- * @param slabs         the slab allocator to be initialized
- * @param blocksize     the blocksize of the slabs
- * @param refill_func   function to be called when the slabs running out of memory
+ * @param slabs     the slab allocator
+ * @param block     the block
+ *
+ * @returns pointer to the slab head
  */
-void slab_init(struct slab_allocator *slabs, size_t blocksize, slab_refill_func_t refill_func)
+static inline struct slab_head *slab_of_block(struct slab_allocator *slabs, void *block)
 {
-    slabs->slabs = NULL;
-    slabs->blocksize = SLAB_REAL_BLOCKSIZE(blocksize);
-    slabs->refill_func = refill_func;
+    return (struct slab_head *)((uintptr_t)block & ~(uintptr_t)(slabs->slabsize - 1));
 }
 
 
 /**
- * @brief allocates a new block from the slab allocator
+ * @brief takes a block from the slabs
  *
- * @param slabs     the slab allocator to allocate from
+ * @param slabs     the slab allocator
  *
- * @returns pointer ot new memory or NULL
+ * @returns pointer to the block, or NULL if the slabs are exhausted and can't be refilled
  */
-void *slab_alloc(struct slab_allocator *slabs)
+static void *slab_take_block(struct slab_allocator *slabs)
 {
-    /* find a slab with free blocks */
-    struct slab_head *sh;
-    for (sh = slabs->slabs; sh != NULL && sh->free == 0; sh = sh->next)
-        ;
-
+    struct slab_head *sh = slabs->partial;
     if (sh == NULL) {
         /* out of memory. try refill function if we have one */
         if (!slabs->refill_func) {
             return NULL;
-        } else {
-            if (slabs->refill_func(slabs)) {
-                printf("slab refill_func failed\n");
-                return NULL;
-            }
-            for (sh = slabs->slabs; sh != NULL && sh->free == 0; sh = sh->next)
-                ;
-            if (sh == NULL) {
-                return NULL;
-            }
+        }
+        if (slabs->refill_func(slabs)) {
+            printf("slab refill_func failed\n");
+            return NULL;
+        }
+        sh = slabs->partial;
+        if (sh == NULL) {
+            return NULL;
         }
     }
 
@@ -97,12 +143,380 @@ void *slab_alloc(struct slab_allocator *slabs)
     sh->blocks = bh->next;
     sh->free--;
 
-    memset(bh, 0, slabs->blocksize);
+    /* the slab is full, take it off the partial list */
+    if (sh->free == 0) {
+        slabs->partial = sh->next_partial;
+        sh->next_partial = NULL;
+    }
 
     return bh;
 }
 
 
+/**
+ * @brief returns a block to its slab
+ *
+ * @param slabs     the slab allocator
+ * @param block     the block to be returned
+ */
+static void slab_put_block(struct slab_allocator *slabs, void *block)
+{
+    struct block_head *bh = (struct block_head *)block;
+    struct slab_head *sh = slab_of_block(slabs, block);
+    assert((uintptr_t)bh >= (uintptr_t)sh + SLAB_HEAD_SIZE);
+    assert((uintptr_t)bh < (uintptr_t)sh + SLAB_HEAD_SIZE + slabs->blocksize * sh->total);
+
+    /* the slab was full, it has free blocks again */
+    if (sh->free == 0) {
+        sh->next_partial = slabs->partial;
+        slabs->partial = sh;
+    }
+
+    /* re-enqueue in slab's free list */
+    bh->next = sh->blocks;
+    sh->blocks = bh;
+    sh->free++;
+    assert(sh->free <= sh->total);
+}
+
+
+/**
+ * @brief adds a slab to the allocator
+ *
+ * @param slabs     the slab allocator
+ * @param buf       the start of the slab, aligned to the slab size
+ * @param buflen    the usable size of the slab, at most the slab size
+ * @param owned     whether the memory has been allocated by slab_default_refill()
+ *
+ * @returns true if the slab was added, false if it is too small to hold a block
+ */
+static bool slab_add(struct slab_allocator *slabs, void *buf, size_t buflen, bool owned)
+{
+    assert(((uintptr_t)buf & (slabs->slabsize - 1)) == 0);
+    assert(buflen <= slabs->slabsize);
+
+    size_t blocksize = slabs->blocksize;
+    if (buflen < SLAB_HEAD_SIZE + blocksize) {
+        return false;
+    }
+
+    /* setup slab_head structure at top of buffer */
+    struct slab_head *head = (struct slab_head *)buf;
+    head->owned = owned;
+    buflen -= SLAB_HEAD_SIZE;
+    buf = (char *)buf + SLAB_HEAD_SIZE;
+
+    /* calculate number of blocks in buffer */
+    assert(buflen / blocksize <= UINT32_MAX);
+    head->free = head->total = buflen / blocksize;
+
+    /* enqueue blocks in freelist */
+    struct block_head *bh = head->blocks = (struct block_head *)buf;
+    for (uint32_t i = head->total; i > 1; i--) {
+        buf = (char *)buf + blocksize;
+        bh->next = (struct block_head *)buf;
+        bh = (struct block_head *)buf;
+    }
+    bh->next = NULL;
+
+    /* enqueue slab in list of slabs and in the list of slabs with free blocks */
+    head->next = slabs->slabs;
+    slabs->slabs = head;
+    head->next_partial = slabs->partial;
+    slabs->partial = head;
+
+    return true;
+}
+
+
+/*
+ * ================================================================================================
+ * Thread Caches
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief returns all blocks of a magazine to the slabs, the depot lock must be held
+ *
+ * @param mag   the magazine to flush
+ */
+static void slab_magazine_flush(struct slab_magazine *mag)
+{
+    while (mag->count > 0) {
+        slab_put_block(mag->slabs, mag->blocks[--mag->count]);
+    }
+}
+
+
+/**
+ * @brief destructor of the magazine of a thread, called on thread exit
+ *
+ * @param arg   the magazine of the exiting thread
+ */
+static void slab_magazine_destructor(void *arg)
+{
+    struct slab_magazine *mag = arg;
+    struct slab_depot *depot = mag->slabs->depot;
+
+    pthread_mutex_lock(&depot->lock);
+    slab_magazine_flush(mag);
+    if (mag->prev) {
+        mag->prev->next = mag->next;
+    } else {
+        depot->magazines = mag->next;
+    }
+    if (mag->next) {
+        mag->next->prev = mag->prev;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    free(mag);
+}
+
+
+/**
+ * @brief obtains the magazine of the calling thread, creating it if needed
+ *
+ * @param slabs     the slab allocator
+ *
+ * @returns pointer to the magazine, or NULL if it could not be allocated
+ */
+static struct slab_magazine *slab_magazine_get(struct slab_allocator *slabs)
+{
+    struct slab_depot *depot = slabs->depot;
+    struct slab_magazine *mag = pthread_getspecific(depot->key);
+    if (mag != NULL) {
+        return mag;
+    }
+
+    mag = malloc(sizeof(*mag));
+    if (mag == NULL) {
+        return NULL;
+    }
+    mag->slabs = slabs;
+    mag->count = 0;
+    mag->prev = NULL;
+
+    if (pthread_setspecific(depot->key, mag)) {
+        free(mag);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&depot->lock);
+    mag->next = depot->magazines;
+    if (mag->next) {
+        mag->next->prev = mag;
+    }
+    depot->magazines = mag;
+    pthread_mutex_unlock(&depot->lock);
+
+    return mag;
+}
+
+
+/**
+ * @brief allocates a block through the thread cache
+ *
+ * @param slabs     the slab allocator
+ *
+ * @returns pointer to the block or NULL
+ */
+static void *slab_alloc_cached(struct slab_allocator *slabs)
+{
+    struct slab_depot *depot = slabs->depot;
+    struct slab_magazine *mag = slab_magazine_get(slabs);
+    if (mag == NULL) {
+        pthread_mutex_lock(&depot->lock);
+        void *block = slab_take_block(slabs);
+        pthread_mutex_unlock(&depot->lock);
+        return block;
+    }
+
+    if (mag->count == 0) {
+        /* fill half of the magazine, so a following free doesn't need to flush */
+        pthread_mutex_lock(&depot->lock);
+        while (mag->count < SLAB_MAGAZINE_SIZE / 2) {
+            void *block = slab_take_block(slabs);
+            if (block == NULL) {
+                break;
+            }
+            mag->blocks[mag->count++] = block;
+        }
+        pthread_mutex_unlock(&depot->lock);
+
+        if (mag->count == 0) {
+            return NULL;
+        }
+    }
+
+    return mag->blocks[--mag->count];
+}
+
+
+/**
+ * @brief frees a block through the thread cache
+ *
+ * @param slabs     the slab allocator
+ * @param block     the block to be freed
+ */
+static void slab_free_cached(struct slab_allocator *slabs, void *block)
+{
+    struct slab_depot *depot = slabs->depot;
+    struct slab_magazine *mag = slab_magazine_get(slabs);
+    if (mag == NULL) {
+        pthread_mutex_lock(&depot->lock);
+        slab_put_block(slabs, block);
+        pthread_mutex_unlock(&depot->lock);
+        return;
+    }
+
+    if (mag->count == SLAB_MAGAZINE_SIZE) {
+        /* return the older half of the magazine */
+        pthread_mutex_lock(&depot->lock);
+        for (uint32_t i = 0; i < SLAB_MAGAZINE_SIZE / 2; i++) {
+            slab_put_block(slabs, mag->blocks[i]);
+        }
+        pthread_mutex_unlock(&depot->lock);
+
+        memmove(mag->blocks, mag->blocks + SLAB_MAGAZINE_SIZE / 2,
+                (SLAB_MAGAZINE_SIZE / 2) * sizeof(void *));
+        mag->count = SLAB_MAGAZINE_SIZE / 2;
+    }
+
+    mag->blocks[mag->count++] = block;
+}
+
+
+/*
+ * ================================================================================================
+ * Slab Allocator
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief initializes a slab allocator
+ *
+ * @param slabs         the slab allocator to be initialized
+ * @param blocksize     the blocksize of the slabs
+ * @param refill_func   function to be called when the slabs running out of memory
+ */
+void slab_init(struct slab_allocator *slabs, size_t blocksize, slab_refill_func_t refill_func)
+{
+    int r = slab_init_with_flags(slabs, blocksize, refill_func, 0);
+    assert(r == 0);
+    (void)r;
+}
+
+
+/**
+ * @brief initializes a slab allocator with flags
+ *
+ * @param slabs         the slab allocator to be initialized
+ * @param blocksize     the blocksize of the slabs
+ * @param refill_func   function to be called when the slabs running out of memory
+ * @param flags         the flags of the allocator, SLAB_FLAG_*
+ *
+ * @returns 0 on success, -ENOMEM on failure
+ */
+int slab_init_with_flags(struct slab_allocator *slabs, size_t blocksize,
+                         slab_refill_func_t refill_func, uint32_t flags)
+{
+    slabs->slabs = NULL;
+    slabs->partial = NULL;
+    slabs->blocksize = SLAB_REAL_BLOCKSIZE(blocksize);
+    slabs->flags = flags;
+    slabs->refill_func = refill_func;
+    slabs->depot = NULL;
+
+    /* the slab must hold a few blocks, the blocks are found by masking their address */
+    slabs->slabsize = SLAB_MIN_SLABSIZE;
+    while (slabs->slabsize - SLAB_HEAD_SIZE < SLAB_MIN_BLOCKS * slabs->blocksize) {
+        slabs->slabsize <<= 1;
+    }
+
+    if (!(flags & SLAB_FLAG_THREAD_CACHE)) {
+        return 0;
+    }
+
+    struct slab_depot *depot = malloc(sizeof(*depot));
+    if (depot == NULL) {
+        return -ENOMEM;
+    }
+
+    if (pthread_key_create(&depot->key, slab_magazine_destructor)) {
+        free(depot);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&depot->lock, NULL);
+    depot->magazines = NULL;
+    slabs->depot = depot;
+
+    return 0;
+}
+
+
+/**
+ * @brief destroys a slab allocator
+ *
+ * @param slabs     the slab allocator to be destroyed
+ */
+void slab_destroy(struct slab_allocator *slabs)
+{
+    struct slab_depot *depot = slabs->depot;
+    if (depot) {
+        /* the magazines of the threads that are still running */
+        pthread_key_delete(depot->key);
+        while (depot->magazines) {
+            struct slab_magazine *mag = depot->magazines;
+            depot->magazines = mag->next;
+            free(mag);
+        }
+        pthread_mutex_destroy(&depot->lock);
+        free(depot);
+        slabs->depot = NULL;
+    }
+
+    struct slab_head *sh = slabs->slabs;
+    while (sh) {
+        struct slab_head *next = sh->next;
+        if (sh->owned) {
+            free(sh);
+        }
+        sh = next;
+    }
+
+    slabs->slabs = NULL;
+    slabs->partial = NULL;
+}
+
+
+/**
+ * @brief allocates a new block from the slab allocator
+ *
+ * @param slabs     the slab allocator to allocate from
+ *
+ * @returns pointer ot new memory or NULL
+ */
+void *slab_alloc(struct slab_allocator *slabs)
+{
+    void *block;
+    if (slabs->depot) {
+        block = slab_alloc_cached(slabs);
+    } else {
+        block = slab_take_block(slabs);
+    }
+
+    if (block && !(slabs->flags & SLAB_FLAG_NO_ZERO)) {
+        memset(block, 0, slabs->blocksize);
+    }
+
+    return block;
+}
+
+
 /**
  * @brief frees a previously allocated block
  *
@@ -117,25 +531,11 @@ void slab_free(struct slab_allocator *slabs, void *block)
         return;
     }
 
-    struct block_head *bh = (struct block_head *)block;
-
-    /* find matching slab */
-    struct slab_head *sh;
-    size_t blocksize = slabs->blocksize;
-    for (sh = slabs->slabs; sh != NULL; sh = sh->next) {
-        /* check if block falls inside this slab */
-        uintptr_t slab_limit = (uintptr_t)sh + sizeof(struct slab_head) + blocksize * sh->total;
-        if ((uintptr_t)bh > (uintptr_t)sh && (uintptr_t)bh < slab_limit) {
-            break;
-        }
+    if (slabs->depot) {
+        slab_free_cached(slabs, block);
+    } else {
+        slab_put_block(slabs, block);
     }
-    assert(sh != NULL);
-
-    /* re-enqueue in slab's free list */
-    bh->next = sh->blocks;
-    sh->blocks = bh;
-    sh->free++;
-    assert(sh->free <= sh->total);
 }
 
 
@@ -148,12 +548,14 @@ void slab_free(struct slab_allocator *slabs, void *block)
  */
 int slab_default_refill(struct slab_allocator *slabs)
 {
-    void *buf = malloc(DEFAULT_REFIL_SIZE);
+    void *buf = aligned_alloc(slabs->slabsize, slabs->slabsize);
     if (!buf) {
         return -ENOMEM;
     }
 
-    slab_grow(slabs, buf, DEFAULT_REFIL_SIZE);
+    bool added = slab_add(slabs, buf, slabs->slabsize, true);
+    assert(added);
+    (void)added;
 
     return 0;
 }
@@ -165,32 +567,25 @@ int slab_default_refill(struct slab_allocator *slabs)
  * @param slabs     the slab allocator to refill
  * @param buf       pointer to backing memory
  * @param buflen    size of the backing memory in bytes
+ *
+ * @returns 0 on success, -EINVAL if no aligned piece of the buffer holds a block
+ *
+ * NOTE: with SLAB_FLAG_THREAD_CACHE, this must only be called from the refill function or
+ *       before the allocator is used by several threads.
  */
-void slab_grow(struct slab_allocator *slabs, void *buf, size_t buflen)
+int slab_grow(struct slab_allocator *slabs, void *buf, size_t buflen)
 {
-    assert(buflen > sizeof(struct slab_head));
-
-    /* setup slab_head structure at top of buffer */
-    struct slab_head *head = (struct slab_head *)buf;
-    buflen -= sizeof(struct slab_head);
-    buf = (char *)buf + sizeof(struct slab_head);
-
-    /* calculate number of blocks in buffer */
-    size_t blocksize = slabs->blocksize;
-    assert(buflen / blocksize <= UINT32_MAX);
-    head->free = head->total = buflen / blocksize;
-    assert(head->total > 0);
-
-    /* enqueue blocks in freelist */
-    struct block_head *bh = head->blocks = (struct block_head *)buf;
-    for (uint32_t i = head->total; i > 1; i--) {
-        buf = (char *)buf + blocksize;
-        bh->next = (struct block_head *)buf;
-        bh = (struct block_head *)buf;
+    size_t slabsize = slabs->slabsize;
+    uintptr_t start = (uintptr_t)buf;
+    uintptr_t end = start + buflen;
+
+    /* the slab heads are at the naturally aligned addresses inside the buffer */
+    uintptr_t slab = (start + slabsize - 1) & ~(uintptr_t)(slabsize - 1);
+    bool added = false;
+    for (; slab < end && slab >= start; slab += slabsize) {
+        size_t len = (end - slab < slabsize) ? end - slab : slabsize;
+        added |= slab_add(slabs, (void *)slab, len, false);
     }
-    bh->next = NULL;
 
-    /* enqueue slab in list of slabs */
-    head->next = slabs->slabs;
-    slabs->slabs = head;
+    return added ? 0 : -EINVAL;
 }
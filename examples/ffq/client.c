@@ -16,6 +16,7 @@
 #include <inttypes.h>
 
 #include <cleanq/cleanq.h>
+#include <cleanq/bufpool.h>
 #include <cleanq/backends/ff_queue.h>
 
 
@@ -25,6 +26,7 @@
 
 static struct capref memory;
 static regionid_t regid;
+static struct cleanq_bufpool *pool;
 
 
 int main(int argc, char *argv[])
@@ -59,6 +61,13 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /* carve the memory into buffers */
+    err = cleanq_bufpool_create(&pool, memory, regid, BUF_SIZE, 0);
+    if (err_is_fail(err)) {
+        printf("CLIENT: creating the buffer pool failed\n");
+        exit(1);
+    }
+
     regionid_t regid_ret;
     genoffset_t offset, length, valid_data, valid_length;
     uint64_t flags;
@@ -67,7 +76,12 @@ int main(int argc, char *argv[])
     for (size_t i = 0; i < 10; i++) {
         usleep(500);
 
-        offset = 0;
+        err = cleanq_bufpool_alloc(pool, &regid_ret, &offset);
+        if (err_is_fail(err)) {
+            printf("CLIENT: out of buffers\n");
+            exit(1);
+        }
+
         length = BUF_SIZE;
         valid_data = 0;
         valid_length = BUF_SIZE;
@@ -76,6 +90,7 @@ int main(int argc, char *argv[])
                offset + length - 1);
         err = cleanq_enqueue(q, regid, offset, length, valid_data, valid_length, 0);
         if (err_is_fail(err)) {
+            cleanq_bufpool_free(pool, regid, offset);
             if (err == CLEANQ_ERR_QUEUE_FULL) {
                 continue;
             } else {
@@ -98,8 +113,11 @@ int main(int argc, char *argv[])
                 }
             }
         } while (err_is_fail(err));
+
+        cleanq_bufpool_free(pool, regid_ret, offset);
     }
 
+    cleanq_bufpool_destroy(pool);
 
     /* deregister again */
     err = cleanq_deregister(q, regid, &memory);
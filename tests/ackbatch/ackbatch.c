@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "ackbatch"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 512
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define MAX_BATCH 24
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 200000
+
+///< the echo side picks a new acknowledgement batch after this many buffers
+#define ACK_INTERVAL 1000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static uint64_t set_ack_batch(struct cleanq *q, uint64_t batch)
+{
+    uint64_t old;
+    errval_t err = cleanq_control(q, CLEANQ_CTRL_ACK_BATCH, batch, &old);
+    if (err_is_fail(err)) {
+        FAIL("setting the acknowledgement batch to %lu failed %d\n", batch, err);
+    }
+    return old;
+}
+
+
+///< enqueues buffers until the ring is full, returns their number
+static size_t fill(struct cleanq *tx, uint64_t *seq)
+{
+    errval_t err;
+    size_t num = 0;
+
+    while ((err = cleanq_enqueue(tx, regid, (*seq % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE,
+                                 *seq))
+           == CLEANQ_ERR_OK) {
+        (*seq)++;
+        num++;
+    }
+    if (err != CLEANQ_ERR_QUEUE_FULL) {
+        FAIL("filling the ring returned %d\n", err);
+    }
+
+    return num;
+}
+
+
+static void drain(struct cleanq *rx, uint64_t *seq, size_t num)
+{
+    for (size_t i = 0; i < num; i++) {
+        struct cleanq_buf b;
+        errval_t err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                      &b.valid_length, &b.flags);
+        if (err_is_fail(err) || b.flags != *seq) {
+            FAIL("expected buffer %lu, got %lu err=%d\n", *seq, b.flags, err);
+        }
+        (*seq)++;
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The receiver hands the slots back once a batch of them has been consumed, and always once the
+ * ring is drained. Until then the sender sees the ring as full.
+ */
+static void test_deferred(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = test_create_queue(name, ffq, true, NUM_SLOTS);
+    struct cleanq *rx = test_create_queue(name, ffq, false, NUM_SLOTS);
+
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t tx_seq = 0;
+    uint64_t rx_seq = 0;
+    if (set_ack_batch(rx, 1) != 1) {
+        FAIL("the acknowledgement batch is not 1 by default\n");
+    }
+
+    for (uint64_t batch = 1; batch < NUM_SLOTS; batch++) {
+        if (set_ack_batch(rx, batch) != (batch > 1 ? batch - 1 : 1)) {
+            FAIL("setting the acknowledgement batch does not return the old one\n");
+        }
+
+        if (fill(tx, &tx_seq) != NUM_SLOTS) {
+            FAIL("the ring does not take %d buffers\n", NUM_SLOTS);
+        }
+
+        /* each round consumes a batch from a ring that is not drained */
+        for (size_t round = 0; round < 4; round++) {
+            drain(rx, &rx_seq, batch - 1);
+            if (fill(tx, &tx_seq) != 0) {
+                FAIL("the sender got slots back before a batch of %lu was consumed\n", batch);
+            }
+            drain(rx, &rx_seq, 1);
+            if (fill(tx, &tx_seq) != batch) {
+                FAIL("the sender did not get a batch of %lu slots back\n", batch);
+            }
+        }
+
+        /* a drained ring is handed back whatever is left of the batch */
+        drain(rx, &rx_seq, NUM_SLOTS);
+        struct cleanq_buf b;
+        err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+            FAIL("dequeue from a drained ring returned %d\n", err);
+        }
+    }
+
+    /* lowering the batch hands back what is pending under the old one */
+    set_ack_batch(rx, NUM_SLOTS - 1);
+    fill(tx, &tx_seq);
+    drain(rx, &rx_seq, 2);
+    if (fill(tx, &tx_seq) != 0) {
+        FAIL("the sender got slots back before a batch of %d was consumed\n", NUM_SLOTS - 1);
+    }
+    set_ack_batch(rx, 1);
+    if (!ffq) {
+        /* the IPC queue publishes its acknowledgement with the next dequeue */
+        drain(rx, &rx_seq, 1);
+    }
+    if (fill(tx, &tx_seq) != (ffq ? 2 : 3)) {
+        FAIL("the slots pending under the old batch have not been handed back\n");
+    }
+    drain(rx, &rx_seq, NUM_SLOTS);
+
+    /* 0 means every descriptor */
+    set_ack_batch(rx, 0);
+    if (set_ack_batch(rx, 1) != 1) {
+        FAIL("an acknowledgement batch of 0 is not taken as 1\n");
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Answers every buffer in batches of random size, and changes its acknowledgement batch while
+ * the buffers are in flight.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, false, NUM_SLOTS);
+
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        if (num_rx % ACK_INTERVAL == 0) {
+            set_ack_batch(queue, rand() % NUM_SLOTS);
+        }
+
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            if (bufs[i].flags != num_rx + i) {
+                FAIL("the echo side expected buffer %lu, got %lu\n", num_rx + i, bufs[i].flags);
+            }
+        }
+
+        size_t sent = 0;
+        while (sent < num_deq) {
+            size_t num_enq;
+            err = cleanq_enqueue_batch(queue, bufs + sent, num_deq - sent, &num_enq);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                sched_yield();
+                continue;
+            }
+            if (err_is_fail(err)) {
+                FAIL("the echo side enqueue returned %d\n", err);
+            }
+            sent += num_enq;
+        }
+        num_rx += num_deq;
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * Both sides acknowledge lazily with batches that change at random, neither of them waits
+ * forever on slots the other one has consumed.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    alarm(HANG_TIMEOUT_S);
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num = (rand() % MAX_BATCH) + 1;
+        if (num > NUM_MSGS - num_tx) {
+            num = NUM_MSGS - num_tx;
+        }
+        for (size_t i = 0; i < num; i++) {
+            uint64_t seq = num_tx + i;
+            bufs[i] = (struct cleanq_buf){ .rid = regid, .offset = (seq % NUM_BUFS) * BUF_SIZE,
+                                           .length = BUF_SIZE, .valid_data = 0,
+                                           .valid_length = BUF_SIZE, .flags = seq };
+        }
+        size_t num_enq = 0;
+        if (num) {
+            err = cleanq_enqueue_batch(queue, bufs, num, &num_enq);
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            num_tx += num_enq;
+        }
+
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("receiving buffer %lu returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            if (bufs[i].flags != num_rx + i) {
+                FAIL("expected buffer %lu back, got %lu\n", num_rx + i, bufs[i].flags);
+            }
+        }
+        num_rx += num_deq;
+
+        if (rand() % ACK_INTERVAL == 0) {
+            set_ack_batch(queue, rand() % NUM_SLOTS);
+        }
+    }
+
+    test_join(pid);
+
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-ackbatch-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting ipcq deferred test\n");
+    test_deferred(false);
+
+    printf("Starting ffq deferred test\n");
+    test_deferred(true);
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("ackbatch test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+#include <cleanq/backends/debug_queue.h>
+
+#define TEST_NAME "batch"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define MAX_BATCH 16
+
+#define NUM_ROUNDS 100000
+
+static struct capref memory;
+static regionid_t regid;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void fill_buf(struct cleanq_buf *b, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = (seq % NUM_BUFS) * BUF_SIZE;
+    b->length = BUF_SIZE;
+    b->valid_data = seq % 64;
+    b->valid_length = (seq % 1000) + 1;
+    b->flags = seq;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, uint64_t seq)
+{
+    if (b->offset != (seq % NUM_BUFS) * BUF_SIZE || b->length != BUF_SIZE
+        || b->valid_data != seq % 64 || b->valid_length != (seq % 1000) + 1 || b->flags != seq) {
+        printf("batch test failed: buffer %lu came back as offset=%lu length=%lu valid_data=%lu "
+               "valid_length=%lu flags=%lu\n",
+               seq, b->offset, b->length, b->valid_data, b->valid_length, b->flags);
+        exit(1);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Sends NUM_ROUNDS buffers in batches of random size and checks that they come back in order
+ * and unchanged, also when they are dequeued in batches of a different size.
+ */
+static void test_randomized_batch(struct cleanq *queue, size_t inflight)
+{
+    errval_t err;
+    uint64_t sent = 0;
+    uint64_t recv = 0;
+
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    while (recv < NUM_ROUNDS) {
+        size_t num = (rand() % MAX_BATCH) + 1;
+        size_t k = 0;
+        for (; k < num && sent + k < NUM_ROUNDS && sent + k - recv < inflight; k++) {
+            fill_buf(&bufs[k], sent + k);
+        }
+
+        if (k) {
+            size_t num_enq = 0;
+            err = cleanq_enqueue_batch(queue, bufs, k, &num_enq);
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("enqueue batch of %zu returned %d\n", k, err);
+            }
+            if (num_enq > k || (err_is_ok(err) && num_enq == 0)) {
+                FAIL("enqueue batch of %zu enqueued %zu\n", k, num_enq);
+            }
+            sent += num_enq;
+        }
+
+        num = (rand() % MAX_BATCH) + 1;
+        size_t num_deq = 0;
+        err = cleanq_dequeue_batch(queue, bufs, num, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            if (num_deq) {
+                FAIL("empty dequeue returned %zu buffers\n", num_deq);
+            }
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("dequeue batch returned %d\n", err);
+        }
+        if (num_deq == 0 || num_deq > num) {
+            FAIL("dequeue batch of %zu returned %zu buffers\n", num, num_deq);
+        }
+
+        for (size_t i = 0; i < num_deq; i++) {
+            if (bufs[i].rid != regid) {
+                FAIL("buffer %lu has region %u\n", recv + i, bufs[i].rid);
+            }
+            check_buf(&bufs[i], recv + i);
+        }
+        recv += num_deq;
+    }
+}
+
+
+/*
+ * A batch with one invalid buffer is rejected as a whole.
+ */
+static void test_invalid_batch(struct cleanq *queue)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    for (int round = 0; round < 100; round++) {
+        for (uint64_t i = 0; i < MAX_BATCH; i++) {
+            fill_buf(&bufs[i], i);
+        }
+
+        size_t bad = rand() % MAX_BATCH;
+        switch (rand() % 3) {
+        case 0:
+            bufs[bad].rid = regid + 1;
+            break;
+        case 1:
+            bufs[bad].offset = MEMORY_SIZE;
+            break;
+        default:
+            bufs[bad].valid_length = BUF_SIZE + 1;
+            break;
+        }
+
+        size_t num_enq = 42;
+        err = cleanq_enqueue_batch(queue, bufs, MAX_BATCH, &num_enq);
+        if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS || num_enq != 0) {
+            FAIL("batch with invalid buffer %zu returned %d, enqueued %zu\n", bad, err, num_enq);
+        }
+
+        size_t num_deq = 42;
+        err = cleanq_dequeue_batch(queue, bufs, MAX_BATCH, &num_deq);
+        if (err != CLEANQ_ERR_QUEUE_EMPTY || num_deq != 0) {
+            FAIL("rejected batch was dequeued, err=%d num=%zu\n", err, num_deq);
+        }
+    }
+
+    size_t num = 1;
+    err = cleanq_enqueue_batch(queue, bufs, 0, &num);
+    if (err_is_fail(err) || num != 0) {
+        FAIL("empty batch returned %d, enqueued %zu\n", err, num);
+    }
+}
+
+
+/*
+ * Batches and single buffers can be mixed, the order is kept.
+ */
+static void test_mixed(struct cleanq *queue)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    for (uint64_t i = 0; i < 4; i++) {
+        fill_buf(&bufs[i], i);
+    }
+
+    size_t num = 0;
+    err = cleanq_enqueue_batch(queue, bufs, 2, &num);
+    if (err_is_fail(err) || num != 2) {
+        FAIL("enqueue batch returned %d, enqueued %zu\n", err, num);
+    }
+    for (int i = 2; i < 4; i++) {
+        err = cleanq_enqueue(queue, bufs[i].rid, bufs[i].offset, bufs[i].length,
+                             bufs[i].valid_data, bufs[i].valid_length, bufs[i].flags);
+        if (err_is_fail(err)) {
+            FAIL("enqueue returned %d\n", err);
+        }
+    }
+
+    struct cleanq_buf b;
+    while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags))
+           == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("dequeue returned %d\n", err);
+    }
+    check_buf(&b, 0);
+
+    uint64_t recv = 1;
+    while (recv < 4) {
+        err = cleanq_dequeue_batch(queue, bufs, MAX_BATCH, &num);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || recv + num > 4) {
+            FAIL("dequeue batch returned %d, dequeued %zu\n", err, num);
+        }
+        for (size_t i = 0; i < num; i++) {
+            check_buf(&bufs[i], recv + i);
+        }
+        recv += num;
+    }
+}
+
+
+static void run_test(struct cleanq *queue, const char *q_name, size_t inflight)
+{
+    errval_t err;
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed using q: %s\n", q_name);
+    }
+
+    printf("Starting randomized batch test %s\n", q_name);
+    test_randomized_batch(queue, inflight);
+
+    printf("Starting invalid batch test %s\n", q_name);
+    test_invalid_batch(queue);
+
+    printf("Starting mixed batch test %s\n", q_name);
+    test_mixed(queue);
+
+    struct capref cap;
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering memory failed using q: %s\n", q_name);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Returns every buffer received in batches of random size until it is killed.
+ */
+static void echo(struct cleanq *queue)
+{
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    while (true) {
+        size_t num_deq = 0;
+        errval_t err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("echo dequeue returned %d\n", err);
+        }
+
+        size_t done = 0;
+        while (done < num_deq) {
+            size_t num_enq = 0;
+            err = cleanq_enqueue_batch(queue, bufs + done, num_deq - done, &num_enq);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                sched_yield();
+                continue;
+            }
+            if (err_is_fail(err)) {
+                FAIL("echo enqueue returned %d\n", err);
+            }
+            done += num_enq;
+        }
+    }
+}
+
+
+static void run_echo_test(const char *q_name, bool ipc)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-batch-%s-%d", q_name, getpid());
+
+    struct cleanq *queue;
+    if (ipc) {
+        err = cleanq_ipcq_create((struct cleanq_ipcq **)&queue, name, true);
+    } else {
+        err = cleanq_ffq_create((struct cleanq_ffq **)&queue, name, true);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating %s failed %d\n", q_name, err);
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        struct cleanq *other;
+        if (ipc) {
+            err = cleanq_ipcq_create((struct cleanq_ipcq **)&other, name, false);
+        } else {
+            err = cleanq_ffq_create((struct cleanq_ffq **)&other, name, false);
+        }
+        if (err_is_fail(err)) {
+            FAIL("connecting to %s failed %d\n", q_name, err);
+        }
+        echo(other);
+    }
+
+    /* the ring holds fewer buffers than the region, keep them apart */
+    run_test(queue, q_name, NUM_BUFS / 2);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    errval_t err;
+
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    srand(time(NULL));
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+    run_test((struct cleanq *)lbq, "loopback", NUM_BUFS);
+
+    struct cleanq_debugq *dbgq;
+    err = cleanq_debugq_create(&dbgq, (struct cleanq *)lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating debug queue failed %d\n", err);
+    }
+    run_test((struct cleanq *)dbgq, "debug_loopback", NUM_BUFS);
+
+    run_echo_test("ffq", false);
+    run_echo_test("ipcq", true);
+
+    printf("batch test passed\n");
+
+    return 0;
+}
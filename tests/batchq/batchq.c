@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+#include <cleanq/backends/batch_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/thread_queue.h>
+
+#define TEST_NAME "batchq"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 512
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define BATCH 8
+#define RX_BATCH 4
+
+///< long enough not to expire while the basic test runs
+#define FLUSH_US 20000
+
+#define MAX_BATCH 24
+
+#define NUM_ROUNDS 200000
+
+///< the test fails if a buffer is kept back and nothing arrives for this long
+#define HANG_TIMEOUT_S 60
+
+static struct capref memory;
+static regionid_t regid;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void fill_buf(struct cleanq_buf *b, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = (seq % NUM_BUFS) * BUF_SIZE;
+    b->length = BUF_SIZE;
+    b->valid_data = 0;
+    b->valid_length = (seq % BUF_SIZE) + 1;
+    b->flags = seq;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, uint64_t seq)
+{
+    if (b->rid != regid || b->offset != (seq % NUM_BUFS) * BUF_SIZE || b->length != BUF_SIZE
+        || b->valid_length != (seq % BUF_SIZE) + 1
+        || (b->flags & ~CLEANQ_FLAG_LAST) != seq) {
+        FAIL("expected buffer %lu, got flags=%lx offset=%lu\n", seq, b->flags, b->offset);
+    }
+}
+
+
+static errval_t send_buf(struct cleanq *queue, uint64_t seq)
+{
+    struct cleanq_buf b;
+    fill_buf(&b, seq);
+    return cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data, b.valid_length,
+                          b.flags);
+}
+
+
+static errval_t recv_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    return cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                          &b->valid_length, &b->flags);
+}
+
+
+static uint64_t lower_enqueues(struct cleanq *lower)
+{
+    uint64_t num;
+    errval_t err = cleanq_control(lower, CLEANQ_CTRL_STATS, CLEANQ_STAT_ENQUEUES, &num);
+    if (err_is_fail(err)) {
+        FAIL("reading the statistics of the queue below failed %d\n", err);
+    }
+
+    return num;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Buffers are kept back until the batch is complete, the queue is notified or flushed, or the
+ * oldest one has been kept back for longer than the deadline.
+ */
+static void test_keep_back(struct cleanq *tx, struct cleanq *lower, struct cleanq *rx)
+{
+    errval_t err;
+    struct cleanq_buf b;
+    uint64_t seq = 0;
+
+    err = cleanq_enqueue(tx, regid + 1, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue into an unknown region returned %d\n", err);
+    }
+
+    uint64_t before = lower_enqueues(lower);
+    for (int i = 0; i < BATCH - 1; i++) {
+        err = send_buf(tx, seq++);
+        if (err_is_fail(err)) {
+            FAIL("enqueue %d returned %d\n", i, err);
+        }
+    }
+    if (lower_enqueues(lower) != before || recv_buf(rx, &b) != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("an incomplete batch has been sent\n");
+    }
+    err = send_buf(tx, seq++);
+    if (err_is_fail(err) || lower_enqueues(lower) != before + BATCH) {
+        FAIL("a complete batch has not been sent, err=%d\n", err);
+    }
+    for (uint64_t i = 0; i < seq; i++) {
+        err = recv_buf(rx, &b);
+        if (err_is_fail(err)) {
+            FAIL("dequeue of buffer %lu of the batch returned %d\n", i, err);
+        }
+        check_buf(&b, i);
+    }
+
+    /* a notification sends the buffers kept back */
+    send_buf(tx, seq);
+    if (recv_buf(rx, &b) != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("a single buffer has not been kept back\n");
+    }
+    err = cleanq_notify(tx);
+    if (err_is_fail(err) || err_is_fail(recv_buf(rx, &b))) {
+        FAIL("a notification did not send the buffer kept back, err=%d\n", err);
+    }
+    check_buf(&b, seq++);
+
+    /* so does a flush, without a notification */
+    send_buf(tx, seq);
+    err = cleanq_batchq_flush((struct cleanq_batchq *)tx);
+    if (err_is_fail(err) || err_is_fail(recv_buf(rx, &b))) {
+        FAIL("a flush did not send the buffer kept back, err=%d\n", err);
+    }
+    check_buf(&b, seq++);
+
+    /* the deadline is checked by the calls of the batch queue */
+    send_buf(tx, seq);
+    usleep(FLUSH_US + 5000);
+    if (recv_buf(rx, &b) != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("the buffer kept back has been sent without a call of the batch queue\n");
+    }
+    err = recv_buf(tx, &b);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue on the sending side returned %d\n", err);
+    }
+    err = recv_buf(rx, &b);
+    if (err_is_fail(err)) {
+        FAIL("the buffer kept back past the deadline has not been sent, err=%d\n", err);
+    }
+    check_buf(&b, seq++);
+}
+
+
+/*
+ * Batches of any size are split and merged into batches of the queue below, and handed out
+ * in order, also when dequeued in batches of other sizes.
+ */
+static void test_batches(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    /* smaller and larger than a batch, all of them fit into the ring below */
+    uint64_t seq = 0;
+    for (size_t num = 1; num <= BATCH + 2; num++) {
+        for (size_t i = 0; i < num; i++) {
+            fill_buf(&bufs[i], seq + i);
+        }
+        size_t num_enq;
+        err = cleanq_enqueue_batch(tx, bufs, num, &num_enq);
+        if (err_is_fail(err) || num_enq != num) {
+            FAIL("a batch of %zu returned %d with %zu\n", num, err, num_enq);
+        }
+        seq += num;
+    }
+    cleanq_notify(tx);
+
+    uint64_t got = 0;
+    while (got < seq) {
+        size_t num_deq;
+        err = cleanq_dequeue_batch(rx, bufs, (got % MAX_BATCH) + 1, &num_deq);
+        if (err_is_fail(err)) {
+            FAIL("dequeue of a batch after %lu of %lu returned %d\n", got, seq, err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], got + i);
+        }
+        got += num_deq;
+    }
+
+    size_t num_deq;
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue of a batch from a drained queue returned %d\n", err);
+    }
+}
+
+
+/*
+ * A chain arrives whole, also if it is split between the buffers dequeued from the queue below
+ * already and those still in there.
+ */
+static void test_chains(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+    struct cleanq_buf chain[6];
+    struct cleanq_buf bufs[8];
+    size_t num_deq;
+
+    for (uint64_t i = 0; i < 6; i++) {
+        fill_buf(&chain[i], i + 1);
+    }
+
+    /* a buffer before the chain makes the dequeue take a part of the chain with it */
+    send_buf(tx, 0);
+    err = cleanq_enqueue_chain(tx, chain, 6);
+    if (err_is_fail(err)) {
+        FAIL("sending a chain returned %d\n", err);
+    }
+    cleanq_notify(tx);
+
+    struct cleanq_buf b;
+    err = recv_buf(rx, &b);
+    if (err_is_fail(err)) {
+        FAIL("dequeue before the chain returned %d\n", err);
+    }
+    check_buf(&b, 0);
+
+    err = cleanq_dequeue_chain(rx, bufs, 3, &num_deq);
+    if (err != CLEANQ_ERR_CHAIN_TOO_LONG || num_deq != 6) {
+        FAIL("receiving a split chain into a short array returned %d with %zu\n", err, num_deq);
+    }
+    err = cleanq_dequeue_chain(rx, bufs, 8, &num_deq);
+    if (err_is_fail(err) || num_deq != 6 || !(bufs[5].flags & CLEANQ_FLAG_LAST)) {
+        FAIL("receiving a split chain returned %d with %zu\n", err, num_deq);
+    }
+    for (uint64_t i = 0; i < 6; i++) {
+        check_buf(&bufs[i], i + 1);
+    }
+}
+
+
+/*
+ * Regions registered on the other side are known to both batch queues.
+ */
+static void test_regions(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+
+    struct capref cap;
+    cap.vaddr = malloc(MEMORY_SIZE);
+    cap.paddr = (uint64_t)cap.vaddr;
+    cap.len = MEMORY_SIZE;
+
+    regionid_t rid;
+    err = cleanq_register(rx, cap, &rid);
+    if (err_is_fail(err)) {
+        FAIL("registering on the receiving side failed %d\n", err);
+    }
+    err = cleanq_enqueue(rx, rid, BUF_SIZE, BUF_SIZE, 0, BUF_SIZE, 77);
+    if (err_is_fail(err) || err_is_fail(cleanq_notify(rx))) {
+        FAIL("enqueue into the new region returned %d\n", err);
+    }
+
+    struct cleanq_buf b;
+    err = recv_buf(tx, &b);
+    if (err_is_fail(err) || b.rid != rid || b.offset != BUF_SIZE || b.flags != 77) {
+        FAIL("the buffer of the new region returned %d with region %u\n", err, b.rid);
+    }
+
+    err = cleanq_deregister(rx, rid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering the new region failed %d\n", err);
+    }
+    free(cap.vaddr);
+}
+
+
+/*
+ * Sends buffers one by one and in batches of random size to the echo side, which sends them
+ * back through a batch queue too. Buffers kept back on either side only get going by the
+ * deadline then.
+ */
+static void test_echo(struct cleanq *queue)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_BATCH];
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+
+    alarm(HANG_TIMEOUT_S);
+    while (num_rx < NUM_ROUNDS) {
+        /* at most half of the buffers are in flight, their offsets stay distinct */
+        if (num_tx < NUM_ROUNDS && num_tx - num_rx < NUM_BUFS / 2) {
+            size_t num = (rand() % MAX_BATCH) + 1;
+            if (num > NUM_ROUNDS - num_tx) {
+                num = NUM_ROUNDS - num_tx;
+            }
+            size_t num_enq = 0;
+            if (num == 1) {
+                err = send_buf(queue, num_tx);
+                num_enq = err_is_ok(err) ? 1 : 0;
+            } else {
+                for (size_t i = 0; i < num; i++) {
+                    fill_buf(&bufs[i], num_tx + i);
+                }
+                err = cleanq_enqueue_batch(queue, bufs, num, &num_enq);
+            }
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            num_tx += num_enq;
+        }
+
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("receiving after %lu buffers returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx + i);
+        }
+        num_rx += num_deq;
+        alarm(HANG_TIMEOUT_S);
+    }
+    alarm(0);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static void echo(const char *name)
+{
+    errval_t err;
+    struct cleanq *lower;
+    err = cleanq_ipcq_create((struct cleanq_ipcq **)&lower, (char *)name, false);
+    if (err_is_fail(err)) {
+        FAIL("connecting to %s failed %d\n", name, err);
+    }
+
+    struct cleanq_batchq *bq;
+    err = cleanq_batchq_create(&bq, lower);
+    if (err_is_fail(err)) {
+        FAIL("creating the batch queue of the echo side failed %d\n", err);
+    }
+    struct cleanq *queue = (struct cleanq *)bq;
+
+    while (true) {
+        struct cleanq_buf b;
+        err = recv_buf(queue, &b);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+    }
+}
+
+
+static struct cleanq *create_batchq(struct cleanq *lower, size_t batch, uint64_t flush_us,
+                                    size_t rx_batch)
+{
+    struct cleanq_batchq_attr attr = { .batch = batch, .flush_us = flush_us,
+                                       .rx_batch = rx_batch };
+
+    struct cleanq_batchq *bq;
+    errval_t err = cleanq_batchq_create_with_attr(&bq, lower, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the batch queue failed %d\n", err);
+    }
+
+    return (struct cleanq *)bq;
+}
+
+
+/*
+ * Both batch queues are stacked on the ends of a thread queue, which is used by one thread.
+ */
+static void run_local_test(void)
+{
+    errval_t err;
+
+    struct cleanq_threadq *a, *b;
+    err = cleanq_threadq_create(&a, &b, 64);
+    if (err_is_fail(err)) {
+        FAIL("creating the thread queue failed %d\n", err);
+    }
+
+    struct cleanq *tx = create_batchq((struct cleanq *)a, BATCH, FLUSH_US, RX_BATCH);
+    struct cleanq *rx = create_batchq((struct cleanq *)b, BATCH, FLUSH_US, RX_BATCH);
+
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    printf("Starting keep back test\n");
+    test_keep_back(tx, (struct cleanq *)a, rx);
+
+    printf("Starting batches test\n");
+    test_batches(tx, rx);
+
+    printf("Starting chains test\n");
+    test_chains(tx, rx);
+
+    printf("Starting regions test\n");
+    test_regions(tx, rx);
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    cleanq_destroy((struct cleanq *)b);
+    cleanq_destroy((struct cleanq *)a);
+}
+
+
+static void run_echo_test(void)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-batchq-%d", getpid());
+
+    struct cleanq *lower;
+    err = cleanq_ipcq_create((struct cleanq_ipcq **)&lower, name, true);
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(name);
+    }
+
+    struct cleanq *queue = create_batchq(lower, 0, 0, 0);
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    printf("Starting echo test\n");
+    test_echo(queue);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    cleanq_destroy(queue);
+    cleanq_destroy(lower);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    srand(time(NULL));
+    test_watchdog("nothing arrived");
+
+    run_local_test();
+    run_echo_test();
+
+    printf("batchq test passed\n");
+
+    return 0;
+}
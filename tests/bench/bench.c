@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST_NAME "bench"
+#include "../common/test.h"
+
+
+///< where the top level build installs the benchmark, the first argument overrides it
+#define BENCH_PATH "../../build/bin/cleanq-bench"
+
+#define BACKENDS "loopback,threadq,ipcq,ipcq-compact,ffq,ffq-compact,virtq,debugq,batchq"
+#define NUM_BACKENDS 9
+
+#define ROUNDS 2000
+
+///< the number of columns of a CSV row
+#define NUM_COLUMNS 21
+
+#define MAX_OUTPUT (1 << 20)
+
+///< the test fails if the benchmark does not finish in this time
+#define HANG_TIMEOUT_S 120
+
+static const char *bench = BENCH_PATH;
+
+static char output[MAX_OUTPUT];
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+///< runs the benchmark with the arguments, the output goes to the buffer, returns the exit code
+static int run_bench(const char *args)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s %s 2>/dev/null", bench, args);
+
+    FILE *f = popen(cmd, "r");
+    if (f == NULL) {
+        FAIL("starting '%s' failed\n", cmd);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    size_t len = fread(output, 1, MAX_OUTPUT - 1, f);
+    output[len] = 0;
+    int status = pclose(f);
+    alarm(0);
+
+    if (!WIFEXITED(status)) {
+        FAIL("'%s' did not exit\n", cmd);
+    }
+
+    return WEXITSTATUS(status);
+}
+
+
+static size_t count(const char *s, const char *what)
+{
+    size_t n = 0;
+    for (s = strstr(s, what); s; s = strstr(s + 1, what)) {
+        n++;
+    }
+    return n;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Each backend runs the whole sweep, one CSV row per run in the sweep order, and the results
+ * are consistent: the percentiles are ordered, no more buffers are in flight than the ring
+ * holds and the debug queue finds no ownership violations.
+ */
+static void test_csv(void)
+{
+    static const size_t slots[] = { 16, 64 };
+    static const size_t batch[] = { 1, 8 };
+    static const size_t payload[] = { 8, 256 };
+
+    int ret = run_bench("-b " BACKENDS " -s 16,64 -B 1,8 -p 8,256 -r 2000 -f csv -y -l");
+    if (ret != 0) {
+        FAIL("the benchmark returned %d\n", ret);
+    }
+
+    char *save;
+    char *line = strtok_r(output, "\n", &save);
+    if (line == NULL || strncmp(line, "backend,slots,batch,payload,", 28) != 0
+        || count(line, ",") != NUM_COLUMNS - 1) {
+        FAIL("the CSV header is '%s'\n", line ? line : "");
+    }
+
+    char backends[] = BACKENDS;
+    char *bsave;
+    size_t rows = 0;
+    for (char *b = strtok_r(backends, ",", &bsave); b; b = strtok_r(NULL, ",", &bsave)) {
+        for (size_t i = 0; i < 8; i++, rows++) {
+            line = strtok_r(NULL, "\n", &save);
+            if (line == NULL) {
+                FAIL("got only %zu rows\n", rows);
+            }
+            if (count(line, ",") != NUM_COLUMNS - 1) {
+                FAIL("row %zu is '%s'\n", rows, line);
+            }
+
+            char backend[32];
+            size_t s, k, p, inflight, rounds;
+            double seconds, mops, mbps;
+            unsigned long rtt[4], enq[2], deq[2], full, empty, hwm, errors;
+            int n = sscanf(line,
+                           "%31[^,],%zu,%zu,%zu,%zu,%zu,%lf,%lf,%lf,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+                           "%lu,%lu,%lu,%lu,%lu",
+                           backend, &s, &k, &p, &inflight, &rounds, &seconds, &mops, &mbps,
+                           &rtt[0], &rtt[1], &rtt[2], &rtt[3], &enq[0], &enq[1], &deq[0],
+                           &deq[1], &full, &empty, &hwm, &errors);
+            if (n != NUM_COLUMNS) {
+                FAIL("row %zu is '%s'\n", rows, line);
+            }
+
+            if (strcmp(backend, b) != 0 || s != slots[i / 4] || k != batch[(i / 2) % 2]
+                || p != payload[i % 2] || rounds != ROUNDS) {
+                FAIL("row %zu is '%s', expected %s slots=%zu batch=%zu payload=%zu\n", rows, line,
+                     b, slots[i / 4], batch[(i / 2) % 2], payload[i % 2]);
+            }
+            if (seconds <= 0 || mops <= 0 || inflight == 0 || inflight > 64) {
+                FAIL("row %zu has no throughput '%s'\n", rows, line);
+            }
+            if (strcmp(b, "loopback") != 0 && inflight > s) {
+                FAIL("row %zu has %zu buffers in flight in %zu slots\n", rows, inflight, s);
+            }
+            if (rtt[0] > rtt[1] || rtt[1] > rtt[2] || rtt[2] > rtt[3] || enq[0] > enq[1]
+                || deq[0] > deq[1]) {
+                FAIL("row %zu has unordered percentiles '%s'\n", rows, line);
+            }
+            if (errors != 0) {
+                FAIL("row %zu has %lu ownership violations\n", rows, errors);
+            }
+        }
+    }
+
+    line = strtok_r(NULL, "\n", &save);
+    if (line != NULL) {
+        FAIL("got the extra row '%s'\n", line);
+    }
+}
+
+
+/*
+ * The JSON output is an array with one object per run.
+ */
+static void test_json(void)
+{
+    int ret = run_bench("-b " BACKENDS " -r 2000 -y");
+    if (ret != 0) {
+        FAIL("the benchmark returned %d\n", ret);
+    }
+
+    size_t len = strlen(output);
+    if (strncmp(output, "[\n", 2) != 0 || len < 3 || strcmp(output + len - 3, "\n]\n") != 0) {
+        FAIL("the JSON output is not an array\n");
+    }
+    if (count(output, "{\"backend\": ") != NUM_BACKENDS
+        || count(output, "},\n  {\"backend\": ") != NUM_BACKENDS - 1
+        || count(output, "\"debug_errors\": 0}") != NUM_BACKENDS) {
+        FAIL("the JSON output has no object per run\n%s", output);
+    }
+}
+
+
+/*
+ * Invalid arguments print the usage and fail without running anything, an unknown backend
+ * fails but does not stop the other runs.
+ */
+static void test_args(void)
+{
+    static const char *invalid[] = { "-s 0", "-s 16,x", "-B ''", "-p 1,,2", "-r 0",
+                                     "-f xml", "-P 3-1", "--unknown" };
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        int ret = run_bench(invalid[i]);
+        if (ret != EXIT_FAILURE || strlen(output) != 0) {
+            FAIL("'%s' returned %d\n", invalid[i], ret);
+        }
+    }
+
+    if (run_bench("-h") != EXIT_SUCCESS || strlen(output) != 0) {
+        FAIL("the usage failed\n");
+    }
+
+    int ret = run_bench("-b nosuchq,loopback -r 100 -f csv -y");
+    if (ret != EXIT_FAILURE || count(output, "\n") != 2 || count(output, "\nloopback,") != 1) {
+        FAIL("an unknown backend returned %d\n%s", ret, output);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        bench = argv[1];
+    }
+
+    test_watchdog("the benchmark hangs");
+
+    if (access(bench, X_OK) != 0) {
+        FAIL("%s does not exist, build the tools first\n", bench);
+    }
+
+    printf("Starting csv test\n");
+    test_csv();
+
+    printf("Starting json test\n");
+    test_json();
+
+    printf("Starting args test\n");
+    test_args();
+
+    printf("bench test passed\n");
+
+    return 0;
+}
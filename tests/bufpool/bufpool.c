@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/bufpool.h>
+#include <cleanq/backends/loopback_queue.h>
+
+#define TEST_NAME "bufpool"
+#include "../common/test.h"
+
+
+///< not a multiple of the alignment, the pool rounds it up
+#define BUF_SIZE 2000
+#define NUM_BUFS 128
+
+#define MEMORY_SIZE 2048 * NUM_BUFS
+
+#define NUM_THREADS 4
+
+#define MAX_BATCH 40
+
+#define NUM_ROUNDS 20000
+
+static struct capref memory;
+static regionid_t regid;
+
+static struct cleanq_bufpool *pool;
+static size_t num_bufs;
+
+///< the thread a buffer is allocated to, indexed by buffer
+static uint64_t owner[NUM_BUFS];
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static size_t buf_index(genoffset_t offset)
+{
+    size_t bufsize = cleanq_bufpool_get_bufsize(pool);
+    size_t idx = offset / bufsize;
+    if (offset % bufsize || idx >= num_bufs) {
+        FAIL("the pool handed out offset %lu\n", offset);
+    }
+
+    return idx;
+}
+
+
+/*
+ * Allocates all buffers of the pool, the number of buffers is returned.
+ */
+static size_t drain(genoffset_t *offsets, size_t max)
+{
+    size_t num = 0;
+    regionid_t rid;
+
+    while (num < max && err_is_ok(cleanq_bufpool_alloc(pool, &rid, &offsets[num]))) {
+        if (rid != regid) {
+            FAIL("the pool handed out a buffer of region %u\n", rid);
+        }
+        num++;
+    }
+
+    return num;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The region is carved into aligned buffers, every buffer is handed out once, the most recently
+ * freed one is reused first, and buffers of other regions or offsets are refused.
+ */
+static void test_basic(uint32_t flags)
+{
+    errval_t err;
+
+    struct capref small = memory;
+    small.len = 1024;
+    err = cleanq_bufpool_create(&pool, small, regid, BUF_SIZE, flags);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("a pool on a region without a single buffer returned %d\n", err);
+    }
+
+    err = cleanq_bufpool_create(&pool, memory, regid, BUF_SIZE, flags);
+    if (err_is_fail(err)) {
+        FAIL("creating the pool failed %d\n", err);
+    }
+
+    size_t bufsize = cleanq_bufpool_get_bufsize(pool);
+    if (bufsize < BUF_SIZE || bufsize % CLEANQ_BUFFER_ALIGNMENT) {
+        FAIL("the buffer size is %zu\n", bufsize);
+    }
+
+    genoffset_t offsets[NUM_BUFS + 1];
+    num_bufs = drain(offsets, NUM_BUFS + 1);
+    if (num_bufs != MEMORY_SIZE / bufsize) {
+        FAIL("the pool has %zu buffers instead of %zu\n", num_bufs, MEMORY_SIZE / bufsize);
+    }
+
+    bool seen[NUM_BUFS] = { false };
+    for (size_t i = 0; i < num_bufs; i++) {
+        size_t idx = buf_index(offsets[i]);
+        if (seen[idx]) {
+            FAIL("buffer %zu handed out twice\n", idx);
+        }
+        seen[idx] = true;
+
+        uint8_t *vaddr = cleanq_bufpool_get_vaddr(pool, offsets[i]);
+        if (vaddr != (uint8_t *)memory.vaddr + offsets[i]
+            || (uintptr_t)vaddr % CLEANQ_BUFFER_ALIGNMENT) {
+            FAIL("buffer %zu is at %p\n", idx, (void *)vaddr);
+        }
+    }
+
+    regionid_t rid;
+    genoffset_t offset;
+    err = cleanq_bufpool_alloc(pool, &rid, &offset);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("allocating from an empty pool returned %d\n", err);
+    }
+
+    err = cleanq_bufpool_free(pool, regid + 1, offsets[0]);
+    if (err != CLEANQ_ERR_INVALID_REGION_ID) {
+        FAIL("freeing a buffer of another region returned %d\n", err);
+    }
+    err = cleanq_bufpool_free(pool, regid, offsets[0] + 1);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("freeing an offset inside a buffer returned %d\n", err);
+    }
+    err = cleanq_bufpool_free(pool, regid, MEMORY_SIZE);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("freeing an offset behind the region returned %d\n", err);
+    }
+
+    for (size_t i = 0; i < num_bufs; i++) {
+        err = cleanq_bufpool_free(pool, regid, offsets[i]);
+        if (err_is_fail(err)) {
+            FAIL("freeing buffer %zu returned %d\n", i, err);
+        }
+    }
+
+    if (flags == 0) {
+        if (err_is_fail(cleanq_bufpool_alloc(pool, &rid, &offset))
+            || offset != offsets[num_bufs - 1]) {
+            FAIL("the most recently freed buffer was not reused first\n");
+        }
+        cleanq_bufpool_free(pool, regid, offset);
+    }
+}
+
+
+/*
+ * Allocates batches of random size and claims the buffers, a buffer that is handed out twice
+ * is already claimed by another thread. The data written into a buffer must be intact when it
+ * is freed.
+ */
+static void *thread_randomized(void *arg)
+{
+    uint64_t me = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + me;
+
+    genoffset_t offsets[MAX_BATCH];
+
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        size_t num = (rand_r(&seed) % MAX_BATCH) + 1;
+        size_t got = 0;
+        regionid_t rid;
+
+        while (got < num && err_is_ok(cleanq_bufpool_alloc(pool, &rid, &offsets[got]))) {
+            if (rid != regid) {
+                FAIL("thread %lu got a buffer of region %u\n", me, rid);
+            }
+            size_t idx = buf_index(offsets[got]);
+            uint64_t other = __atomic_exchange_n(&owner[idx], me, __ATOMIC_ACQUIRE);
+            if (other) {
+                FAIL("buffer %zu handed out to thread %lu and %lu\n", idx, other, me);
+            }
+            memset(cleanq_bufpool_get_vaddr(pool, offsets[got]), (int)me, 64);
+            got++;
+        }
+
+        for (size_t j = 0; j < got; j++) {
+            size_t idx = buf_index(offsets[j]);
+            uint8_t *data = cleanq_bufpool_get_vaddr(pool, offsets[j]);
+            for (int k = 0; k < 64; k++) {
+                if (data[k] != (uint8_t)me) {
+                    FAIL("buffer %zu of thread %lu was written by %u\n", idx, me, data[k]);
+                }
+            }
+
+            __atomic_store_n(&owner[idx], 0, __ATOMIC_RELEASE);
+            errval_t err = cleanq_bufpool_free(pool, regid, offsets[j]);
+            if (err_is_fail(err)) {
+                FAIL("thread %lu freeing buffer %zu returned %d\n", me, idx, err);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static void test_threads(void)
+{
+    pthread_t threads[NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_randomized, (void *)(i + 1))) {
+            FAIL("creating thread %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* no buffer got lost, also not in the caches of the cores */
+    genoffset_t offsets[NUM_BUFS + 1];
+    size_t num = drain(offsets, NUM_BUFS + 1);
+    if (num != num_bufs) {
+        FAIL("%zu of %zu buffers are left after the threads\n", num, num_bufs);
+    }
+    for (size_t i = 0; i < num; i++) {
+        cleanq_bufpool_free(pool, regid, offsets[i]);
+    }
+}
+
+
+/*
+ * The buffers of the pool go through a queue and back into the pool.
+ */
+static void test_queue(struct cleanq *queue)
+{
+    errval_t err;
+
+    for (int i = 0; i < 1000; i++) {
+        genoffset_t offsets[MAX_BATCH];
+        size_t num = drain(offsets, (rand() % MAX_BATCH) + 1);
+
+        size_t bufsize = cleanq_bufpool_get_bufsize(pool);
+        for (size_t j = 0; j < num; j++) {
+            err = cleanq_enqueue(queue, regid, offsets[j], bufsize, 0, bufsize, j);
+            if (err_is_fail(err)) {
+                FAIL("enqueue of a pool buffer returned %d\n", err);
+            }
+        }
+
+        for (size_t j = 0; j < num; j++) {
+            struct cleanq_buf b;
+            err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags);
+            if (err_is_fail(err) || b.offset != offsets[j]) {
+                FAIL("dequeue returned %d with offset %lu\n", err, b.offset);
+            }
+            err = cleanq_bufpool_free(pool, b.rid, b.offset);
+            if (err_is_fail(err)) {
+                FAIL("freeing a dequeued buffer returned %d\n", err);
+            }
+        }
+    }
+}
+
+
+static void run_test(struct cleanq *queue, const char *p_name, uint32_t flags)
+{
+    printf("Starting basic test %s\n", p_name);
+    test_basic(flags);
+
+    printf("Starting threaded test %s\n", p_name);
+    test_threads();
+
+    printf("Starting queue test %s\n", p_name);
+    test_queue(queue);
+
+    errval_t err = cleanq_bufpool_destroy(pool);
+    if (err_is_fail(err)) {
+        FAIL("destroying the pool failed %d\n", err);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    errval_t err;
+
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+
+    memory.vaddr = aligned_alloc(CLEANQ_BUFFER_ALIGNMENT, MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+
+    err = cleanq_register((struct cleanq *)lbq, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    run_test((struct cleanq *)lbq, "shared", 0);
+    run_test((struct cleanq *)lbq, "percpu", CLEANQ_BUFPOOL_FLAG_PERCPU);
+
+    printf("bufpool test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/debug_queue.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+
+#define TEST_NAME "chain"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< the longest chain sent, a few fit into the ring
+#define MAX_CHAIN 8
+
+///< more segments than fit into any ring
+#define TOO_LONG 1024
+
+///< the number of chains sent in one burst at most, the sender stops at a full queue
+#define MAX_BURST 40
+
+#define NUM_ROUNDS 2000
+
+#define NUM_THREADS 2
+
+///< the number of chains every producer thread sends
+#define NUM_CHAINS 20000
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the endpoints of the threaded test
+static struct cleanq *tx_que;
+static struct cleanq *rx_que;
+
+///< the number of chains received by all consumers
+static uint64_t num_rx;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+/*
+ * The segments of a chain carry its sequence number and their index in the flags, the length of
+ * the chain is in valid_length. Compact queues have 32-bit flags.
+ */
+static void fill_chain(struct cleanq_buf *bufs, size_t num, uint64_t seq)
+{
+    for (size_t i = 0; i < num; i++) {
+        bufs[i].rid = regid;
+        bufs[i].offset = ((seq * MAX_CHAIN + i) % NUM_BUFS) * BUF_SIZE;
+        bufs[i].length = BUF_SIZE;
+        bufs[i].valid_data = i;
+        bufs[i].valid_length = num;
+        bufs[i].flags = ((seq << 4) | i) & 0x3fffffff;
+    }
+}
+
+
+static void check_chain(const struct cleanq_buf *bufs, size_t num, uint64_t seq)
+{
+    for (size_t i = 0; i < num; i++) {
+        if (bufs[i].rid != regid || bufs[i].offset != ((seq * MAX_CHAIN + i) % NUM_BUFS) * BUF_SIZE
+            || bufs[i].valid_data != i || bufs[i].valid_length != num
+            || (bufs[i].flags & ~CLEANQ_FLAG_LAST) != (((seq << 4) | i) & 0x3fffffff)) {
+            FAIL("segment %zu of chain %lu is corrupted, offset=%lu flags=%lx\n", i, seq,
+                 bufs[i].offset, bufs[i].flags);
+        }
+        if (!!(bufs[i].flags & CLEANQ_FLAG_LAST) != (i == num - 1)) {
+            FAIL("segment %zu of %zu of chain %lu has flags %lx\n", i, num, seq, bufs[i].flags);
+        }
+    }
+}
+
+
+static struct cleanq *create_queue(const char *name, bool ipc, bool clear, bool compact,
+                                   bool multi)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    if (ipc) {
+        struct cleanq_ipcq_attr attr = { 0 };
+        attr.compact = compact;
+        attr.multi_producer = multi;
+        attr.multi_consumer = multi;
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, (char *)name, clear,
+                                           &attr);
+    } else {
+        struct cleanq_ffq_attr attr = { 0 };
+        attr.compact = compact;
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&queue, name, clear, &attr);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    return queue;
+}
+
+
+/*
+ * Receives the next chain, with cleanq_dequeue_chain() or segment by segment.
+ */
+static void recv_chain(struct cleanq *queue, size_t num, uint64_t seq)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_CHAIN];
+    size_t num_deq = 0;
+
+    switch (rand() % 3) {
+    case 0:
+        err = cleanq_dequeue_chain(queue, bufs, MAX_CHAIN, &num_deq);
+        break;
+    case 1:
+        for (num_deq = 0; num_deq < num; num_deq++) {
+            struct cleanq_buf *b = &bufs[num_deq];
+            err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                 &b->valid_length, &b->flags);
+            if (err_is_fail(err)) {
+                break;
+            }
+        }
+        break;
+    default:
+        /* the batch may end before the end of the chain */
+        err = cleanq_dequeue_batch(queue, bufs, num, &num_deq);
+        while (err_is_ok(err) && num_deq < num) {
+            size_t more;
+            err = cleanq_dequeue_batch(queue, bufs + num_deq, num - num_deq, &more);
+            num_deq += more;
+        }
+        break;
+    }
+
+    if (err_is_fail(err) || num_deq != num) {
+        FAIL("receiving chain %lu returned %d with %zu of %zu segments\n", seq, err, num_deq, num);
+    }
+    check_chain(bufs, num, seq);
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The last flag is set on the last segment only, whatever the caller passed. A chain that does
+ * not fit into the array stays in the queue, an invalid or too long chain is refused whole, and
+ * plain buffers end at the last one received.
+ */
+static void test_basic(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_CHAIN];
+    size_t num_deq;
+
+    err = cleanq_dequeue_chain(rx, bufs, MAX_CHAIN, &num_deq);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("receiving a chain from an empty queue returned %d\n", err);
+    }
+
+    struct cleanq_buf chain[3];
+    fill_chain(chain, 3, 1);
+    chain[0].flags |= CLEANQ_FLAG_LAST;
+    err = cleanq_enqueue_chain(tx, chain, 3);
+    if (err_is_fail(err)) {
+        FAIL("sending a chain returned %d\n", err);
+    }
+    if ((chain[0].flags & CLEANQ_FLAG_LAST) || !(chain[2].flags & CLEANQ_FLAG_LAST)) {
+        FAIL("the last flag has not been fixed up in the chain\n");
+    }
+
+    err = cleanq_dequeue_chain(rx, bufs, 2, &num_deq);
+    if (err != CLEANQ_ERR_CHAIN_TOO_LONG || num_deq != 3) {
+        FAIL("receiving a chain into a short array returned %d with %zu\n", err, num_deq);
+    }
+    err = cleanq_dequeue_chain(rx, bufs, MAX_CHAIN, &num_deq);
+    if (err_is_fail(err) || num_deq != 3) {
+        FAIL("receiving the chain returned %d with %zu segments\n", err, num_deq);
+    }
+    check_chain(bufs, 3, 1);
+
+    /* one plain buffer and a chain make up a single chain */
+    err = cleanq_enqueue(tx, regid, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err_is_fail(err)) {
+        FAIL("sending a buffer returned %d\n", err);
+    }
+    err = cleanq_enqueue_chain(tx, chain, 2);
+    if (err_is_fail(err)) {
+        FAIL("sending a chain returned %d\n", err);
+    }
+    err = cleanq_dequeue_chain(rx, bufs, MAX_CHAIN, &num_deq);
+    if (err_is_fail(err) || num_deq != 3 || !(bufs[2].flags & CLEANQ_FLAG_LAST)) {
+        FAIL("a buffer before a chain returned %d with %zu segments\n", err, num_deq);
+    }
+
+    /* without a last flag the chain ends at the last buffer received so far */
+    for (genoffset_t i = 0; i < 2; i++) {
+        err = cleanq_enqueue(tx, regid, i * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE, 0);
+        if (err_is_fail(err)) {
+            FAIL("sending a buffer returned %d\n", err);
+        }
+    }
+    err = cleanq_dequeue_chain(rx, bufs, MAX_CHAIN, &num_deq);
+    if (err_is_fail(err) || num_deq != 2) {
+        FAIL("plain buffers returned %d with %zu segments\n", err, num_deq);
+    }
+
+    chain[1].rid = regid + 1;
+    err = cleanq_enqueue_chain(tx, chain, 3);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("sending a chain with an invalid segment returned %d\n", err);
+    }
+    chain[1].rid = regid;
+
+    static struct cleanq_buf too_long[TOO_LONG];
+    for (size_t i = 0; i < TOO_LONG; i++) {
+        too_long[i] = chain[0];
+    }
+    err = cleanq_enqueue_chain(tx, too_long, TOO_LONG);
+    if (err_is_ok(err)) {
+        FAIL("a chain longer than the ring has been sent\n");
+    }
+
+    /* a full queue takes the entire chain or nothing */
+    uint64_t num_chains = 0;
+    while (err_is_ok(err = cleanq_enqueue_chain(tx, chain, 3))) {
+        num_chains++;
+    }
+    if (err != CLEANQ_ERR_QUEUE_FULL || num_chains == 0) {
+        FAIL("filling the queue with chains returned %d after %lu\n", err, num_chains);
+    }
+    for (uint64_t i = 0; i < num_chains; i++) {
+        recv_chain(rx, 3, 1);
+    }
+    err = cleanq_dequeue_chain(rx, bufs, MAX_CHAIN, &num_deq);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("a queue full of chains had more segments, err=%d\n", err);
+    }
+}
+
+
+/*
+ * Sends bursts of chains of random length until the queue is full and receives them in order.
+ */
+static void test_randomized(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+    size_t lengths[MAX_BURST];
+    uint64_t seq = 0;
+
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        size_t burst = (rand() % MAX_BURST) + 1;
+        size_t num = 0;
+
+        while (num < burst) {
+            struct cleanq_buf chain[MAX_CHAIN];
+            lengths[num] = (rand() % MAX_CHAIN) + 1;
+            fill_chain(chain, lengths[num], seq + num);
+
+            err = cleanq_enqueue_chain(tx, chain, lengths[num]);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                break;
+            }
+            if (err_is_fail(err)) {
+                FAIL("sending chain %lu returned %d\n", seq + num, err);
+            }
+            num++;
+        }
+
+        for (size_t j = 0; j < num; j++) {
+            recv_chain(rx, lengths[j], seq + j);
+        }
+        seq += num;
+    }
+}
+
+
+/*
+ * Producers send chains of random length, the consumers must never see a chain interleaved
+ * with another one or torn apart. The chains of one producer arrive in order.
+ */
+static void *producer_thread(void *arg)
+{
+    uint64_t producer = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + producer;
+
+    for (uint64_t seq = 0; seq < NUM_CHAINS; seq++) {
+        struct cleanq_buf chain[MAX_CHAIN];
+        size_t num = (rand_r(&seed) % MAX_CHAIN) + 1;
+        fill_chain(chain, num, seq * NUM_THREADS + producer);
+
+        errval_t err;
+        while ((err = cleanq_enqueue_chain(tx_que, chain, num)) == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("producer %lu sending chain %lu returned %d\n", producer, seq, err);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *consumer_thread(void *arg)
+{
+    uint64_t consumer = (uintptr_t)arg;
+    int64_t last[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        last[i] = -1;
+    }
+
+    struct cleanq_buf bufs[MAX_CHAIN];
+    while (__atomic_load_n(&num_rx, __ATOMIC_RELAXED) < NUM_THREADS * NUM_CHAINS) {
+        size_t num_deq;
+        errval_t err = cleanq_dequeue_chain(rx_que, bufs, MAX_CHAIN, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || num_deq == 0) {
+            FAIL("consumer %lu receiving returned %d with %zu segments\n", consumer, err,
+                 num_deq);
+        }
+
+        int64_t seq = (bufs[0].flags & ~CLEANQ_FLAG_LAST) >> 4;
+        uint64_t producer = seq % NUM_THREADS;
+        if (seq <= last[producer]) {
+            FAIL("consumer %lu got chain %ld after %ld\n", consumer, seq, last[producer]);
+        }
+        check_chain(bufs, num_deq, seq);
+        last[producer] = seq;
+
+        __atomic_fetch_add(&num_rx, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+static void test_threads(void)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-chain-mpmc-%d", getpid());
+
+    tx_que = create_queue(name, true, true, false, true);
+    rx_que = create_queue(name, true, false, false, true);
+
+    err = cleanq_register(tx_que, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    pthread_t threads[2 * NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, producer_thread, (void *)i)
+            || pthread_create(&threads[NUM_THREADS + i], NULL, consumer_thread, (void *)i)) {
+            FAIL("creating thread %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; i < 2 * NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (num_rx != NUM_THREADS * NUM_CHAINS) {
+        FAIL("received %lu chains instead of %d\n", num_rx, NUM_THREADS * NUM_CHAINS);
+    }
+
+    cleanq_destroy(rx_que);
+    cleanq_destroy(tx_que);
+}
+
+
+static void run_test(const char *q_name, struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed using q: %s\n", q_name);
+    }
+
+    printf("Starting basic test %s\n", q_name);
+    test_basic(tx, rx);
+
+    printf("Starting randomized test %s\n", q_name);
+    test_randomized(tx, rx);
+}
+
+
+static void run_shm_test(const char *q_name, bool ipc, bool compact)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-chain-%s-%d", q_name, getpid());
+
+    struct cleanq *tx = create_queue(name, ipc, true, compact, false);
+    struct cleanq *rx = create_queue(name, ipc, false, compact, false);
+
+    run_test(q_name, tx, rx);
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+}
+
+
+int main(int argc, char *argv[])
+{
+    errval_t err;
+
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    srand(time(NULL));
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+    run_test("loopback", (struct cleanq *)lbq, (struct cleanq *)lbq);
+
+    /* the debug queue tracks single buffers and does not pass chains on */
+    struct cleanq_debugq *dbgq;
+    err = cleanq_debugq_create(&dbgq, (struct cleanq *)lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating debug queue failed %d\n", err);
+    }
+    struct cleanq_buf chain[2];
+    fill_chain(chain, 2, 0);
+    err = cleanq_enqueue_chain((struct cleanq *)dbgq, chain, 2);
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("sending a chain on the debug queue returned %d\n", err);
+    }
+    cleanq_destroy((struct cleanq *)dbgq);
+
+    run_shm_test("ffq", false, false);
+    run_shm_test("ffq-compact", false, true);
+    run_shm_test("ipcq", true, false);
+    run_shm_test("ipcq-compact", true, true);
+
+    printf("Starting threaded test\n");
+    test_threads();
+
+    printf("chain test passed\n");
+
+    return 0;
+}
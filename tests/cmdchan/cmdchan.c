@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "cmdchan"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+///< the number of regions that are registered at the same time at most
+#define NUM_REGIONS 8
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 50000
+
+///< the echo test registers many more regions than the command channel holds
+#define MIN_REGISTRATIONS 256
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+///< the regions known on the receiving side, as told by the callbacks
+static regionid_t known[NUM_REGIONS];
+static size_t num_known;
+
+///< the number of buffers the receiving side had dequeued when the last region arrived
+static uint64_t num_rx_at_register;
+static uint64_t num_rx;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static struct capref alloc_region(void)
+{
+    struct capref cap = { .vaddr = malloc(MEMORY_SIZE), .paddr = 0, .len = MEMORY_SIZE };
+    cap.paddr = (uint64_t)cap.vaddr;
+    return cap;
+}
+
+
+static bool is_known(regionid_t rid)
+{
+    for (size_t i = 0; i < num_known; i++) {
+        if (known[i] == rid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static errval_t register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+    (void)cap;
+
+    if (num_known == NUM_REGIONS || is_known(region_id)) {
+        FAIL("region %u arrived while %zu regions are known\n", region_id, num_known);
+    }
+    known[num_known++] = region_id;
+    num_rx_at_register = num_rx;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static errval_t deregister_cb(struct cleanq *q, regionid_t region_id)
+{
+    (void)q;
+
+    for (size_t i = 0; i < num_known; i++) {
+        if (known[i] == region_id) {
+            known[i] = known[--num_known];
+            return CLEANQ_ERR_OK;
+        }
+    }
+    FAIL("the unknown region %u has been deregistered\n", region_id);
+}
+
+
+static errval_t send_buf(struct cleanq *queue, regionid_t rid, uint64_t seq, uint64_t flags)
+{
+    return cleanq_enqueue(queue, rid, (seq % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE, flags);
+}
+
+
+///< dequeues a buffer and checks that its region is known at that point
+static errval_t recv_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                  &b->valid_length, &b->flags);
+    if (err_is_ok(err)) {
+        if (!is_known(b->rid)) {
+            FAIL("buffer %lu of region %u arrived before its region\n", num_rx, b->rid);
+        }
+        num_rx++;
+    }
+    return err;
+}
+
+
+static void expect_buf(struct cleanq *queue, regionid_t rid, uint64_t flags)
+{
+    struct cleanq_buf b;
+    errval_t err = recv_buf(queue, &b);
+    if (err_is_fail(err) || b.rid != rid || b.flags != flags) {
+        FAIL("expected buffer %lx of region %u, got %lx of %u err=%d\n", flags, rid, b.flags,
+             b.rid, err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Regions are registered and deregistered while the descriptor ring is full, and the other side
+ * learns about them before it gets the buffers that were sent afterwards.
+ */
+static void test_full_ring(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = test_create_queue(name, ffq, true, NUM_SLOTS);
+    struct cleanq *rx = test_create_queue(name, ffq, false, NUM_SLOTS);
+    cleanq_set_register_callback(rx, register_cb);
+    cleanq_set_deregister_callback(rx, deregister_cb);
+    num_known = 0;
+    num_rx = 0;
+
+    struct capref first = alloc_region();
+    struct capref second = alloc_region();
+    regionid_t first_rid, second_rid;
+    err = cleanq_register(tx, first, &first_rid);
+    if (err_is_fail(err)) {
+        FAIL("registering the first region failed %d\n", err);
+    }
+
+    uint64_t seq = 0;
+    while ((err = send_buf(tx, first_rid, seq, seq)) == CLEANQ_ERR_OK) {
+        seq++;
+    }
+    if (err != CLEANQ_ERR_QUEUE_FULL || seq < NUM_SLOTS) {
+        FAIL("filling the ring returned %d after %lu buffers\n", err, seq);
+    }
+    uint64_t num_ring = seq;
+
+    /* the registration doesn't need a slot of the full ring */
+    err = cleanq_register(tx, second, &second_rid);
+    if (err_is_fail(err)) {
+        FAIL("registering a region into a full ring returned %d\n", err);
+    }
+
+    /* the first dequeue handles the command, the region is known before its buffer */
+    expect_buf(rx, first_rid, 0);
+    if (!is_known(second_rid) || num_rx_at_register != 0) {
+        FAIL("the region registered into a full ring is not known after the first dequeue\n");
+    }
+    err = send_buf(tx, second_rid, seq, seq);
+    if (err_is_fail(err)) {
+        FAIL("sending a buffer of the second region returned %d\n", err);
+    }
+    seq++;
+    for (uint64_t i = 1; i < num_ring; i++) {
+        expect_buf(rx, first_rid, i);
+    }
+    expect_buf(rx, second_rid, num_ring);
+
+    /* the ring fills up with buffers of the second region, the first one goes away */
+    while (send_buf(tx, second_rid, seq, seq) == CLEANQ_ERR_OK) {
+        seq++;
+    }
+    struct capref cap;
+    err = cleanq_deregister(tx, first_rid, &cap);
+    if (err_is_fail(err) || cap.vaddr != first.vaddr) {
+        FAIL("deregistering a region while the ring is full failed %d\n", err);
+    }
+    for (uint64_t i = num_ring + 1; i < seq; i++) {
+        expect_buf(rx, second_rid, i);
+        if (is_known(first_rid)) {
+            FAIL("the deregistered region is still known after a dequeue\n");
+        }
+    }
+
+    /* the other side's acknowledgements don't take slots either */
+    err = cleanq_register(rx, first, &first_rid);
+    if (err_is_fail(err)) {
+        FAIL("registering a region on the other side failed %d\n", err);
+    }
+
+    struct cleanq_buf b;
+    err = recv_buf(rx, &b);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue from a drained ring returned %d\n", err);
+    }
+    err = cleanq_dequeue(tx, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                         &b.flags);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("the commands of the other side show up as buffers, err=%d\n", err);
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    free(first.vaddr);
+    free(second.vaddr);
+}
+
+
+/*
+ * The buffer flags travel unchanged, also those that look like the former command words.
+ */
+static void test_flags(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = test_create_queue(name, ffq, true, NUM_SLOTS);
+    struct cleanq *rx = test_create_queue(name, ffq, false, NUM_SLOTS);
+    cleanq_set_register_callback(rx, register_cb);
+    cleanq_set_deregister_callback(rx, deregister_cb);
+    num_known = 0;
+    num_rx = 0;
+
+    struct capref memory = alloc_region();
+    regionid_t rid;
+    err = cleanq_register(tx, memory, &rid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t flags[] = { 0, 1, 2, 3, 4, 0xff, 1UL << 31, 1UL << 32, 1UL << 63, ~0UL, ~1UL };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        err = send_buf(tx, rid, i, flags[i]);
+        if (err_is_fail(err)) {
+            FAIL("sending flags %lx returned %d\n", flags[i], err);
+        }
+        expect_buf(rx, rid, flags[i]);
+    }
+    for (size_t i = 0; i < 1000; i++) {
+        uint64_t f = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ (uint64_t)rand();
+        err = send_buf(tx, rid, i, f);
+        if (err_is_fail(err)) {
+            FAIL("sending flags %lx returned %d\n", f, err);
+        }
+        expect_buf(rx, rid, f);
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    free(memory.vaddr);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Answers every buffer, each of them belongs to a region it has been told about.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, false, NUM_SLOTS);
+    cleanq_set_register_callback(queue, register_cb);
+    cleanq_set_deregister_callback(queue, deregister_cb);
+    num_known = 0;
+    num_rx = 0;
+
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf b;
+        uint64_t seq = num_rx;
+        err = recv_buf(queue, &b);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || (b.flags & 0xffffffff) != seq) {
+            FAIL("the echo side expected buffer %lu, got %lx err=%d\n", seq, b.flags, err);
+        }
+
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * Regions come and go at random while their buffers travel to the echo process and back. A
+ * region is only deregistered once all its buffers are back.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    struct capref caps[NUM_REGIONS];
+    regionid_t rids[NUM_REGIONS];
+    bool alive[NUM_REGIONS];
+    size_t outstanding[NUM_REGIONS];
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        caps[i] = alloc_region();
+        alive[i] = false;
+        outstanding[i] = 0;
+    }
+
+    /* at most NUM_SLOTS buffers are in flight, the echo side never waits for the ring */
+    uint64_t num_tx = 0;
+    uint64_t num_back = 0;
+    uint64_t num_registrations = 0;
+    alarm(HANG_TIMEOUT_S);
+    while (num_back < NUM_MSGS) {
+        size_t r = rand() % NUM_REGIONS;
+        if (!alive[r] && (num_tx == NUM_MSGS || rand() % 4 == 0)) {
+            err = cleanq_register(queue, caps[r], &rids[r]);
+            if (err_is_fail(err)) {
+                FAIL("registering region %zu failed %d\n", r, err);
+            }
+            alive[r] = true;
+            num_registrations++;
+        } else if (alive[r] && outstanding[r] == 0 && rand() % 4 == 0) {
+            struct capref cap;
+            err = cleanq_deregister(queue, rids[r], &cap);
+            if (err_is_fail(err) || cap.vaddr != caps[r].vaddr) {
+                FAIL("deregistering region %zu failed %d\n", r, err);
+            }
+            alive[r] = false;
+        } else if (alive[r] && num_tx < NUM_MSGS && num_tx - num_back < NUM_SLOTS) {
+            err = send_buf(queue, rids[r], num_tx, ((uint64_t)r << 32) | num_tx);
+            if (err_is_fail(err)) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            outstanding[r]++;
+            num_tx++;
+        }
+
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        size_t br = b.flags >> 32;
+        if (err_is_fail(err) || (b.flags & 0xffffffff) != num_back || br >= NUM_REGIONS
+            || !alive[br] || b.rid != rids[br]) {
+            FAIL("expected buffer %lu back, got %lx err=%d\n", num_back, b.flags, err);
+        }
+        outstanding[br]--;
+        num_back++;
+    }
+
+    test_join(pid);
+    if (num_registrations < MIN_REGISTRATIONS) {
+        FAIL("only %lu regions have been registered\n", num_registrations);
+    }
+
+    cleanq_destroy(queue);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        free(caps[i].vaddr);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-cmdchan-%d", getpid());
+
+    printf("Starting ipcq full ring test\n");
+    test_full_ring(false);
+
+    printf("Starting ffq full ring test\n");
+    test_full_ring(true);
+
+    printf("Starting ipcq flags test\n");
+    test_flags(false);
+
+    printf("Starting ffq flags test\n");
+    test_flags(true);
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("cmdchan test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#ifndef CLEANQ_TEST_H_
+#define CLEANQ_TEST_H_ 1
+
+/*
+ * Helpers shared by the behaviour tests. A test defines TEST_NAME before it includes this file,
+ * the messages of FAIL() and of the watchdog start with it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#ifndef TEST_NAME
+#error "TEST_NAME must be defined before including common/test.h"
+#endif
+
+
+///< prints the reason the test failed and exits, also from the echo side
+#define FAIL(x...)                                                                                \
+    do {                                                                                          \
+        printf(TEST_NAME " test failed: " x);                                                     \
+        exit(1);                                                                                  \
+    } while (0)
+
+
+/*
+ * ================================================================================================
+ * Watchdog
+ * ================================================================================================
+ */
+
+
+///< what the watchdog reports when it expires
+static const char *test_hang_reason = "no progress";
+
+
+static inline void test_hang_handler(int sig)
+{
+    (void)sig;
+
+    printf(TEST_NAME " test failed: %s\n", test_hang_reason);
+    exit(1);
+}
+
+
+/**
+ * @brief fails the test when an alarm() expires before it is cancelled
+ *
+ * @param reason    what the failure message says, i.e. what hangs
+ */
+static inline void test_watchdog(const char *reason)
+{
+    test_hang_reason = reason;
+    signal(SIGALRM, test_hang_handler);
+}
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+///< the monotonic time in microseconds
+static inline uint64_t test_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief creates or attaches to a shared memory queue, the test fails if it can't
+ *
+ * @param name      the name of the queue
+ * @param ffq       create an FFQ instead of an IPCQ
+ * @param clear     create the queue instead of attaching to it
+ * @param slots     the number of slots of the rings, 0 for the default
+ */
+static inline struct cleanq *test_create_queue(const char *name, bool ffq, bool clear,
+                                               size_t slots)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = slots };
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&queue, name, clear, &attr);
+    } else {
+        struct cleanq_ipcq_attr attr = { .slots = slots };
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, (char *)name, clear,
+                                           &attr);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating the %s %s failed %d\n", ffq ? "ffq" : "ipcq", name, err);
+    }
+
+    return queue;
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief forks the echo side, it gets a random seed of its own
+ *
+ * @returns the pid of the echo side in the parent, 0 in the echo side
+ */
+static inline pid_t test_fork(void)
+{
+    /* the buffered output must not be printed twice */
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        FAIL("forking the echo side failed\n");
+    }
+    if (pid == 0) {
+        srand(getpid());
+    }
+
+    return pid;
+}
+
+
+/**
+ * @brief waits for the echo side to exit and cancels the watchdog, the test fails with it
+ *
+ * @param pid   the pid returned by test_fork()
+ */
+static inline void test_join(pid_t pid)
+{
+    int status;
+    waitpid(pid, &status, 0);
+    alarm(0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        FAIL("the echo side failed\n");
+    }
+}
+
+#endif /* CLEANQ_TEST_H_ */
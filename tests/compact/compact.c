@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "compact"
+#include "../common/test.h"
+
+
+///< the region is never touched, it is large enough for offsets beyond 32 bits
+#define REGION_SIZE (1UL << 40)
+#define REGION_ADDR (1UL << 44)
+
+#define BUF_SIZE 2048
+
+#define NUM_SLOTS 16
+
+#define MAX_BATCH 12
+
+#define NUM_ROUNDS 200000
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 200000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory = { .vaddr = (void *)REGION_ADDR,
+                                .paddr = REGION_ADDR,
+                                .len = REGION_SIZE };
+static regionid_t regid;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static struct cleanq *create_queue(bool ffq, bool clear)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS, .compact = clear };
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&queue, name, clear, &attr);
+    } else {
+        struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS, .compact = clear };
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, name, clear, &attr);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating the compact %s failed %d\n", ffq ? "ffq" : "ipcq", err);
+    }
+
+    return queue;
+}
+
+
+///< a random value of up to the given number of bits, often a small one
+static uint64_t random_bits(unsigned bits)
+{
+    uint64_t v = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+    if (rand() % 2) {
+        bits = rand() % 33;
+    }
+    return bits < 64 ? v & ((1UL << bits) - 1) : v;
+}
+
+
+/*
+ * Fills in a buffer with random fields, any of them may need more than 32 bits. The sequence
+ * number is kept in the lower bits of the flags.
+ */
+static void fill_buf(struct cleanq_buf *b, uint64_t seq)
+{
+    b->rid = regid;
+    b->length = (rand() % BUF_SIZE) + 1;
+    b->offset = random_bits(40) % (REGION_SIZE - b->length);
+    b->valid_data = rand() % (b->length + 1);
+    b->valid_length = rand() % (b->length - b->valid_data + 1);
+    b->flags = (random_bits(64) & ~0xffffffUL) | (seq & 0xffffff);
+
+    /* large lengths are rare, the buffer is made as large as the region allows */
+    if (rand() % 16 == 0) {
+        b->offset = random_bits(34);
+        b->length = REGION_SIZE - b->offset;
+        b->valid_data = random_bits(34) % b->length;
+        b->valid_length = b->length - b->valid_data;
+    }
+}
+
+
+static bool is_wide(const struct cleanq_buf *b)
+{
+    return ((b->offset | b->length | b->valid_data | b->valid_length | b->flags) >> 32) != 0;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, const struct cleanq_buf *exp)
+{
+    if (b->rid != exp->rid || b->offset != exp->offset || b->length != exp->length
+        || b->valid_data != exp->valid_data || b->valid_length != exp->valid_length
+        || b->flags != exp->flags) {
+        FAIL("expected buffer %lx+%lx flags=%lx, got %lx+%lx flags=%lx\n", exp->offset,
+             exp->length, exp->flags, b->offset, b->length, b->flags);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Compact queues have no inline messages, and buffers with fields beyond 32 bits take two
+ * slots of the ring.
+ */
+static void test_capacity(bool ffq)
+{
+    errval_t err;
+
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS, .compact = true, .inline_max = 64 };
+        struct cleanq_ffq *q;
+        err = cleanq_ffq_create_with_attr(&q, name, true, &attr);
+    } else {
+        struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS, .compact = true, .inline_max = 64 };
+        struct cleanq_ipcq *q;
+        err = cleanq_ipcq_create_with_attr(&q, name, true, &attr);
+    }
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a compact queue with inline messages returned %d\n", err);
+    }
+
+    struct cleanq *tx = create_queue(ffq, true);
+    struct cleanq *rx = create_queue(ffq, false);
+
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t max_inline;
+    err = cleanq_control(tx, CLEANQ_CTRL_INLINE_MAX, 0, &max_inline);
+    if (err_is_fail(err) || max_inline != 0) {
+        FAIL("a compact queue has inline messages of %lu bytes\n", max_inline);
+    }
+
+    for (size_t round = 0; round < 1000; round++) {
+        struct cleanq_buf sent[NUM_SLOTS];
+        size_t num = 0;
+        size_t used = 0;
+        struct cleanq_buf b;
+
+        /* narrow and wide buffers, the share of wide ones changes from round to round */
+        int wide_pct = rand() % 101;
+        while (true) {
+            fill_buf(&b, num);
+            if (rand() % 100 >= wide_pct) {
+                b.offset &= 0xffffffff;
+                b.length = (rand() % BUF_SIZE) + 1;
+                b.valid_data = 0;
+                b.valid_length = b.length;
+                b.flags &= 0xffffffff;
+            }
+            err = cleanq_enqueue(tx, b.rid, b.offset, b.length, b.valid_data, b.valid_length,
+                                 b.flags);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                break;
+            }
+            if (err_is_fail(err)) {
+                FAIL("enqueue of buffer %zu returned %d\n", num, err);
+            }
+            sent[num++] = b;
+            used += is_wide(&b) ? 2 : 1;
+        }
+
+        /* a buffer is refused only if it does not fit */
+        if (used > NUM_SLOTS || NUM_SLOTS - used >= (is_wide(&b) ? 2U : 1U)) {
+            FAIL("the ring of %d slots is full with %zu slots used\n", NUM_SLOTS, used);
+        }
+
+        for (size_t i = 0; i < num; i++) {
+            err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags);
+            if (err_is_fail(err)) {
+                FAIL("dequeue of buffer %zu returned %d\n", i, err);
+            }
+            check_buf(&b, &sent[i]);
+        }
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+}
+
+
+/*
+ * Batches of narrow and wide buffers go through the ring while it wraps around, a wide buffer
+ * may start in the last slot and end in the first one.
+ */
+static void test_wrap(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = create_queue(ffq, true);
+    struct cleanq *rx = create_queue(ffq, false);
+
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    static struct cleanq_buf sent[NUM_SLOTS + MAX_BATCH];
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_ROUNDS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num = (rand() % MAX_BATCH) + 1;
+        for (size_t i = 0; i < num; i++) {
+            fill_buf(&bufs[i], num_tx + i);
+        }
+
+        size_t num_enq;
+        err = cleanq_enqueue_batch(tx, bufs, num, &num_enq);
+        if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+            FAIL("sending buffer %lu returned %d\n", num_tx, err);
+        }
+        for (size_t i = 0; i < num_enq; i++) {
+            sent[(num_tx + i) % (NUM_SLOTS + MAX_BATCH)] = bufs[i];
+        }
+        num_tx += num_enq;
+
+        size_t num_deq;
+        err = cleanq_dequeue_batch(rx, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_EMPTY) {
+            FAIL("receiving buffer %lu returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; err_is_ok(err) && i < num_deq; i++) {
+            check_buf(&bufs[i], &sent[(num_rx + i) % (NUM_SLOTS + MAX_BATCH)]);
+        }
+        num_rx += err_is_ok(err) ? num_deq : 0;
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Answers every buffer with the same fields, in batches of random size.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = create_queue(ffq, false);
+
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            if ((bufs[i].flags & 0xffffff) != ((num_rx + i) & 0xffffff)) {
+                FAIL("the echo side expected buffer %lu, got flags %lx\n", num_rx + i,
+                     bufs[i].flags);
+            }
+        }
+
+        size_t sent = 0;
+        while (sent < num_deq) {
+            size_t num_enq;
+            err = cleanq_enqueue_batch(queue, bufs + sent, num_deq - sent, &num_enq);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                sched_yield();
+                continue;
+            }
+            if (err_is_fail(err)) {
+                FAIL("the echo side enqueue returned %d\n", err);
+            }
+            sent += num_enq;
+        }
+        num_rx += num_deq;
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * The other process attaches without asking for the compact format, it takes it from the
+ * header. Every field comes back as it was sent.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = create_queue(ffq, true);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    /* at most two rings worth of buffers are in flight */
+    static struct cleanq_buf sent[2 * NUM_SLOTS];
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    alarm(HANG_TIMEOUT_S);
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf b;
+        if (num_tx < NUM_MSGS && num_tx - num_rx < 2 * NUM_SLOTS) {
+            fill_buf(&b, num_tx);
+            err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data, b.valid_length,
+                                 b.flags);
+            if (err_is_ok(err)) {
+                sent[num_tx % (2 * NUM_SLOTS)] = b;
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("enqueue of buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("dequeue of buffer %lu returned %d\n", num_rx, err);
+        }
+        check_buf(&b, &sent[num_rx % (2 * NUM_SLOTS)]);
+        num_rx++;
+    }
+
+    test_join(pid);
+
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-compact-%d", getpid());
+
+    printf("Starting ipcq capacity test\n");
+    test_capacity(false);
+
+    printf("Starting ffq capacity test\n");
+    test_capacity(true);
+
+    printf("Starting ipcq wrap test\n");
+    test_wrap(false);
+
+    printf("Starting ffq wrap test\n");
+    test_wrap(true);
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("compact test passed\n");
+
+    return 0;
+}
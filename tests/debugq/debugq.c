@@ -0,0 +1,662 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/debug_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "debugq"
+#include "../common/test.h"
+
+
+///< the ownership is tracked at any granularity, the test uses units
+#define UNIT_SIZE 64
+#define NUM_UNITS 1024
+#define MEMORY_SIZE UNIT_SIZE *NUM_UNITS
+
+///< the maximum number of units of a buffer
+#define MAX_UNITS 16
+
+#define NUM_SLOTS 64
+
+#define NUM_ROUNDS 300000
+
+///< every violation dumps the owned memory, keep them few
+#define MAX_VIOLATIONS 32
+
+///< marks a buffer the other side sends although the debug queue still owns it
+#define FORGED_FLAG 1
+
+///< the entries of the operation log of the async mode, the datapath waits for the checker
+#define LOG_SIZE 16
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the debug queue on one end of an IPC queue, the other end is used directly
+static struct cleanq *queue;
+static struct cleanq *lower;
+static struct cleanq *peer;
+
+///< the units owned by the side of the debug queue
+static bool owned[NUM_UNITS];
+
+///< the buffers the other side holds
+static struct cleanq_buf held[NUM_UNITS];
+static size_t num_held;
+
+static uint64_t num_violations;
+
+///< the violations are only counted by the checker thread, the datapath does not see them
+static bool async;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void create_queues(const struct cleanq_debugq_attr *attr)
+{
+    errval_t err;
+
+    struct cleanq_ipcq_attr ipcq_attr = { .slots = NUM_SLOTS };
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&lower, name, true, &ipcq_attr);
+    if (err_is_ok(err)) {
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&peer, name, false, NULL);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    struct cleanq_debugq *dq;
+    err = cleanq_debugq_create_with_attr(&dq, lower, attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the debug queue failed %d\n", err);
+    }
+    queue = (struct cleanq *)dq;
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    /* the other side learns about the region */
+    struct cleanq_buf b;
+    err = cleanq_dequeue(peer, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                         &b.flags);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue from an empty queue returned %d\n", err);
+    }
+
+    for (size_t i = 0; i < NUM_UNITS; i++) {
+        owned[i] = true;
+    }
+    num_held = 0;
+    num_violations = 0;
+    async = attr && attr->mode == CLEANQ_DEBUGQ_CHECK_ASYNC;
+}
+
+
+static void destroy_queues(void)
+{
+    /* the debug queue does not destroy the queue it wraps */
+    cleanq_destroy(queue);
+    cleanq_destroy(lower);
+    cleanq_destroy(peer);
+}
+
+
+static bool all_owned(size_t start, size_t num)
+{
+    for (size_t i = start; i < start + num; i++) {
+        if (!owned[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool any_owned(size_t start, size_t num)
+{
+    for (size_t i = start; i < start + num; i++) {
+        if (owned[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static void set_owned(size_t start, size_t num, bool value)
+{
+    for (size_t i = start; i < start + num; i++) {
+        owned[i] = value;
+    }
+}
+
+
+/*
+ * Enqueues units start to start + num on the debug queue, which must refuse them unless it owns
+ * all of them.
+ */
+static void send(size_t start, size_t num)
+{
+    bool valid = all_owned(start, num);
+    errval_t err = cleanq_enqueue(queue, regid, start * UNIT_SIZE, num * UNIT_SIZE, 0,
+                                  num * UNIT_SIZE, 0);
+    if (err == CLEANQ_ERR_QUEUE_FULL && valid) {
+        return;
+    }
+    if (valid != err_is_ok(err)) {
+        FAIL("enqueue of units %zu to %zu returned %d\n", start, start + num, err);
+    }
+
+    if (valid) {
+        set_owned(start, num, false);
+    } else {
+        num_violations++;
+    }
+}
+
+
+/*
+ * Sends a buffer within the owned units the unit start is in, if it is owned.
+ */
+static void send_owned(size_t start)
+{
+    if (!owned[start]) {
+        return;
+    }
+
+    size_t num = 1;
+    size_t max = (rand() % MAX_UNITS) + 1;
+    while (num < max && start + num < NUM_UNITS && owned[start + num]) {
+        num++;
+    }
+    send(start, num);
+}
+
+
+/*
+ * Receives everything the other side has sent, its buffers are owned again unless they are
+ * forged.
+ */
+static void recv_all(void)
+{
+    errval_t err;
+    struct cleanq_buf b;
+
+    while (true) {
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            return;
+        }
+
+        size_t start = b.offset / UNIT_SIZE;
+        size_t num = b.length / UNIT_SIZE;
+        if (b.flags == FORGED_FLAG) {
+            if (err_is_ok(err) != async) {
+                FAIL("a forged buffer of units %zu to %zu has been dequeued\n", start,
+                     start + num);
+            }
+            num_violations++;
+            continue;
+        }
+        if (err_is_fail(err) || any_owned(start, num)) {
+            FAIL("dequeue of units %zu to %zu returned %d\n", start, start + num, err);
+        }
+        set_owned(start, num, true);
+    }
+}
+
+
+/*
+ * The other side takes everything from its ring.
+ */
+static void peer_collect(void)
+{
+    size_t num_deq;
+    while (cleanq_dequeue_batch(peer, held + num_held, NUM_SLOTS, &num_deq) == CLEANQ_ERR_OK) {
+        num_held += num_deq;
+    }
+}
+
+
+/*
+ * The other side gives back a random buffer, possibly in two parts.
+ */
+static void peer_return(void)
+{
+    errval_t err;
+
+    if (num_held == 0) {
+        return;
+    }
+
+    size_t idx = rand() % num_held;
+    struct cleanq_buf *b = &held[idx];
+    genoffset_t length = b->length;
+    if (length > UNIT_SIZE && rand() % 2) {
+        length = ((rand() % (b->length / UNIT_SIZE - 1)) + 1) * UNIT_SIZE;
+    }
+
+    err = cleanq_enqueue(peer, b->rid, b->offset, length, 0, length, 0);
+    if (err == CLEANQ_ERR_QUEUE_FULL) {
+        return;
+    }
+    if (err_is_fail(err)) {
+        FAIL("the other side returning a buffer returned %d\n", err);
+    }
+
+    if (length == b->length) {
+        held[idx] = held[--num_held];
+    } else {
+        b->offset += length;
+        b->length -= length;
+        b->valid_length = b->length;
+    }
+}
+
+
+/*
+ * The other side sends a buffer overlapping with the owned ones.
+ */
+static void peer_forge(size_t start)
+{
+    if (!owned[start]) {
+        return;
+    }
+
+    size_t num = (start + 1 < NUM_UNITS) ? 2 : 1;
+    errval_t err = cleanq_enqueue(peer, regid, start * UNIT_SIZE, num * UNIT_SIZE, 0,
+                                  num * UNIT_SIZE, FORGED_FLAG);
+    if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+        FAIL("the other side sending a forged buffer returned %d\n", err);
+    }
+}
+
+
+/*
+ * Everything the other side holds comes back, then the region can be deregistered.
+ */
+static void drain(void)
+{
+    peer_collect();
+    while (num_held) {
+        peer_return();
+        recv_all();
+    }
+    recv_all();
+
+    if (!all_owned(0, NUM_UNITS)) {
+        FAIL("not all memory is owned after draining\n");
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Only owned memory is enqueued, a region is deregistered only if all of it is owned.
+ */
+static void test_basic(void)
+{
+    errval_t err;
+
+    create_queues(NULL);
+
+    /* unknown regions are refused before the debug queue is involved */
+    err = cleanq_enqueue(queue, regid + 1, 0, UNIT_SIZE, 0, UNIT_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue into an unknown region returned %d\n", err);
+    }
+
+    send(0, NUM_UNITS);
+    err = cleanq_enqueue(queue, regid, 0, UNIT_SIZE, 0, UNIT_SIZE, 0);
+    if (err != CLEANQ_ERR_BUFFER_ALREADY_IN_USE) {
+        FAIL("enqueue while the whole region is in use returned %d\n", err);
+    }
+    num_violations++;
+
+    /* the region comes back in random pieces */
+    drain();
+
+    if (cleanq_debugq_get_errors((struct cleanq_debugq *)queue) != num_violations) {
+        FAIL("%lu errors counted, expected %lu\n",
+             cleanq_debugq_get_errors((struct cleanq_debugq *)queue), num_violations);
+    }
+
+    struct capref cap;
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering an owned region failed %d\n", err);
+    }
+
+    destroy_queues();
+
+    /* checked on a queue of its own, the region is gone from the pool even if it is refused */
+    create_queues(NULL);
+    send(0, 1);
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err != CLEANQ_ERR_REGION_DESTROY) {
+        FAIL("deregistering a region in use returned %d\n", err);
+    }
+    destroy_queues();
+}
+
+
+/*
+ * Buffers are sent and come back in random order and pieces, the owned memory splits and merges
+ * in any pattern. Enqueues of memory not owned and buffers received twice are detected.
+ */
+static void test_randomized(const struct cleanq_debugq_attr *attr)
+{
+    errval_t err;
+
+    create_queues(attr);
+
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+        size_t start = rand() % NUM_UNITS;
+        switch (rand() % 8) {
+        case 0:
+        case 1:
+        case 2:
+            send_owned(start);
+            break;
+        case 3:
+            if (num_violations < MAX_VIOLATIONS && rand() % 2000 == 0) {
+                if (rand() % 2 && !async) {
+                    send(start, (start + MAX_UNITS < NUM_UNITS) ? MAX_UNITS : 1);
+                } else {
+                    /* received right away, before the debug queue sends the memory itself */
+                    peer_forge(start);
+                    recv_all();
+                }
+            }
+            break;
+        case 4:
+            peer_collect();
+            break;
+        case 5:
+        case 6:
+            peer_return();
+            break;
+        default:
+            recv_all();
+            break;
+        }
+    }
+
+    drain();
+
+    cleanq_debugq_sync((struct cleanq_debugq *)queue);
+    uint64_t errors = cleanq_debugq_get_errors((struct cleanq_debugq *)queue);
+    if (errors != num_violations) {
+        FAIL("%lu errors counted, expected %lu\n", errors, num_violations);
+    }
+
+    struct capref cap;
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering the region failed %d\n", err);
+    }
+
+    destroy_queues();
+}
+
+
+/*
+ * Receives everything on the debug queue without checking it, returns the number of buffers.
+ */
+static size_t recv_unchecked(void)
+{
+    errval_t err;
+    struct cleanq_buf b;
+    size_t num = 0;
+
+    while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags))
+           == CLEANQ_ERR_OK) {
+        num++;
+    }
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue returned %d\n", err);
+    }
+
+    return num;
+}
+
+
+/*
+ * The other side sends back everything it has received, returns the number of buffers.
+ */
+static size_t bounce(void)
+{
+    size_t num = 0;
+
+    peer_collect();
+    while (num_held) {
+        struct cleanq_buf *b = &held[num_held - 1];
+        errval_t err = cleanq_enqueue(peer, b->rid, b->offset, b->length, 0, b->length, 0);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            num += recv_unchecked();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the other side returning a buffer returned %d\n", err);
+        }
+        num_held--;
+    }
+
+    return num + recv_unchecked();
+}
+
+
+static errval_t send_unit(size_t unit)
+{
+    return cleanq_enqueue(queue, regid, unit * UNIT_SIZE, UNIT_SIZE, 0, UNIT_SIZE, 0);
+}
+
+
+/*
+ * Enqueues every unit twice, the second enqueue is refused for the sampled ones. Returns the
+ * number of them, and checks that the same ones are sampled every time.
+ */
+static size_t count_sampled(const struct cleanq_debugq_attr *attr)
+{
+    static bool sampled[NUM_UNITS];
+    size_t num_sampled = 0;
+
+    create_queues(attr);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < NUM_UNITS; i++) {
+            errval_t err = send_unit(i);
+            if (err_is_fail(err)) {
+                FAIL("enqueue of unit %zu returned %d\n", i, err);
+            }
+
+            err = send_unit(i);
+            if (err_is_fail(err) && err != CLEANQ_ERR_BUFFER_ALREADY_IN_USE) {
+                FAIL("the second enqueue of unit %zu returned %d\n", i, err);
+            }
+            if (pass == 0) {
+                sampled[i] = err_is_fail(err);
+                num_sampled += sampled[i];
+            } else if (sampled[i] != err_is_fail(err)) {
+                FAIL("unit %zu has not been sampled the same way twice\n", i);
+            }
+
+            bounce();
+        }
+    }
+
+    uint64_t errors = cleanq_debugq_get_errors((struct cleanq_debugq *)queue);
+    if (errors != 2 * num_sampled) {
+        FAIL("%lu errors counted for %zu sampled buffers\n", errors, num_sampled);
+    }
+
+    destroy_queues();
+
+    return num_sampled;
+}
+
+
+/*
+ * Invalid attributes are refused. The sampled buffers are tracked until they come back, double
+ * enqueues and buffers outstanding for long are reported, and the sampled fraction matches.
+ */
+static void test_sampled(void)
+{
+    errval_t err;
+    struct cleanq_debugq *dq;
+    struct cleanq_debugq_attr attr = { .mode = 3 };
+
+    err = cleanq_debugq_create_with_attr(&dq, NULL, &attr);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a debug queue with an unknown mode returned %d\n", err);
+    }
+    attr = (struct cleanq_debugq_attr){ .mode = CLEANQ_DEBUGQ_CHECK_ASYNC, .log_size = 3 };
+    err = cleanq_debugq_create_with_attr(&dq, NULL, &attr);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a debug queue with a log of 3 entries returned %d\n", err);
+    }
+
+    /* without a period or fraction, every buffer is tracked */
+    attr = (struct cleanq_debugq_attr){ .mode = CLEANQ_DEBUGQ_CHECK_SAMPLED };
+    create_queues(&attr);
+
+    if (err_is_fail(send_unit(0))) {
+        FAIL("enqueue of a sampled buffer failed\n");
+    }
+    err = send_unit(0);
+    if (err != CLEANQ_ERR_BUFFER_ALREADY_IN_USE) {
+        FAIL("a double enqueue of a sampled buffer returned %d\n", err);
+    }
+    if (bounce() != 1) {
+        FAIL("the sampled buffer has not come back once\n");
+    }
+    if (err_is_fail(send_unit(0))) {
+        FAIL("enqueue of a sampled buffer that came back failed\n");
+    }
+
+    /* the other side keeps the buffer while another one goes back and forth */
+    peer_collect();
+    num_held = 0;
+    for (size_t i = 0; i < 100; i++) {
+        if (err_is_fail(send_unit(1)) || bounce() != 1) {
+            FAIL("a round trip of another buffer failed\n");
+        }
+    }
+    if (cleanq_debugq_check_lost((struct cleanq_debugq *)queue, 150) != 1
+        || cleanq_debugq_check_lost((struct cleanq_debugq *)queue, 1000) != 0) {
+        FAIL("the outstanding buffer is not reported once it is old\n");
+    }
+
+    /* checked last, the region is gone from the pool even if it is refused */
+    struct capref cap;
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err != CLEANQ_ERR_REGION_DESTROY) {
+        FAIL("deregistering a region with a sampled buffer in use returned %d\n", err);
+    }
+    if (cleanq_debugq_get_errors((struct cleanq_debugq *)queue) != 2) {
+        FAIL("%lu errors counted, expected 2\n",
+             cleanq_debugq_get_errors((struct cleanq_debugq *)queue));
+    }
+    destroy_queues();
+
+    attr.sample_fraction = 0.25;
+    size_t num = count_sampled(&attr);
+    if (num < NUM_UNITS * 15 / 100 || num > NUM_UNITS * 35 / 100) {
+        FAIL("%zu of %d buffers are sampled with a fraction of 0.25\n", num, NUM_UNITS);
+    }
+
+    attr.sample_fraction = 0;
+    attr.sample_period = 8;
+    num = count_sampled(&attr);
+    if (num < NUM_UNITS * 6 / 100 || num > NUM_UNITS * 19 / 100) {
+        FAIL("%zu of %d buffers are sampled with a period of 8\n", num, NUM_UNITS);
+    }
+}
+
+
+/*
+ * The checker thread finds the violations behind the datapath, which waits once the log is full.
+ */
+static void test_async(void)
+{
+    struct cleanq_debugq_attr attr = { .mode = CLEANQ_DEBUGQ_CHECK_ASYNC, .log_size = LOG_SIZE };
+    test_randomized(&attr);
+
+    /* the datapath does not refuse a region in use */
+    create_queues(&attr);
+    send(0, 1);
+    struct capref cap;
+    errval_t err = cleanq_deregister(queue, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering a region in use returned %d\n", err);
+    }
+    cleanq_debugq_sync((struct cleanq_debugq *)queue);
+    if (cleanq_debugq_get_errors((struct cleanq_debugq *)queue) != 1) {
+        FAIL("deregistering a region in use has not been counted\n");
+    }
+    destroy_queues();
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+
+    snprintf(name, sizeof(name), "/cleanq-test-debugq-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting basic test\n");
+    test_basic();
+
+    printf("Starting randomized test\n");
+    test_randomized(NULL);
+
+    printf("Starting sampled test\n");
+    test_sampled();
+
+    printf("Starting async test\n");
+    test_async();
+
+    printf("debugq test passed\n");
+
+    return 0;
+}
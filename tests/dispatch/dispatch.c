@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/dispatch.h>
+#include <cleanq/backends/loopback_queue.h>
+#include <cleanq/backends/debug_queue.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "dispatch"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 400
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_WORKERS 3
+
+///< the number of buffers sent through the dispatcher for each queue type
+#define NUM_MSGS 200000
+
+///< every this many buffers take longer on the first worker, the others steal its deque
+#define SLOW_EVERY 7
+
+#define MAX_BATCH 32
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the producer end and the end the dispatcher works on
+static struct cleanq *prod_queue;
+static struct cleanq *disp_queue;
+static struct cleanq_dispatch *disp;
+
+///< the worker processing a buffer, two workers must never hold the same one
+static uint64_t owner[NUM_BUFS];
+
+///< the number of buffers every worker has processed
+static uint64_t num_processed[NUM_WORKERS];
+
+static int stop;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static uint64_t *buf_data(genoffset_t offset)
+{
+    return (uint64_t *)((uint8_t *)memory.vaddr + offset);
+}
+
+
+static void create_queues(bool ffq)
+{
+    errval_t err;
+
+    if (ffq) {
+        err = cleanq_ffq_create((struct cleanq_ffq **)&prod_queue, name, true);
+        if (err_is_ok(err)) {
+            err = cleanq_ffq_create((struct cleanq_ffq **)&disp_queue, name, false);
+        }
+    } else {
+        err = cleanq_ipcq_create((struct cleanq_ipcq **)&prod_queue, name, true);
+        if (err_is_ok(err)) {
+            err = cleanq_ipcq_create((struct cleanq_ipcq **)&disp_queue, name, false);
+        }
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    err = cleanq_register(prod_queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The attributes are checked, and an invalid buffer returned by a worker is dropped on its own
+ * while the others of the batch go back into the queue.
+ */
+static void test_basic(void)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    err = loopback_queue_create((struct cleanq_loopbackq **)&queue);
+    if (err_is_fail(err)) {
+        FAIL("creating the loopback queue failed %d\n", err);
+    }
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    struct cleanq_dispatch_attr attr = { .slots = 64, .batch = 16, .return_batch = 4 };
+    err = cleanq_dispatch_create(&disp, queue, 0, &attr);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("creating a dispatcher without workers returned %d\n", err);
+    }
+    attr.slots = 48;
+    err = cleanq_dispatch_create(&disp, queue, 1, &attr);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("creating a dispatcher with %zu slots returned %d\n", attr.slots, err);
+    }
+    attr.slots = 8;
+    err = cleanq_dispatch_create(&disp, queue, 1, &attr);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("creating a dispatcher with a batch larger than the deques returned %d\n", err);
+    }
+    attr.slots = 64;
+    err = cleanq_dispatch_create(&disp, queue, 1, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the dispatcher failed %d\n", err);
+    }
+
+    struct cleanq_buf b;
+    err = cleanq_dispatch_get(disp, 0, &b);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("getting a buffer from an empty queue returned %d\n", err);
+    }
+
+    /* the batch is enqueued with the last buffer, the third one is in no region */
+    for (uint64_t i = 0; i < attr.return_batch; i++) {
+        b = (struct cleanq_buf){ .rid = regid, .offset = i * BUF_SIZE, .length = BUF_SIZE,
+                                 .valid_length = BUF_SIZE, .flags = i };
+        if (i == 2) {
+            b.rid = regid + 7;
+        }
+        err = cleanq_dispatch_put(disp, 0, &b);
+        if (i + 1 < attr.return_batch && err_is_fail(err)) {
+            FAIL("returning buffer %lu returned %d\n", i, err);
+        }
+    }
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("returning a batch with an invalid buffer returned %d\n", err);
+    }
+
+    for (uint64_t i = 0; i < attr.return_batch; i++) {
+        if (i == 2) {
+            continue;
+        }
+        err = cleanq_dispatch_get(disp, 0, &b);
+        if (err_is_fail(err) || b.rid != regid || b.flags != i) {
+            FAIL("getting buffer %lu back returned %d with flags=%lu\n", i, err, b.flags);
+        }
+    }
+    err = cleanq_dispatch_get(disp, 0, &b);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("the invalid buffer has been enqueued, %d\n", err);
+    }
+
+    err = cleanq_dispatch_destroy(disp);
+    if (err_is_fail(err)) {
+        FAIL("destroying the dispatcher failed %d\n", err);
+    }
+    cleanq_destroy(queue);
+}
+
+
+///< the buffers handed to the dropped callback
+static struct cleanq_buf dropped_bufs[MAX_BATCH];
+static errval_t dropped_errs[MAX_BATCH];
+static size_t num_dropped;
+
+
+static void dropped_cb(void *arg, const struct cleanq_buf *buf, errval_t err)
+{
+    if (arg != &num_dropped || num_dropped == MAX_BATCH) {
+        FAIL("dropped callback with arg=%p after %zu buffers\n", arg, num_dropped);
+    }
+
+    dropped_bufs[num_dropped] = *buf;
+    dropped_errs[num_dropped] = err;
+    num_dropped++;
+}
+
+
+/*
+ * A buffer the queue rejects, here one the debug queue does not own, is handed to the dropped
+ * callback without holding up the others of the batch. The error is reported once, the worker
+ * goes on returning buffers.
+ */
+static void test_rejected(void)
+{
+    errval_t err;
+    struct cleanq *lower;
+    struct cleanq_debugq *queue;
+
+    err = loopback_queue_create((struct cleanq_loopbackq **)&lower);
+    if (err_is_fail(err)) {
+        FAIL("creating the loopback queue failed %d\n", err);
+    }
+    err = cleanq_debugq_create(&queue, lower);
+    if (err_is_fail(err)) {
+        FAIL("creating the debug queue failed %d\n", err);
+    }
+    err = cleanq_register((struct cleanq *)queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    struct cleanq_dispatch_attr attr = { .slots = 64, .batch = 16, .return_batch = 4,
+                                         .dropped = dropped_cb, .dropped_arg = &num_dropped };
+    err = cleanq_dispatch_create(&disp, (struct cleanq *)queue, 1, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the dispatcher failed %d\n", err);
+    }
+
+    /* the third buffer is the second one again, the queue does not own it anymore then */
+    static const uint64_t bufs[] = { 0, 1, 1, 2 };
+    struct cleanq_buf b;
+    for (uint64_t i = 0; i < attr.return_batch; i++) {
+        b = (struct cleanq_buf){ .rid = regid, .offset = bufs[i] * BUF_SIZE, .length = BUF_SIZE,
+                                 .valid_length = BUF_SIZE, .flags = i };
+        err = cleanq_dispatch_put(disp, 0, &b);
+        if (i + 1 < attr.return_batch && err_is_fail(err)) {
+            FAIL("returning buffer %lu returned %d\n", i, err);
+        }
+    }
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("returning a batch with a rejected buffer returned %d\n", err);
+    }
+    if (num_dropped != 1 || dropped_bufs[0].flags != 2 || dropped_bufs[0].offset != BUF_SIZE
+        || dropped_errs[0] != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("%zu buffers have been handed to the dropped callback\n", num_dropped);
+    }
+
+    err = cleanq_dispatch_flush(disp, 0);
+    if (err_is_fail(err)) {
+        FAIL("flushing after the rejected buffer was dropped returned %d\n", err);
+    }
+
+    struct cleanq_buf got[MAX_BATCH];
+    size_t num_deq;
+    err = cleanq_dequeue_batch((struct cleanq *)queue, got, MAX_BATCH, &num_deq);
+    if (err_is_fail(err) || num_deq != 3 || got[0].flags != 0 || got[1].flags != 1
+        || got[2].flags != 3) {
+        FAIL("got %zu buffers of the batch back, err=%d\n", num_deq, err);
+    }
+
+    /* the buffers that came back can be returned again */
+    for (size_t i = 0; i < num_deq; i++) {
+        err = cleanq_dispatch_put(disp, 0, &got[i]);
+        if (err_is_fail(err)) {
+            FAIL("returning buffer %zu again returned %d\n", i, err);
+        }
+    }
+    err = cleanq_dispatch_flush(disp, 0);
+    if (err_is_fail(err)) {
+        FAIL("flushing the buffers again returned %d\n", err);
+    }
+    err = cleanq_dequeue_batch((struct cleanq *)queue, got, MAX_BATCH, &num_deq);
+    if (err_is_fail(err) || num_deq != 3 || num_dropped != 1) {
+        FAIL("got %zu buffers back the second time, err=%d\n", num_deq, err);
+    }
+
+    err = cleanq_dispatch_destroy(disp);
+    if (err_is_fail(err)) {
+        FAIL("destroying the dispatcher failed %d\n", err);
+    }
+
+    /* the debug queue does not destroy the queue it wraps */
+    cleanq_destroy((struct cleanq *)queue);
+    cleanq_destroy(lower);
+}
+
+
+/*
+ * Processes the buffers it gets from the dispatcher, checks that no other worker holds the same
+ * buffer at the time and answers in place. The first worker is slow on some buffers.
+ */
+static void *worker_thread(void *arg)
+{
+    uint64_t worker = (uint64_t)arg;
+    errval_t err;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        struct cleanq_buf b;
+        err = cleanq_dispatch_get(disp, worker, &b);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            cleanq_dispatch_flush(disp, worker);
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("worker %lu got %d\n", worker, err);
+        }
+
+        size_t idx = b.offset / BUF_SIZE;
+        if (b.rid != regid || b.offset % BUF_SIZE || idx >= NUM_BUFS) {
+            FAIL("worker %lu got a buffer at offset %lu\n", worker, b.offset);
+        }
+        uint64_t other = __atomic_exchange_n(&owner[idx], worker + 1, __ATOMIC_ACQUIRE);
+        if (other) {
+            FAIL("workers %lu and %lu hold buffer %zu\n", other - 1, worker, idx);
+        }
+
+        uint64_t *data = buf_data(b.offset);
+        if (data[0] != b.flags) {
+            FAIL("worker %lu got buffer %lu with data %lu\n", worker, b.flags, data[0]);
+        }
+        if (worker == 0 && b.flags % SLOW_EVERY == 0) {
+            sched_yield();
+        }
+        data[1] = ~b.flags;
+
+        __atomic_store_n(&owner[idx], 0, __ATOMIC_RELEASE);
+        num_processed[worker]++;
+
+        while ((err = cleanq_dispatch_put(disp, worker, &b)) == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("worker %lu returning buffer %lu returned %d\n", worker, b.flags, err);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Sends the buffers to the workers through the dispatcher and checks that every one comes back
+ * once, processed, while the workers steal from each other and share the queue.
+ */
+static void test_workers(bool ffq)
+{
+    errval_t err;
+
+    create_queues(ffq);
+
+    struct cleanq_dispatch_attr attr = { .slots = 64, .batch = 16, .return_batch = 8 };
+    err = cleanq_dispatch_create(&disp, disp_queue, NUM_WORKERS, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the dispatcher failed %d\n", err);
+    }
+
+    stop = 0;
+    memset(num_processed, 0, sizeof(num_processed));
+    pthread_t threads[NUM_WORKERS];
+    for (uint64_t i = 0; i < NUM_WORKERS; i++) {
+        if (pthread_create(&threads[i], NULL, worker_thread, (void *)i)) {
+            FAIL("creating worker %lu failed\n", i);
+        }
+    }
+
+    genoffset_t free_bufs[NUM_BUFS];
+    size_t num_free = NUM_BUFS;
+    for (size_t i = 0; i < NUM_BUFS; i++) {
+        free_bufs[i] = i * BUF_SIZE;
+    }
+    static bool in_flight[NUM_BUFS];
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        while (num_free && num_tx < NUM_MSGS) {
+            genoffset_t offset = free_bufs[num_free - 1];
+            uint64_t *data = buf_data(offset);
+            data[0] = num_tx;
+            data[1] = 0;
+            err = cleanq_enqueue(prod_queue, regid, offset, BUF_SIZE, 0, BUF_SIZE, num_tx);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                break;
+            }
+            if (err_is_fail(err)) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            in_flight[offset / BUF_SIZE] = true;
+            num_free--;
+            num_tx++;
+        }
+
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num_deq;
+        err = cleanq_dequeue_batch(prod_queue, bufs, MAX_BATCH, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("receiving after %lu buffers returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            size_t idx = bufs[i].offset / BUF_SIZE;
+            uint64_t *data = buf_data(bufs[i].offset);
+            if (!in_flight[idx] || data[0] != bufs[i].flags || data[1] != ~bufs[i].flags) {
+                FAIL("buffer %lu came back unprocessed or twice\n", bufs[i].flags);
+            }
+            in_flight[idx] = false;
+            free_bufs[num_free++] = bufs[i].offset;
+        }
+        num_rx += num_deq;
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_WORKERS; i++) {
+        pthread_join(threads[i], NULL);
+        total += num_processed[i];
+    }
+    if (total != NUM_MSGS || num_free != NUM_BUFS) {
+        FAIL("the workers processed %lu buffers, %zu are free\n", total, num_free);
+    }
+
+    err = cleanq_dispatch_destroy(disp);
+    if (err_is_fail(err)) {
+        FAIL("destroying the dispatcher failed %d\n", err);
+    }
+    cleanq_destroy(disp_queue);
+    cleanq_destroy(prod_queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    snprintf(name, sizeof(name), "/cleanq-test-dispatch-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting basic test\n");
+    test_basic();
+
+    printf("Starting rejected test\n");
+    test_rejected();
+
+    printf("Starting ffq workers test\n");
+    test_workers(true);
+
+    printf("Starting ipcq workers test\n");
+    test_workers(false);
+
+    printf("dispatch test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+#include <cleanq/fastpath.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ff_queue_fast.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/ipc_queue_fast.h>
+
+#define TEST_NAME "fastpath"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define REGION_SIZE (BUF_SIZE * 64)
+
+///< more regions than a fast path handle caches, they evict each other
+#define NUM_REGIONS (2 * CLEANQ_FAST_REGIONS + 1)
+
+#define NUM_SLOTS 16
+
+///< more buffers than fit into the ring, so that it fills up
+#define FIFO_SIZE (2 * NUM_SLOTS)
+
+#define NUM_ROUNDS 500000
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 100000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+///< a queue endpoint with its fast path handle
+struct endpoint
+{
+    struct cleanq *q;
+    bool ffq;
+    struct cleanq_ffq_fast ff;
+    struct cleanq_ipcq_fast ipc;
+
+    ///< the counters the endpoint should have
+    struct cleanq_stats model;
+
+    ///< the regions this endpoint knows about
+    bool known[NUM_REGIONS];
+};
+
+///< the regions, registered by the creator of the queue
+struct region
+{
+    struct capref cap;
+    regionid_t rid;
+    bool registered;
+    size_t in_flight;
+};
+
+static struct region regions[NUM_REGIONS];
+
+///< no region has ever had this id or a larger one
+static regionid_t unused_rid;
+
+///< the buffers in flight in one direction, in order
+struct fifo
+{
+    struct cleanq_buf bufs[FIFO_SIZE];
+    size_t head;
+    size_t num;
+    uint64_t seq;
+};
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void create_endpoint(struct endpoint *e, bool ffq, bool clear)
+{
+    errval_t err;
+
+    memset(e, 0, sizeof(*e));
+    e->ffq = ffq;
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS };
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&e->q, name, clear, &attr);
+        if (err_is_ok(err)) {
+            err = cleanq_ffq_get_fast((struct cleanq_ffq *)e->q, &e->ff);
+        }
+    } else {
+        struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS };
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&e->q, name, clear, &attr);
+        if (err_is_ok(err)) {
+            err = cleanq_ipcq_get_fast((struct cleanq_ipcq *)e->q, &e->ipc);
+        }
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating the %s with a fast path handle failed %d\n", ffq ? "ffq" : "ipcq", err);
+    }
+}
+
+
+static errval_t fast_enqueue(struct endpoint *e, const struct cleanq_buf *b)
+{
+    if (e->ffq) {
+        return cleanq_ffq_enqueue_fast(&e->ff, b->rid, b->offset, b->length, b->valid_data,
+                                       b->valid_length, b->flags);
+    }
+    return cleanq_ipcq_enqueue_fast(&e->ipc, b->rid, b->offset, b->length, b->valid_data,
+                                    b->valid_length, b->flags);
+}
+
+
+static errval_t fast_dequeue(struct endpoint *e, struct cleanq_buf *b)
+{
+    if (e->ffq) {
+        return cleanq_ffq_dequeue_fast(&e->ff, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                       &b->valid_length, &b->flags);
+    }
+    return cleanq_ipcq_dequeue_fast(&e->ipc, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                    &b->valid_length, &b->flags);
+}
+
+
+///< sends a buffer on the fast or the generic path
+static errval_t send(struct endpoint *e, const struct cleanq_buf *b, bool fast)
+{
+    if (fast) {
+        return fast_enqueue(e, b);
+    }
+    return cleanq_enqueue(e->q, b->rid, b->offset, b->length, b->valid_data, b->valid_length,
+                          b->flags);
+}
+
+
+static errval_t recv(struct endpoint *e, struct cleanq_buf *b, bool fast)
+{
+    if (fast) {
+        return fast_dequeue(e, b);
+    }
+    return cleanq_dequeue(e->q, &b->rid, &b->offset, &b->length, &b->valid_data,
+                          &b->valid_length, &b->flags);
+}
+
+
+static void alloc_regions(void)
+{
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        regions[i].cap.vaddr = malloc(REGION_SIZE);
+        regions[i].cap.paddr = (uint64_t)regions[i].cap.vaddr;
+        regions[i].cap.len = REGION_SIZE;
+        regions[i].registered = false;
+        regions[i].in_flight = 0;
+    }
+}
+
+
+static void register_region(struct endpoint *e, size_t i)
+{
+    errval_t err = cleanq_register(e->q, regions[i].cap, &regions[i].rid);
+    if (err_is_fail(err)) {
+        FAIL("registering region %zu failed %d\n", i, err);
+    }
+    regions[i].registered = true;
+    e->known[i] = true;
+    if (regions[i].rid >= unused_rid) {
+        unused_rid = regions[i].rid + 1;
+    }
+}
+
+
+static void check_stats(struct endpoint *e)
+{
+    struct cleanq_stats s;
+    cleanq_get_stats(e->q, &s);
+    if (s.enqueues != e->model.enqueues || s.dequeues != e->model.dequeues
+        || s.enqueue_full != e->model.enqueue_full || s.dequeue_empty != e->model.dequeue_empty
+        || s.enqueue_bytes != e->model.enqueue_bytes
+        || s.dequeue_bytes != e->model.dequeue_bytes || s.occupancy_hwm > NUM_SLOTS) {
+        FAIL("counted %lu/%lu enqueues/dequeues and %lu/%lu full/empty, expected %lu/%lu and "
+             "%lu/%lu\n",
+             s.enqueues, s.dequeues, s.enqueue_full, s.dequeue_empty, e->model.enqueues,
+             e->model.dequeues, e->model.enqueue_full, e->model.dequeue_empty);
+    }
+}
+
+
+/*
+ * Sends a buffer of a random region the endpoint knows about, on a random path.
+ */
+static void send_random(struct endpoint *e, struct fifo *f)
+{
+    size_t i = rand() % NUM_REGIONS;
+    if (!regions[i].registered || !e->known[i] || f->num == FIFO_SIZE) {
+        return;
+    }
+
+    struct cleanq_buf b = { .rid = regions[i].rid,
+                            .offset = (rand() % (REGION_SIZE / BUF_SIZE)) * BUF_SIZE,
+                            .length = BUF_SIZE,
+                            .valid_data = rand() % 8,
+                            .valid_length = (rand() % (BUF_SIZE - 8)) + 1,
+                            .flags = f->seq };
+
+    errval_t err = send(e, &b, rand() % 2);
+    if (err == CLEANQ_ERR_QUEUE_FULL) {
+        e->model.enqueue_full++;
+        return;
+    }
+    if (err_is_fail(err)) {
+        FAIL("enqueue of buffer %lu of region %zu returned %d\n", f->seq, i, err);
+    }
+
+    e->model.enqueues++;
+    e->model.enqueue_bytes += b.valid_length;
+    f->bufs[(f->head + f->num) % FIFO_SIZE] = b;
+    f->num++;
+    f->seq++;
+    regions[i].in_flight++;
+}
+
+
+/*
+ * Receives the next buffer on a random path, the endpoint learns about new regions on the way.
+ */
+static void recv_random(struct endpoint *e, struct fifo *f)
+{
+    struct cleanq_buf b;
+    errval_t err = recv(e, &b, rand() % 2);
+
+    /* the commands of the other side are handled by every dequeue */
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        e->known[i] = regions[i].registered;
+    }
+
+    if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+        if (f->num) {
+            FAIL("the queue is empty with %zu buffers in flight\n", f->num);
+        }
+        e->model.dequeue_empty++;
+        return;
+    }
+
+    struct cleanq_buf *exp = &f->bufs[f->head];
+    if (err_is_fail(err) || f->num == 0 || b.rid != exp->rid || b.offset != exp->offset
+        || b.length != exp->length || b.valid_data != exp->valid_data
+        || b.valid_length != exp->valid_length || b.flags != exp->flags) {
+        FAIL("expected buffer %lu, got %lu err=%d\n", exp->flags, b.flags, err);
+    }
+
+    e->model.dequeues++;
+    e->model.dequeue_bytes += b.valid_length;
+    f->head = (f->head + 1) % FIFO_SIZE;
+    f->num--;
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        if (regions[i].registered && regions[i].rid == b.rid) {
+            regions[i].in_flight--;
+        }
+    }
+}
+
+
+/*
+ * Buffers outside of the regions are refused by the fast path and are not counted.
+ */
+static void send_invalid(struct endpoint *e)
+{
+    size_t i = rand() % NUM_REGIONS;
+    struct cleanq_buf b = { .rid = regions[i].rid, .offset = 0, .length = BUF_SIZE,
+                            .valid_data = 0, .valid_length = BUF_SIZE, .flags = 0 };
+
+    if (regions[i].registered) {
+        switch (rand() % 3) {
+        case 0:
+            b.offset = REGION_SIZE - BUF_SIZE + 1 + (rand() % BUF_SIZE);
+            break;
+        case 1:
+            b.length = REGION_SIZE + 1;
+            break;
+        default:
+            b.valid_data = 1 + (rand() % BUF_SIZE);
+            break;
+        }
+    } else {
+        /* the other side may not have handled a deregistration yet, it would take the id */
+        b.rid = unused_rid + (rand() % 16);
+    }
+
+    errval_t err = fast_enqueue(e, &b);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("fast enqueue of an invalid buffer in region %zu returned %d\n", i, err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Compact queues and endpoints shared by several threads have no fast path.
+ */
+static void test_not_supported(void)
+{
+    errval_t err;
+
+    struct cleanq_ffq_attr fattr = { .slots = NUM_SLOTS, .compact = true };
+    struct cleanq_ffq *fq;
+    struct cleanq_ffq_fast ff;
+    err = cleanq_ffq_create_with_attr(&fq, name, true, &fattr);
+    if (err_is_fail(err)) {
+        FAIL("creating a compact ffq failed %d\n", err);
+    }
+    err = cleanq_ffq_get_fast(fq, &ff);
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("obtaining the fast path of a compact ffq returned %d\n", err);
+    }
+    cleanq_destroy((struct cleanq *)fq);
+
+    static const struct cleanq_ipcq_attr iattrs[] = {
+        { .slots = NUM_SLOTS, .compact = true },
+        { .slots = NUM_SLOTS, .multi_producer = true },
+        { .slots = NUM_SLOTS, .multi_consumer = true },
+    };
+    for (size_t i = 0; i < sizeof(iattrs) / sizeof(iattrs[0]); i++) {
+        struct cleanq_ipcq *iq;
+        struct cleanq_ipcq_fast ipc;
+        err = cleanq_ipcq_create_with_attr(&iq, name, true, &iattrs[i]);
+        if (err_is_fail(err)) {
+            FAIL("creating ipcq %zu failed %d\n", i, err);
+        }
+        err = cleanq_ipcq_get_fast(iq, &ipc);
+        if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+            FAIL("obtaining the fast path of ipcq %zu returned %d\n", i, err);
+        }
+        cleanq_destroy((struct cleanq *)iq);
+    }
+}
+
+
+/*
+ * Both endpoints send and receive on the fast and the generic path in any mix, the order and
+ * the counters are the same as if only one of them was used. Regions come and go in between,
+ * more than the handles cache.
+ */
+static void test_mixed(bool ffq)
+{
+    struct endpoint creator, attacher;
+    struct fifo to_attacher = { .head = 0 }, to_creator = { .head = 0 };
+
+    alloc_regions();
+    create_endpoint(&creator, ffq, true);
+    create_endpoint(&attacher, ffq, false);
+
+    for (size_t i = 0; i < NUM_REGIONS / 2; i++) {
+        register_region(&creator, i);
+    }
+
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+        switch (rand() % 10) {
+        case 0:
+        case 1:
+            send_random(&creator, &to_attacher);
+            break;
+        case 2:
+        case 3:
+            send_random(&attacher, &to_creator);
+            break;
+        case 4:
+        case 5:
+            recv_random(&attacher, &to_attacher);
+            break;
+        case 6:
+        case 7:
+            recv_random(&creator, &to_creator);
+            break;
+        case 8:
+            send_invalid(rand() % 2 ? &creator : &attacher);
+            break;
+        default: {
+            /* regions in flight can't go away */
+            size_t i = rand() % NUM_REGIONS;
+            if (rand() % 100) {
+                break;
+            }
+            if (!regions[i].registered) {
+                register_region(&creator, i);
+            } else if (regions[i].in_flight == 0) {
+                struct capref cap;
+                errval_t err = cleanq_deregister(creator.q, regions[i].rid, &cap);
+                if (err_is_fail(err)) {
+                    FAIL("deregistering region %zu failed %d\n", i, err);
+                }
+                regions[i].registered = false;
+                creator.known[i] = false;
+                attacher.known[i] = false;
+            }
+            break;
+        }
+        }
+
+        if (round % 1000 == 0) {
+            check_stats(&creator);
+            check_stats(&attacher);
+        }
+    }
+
+    check_stats(&creator);
+    check_stats(&attacher);
+    if (!creator.model.enqueue_full || !attacher.model.dequeue_empty) {
+        FAIL("the rings have never been full and empty\n");
+    }
+
+    cleanq_destroy(attacher.q);
+    cleanq_destroy(creator.q);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        free(regions[i].cap.vaddr);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Answers every buffer on the fast path only, the registrations are handed over to the generic
+ * path behind its back.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct endpoint e;
+    create_endpoint(&e, ffq, false);
+
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf b;
+        err = fast_dequeue(&e, &b);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || b.flags != num_rx) {
+            FAIL("the echo side expected buffer %lu, got %lu err=%d\n", num_rx, b.flags, err);
+        }
+
+        while ((err = fast_enqueue(&e, &b)) == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+        num_rx++;
+    }
+
+    cleanq_destroy(e.q);
+    exit(0);
+}
+
+
+/*
+ * The buffers go to another process and back on the fast path of both sides. A new region is
+ * registered halfway through, and the buffers of both regions are valid on the echo side.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct endpoint e;
+
+    alloc_regions();
+    create_endpoint(&e, ffq, true);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    register_region(&e, 0);
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        if (num_tx == NUM_MSGS / 2 && !regions[1].registered) {
+            register_region(&e, 1);
+        }
+
+        struct cleanq_buf b;
+        if (num_tx < NUM_MSGS) {
+            size_t i = regions[1].registered ? num_tx % 2 : 0;
+            b = (struct cleanq_buf){ .rid = regions[i].rid,
+                                     .offset = (num_tx % (REGION_SIZE / BUF_SIZE)) * BUF_SIZE,
+                                     .length = BUF_SIZE,
+                                     .valid_data = 0,
+                                     .valid_length = BUF_SIZE,
+                                     .flags = num_tx };
+            err = fast_enqueue(&e, &b);
+            if (err_is_ok(err)) {
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("enqueue of buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        err = fast_dequeue(&e, &b);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        bool known = b.rid == regions[0].rid || (regions[1].registered && b.rid == regions[1].rid);
+        if (err_is_fail(err) || b.flags != num_rx || !known
+            || b.offset != (num_rx % (REGION_SIZE / BUF_SIZE)) * BUF_SIZE) {
+            FAIL("expected buffer %lu back, got %lu err=%d\n", num_rx, b.flags, err);
+        }
+        num_rx++;
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    test_join(pid);
+
+    struct cleanq_stats s;
+    cleanq_get_stats(e.q, &s);
+    if (s.enqueues != NUM_MSGS || s.dequeues != NUM_MSGS) {
+        FAIL("counted %lu enqueues and %lu dequeues of %d\n", s.enqueues, s.dequeues, NUM_MSGS);
+    }
+
+    cleanq_destroy(e.q);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        free(regions[i].cap.vaddr);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-fastpath-%d", getpid());
+
+    printf("Starting not supported test\n");
+    test_not_supported();
+
+    printf("Starting ipcq mixed test\n");
+    test_mixed(false);
+
+    printf("Starting ffq mixed test\n");
+    test_mixed(true);
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("fastpath test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "geometry"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< the number of slots the attaching side asks for, it gets the geometry of the creator
+#define ATTACH_SLOTS 8
+
+///< the number of slots of both backends if none is given
+#define DEFAULT_SLOTS 64
+
+#define MAX_BATCH 16
+
+///< the number of buffers sent each way through every geometry
+#define NUM_ROUNDS 20000
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the geometries each backend is created with
+struct geometry
+{
+    size_t slots;
+    size_t desc_size;
+    size_t desc_align;
+};
+
+static const struct geometry geometries[] = {
+    { 2, 0, 0 }, { 4, 128, 0 }, { 16, 192, 64 }, { 64, 256, 128 },
+    { 1024, 64, 64 }, { 4096, 0, 0 }, { 0, 128, 128 },
+};
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static errval_t create_queue(struct cleanq **queue, bool ffq, bool clear,
+                             const struct geometry *g)
+{
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { 0 };
+        attr.slots = g->slots;
+        attr.desc_size = g->desc_size;
+        attr.desc_align = g->desc_align;
+        return cleanq_ffq_create_with_attr((struct cleanq_ffq **)queue, name, clear, &attr);
+    }
+
+    struct cleanq_ipcq_attr attr = { 0 };
+    attr.slots = g->slots;
+    attr.desc_size = g->desc_size;
+    attr.desc_align = g->desc_align;
+    return cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)queue, name, clear, &attr);
+}
+
+
+static void fill_buf(struct cleanq_buf *b, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = (seq % NUM_BUFS) * BUF_SIZE;
+    b->length = BUF_SIZE;
+    b->valid_data = seq % 8;
+    b->valid_length = (seq % (BUF_SIZE - 8)) + 1;
+    b->flags = seq;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, uint64_t seq)
+{
+    if (b->rid != regid || b->offset != (seq % NUM_BUFS) * BUF_SIZE || b->length != BUF_SIZE
+        || b->valid_data != seq % 8 || b->valid_length != (seq % (BUF_SIZE - 8)) + 1
+        || b->flags != seq) {
+        FAIL("expected buffer %lu, got flags=%lu offset=%lu\n", seq, b->flags, b->offset);
+    }
+}
+
+
+/*
+ * Fills the ring from tx, which must take exactly slots descriptors, and drains it on rx.
+ */
+static void check_capacity(struct cleanq *tx, struct cleanq *rx, size_t slots)
+{
+    errval_t err;
+
+    size_t num = 0;
+    while ((err = cleanq_enqueue(tx, regid, (num % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE,
+                                 num))
+           == CLEANQ_ERR_OK) {
+        num++;
+        if (num > slots) {
+            FAIL("a ring of %zu slots takes more descriptors\n", slots);
+        }
+    }
+    if (err != CLEANQ_ERR_QUEUE_FULL || num != slots) {
+        FAIL("a ring of %zu slots took %zu descriptors, err=%d\n", slots, num, err);
+    }
+
+    for (size_t i = 0; i < slots; i++) {
+        struct cleanq_buf b;
+        err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err_is_fail(err) || b.flags != i) {
+            FAIL("draining a ring of %zu slots returned %d at %zu\n", slots, err, i);
+        }
+    }
+}
+
+
+/*
+ * Sends the buffers from tx to rx in batches of random size while the ring wraps around.
+ */
+static void check_wrap(struct cleanq *tx, struct cleanq *rx)
+{
+    errval_t err;
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+
+    while (num_rx < NUM_ROUNDS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num = (rand() % MAX_BATCH) + 1;
+        if (num > NUM_ROUNDS - num_tx) {
+            num = NUM_ROUNDS - num_tx;
+        }
+        for (size_t i = 0; i < num; i++) {
+            fill_buf(&bufs[i], num_tx + i);
+        }
+        size_t num_enq = 0;
+        if (num) {
+            err = cleanq_enqueue_batch(tx, bufs, num, &num_enq);
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            num_tx += num_enq;
+        }
+
+        size_t num_deq;
+        err = cleanq_dequeue_batch(rx, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_EMPTY) {
+            FAIL("receiving buffer %lu returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; err_is_ok(err) && i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx + i);
+        }
+        num_rx += err_is_ok(err) ? num_deq : 0;
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The creator checks the geometry before it creates the shared memory object.
+ */
+static void test_invalid(void)
+{
+    static const struct geometry ipcq_invalid[] = {
+        { 12, 0, 0 }, { 0, 32, 0 }, { 0, 0, 32 }, { 0, 96, 64 }, { 0, 128, 96 },
+    };
+    static const struct geometry ffq_invalid[] = {
+        { 12, 0, 0 }, { 0, 96, 0 }, { 0, 0, 32 }, { 0, 64, 128 },
+    };
+
+    for (int ffq = 0; ffq < 2; ffq++) {
+        const struct geometry *invalid = ffq ? ffq_invalid : ipcq_invalid;
+        size_t num = ffq ? sizeof(ffq_invalid) / sizeof(ffq_invalid[0])
+                         : sizeof(ipcq_invalid) / sizeof(ipcq_invalid[0]);
+        for (size_t i = 0; i < num; i++) {
+            struct cleanq *queue;
+            errval_t err = create_queue(&queue, ffq, true, &invalid[i]);
+            if (err != CLEANQ_ERR_INIT_QUEUE) {
+                FAIL("creating a %s with slots=%zu desc_size=%zu desc_align=%zu returned %d\n",
+                     ffq ? "ffq" : "ipcq", invalid[i].slots, invalid[i].desc_size,
+                     invalid[i].desc_align, err);
+            }
+        }
+    }
+
+    /* an inline message of the maximum length must fit into the ring */
+    struct cleanq_ipcq_attr attr = { .slots = 2, .inline_max = 1000 };
+    struct cleanq_ipcq *queue;
+    errval_t err = cleanq_ipcq_create_with_attr(&queue, name, true, &attr);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a queue too small for an inline message returned %d\n", err);
+    }
+}
+
+
+/*
+ * The attaching side takes the geometry from the header, whatever it asks for, and both
+ * directions hold exactly as many descriptors as the creator asked for.
+ */
+static void test_geometries(bool ffq)
+{
+    errval_t err;
+    const struct geometry attach = { ATTACH_SLOTS, 0, 0 };
+
+    for (size_t i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        const struct geometry *g = &geometries[i];
+        struct cleanq *creator, *other;
+
+        err = create_queue(&creator, ffq, true, g);
+        if (err_is_fail(err)) {
+            FAIL("creating a queue with %zu slots failed %d\n", g->slots, err);
+        }
+        err = create_queue(&other, ffq, false, &attach);
+        if (err_is_fail(err)) {
+            FAIL("attaching to a queue with %zu slots failed %d\n", g->slots, err);
+        }
+
+        err = cleanq_register(creator, memory, &regid);
+        if (err_is_fail(err)) {
+            FAIL("registering memory failed %d\n", err);
+        }
+
+        size_t slots = g->slots ? g->slots : DEFAULT_SLOTS;
+        check_capacity(creator, other, slots);
+        check_capacity(other, creator, slots);
+        check_wrap(creator, other);
+        check_wrap(other, creator);
+
+        cleanq_destroy(other);
+        cleanq_destroy(creator);
+    }
+}
+
+
+/*
+ * An object of another backend, or one the creator never initializes, is not attached to.
+ */
+static void test_header(void)
+{
+    errval_t err;
+    const struct geometry g = { 16, 0, 0 };
+
+    struct cleanq *creator, *other;
+    err = create_queue(&creator, false, true, &g);
+    if (err_is_fail(err)) {
+        FAIL("creating the queue failed %d\n", err);
+    }
+    err = create_queue(&other, true, false, &g);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("attaching an ffq to an ipcq returned %d\n", err);
+    }
+    cleanq_destroy(creator);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        FAIL("creating the shared memory object failed\n");
+    }
+    time_t start = time(NULL);
+    err = create_queue(&other, false, false, &g);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("attaching to an object without a header returned %d\n", err);
+    }
+    if (time(NULL) - start < 4) {
+        FAIL("attaching to an object without a header did not wait for the creator\n");
+    }
+    close(fd);
+    shm_unlink(name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+
+    snprintf(name, sizeof(name), "/cleanq-test-geometry-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting invalid geometry test\n");
+    test_invalid();
+
+    printf("Starting ffq geometry test\n");
+    test_geometries(true);
+
+    printf("Starting ipcq geometry test\n");
+    test_geometries(false);
+
+    printf("Starting header test\n");
+    test_header();
+
+    printf("geometry test passed\n");
+
+    return 0;
+}
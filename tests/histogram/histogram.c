@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/histogram.h>
+#include <cleanq/backends/loopback_queue.h>
+#include <cleanq/backends/thread_queue.h>
+#include <cleanq_backend.h>
+#include <cleanq_histogram.h>
+
+#define TEST_NAME "histogram"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 512
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< the number of descriptors the loopback queue holds
+#define LOOPBACK_SLOTS 64
+
+#define NUM_SLOTS 16
+
+///< the number of values recorded to check the percentiles against the exact ones
+#define NUM_VALUES 100000
+
+///< the number of single values checked against the bucket bounds
+#define NUM_SINGLE 10000
+
+///< the number of buffers sent to the echo thread and back
+#define NUM_MSGS 200000
+
+static struct capref memory;
+static regionid_t regid;
+
+static uint64_t values[NUM_VALUES];
+
+///< the ends of the thread queue, the second one is used by the echo thread
+static struct cleanq *end_a;
+static struct cleanq *end_b;
+
+///< the number of enqueue calls of the sender, each is recorded
+static uint64_t num_enq_calls;
+static bool done;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+///< a value of random magnitude up to the largest one the histograms resolve
+static uint64_t random_value(void)
+{
+    uint64_t v = ((uint64_t)rand() << 31) ^ rand();
+    return v >> (62 - CLEANQ_HIST_MAX_MAGNITUDE + rand() % CLEANQ_HIST_MAX_MAGNITUDE);
+}
+
+
+///< the reported value may be above the exact one by the width of its bucket
+static void check_close(uint64_t exact, uint64_t reported, const char *what)
+{
+    if (reported < exact || reported > exact + exact / CLEANQ_HIST_SUB_BUCKETS) {
+        FAIL("%s is %lu, expected %lu\n", what, reported, exact);
+    }
+}
+
+
+static int cmp_values(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+///< the value of the percentile as the histograms rank it
+static uint64_t exact_percentile(double pct)
+{
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)NUM_VALUES + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    } else if (rank > NUM_VALUES) {
+        rank = NUM_VALUES;
+    }
+    return values[rank - 1];
+}
+
+
+static uint64_t get_count(struct cleanq *q, cleanq_hist_op_t op)
+{
+    struct cleanq_latency lat;
+    errval_t err = cleanq_get_latency(q, op, &lat);
+    if (err_is_fail(err)) {
+        FAIL("obtaining the latency of operation %d failed %d\n", op, err);
+    }
+    return lat.count;
+}
+
+
+static void check_counts(struct cleanq *q, uint64_t enq, uint64_t deq, uint64_t reg,
+                         uint64_t dereg)
+{
+    if (get_count(q, CLEANQ_HIST_ENQUEUE) != enq || get_count(q, CLEANQ_HIST_DEQUEUE) != deq
+        || get_count(q, CLEANQ_HIST_REGISTER) != reg
+        || get_count(q, CLEANQ_HIST_DEREGISTER) != dereg) {
+        FAIL("recorded %lu/%lu/%lu/%lu operations, expected %lu/%lu/%lu/%lu\n",
+             get_count(q, CLEANQ_HIST_ENQUEUE), get_count(q, CLEANQ_HIST_DEQUEUE),
+             get_count(q, CLEANQ_HIST_REGISTER), get_count(q, CLEANQ_HIST_DEREGISTER), enq, deq,
+             reg, dereg);
+    }
+}
+
+
+static uint64_t control(struct cleanq *q, uint64_t request, uint64_t value)
+{
+    uint64_t result = 0;
+    errval_t err = cleanq_control(q, request, value, &result);
+    if (err_is_fail(err)) {
+        FAIL("control request %lu failed %d\n", request, err);
+    }
+    return result;
+}
+
+
+static struct cleanq *create_loopback(void)
+{
+    struct cleanq_loopbackq *lq;
+    errval_t err = loopback_queue_create(&lq);
+    if (err_is_fail(err)) {
+        FAIL("creating the loopback queue failed %d\n", err);
+    }
+    return (struct cleanq *)lq;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Larger values never go into an earlier bucket, and every value has a bucket.
+ */
+static void test_buckets(void)
+{
+    size_t last = 0;
+    for (uint64_t v = 0; v < 1 << 16; v++) {
+        size_t b = cleanq_histogram_bucket(v);
+        if (b < last || b > last + 1) {
+            FAIL("value %lu goes into bucket %zu after bucket %zu\n", v, b, last);
+        }
+        last = b;
+    }
+
+    for (size_t i = 0; i < NUM_VALUES; i++) {
+        uint64_t v = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+        uint64_t w = random_value();
+        size_t bv = cleanq_histogram_bucket(v);
+        size_t bw = cleanq_histogram_bucket(w);
+        if (bv >= CLEANQ_HIST_NUM_BUCKETS || bw >= CLEANQ_HIST_NUM_BUCKETS
+            || (v < w && bv > bw) || (w < v && bw > bv)) {
+            FAIL("values %lu and %lu go into buckets %zu and %zu\n", v, w, bv, bw);
+        }
+    }
+}
+
+
+/*
+ * The percentiles are within the error bound of the exact ones, the count, minimum, maximum
+ * and mean are exact. The values are recorded directly, with the histograms of the queue
+ * allocated but disabled so that nothing else is recorded.
+ */
+static void test_accuracy(void)
+{
+    errval_t err;
+    struct cleanq *q = create_loopback();
+
+    struct cleanq_latency lat;
+    err = cleanq_get_latency(q, CLEANQ_HIST_NUM_OPS, &lat);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("obtaining the latency of an unknown operation returned %d\n", err);
+    }
+
+    control(q, CLEANQ_CTRL_HISTOGRAM, 1);
+    control(q, CLEANQ_CTRL_HISTOGRAM, 0);
+    struct cleanq_histogram *h = &q->hist->h[CLEANQ_HIST_DEREGISTER];
+
+    /* with a much larger value next to it, the value is reported as the end of its bucket */
+    for (size_t i = 0; i < NUM_SINGLE; i++) {
+        uint64_t v = random_value();
+        control(q, CLEANQ_CTRL_HISTOGRAM_RESET, 0);
+        cleanq_histogram_record(h, v);
+        cleanq_histogram_record(h, 1UL << (CLEANQ_HIST_MAX_MAGNITUDE + 8));
+        check_close(v, cleanq_get_latency_percentile(q, CLEANQ_HIST_DEREGISTER, 50), "50th");
+    }
+
+    control(q, CLEANQ_CTRL_HISTOGRAM_RESET, 0);
+    err = cleanq_get_latency(q, CLEANQ_HIST_DEREGISTER, &lat);
+    if (err_is_fail(err) || lat.count || lat.min || lat.max || lat.p50 || lat.p999
+        || cleanq_get_latency_percentile(q, CLEANQ_HIST_DEREGISTER, 99)) {
+        FAIL("a histogram that has been reset is not empty\n");
+    }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < NUM_VALUES; i++) {
+        values[i] = random_value();
+        sum += values[i];
+        cleanq_histogram_record(h, values[i]);
+    }
+    qsort(values, NUM_VALUES, sizeof(values[0]), cmp_values);
+
+    err = cleanq_get_latency(q, CLEANQ_HIST_DEREGISTER, &lat);
+    if (err_is_fail(err) || lat.count != NUM_VALUES || lat.min != values[0]
+        || lat.max != values[NUM_VALUES - 1] || lat.mean != sum / NUM_VALUES) {
+        FAIL("the summary of %lu values does not match\n", lat.count);
+    }
+    check_close(exact_percentile(50), lat.p50, "p50");
+    check_close(exact_percentile(99), lat.p99, "p99");
+    check_close(exact_percentile(99.9), lat.p999, "p999");
+
+    static const double pcts[] = { 0, 1, 25, 50, 75, 90, 99, 99.9, 99.99, 100 };
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        check_close(exact_percentile(pcts[i]),
+                    cleanq_get_latency_percentile(q, CLEANQ_HIST_DEREGISTER, pcts[i]),
+                    "a percentile");
+    }
+
+    /* the other operations are not affected */
+    check_counts(q, 0, 0, 0, NUM_VALUES);
+
+    cleanq_destroy(q);
+}
+
+
+/*
+ * The histograms are switched on and off at runtime, each operation is recorded once while
+ * they are on. Dequeues that find the queue empty are not recorded.
+ */
+static void test_control(void)
+{
+    errval_t err;
+    struct cleanq *q = create_loopback();
+
+    check_counts(q, 0, 0, 0, 0);
+    if (control(q, CLEANQ_CTRL_HISTOGRAM, 1) != 0) {
+        FAIL("the histograms are enabled by default\n");
+    }
+
+    err = cleanq_register(q, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    size_t num = 0;
+    while ((err = cleanq_enqueue(q, regid, num * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE, 0))
+           == CLEANQ_ERR_OK) {
+        num++;
+    }
+    if (err != CLEANQ_ERR_QUEUE_FULL || num != LOOPBACK_SLOTS) {
+        FAIL("filling the queue returned %d after %zu buffers\n", err, num);
+    }
+    /* refused before it gets to the queue */
+    err = cleanq_enqueue(q, regid + 1, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue of an unknown region returned %d\n", err);
+    }
+
+    struct cleanq_buf b;
+    for (size_t i = 0; i <= num; i++) {
+        err = cleanq_dequeue(q, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if ((i < num && err_is_fail(err)) || (i == num && err != CLEANQ_ERR_QUEUE_EMPTY)) {
+            FAIL("dequeue %zu returned %d\n", i, err);
+        }
+    }
+    check_counts(q, num + 1, num, 1, 0);
+
+    if (control(q, CLEANQ_CTRL_HISTOGRAM, 0) != 1) {
+        FAIL("disabling the histograms does not return that they were enabled\n");
+    }
+    for (size_t i = 0; i < 2; i++) {
+        cleanq_enqueue(q, regid, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+        cleanq_dequeue(q, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                       &b.flags);
+    }
+    check_counts(q, num + 1, num, 1, 0);
+
+    control(q, CLEANQ_CTRL_HISTOGRAM_RESET, 0);
+    check_counts(q, 0, 0, 0, 0);
+
+    control(q, CLEANQ_CTRL_HISTOGRAM, 1);
+    struct capref cap;
+    err = cleanq_deregister(q, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering memory failed %d\n", err);
+    }
+    check_counts(q, 0, 0, 0, 1);
+
+    struct cleanq_latency lat;
+    err = cleanq_get_latency(q, CLEANQ_HIST_DEREGISTER, &lat);
+    if (err_is_fail(err) || lat.min > lat.p50 || lat.p50 > lat.max || lat.min != lat.max) {
+        FAIL("the summary of a single deregister does not match\n");
+    }
+
+    cleanq_destroy(q);
+}
+
+
+/*
+ * ================================================================================================
+ * Concurrent Readers
+ * ================================================================================================
+ */
+
+
+static void *echo_thread(void *arg)
+{
+    (void)(arg);
+
+    uint64_t num = 0;
+    while (num < NUM_MSGS) {
+        struct cleanq_buf b;
+        errval_t err = cleanq_dequeue(end_b, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                      &b.valid_length, &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("echo dequeue returned %d\n", err);
+        }
+
+        while ((err = cleanq_enqueue(end_b, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("echo enqueue returned %d\n", err);
+        }
+        num++;
+    }
+
+    return NULL;
+}
+
+
+static void *send_thread(void *arg)
+{
+    (void)(arg);
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        errval_t err;
+        if (num_tx < NUM_MSGS) {
+            err = cleanq_enqueue(end_a, regid, (num_tx % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0,
+                                 BUF_SIZE, num_tx);
+            __atomic_store_n(&num_enq_calls, num_enq_calls + 1, __ATOMIC_RELAXED);
+            if (err_is_ok(err)) {
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("enqueue of buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        struct cleanq_buf b;
+        err = cleanq_dequeue(end_a, &b.rid, &b.offset, &b.length, &b.valid_data,
+                             &b.valid_length, &b.flags);
+        if (err_is_ok(err)) {
+            if (b.flags != num_rx) {
+                FAIL("expected buffer %lu, got %lu\n", num_rx, b.flags);
+            }
+            num_rx++;
+        } else if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+        } else {
+            FAIL("dequeue of buffer %lu returned %d\n", num_rx, err);
+        }
+    }
+
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+///< the summary of a histogram is taken from a consistent snapshot of its buckets
+static void check_snapshot(struct cleanq *q, cleanq_hist_op_t op, uint64_t *last_count)
+{
+    struct cleanq_latency lat;
+    errval_t err = cleanq_get_latency(q, op, &lat);
+    if (err_is_fail(err)) {
+        FAIL("obtaining the latency concurrently failed %d\n", err);
+    }
+    if (lat.count < *last_count || lat.p50 > lat.p99 || lat.p99 > lat.p999) {
+        FAIL("read count=%lu p50=%lu p99=%lu p999=%lu after count=%lu\n", lat.count, lat.p50,
+             lat.p99, lat.p999, *last_count);
+    }
+    *last_count = lat.count;
+}
+
+
+/*
+ * The histograms are read while both ends of a thread queue record into them, and those of
+ * the echo side are switched on and off behind its back. None of the records of the sending
+ * side are lost.
+ */
+static void test_concurrent(void)
+{
+    errval_t err;
+    struct cleanq_threadq *a, *b;
+
+    err = cleanq_threadq_create(&a, &b, NUM_SLOTS);
+    if (err_is_fail(err)) {
+        FAIL("creating the thread queue failed %d\n", err);
+    }
+    end_a = (struct cleanq *)a;
+    end_b = (struct cleanq *)b;
+
+    err = cleanq_register(end_a, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+    control(end_a, CLEANQ_CTRL_HISTOGRAM, 1);
+    control(end_b, CLEANQ_CTRL_HISTOGRAM, 1);
+
+    pthread_t sender, echo;
+    if (pthread_create(&echo, NULL, echo_thread, NULL)
+        || pthread_create(&sender, NULL, send_thread, NULL)) {
+        FAIL("creating the threads failed\n");
+    }
+
+    uint64_t counts[4] = { 0 };
+    size_t round = 0;
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        check_snapshot(end_a, CLEANQ_HIST_ENQUEUE, &counts[0]);
+        check_snapshot(end_a, CLEANQ_HIST_DEQUEUE, &counts[1]);
+        check_snapshot(end_b, CLEANQ_HIST_ENQUEUE, &counts[2]);
+        check_snapshot(end_b, CLEANQ_HIST_DEQUEUE, &counts[3]);
+        if (++round % 16 == 0) {
+            control(end_b, CLEANQ_CTRL_HISTOGRAM, rand() % 2);
+        }
+        sched_yield();
+    }
+
+    pthread_join(sender, NULL);
+    pthread_join(echo, NULL);
+
+    if (get_count(end_a, CLEANQ_HIST_ENQUEUE) != num_enq_calls
+        || get_count(end_a, CLEANQ_HIST_DEQUEUE) != NUM_MSGS) {
+        FAIL("the sender recorded %lu enqueues of %lu and %lu dequeues of %d\n",
+             get_count(end_a, CLEANQ_HIST_ENQUEUE), num_enq_calls,
+             get_count(end_a, CLEANQ_HIST_DEQUEUE), NUM_MSGS);
+    }
+    if (get_count(end_b, CLEANQ_HIST_DEQUEUE) > NUM_MSGS
+        || get_count(end_b, CLEANQ_HIST_ENQUEUE) > NUM_MSGS) {
+        FAIL("the echo side recorded more operations than it did\n");
+    }
+
+    cleanq_destroy(end_b);
+    cleanq_destroy(end_a);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting bucket test\n");
+    test_buckets();
+
+    printf("Starting accuracy test\n");
+    test_accuracy();
+
+    printf("Starting control test\n");
+    test_control();
+
+    printf("Starting concurrent test\n");
+    test_concurrent();
+
+    printf("histogram test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <mntent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "hugepage"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 20000
+
+///< the huge pages the test needs at most at the same time
+#define NUM_HUGE_PAGES 4
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+///< the size of a huge page and whether there are enough of them in the hugetlb pool
+static size_t huge_page_size;
+static bool hugetlb;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+///< reads a value from a file of the form of /proc/meminfo
+static unsigned long read_value(const char *path, const char *key)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        FAIL("opening %s failed\n", path);
+    }
+
+    char line[128];
+    unsigned long value = 0;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, len) == 0) {
+            value = strtoul(line + len, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+
+    return value;
+}
+
+
+///< the huge pages of the pool that are neither used nor reserved
+static unsigned long huge_pages_available(void)
+{
+    return read_value("/proc/meminfo", "HugePages_Free:")
+           - read_value("/proc/meminfo", "HugePages_Rsvd:");
+}
+
+
+///< the locked memory of this process in kB
+static unsigned long locked_kb(void)
+{
+    return read_value("/proc/self/status", "VmLck:");
+}
+
+
+///< builds the path of the queue object on the hugetlbfs mount, returns false if there is none
+static bool hugetlbfs_path(char *path, size_t size)
+{
+    FILE *f = setmntent("/proc/mounts", "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    struct mntent *m;
+    while ((m = getmntent(f)) != NULL) {
+        if (strcmp(m->mnt_type, "hugetlbfs") == 0) {
+            snprintf(path, size, "%s/%s", m->mnt_dir, name + 1);
+            found = true;
+            break;
+        }
+    }
+    endmntent(f);
+
+    return found;
+}
+
+
+///< checks if all pages of the memory are present
+static bool is_resident(void *addr, size_t len)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t num = (len + page - 1) / page;
+    unsigned char *vec = malloc(num);
+    if (mincore(addr, len, vec)) {
+        FAIL("mincore failed\n");
+    }
+
+    bool resident = true;
+    for (size_t i = 0; i < num; i++) {
+        resident = resident && (vec[i] & 1);
+    }
+    free(vec);
+
+    return resident;
+}
+
+
+static errval_t create_queue(struct cleanq **queue, bool ffq, bool clear, uint32_t mem_flags)
+{
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS, .mem_flags = mem_flags };
+        return cleanq_ffq_create_with_attr((struct cleanq_ffq **)queue, name, clear, &attr);
+    }
+
+    struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS, .mem_flags = mem_flags };
+    return cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)queue, name, clear, &attr);
+}
+
+
+static void send_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err;
+    while ((err = cleanq_enqueue(queue, b->rid, b->offset, b->length, b->valid_data,
+                                 b->valid_length, b->flags))
+           == CLEANQ_ERR_QUEUE_FULL) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("sending buffer %lu returned %d\n", b->flags, err);
+    }
+}
+
+
+static void recv_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err;
+    while ((err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                 &b->valid_length, &b->flags))
+           == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("receiving a buffer returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Regions are rounded up to huge pages for THP and HUGETLB, the latter takes them from the pool.
+ * PREFAULT and LOCK leave no page to be faulted in, LOCK also locks them.
+ */
+static void test_regions(void)
+{
+    errval_t err;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    uint32_t flags[] = { 0,
+                         CLEANQ_MEM_THP,
+                         CLEANQ_MEM_PREFAULT,
+                         CLEANQ_MEM_LOCK,
+                         CLEANQ_MEM_THP | CLEANQ_MEM_LOCK,
+                         CLEANQ_MEM_HUGETLB,
+                         CLEANQ_MEM_HUGETLB | CLEANQ_MEM_LOCK };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        unsigned long avail = huge_pages_available();
+        unsigned long locked = locked_kb();
+
+        struct capref cap;
+        err = cleanq_memfd_alloc_with_flags(&cap, MEMORY_SIZE + 1, flags[i]);
+        if ((flags[i] & CLEANQ_MEM_HUGETLB) && !hugetlb) {
+            if (avail == 0 && err != CLEANQ_ERR_MALLOC_FAIL) {
+                FAIL("allocating huge pages without a hugetlb pool returned %d\n", err);
+            }
+            if (err_is_ok(err)) {
+                cleanq_memfd_free(&cap);
+            }
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("allocating a region with flags %x failed %d\n", flags[i], err);
+        }
+
+        size_t align = (flags[i] & (CLEANQ_MEM_THP | CLEANQ_MEM_HUGETLB)) ? huge_page_size : page;
+        if (cap.len != (MEMORY_SIZE + align) / align * align) {
+            FAIL("the region with flags %x has %lu bytes\n", flags[i], cap.len);
+        }
+        if ((flags[i] & (CLEANQ_MEM_PREFAULT | CLEANQ_MEM_LOCK))
+            && !is_resident(cap.vaddr, cap.len)) {
+            FAIL("the region with flags %x is not prefaulted\n", flags[i]);
+        }
+        if ((flags[i] & CLEANQ_MEM_HUGETLB) && avail - huge_pages_available() != cap.len / align) {
+            FAIL("the region has not taken %lu pages from the pool\n", cap.len / align);
+        }
+        if ((flags[i] & CLEANQ_MEM_LOCK) && !(flags[i] & CLEANQ_MEM_HUGETLB)
+            && locked_kb() - locked < cap.len / 1024) {
+            FAIL("the region with flags %x is not locked\n", flags[i]);
+        }
+
+        /* the memory is zeroed and writable */
+        for (size_t j = 0; j < cap.len; j += page) {
+            if (((uint8_t *)cap.vaddr)[j] != 0) {
+                FAIL("the memory of a new region is not zeroed\n");
+            }
+        }
+        memset(cap.vaddr, 0xab, cap.len);
+
+        err = cleanq_memfd_free(&cap);
+        if (err_is_fail(err)) {
+            FAIL("freeing a region failed %d\n", err);
+        }
+        if (huge_pages_available() != avail || locked_kb() != locked) {
+            FAIL("freeing the region with flags %x has not released its pages\n", flags[i]);
+        }
+    }
+}
+
+
+/*
+ * Both sides of a queue back the rings the same way. HUGETLB puts the object on the hugetlbfs
+ * mount and takes its pages from the pool until both sides have destroyed the queue.
+ */
+static void test_rings(bool ffq)
+{
+    errval_t err;
+
+    struct capref memory;
+    err = cleanq_memfd_alloc(&memory, MEMORY_SIZE);
+    if (err_is_fail(err)) {
+        FAIL("allocating the memory failed %d\n", err);
+    }
+
+    uint32_t flags[] = { CLEANQ_MEM_THP, CLEANQ_MEM_PREFAULT, CLEANQ_MEM_LOCK,
+                         CLEANQ_MEM_HUGETLB, CLEANQ_MEM_HUGETLB | CLEANQ_MEM_LOCK };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        unsigned long avail = huge_pages_available();
+        unsigned long locked = locked_kb();
+
+        struct cleanq *tx, *rx;
+        err = create_queue(&tx, ffq, true, flags[i]);
+        if ((flags[i] & CLEANQ_MEM_HUGETLB) && !hugetlb) {
+            if (avail == 0 && err != CLEANQ_ERR_INIT_QUEUE) {
+                FAIL("creating a queue without a hugetlb pool returned %d\n", err);
+            }
+            if (err_is_ok(err)) {
+                cleanq_destroy(tx);
+            }
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("creating a queue with flags %x failed %d\n", flags[i], err);
+        }
+        err = create_queue(&rx, ffq, false, flags[i]);
+        if (err_is_fail(err)) {
+            FAIL("attaching to a queue with flags %x failed %d\n", flags[i], err);
+        }
+
+        if (flags[i] & CLEANQ_MEM_HUGETLB) {
+            char path[128];
+            if (!hugetlbfs_path(path, sizeof(path)) || access(path, F_OK)) {
+                FAIL("the queue object is not on the hugetlbfs mount\n");
+            }
+            if (huge_pages_available() >= avail) {
+                FAIL("the queue has not taken pages from the pool\n");
+            }
+        }
+        if ((flags[i] & CLEANQ_MEM_LOCK) && !(flags[i] & CLEANQ_MEM_HUGETLB)
+            && locked_kb() <= locked) {
+            FAIL("the rings with flags %x are not locked\n", flags[i]);
+        }
+
+        /* the region is shared, the receiving side answers through its own mapping */
+        regionid_t regid;
+        err = cleanq_register(tx, memory, &regid);
+        if (err_is_fail(err)) {
+            FAIL("registering memory failed %d\n", err);
+        }
+        for (uint64_t seq = 0; seq < 4 * NUM_SLOTS; seq++) {
+            struct cleanq_buf b = { .rid = regid, .offset = (seq % NUM_BUFS) * BUF_SIZE,
+                                    .length = BUF_SIZE, .valid_length = BUF_SIZE,
+                                    .flags = seq };
+            send_buf(tx, &b);
+            recv_buf(rx, &b);
+            if (b.flags != seq || b.rid != regid) {
+                FAIL("expected buffer %lu, got %lu\n", seq, b.flags);
+            }
+        }
+
+        cleanq_destroy(rx);
+        cleanq_destroy(tx);
+        if (huge_pages_available() != avail || locked_kb() != locked) {
+            FAIL("destroying the queue with flags %x has not released its pages\n", flags[i]);
+        }
+    }
+
+    cleanq_memfd_free(&memory);
+}
+
+
+/*
+ * Above RLIMIT_MEMLOCK neither regions nor rings can be locked. Privileged processes are not
+ * limited, there is nothing to check then.
+ */
+static void test_limit(void)
+{
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        struct rlimit limit = { .rlim_cur = 0, .rlim_max = 0 };
+        if (setrlimit(RLIMIT_MEMLOCK, &limit)) {
+            FAIL("lowering the limit of locked memory failed\n");
+        }
+
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        void *probe = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                           0);
+        if (mlock(probe, page) == 0) {
+            printf("Locked memory is not limited, skipping limit test\n");
+            exit(0);
+        }
+
+        struct capref cap;
+        errval_t err = cleanq_memfd_alloc_with_flags(&cap, MEMORY_SIZE, CLEANQ_MEM_LOCK);
+        if (err != CLEANQ_ERR_MALLOC_FAIL) {
+            FAIL("allocating locked memory above the limit returned %d\n", err);
+        }
+
+        for (int ffq = 0; ffq < 2; ffq++) {
+            struct cleanq *queue;
+            err = create_queue(&queue, ffq, true, CLEANQ_MEM_LOCK);
+            if (err != CLEANQ_ERR_INIT_QUEUE) {
+                FAIL("creating locked rings above the limit returned %d\n", err);
+            }
+
+            /* the failed creation has removed the object again */
+            err = create_queue(&queue, ffq, true, CLEANQ_MEM_PREFAULT);
+            if (err_is_fail(err)) {
+                FAIL("creating the queue without locking failed %d\n", err);
+            }
+            cleanq_destroy(queue);
+        }
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        exit(1);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static struct capref echo_memory;
+static regionid_t echo_regid;
+
+
+static errval_t echo_register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    echo_memory = cap;
+    echo_regid = region_id;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * Locks its own mapping of the rings and answers every buffer in place.
+ */
+static void echo(bool ffq, uint32_t mem_flags)
+{
+    struct cleanq *queue;
+    errval_t err = create_queue(&queue, ffq, false, mem_flags);
+    if (err_is_fail(err)) {
+        FAIL("attaching the echo side failed %d\n", err);
+    }
+    cleanq_set_register_callback(queue, echo_register_cb);
+
+    for (uint64_t seq = 0; seq < NUM_MSGS; seq++) {
+        struct cleanq_buf b;
+        recv_buf(queue, &b);
+
+        uint64_t *data = (uint64_t *)((uint8_t *)echo_memory.vaddr + b.offset);
+        if (b.rid != echo_regid || b.flags != seq || *data != seq) {
+            FAIL("the echo side expected buffer %lu, got %lu\n", seq, b.flags);
+        }
+        *data = ~seq;
+
+        send_buf(queue, &b);
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * The rings and the region are backed by huge pages if the pool has them, and transparent huge
+ * pages otherwise. Both processes lock their mappings and keep the rings busy.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    uint32_t mem_flags = (hugetlb ? CLEANQ_MEM_HUGETLB : CLEANQ_MEM_THP) | CLEANQ_MEM_LOCK;
+
+    struct capref memory;
+    err = cleanq_memfd_alloc_with_flags(&memory, MEMORY_SIZE, mem_flags);
+    if (err_is_fail(err)) {
+        FAIL("allocating the memory failed %d\n", err);
+    }
+
+    struct cleanq *queue;
+    err = create_queue(&queue, ffq, true, mem_flags);
+    if (err_is_fail(err)) {
+        FAIL("creating the queue failed %d\n", err);
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq, mem_flags);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    regionid_t regid;
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        if (num_tx < NUM_MSGS && num_tx - num_rx < NUM_BUFS) {
+            genoffset_t offset = (num_tx % NUM_BUFS) * BUF_SIZE;
+            *(uint64_t *)((uint8_t *)memory.vaddr + offset) = num_tx;
+            err = cleanq_enqueue(queue, regid, offset, BUF_SIZE, 0, BUF_SIZE, num_tx);
+            if (err_is_ok(err)) {
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        uint64_t *data = (uint64_t *)((uint8_t *)memory.vaddr + b.offset);
+        if (err_is_fail(err) || b.flags != num_rx || *data != ~num_rx) {
+            FAIL("expected buffer %lu back, got %lu err=%d\n", num_rx, b.flags, err);
+        }
+        num_rx++;
+    }
+
+    test_join(pid);
+
+    err = cleanq_deregister(queue, regid, &memory);
+    if (err_is_fail(err)) {
+        FAIL("deregistering memory failed %d\n", err);
+    }
+    cleanq_destroy(queue);
+    cleanq_memfd_free(&memory);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-hugepage-%d", getpid());
+
+    huge_page_size = read_value("/proc/meminfo", "Hugepagesize:") << 10;
+    if (huge_page_size == 0) {
+        huge_page_size = 2UL << 20;
+    }
+
+    char path[128];
+    hugetlb = hugetlbfs_path(path, sizeof(path)) && huge_pages_available() >= NUM_HUGE_PAGES;
+    if (!hugetlb) {
+        printf("The hugetlb pool has less than %d pages, skipping the hugetlb checks\n",
+               NUM_HUGE_PAGES);
+    }
+
+    printf("Starting regions test\n");
+    test_regions();
+
+    printf("Starting ipcq rings test\n");
+    test_rings(false);
+
+    printf("Starting ffq rings test\n");
+    test_rings(true);
+
+    printf("Starting limit test\n");
+    test_limit();
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("hugepage test passed\n");
+
+    return 0;
+}
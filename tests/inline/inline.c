@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+
+#define TEST_NAME "inline"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< a message size spanning many slots
+#define LARGE_INLINE_MAX 1000
+
+#define MAX_MSG 2048
+
+///< more than fit into the ring, the sender stops at a full queue
+#define MAX_BURST 80
+
+#define NUM_ROUNDS 2000
+
+#define NUM_THREADS 2
+
+///< the number of messages every producer thread sends
+#define NUM_MSGS 20000
+
+///< a message in flight, either inline data or a buffer
+struct msg
+{
+    bool is_inline;
+    size_t len;
+    uint64_t seq;
+};
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the endpoints of the threaded test
+static struct cleanq *tx_que;
+static struct cleanq *rx_que;
+
+///< the number of messages received by all consumers
+static uint64_t num_rx;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void fill_data(uint8_t *data, size_t len, uint64_t seq)
+{
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (uint8_t)(seq * 31 + i * 7);
+    }
+}
+
+
+static void check_data(const uint8_t *data, size_t len, uint64_t seq)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != (uint8_t)(seq * 31 + i * 7)) {
+            FAIL("message %lu of %zu bytes is corrupted at %zu\n", seq, len, i);
+        }
+    }
+}
+
+
+static uint64_t msg_tag(uint64_t producer, uint64_t seq)
+{
+    return (producer << 32) | seq;
+}
+
+
+/*
+ * Creates both endpoints of a queue in this process, the second one connects to the first.
+ */
+static void create_pair(struct cleanq **tx, struct cleanq **rx, const char *q_name, bool ipc,
+                        size_t inline_max, bool multi)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-inline-%s-%d", q_name, getpid());
+
+    if (ipc) {
+        struct cleanq_ipcq_attr attr = { 0 };
+        attr.inline_max = inline_max;
+        attr.multi_producer = multi;
+        attr.multi_consumer = multi;
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)tx, name, true, &attr);
+        if (err_is_ok(err)) {
+            err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)rx, name, false, &attr);
+        }
+    } else {
+        struct cleanq_ffq_attr attr = { 0 };
+        attr.inline_max = inline_max;
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)tx, name, true, &attr);
+        if (err_is_ok(err)) {
+            err = cleanq_ffq_create((struct cleanq_ffq **)rx, name, false);
+        }
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+}
+
+
+/*
+ * Both endpoints agree on the maximum length of an inline message.
+ */
+static size_t get_inline_max(struct cleanq *tx, struct cleanq *rx)
+{
+    uint64_t tx_max, rx_max;
+    if (err_is_fail(cleanq_control(tx, CLEANQ_CTRL_INLINE_MAX, 0, &tx_max))
+        || err_is_fail(cleanq_control(rx, CLEANQ_CTRL_INLINE_MAX, 0, &rx_max))) {
+        FAIL("querying the inline maximum failed\n");
+    }
+    if (tx_max != rx_max) {
+        FAIL("the endpoints have an inline maximum of %lu and %lu\n", tx_max, rx_max);
+    }
+
+    return tx_max;
+}
+
+
+static errval_t send_msg(struct cleanq *queue, const struct msg *m)
+{
+    if (m->is_inline) {
+        uint8_t data[MAX_MSG];
+        fill_data(data, m->len, m->seq);
+        return cleanq_enqueue_inline(queue, data, m->len);
+    }
+
+    return cleanq_enqueue(queue, regid, (m->seq % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0, m->len,
+                          m->seq);
+}
+
+
+/*
+ * Receives the next message, which must be the expected one. The receive call is picked at
+ * random, the wrong one tells what kind of message is next without taking it.
+ */
+static void recv_msg(struct cleanq *queue, const struct msg *m)
+{
+    errval_t err;
+    bool as_inline = rand() % 2;
+
+    if (as_inline != m->is_inline) {
+        if (as_inline) {
+            uint8_t data[MAX_MSG];
+            size_t len;
+            err = cleanq_dequeue_inline(queue, data, sizeof(data), &len);
+            if (err != CLEANQ_ERR_BUFFER_PENDING) {
+                FAIL("receiving inline data before buffer %lu returned %d\n", m->seq, err);
+            }
+        } else {
+            struct cleanq_buf b;
+            err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags);
+            if (err != CLEANQ_ERR_INLINE_PENDING) {
+                FAIL("receiving a buffer before inline message %lu returned %d\n", m->seq, err);
+            }
+        }
+    }
+
+    if (m->is_inline) {
+        uint8_t data[MAX_MSG];
+        size_t len;
+        err = cleanq_dequeue_inline(queue, data, sizeof(data), &len);
+        if (err_is_fail(err) || len != m->len) {
+            FAIL("inline message %lu returned %d with %zu instead of %zu bytes\n", m->seq, err,
+                 len, m->len);
+        }
+        check_data(data, len, m->seq);
+    } else {
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                             &b.valid_length, &b.flags);
+        if (err_is_fail(err) || b.flags != m->seq || b.valid_length != m->len
+            || b.offset != (m->seq % NUM_BUFS) * BUF_SIZE) {
+            FAIL("buffer %lu returned %d with flags=%lu valid_length=%lu\n", m->seq, err,
+                 b.flags, b.valid_length);
+        }
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Messages above the maximum are refused. A receive buffer that is too small gets the length of
+ * the message, which stays in the queue. A batch of buffers ends before an inline message.
+ */
+static void test_limits(struct cleanq *tx, struct cleanq *rx, size_t max)
+{
+    errval_t err;
+    uint8_t data[MAX_MSG] = { 0 };
+    size_t len;
+
+    err = cleanq_enqueue_inline(tx, data, max + 1);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("sending %zu bytes inline returned %d\n", max + 1, err);
+    }
+    err = cleanq_dequeue_inline(rx, data, sizeof(data), &len);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("receiving from an empty queue returned %d\n", err);
+    }
+
+    struct msg msgs[] = {
+        { .is_inline = false, .len = 11, .seq = 1 },
+        { .is_inline = false, .len = 12, .seq = 2 },
+        { .is_inline = true, .len = max, .seq = 3 },
+        { .is_inline = true, .len = 0, .seq = 4 },
+        { .is_inline = false, .len = 13, .seq = 5 },
+    };
+    for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); i++) {
+        err = send_msg(tx, &msgs[i]);
+        if (err_is_fail(err)) {
+            FAIL("sending message %zu returned %d\n", i, err);
+        }
+    }
+
+    struct cleanq_buf bufs[8];
+    size_t num_deq;
+    err = cleanq_dequeue_batch(rx, bufs, 8, &num_deq);
+    if (err_is_fail(err) || num_deq != 2 || bufs[1].flags != 2) {
+        FAIL("a batch before an inline message returned %d with %zu buffers\n", err, num_deq);
+    }
+    err = cleanq_dequeue_batch(rx, bufs, 8, &num_deq);
+    if (err != CLEANQ_ERR_INLINE_PENDING || num_deq != 0) {
+        FAIL("a batch at an inline message returned %d with %zu buffers\n", err, num_deq);
+    }
+
+    if (max > 0) {
+        err = cleanq_dequeue_inline(rx, data, max - 1, &len);
+        if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS || len != max) {
+            FAIL("receiving into a small buffer returned %d with %zu bytes\n", err, len);
+        }
+    }
+    recv_msg(rx, &msgs[2]);
+    recv_msg(rx, &msgs[3]);
+    recv_msg(rx, &msgs[4]);
+
+    err = cleanq_dequeue_inline(rx, data, sizeof(data), &len);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("receiving from a drained queue returned %d\n", err);
+    }
+}
+
+
+/*
+ * Sends bursts of inline messages of random length and buffers until the queue is full, and
+ * receives them in the same order with intact data.
+ */
+static void test_randomized(struct cleanq *tx, struct cleanq *rx, size_t max)
+{
+    errval_t err;
+    struct msg msgs[MAX_BURST];
+    uint64_t seq = 0;
+
+    for (int i = 0; i < NUM_ROUNDS; i++) {
+        size_t burst = (rand() % MAX_BURST) + 1;
+        size_t num = 0;
+
+        while (num < burst) {
+            msgs[num].is_inline = rand() % 4;
+            msgs[num].len = msgs[num].is_inline ? (size_t)rand() % (max + 1)
+                                                : (size_t)(rand() % BUF_SIZE) + 1;
+            msgs[num].seq = seq;
+
+            err = send_msg(tx, &msgs[num]);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                break;
+            }
+            if (err_is_fail(err)) {
+                FAIL("sending message %lu returned %d\n", seq, err);
+            }
+            num++;
+            seq++;
+        }
+
+        for (size_t j = 0; j < num; j++) {
+            recv_msg(rx, &msgs[j]);
+        }
+    }
+}
+
+
+/*
+ * Producers send inline messages of random length tagged with the producer and sequence number,
+ * the consumers check their content and that the messages of a producer arrive in order.
+ */
+static void *producer_thread(void *arg)
+{
+    uint64_t producer = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + producer;
+    uint8_t data[MAX_MSG];
+
+    for (uint64_t seq = 0; seq < NUM_MSGS; seq++) {
+        size_t len = sizeof(uint64_t) + rand_r(&seed) % (LARGE_INLINE_MAX - sizeof(uint64_t));
+        uint64_t tag = msg_tag(producer, seq);
+        memcpy(data, &tag, sizeof(tag));
+        fill_data(data + sizeof(tag), len - sizeof(tag), tag);
+
+        errval_t err;
+        while ((err = cleanq_enqueue_inline(tx_que, data, len)) == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("producer %lu sending message %lu returned %d\n", producer, seq, err);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *consumer_thread(void *arg)
+{
+    uint64_t consumer = (uintptr_t)arg;
+    int64_t last[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        last[i] = -1;
+    }
+
+    uint8_t data[MAX_MSG];
+    while (__atomic_load_n(&num_rx, __ATOMIC_RELAXED) < NUM_THREADS * NUM_MSGS) {
+        size_t len;
+        errval_t err = cleanq_dequeue_inline(rx_que, data, sizeof(data), &len);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || len < sizeof(uint64_t)) {
+            FAIL("consumer %lu receiving returned %d with %zu bytes\n", consumer, err, len);
+        }
+
+        uint64_t tag;
+        memcpy(&tag, data, sizeof(tag));
+        uint64_t producer = tag >> 32;
+        int64_t seq = tag & 0xffffffff;
+        if (producer >= NUM_THREADS || seq <= last[producer]) {
+            FAIL("consumer %lu got message %lx after %ld\n", consumer, tag, last[producer]);
+        }
+        check_data(data + sizeof(tag), len - sizeof(tag), tag);
+        last[producer] = seq;
+
+        __atomic_fetch_add(&num_rx, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+static void test_threads(void)
+{
+    create_pair(&tx_que, &rx_que, "mpmc", true, LARGE_INLINE_MAX, true);
+    if (get_inline_max(tx_que, rx_que) != LARGE_INLINE_MAX) {
+        FAIL("the inline maximum of the multi producer queue is not %d\n", LARGE_INLINE_MAX);
+    }
+
+    pthread_t threads[2 * NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, producer_thread, (void *)i)
+            || pthread_create(&threads[NUM_THREADS + i], NULL, consumer_thread, (void *)i)) {
+            FAIL("creating thread %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; i < 2 * NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (num_rx != NUM_THREADS * NUM_MSGS) {
+        FAIL("received %lu messages instead of %d\n", num_rx, NUM_THREADS * NUM_MSGS);
+    }
+
+    cleanq_destroy(rx_que);
+    cleanq_destroy(tx_que);
+}
+
+
+/*
+ * Queues without room for inline data in their slots refuse inline messages.
+ */
+static void test_unsupported(void)
+{
+    errval_t err;
+    uint8_t data[8] = { 0 };
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+    err = cleanq_enqueue_inline((struct cleanq *)lbq, data, sizeof(data));
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("sending inline on a loopback queue returned %d\n", err);
+    }
+    cleanq_destroy((struct cleanq *)lbq);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-inline-compact-%d", getpid());
+
+    struct cleanq *queue;
+    struct cleanq_ipcq_attr attr = { 0 };
+    attr.compact = true;
+    attr.inline_max = sizeof(data);
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, name, true, &attr);
+    if (err_is_ok(err)) {
+        FAIL("a compact queue with inline messages has been created\n");
+    }
+
+    attr.inline_max = 0;
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, name, true, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating the compact queue failed %d\n", err);
+    }
+    err = cleanq_enqueue_inline(queue, data, sizeof(data));
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("sending inline on a compact queue returned %d\n", err);
+    }
+    cleanq_destroy(queue);
+}
+
+
+static void run_test(const char *q_name, bool ipc, size_t inline_max)
+{
+    errval_t err;
+    struct cleanq *tx, *rx;
+
+    create_pair(&tx, &rx, q_name, ipc, inline_max, false);
+
+    size_t max = get_inline_max(tx, rx);
+    if (inline_max ? max != inline_max : max == 0) {
+        FAIL("the inline maximum of %s is %zu\n", q_name, max);
+    }
+
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed using q: %s\n", q_name);
+    }
+
+    printf("Starting limits test %s (%zu bytes)\n", q_name, max);
+    test_limits(tx, rx, max);
+
+    printf("Starting randomized test %s (%zu bytes)\n", q_name, max);
+    test_randomized(tx, rx, max);
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    srand(time(NULL));
+
+    run_test("ffq", false, 0);
+    run_test("ffq-large", false, LARGE_INLINE_MAX);
+    run_test("ipcq", true, 0);
+    run_test("ipcq-large", true, LARGE_INLINE_MAX);
+
+    printf("Starting threaded test\n");
+    test_threads();
+
+    printf("Starting unsupported test\n");
+    test_unsupported();
+
+    printf("inline test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "memfd"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 256
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define NUM_REGIONS 2
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 20000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory[NUM_REGIONS];
+static regionid_t regid[NUM_REGIONS];
+
+///< the number of regions the echo side has been told about, and lost again
+static size_t num_registered;
+static size_t num_deregistered;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static size_t find_region(regionid_t rid)
+{
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        if (regid[i] == rid) {
+            return i;
+        }
+    }
+    FAIL("got a buffer of the unknown region %u\n", rid);
+}
+
+
+///< checks if a page of the address space is mapped in this process
+static bool is_mapped(void *vaddr)
+{
+    if (msync(vaddr, (size_t)sysconf(_SC_PAGESIZE), MS_ASYNC) == 0) {
+        return true;
+    }
+    if (errno != ENOMEM) {
+        FAIL("msync returned %d\n", errno);
+    }
+    return false;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The size of a region is rounded up to the page size, and only regions allocated with
+ * cleanq_memfd_alloc() can be freed, exactly once.
+ */
+static void test_alloc(void)
+{
+    errval_t err;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    struct capref cap;
+    err = cleanq_memfd_alloc(&cap, 0);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("allocating an empty region returned %d\n", err);
+    }
+
+    size_t lens[] = { 1, page - 1, page, page + 1, 3 * page };
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        err = cleanq_memfd_alloc(&cap, lens[i]);
+        if (err_is_fail(err)) {
+            FAIL("allocating %zu bytes failed %d\n", lens[i], err);
+        }
+        if (cap.len != (lens[i] + page - 1) / page * page || cap.paddr != (uint64_t)cap.vaddr) {
+            FAIL("allocating %zu bytes got a region of %lu bytes\n", lens[i], cap.len);
+        }
+
+        /* the memory is zeroed and writable */
+        for (size_t j = 0; j < cap.len; j++) {
+            if (((uint8_t *)cap.vaddr)[j] != 0) {
+                FAIL("the memory of a new region is not zeroed\n");
+            }
+        }
+        memset(cap.vaddr, 0xab, cap.len);
+
+        struct capref copy = cap;
+        err = cleanq_memfd_free(&cap);
+        if (err_is_fail(err) || cap.vaddr != NULL || cap.len != 0) {
+            FAIL("freeing a region failed %d\n", err);
+        }
+        err = cleanq_memfd_free(&copy);
+        if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+            FAIL("freeing a region twice returned %d\n", err);
+        }
+    }
+
+    struct capref heap = { .vaddr = malloc(page), .paddr = 0, .len = page };
+    heap.paddr = (uint64_t)heap.vaddr;
+    err = cleanq_memfd_free(&heap);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("freeing a region on the heap returned %d\n", err);
+    }
+    free(heap.vaddr);
+}
+
+
+/*
+ * Without the other side, registering a shared region times out, while an ordinary one is taken
+ * right away.
+ */
+static void test_timeout(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    struct capref cap;
+    err = cleanq_memfd_alloc(&cap, MEMORY_SIZE);
+    if (err_is_fail(err)) {
+        FAIL("allocating the memory failed %d\n", err);
+    }
+
+    regionid_t rid;
+    err = cleanq_register(queue, cap, &rid);
+    if (err != CLEANQ_ERR_TIMEOUT) {
+        FAIL("registering without the other side returned %d\n", err);
+    }
+
+    struct capref heap = { .vaddr = malloc(MEMORY_SIZE), .paddr = 0, .len = MEMORY_SIZE };
+    heap.paddr = (uint64_t)heap.vaddr;
+    err = cleanq_register(queue, heap, &rid);
+    if (err_is_fail(err)) {
+        FAIL("registering a region on the heap failed %d\n", err);
+    }
+
+    cleanq_destroy(queue);
+    cleanq_memfd_free(&cap);
+    free(heap.vaddr);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static errval_t echo_register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    if (num_registered == NUM_REGIONS) {
+        FAIL("the echo side got more than %d regions\n", NUM_REGIONS);
+    }
+    if (cap.len != MEMORY_SIZE) {
+        FAIL("the echo side got a region of %lu bytes\n", cap.len);
+    }
+    memory[num_registered] = cap;
+    regid[num_registered] = region_id;
+    num_registered++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static errval_t echo_deregister_cb(struct cleanq *q, regionid_t region_id)
+{
+    (void)q;
+
+    find_region(region_id);
+    num_deregistered++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * Answers the buffers in place through its own mapping of the regions, until the other side
+ * has deregistered them.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, false, NUM_SLOTS);
+    cleanq_set_register_callback(queue, echo_register_cb);
+    cleanq_set_deregister_callback(queue, echo_deregister_cb);
+
+    uint64_t num_rx = 0;
+    while (num_deregistered < NUM_REGIONS) {
+        struct cleanq_buf b;
+        void *data;
+        err = cleanq_dequeue_data(queue, &b, &data, 1);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        size_t r = find_region(b.rid);
+        if (data != (uint8_t *)memory[r].vaddr + b.offset + b.valid_data) {
+            FAIL("the echo side got the address %p outside of its mapping\n", data);
+        }
+
+        char expected[64];
+        snprintf(expected, sizeof(expected), "ping %lu", b.flags);
+        if (b.flags != num_rx || strcmp(data, expected)) {
+            FAIL("the echo side got %s instead of ping %lu\n", (char *)data, num_rx);
+        }
+        snprintf(data, b.valid_length, "pong %lu", b.flags);
+
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+        num_rx++;
+    }
+
+    /* the regions are unmapped once they have been deregistered */
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        if (is_mapped(memory[i].vaddr)) {
+            FAIL("the echo side still maps a deregistered region\n");
+        }
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * The buffers of two shared regions go to the echo process and come back with its answer
+ * written into the same memory. Afterwards the echo process unmaps the regions.
+ */
+static void test_share(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        err = cleanq_memfd_alloc(&memory[i], MEMORY_SIZE);
+        if (err_is_fail(err)) {
+            FAIL("allocating the memory failed %d\n", err);
+        }
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        num_registered = 0;
+        num_deregistered = 0;
+        echo(ffq);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        err = cleanq_register(queue, memory[i], &regid[i]);
+        if (err_is_fail(err)) {
+            FAIL("registering region %zu failed %d\n", i, err);
+        }
+    }
+
+    /* both rings hold at most NUM_SLOTS buffers, none of the buffers in flight overlap */
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    size_t regions[NUM_BUFS];
+    while (num_rx < NUM_MSGS) {
+        if (num_tx < NUM_MSGS && num_tx - num_rx < 2 * NUM_SLOTS) {
+            size_t r = rand() % NUM_REGIONS;
+            genoffset_t offset = (num_tx % NUM_BUFS) * BUF_SIZE;
+            genoffset_t valid_data = (rand() % 4) * 64;
+            char *data = (char *)memory[r].vaddr + offset + valid_data;
+            snprintf(data, BUF_SIZE - valid_data, "ping %lu", num_tx);
+
+            err = cleanq_enqueue(queue, regid[r], offset, BUF_SIZE, valid_data,
+                                 BUF_SIZE - valid_data, num_tx);
+            if (err_is_ok(err)) {
+                regions[num_tx % NUM_BUFS] = r;
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("receiving buffer %lu returned %d\n", num_rx, err);
+        }
+
+        size_t r = regions[num_rx % NUM_BUFS];
+        char expected[64];
+        snprintf(expected, sizeof(expected), "pong %lu", num_rx);
+        char *data = (char *)memory[r].vaddr + b.offset + b.valid_data;
+        if (b.flags != num_rx || b.rid != regid[r] || strcmp(data, expected)) {
+            FAIL("expected pong %lu back, got %s\n", num_rx, data);
+        }
+        num_rx++;
+    }
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        struct capref cap;
+        err = cleanq_deregister(queue, regid[i], &cap);
+        if (err_is_fail(err) || cap.vaddr != memory[i].vaddr) {
+            FAIL("deregistering region %zu failed %d\n", i, err);
+        }
+    }
+
+    test_join(pid);
+
+    cleanq_destroy(queue);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        err = cleanq_memfd_free(&memory[i]);
+        if (err_is_fail(err)) {
+            FAIL("freeing region %zu failed %d\n", i, err);
+        }
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-memfd-%d", getpid());
+
+    printf("Starting alloc test\n");
+    test_alloc();
+
+    printf("Starting ipcq timeout test\n");
+    test_timeout(false);
+
+    printf("Starting ffq timeout test\n");
+    test_timeout(true);
+
+    printf("Starting ipcq share test\n");
+    test_share(false);
+
+    printf("Starting ffq share test\n");
+    test_share(true);
+
+    printf("memfd test passed\n");
+
+    return 0;
+}
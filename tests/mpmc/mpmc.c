@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "mpmc"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define BUFS_PER_PRODUCER 64
+
+#define NUM_PRODUCERS 4
+#define NUM_CONSUMERS 3
+
+///< the number of buffers every producer sends
+#define NUM_MSGS 100000
+
+#define MAX_BATCH 8
+
+#define MEMORY_SIZE BUF_SIZE *BUFS_PER_PRODUCER *NUM_PRODUCERS
+
+///< the test fails if the receiver has not seen all buffers after this long
+#define HANG_TIMEOUT_S 120
+
+static struct capref memory;
+static regionid_t regid;
+static struct cleanq *que;
+
+///< whether each buffer has been received, indexed by producer and sequence number
+static uint8_t seen[NUM_PRODUCERS][NUM_MSGS];
+
+///< the number of buffers received by all consumers
+static uint64_t num_rx;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void hang_handler(int sig)
+{
+    (void)sig;
+    printf("mpmc test failed: only %lu of %d buffers arrived\n",
+           __atomic_load_n(&num_rx, __ATOMIC_RELAXED), NUM_PRODUCERS * NUM_MSGS);
+    exit(1);
+}
+
+
+static void fill_buf(struct cleanq_buf *b, uint64_t producer, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = (producer * BUFS_PER_PRODUCER + seq % BUFS_PER_PRODUCER) * BUF_SIZE;
+    b->length = BUF_SIZE;
+    b->valid_data = 0;
+    b->valid_length = (seq % BUF_SIZE) + 1;
+    b->flags = (producer << 32) | seq;
+}
+
+
+/*
+ * Checks a received buffer, marks it as seen and returns its producer and sequence number.
+ */
+static void check_buf(const struct cleanq_buf *b, uint64_t *producer, uint64_t *seq)
+{
+    *producer = b->flags >> 32;
+    *seq = b->flags & 0xffffffff;
+
+    if (*producer >= NUM_PRODUCERS || *seq >= NUM_MSGS) {
+        FAIL("received unknown buffer flags=%lx\n", b->flags);
+    }
+    if (b->offset != (*producer * BUFS_PER_PRODUCER + *seq % BUFS_PER_PRODUCER) * BUF_SIZE
+        || b->length != BUF_SIZE || b->valid_length != (*seq % BUF_SIZE) + 1) {
+        FAIL("buffer %lu of producer %lu is corrupted, offset=%lu valid_length=%lu\n", *seq,
+             *producer, b->offset, b->valid_length);
+    }
+    if (__atomic_exchange_n(&seen[*producer][*seq], 1, __ATOMIC_RELAXED)) {
+        FAIL("buffer %lu of producer %lu received twice\n", *seq, *producer);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Producers
+ * ================================================================================================
+ */
+
+
+/*
+ * Sends the buffers of one producer in order, one at a time or in batches of random size.
+ */
+static void *producer_thread(void *arg)
+{
+    uint64_t producer = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + producer;
+
+    struct cleanq_buf bufs[MAX_BATCH];
+    uint64_t seq = 0;
+
+    while (seq < NUM_MSGS) {
+        errval_t err;
+        size_t num_enq = 0;
+
+        if (rand_r(&seed) % 2) {
+            fill_buf(&bufs[0], producer, seq);
+            err = cleanq_enqueue(que, bufs[0].rid, bufs[0].offset, bufs[0].length,
+                                 bufs[0].valid_data, bufs[0].valid_length, bufs[0].flags);
+            num_enq = err_is_ok(err) ? 1 : 0;
+        } else {
+            size_t num = (rand_r(&seed) % MAX_BATCH) + 1;
+            if (num > NUM_MSGS - seq) {
+                num = NUM_MSGS - seq;
+            }
+            for (size_t i = 0; i < num; i++) {
+                fill_buf(&bufs[i], producer, seq + i);
+            }
+            err = cleanq_enqueue_batch(que, bufs, num, &num_enq);
+        }
+
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("producer %lu enqueue returned %d\n", producer, err);
+        }
+        seq += num_enq;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * ================================================================================================
+ * Consumers
+ * ================================================================================================
+ */
+
+
+/*
+ * Receives buffers until all of them have arrived. The slots are claimed in the order of the
+ * ring, so the buffers of one producer arrive in order at every consumer.
+ */
+static void *consumer_thread(void *arg)
+{
+    uint64_t consumer = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + consumer;
+
+    int64_t last[NUM_PRODUCERS];
+    for (int i = 0; i < NUM_PRODUCERS; i++) {
+        last[i] = -1;
+    }
+
+    struct cleanq_buf bufs[MAX_BATCH];
+
+    while (__atomic_load_n(&num_rx, __ATOMIC_RELAXED) < NUM_PRODUCERS * NUM_MSGS) {
+        errval_t err;
+        size_t num_deq = 0;
+
+        if (rand_r(&seed) % 2) {
+            struct cleanq_buf *b = &bufs[0];
+            err = cleanq_dequeue(que, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                 &b->valid_length, &b->flags);
+            num_deq = err_is_ok(err) ? 1 : 0;
+        } else {
+            err = cleanq_dequeue_batch(que, bufs, (rand_r(&seed) % MAX_BATCH) + 1, &num_deq);
+        }
+
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("consumer %lu dequeue returned %d\n", consumer, err);
+        }
+
+        for (size_t i = 0; i < num_deq; i++) {
+            uint64_t producer, seq;
+            check_buf(&bufs[i], &producer, &seq);
+            if ((int64_t)seq <= last[producer]) {
+                FAIL("consumer %lu got buffer %lu of producer %lu after %ld\n", consumer, seq,
+                     producer, last[producer]);
+            }
+            last[producer] = seq;
+        }
+        __atomic_fetch_add(&num_rx, num_deq, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The receiver runs the consumers in its own process and exits with 0 once it has seen every
+ * buffer exactly once.
+ */
+static void receiver(const char *name, size_t consumers)
+{
+    struct cleanq_ipcq_attr attr = { 0 };
+    attr.multi_consumer = (consumers > 1);
+
+    errval_t err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&que, (char *)name, false,
+                                                &attr);
+    if (err_is_fail(err)) {
+        FAIL("connecting to %s failed %d\n", name, err);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+
+    pthread_t threads[NUM_CONSUMERS];
+    for (uintptr_t i = 0; i < consumers; i++) {
+        if (pthread_create(&threads[i], NULL, consumer_thread, (void *)i)) {
+            FAIL("creating consumer %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; i < consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int p = 0; p < NUM_PRODUCERS; p++) {
+        for (int s = 0; s < NUM_MSGS; s++) {
+            if (!seen[p][s]) {
+                FAIL("buffer %d of producer %d never arrived\n", s, p);
+            }
+        }
+    }
+    if (num_rx != NUM_PRODUCERS * NUM_MSGS) {
+        FAIL("received %lu buffers instead of %d\n", num_rx, NUM_PRODUCERS * NUM_MSGS);
+    }
+
+    exit(0);
+}
+
+
+static void run_test(const char *t_name, size_t producers, size_t consumers)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-mpmc-%d", getpid());
+
+    printf("Starting %s test\n", t_name);
+
+    struct cleanq_ipcq_attr attr = { 0 };
+    attr.multi_producer = (producers > 1);
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&que, name, true, &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating %s failed %d\n", name, err);
+    }
+
+    err = cleanq_register(que, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        receiver(name, consumers);
+    }
+
+    /* a single producer sends the buffers of all of them one after the other */
+    pthread_t threads[NUM_PRODUCERS];
+    for (uintptr_t i = 0; i < NUM_PRODUCERS; i++) {
+        if (producers == 1) {
+            producer_thread((void *)i);
+        } else if (pthread_create(&threads[i], NULL, producer_thread, (void *)i)) {
+            FAIL("creating producer %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; producers > 1 && i < NUM_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("mpmc test failed: the receiver of the %s test failed\n", t_name);
+        exit(1);
+    }
+
+    cleanq_destroy(que);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    signal(SIGALRM, hang_handler);
+
+    run_test("spsc", 1, 1);
+    run_test("mpsc", NUM_PRODUCERS, 1);
+    run_test("spmc", 1, NUM_CONSUMERS);
+    run_test("mpmc", NUM_PRODUCERS, NUM_CONSUMERS);
+
+    printf("mpmc test passed\n");
+
+    return 0;
+}
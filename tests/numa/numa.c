@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/numa.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "numa"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 20000
+
+///< a node no machine has, it is still within the node masks of the library
+#define NO_NODE 1023
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the node this process runs on
+static int node;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static errval_t create_queue(struct cleanq **queue, bool ffq, bool clear, cleanq_numa_t numa,
+                             int numa_node)
+{
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS, .numa = numa, .numa_node = numa_node };
+        return cleanq_ffq_create_with_attr((struct cleanq_ffq **)queue, name, clear, &attr);
+    }
+
+    struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS, .numa = numa, .numa_node = numa_node };
+    return cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)queue, name, clear, &attr);
+}
+
+
+static void check_rings(struct cleanq *queue, int expected)
+{
+    for (uint64_t ring = 0; ring < 2; ring++) {
+        uint64_t result;
+        errval_t err = cleanq_control(queue, CLEANQ_CTRL_RING_NODE, ring, &result);
+        if (err_is_fail(err) || result != (uint64_t)expected) {
+            FAIL("ring %lu is on node %lu instead of %d, err=%d\n", ring, result, expected, err);
+        }
+    }
+}
+
+
+static void send_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err;
+    while ((err = cleanq_enqueue(queue, b->rid, b->offset, b->length, b->valid_data,
+                                 b->valid_length, b->flags))
+           == CLEANQ_ERR_QUEUE_FULL) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("sending buffer %lu returned %d\n", b->flags, err);
+    }
+}
+
+
+static void recv_buf(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err;
+    while ((err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                 &b->valid_length, &b->flags))
+           == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("receiving a buffer returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+static void *bind_thread(void *arg)
+{
+    (void)arg;
+
+    errval_t err = cleanq_numa_bind_thread(node);
+    if (err_is_fail(err)) {
+        FAIL("binding a thread to node %d failed %d\n", node, err);
+    }
+    if (cleanq_numa_current_node() != node) {
+        FAIL("the thread does not run on node %d after binding it\n", node);
+    }
+
+    err = cleanq_numa_bind_thread(NO_NODE);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("binding a thread to node %d returned %d\n", NO_NODE, err);
+    }
+    err = cleanq_numa_bind_thread(-1);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("binding a thread to node -1 returned %d\n", err);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Memory is bound to the node of this process and found there, nodes that don't exist are
+ * rejected. Returns false if the kernel has no NUMA support.
+ */
+static bool test_helpers(void)
+{
+    errval_t err;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    uint8_t *mem = mmap(NULL, 4 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                        0);
+    if (mem == MAP_FAILED) {
+        FAIL("mapping memory failed\n");
+    }
+
+    /* the range is extended to full pages */
+    err = cleanq_numa_bind_memory(mem + page + 1, page, node);
+    if (err == CLEANQ_ERR_NOT_SUPPORTED) {
+        munmap(mem, 4 * page);
+        return false;
+    }
+    if (err_is_fail(err)) {
+        FAIL("binding memory to node %d failed %d\n", node, err);
+    }
+    memset(mem, 0, 4 * page);
+    for (size_t i = 0; i < 4; i++) {
+        int n;
+        err = cleanq_numa_memory_node(mem + i * page, &n);
+        if (err_is_fail(err) || n != node) {
+            FAIL("page %zu is on node %d instead of %d, err=%d\n", i, n, node, err);
+        }
+    }
+
+    err = cleanq_numa_bind_memory(mem, page, NO_NODE);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("binding memory to node %d returned %d\n", NO_NODE, err);
+    }
+    err = cleanq_numa_bind_memory(mem, page, -1);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("binding memory to node -1 returned %d\n", err);
+    }
+    err = cleanq_numa_bind_memory(mem, 0, node);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("binding no memory returned %d\n", err);
+    }
+
+    munmap(mem, 4 * page);
+    int n;
+    err = cleanq_numa_memory_node(mem, &n);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("the node of unmapped memory returned %d\n", err);
+    }
+
+    /* binding changes the affinity and the memory policy of the thread, not of the test */
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bind_thread, NULL)) {
+        FAIL("creating a thread failed\n");
+    }
+    pthread_join(thread, NULL);
+
+    return true;
+}
+
+
+/*
+ * Every placement puts the rings on the node of this process, as seen from both sides, and the
+ * buffers flow as usual. Placements on nodes that don't exist fail to create the queue.
+ */
+static void test_placement(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx, *rx;
+
+    cleanq_numa_t placements[] = { CLEANQ_NUMA_FIRST_TOUCH, CLEANQ_NUMA_NODE,
+                                   CLEANQ_NUMA_CONSUMER, CLEANQ_NUMA_PRODUCER };
+    for (size_t i = 0; i < sizeof(placements) / sizeof(placements[0]); i++) {
+        err = create_queue(&tx, ffq, true, placements[i], node);
+        if (err_is_fail(err)) {
+            FAIL("creating a queue with placement %d failed %d\n", placements[i], err);
+        }
+
+        /* the attacher takes the placement of the creator */
+        err = create_queue(&rx, ffq, false, CLEANQ_NUMA_NODE, NO_NODE);
+        if (err_is_fail(err)) {
+            FAIL("attaching to a queue with placement %d failed %d\n", placements[i], err);
+        }
+        check_rings(tx, node);
+        check_rings(rx, node);
+
+        err = cleanq_register(tx, memory, &regid);
+        if (err_is_fail(err)) {
+            FAIL("registering memory failed %d\n", err);
+        }
+        for (uint64_t seq = 0; seq < 4 * NUM_SLOTS; seq++) {
+            struct cleanq_buf b = { .rid = regid, .offset = (seq % NUM_BUFS) * BUF_SIZE,
+                                    .length = BUF_SIZE, .valid_length = BUF_SIZE,
+                                    .flags = seq };
+            send_buf(tx, &b);
+            recv_buf(rx, &b);
+            if (b.flags != seq || b.rid != regid) {
+                FAIL("expected buffer %lu, got %lu\n", seq, b.flags);
+            }
+        }
+
+        uint64_t result;
+        err = cleanq_control(tx, CLEANQ_CTRL_REGION_NODE, regid, &result);
+        if (err_is_fail(err) || result != (uint64_t)node) {
+            FAIL("the region is on node %lu instead of %d, err=%d\n", result, node, err);
+        }
+        err = cleanq_control(tx, CLEANQ_CTRL_REGION_NODE, regid + 1, &result);
+        if (err != CLEANQ_ERR_INVALID_REGION_ID) {
+            FAIL("the node of an unknown region returned %d\n", err);
+        }
+
+        cleanq_destroy(rx);
+        cleanq_destroy(tx);
+    }
+
+    for (size_t i = 1; i < sizeof(placements) / sizeof(placements[0]); i++) {
+        err = create_queue(&tx, ffq, true, placements[i], -1);
+        if (err != CLEANQ_ERR_INIT_QUEUE) {
+            FAIL("creating a queue on node -1 returned %d\n", err);
+        }
+    }
+    err = create_queue(&tx, ffq, true, CLEANQ_NUMA_NODE, NO_NODE);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a queue on node %d returned %d\n", NO_NODE, err);
+    }
+    err = create_queue(&tx, ffq, true, (cleanq_numa_t)(CLEANQ_NUMA_PRODUCER + 1), node);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a queue with an unknown placement returned %d\n", err);
+    }
+}
+
+
+/*
+ * Without NUMA support in the kernel the rings can't be placed, the queue is only created
+ * without a placement.
+ */
+static void test_unsupported(bool ffq)
+{
+    struct cleanq *queue;
+    errval_t err = create_queue(&queue, ffq, true, CLEANQ_NUMA_NODE, 0);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("placing the rings without NUMA support returned %d\n", err);
+    }
+
+    err = create_queue(&queue, ffq, true, CLEANQ_NUMA_FIRST_TOUCH, 0);
+    if (err_is_fail(err)) {
+        FAIL("creating a queue without a placement failed %d\n", err);
+    }
+    cleanq_destroy(queue);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Runs on the node of its receive ring and answers every buffer.
+ */
+static void echo(bool ffq)
+{
+    errval_t err = cleanq_numa_bind_thread(node);
+    if (err_is_fail(err)) {
+        FAIL("binding the echo side to node %d failed %d\n", node, err);
+    }
+
+    struct cleanq *queue;
+    err = create_queue(&queue, ffq, false, CLEANQ_NUMA_FIRST_TOUCH, 0);
+    if (err_is_fail(err)) {
+        FAIL("attaching the echo side failed %d\n", err);
+    }
+    check_rings(queue, node);
+
+    for (uint64_t seq = 0; seq < NUM_MSGS; seq++) {
+        struct cleanq_buf b;
+        recv_buf(queue, &b);
+        if (b.flags != seq) {
+            FAIL("the echo side expected buffer %lu, got %lu\n", seq, b.flags);
+        }
+        send_buf(queue, &b);
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * Each ring is placed on the node of its consumer, the echo process runs on its node and both
+ * sides keep the rings busy.
+ */
+static void test_echo(bool ffq)
+{
+    struct cleanq *queue;
+    errval_t err = create_queue(&queue, ffq, true, CLEANQ_NUMA_CONSUMER, node);
+    if (err_is_fail(err)) {
+        FAIL("creating the queue failed %d\n", err);
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    alarm(HANG_TIMEOUT_S);
+    while (num_rx < NUM_MSGS) {
+        if (num_tx < NUM_MSGS) {
+            err = cleanq_enqueue(queue, regid, (num_tx % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0,
+                                 BUF_SIZE, num_tx);
+            if (err_is_ok(err)) {
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                             &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || b.flags != num_rx) {
+            FAIL("expected buffer %lu back, got %lu err=%d\n", num_rx, b.flags, err);
+        }
+        num_rx++;
+    }
+    check_rings(queue, node);
+
+    test_join(pid);
+
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-numa-%d", getpid());
+
+    node = cleanq_numa_current_node();
+
+    /* the region is placed before it is registered */
+    memory.vaddr = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (memory.vaddr == MAP_FAILED) {
+        FAIL("mapping the memory failed\n");
+    }
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting helpers test\n");
+    if (!test_helpers()) {
+        printf("No NUMA support, starting ipcq unsupported test\n");
+        test_unsupported(false);
+
+        printf("Starting ffq unsupported test\n");
+        test_unsupported(true);
+
+        printf("numa test passed\n");
+        return 0;
+    }
+    cleanq_numa_bind_memory(memory.vaddr, memory.len, node);
+
+    printf("Starting ipcq placement test\n");
+    test_placement(false);
+
+    printf("Starting ffq placement test\n");
+    test_placement(true);
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("numa test passed\n");
+
+    return 0;
+}
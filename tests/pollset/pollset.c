@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/pollset.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+
+#define TEST_NAME "pollset"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< the number of queues, the even ones are IPC queues, the odd ones FastForward queues
+#define NUM_QUEUES 8
+
+///< the queue that is removed from the pollset before the buffers are sent
+#define REMOVED_QUEUE 5
+
+///< the number of buffers sent on the removed queue, they must fit into its ring
+#define NUM_REMOVED 16
+
+///< the number of buffers sent on the other queues
+#define NUM_ROUNDS 20000
+
+///< the maximum number of ready queues returned at once, less than there are queues
+#define MAX_READY 3
+
+///< the test fails if a notification got lost and the pollset sleeps for this long
+#define HANG_TIMEOUT_S 60
+
+static struct cleanq *queues[NUM_QUEUES];
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static struct cleanq *create_queue(const char *prefix, int i, bool clear)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%d", prefix, i);
+
+    struct cleanq *queue;
+    if ((i % 2) == 0) {
+        err = cleanq_ipcq_create((struct cleanq_ipcq **)&queue, name, clear);
+    } else {
+        err = cleanq_ffq_create((struct cleanq_ffq **)&queue, name, clear);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    return queue;
+}
+
+
+static int queue_index(struct cleanq *queue)
+{
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        if (queues[i] == queue) {
+            return i;
+        }
+    }
+
+    FAIL("the pollset returned an unknown queue %p\n", (void *)queue);
+}
+
+
+/*
+ * ================================================================================================
+ * Sender
+ * ================================================================================================
+ */
+
+
+/*
+ * Sends the buffers on randomly chosen queues, each with a notification, and the buffers of the
+ * removed queue in between. The flags carry the sequence number per queue.
+ */
+static void sender(const char *prefix)
+{
+    errval_t err;
+
+    struct cleanq *q[NUM_QUEUES];
+    regionid_t rids[NUM_QUEUES];
+    uint64_t seq[NUM_QUEUES] = { 0 };
+
+    struct capref memory;
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        q[i] = create_queue(prefix, i, false);
+        err = cleanq_register(q[i], memory, &rids[i]);
+        if (err_is_fail(err)) {
+            FAIL("registering memory on queue %d failed %d\n", i, err);
+        }
+    }
+
+    uint64_t sent = 0;
+    while (sent < NUM_ROUNDS || seq[REMOVED_QUEUE] < NUM_REMOVED) {
+        int i = rand() % NUM_QUEUES;
+        if (i == REMOVED_QUEUE ? seq[i] >= NUM_REMOVED : sent >= NUM_ROUNDS) {
+            continue;
+        }
+
+        err = cleanq_enqueue(q[i], rids[i], (seq[i] % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0,
+                             BUF_SIZE, seq[i]);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("enqueue on queue %d returned %d\n", i, err);
+        }
+
+        err = cleanq_notify(q[i]);
+        if (err_is_fail(err)) {
+            FAIL("notify on queue %d returned %d\n", i, err);
+        }
+
+        seq[i]++;
+        if (i != REMOVED_QUEUE) {
+            sent++;
+        }
+        if ((rand() % 16) == 0) {
+            usleep(rand() % 100);
+        }
+    }
+
+    /* the buffers are never returned, wait until we are killed */
+    while (true) {
+        pause();
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Queues without doorbells, duplicates and queues beyond the capacity are refused. A queue
+ * is a duplicate also if it sits behind a hole left by a removed one.
+ */
+static void test_add_remove(struct cleanq_pollset *ps)
+{
+    errval_t err;
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+    err = cleanq_pollset_add(ps, (struct cleanq *)lbq);
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("adding a loopback queue returned %d\n", err);
+    }
+
+    for (int i = 0; i < NUM_QUEUES - 1; i++) {
+        err = cleanq_pollset_add(ps, queues[i]);
+        if (err_is_fail(err)) {
+            FAIL("adding queue %d returned %d\n", i, err);
+        }
+    }
+
+    err = cleanq_pollset_remove(ps, queues[1]);
+    if (err_is_fail(err)) {
+        FAIL("removing queue 1 returned %d\n", err);
+    }
+    err = cleanq_pollset_add(ps, queues[4]);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("adding queue 4 twice returned %d\n", err);
+    }
+
+    err = cleanq_pollset_add(ps, queues[1]);
+    if (err_is_fail(err)) {
+        FAIL("adding queue 1 again returned %d\n", err);
+    }
+    err = cleanq_pollset_add(ps, queues[NUM_QUEUES - 1]);
+    if (err_is_fail(err)) {
+        FAIL("adding the last queue returned %d\n", err);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-pollset-extra-%d", getpid());
+    struct cleanq *extra = create_queue(name, 0, true);
+    err = cleanq_pollset_add(ps, extra);
+    if (err != CLEANQ_ERR_QUEUE_FULL) {
+        FAIL("adding to a full pollset returned %d\n", err);
+    }
+    cleanq_destroy(extra);
+
+    /* newly added queues are reported once */
+    bool reported[NUM_QUEUES] = { false };
+    size_t num_reported = 0;
+    while (num_reported < NUM_QUEUES) {
+        struct cleanq *ready[MAX_READY];
+        size_t num_ready;
+        err = cleanq_pollset_wait(ps, ready, MAX_READY, &num_ready, 100000);
+        if (err == CLEANQ_ERR_TIMEOUT) {
+            FAIL("only %zu of the new queues have been reported\n", num_reported);
+        }
+        for (size_t i = 0; i < num_ready; i++) {
+            int idx = queue_index(ready[i]);
+            if (reported[idx]) {
+                FAIL("new queue %d reported twice\n", idx);
+            }
+            reported[idx] = true;
+            num_reported++;
+        }
+    }
+
+    struct cleanq *ready[MAX_READY];
+    size_t num_ready;
+    err = cleanq_pollset_wait(ps, ready, MAX_READY, &num_ready, 0);
+    if (err != CLEANQ_ERR_TIMEOUT) {
+        FAIL("polling a quiet pollset returned %d with %zu queues\n", err, num_ready);
+    }
+
+    err = cleanq_pollset_remove(ps, queues[REMOVED_QUEUE]);
+    if (err_is_fail(err)) {
+        FAIL("removing queue %d returned %d\n", REMOVED_QUEUE, err);
+    }
+
+    cleanq_destroy((struct cleanq *)lbq);
+}
+
+
+/*
+ * Receives all buffers by waiting on the pollset and draining the ready queues. The removed
+ * queue is never reported, its buffers are still there at the end.
+ */
+static void test_receive(struct cleanq_pollset *ps)
+{
+    errval_t err;
+    uint64_t seq[NUM_QUEUES] = { 0 };
+    uint64_t recv = 0;
+
+    while (recv < NUM_ROUNDS) {
+        struct cleanq *ready[MAX_READY];
+        size_t num_ready = 0;
+
+        alarm(HANG_TIMEOUT_S);
+        err = cleanq_pollset_wait(ps, ready, MAX_READY, &num_ready, CLEANQ_WAIT_FOREVER);
+        alarm(0);
+        if (err_is_fail(err)) {
+            FAIL("waiting on the pollset returned %d\n", err);
+        }
+        if (num_ready > MAX_READY) {
+            FAIL("the pollset returned %zu queues\n", num_ready);
+        }
+
+        for (size_t r = 0; r < num_ready; r++) {
+            int i = queue_index(ready[r]);
+            if (i == REMOVED_QUEUE) {
+                FAIL("the removed queue has been reported\n");
+            }
+
+            /* the readiness is edge triggered, drain the queue */
+            while (true) {
+                struct cleanq_buf b;
+                err = cleanq_dequeue(ready[r], &b.rid, &b.offset, &b.length, &b.valid_data,
+                                     &b.valid_length, &b.flags);
+                if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+                    break;
+                }
+                if (err_is_fail(err)) {
+                    FAIL("dequeue on queue %d returned %d\n", i, err);
+                }
+                if (b.flags != seq[i] || b.offset != (seq[i] % NUM_BUFS) * BUF_SIZE) {
+                    FAIL("queue %d delivered buffer %lu instead of %lu\n", i, b.flags, seq[i]);
+                }
+                seq[i]++;
+                recv++;
+            }
+        }
+    }
+
+    /* the sender may still be sending the last buffers of the removed queue */
+    uint64_t num_removed = 0;
+    alarm(HANG_TIMEOUT_S);
+    while (num_removed < NUM_REMOVED) {
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queues[REMOVED_QUEUE], &b.rid, &b.offset, &b.length, &b.valid_data,
+                             &b.valid_length, &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || b.flags != num_removed) {
+            FAIL("the removed queue delivered buffer %lu instead of %lu, err=%d\n", b.flags,
+                 num_removed, err);
+        }
+        num_removed++;
+    }
+    alarm(0);
+}
+
+
+int main(int argc, char *argv[])
+{
+    errval_t err;
+
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("no notification");
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "/cleanq-test-pollset-%d", getpid());
+
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        queues[i] = create_queue(prefix, i, true);
+    }
+
+    struct cleanq_pollset *ps;
+    char name[80];
+    snprintf(name, sizeof(name), "%s-bell", prefix);
+    err = cleanq_pollset_create(&ps, name, NUM_QUEUES);
+    if (err_is_fail(err)) {
+        FAIL("creating the pollset failed %d\n", err);
+    }
+
+    printf("Starting pollset add/remove test\n");
+    test_add_remove(ps);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        sender(prefix);
+    }
+
+    printf("Starting pollset receive test\n");
+    test_receive(ps);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    err = cleanq_pollset_destroy(ps);
+    if (err_is_fail(err)) {
+        FAIL("destroying the pollset failed %d\n", err);
+    }
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        cleanq_destroy(queues[i]);
+    }
+
+    printf("pollset test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "prefetch"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 512
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define NUM_REGIONS 3
+
+#define MAX_BATCH 24
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 50000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory[NUM_REGIONS];
+static regionid_t regid[NUM_REGIONS];
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+///< a random buffer of a random region, the sequence number picks its slot in the region
+static struct cleanq_buf random_buf(uint64_t seq)
+{
+    size_t r = rand() % NUM_REGIONS;
+    genoffset_t valid_data = rand() % (BUF_SIZE / 2);
+    genoffset_t valid_length = rand() % (BUF_SIZE - valid_data + 1);
+    return (struct cleanq_buf){ .rid = regid[r], .offset = (seq % NUM_BUFS) * BUF_SIZE,
+                                .length = BUF_SIZE, .valid_data = valid_data,
+                                .valid_length = valid_length, .flags = seq };
+}
+
+
+static size_t find_region(regionid_t rid)
+{
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        if (regid[i] == rid) {
+            return i;
+        }
+    }
+    FAIL("got a buffer of the unknown region %u\n", rid);
+}
+
+
+///< the address of the valid data of a buffer in the mapping of this process
+static void *buf_data(const struct cleanq_buf *b)
+{
+    return (uint8_t *)memory[find_region(b->rid)].vaddr + b->offset + b->valid_data;
+}
+
+
+static void send_bufs(struct cleanq *queue, struct cleanq_buf *bufs, size_t num)
+{
+    size_t sent = 0;
+    while (sent < num) {
+        size_t num_enq;
+        errval_t err = cleanq_enqueue_batch(queue, bufs + sent, num - sent, &num_enq);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("sending buffer %lu returned %d\n", bufs[sent].flags, err);
+        }
+        sent += num_enq;
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The address points at the valid data of the buffer in its region, for single buffers and for
+ * batches that mix regions, whatever the number of lines to prefetch.
+ */
+static void test_addresses(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = test_create_queue(name, ffq, true, NUM_SLOTS);
+    struct cleanq *rx = test_create_queue(name, ffq, false, NUM_SLOTS);
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        memory[i].vaddr = malloc(MEMORY_SIZE);
+        memory[i].paddr = (uint64_t)memory[i].vaddr;
+        memory[i].len = MEMORY_SIZE;
+        err = cleanq_register(tx, memory[i], &regid[i]);
+        if (err_is_fail(err)) {
+            FAIL("registering region %zu failed %d\n", i, err);
+        }
+    }
+
+    struct cleanq_buf b;
+    void *data = &b;
+    err = cleanq_dequeue_data(rx, &b, &data, 1);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY || data != &b) {
+        FAIL("dequeue from an empty queue returned %d\n", err);
+    }
+
+    size_t prefetch[] = { 0, 1, 2, 64, (size_t)-1 };
+    uint64_t seq = 0;
+    for (size_t round = 0; round < 200; round++) {
+        struct cleanq_buf bufs[NUM_SLOTS], got[NUM_SLOTS];
+        void *addrs[NUM_SLOTS];
+        size_t num = (rand() % NUM_SLOTS) + 1;
+        for (size_t i = 0; i < num; i++) {
+            bufs[i] = random_buf(seq + i);
+        }
+        send_bufs(tx, bufs, num);
+
+        size_t lines = prefetch[round % (sizeof(prefetch) / sizeof(prefetch[0]))];
+        size_t num_deq = 0;
+        if (round % 2) {
+            while (num_deq < num) {
+                err = cleanq_dequeue_data(rx, &got[num_deq], &addrs[num_deq], lines);
+                if (err_is_fail(err)) {
+                    FAIL("dequeue returned %d\n", err);
+                }
+                num_deq++;
+            }
+        } else {
+            err = cleanq_dequeue_batch_data(rx, got, addrs, NUM_SLOTS, &num_deq, lines);
+            if (err_is_fail(err) || num_deq != num) {
+                FAIL("dequeueing a batch of %zu returned %d with %zu\n", num, err, num_deq);
+            }
+        }
+
+        for (size_t i = 0; i < num; i++) {
+            if (got[i].flags != seq + i || addrs[i] != buf_data(&bufs[i])) {
+                FAIL("buffer %lu has the address %p instead of %p\n", seq + i, addrs[i],
+                     buf_data(&bufs[i]));
+            }
+        }
+        seq += num;
+    }
+
+    size_t num_deq = 1;
+    err = cleanq_dequeue_batch_data(rx, &b, &data, 1, &num_deq, 1);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY || num_deq != 0) {
+        FAIL("dequeueing a batch from an empty queue returned %d\n", err);
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        free(memory[i].vaddr);
+    }
+}
+
+
+/*
+ * Prefetching stays within the valid data and never faults, not even for data that ends right
+ * before an inaccessible page or for addresses that are not mapped at all.
+ */
+static void test_bounds(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t *mem = mmap(NULL, 3 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                        0);
+    if (mem == MAP_FAILED) {
+        FAIL("mapping memory failed\n");
+    }
+    mprotect(mem + page, page, PROT_NONE);
+    munmap(mem + 2 * page, page);
+
+    for (genoffset_t len = 0; len <= 256; len++) {
+        cleanq_prefetch(mem + page - len, len, (size_t)-1);
+    }
+    cleanq_prefetch(mem + page, page, 4);
+    cleanq_prefetch(mem + 2 * page, page, 4);
+    cleanq_prefetch(NULL, 0, 4);
+
+    munmap(mem, 2 * page);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static size_t num_registered;
+
+static errval_t echo_register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    if (num_registered == NUM_REGIONS) {
+        FAIL("the echo side got more than %d regions\n", NUM_REGIONS);
+    }
+    memory[num_registered] = cap;
+    regid[num_registered] = region_id;
+    num_registered++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * Reads the valid data of each buffer of a batch through the returned address, in its own
+ * mapping of the region, while it prefetches the next one, then answers in place.
+ */
+static void echo(bool ffq)
+{
+    struct cleanq *queue = test_create_queue(name, ffq, false, NUM_SLOTS);
+    cleanq_set_register_callback(queue, echo_register_cb);
+    num_registered = 0;
+
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        void *data[MAX_BATCH];
+        size_t num_deq;
+        errval_t err = cleanq_dequeue_batch_data(queue, bufs, data, (rand() % MAX_BATCH) + 1,
+                                                 &num_deq, 2);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        for (size_t i = 0; i < num_deq; i++) {
+            if (i + 1 < num_deq) {
+                cleanq_prefetch(data[i + 1], bufs[i + 1].valid_length, 2);
+            }
+
+            uint8_t *d = data[i];
+            if (bufs[i].flags != num_rx + i || d != buf_data(&bufs[i])) {
+                FAIL("the echo side got buffer %lu at %p\n", bufs[i].flags, data[i]);
+            }
+            for (genoffset_t j = 0; j < bufs[i].valid_length; j++) {
+                if (d[j] != (uint8_t)(bufs[i].flags + j)) {
+                    FAIL("byte %lu of buffer %lu is %u\n", j, bufs[i].flags, d[j]);
+                }
+                d[j] = ~d[j];
+            }
+        }
+
+        send_bufs(queue, bufs, num_deq);
+        num_rx += num_deq;
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * The echo process finds the data of the buffers of three shared regions at the addresses the
+ * dequeue returns, which are those of its own mappings.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        err = cleanq_memfd_alloc(&memory[i], MEMORY_SIZE);
+        if (err_is_fail(err)) {
+            FAIL("allocating region %zu failed %d\n", i, err);
+        }
+    }
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        err = cleanq_register(queue, memory[i], &regid[i]);
+        if (err_is_fail(err)) {
+            FAIL("registering region %zu failed %d\n", i, err);
+        }
+    }
+
+    /* both rings hold at most NUM_SLOTS buffers, the buffers in flight never overlap */
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        if (num_tx < NUM_MSGS && num_tx - num_rx < 2 * NUM_SLOTS) {
+            struct cleanq_buf b = random_buf(num_tx);
+            uint8_t *d = buf_data(&b);
+            for (genoffset_t j = 0; j < b.valid_length; j++) {
+                d[j] = (uint8_t)(num_tx + j);
+            }
+            err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data, b.valid_length,
+                                 b.flags);
+            if (err_is_ok(err)) {
+                num_tx++;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+        }
+
+        struct cleanq_buf b;
+        void *data;
+        err = cleanq_dequeue_data(queue, &b, &data, 1);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || b.flags != num_rx || data != buf_data(&b)) {
+            FAIL("expected buffer %lu back, got %lu err=%d\n", num_rx, b.flags, err);
+        }
+        uint8_t *d = data;
+        for (genoffset_t j = 0; j < b.valid_length; j++) {
+            if (d[j] != (uint8_t)~(num_rx + j)) {
+                FAIL("byte %lu of buffer %lu has not been answered\n", j, num_rx);
+            }
+        }
+        num_rx++;
+    }
+
+    test_join(pid);
+
+    cleanq_destroy(queue);
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        cleanq_memfd_free(&memory[i]);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-prefetch-%d", getpid());
+
+    printf("Starting ipcq addresses test\n");
+    test_addresses(false);
+
+    printf("Starting ffq addresses test\n");
+    test_addresses(true);
+
+    printf("Starting bounds test\n");
+    test_bounds();
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("prefetch test passed\n");
+
+    return 0;
+}
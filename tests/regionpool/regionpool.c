@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+
+#include <cleanq/cleanq.h>
+#include <region_pool.h>
+
+#define TEST_NAME "regionpool"
+#include "../common/test.h"
+
+
+///< the address space is split into this many slots, each holds at most one region start
+#define NUM_SLOTS (1 << 18)
+
+///< the distance of the slots, a region may reach into the next slot
+#define SLOT_SIZE 8192
+
+///< the base of the physical addresses, the pool never touches the memory
+#define BASE_ADDR (1UL << 32)
+
+///< more regions than region ids of 16 bits
+#define NUM_FILL 100000
+
+#define NUM_ROUNDS 1000000
+
+#define MAX_BATCH 16
+
+///< what the pool should contain
+struct slot
+{
+    bool present;
+    regionid_t id;
+    size_t len;
+};
+
+static struct slot slots[NUM_SLOTS];
+static size_t num_present;
+
+static struct region_pool *pool;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static uint64_t slot_addr(size_t i)
+{
+    return BASE_ADDR + i * SLOT_SIZE;
+}
+
+
+/*
+ * A region starting in slot i overlaps with one of its neighbours, regions are at most two
+ * slots long.
+ */
+static bool overlaps(size_t i, size_t len)
+{
+    if (i > 0 && slots[i - 1].present && slots[i - 1].len > SLOT_SIZE) {
+        return true;
+    }
+
+    return len > SLOT_SIZE && i + 1 < NUM_SLOTS && slots[i + 1].present;
+}
+
+
+static size_t random_len(void)
+{
+    if (rand() % 4 == 0) {
+        return SLOT_SIZE + (rand() % SLOT_SIZE) + 1;
+    }
+
+    return (rand() % SLOT_SIZE) + 1;
+}
+
+
+static void add_region(size_t i, size_t len)
+{
+    errval_t err;
+    struct capref cap = { .vaddr = NULL, .paddr = slot_addr(i), .len = len };
+
+    uint64_t gen = *region_pool_generation(pool);
+    regionid_t id;
+    err = region_pool_add_region(pool, cap, &id);
+
+    if (overlaps(i, len)) {
+        if (err != CLEANQ_ERR_INVALID_REGION_ARGS || *region_pool_generation(pool) != gen) {
+            FAIL("adding an overlapping region in slot %zu returned %d\n", i, err);
+        }
+        return;
+    }
+    if (err_is_fail(err) || *region_pool_generation(pool) == gen) {
+        FAIL("adding a region in slot %zu failed %d\n", i, err);
+    }
+
+    slots[i] = (struct slot){ .present = true, .id = id, .len = len };
+    num_present++;
+}
+
+
+static void remove_region(size_t i)
+{
+    struct capref cap;
+    uint64_t gen = *region_pool_generation(pool);
+    errval_t err = region_pool_remove_region(pool, slots[i].id, &cap);
+    if (err_is_fail(err) || cap.paddr != slot_addr(i) || cap.len != slots[i].len
+        || *region_pool_generation(pool) == gen) {
+        FAIL("removing the region in slot %zu returned %d\n", i, err);
+    }
+
+    err = region_pool_remove_region(pool, slots[i].id, &cap);
+    if (err != CLEANQ_ERR_INVALID_REGION_ID) {
+        FAIL("removing the region in slot %zu twice returned %d\n", i, err);
+    }
+
+    slots[i].present = false;
+    num_present--;
+}
+
+
+/*
+ * Looks the region in slot i up by its id and by an address, and checks a buffer in it.
+ */
+static void check_slot(size_t i)
+{
+    struct slot *s = &slots[i];
+    uint64_t addr = slot_addr(i) + (rand() % (2 * SLOT_SIZE));
+
+    /* the address is in slot i or i + 1, the regions of slots i - 1 to i + 1 may contain it */
+    size_t expected = NUM_SLOTS;
+    for (size_t j = i ? i - 1 : i; j <= i + 1 && j < NUM_SLOTS; j++) {
+        if (slots[j].present && addr >= slot_addr(j) && addr - slot_addr(j) < slots[j].len) {
+            expected = j;
+        }
+    }
+
+    regionid_t id;
+    genoffset_t offset;
+    bool found = region_pool_find_addr(pool, addr, &id, &offset);
+    if (found != (expected < NUM_SLOTS)
+        || (found && (id != slots[expected].id || offset != addr - slot_addr(expected)))) {
+        FAIL("address %lx is %s found\n", addr, found ? "wrongly" : "not");
+    }
+
+    if (!s->present) {
+        return;
+    }
+
+    struct capref cap;
+    size_t len;
+    if (!region_pool_get_cap(pool, s->id, &cap) || cap.paddr != slot_addr(i)
+        || !region_pool_get_length(pool, s->id, &len) || len != s->len) {
+        FAIL("the region of slot %zu is not found by its id %u\n", i, s->id);
+    }
+
+    genoffset_t buf_offset = rand() % (s->len + 1);
+    genoffset_t length = rand() % (s->len + 1);
+    genoffset_t valid_data = rand() % (length + 1);
+    genoffset_t valid_length = rand() % (length + 1);
+    bool valid = buf_offset + length <= s->len && valid_data + valid_length <= length;
+    if (region_pool_buffer_check_bounds(pool, s->id, buf_offset, length, valid_data,
+                                        valid_length)
+        != valid) {
+        FAIL("the buffer %lu+%lu in slot %zu is not %s\n", buf_offset, length, i,
+             valid ? "valid" : "invalid");
+    }
+}
+
+
+/*
+ * Checks a batch of buffers in the regions of random slots, the regions and buffers are valid
+ * up to the first of them that is not.
+ */
+static void check_batch(void)
+{
+    struct cleanq_buf bufs[MAX_BATCH];
+    size_t num = (rand() % MAX_BATCH) + 1;
+    size_t expected = num;
+
+    size_t i = rand() % NUM_SLOTS;
+    for (size_t j = 0; j < num; j++) {
+        /* consecutive buffers often share the region */
+        if (rand() % 2) {
+            i = rand() % NUM_SLOTS;
+        }
+        struct slot *s = &slots[i];
+        bufs[j] = (struct cleanq_buf){ .rid = s->id, .offset = 0, .length = SLOT_SIZE / 2,
+                                       .valid_data = 0, .valid_length = SLOT_SIZE / 2 };
+        bool valid = s->present && bufs[j].length <= s->len;
+        if (!s->present) {
+            bufs[j].rid = (regionid_t)rand();
+            struct capref cap;
+            valid = region_pool_get_cap(pool, bufs[j].rid, &cap)
+                    && cap.len >= bufs[j].length;
+        }
+        if (!valid && expected == num) {
+            expected = j;
+        }
+    }
+
+    size_t num_valid = region_pool_buffer_check_bounds_batch(pool, bufs, num);
+    if (num_valid != expected) {
+        FAIL("%zu of a batch of %zu buffers are valid, expected %zu\n", num_valid, num,
+             expected);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Fills the pool with more regions than fit into 16-bit ids, the ids are unique and every
+ * region is found by id and address.
+ */
+static void test_fill(void)
+{
+    while (num_present < NUM_FILL) {
+        size_t i = rand() % NUM_SLOTS;
+        if (!slots[i].present) {
+            add_region(i, random_len());
+        }
+    }
+
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        check_slot(i);
+    }
+
+    /* an id of another region can't be used again, a new one can */
+    size_t i = 0;
+    while (slots[i].present || overlaps(i, SLOT_SIZE)) {
+        i++;
+    }
+    struct capref cap = { .vaddr = NULL, .paddr = slot_addr(i), .len = SLOT_SIZE };
+    size_t other = (i + 1) % NUM_SLOTS;
+    while (!slots[other].present) {
+        other = (other + 1) % NUM_SLOTS;
+    }
+    errval_t err = region_pool_add_region_with_id(pool, cap, slots[other].id);
+    if (err != CLEANQ_ERR_INVALID_REGION_ID) {
+        FAIL("adding a region with the id of another returned %d\n", err);
+    }
+
+    regionid_t id = 0;
+    struct capref found;
+    while (region_pool_get_cap(pool, id, &found)) {
+        id++;
+    }
+    err = region_pool_add_region_with_id(pool, cap, id);
+    if (err_is_fail(err)) {
+        FAIL("adding a region with a free id failed %d\n", err);
+    }
+    slots[i] = (struct slot){ .present = true, .id = id, .len = SLOT_SIZE };
+    num_present++;
+
+    /* the range of a region of the other endpoint is taken even with an id no region uses */
+    regionid_t unused = id + 1;
+    while (region_pool_get_cap(pool, unused, &found)) {
+        unused++;
+    }
+    cap.paddr = slot_addr(i) + 1;
+    cap.len = 1;
+    err = region_pool_add_region_with_id(pool, cap, unused);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("adding a region within another one returned %d\n", err);
+    }
+
+    /* the model only knows the own regions */
+    remove_region(i);
+}
+
+
+/*
+ * The regions of the other endpoint may overlap with the own ones, a forked process maps its
+ * memory at the same addresses. An address is looked up in the own regions first.
+ */
+static void test_other_side(void)
+{
+    struct region_pool *p;
+    errval_t err = region_pool_init(&p);
+    if (err_is_fail(err)) {
+        FAIL("creating the pool failed %d\n", err);
+    }
+
+    struct capref cap = { .vaddr = NULL, .paddr = BASE_ADDR, .len = SLOT_SIZE };
+    regionid_t own;
+    err = region_pool_add_region(p, cap, &own);
+    if (err_is_fail(err)) {
+        FAIL("adding a region failed %d\n", err);
+    }
+
+    regionid_t other = own + 1;
+    err = region_pool_add_region_with_id(p, cap, other);
+    if (err_is_fail(err)) {
+        FAIL("adding a region of the other side at the same address returned %d\n", err);
+    }
+
+    /* the regions of each side must not overlap among themselves */
+    struct capref inner = { .vaddr = NULL, .paddr = BASE_ADDR + 1, .len = 1 };
+    regionid_t id;
+    err = region_pool_add_region(p, inner, &id);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("adding a region within an own one returned %d\n", err);
+    }
+    err = region_pool_add_region_with_id(p, inner, other + 1);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("adding a region within one of the other side returned %d\n", err);
+    }
+
+    genoffset_t offset;
+    if (!region_pool_find_addr(p, BASE_ADDR + 1, &id, &offset) || id != own || offset != 1) {
+        FAIL("the address is not found in the own region\n");
+    }
+    if (!region_pool_buffer_check_bounds(p, other, 0, SLOT_SIZE, 0, SLOT_SIZE)) {
+        FAIL("a buffer in the region of the other side is not valid\n");
+    }
+
+    /* without the own region, the address is in the region of the other side */
+    struct capref removed;
+    err = region_pool_remove_region(p, own, &removed);
+    if (err_is_fail(err)) {
+        FAIL("removing the own region failed %d\n", err);
+    }
+    if (!region_pool_find_addr(p, BASE_ADDR + 1, &id, &offset) || id != other) {
+        FAIL("the address is not found in the region of the other side\n");
+    }
+
+    err = region_pool_remove_region(p, other, &removed);
+    if (err_is_fail(err)) {
+        FAIL("removing the region of the other side failed %d\n", err);
+    }
+    if (region_pool_find_addr(p, BASE_ADDR + 1, &id, &offset)) {
+        FAIL("the address is found after all regions are removed\n");
+    }
+
+    err = region_pool_destroy(p);
+    if (err_is_fail(err)) {
+        FAIL("destroying the pool failed %d\n", err);
+    }
+}
+
+
+/*
+ * A forked process registers memory it got from its parent, at the same address as the memory
+ * the parent registers. Each side takes the buffers in the region of the other one.
+ */
+static void test_forked(void)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-regionpool-%d", getpid());
+
+    struct capref mem = { .len = SLOT_SIZE };
+    mem.vaddr = malloc(mem.len);
+    mem.paddr = (uint64_t)mem.vaddr;
+
+    struct cleanq *queue = test_create_queue(name, true, true, 0);
+    struct cleanq_buf b;
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        struct cleanq *other = test_create_queue(name, true, false, 0);
+        regionid_t rid;
+        err = cleanq_register(other, mem, &rid);
+        if (err_is_fail(err)) {
+            FAIL("registering memory on the forked side failed %d\n", err);
+        }
+        err = cleanq_enqueue(other, rid, 0, SLOT_SIZE, 0, SLOT_SIZE, 0);
+        if (err_is_fail(err)) {
+            FAIL("sending a buffer to the parent failed %d\n", err);
+        }
+
+        while ((err = cleanq_dequeue(other, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                     &b.valid_length, &b.flags))
+               == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+        }
+        if (err_is_fail(err) || b.rid == rid) {
+            FAIL("the buffer of the parent came back with %d in region %u\n", err, b.rid);
+        }
+        exit(0);
+    }
+
+    alarm(10);
+    while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags))
+           == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("receiving the buffer of the forked side returned %d\n", err);
+    }
+
+    regionid_t rid;
+    err = cleanq_register(queue, mem, &rid);
+    if (err_is_fail(err) || rid == b.rid) {
+        FAIL("registering memory at the address of the forked side returned %d\n", err);
+    }
+    err = cleanq_enqueue(queue, rid, 0, SLOT_SIZE, 0, SLOT_SIZE, 0);
+    if (err_is_fail(err)) {
+        FAIL("sending a buffer to the forked side failed %d\n", err);
+    }
+
+    test_join(pid);
+    cleanq_destroy(queue);
+    free(mem.vaddr);
+}
+
+
+/*
+ * Adds and removes random regions, and checks lookups in between against the model.
+ */
+static void test_randomized(void)
+{
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+        size_t i = rand() % NUM_SLOTS;
+        switch (rand() % 4) {
+        case 0:
+            if (slots[i].present) {
+                remove_region(i);
+            } else {
+                add_region(i, random_len());
+            }
+            break;
+        case 1:
+            check_batch();
+            break;
+        default:
+            check_slot(i);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        check_slot(i);
+    }
+}
+
+
+/*
+ * A shared pool stays alive until the last reference is dropped. Sharing it with another thread
+ * locks it, which doesn't change its contents.
+ */
+static void test_share(void)
+{
+    struct region_pool *shared = region_pool_share(pool, true);
+    if (shared != pool) {
+        FAIL("sharing the pool returned another pool\n");
+    }
+
+    errval_t err = region_pool_destroy(pool);
+    if (err_is_fail(err)) {
+        FAIL("dropping a reference failed %d\n", err);
+    }
+
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        check_slot(i);
+    }
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        if (slots[i].present) {
+            remove_region(i);
+        }
+    }
+    if (num_present != 0) {
+        FAIL("%zu regions are left\n", num_present);
+    }
+
+    err = region_pool_destroy(shared);
+    if (err_is_fail(err)) {
+        FAIL("destroying the pool failed %d\n", err);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("a buffer of the forked side got lost");
+
+    errval_t err = region_pool_init(&pool);
+    if (err_is_fail(err)) {
+        FAIL("creating the pool failed %d\n", err);
+    }
+
+    printf("Starting fill test\n");
+    test_fill();
+
+    printf("Starting other side test\n");
+    test_other_side();
+
+    printf("Starting forked test\n");
+    test_forked();
+
+    printf("Starting randomized test\n");
+    test_randomized();
+
+    printf("Starting share test\n");
+    test_share();
+
+    printf("regionpool test passed\n");
+
+    return 0;
+}
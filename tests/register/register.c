@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+#include <cleanq_backend.h>
+
+#define TEST_NAME "register"
+#include "../common/test.h"
+
+
+#define REGION_SIZE 4096
+
+///< regions of this size are refused by the other side
+#define REFUSED_SIZE 8192
+
+#define NUM_REGIONS 300
+
+///< a small ring, so that the batches do not fit at once
+#define NUM_SLOTS 64
+
+#define MAX_BATCH 40
+
+///< the number of regions of the batch whose notification fails
+#define NUM_NOTIFY 8
+
+///< the test fails if an acknowledgement got lost and it waits for this long
+#define HANG_TIMEOUT_S 60
+
+static struct capref caps[NUM_REGIONS];
+static regionid_t rids[NUM_REGIONS];
+
+static struct capref notify_caps[NUM_NOTIFY];
+static regionid_t notify_rids[NUM_NOTIFY];
+
+///< the tokens of the batches sent, the outcome and whether the callback has been called
+static cleanq_reg_token_t tokens[NUM_REGIONS];
+static errval_t results[NUM_REGIONS];
+static bool completed[NUM_REGIONS];
+static size_t num_batches;
+static size_t num_completed;
+
+///< the number of failed registrations reported without a token
+static size_t num_untracked;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void hang_handler(int sig)
+{
+    (void)sig;
+    printf("register test failed: only %zu of %zu batches acknowledged after %d seconds\n",
+           num_completed, num_batches, HANG_TIMEOUT_S);
+    exit(1);
+}
+
+
+static bool is_refused(size_t i)
+{
+    return (i % 37) == 5;
+}
+
+
+static void register_done(struct cleanq *q, cleanq_reg_token_t token, errval_t err)
+{
+    (void)q;
+
+    if (token == 0) {
+        num_untracked++;
+        return;
+    }
+
+    for (size_t i = 0; i < num_batches; i++) {
+        if (tokens[i] == token) {
+            if (completed[i]) {
+                FAIL("batch %zu has been completed twice\n", i);
+            }
+            completed[i] = true;
+            results[i] = err;
+            num_completed++;
+            return;
+        }
+    }
+
+    FAIL("the callback got the unknown token %lu\n", token);
+}
+
+
+/*
+ * Handles the acknowledgements that have arrived, no buffers are expected back.
+ */
+static void poll_queue(struct cleanq *queue)
+{
+    struct cleanq_buf b;
+    errval_t err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                  &b.valid_length, &b.flags);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("polling for acknowledgements returned %d\n", err);
+    }
+    sched_yield();
+}
+
+
+static errval_t failing_notify(struct cleanq *q)
+{
+    (void)q;
+
+    return CLEANQ_ERR_NOT_SUPPORTED;
+}
+
+
+static struct cleanq *create_queue(const char *name, bool ipc, bool clear, bool compact)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    if (ipc) {
+        struct cleanq_ipcq_attr attr = { 0 };
+        attr.slots = NUM_SLOTS;
+        attr.compact = compact;
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, (char *)name, clear,
+                                           &attr);
+    } else {
+        struct cleanq_ffq_attr attr = { 0 };
+        attr.slots = NUM_SLOTS;
+        attr.compact = compact;
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&queue, name, clear, &attr);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    return queue;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * A queue without another side completes the batches right away.
+ */
+static void test_local(void)
+{
+    errval_t err;
+
+    struct cleanq_loopbackq *lbq;
+    err = loopback_queue_create(&lbq);
+    if (err_is_fail(err)) {
+        FAIL("creating loopback queue failed %d\n", err);
+    }
+    struct cleanq *queue = (struct cleanq *)lbq;
+
+    size_t num_reg;
+    cleanq_reg_token_t token;
+    err = cleanq_register_batch(queue, caps, MAX_BATCH, rids, &num_reg, &token);
+    if (err_is_fail(err) || num_reg != MAX_BATCH || token == 0) {
+        FAIL("registering on a loopback queue returned %d with %zu regions\n", err, num_reg);
+    }
+
+    err = cleanq_register_status(queue, token);
+    if (err_is_fail(err)) {
+        FAIL("the loopback batch has status %d\n", err);
+    }
+
+    uint64_t pending;
+    err = cleanq_control(queue, CLEANQ_CTRL_REGISTER_PENDING, 0, &pending);
+    if (err_is_fail(err) || pending) {
+        FAIL("the loopback queue has %lu registrations pending, err=%d\n", pending, err);
+    }
+
+    for (size_t i = 0; i < MAX_BATCH; i++) {
+        err = cleanq_enqueue(queue, rids[i], 0, REGION_SIZE, 0, REGION_SIZE, i);
+        if (err_is_fail(err)) {
+            FAIL("enqueue into region %zu of the batch returned %d\n", i, err);
+        }
+    }
+
+    cleanq_destroy(queue);
+}
+
+
+/*
+ * Registers all regions in batches of random size while the ring fills up, the other side
+ * refuses some of them. Every batch is completed once and the callback and the status agree on
+ * the outcome, which is the refusal for the batches with a refused region.
+ */
+static void test_batches(struct cleanq *queue)
+{
+    errval_t err;
+
+    cleanq_set_register_done_callback(queue, register_done);
+
+    memset(completed, 0, sizeof(completed));
+    num_batches = 0;
+    num_completed = 0;
+    num_untracked = 0;
+
+    size_t first[NUM_REGIONS + 1];
+    size_t done = 0;
+    uint64_t num_full = 0;
+
+    while (done < NUM_REGIONS) {
+        size_t num = (rand() % MAX_BATCH) + 1;
+        if (num > NUM_REGIONS - done) {
+            num = NUM_REGIONS - done;
+        }
+
+        size_t num_reg;
+        cleanq_reg_token_t token;
+        err = cleanq_register_batch(queue, caps + done, num, rids + done, &num_reg, &token);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            num_full++;
+            poll_queue(queue);
+            continue;
+        }
+        if (err_is_fail(err) || num_reg == 0 || num_reg > num) {
+            FAIL("registering %zu regions returned %d with %zu\n", num, err, num_reg);
+        }
+        if (token == 0 || (num_batches && token <= tokens[num_batches - 1])) {
+            FAIL("batch %zu got token %lu\n", num_batches, token);
+        }
+
+        err = cleanq_register_status(queue, token);
+        if (err != CLEANQ_ERR_REGISTER_PENDING && err_is_fail(err)
+            && err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+            FAIL("the status of a new batch is %d\n", err);
+        }
+
+        tokens[num_batches] = token;
+        first[num_batches] = done;
+        num_batches++;
+        done += num_reg;
+    }
+    first[num_batches] = NUM_REGIONS;
+
+    if (num_full == 0) {
+        FAIL("the batches never filled the ring\n");
+    }
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (rids[i] == rids[j]) {
+                FAIL("regions %zu and %zu have the same id %u\n", j, i, rids[i]);
+            }
+        }
+    }
+
+    err = cleanq_register_status(queue, 0);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("the status of token 0 is %d\n", err);
+    }
+    err = cleanq_register_status(queue, tokens[num_batches - 1] + 1);
+    if (err != CLEANQ_ERR_INVALID_REGION_ARGS) {
+        FAIL("the status of an unknown token is %d\n", err);
+    }
+
+    /* a refused synchronous registration is reported without a token */
+    struct capref refused = { .vaddr = malloc(REFUSED_SIZE), .len = REFUSED_SIZE };
+    refused.paddr = (uint64_t)refused.vaddr;
+    regionid_t refused_rid;
+    err = cleanq_register(queue, refused, &refused_rid);
+    if (err_is_fail(err)) {
+        FAIL("registering a region to be refused returned %d\n", err);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    uint64_t pending = 1;
+    while (pending || num_completed < num_batches || num_untracked == 0) {
+        poll_queue(queue);
+        err = cleanq_control(queue, CLEANQ_CTRL_REGISTER_PENDING, 0, &pending);
+        if (err_is_fail(err)) {
+            FAIL("querying the pending registrations returned %d\n", err);
+        }
+    }
+    alarm(0);
+
+    if (num_untracked != 1) {
+        FAIL("%zu registrations failed without a token\n", num_untracked);
+    }
+
+    for (size_t i = 0; i < num_batches; i++) {
+        bool refused = false;
+        for (size_t j = first[i]; j < first[i + 1]; j++) {
+            refused |= is_refused(j);
+        }
+
+        err = cleanq_register_status(queue, tokens[i]);
+        if (err != results[i]) {
+            FAIL("batch %zu has status %d but completed with %d\n", i, err, results[i]);
+        }
+        if (refused ? err != CLEANQ_ERR_INVALID_REGION_ARGS : err_is_fail(err)) {
+            FAIL("batch %zu with regions %zu to %zu completed with %d\n", i, first[i],
+                 first[i + 1], err);
+        }
+    }
+}
+
+
+/*
+ * The regions of the completed batches are known on the other side, it sends the buffers back.
+ */
+static void test_echo(struct cleanq *queue)
+{
+    errval_t err;
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        if (is_refused(i)) {
+            continue;
+        }
+
+        err = cleanq_enqueue(queue, rids[i], 0, REGION_SIZE, 0, REGION_SIZE, i);
+        if (err_is_fail(err)) {
+            FAIL("enqueue into region %zu returned %d\n", i, err);
+        }
+
+        struct cleanq_buf b;
+        alarm(HANG_TIMEOUT_S);
+        while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                     &b.valid_length, &b.flags))
+               == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+        }
+        alarm(0);
+        if (err_is_fail(err) || b.rid != rids[i] || b.flags != i) {
+            FAIL("region %zu came back as %u with flags %lu, err=%d\n", i, b.rid, b.flags, err);
+        }
+    }
+}
+
+
+/*
+ * Waking up the other side fails after a batch has been sent. The batch fails as a whole and
+ * the other side removes its regions again, so the same memory can be registered once more.
+ */
+static void test_notify_failure(struct cleanq *queue)
+{
+    errval_t err;
+
+    size_t num_reg;
+    cleanq_reg_token_t token;
+    cleanq_notify_t notify = queue->f.notify;
+    queue->f.notify = failing_notify;
+    err = cleanq_register_batch(queue, notify_caps, NUM_NOTIFY, notify_rids, &num_reg, &token);
+    queue->f.notify = notify;
+    if (err != CLEANQ_ERR_NOT_SUPPORTED || num_reg != 0) {
+        FAIL("a batch whose notification failed returned %d with %zu regions\n", err, num_reg);
+    }
+
+    /* the acknowledgement of the failed batch must not reach the callback */
+    alarm(HANG_TIMEOUT_S);
+    while ((err = cleanq_register_batch(queue, notify_caps, NUM_NOTIFY, notify_rids, &num_reg,
+                                        &token))
+           == CLEANQ_ERR_QUEUE_FULL) {
+        poll_queue(queue);
+    }
+    if (err_is_fail(err) || num_reg != NUM_NOTIFY) {
+        FAIL("registering the regions again returned %d with %zu regions\n", err, num_reg);
+    }
+    tokens[num_batches++] = token;
+
+    while (num_completed < num_batches) {
+        poll_queue(queue);
+    }
+    alarm(0);
+
+    if (err_is_fail(results[num_batches - 1])) {
+        FAIL("the other side refused the regions again with %d\n", results[num_batches - 1]);
+    }
+
+    for (size_t i = 0; i < NUM_NOTIFY; i++) {
+        err = cleanq_enqueue(queue, notify_rids[i], 0, REGION_SIZE, 0, REGION_SIZE, i);
+        if (err_is_fail(err)) {
+            FAIL("enqueue into region %zu returned %d\n", i, err);
+        }
+
+        struct cleanq_buf b;
+        alarm(HANG_TIMEOUT_S);
+        while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                     &b.valid_length, &b.flags))
+               == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+        }
+        alarm(0);
+        if (err_is_fail(err) || b.rid != notify_rids[i] || b.flags != i) {
+            FAIL("region %zu came back as %u with flags %lu, err=%d\n", i, b.rid, b.flags, err);
+        }
+    }
+
+    for (size_t i = 0; i < NUM_NOTIFY; i++) {
+        struct capref cap;
+        err = cleanq_deregister(queue, notify_rids[i], &cap);
+        if (err_is_fail(err)) {
+            FAIL("deregistering region %zu returned %d\n", i, err);
+        }
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static errval_t register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+    (void)region_id;
+
+    return (cap.len == REFUSED_SIZE) ? CLEANQ_ERR_INVALID_REGION_ARGS : CLEANQ_ERR_OK;
+}
+
+
+static void echo(const char *name, bool ipc, bool compact)
+{
+    struct cleanq *queue = create_queue(name, ipc, false, compact);
+    cleanq_set_register_callback(queue, register_cb);
+
+    while (true) {
+        struct cleanq_buf b;
+        errval_t err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                      &b.valid_length, &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+    }
+}
+
+
+static void run_test(const char *q_name, bool ipc, bool compact)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-register-%s-%d", q_name, getpid());
+
+    struct cleanq *queue = create_queue(name, ipc, true, compact);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(name, ipc, compact);
+    }
+
+    printf("Starting batch test %s\n", q_name);
+    test_batches(queue);
+
+    printf("Starting echo test %s\n", q_name);
+    test_echo(queue);
+
+    printf("Starting notify failure test %s\n", q_name);
+    test_notify_failure(queue);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    signal(SIGALRM, hang_handler);
+
+    for (size_t i = 0; i < NUM_REGIONS; i++) {
+        caps[i].len = is_refused(i) ? REFUSED_SIZE : REGION_SIZE;
+        caps[i].vaddr = malloc(caps[i].len);
+        caps[i].paddr = (uint64_t)caps[i].vaddr;
+    }
+    for (size_t i = 0; i < NUM_NOTIFY; i++) {
+        notify_caps[i].len = REGION_SIZE;
+        notify_caps[i].vaddr = malloc(REGION_SIZE);
+        notify_caps[i].paddr = (uint64_t)notify_caps[i].vaddr;
+    }
+
+    printf("Starting local test\n");
+    test_local();
+
+    run_test("ffq", false, false);
+    run_test("ipcq", true, false);
+    run_test("ipcq-compact", true, true);
+
+    printf("register test passed\n");
+
+    return 0;
+}
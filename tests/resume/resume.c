@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq_shm.h>
+
+#define TEST_NAME "resume"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 4096
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< the size of the region of the echo side, it tells the regions apart
+#define ECHO_MEMORY_SIZE 2 * BUF_SIZE
+
+///< the number of times the echo side is killed and started again
+#define NUM_GENERATIONS 6
+
+///< the number of buffers every generation of the echo side sends back before it stops
+#define NUM_ECHOS 500
+
+///< the maximum number of buffers in flight, they stay in the ring when the echo side dies
+#define MAX_IN_FLIGHT 32
+
+///< marks the buffer of the echo side region in the flags
+#define ECHO_FLAG (1UL << 20)
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+///< the region of each side, as mapped in this process
+static struct capref memory;
+static regionid_t regid;
+static struct capref echo_memory;
+static regionid_t echo_regid;
+
+///< the number of regions of the echo side that have been deregistered
+static int num_deregistered;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static struct cleanq *create_queue(bool clear)
+{
+    /* the creator records the endpoints, the echo side takes over the role of a dead one */
+    struct cleanq_ipcq_attr attr = { 0 };
+    attr.resume = true;
+
+    struct cleanq *queue;
+    errval_t err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, name, clear,
+                                                &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    return queue;
+}
+
+
+static char *buf_data(struct capref *cap, genoffset_t offset)
+{
+    return (char *)cap->vaddr + offset;
+}
+
+
+/*
+ * Either side polls for the next buffer, and handles the commands on the way.
+ */
+static void wait_dequeue(struct cleanq *queue, struct cleanq_buf *b)
+{
+    errval_t err;
+
+    alarm(HANG_TIMEOUT_S);
+    while ((err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                 &b->valid_length, &b->flags))
+           == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+    }
+    alarm(0);
+    if (err_is_fail(err)) {
+        FAIL("dequeue returned %d\n", err);
+    }
+}
+
+
+static void send_buf(struct cleanq *queue, const struct cleanq_buf *b)
+{
+    errval_t err = cleanq_enqueue(queue, b->rid, b->offset, b->length, b->valid_data,
+                                  b->valid_length, b->flags);
+    if (err_is_fail(err)) {
+        FAIL("enqueue returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static errval_t echo_register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    memory = cap;
+    regid = region_id;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * The first generation registers a region allocated with cleanq_memfd_alloc(), which survives,
+ * and one on the heap, which does not. The later ones find the regions in the queue.
+ */
+static void echo_regions(struct cleanq *queue, int generation)
+{
+    errval_t err;
+
+    if (generation == 0) {
+        if (cleanq_ipcq_resumed((struct cleanq_ipcq *)queue)) {
+            FAIL("the first generation has resumed an endpoint\n");
+        }
+
+        /* both sides must not register at the same time, wait for the region of the other */
+        while (memory.vaddr == NULL) {
+            struct cleanq_buf b;
+            err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags);
+            if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+                FAIL("dequeue before the region of the other side returned %d\n", err);
+            }
+            sched_yield();
+        }
+
+        err = cleanq_memfd_alloc(&echo_memory, ECHO_MEMORY_SIZE);
+        if (err_is_fail(err)) {
+            FAIL("allocating the memory of the echo side failed %d\n", err);
+        }
+        err = cleanq_register(queue, echo_memory, &echo_regid);
+        if (err_is_fail(err)) {
+            FAIL("registering the memory of the echo side failed %d\n", err);
+        }
+
+        struct capref heap;
+        heap.vaddr = malloc(BUF_SIZE);
+        heap.paddr = (uint64_t)heap.vaddr;
+        heap.len = BUF_SIZE;
+        regionid_t heap_regid;
+        err = cleanq_register(queue, heap, &heap_regid);
+        if (err_is_fail(err)) {
+            FAIL("registering heap memory failed %d\n", err);
+        }
+        return;
+    }
+
+    if (!cleanq_ipcq_resumed((struct cleanq_ipcq *)queue)) {
+        FAIL("generation %d has not resumed the endpoint\n", generation);
+    }
+
+    regionid_t rids[4];
+    struct capref caps[4];
+    size_t num;
+    err = cleanq_ipcq_get_regions((struct cleanq_ipcq *)queue, rids, caps, 4, &num);
+    if (err_is_fail(err) || num != 2) {
+        FAIL("generation %d got %zu regions, err=%d\n", generation, num, err);
+    }
+    for (size_t i = 0; i < num; i++) {
+        if (caps[i].len == ECHO_MEMORY_SIZE) {
+            echo_memory = caps[i];
+            echo_regid = rids[i];
+        } else {
+            memory = caps[i];
+            regid = rids[i];
+        }
+    }
+    if (echo_memory.vaddr == NULL || memory.vaddr == NULL) {
+        FAIL("generation %d is missing a region\n", generation);
+    }
+}
+
+
+/*
+ * Sends a buffer of its own region with the generation, answers the buffers of the other side
+ * in place until NUM_ECHOS of them went back and then waits to be killed.
+ */
+static void echo(int generation)
+{
+    struct cleanq *queue = create_queue(false);
+    cleanq_set_register_callback(queue, echo_register_cb);
+
+    /* every received descriptor is acknowledged, none is received twice after a restart */
+    uint64_t old;
+    errval_t err = cleanq_control(queue, CLEANQ_CTRL_ACK_BATCH, 1, &old);
+    if (err_is_fail(err)) {
+        FAIL("setting the acknowledgement batch failed %d\n", err);
+    }
+
+    echo_regions(queue, generation);
+
+    /* the buffer of the last generation may still be on its way back */
+    genoffset_t offset = (generation % 2) * BUF_SIZE;
+    snprintf(buf_data(&echo_memory, offset), BUF_SIZE, "generation %d", generation);
+    struct cleanq_buf b = { .rid = echo_regid, .offset = offset, .length = BUF_SIZE,
+                            .valid_length = BUF_SIZE, .flags = ECHO_FLAG | generation };
+    send_buf(queue, &b);
+
+    int num_echos = 0;
+    while (num_echos < NUM_ECHOS) {
+        wait_dequeue(queue, &b);
+        if (b.rid == echo_regid) {
+            /* our buffer came back, possibly one of an earlier generation */
+            continue;
+        }
+
+        char expected[64];
+        snprintf(expected, sizeof(expected), "ping %lu", b.flags);
+        if (b.rid != regid || strcmp(buf_data(&memory, b.offset), expected)) {
+            FAIL("generation %d got %s instead of %s\n", generation,
+                 buf_data(&memory, b.offset), expected);
+        }
+        snprintf(buf_data(&memory, b.offset), BUF_SIZE, "pong %lu", b.flags);
+
+        send_buf(queue, &b);
+        num_echos++;
+    }
+
+    while (true) {
+        pause();
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+static errval_t register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    if (cap.len == ECHO_MEMORY_SIZE) {
+        echo_memory = cap;
+        echo_regid = region_id;
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static errval_t deregister_cb(struct cleanq *q, regionid_t region_id)
+{
+    (void)q;
+
+    if (region_id == echo_regid) {
+        FAIL("the region allocated with cleanq_memfd_alloc() has been deregistered\n");
+    }
+    num_deregistered++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static pid_t start_echo(int generation)
+{
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(generation);
+    }
+
+    return pid;
+}
+
+
+/*
+ * Sends buffers to the echo side, which is killed after every NUM_ECHOS buffers and started
+ * again. The buffers it has not received yet stay in the ring, the new process receives them
+ * and the buffers come back in order without a gap. Its memory from cleanq_memfd_alloc() is
+ * mapped again, its heap memory is deregistered.
+ */
+static void test_resume(struct cleanq *queue)
+{
+    errval_t err;
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+
+    pid_t pid = start_echo(0);
+
+    /* the memory file is passed once the other side has attached */
+    err = cleanq_memfd_alloc(&memory, MEMORY_SIZE);
+    if (err_is_fail(err)) {
+        FAIL("allocating memory failed %d\n", err);
+    }
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    for (int generation = 0; generation < NUM_GENERATIONS; generation++) {
+        /* the echo side sends its own buffer first, the previous one has sent back all others */
+        struct cleanq_buf b;
+        wait_dequeue(queue, &b);
+
+        char expected[64];
+        snprintf(expected, sizeof(expected), "generation %d", generation);
+        if (b.rid != echo_regid || b.flags != (ECHO_FLAG | generation)
+            || strcmp(buf_data(&echo_memory, b.offset), expected)) {
+            FAIL("generation %d sent flags=%lx first\n", generation, b.flags);
+        }
+        send_buf(queue, &b);
+
+        while (num_rx < (uint64_t)(generation + 1) * NUM_ECHOS) {
+            while (num_tx - num_rx < MAX_IN_FLIGHT) {
+                genoffset_t offset = (num_tx % NUM_BUFS) * BUF_SIZE;
+                snprintf(buf_data(&memory, offset), BUF_SIZE, "ping %lu", num_tx);
+                b = (struct cleanq_buf){ .rid = regid, .offset = offset, .length = BUF_SIZE,
+                                         .valid_length = BUF_SIZE, .flags = num_tx };
+                send_buf(queue, &b);
+                num_tx++;
+            }
+
+            wait_dequeue(queue, &b);
+
+            snprintf(expected, sizeof(expected), "pong %lu", num_rx);
+            if (b.rid != regid || b.flags != num_rx
+                || strcmp(buf_data(&memory, b.offset), expected)) {
+                FAIL("generation %d sent back %lu with %s instead of %lu\n", generation, b.flags,
+                     buf_data(&memory, b.offset), num_rx);
+            }
+            num_rx++;
+        }
+
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        if (generation + 1 < NUM_GENERATIONS) {
+            pid = start_echo(generation + 1);
+        }
+    }
+
+    if (num_deregistered != 1) {
+        FAIL("%d regions of the echo side have been deregistered\n", num_deregistered);
+    }
+}
+
+
+/*
+ * A second endpoint does not take the place of a live one, and an endpoint does not register
+ * more regions than can be recorded.
+ */
+static void test_limits(void)
+{
+    errval_t err;
+
+    struct cleanq *queue = create_queue(true);
+
+    struct cleanq_ipcq_attr attr = { 0 };
+    struct cleanq *other;
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&other, name, false, &attr);
+    if (err_is_fail(err)) {
+        FAIL("attaching to queue %s failed %d\n", name, err);
+    }
+    struct cleanq *third;
+    err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&third, name, false, &attr);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("attaching a third endpoint returned %d\n", err);
+    }
+
+    struct capref mem = { .len = (CLEANQ_SHM_REGION_SLOTS + 1) * BUF_SIZE };
+    mem.vaddr = malloc(mem.len);
+    mem.paddr = (uint64_t)mem.vaddr;
+    for (size_t i = 0; i <= CLEANQ_SHM_REGION_SLOTS; i++) {
+        struct capref cap = { .vaddr = (char *)mem.vaddr + i * BUF_SIZE,
+                              .paddr = mem.paddr + i * BUF_SIZE,
+                              .len = BUF_SIZE };
+        regionid_t rid;
+        err = cleanq_register(queue, cap, &rid);
+        if (i < CLEANQ_SHM_REGION_SLOTS ? err_is_fail(err) : err != CLEANQ_ERR_TOO_MANY_REGIONS) {
+            FAIL("registering region %zu returned %d\n", i, err);
+        }
+
+        /* the other side takes the command, there is room for the next one */
+        struct cleanq_buf b;
+        err = cleanq_dequeue(other, &b.rid, &b.offset, &b.length, &b.valid_data,
+                             &b.valid_length, &b.flags);
+        if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+            FAIL("dequeue after registering region %zu returned %d\n", i, err);
+        }
+    }
+
+    cleanq_destroy(other);
+    cleanq_destroy(queue);
+    free(mem.vaddr);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    test_watchdog("no progress");
+
+    snprintf(name, sizeof(name), "/cleanq-test-resume-%d", getpid());
+
+    struct cleanq *queue = create_queue(true);
+    cleanq_set_register_callback(queue, register_cb);
+    cleanq_set_deregister_callback(queue, deregister_cb);
+
+    printf("Starting resume test\n");
+    test_resume(queue);
+
+    cleanq_destroy(queue);
+
+    printf("Starting limits test\n");
+    test_limits();
+
+    printf("resume test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <slab.h>
+
+#define TEST_NAME "slab"
+#include "../common/test.h"
+
+
+#define BLOCK_SIZE 48
+
+#define MAX_LIVE 512
+
+#define NUM_ROUNDS 200000
+
+#define NUM_THREADS 4
+
+///< the number of slots to pass blocks between the threads
+#define NUM_EXCHANGE 64
+
+#define GROW_SIZE 100000
+
+///< a block is stamped with its owner and a serial number while it is allocated
+struct block
+{
+    uint64_t owner;
+    uint64_t serial;
+    uint8_t fill[BLOCK_SIZE - 2 * sizeof(uint64_t)];
+};
+
+static struct slab_allocator shared;
+
+///< blocks allocated by one thread and freed by another one
+static struct block *exchange[NUM_EXCHANGE];
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void stamp(struct block *b, uint64_t owner, uint64_t serial)
+{
+    b->owner = owner;
+    b->serial = serial;
+    memset(b->fill, (uint8_t)serial, sizeof(b->fill));
+}
+
+
+/*
+ * A block that has been handed out twice has been stamped by someone else in the meantime.
+ */
+static void check_stamp(const struct block *b, uint64_t owner, uint64_t serial)
+{
+    if (b->owner != owner || b->serial != serial) {
+        FAIL("block %p of %lu/%lu is stamped %lu/%lu\n", (void *)b, owner, serial, b->owner,
+             b->serial);
+    }
+    for (size_t i = 0; i < sizeof(b->fill); i++) {
+        if (b->fill[i] != (uint8_t)serial) {
+            FAIL("block %p of %lu/%lu is overwritten at %zu\n", (void *)b, owner, serial, i);
+        }
+    }
+}
+
+
+static void check_zero(const struct block *b)
+{
+    const uint8_t *p = (const uint8_t *)b;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (p[i]) {
+            FAIL("block %p is not zeroed at %zu\n", (void *)b, i);
+        }
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Allocates and frees blocks in random order, the blocks are zeroed and never handed out twice.
+ */
+static void test_randomized(void)
+{
+    struct slab_allocator slabs;
+    slab_init(&slabs, BLOCK_SIZE, slab_default_refill);
+
+    struct block *live[MAX_LIVE];
+    uint64_t serials[MAX_LIVE];
+    size_t num_live = 0;
+
+    for (uint64_t i = 0; i < NUM_ROUNDS; i++) {
+        if (num_live < MAX_LIVE && (num_live == 0 || (rand() % 2))) {
+            struct block *b = slab_alloc(&slabs);
+            if (b == NULL) {
+                FAIL("allocation %lu failed\n", i);
+            }
+            check_zero(b);
+            stamp(b, 0, i);
+            serials[num_live] = i;
+            live[num_live++] = b;
+        } else {
+            size_t j = rand() % num_live;
+            check_stamp(live[j], 0, serials[j]);
+            slab_free(&slabs, live[j]);
+            num_live--;
+            live[j] = live[num_live];
+            serials[j] = serials[num_live];
+        }
+    }
+
+    while (num_live) {
+        num_live--;
+        check_stamp(live[num_live], 0, serials[num_live]);
+        slab_free(&slabs, live[num_live]);
+    }
+
+    slab_destroy(&slabs);
+}
+
+
+/*
+ * Without a refill function, the allocator hands out the blocks of the memory it was given and
+ * then fails. After freeing them, the same number of blocks can be allocated again.
+ */
+static void test_grow(void)
+{
+    struct slab_allocator slabs;
+    if (slab_init_with_flags(&slabs, BLOCK_SIZE, NULL, SLAB_FLAG_NO_ZERO)) {
+        FAIL("initializing the allocator failed\n");
+    }
+
+    if (slab_alloc(&slabs) != NULL) {
+        FAIL("an allocator without memory handed out a block\n");
+    }
+
+    /* a buffer without an aligned piece that holds a block adds nothing */
+    uint8_t *buf = aligned_alloc(SLAB_MIN_SLABSIZE, 2 * SLAB_MIN_SLABSIZE);
+    if (slab_grow(&slabs, buf + 1, SLAB_MIN_SLABSIZE) != -EINVAL) {
+        FAIL("growing with an unaligned buffer didn't fail\n");
+    }
+    if (slab_alloc(&slabs) != NULL) {
+        FAIL("an allocator with an unaligned buffer handed out a block\n");
+    }
+    free(buf);
+
+    buf = malloc(GROW_SIZE);
+    if (slab_grow(&slabs, buf, GROW_SIZE)) {
+        FAIL("growing with %d bytes failed\n", GROW_SIZE);
+    }
+
+    static struct block *blocks[GROW_SIZE / BLOCK_SIZE];
+    size_t num = 0;
+    while ((blocks[num] = slab_alloc(&slabs)) != NULL) {
+        if ((uint8_t *)blocks[num] < buf || (uint8_t *)(blocks[num] + 1) > buf + GROW_SIZE) {
+            FAIL("block %p is outside of the memory given\n", (void *)blocks[num]);
+        }
+        stamp(blocks[num], 1, num);
+        num++;
+        if (num == GROW_SIZE / BLOCK_SIZE) {
+            FAIL("more blocks than fit into the memory\n");
+        }
+    }
+    if (num == 0) {
+        FAIL("no block from %d bytes\n", GROW_SIZE);
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        check_stamp(blocks[i], 1, i);
+        slab_free(&slabs, blocks[i]);
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        if (slab_alloc(&slabs) == NULL) {
+            FAIL("only %zu of %zu blocks could be allocated again\n", i, num);
+        }
+    }
+    if (slab_alloc(&slabs) != NULL) {
+        FAIL("more blocks than before\n");
+    }
+
+    slab_destroy(&slabs);
+    free(buf);
+}
+
+
+/*
+ * Allocates and frees blocks on the shared allocator, and passes some of them to the other
+ * threads, which free them. A block with a different stamp has been handed out twice.
+ */
+static void *thread_randomized(void *arg)
+{
+    uint64_t owner = (uintptr_t)arg;
+    unsigned int seed = time(NULL) + owner;
+
+    struct block *live[MAX_LIVE];
+    size_t num_live = 0;
+
+    for (uint64_t i = 0; i < NUM_ROUNDS; i++) {
+        int action = rand_r(&seed) % 8;
+
+        if (action == 0) {
+            /* take a block of another thread, or leave one for them */
+            size_t slot = rand_r(&seed) % NUM_EXCHANGE;
+            struct block *b = __atomic_exchange_n(&exchange[slot], NULL, __ATOMIC_ACQUIRE);
+            if (b) {
+                check_stamp(b, b->owner, b->serial);
+                slab_free(&shared, b);
+            } else if (num_live) {
+                num_live--;
+                b = live[num_live];
+                struct block *other = NULL;
+                if (!__atomic_compare_exchange_n(&exchange[slot], &other, b, false,
+                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                    live[num_live++] = b;
+                }
+            }
+        } else if (num_live < MAX_LIVE && (num_live == 0 || (action % 2))) {
+            struct block *b = slab_alloc(&shared);
+            if (b == NULL) {
+                FAIL("thread %lu allocation %lu failed\n", owner, i);
+            }
+            check_zero(b);
+            stamp(b, owner, i);
+            live[num_live++] = b;
+        } else {
+            size_t j = rand_r(&seed) % num_live;
+            struct block *b = live[j];
+            if (b->owner != owner) {
+                FAIL("thread %lu owns a block of thread %lu\n", owner, b->owner);
+            }
+            check_stamp(b, owner, b->serial);
+            slab_free(&shared, b);
+            live[j] = live[--num_live];
+        }
+    }
+
+    while (num_live) {
+        slab_free(&shared, live[--num_live]);
+    }
+
+    /* the magazine of this thread is flushed when it exits */
+    return NULL;
+}
+
+
+static void test_threads(void)
+{
+    if (slab_init_with_flags(&shared, BLOCK_SIZE, slab_default_refill,
+                             SLAB_FLAG_THREAD_CACHE)) {
+        FAIL("initializing the thread cached allocator failed\n");
+    }
+
+    pthread_t threads[NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_randomized, (void *)(i + 1))) {
+            FAIL("creating thread %lu failed\n", i);
+        }
+    }
+    for (size_t i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < NUM_EXCHANGE; i++) {
+        if (exchange[i]) {
+            check_stamp(exchange[i], exchange[i]->owner, exchange[i]->serial);
+            slab_free(&shared, exchange[i]);
+            exchange[i] = NULL;
+        }
+    }
+
+    /* the blocks of the exited threads can be allocated again */
+    struct block *live[MAX_LIVE];
+    for (size_t i = 0; i < MAX_LIVE; i++) {
+        live[i] = slab_alloc(&shared);
+        if (live[i] == NULL) {
+            FAIL("allocation after the threads exited failed\n");
+        }
+        check_zero(live[i]);
+    }
+    for (size_t i = 0; i < MAX_LIVE; i++) {
+        slab_free(&shared, live[i]);
+    }
+
+    slab_destroy(&shared);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+
+    printf("Starting randomized slab test\n");
+    test_randomized();
+
+    printf("Starting slab grow test\n");
+    test_grow();
+
+    printf("Starting threaded slab test\n");
+    test_threads();
+
+    printf("slab test passed\n");
+
+    return 0;
+}
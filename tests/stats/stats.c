@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "stats"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 512
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define NUM_ROUNDS 200000
+
+///< the counters are compared with the model this often
+#define CHECK_INTERVAL 1000
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 50000
+
+///< the monitor samples the counters this often, like cleanq-top but faster
+#define MONITOR_INTERVAL_US 100
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the monitor thread stops once this is set
+static bool done;
+static uint64_t num_samples;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static uint64_t read_stat(struct cleanq *q, cleanq_stat_t stat)
+{
+    uint64_t value;
+    errval_t err = cleanq_control(q, CLEANQ_CTRL_STATS, stat, &value);
+    if (err_is_fail(err)) {
+        FAIL("reading counter %d failed %d\n", stat, err);
+    }
+    return value;
+}
+
+
+/*
+ * The counters of the endpoint match the model, whether they are copied, read one by one or
+ * read through the shared memory view.
+ */
+static void check_stats(struct cleanq *q, const struct cleanq_stats *model,
+                        const volatile struct cleanq_stats *view)
+{
+    struct cleanq_stats s;
+    cleanq_get_stats(q, &s);
+
+    if (s.enqueues != model->enqueues || s.dequeues != model->dequeues
+        || s.enqueue_full != model->enqueue_full || s.dequeue_empty != model->dequeue_empty
+        || s.enqueue_bytes != model->enqueue_bytes || s.dequeue_bytes != model->dequeue_bytes
+        || s.slots != NUM_SLOTS || s.pid != (uint64_t)getpid()) {
+        FAIL("counted %lu/%lu enqueues/dequeues, %lu/%lu full/empty, expected %lu/%lu, %lu/%lu\n",
+             s.enqueues, s.dequeues, s.enqueue_full, s.dequeue_empty, model->enqueues,
+             model->dequeues, model->enqueue_full, model->dequeue_empty);
+    }
+
+    /* the high-water mark is sampled, but a full ring is always seen */
+    if (s.occupancy_hwm > NUM_SLOTS || (model->enqueue_full && s.occupancy_hwm != NUM_SLOTS)) {
+        FAIL("the high-water mark is %lu after %lu full rings\n", s.occupancy_hwm,
+             model->enqueue_full);
+    }
+
+    if (read_stat(q, CLEANQ_STAT_ENQUEUES) != s.enqueues
+        || read_stat(q, CLEANQ_STAT_DEQUEUES) != s.dequeues
+        || read_stat(q, CLEANQ_STAT_ENQUEUE_FULL) != s.enqueue_full
+        || read_stat(q, CLEANQ_STAT_DEQUEUE_EMPTY) != s.dequeue_empty
+        || read_stat(q, CLEANQ_STAT_ENQUEUE_BYTES) != s.enqueue_bytes
+        || read_stat(q, CLEANQ_STAT_DEQUEUE_BYTES) != s.dequeue_bytes
+        || read_stat(q, CLEANQ_STAT_OCCUPANCY_HWM) != s.occupancy_hwm
+        || read_stat(q, CLEANQ_STAT_SLOTS) != s.slots) {
+        FAIL("the counters read one by one do not match\n");
+    }
+
+    if (view->enqueues != s.enqueues || view->dequeues != s.dequeues
+        || view->enqueue_full != s.enqueue_full || view->dequeue_empty != s.dequeue_empty
+        || view->enqueue_bytes != s.enqueue_bytes || view->dequeue_bytes != s.dequeue_bytes
+        || view->occupancy_hwm != s.occupancy_hwm || view->slots != s.slots
+        || view->pid != s.pid) {
+        FAIL("the counters in shared memory do not match\n");
+    }
+}
+
+
+/*
+ * Sends a buffer from tx to rx and counts it in the model of tx.
+ */
+static void send_buf(struct cleanq *tx, struct cleanq_stats *model)
+{
+    genoffset_t valid_length = (rand() % BUF_SIZE) + 1;
+    errval_t err = cleanq_enqueue(tx, regid, (rand() % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0,
+                                  valid_length, 0);
+    if (err_is_ok(err)) {
+        model->enqueues++;
+        model->enqueue_bytes += valid_length;
+    } else if (err == CLEANQ_ERR_QUEUE_FULL) {
+        model->enqueue_full++;
+    } else {
+        FAIL("enqueue returned %d\n", err);
+    }
+}
+
+
+static void recv_buf(struct cleanq *rx, struct cleanq_stats *model)
+{
+    struct cleanq_buf b;
+    errval_t err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                  &b.valid_length, &b.flags);
+    if (err_is_ok(err)) {
+        model->dequeues++;
+        model->dequeue_bytes += b.valid_length;
+    } else if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+        model->dequeue_empty++;
+    } else {
+        FAIL("dequeue returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Both endpoints of a queue in this process send and receive at random, every call is counted
+ * on the endpoint that made it. The view of the statistics survives the queue.
+ */
+static void test_counters(bool ffq)
+{
+    errval_t err;
+    struct cleanq_stats_view view;
+
+    err = cleanq_stats_attach(&view, name);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("attaching to the statistics of a queue that does not exist returned %d\n", err);
+    }
+
+    struct cleanq *creator = test_create_queue(name, ffq, true, NUM_SLOTS);
+    struct cleanq *attacher = test_create_queue(name, ffq, false, NUM_SLOTS);
+
+    err = cleanq_stats_attach(&view, name);
+    if (err_is_fail(err)) {
+        FAIL("attaching to the statistics failed %d\n", err);
+    }
+    if (strcmp(view.backend, ffq ? "ffq" : "ipcq")) {
+        FAIL("the statistics are of backend %s\n", view.backend);
+    }
+
+    err = cleanq_register(creator, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    uint64_t value;
+    err = cleanq_control(creator, CLEANQ_CTRL_STATS, CLEANQ_STAT_SLOTS + 1, &value);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("reading an unknown counter returned %d\n", err);
+    }
+
+    /* refused before it gets to the queue, it is not counted */
+    err = cleanq_enqueue(creator, regid + 1, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue of an unknown region returned %d\n", err);
+    }
+
+    struct cleanq_stats model[2] = { { 0 } };
+    const volatile struct cleanq_stats *views[2] = { view.endpoint[CLEANQ_STATS_CREATOR],
+                                                     view.endpoint[CLEANQ_STATS_ATTACHER] };
+    check_stats(creator, &model[0], views[0]);
+    check_stats(attacher, &model[1], views[1]);
+
+    /* the attacher learns about the region on its first dequeue */
+    recv_buf(attacher, &model[1]);
+
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+        /* bursts of one kind fill and drain the rings */
+        switch ((round / 64 + rand()) % 4) {
+        case 0:
+            send_buf(creator, &model[0]);
+            break;
+        case 1:
+            recv_buf(attacher, &model[1]);
+            break;
+        case 2:
+            send_buf(attacher, &model[1]);
+            break;
+        default:
+            recv_buf(creator, &model[0]);
+            break;
+        }
+
+        if (round % CHECK_INTERVAL == 0) {
+            check_stats(creator, &model[0], views[0]);
+            check_stats(attacher, &model[1], views[1]);
+        }
+    }
+
+    check_stats(creator, &model[0], views[0]);
+    check_stats(attacher, &model[1], views[1]);
+    if (!model[0].enqueue_full || !model[1].dequeue_empty) {
+        FAIL("the rings have never been full and empty\n");
+    }
+
+    cleanq_destroy(attacher);
+    cleanq_destroy(creator);
+
+    if (views[0]->enqueues != model[0].enqueues || views[1]->dequeues != model[1].dequeues) {
+        FAIL("the counters have changed after the queue was destroyed\n");
+    }
+    cleanq_stats_detach(&view);
+}
+
+
+/*
+ * ================================================================================================
+ * Monitor and Echo Side
+ * ================================================================================================
+ */
+
+
+/*
+ * Answers every buffer and exits once all of them have come back.
+ */
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, false, NUM_SLOTS);
+
+    uint64_t num_rx = 0;
+    while (num_rx < NUM_MSGS) {
+        struct cleanq_buf b;
+        err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                             &b.valid_length, &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+        num_rx++;
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+/*
+ * Reads the counters of both endpoints through a view of its own, as cleanq-top does. They
+ * only grow, and the echo side never gets ahead of the buffers that are sent.
+ */
+static void *monitor_thread(void *arg)
+{
+    struct cleanq_stats_view *view = arg;
+    const volatile struct cleanq_stats *creator = view->endpoint[CLEANQ_STATS_CREATOR];
+    const volatile struct cleanq_stats *echo = view->endpoint[CLEANQ_STATS_ATTACHER];
+
+    struct cleanq_stats last[2] = { { 0 } };
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        /* the echo side may count a buffer before the sender has counted its enqueue */
+        uint64_t echo_enq = echo->enqueues;
+        uint64_t echo_deq = echo->dequeues;
+        uint64_t sent = creator->enqueues;
+        if (echo_deq > sent + 1 || echo_enq > echo_deq) {
+            FAIL("the echo side received %lu of %lu buffers\n", echo_deq, sent);
+        }
+
+        for (int i = 0; i < 2; i++) {
+            const volatile struct cleanq_stats *s = i ? echo : creator;
+            struct cleanq_stats now = { .enqueues = s->enqueues,
+                                        .dequeues = s->dequeues,
+                                        .enqueue_full = s->enqueue_full,
+                                        .dequeue_empty = s->dequeue_empty,
+                                        .enqueue_bytes = s->enqueue_bytes,
+                                        .dequeue_bytes = s->dequeue_bytes,
+                                        .occupancy_hwm = s->occupancy_hwm };
+            if (now.enqueues < last[i].enqueues || now.dequeues < last[i].dequeues
+                || now.enqueue_full < last[i].enqueue_full
+                || now.dequeue_empty < last[i].dequeue_empty
+                || now.enqueue_bytes < last[i].enqueue_bytes
+                || now.dequeue_bytes < last[i].dequeue_bytes
+                || now.occupancy_hwm < last[i].occupancy_hwm || now.occupancy_hwm > NUM_SLOTS) {
+                FAIL("a counter of endpoint %d went backwards\n", i);
+            }
+            last[i] = now;
+        }
+        __atomic_store_n(&num_samples, num_samples + 1, __ATOMIC_RELAXED);
+        usleep(MONITOR_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * The echo side runs in another process, the counters of both endpoints are read while the
+ * buffers are in flight. Once the echo side is gone, its counters match what was sent.
+ */
+static void test_monitor(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = test_create_queue(name, ffq, true, NUM_SLOTS);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    struct cleanq_stats_view view;
+    err = cleanq_stats_attach(&view, name);
+    if (err_is_fail(err)) {
+        FAIL("attaching to the statistics failed %d\n", err);
+    }
+
+    __atomic_store_n(&done, false, __ATOMIC_RELAXED);
+    num_samples = 0;
+    pthread_t monitor;
+    if (pthread_create(&monitor, NULL, monitor_thread, &view)) {
+        FAIL("creating the monitor thread failed\n");
+    }
+
+    struct cleanq_stats model = { 0 };
+    uint64_t sent_bytes = 0;
+    while (model.dequeues < NUM_MSGS) {
+        if (model.enqueues < NUM_MSGS) {
+            uint64_t bytes = model.enqueue_bytes;
+            send_buf(queue, &model);
+            sent_bytes += model.enqueue_bytes - bytes;
+        }
+        recv_buf(queue, &model);
+        if (model.dequeues == model.enqueues) {
+            sched_yield();
+        }
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    test_join(pid);
+
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    pthread_join(monitor, NULL);
+    if (num_samples == 0) {
+        FAIL("the monitor has not read the counters\n");
+    }
+
+    const volatile struct cleanq_stats *echo = view.endpoint[CLEANQ_STATS_ATTACHER];
+    if (echo->dequeues != NUM_MSGS || echo->enqueues != NUM_MSGS
+        || echo->dequeue_bytes != sent_bytes || echo->enqueue_bytes != sent_bytes
+        || echo->pid != (uint64_t)pid) {
+        FAIL("the echo side counted %lu/%lu buffers of %lu bytes\n", echo->dequeues,
+             echo->enqueues, echo->dequeue_bytes);
+    }
+    check_stats(queue, &model, view.endpoint[CLEANQ_STATS_CREATOR]);
+
+    cleanq_stats_detach(&view);
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-stats-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting ipcq counter test\n");
+    test_counters(false);
+
+    printf("Starting ffq counter test\n");
+    test_counters(true);
+
+    printf("Starting ipcq monitor test\n");
+    test_monitor(false);
+
+    printf("Starting ffq monitor test\n");
+    test_monitor(true);
+
+    printf("stats test passed\n");
+
+    return 0;
+}
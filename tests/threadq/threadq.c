@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/thread_queue.h>
+
+#define TEST_NAME "threadq"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 512
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define MAX_BATCH 24
+
+///< the number of buffers sent to the echo thread and back
+#define NUM_MSGS 1000000
+
+///< the number of regions registered while the echo thread runs, the id table grows several times
+#define NUM_EXTRA_REGIONS 1024
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the ends of the queue, the second one is used by the echo thread
+static struct cleanq *end_a;
+static struct cleanq *end_b;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void fill_buf(struct cleanq_buf *b, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = (seq % NUM_BUFS) * BUF_SIZE;
+    b->length = BUF_SIZE;
+    b->valid_data = 0;
+    b->valid_length = (seq % BUF_SIZE) + 1;
+    b->flags = seq;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, uint64_t seq)
+{
+    if (b->rid != regid || b->offset != (seq % NUM_BUFS) * BUF_SIZE || b->length != BUF_SIZE
+        || b->valid_length != (seq % BUF_SIZE) + 1 || b->flags != seq) {
+        FAIL("expected buffer %lu, got flags=%lu offset=%lu\n", seq, b->flags, b->offset);
+    }
+}
+
+
+/*
+ * Sends the buffers from seq up to max, one at a time or in a batch of random size, and
+ * returns how many have been sent.
+ */
+static size_t send_some(struct cleanq *queue, uint64_t seq, uint64_t max, unsigned int *seed)
+{
+    errval_t err;
+    struct cleanq_buf bufs[MAX_BATCH];
+    size_t num_enq = 0;
+
+    if (rand_r(seed) % 2) {
+        fill_buf(&bufs[0], seq);
+        err = cleanq_enqueue(queue, bufs[0].rid, bufs[0].offset, bufs[0].length,
+                             bufs[0].valid_data, bufs[0].valid_length, bufs[0].flags);
+        num_enq = err_is_ok(err) ? 1 : 0;
+    } else {
+        size_t num = (rand_r(seed) % MAX_BATCH) + 1;
+        if (num > max - seq) {
+            num = max - seq;
+        }
+        for (size_t i = 0; i < num; i++) {
+            fill_buf(&bufs[i], seq + i);
+        }
+        err = cleanq_enqueue_batch(queue, bufs, num, &num_enq);
+    }
+
+    if (err == CLEANQ_ERR_QUEUE_FULL) {
+        sched_yield();
+        return 0;
+    }
+    if (err_is_fail(err)) {
+        FAIL("sending buffer %lu returned %d\n", seq, err);
+    }
+
+    return num_enq;
+}
+
+
+/*
+ * Receives the next buffers into bufs, one at a time or in a batch of random size.
+ */
+static size_t recv_some(struct cleanq *queue, struct cleanq_buf *bufs, unsigned int *seed)
+{
+    errval_t err;
+    size_t num_deq = 0;
+
+    if (rand_r(seed) % 2) {
+        err = cleanq_dequeue(queue, &bufs[0].rid, &bufs[0].offset, &bufs[0].length,
+                             &bufs[0].valid_data, &bufs[0].valid_length, &bufs[0].flags);
+        num_deq = err_is_ok(err) ? 1 : 0;
+    } else {
+        err = cleanq_dequeue_batch(queue, bufs, (rand_r(seed) % MAX_BATCH) + 1, &num_deq);
+    }
+
+    if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+        sched_yield();
+        return 0;
+    }
+    if (err_is_fail(err)) {
+        FAIL("receiving returned %d\n", err);
+    }
+
+    return num_deq;
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * The second end knows the regions of the first one, each direction takes as many buffers as
+ * there are slots, and chains arrive whole.
+ */
+static void test_basic(void)
+{
+    errval_t err;
+    struct cleanq_buf bufs[2 * NUM_SLOTS];
+    size_t num_deq;
+
+    err = cleanq_dequeue(end_b, &bufs[0].rid, &bufs[0].offset, &bufs[0].length,
+                         &bufs[0].valid_data, &bufs[0].valid_length, &bufs[0].flags);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue from an empty queue returned %d\n", err);
+    }
+
+    fill_buf(&bufs[0], 7);
+    err = cleanq_enqueue(end_b, bufs[0].rid, bufs[0].offset, bufs[0].length, bufs[0].valid_data,
+                         bufs[0].valid_length, bufs[0].flags);
+    if (err_is_fail(err)) {
+        FAIL("enqueue on the second end returned %d\n", err);
+    }
+    err = cleanq_dequeue_batch(end_a, bufs, 2 * NUM_SLOTS, &num_deq);
+    if (err_is_fail(err) || num_deq != 1) {
+        FAIL("dequeue on the first end returned %d with %zu buffers\n", err, num_deq);
+    }
+    check_buf(&bufs[0], 7);
+
+    err = cleanq_enqueue(end_a, regid + 1, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue into an unknown region returned %d\n", err);
+    }
+    err = cleanq_enqueue(end_a, regid, MEMORY_SIZE, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("enqueue behind the region returned %d\n", err);
+    }
+
+    for (uint64_t i = 0; i < NUM_SLOTS; i++) {
+        fill_buf(&bufs[i], i);
+    }
+    size_t num_enq;
+    err = cleanq_enqueue_batch(end_a, bufs, NUM_SLOTS, &num_enq);
+    if (err_is_fail(err) || num_enq != NUM_SLOTS) {
+        FAIL("filling the ring returned %d with %zu buffers\n", err, num_enq);
+    }
+    err = cleanq_enqueue(end_a, regid, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err != CLEANQ_ERR_QUEUE_FULL) {
+        FAIL("enqueue into a full ring returned %d\n", err);
+    }
+    err = cleanq_dequeue_batch(end_b, bufs, 2 * NUM_SLOTS, &num_deq);
+    if (err_is_fail(err) || num_deq != NUM_SLOTS) {
+        FAIL("draining the ring returned %d with %zu buffers\n", err, num_deq);
+    }
+    for (uint64_t i = 0; i < NUM_SLOTS; i++) {
+        check_buf(&bufs[i], i);
+    }
+
+    struct cleanq_buf chain[3];
+    for (uint64_t i = 0; i < 3; i++) {
+        fill_buf(&chain[i], i);
+    }
+    err = cleanq_enqueue_chain(end_a, chain, 3);
+    if (err_is_fail(err)) {
+        FAIL("sending a chain returned %d\n", err);
+    }
+    err = cleanq_dequeue_chain(end_b, bufs, 2, &num_deq);
+    if (err != CLEANQ_ERR_CHAIN_TOO_LONG || num_deq != 3) {
+        FAIL("receiving a chain into a short array returned %d with %zu\n", err, num_deq);
+    }
+    err = cleanq_dequeue_chain(end_b, bufs, 3, &num_deq);
+    if (err_is_fail(err) || num_deq != 3 || !(bufs[2].flags & CLEANQ_FLAG_LAST)) {
+        FAIL("receiving a chain returned %d with %zu segments\n", err, num_deq);
+    }
+}
+
+
+/*
+ * Sends all buffers back in the order they arrive.
+ */
+static void *echo_thread(void *arg)
+{
+    (void)arg;
+    unsigned int seed = time(NULL);
+
+    struct cleanq_buf bufs[MAX_BATCH];
+    uint64_t num_rx = 0;
+
+    while (num_rx < NUM_MSGS) {
+        size_t num_deq = recv_some(end_b, bufs, &seed);
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx + i);
+        }
+
+        /* the buffers go back as they came, the other thread frees up the slots */
+        size_t sent = 0;
+        while (sent < num_deq) {
+            size_t num_enq;
+            errval_t err = cleanq_enqueue_batch(end_b, bufs + sent, num_deq - sent, &num_enq);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                sched_yield();
+                continue;
+            }
+            if (err_is_fail(err)) {
+                FAIL("the echo thread enqueue returned %d\n", err);
+            }
+            sent += num_enq;
+        }
+        num_rx += num_deq;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Sends the buffers to the echo thread and receives them back at the same time, going through
+ * both rings while they wrap around many times. Meanwhile regions are registered, the echo
+ * thread checks its buffers against the region pool while it grows.
+ */
+static void test_echo(void)
+{
+    static regionid_t extra_ids[NUM_EXTRA_REGIONS];
+    struct capref extra;
+    extra.vaddr = malloc(NUM_EXTRA_REGIONS * BUF_SIZE);
+    extra.paddr = (uint64_t)extra.vaddr;
+    extra.len = BUF_SIZE;
+    size_t num_extra = 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, echo_thread, NULL)) {
+        FAIL("creating the echo thread failed\n");
+    }
+
+    unsigned int seed = time(NULL) + 1;
+    struct cleanq_buf bufs[MAX_BATCH];
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+
+    while (num_rx < NUM_MSGS) {
+        /* at most half of the buffers are in flight, their offsets stay distinct */
+        if (num_tx < NUM_MSGS && num_tx - num_rx < NUM_BUFS / 2) {
+            num_tx += send_some(end_a, num_tx, NUM_MSGS, &seed);
+        }
+
+        size_t num_deq = recv_some(end_a, bufs, &seed);
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx + i);
+        }
+        num_rx += num_deq;
+
+        if (num_extra < NUM_EXTRA_REGIONS && (rand_r(&seed) % 64) == 0) {
+            errval_t err = cleanq_register(end_a, extra, &extra_ids[num_extra]);
+            if (err_is_fail(err)) {
+                FAIL("registering region %zu failed %d\n", num_extra, err);
+            }
+            extra.vaddr = (char *)extra.vaddr + BUF_SIZE;
+            extra.paddr += BUF_SIZE;
+            num_extra++;
+        }
+    }
+
+    pthread_join(thread, NULL);
+
+    /* the regions are known to the other end right away */
+    for (size_t i = 0; i < num_extra; i++) {
+        struct capref cap;
+        errval_t err = cleanq_deregister(end_b, extra_ids[i], &cap);
+        if (err_is_fail(err) || cap.len != BUF_SIZE) {
+            FAIL("deregistering region %zu on the other end returned %d\n", i, err);
+        }
+    }
+
+    if (num_extra < NUM_EXTRA_REGIONS / 2) {
+        FAIL("only %zu regions have been registered during the echo test\n", num_extra);
+    }
+
+    free((char *)extra.vaddr - num_extra * BUF_SIZE);
+}
+
+
+/*
+ * The second end stays usable after the first one has been destroyed, and hands out the region.
+ */
+static void test_destroy(void)
+{
+    errval_t err = cleanq_destroy(end_a);
+    if (err_is_fail(err)) {
+        FAIL("destroying the first end failed %d\n", err);
+    }
+
+    err = cleanq_enqueue(end_b, regid, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err_is_fail(err)) {
+        FAIL("enqueue after the other end has been destroyed returned %d\n", err);
+    }
+
+    struct capref cap;
+    err = cleanq_deregister(end_b, regid, &cap);
+    if (err_is_fail(err) || cap.vaddr != memory.vaddr || cap.len != memory.len) {
+        FAIL("deregistering on the second end returned %d\n", err);
+    }
+
+    err = cleanq_destroy(end_b);
+    if (err_is_fail(err)) {
+        FAIL("destroying the second end failed %d\n", err);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    errval_t err;
+
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    struct cleanq_threadq *a, *b;
+    err = cleanq_threadq_create(&a, &b, NUM_SLOTS - 1);
+    if (err != CLEANQ_ERR_INIT_QUEUE) {
+        FAIL("creating a thread queue with %d slots returned %d\n", NUM_SLOTS - 1, err);
+    }
+    err = cleanq_threadq_create(&a, &b, NUM_SLOTS);
+    if (err_is_fail(err)) {
+        FAIL("creating the thread queue failed %d\n", err);
+    }
+    end_a = (struct cleanq *)a;
+    end_b = (struct cleanq *)b;
+
+    err = cleanq_register(end_a, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    printf("Starting basic test\n");
+    test_basic();
+
+    printf("Starting echo test\n");
+    test_echo();
+
+    printf("Starting destroy test\n");
+    test_destroy();
+
+    printf("threadq test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/trace.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/loopback_queue.h>
+
+#define TEST_NAME "trace"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 64
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_SLOTS 16
+
+#define INLINE_LEN 40
+
+///< the number of events of the small ring that wraps
+#define SMALL_EVENTS 16
+
+///< the number of buffers sent to the echo process and back
+#define NUM_MSGS 20000
+
+///< the events of the ring of the echo test, it holds all of them unless there are many empties
+#define ECHO_EVENTS (1UL << 20)
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+static char shm_name[64];
+static char path[64];
+
+static struct capref memory;
+static regionid_t regid;
+
+///< the events the test expects in a trace ring
+struct model
+{
+    struct cleanq_trace_event events[4 * NUM_SLOTS + 16];
+    size_t num;
+};
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void expect(struct model *m, cleanq_trace_op_t op, regionid_t rid, genoffset_t offset,
+                   genoffset_t length, errval_t err)
+{
+    m->events[m->num++] = (struct cleanq_trace_event){
+        .op = op, .rid = rid, .offset = offset, .length = length, .err = (uint8_t)err
+    };
+}
+
+
+///< maps a trace ring in shared memory
+static struct cleanq_trace_hdr *map_ring(const char *shm)
+{
+    int fd = shm_open(shm, O_RDONLY, 0);
+    if (fd < 0) {
+        FAIL("opening the trace ring %s failed\n", shm);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        FAIL("mapping the trace ring %s failed\n", shm);
+    }
+    return mem;
+}
+
+
+///< reads a trace ring saved to a file
+static struct cleanq_trace_hdr *read_ring(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        FAIL("opening the saved trace %s failed\n", file);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    struct cleanq_trace_hdr *hdr = malloc(size);
+    if ((size_t)size < sizeof(*hdr) || fread(hdr, 1, size, f) != (size_t)size) {
+        FAIL("reading the saved trace %s failed\n", file);
+    }
+    fclose(f);
+
+    if ((size_t)size != sizeof(*hdr) + hdr->events * sizeof(struct cleanq_trace_event)) {
+        FAIL("the saved trace has %ld bytes for %lu events\n", size, hdr->events);
+    }
+    return hdr;
+}
+
+
+static struct cleanq_trace_event *ring_events(struct cleanq_trace_hdr *hdr)
+{
+    return (struct cleanq_trace_event *)(hdr + 1);
+}
+
+
+static void check_hdr(struct cleanq_trace_hdr *hdr, uint64_t events, const char *label)
+{
+    if (hdr->magic != CLEANQ_TRACE_MAGIC || hdr->version != CLEANQ_TRACE_VERSION
+        || hdr->event_size != sizeof(struct cleanq_trace_event) || hdr->events != events
+        || hdr->pid != (uint64_t)getpid() || hdr->tsc_hz == 0 || hdr->mono_ns == 0
+        || strcmp(hdr->label, label)) {
+        FAIL("the header of the trace ring %s is not valid\n", label);
+    }
+}
+
+
+///< compares the ring with the expected events, in order and with increasing timestamps
+static void check_events(struct cleanq_trace_hdr *hdr, struct model *m, const char *label)
+{
+    if (hdr->head != m->num) {
+        FAIL("the ring %s has %lu events instead of %zu\n", label, hdr->head, m->num);
+    }
+
+    uint16_t tid = (uint16_t)syscall(SYS_gettid);
+    struct cleanq_trace_event *events = ring_events(hdr);
+    for (size_t i = 0; i < m->num; i++) {
+        struct cleanq_trace_event *e = &events[i];
+        struct cleanq_trace_event *x = &m->events[i];
+        if (e->op != x->op || e->rid != x->rid || e->offset != x->offset
+            || e->length != x->length || e->err != x->err) {
+            FAIL("event %zu of %s is op=%u rid=%u offset=%lu length=%u err=%u, expected op=%u "
+                 "rid=%u offset=%lu length=%u err=%u\n",
+                 i, label, e->op, e->rid, e->offset, e->length, e->err, x->op, x->rid, x->offset,
+                 x->length, x->err);
+        }
+        if (e->tid != tid || e->tsc < hdr->tsc_base || (i && e->tsc < events[i - 1].tsc)) {
+            FAIL("event %zu of %s has tid=%u tsc=%lu\n", i, label, e->tid, e->tsc);
+        }
+    }
+}
+
+
+static struct cleanq *create_queue(bool ffq, bool clear)
+{
+    errval_t err;
+    struct cleanq *queue;
+
+    if (ffq) {
+        struct cleanq_ffq_attr attr = { .slots = NUM_SLOTS, .inline_max = 128 };
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&queue, name, clear, &attr);
+    } else {
+        struct cleanq_ipcq_attr attr = { .slots = NUM_SLOTS, .inline_max = 128 };
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&queue, name, clear, &attr);
+    }
+    if (err_is_fail(err)) {
+        FAIL("creating the %s failed %d\n", ffq ? "ffq" : "ipcq", err);
+    }
+
+    return queue;
+}
+
+
+static void start_trace(struct cleanq *q, size_t events, const char *shm, const char *label)
+{
+    struct cleanq_trace_attr attr = { .events = events, .shm_name = shm, .label = label };
+    errval_t err = cleanq_trace_start(q, &attr);
+    if (err_is_fail(err)) {
+        FAIL("starting the trace %s failed %d\n", label ? label : shm, err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Every operation on both endpoints is recorded with its buffer and outcome: single buffers,
+ * batches, inline messages, regions, and the calls that found the queue full or empty. One
+ * endpoint records into shared memory, the other one into process memory saved to a file.
+ */
+static void test_events(bool ffq)
+{
+    errval_t err;
+    struct cleanq *tx = create_queue(ffq, true);
+    struct cleanq *rx = create_queue(ffq, false);
+
+    start_trace(tx, 0, shm_name, NULL);
+    start_trace(rx, 4 * NUM_SLOTS, NULL, "rx");
+
+    struct model tx_model = { .num = 0 }, rx_model = { .num = 0 };
+    err = cleanq_register(tx, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+    expect(&tx_model, CLEANQ_TRACE_REGISTER, regid, 0, MEMORY_SIZE, CLEANQ_ERR_OK);
+
+    /* the sending endpoint fills the ring, the last attempts find it full */
+    size_t num = 0;
+    while (true) {
+        genoffset_t vlen = (num % 4 + 1) * 16;
+        err = cleanq_enqueue(tx, regid, num * BUF_SIZE, BUF_SIZE, 0, vlen, num);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            expect(&tx_model, CLEANQ_TRACE_FULL, regid, num * BUF_SIZE, vlen, err);
+            break;
+        }
+        if (err_is_fail(err)) {
+            FAIL("enqueue returned %d\n", err);
+        }
+        expect(&tx_model, CLEANQ_TRACE_ENQUEUE, regid, num * BUF_SIZE, vlen, err);
+        num++;
+    }
+
+    struct cleanq_buf bufs[NUM_SLOTS];
+    size_t count;
+    bufs[0] = (struct cleanq_buf){ .rid = regid, .offset = 0, .length = BUF_SIZE,
+                                   .valid_length = BUF_SIZE };
+    err = cleanq_enqueue_batch(tx, bufs, 1, &count);
+    if (err != CLEANQ_ERR_QUEUE_FULL) {
+        FAIL("a batch into a full queue returned %d\n", err);
+    }
+    expect(&tx_model, CLEANQ_TRACE_FULL, 0, 0, 0, CLEANQ_ERR_QUEUE_FULL);
+
+    struct cleanq_buf b;
+    err = cleanq_dequeue(tx, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                         &b.flags);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue from an empty queue returned %d\n", err);
+    }
+    expect(&tx_model, CLEANQ_TRACE_EMPTY, 0, 0, 0, CLEANQ_ERR_QUEUE_EMPTY);
+
+    /* the receiving endpoint drains the ring and sends the buffers back as a batch */
+    for (size_t i = 0; i < num; i++) {
+        err = cleanq_dequeue(rx, &bufs[i].rid, &bufs[i].offset, &bufs[i].length,
+                             &bufs[i].valid_data, &bufs[i].valid_length, &bufs[i].flags);
+        if (err_is_fail(err) || bufs[i].flags != i) {
+            FAIL("expected buffer %zu, got %lu err=%d\n", i, bufs[i].flags, err);
+        }
+        expect(&rx_model, CLEANQ_TRACE_DEQUEUE, regid, i * BUF_SIZE, (i % 4 + 1) * 16, err);
+    }
+    err = cleanq_dequeue(rx, &b.rid, &b.offset, &b.length, &b.valid_data, &b.valid_length,
+                         &b.flags);
+    expect(&rx_model, CLEANQ_TRACE_EMPTY, 0, 0, 0, err);
+
+    err = cleanq_enqueue_batch(rx, bufs, num, &count);
+    if (err_is_fail(err) || count != num) {
+        FAIL("sending the batch back returned %d with %zu\n", err, count);
+    }
+    for (size_t i = 0; i < num; i++) {
+        expect(&rx_model, CLEANQ_TRACE_ENQUEUE, regid, i * BUF_SIZE, (i % 4 + 1) * 16,
+               CLEANQ_ERR_OK);
+    }
+
+    size_t num_back = 0;
+    while (num_back < num) {
+        err = cleanq_dequeue_batch(tx, bufs, NUM_SLOTS, &count);
+        if (err_is_fail(err)) {
+            FAIL("dequeueing the batch returned %d\n", err);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (bufs[i].offset != (num_back + i) * BUF_SIZE) {
+                FAIL("expected buffer %zu back, got %lu\n", num_back + i, bufs[i].offset);
+            }
+            expect(&tx_model, CLEANQ_TRACE_DEQUEUE, regid, bufs[i].offset, bufs[i].valid_length,
+                   CLEANQ_ERR_OK);
+        }
+        num_back += count;
+    }
+
+    /* inline messages have neither a region nor an offset */
+    char msg[INLINE_LEN];
+    memset(msg, 'x', sizeof(msg));
+    err = cleanq_enqueue_inline(rx, msg, sizeof(msg));
+    if (err_is_fail(err)) {
+        FAIL("enqueueing an inline message returned %d\n", err);
+    }
+    expect(&rx_model, CLEANQ_TRACE_ENQUEUE, 0, 0, INLINE_LEN, err);
+
+    size_t len;
+    err = cleanq_dequeue_inline(tx, msg, sizeof(msg), &len);
+    if (err_is_fail(err) || len != INLINE_LEN) {
+        FAIL("dequeueing the inline message returned %d\n", err);
+    }
+    expect(&tx_model, CLEANQ_TRACE_DEQUEUE, 0, 0, INLINE_LEN, err);
+
+    struct capref cap;
+    err = cleanq_deregister(tx, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering memory failed %d\n", err);
+    }
+    expect(&tx_model, CLEANQ_TRACE_DEREGISTER, regid, 0, MEMORY_SIZE, err);
+
+    /* the shared ring can be read while the queue is in use */
+    struct cleanq_trace_hdr *hdr = map_ring(shm_name);
+    check_hdr(hdr, CLEANQ_TRACE_DEFAULT_EVENTS, shm_name);
+    check_events(hdr, &tx_model, shm_name);
+    munmap(hdr, sizeof(*hdr) + hdr->events * sizeof(struct cleanq_trace_event));
+
+    err = cleanq_trace_save(rx, path);
+    if (err_is_fail(err)) {
+        FAIL("saving the trace failed %d\n", err);
+    }
+    hdr = read_ring(path);
+    check_hdr(hdr, 4 * NUM_SLOTS, "rx");
+    check_events(hdr, &rx_model, "rx");
+    free(hdr);
+
+    /* the shared ring stays once the queue is gone */
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    hdr = map_ring(shm_name);
+    if (hdr->head != tx_model.num) {
+        FAIL("the trace ring has changed after the queue is gone\n");
+    }
+    munmap(hdr, sizeof(*hdr));
+    shm_unlink(shm_name);
+    unlink(path);
+}
+
+
+/*
+ * The ring keeps the last events once it wraps, restarting the trace starts a new ring, and a
+ * stopped trace records nothing.
+ */
+static void test_ring(void)
+{
+    errval_t err;
+    struct cleanq *q;
+
+    err = loopback_queue_create((struct cleanq_loopbackq **)&q);
+    if (err_is_fail(err)) {
+        FAIL("creating the loopback queue failed %d\n", err);
+    }
+
+    err = cleanq_trace_save(q, path);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("saving without a trace returned %d\n", err);
+    }
+    struct cleanq_trace_attr attr = { .events = 3 };
+    err = cleanq_trace_start(q, &attr);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("starting a trace of 3 events returned %d\n", err);
+    }
+
+    /* the defaults */
+    err = cleanq_trace_start(q, NULL);
+    if (err_is_fail(err)) {
+        FAIL("starting a trace with the defaults failed %d\n", err);
+    }
+    err = cleanq_trace_save(q, "/nonexistent/trace");
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("saving to a path that doesn't exist returned %d\n", err);
+    }
+    err = cleanq_trace_save(q, path);
+    if (err_is_fail(err)) {
+        FAIL("saving the trace failed %d\n", err);
+    }
+    struct cleanq_trace_hdr *hdr = read_ring(path);
+    check_hdr(hdr, CLEANQ_TRACE_DEFAULT_EVENTS, "cleanq");
+    if (hdr->head != 0) {
+        FAIL("a new trace has %lu events\n", hdr->head);
+    }
+    free(hdr);
+
+    /* restarting replaces the ring */
+    start_trace(q, SMALL_EVENTS, shm_name, "small");
+    err = cleanq_register(q, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    size_t num = 10 * SMALL_EVENTS;
+    for (size_t i = 0; i < num; i++) {
+        struct cleanq_buf b;
+        err = cleanq_enqueue(q, regid, (i % NUM_BUFS) * BUF_SIZE, BUF_SIZE, 0, BUF_SIZE, i);
+        if (err_is_ok(err)) {
+            err = cleanq_dequeue(q, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                 &b.valid_length, &b.flags);
+        }
+        if (err_is_fail(err)) {
+            FAIL("sending buffer %zu through the loopback queue returned %d\n", i, err);
+        }
+    }
+
+    hdr = map_ring(shm_name);
+    check_hdr(hdr, SMALL_EVENTS, "small");
+    if (hdr->head != 2 * num + 1) {
+        FAIL("the ring has recorded %lu events instead of %zu\n", hdr->head, 2 * num + 1);
+    }
+    struct cleanq_trace_event *events = ring_events(hdr);
+    for (uint64_t i = hdr->head - SMALL_EVENTS; i < hdr->head; i++) {
+        struct cleanq_trace_event *e = &events[i % SMALL_EVENTS];
+
+        /* event 0 is the registration, then enqueue and dequeue alternate */
+        cleanq_trace_op_t op = (i % 2) ? CLEANQ_TRACE_ENQUEUE : CLEANQ_TRACE_DEQUEUE;
+        if (e->op != op || e->offset != (((i - 1) / 2) % NUM_BUFS) * BUF_SIZE) {
+            FAIL("event %lu of the wrapped ring is op=%u offset=%lu\n", i, e->op, e->offset);
+        }
+    }
+    munmap(hdr, sizeof(*hdr) + SMALL_EVENTS * sizeof(struct cleanq_trace_event));
+
+    /* nothing is recorded after the trace is stopped */
+    err = cleanq_trace_stop(q);
+    if (err_is_fail(err)) {
+        FAIL("stopping the trace failed %d\n", err);
+    }
+    err = cleanq_enqueue(q, regid, 0, BUF_SIZE, 0, BUF_SIZE, 0);
+    if (err_is_fail(err)) {
+        FAIL("enqueue after stopping the trace returned %d\n", err);
+    }
+    hdr = map_ring(shm_name);
+    if (hdr->head != 2 * num + 1) {
+        FAIL("the stopped trace has recorded an event\n");
+    }
+    munmap(hdr, sizeof(*hdr));
+    err = cleanq_trace_save(q, path);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+        FAIL("saving a stopped trace returned %d\n", err);
+    }
+
+    cleanq_destroy(q);
+    shm_unlink(shm_name);
+    unlink(path);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static void echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = create_queue(ffq, false);
+
+    for (uint64_t seq = 0; seq < NUM_MSGS; seq++) {
+        struct cleanq_buf b;
+        while ((err = cleanq_dequeue(queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                     &b.valid_length, &b.flags))
+               == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+        }
+        if (err_is_fail(err) || b.flags != seq) {
+            FAIL("the echo side expected buffer %lu, got %lu err=%d\n", seq, b.flags, err);
+        }
+        while ((err = cleanq_enqueue(queue, b.rid, b.offset, b.length, b.valid_data,
+                                     b.valid_length, b.flags))
+               == CLEANQ_ERR_QUEUE_FULL) {
+            sched_yield();
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side enqueue returned %d\n", err);
+        }
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+///< the state of the two threads that use the same traced endpoint
+struct endpoint
+{
+    struct cleanq *queue;
+    uint16_t tid;
+    uint64_t num_busy;
+};
+
+
+static void *sender(void *arg)
+{
+    struct endpoint *ep = arg;
+    ep->tid = (uint16_t)syscall(SYS_gettid);
+
+    for (uint64_t seq = 0; seq < NUM_MSGS;) {
+        genoffset_t offset = (seq % NUM_BUFS) * BUF_SIZE;
+        errval_t err = cleanq_enqueue(ep->queue, regid, offset, BUF_SIZE, 0, BUF_SIZE, seq);
+        if (err == CLEANQ_ERR_QUEUE_FULL) {
+            ep->num_busy++;
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("sending buffer %lu returned %d\n", seq, err);
+        }
+        seq++;
+    }
+
+    return NULL;
+}
+
+
+static void *receiver(void *arg)
+{
+    struct endpoint *ep = arg;
+    ep->tid = (uint16_t)syscall(SYS_gettid);
+
+    for (uint64_t seq = 0; seq < NUM_MSGS;) {
+        struct cleanq_buf b;
+        errval_t err = cleanq_dequeue(ep->queue, &b.rid, &b.offset, &b.length, &b.valid_data,
+                                      &b.valid_length, &b.flags);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            ep->num_busy++;
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err) || b.flags != seq) {
+            FAIL("expected buffer %lu back, got %lu err=%d\n", seq, b.flags, err);
+        }
+        seq++;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * One thread sends to the echo process and another one receives on the same endpoint, both
+ * record into its trace ring at the same time. Each of their calls is one event.
+ */
+static void test_echo(bool ffq)
+{
+    errval_t err;
+    struct cleanq *queue = create_queue(ffq, true);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(ffq);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+    start_trace(queue, ECHO_EVENTS, shm_name, "echo");
+
+    alarm(HANG_TIMEOUT_S);
+    struct endpoint tx = { .queue = queue }, rx = { .queue = queue };
+    pthread_t threads[2];
+    if (pthread_create(&threads[0], NULL, receiver, &rx)
+        || pthread_create(&threads[1], NULL, sender, &tx)) {
+        FAIL("creating the threads failed\n");
+    }
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    test_join(pid);
+
+    struct cleanq_trace_hdr *hdr = map_ring(shm_name);
+    check_hdr(hdr, ECHO_EVENTS, "echo");
+    uint64_t total = 2 * NUM_MSGS + tx.num_busy + rx.num_busy;
+    if (hdr->head != total) {
+        FAIL("the ring has recorded %lu events instead of %lu\n", hdr->head, total);
+    }
+
+    /* every slot that was written holds one whole event of one of the threads */
+    uint64_t num[CLEANQ_TRACE_EMPTY + 1] = { 0 };
+    struct cleanq_trace_event *events = ring_events(hdr);
+    uint64_t first = (total > ECHO_EVENTS) ? total - ECHO_EVENTS : 0;
+    for (uint64_t i = first; i < total; i++) {
+        struct cleanq_trace_event *e = &events[i % ECHO_EVENTS];
+        bool sent = e->op == CLEANQ_TRACE_ENQUEUE || e->op == CLEANQ_TRACE_FULL;
+        bool received = e->op == CLEANQ_TRACE_DEQUEUE || e->op == CLEANQ_TRACE_EMPTY;
+        if ((!sent && !received) || e->tid != (sent ? tx.tid : rx.tid)) {
+            FAIL("event %lu has op=%u tid=%u\n", i, e->op, e->tid);
+        }
+        if ((e->op == CLEANQ_TRACE_ENQUEUE || e->op == CLEANQ_TRACE_DEQUEUE)
+            && (e->rid != regid || e->length != BUF_SIZE || e->err != CLEANQ_ERR_OK)) {
+            FAIL("event %lu has rid=%u length=%u err=%u\n", i, e->rid, e->length, e->err);
+        }
+        num[e->op]++;
+    }
+    if (first == 0
+        && (num[CLEANQ_TRACE_ENQUEUE] != NUM_MSGS || num[CLEANQ_TRACE_DEQUEUE] != NUM_MSGS
+            || num[CLEANQ_TRACE_FULL] != tx.num_busy || num[CLEANQ_TRACE_EMPTY] != rx.num_busy)) {
+        FAIL("the ring has %lu enqueues and %lu dequeues\n", num[CLEANQ_TRACE_ENQUEUE],
+             num[CLEANQ_TRACE_DEQUEUE]);
+    }
+    munmap(hdr, sizeof(*hdr) + ECHO_EVENTS * sizeof(struct cleanq_trace_event));
+
+    cleanq_destroy(queue);
+    shm_unlink(shm_name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    test_watchdog("the echo side hangs");
+
+    snprintf(name, sizeof(name), "/cleanq-test-trace-%d", getpid());
+    snprintf(shm_name, sizeof(shm_name), "/cleanq-test-trace-ring-%d", getpid());
+    snprintf(path, sizeof(path), "/tmp/cleanq-test-trace-%d", getpid());
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    printf("Starting ipcq events test\n");
+    test_events(false);
+
+    printf("Starting ffq events test\n");
+    test_events(true);
+
+    printf("Starting ring test\n");
+    test_ring();
+
+    printf("Starting ipcq echo test\n");
+    test_echo(false);
+
+    printf("Starting ffq echo test\n");
+    test_echo(true);
+
+    printf("trace test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/memfd.h>
+#include <cleanq/backends/virtio_queue.h>
+
+#define TEST_NAME "virtq"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 256
+#define NUM_BUFS 64
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+///< fewer descriptors than buffers, the virtqueues wrap around and fill up
+#define NUM_SLOTS 16
+
+///< where the data starts in a buffer
+#define DATA_OFFSET 16
+
+#define MAX_BATCH 8
+
+#define NUM_ROUNDS 50000
+
+///< the test fails if the echo side does not make progress for this long
+#define HANG_TIMEOUT_S 60
+
+static char name[64];
+
+///< the region, as mapped in this process
+static struct capref memory;
+static regionid_t regid;
+
+///< the number of regions the echo side has seen deregistered
+static int num_deregistered;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static struct cleanq *create_queue(bool clear)
+{
+    struct cleanq_virtq_attr attr = { 0 };
+    attr.slots = NUM_SLOTS;
+
+    struct cleanq *queue;
+    errval_t err = cleanq_virtq_create_with_attr((struct cleanq_virtq **)&queue, name, clear,
+                                                 &attr);
+    if (err_is_fail(err)) {
+        FAIL("creating queue %s failed %d\n", name, err);
+    }
+
+    return queue;
+}
+
+
+static uint8_t *buf_data(genoffset_t offset)
+{
+    return (uint8_t *)memory.vaddr + offset + DATA_OFFSET;
+}
+
+
+static void fill_buf(struct cleanq_buf *b, genoffset_t offset, uint64_t seq)
+{
+    b->rid = regid;
+    b->offset = offset;
+    b->length = BUF_SIZE;
+    b->valid_data = DATA_OFFSET;
+    b->valid_length = (seq % (BUF_SIZE - DATA_OFFSET)) + 1;
+    b->flags = seq;
+}
+
+
+static void check_buf(const struct cleanq_buf *b, uint64_t seq)
+{
+    if (b->rid != regid || b->offset % BUF_SIZE || b->offset >= MEMORY_SIZE
+        || b->length != BUF_SIZE || b->valid_data != DATA_OFFSET
+        || b->valid_length != (seq % (BUF_SIZE - DATA_OFFSET)) + 1 || b->flags != seq) {
+        FAIL("buffer %lu arrived as flags=%lu offset=%lu valid_length=%lu\n", seq, b->flags,
+             b->offset, b->valid_length);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Regions are found by their physical address and must not overlap, inline messages and chains
+ * are not supported. A descriptor whose address belongs to no region is dropped and reported
+ * once, the buffers behind it are handed out as usual, and its slot goes back to the sender even
+ * while returns are held back.
+ */
+static void test_basic(void)
+{
+    errval_t err;
+
+    struct cleanq *tx = create_queue(true);
+    struct cleanq *rx = create_queue(false);
+
+    struct capref caps[2];
+    regionid_t rids[2];
+    for (int i = 0; i < 2; i++) {
+        err = cleanq_memfd_alloc(&caps[i], MEMORY_SIZE);
+        if (err_is_fail(err)) {
+            FAIL("allocating memory failed %d\n", err);
+        }
+    }
+    size_t num_reg;
+    cleanq_reg_token_t token;
+    err = cleanq_register_batch(tx, caps, 2, rids, &num_reg, &token);
+    if (err_is_fail(err) || num_reg != 2) {
+        FAIL("registering the regions returned %d with %zu\n", err, num_reg);
+    }
+
+    struct capref overlap = caps[0];
+    overlap.vaddr = malloc(BUF_SIZE);
+    overlap.len = BUF_SIZE;
+    regionid_t overlap_rid;
+    err = cleanq_register(tx, overlap, &overlap_rid);
+    if (err_is_ok(err)) {
+        FAIL("a region overlapping another one has been registered\n");
+    }
+
+    uint8_t data[8] = { 0 };
+    err = cleanq_enqueue_inline(tx, data, sizeof(data));
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("sending inline returned %d\n", err);
+    }
+    struct cleanq_buf bufs[MAX_BATCH];
+    for (int i = 0; i < 2; i++) {
+        bufs[i] = (struct cleanq_buf){ .rid = rids[0], .offset = i * BUF_SIZE,
+                                       .length = BUF_SIZE };
+    }
+    err = cleanq_enqueue_chain(tx, bufs, 2);
+    if (err != CLEANQ_ERR_NOT_SUPPORTED) {
+        FAIL("sending a chain returned %d\n", err);
+    }
+
+    /* the receiving side handles the registrations and then forgets the second region */
+    size_t num_deq;
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue from an empty queue returned %d\n", err);
+    }
+    err = cleanq_deregister(rx, rids[1], &caps[1]);
+    if (err_is_fail(err)) {
+        FAIL("deregistering on the receiving side failed %d\n", err);
+    }
+
+    for (uint64_t i = 0; i < 3; i++) {
+        err = cleanq_enqueue(tx, rids[i == 1], i * BUF_SIZE, BUF_SIZE, 0, 1, i);
+        if (err_is_fail(err)) {
+            FAIL("enqueue %lu returned %d\n", i, err);
+        }
+    }
+
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err_is_fail(err) || num_deq != 1 || bufs[0].flags != 0) {
+        FAIL("a batch before the bad descriptor returned %d with %zu\n", err, num_deq);
+    }
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS || num_deq != 0) {
+        FAIL("a batch at the bad descriptor returned %d with %zu\n", err, num_deq);
+    }
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err_is_fail(err) || num_deq != 1 || bufs[0].flags != 2) {
+        FAIL("a batch after the bad descriptor returned %d with %zu\n", err, num_deq);
+    }
+
+    /* the sender gets the slots of dropped descriptors back without an empty dequeue */
+    cleanq_control(rx, CLEANQ_CTRL_ACK_BATCH, NUM_SLOTS, NULL);
+    for (uint64_t round = 0; round < 2; round++) {
+        for (uint64_t i = 0; i < NUM_SLOTS; i++) {
+            err = cleanq_enqueue(tx, rids[round == 0], i * BUF_SIZE, BUF_SIZE, 0, 1, i);
+            if (err_is_fail(err)) {
+                FAIL("enqueue %lu of round %lu returned %d\n", i, round, err);
+            }
+        }
+        for (uint64_t i = 0; i < NUM_SLOTS && round == 0; i++) {
+            err = cleanq_dequeue(rx, &bufs[0].rid, &bufs[0].offset, &bufs[0].length,
+                                 &bufs[0].valid_data, &bufs[0].valid_length, &bufs[0].flags);
+            if (err != CLEANQ_ERR_INVALID_BUFFER_ARGS) {
+                FAIL("a dequeue of bad descriptor %lu returned %d\n", i, err);
+            }
+        }
+    }
+    for (uint64_t i = 0; i < NUM_SLOTS; i += num_deq) {
+        err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+        if (err_is_fail(err) || bufs[0].flags != i || bufs[0].rid != rids[0]) {
+            FAIL("expected buffer %lu after the bad descriptors, got %d\n", i, err);
+        }
+    }
+    err = cleanq_dequeue_batch(rx, bufs, MAX_BATCH, &num_deq);
+    if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+        FAIL("dequeue after the bad descriptors returned %d\n", err);
+    }
+
+    cleanq_destroy(rx);
+    cleanq_destroy(tx);
+    cleanq_memfd_free(&caps[0]);
+    free(overlap.vaddr);
+}
+
+
+/*
+ * Sends the buffers in batches of random size to the echo side, which checks their data,
+ * writes its answer into them and sends them back.
+ */
+static void test_echo(struct cleanq *queue)
+{
+    errval_t err;
+
+    genoffset_t free_bufs[NUM_BUFS];
+    size_t num_free = NUM_BUFS;
+    for (size_t i = 0; i < NUM_BUFS; i++) {
+        free_bufs[i] = i * BUF_SIZE;
+    }
+
+    uint64_t num_tx = 0;
+    uint64_t num_rx = 0;
+
+    alarm(HANG_TIMEOUT_S);
+    while (num_rx < NUM_ROUNDS) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num = 0;
+        size_t max = (rand() % MAX_BATCH) + 1;
+        while (num < max && num_free && num_tx + num < NUM_ROUNDS) {
+            genoffset_t offset = free_bufs[--num_free];
+            fill_buf(&bufs[num], offset, num_tx + num);
+            memset(buf_data(offset), (uint8_t)(num_tx + num), bufs[num].valid_length);
+            num++;
+        }
+
+        if (num) {
+            size_t num_enq;
+            err = cleanq_enqueue_batch(queue, bufs, num, &num_enq);
+            if (err_is_fail(err) && err != CLEANQ_ERR_QUEUE_FULL) {
+                FAIL("sending buffer %lu returned %d\n", num_tx, err);
+            }
+            for (size_t i = num_enq; i < num; i++) {
+                free_bufs[num_free++] = bufs[i].offset;
+            }
+            num_tx += num_enq;
+        }
+
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("receiving after %lu buffers returned %d\n", num_rx, err);
+        }
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx);
+            uint8_t *data = buf_data(bufs[i].offset);
+            for (size_t j = 0; j < bufs[i].valid_length; j++) {
+                if (data[j] != (uint8_t)~num_rx) {
+                    FAIL("the answer in buffer %lu is wrong at %zu\n", num_rx, j);
+                }
+            }
+            free_bufs[num_free++] = bufs[i].offset;
+            num_rx++;
+        }
+        alarm(HANG_TIMEOUT_S);
+    }
+    alarm(0);
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static errval_t register_cb(struct cleanq *q, struct capref cap, regionid_t region_id)
+{
+    (void)q;
+
+    memory = cap;
+    regid = region_id;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+static errval_t deregister_cb(struct cleanq *q, regionid_t region_id)
+{
+    (void)q;
+
+    if (region_id != regid) {
+        FAIL("the echo side got the deregistration of region %u\n", region_id);
+    }
+    num_deregistered++;
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/*
+ * Answers the buffers with the inverted data, with a random number of descriptors returned at
+ * once, and exits once the region has been deregistered.
+ */
+static void echo(void)
+{
+    errval_t err;
+    struct cleanq *queue = create_queue(false);
+    cleanq_set_register_callback(queue, register_cb);
+    cleanq_set_deregister_callback(queue, deregister_cb);
+
+    uint64_t old;
+    err = cleanq_control(queue, CLEANQ_CTRL_ACK_BATCH, (rand() % NUM_SLOTS) + 1, &old);
+    if (err_is_fail(err)) {
+        FAIL("setting the acknowledgement batch failed %d\n", err);
+    }
+
+    uint64_t num_rx = 0;
+    while (num_deregistered == 0) {
+        struct cleanq_buf bufs[MAX_BATCH];
+        size_t num_deq;
+        err = cleanq_dequeue_batch(queue, bufs, (rand() % MAX_BATCH) + 1, &num_deq);
+        if (err == CLEANQ_ERR_QUEUE_EMPTY) {
+            sched_yield();
+            continue;
+        }
+        if (err_is_fail(err)) {
+            FAIL("the echo side dequeue returned %d\n", err);
+        }
+
+        for (size_t i = 0; i < num_deq; i++) {
+            check_buf(&bufs[i], num_rx);
+            uint8_t *data = buf_data(bufs[i].offset);
+            for (size_t j = 0; j < bufs[i].valid_length; j++) {
+                if (data[j] != (uint8_t)num_rx) {
+                    FAIL("the data of buffer %lu is wrong at %zu\n", num_rx, j);
+                }
+                data[j] = ~data[j];
+            }
+            num_rx++;
+        }
+
+        size_t sent = 0;
+        while (sent < num_deq) {
+            size_t num_enq;
+            err = cleanq_enqueue_batch(queue, bufs + sent, num_deq - sent, &num_enq);
+            if (err == CLEANQ_ERR_QUEUE_FULL) {
+                sched_yield();
+                continue;
+            }
+            if (err_is_fail(err)) {
+                FAIL("the echo side enqueue returned %d\n", err);
+            }
+            sent += num_enq;
+        }
+    }
+
+    if (num_rx != NUM_ROUNDS) {
+        FAIL("the echo side got %lu buffers instead of %d\n", num_rx, NUM_ROUNDS);
+    }
+
+    cleanq_destroy(queue);
+    exit(0);
+}
+
+
+static void run_echo_test(void)
+{
+    errval_t err;
+
+    struct cleanq *queue = create_queue(true);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo();
+    }
+
+    /* the memory file is passed once the other side has attached */
+    err = cleanq_memfd_alloc(&memory, MEMORY_SIZE);
+    if (err_is_fail(err)) {
+        FAIL("allocating memory failed %d\n", err);
+    }
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed %d\n", err);
+    }
+
+    test_echo(queue);
+
+    struct capref cap;
+    err = cleanq_deregister(queue, regid, &cap);
+    if (err_is_fail(err)) {
+        FAIL("deregistering the memory failed %d\n", err);
+    }
+
+    alarm(HANG_TIMEOUT_S);
+    test_join(pid);
+
+    cleanq_destroy(queue);
+    cleanq_memfd_free(&cap);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    srand(time(NULL));
+    test_watchdog("no progress");
+
+    snprintf(name, sizeof(name), "/cleanq-test-virtq-%d", getpid());
+
+    printf("Starting basic test\n");
+    test_basic();
+
+    printf("Starting echo test\n");
+    run_echo_test();
+
+    printf("virtq test passed\n");
+
+    return 0;
+}
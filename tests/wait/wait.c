@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+
+#define TEST_NAME "wait"
+#include "../common/test.h"
+
+
+#define BUF_SIZE 2048
+#define NUM_BUFS 16
+#define MEMORY_SIZE BUF_SIZE *NUM_BUFS
+
+#define NUM_ROUNDS 2000
+
+///< the test fails if a wakeup got lost and a side sleeps for this long
+#define HANG_TIMEOUT_S 60
+
+static struct capref memory;
+static regionid_t regid;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static void set_spin(struct cleanq *queue, uint64_t spin_us)
+{
+    uint64_t old;
+    errval_t err = cleanq_control(queue, CLEANQ_CTRL_WAIT_SPIN_US, spin_us, &old);
+    if (err_is_fail(err)) {
+        FAIL("setting the spin budget failed %d\n", err);
+    }
+}
+
+
+/*
+ * Waits for the next buffer, the wakeups may be spurious.
+ */
+static void wait_dequeue(struct cleanq *queue, struct cleanq_buf *b)
+{
+    while (true) {
+        errval_t err = cleanq_dequeue(queue, &b->rid, &b->offset, &b->length, &b->valid_data,
+                                      &b->valid_length, &b->flags);
+        if (err_is_ok(err)) {
+            return;
+        }
+        if (err != CLEANQ_ERR_QUEUE_EMPTY) {
+            FAIL("dequeue returned %d\n", err);
+        }
+
+        err = cleanq_wait(queue, CLEANQ_WAIT_FOREVER);
+        if (err_is_fail(err)) {
+            FAIL("waiting forever returned %d\n", err);
+        }
+    }
+}
+
+
+static void send_notify(struct cleanq *queue, const struct cleanq_buf *b)
+{
+    errval_t err;
+
+    while ((err = cleanq_enqueue(queue, b->rid, b->offset, b->length, b->valid_data,
+                                 b->valid_length, b->flags))
+           == CLEANQ_ERR_QUEUE_FULL) {
+        sched_yield();
+    }
+    if (err_is_fail(err)) {
+        FAIL("enqueue returned %d\n", err);
+    }
+
+    err = cleanq_notify(queue);
+    if (err_is_fail(err)) {
+        FAIL("notify returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Tests
+ * ================================================================================================
+ */
+
+
+/*
+ * Waiting on an empty queue times out after the timeout and not much later, also without
+ * spinning first. A zero timeout only polls.
+ */
+static void test_timeout(struct cleanq *queue)
+{
+    static const uint64_t spins[] = { 0, CLEANQ_WAIT_DEFAULT_SPIN_US, 5000 };
+    static const uint64_t timeouts[] = { 0, 1000, 20000 };
+
+    for (size_t s = 0; s < sizeof(spins) / sizeof(spins[0]); s++) {
+        set_spin(queue, spins[s]);
+        for (size_t t = 0; t < sizeof(timeouts) / sizeof(timeouts[0]); t++) {
+            uint64_t start = test_now_us();
+            errval_t err = cleanq_wait(queue, timeouts[t]);
+            uint64_t waited = test_now_us() - start;
+
+            if (err != CLEANQ_ERR_TIMEOUT) {
+                FAIL("waiting %luus on an empty queue returned %d\n", timeouts[t], err);
+            }
+            if (waited < timeouts[t] || waited > timeouts[t] + 1000000) {
+                FAIL("waiting %luus with spin %luus took %luus\n", timeouts[t], spins[s],
+                     waited);
+            }
+        }
+    }
+
+    set_spin(queue, CLEANQ_WAIT_DEFAULT_SPIN_US);
+}
+
+
+/*
+ * Sends NUM_ROUNDS buffers to the echo side, which sleeps until they arrive and sends them back.
+ * Both sides sleep for a random time now and then, so the notifications find the other side
+ * spinning, asleep, or busy. A lost wakeup makes the test hang.
+ */
+static void test_ping_pong(struct cleanq *queue)
+{
+    for (uint64_t i = 0; i < NUM_ROUNDS; i++) {
+        if ((i % 100) == 0) {
+            set_spin(queue, (rand() % 2) ? 0 : CLEANQ_WAIT_DEFAULT_SPIN_US);
+        }
+
+        struct cleanq_buf b = {
+            .rid = regid,
+            .offset = (i % NUM_BUFS) * BUF_SIZE,
+            .length = BUF_SIZE,
+            .valid_data = 0,
+            .valid_length = BUF_SIZE,
+            .flags = i,
+        };
+        send_notify(queue, &b);
+
+        if ((rand() % 4) == 0) {
+            usleep(rand() % 200);
+        }
+
+        alarm(HANG_TIMEOUT_S);
+        wait_dequeue(queue, &b);
+        alarm(0);
+
+        if (b.flags != i || b.offset != (i % NUM_BUFS) * BUF_SIZE) {
+            FAIL("round %lu got back buffer %lu at offset %lu\n", i, b.flags, b.offset);
+        }
+    }
+}
+
+
+/*
+ * A buffer that is already there is reported right away, without sleeping.
+ */
+static void test_ready(struct cleanq *queue)
+{
+    struct cleanq_buf b = {
+        .rid = regid, .offset = 0, .length = BUF_SIZE, .valid_length = 1, .flags = 7
+    };
+    send_notify(queue, &b);
+
+    /* the echo side sends it back, then the wait must return as soon as it is there */
+    alarm(HANG_TIMEOUT_S);
+    errval_t err;
+    while ((err = cleanq_wait(queue, 1000000)) == CLEANQ_ERR_TIMEOUT) {
+        /* the echo side may not have been scheduled yet */
+    }
+    alarm(0);
+    if (err_is_fail(err)) {
+        FAIL("waiting for a sent back buffer returned %d\n", err);
+    }
+
+    wait_dequeue(queue, &b);
+
+    err = cleanq_wait(queue, 0);
+    if (err != CLEANQ_ERR_TIMEOUT) {
+        FAIL("polling an empty queue returned %d\n", err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Echo Side
+ * ================================================================================================
+ */
+
+
+static void echo(const char *name, bool ipc)
+{
+    struct cleanq *queue = test_create_queue(name, !ipc, false, 0);
+
+    while (true) {
+        struct cleanq_buf b;
+        wait_dequeue(queue, &b);
+
+        if ((rand() % 4) == 0) {
+            usleep(rand() % 200);
+        }
+        if ((rand() % 64) == 0) {
+            set_spin(queue, (rand() % 2) ? 0 : CLEANQ_WAIT_DEFAULT_SPIN_US);
+        }
+
+        send_notify(queue, &b);
+    }
+}
+
+
+static void run_test(const char *q_name, bool ipc)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-test-wait-%s-%d", q_name, getpid());
+
+    struct cleanq *queue = test_create_queue(name, !ipc, true, 0);
+
+    printf("Starting timeout test %s\n", q_name);
+    test_timeout(queue);
+
+    pid_t pid = test_fork();
+    if (pid == 0) {
+        echo(name, ipc);
+    }
+
+    err = cleanq_register(queue, memory, &regid);
+    if (err_is_fail(err)) {
+        FAIL("registering memory failed using q: %s\n", q_name);
+    }
+
+    printf("Starting ping pong test %s\n", q_name);
+    test_ping_pong(queue);
+
+    printf("Starting ready test %s\n", q_name);
+    test_ready(queue);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    cleanq_destroy(queue);
+}
+
+
+int main(int argc, char *argv[])
+{
+    (void)(argc);
+    (void)(argv);
+
+    memory.vaddr = malloc(MEMORY_SIZE);
+    memory.paddr = (uint64_t)memory.vaddr;
+    memory.len = MEMORY_SIZE;
+
+    srand(time(NULL));
+    test_watchdog("no progress, a wakeup got lost");
+
+    run_test("ffq", false);
+    run_test("ipcq", true);
+
+    printf("wait test passed\n");
+
+    return 0;
+}
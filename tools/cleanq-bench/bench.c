@@ -0,0 +1,931 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/histogram.h>
+#include <cleanq/stats.h>
+#include <cleanq/backends/loopback_queue.h>
+#include <cleanq/backends/ipc_queue.h>
+#include <cleanq/backends/ff_queue.h>
+#include <cleanq/backends/virtio_queue.h>
+#include <cleanq/backends/debug_queue.h>
+#include <cleanq/backends/thread_queue.h>
+#include <cleanq/backends/batch_queue.h>
+
+
+/*
+ * cleanq-bench: measures the throughput and round trip latency of the backends.
+ *
+ * A producer sends buffers to a consumer, which touches the payload and sends them back. The
+ * producer keeps a fixed number of buffers in flight and records the time from enqueueing a
+ * buffer until it comes back. The loopback backend has no other side, the producer dequeues its
+ * own buffers. Every combination of the swept parameters is one run, the results are printed
+ * as JSON or CSV.
+ */
+
+
+///< the maximum number of values of a swept parameter
+#define MAX_SWEEP 16
+
+///< the default number of round trips of a run
+#define DEFAULT_ROUNDS 1000000
+
+///< the smallest buffer, one cache line
+#define MIN_BUFSIZE 64
+
+
+///< a list of swept values
+struct sweep
+{
+    size_t values[MAX_SWEEP];
+    size_t num;
+};
+
+
+///< the configuration of a single run
+struct bench_config
+{
+    ///< the backend to use
+    const char *backend;
+
+    ///< the number of slots of the rings
+    size_t slots;
+
+    ///< the maximum number of buffers per enqueue and dequeue call
+    size_t batch;
+
+    ///< the number of payload bytes per buffer
+    size_t payload;
+
+    ///< the number of buffers in flight, 0 to use the number of slots
+    size_t inflight;
+
+    ///< the number of measured round trips, another 10% are done to warm up
+    size_t rounds;
+
+    ///< the cpu sets of the producer and the consumer, NULL to not pin
+    cpu_set_t *producer_cpus;
+    cpu_set_t *consumer_cpus;
+
+    ///< yield the cpu if a poll finds nothing
+    bool yield;
+
+    ///< record the enqueue and dequeue cost with the queue histograms
+    bool op_latency;
+};
+
+
+///< the results of a single run
+struct bench_result
+{
+    ///< the buffers in flight that were actually used
+    size_t inflight;
+
+    ///< the measured time in seconds
+    double seconds;
+
+    ///< the round trip latency in nanoseconds
+    uint64_t rtt_p50, rtt_p99, rtt_p999, rtt_max;
+
+    ///< the cost of the enqueue and dequeue calls of the producer in cycles
+    struct cleanq_latency enq, deq;
+
+    ///< the statistics of the producer endpoint
+    struct cleanq_stats stats;
+
+    ///< the number of ownership violations found by the debug queue
+    uint64_t debug_errors;
+};
+
+
+///< the queues of a run
+struct bench_queues
+{
+    ///< the producer endpoint, what the producer uses
+    struct cleanq *prod;
+
+    ///< the consumer endpoint, NULL if the producer receives its own buffers
+    struct cleanq *cons;
+
+    ///< the wrapped queue of the producer if it uses a debug queue
+    struct cleanq *inner;
+};
+
+
+///< the state shared by the producer and the consumer
+struct bench_run
+{
+    struct bench_config *cfg;
+    struct bench_queues qs;
+
+    ///< the registered memory
+    struct capref mem;
+    regionid_t rid;
+    size_t bufsize;
+
+    ///< set by the producer when it is done
+    volatile bool stop;
+
+    ///< the round trip samples in timestamp counter cycles
+    uint64_t *samples;
+
+    ///< the measured time in seconds
+    double seconds;
+
+    ///< set if a queue operation failed unexpectedly
+    volatile bool failed;
+};
+
+
+///< timestamp counter cycles per nanosecond
+static double tsc_per_ns;
+
+
+/*
+ * ================================================================================================
+ * Helpers
+ * ================================================================================================
+ */
+
+
+static inline uint64_t tsc(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * @brief measures the frequency of the timestamp counter
+ */
+static void calibrate_tsc(void)
+{
+    double t0 = now_s();
+    uint64_t c0 = tsc();
+    while (now_s() - t0 < 0.05) {
+    }
+    uint64_t c1 = tsc();
+    double t1 = now_s();
+
+    tsc_per_ns = (double)(c1 - c0) / ((t1 - t0) * 1e9);
+}
+
+
+/**
+ * @brief parses a comma separated list of numbers
+ *
+ * @param sw    the list to fill in
+ * @param arg   the string to parse
+ *
+ * @returns true on success
+ */
+static bool parse_sweep(struct sweep *sw, const char *arg)
+{
+    char *end;
+    sw->num = 0;
+
+    while (*arg) {
+        if (sw->num == MAX_SWEEP) {
+            return false;
+        }
+
+        size_t v = strtoul(arg, &end, 0);
+        if (end == arg || v == 0) {
+            return false;
+        }
+        sw->values[sw->num++] = v;
+
+        arg = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') {
+            return false;
+        }
+    }
+
+    return sw->num > 0;
+}
+
+
+/**
+ * @brief parses a cpu list like "0-3,8,10-11" into a cpu set
+ *
+ * @param set   the cpu set to fill in
+ * @param arg   the string to parse
+ *
+ * @returns true on success
+ */
+static bool parse_cpulist(cpu_set_t *set, const char *arg)
+{
+    char *end;
+    CPU_ZERO(set);
+
+    while (*arg && *arg != '\n') {
+        unsigned long first = strtoul(arg, &end, 10);
+        if (end == arg) {
+            return false;
+        }
+
+        unsigned long last = first;
+        if (*end == '-') {
+            arg = end + 1;
+            last = strtoul(arg, &end, 10);
+            if (end == arg || last < first) {
+                return false;
+            }
+        }
+
+        for (unsigned long c = first; c <= last && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+
+        arg = (*end == ',') ? end + 1 : end;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+
+/**
+ * @brief obtains the cpus of a NUMA node from sysfs
+ *
+ * @param set   the cpu set to fill in
+ * @param node  the NUMA node
+ *
+ * @returns true on success
+ */
+static bool node_cpus(cpu_set_t *set, unsigned long node)
+{
+    char path[128], line[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu/cpulist", node);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    bool ok = fgets(line, sizeof(line), f) && parse_cpulist(set, line);
+    fclose(f);
+
+    return ok;
+}
+
+
+/*
+ * ================================================================================================
+ * Setting up the Queues
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief creates the queues of a run
+ *
+ * @param qs    the queues to create
+ * @param cfg   the configuration of the run
+ *
+ * @returns CLEANQ_ERR_OK on success
+ *
+ * Both endpoints of the shared memory backends live in this process, the consumer creates the
+ * queue and the producer attaches to it.
+ */
+static errval_t create_queues(struct bench_queues *qs, struct bench_config *cfg)
+{
+    errval_t err;
+    char name[64];
+    snprintf(name, sizeof(name), "/cleanq-bench-%d", (int)getpid());
+
+    memset(qs, 0, sizeof(*qs));
+
+    const char *b = cfg->backend;
+    if (strcmp(b, "loopback") == 0) {
+        return loopback_queue_create((struct cleanq_loopbackq **)&qs->prod);
+    }
+
+    if (strcmp(b, "threadq") == 0) {
+        return cleanq_threadq_create((struct cleanq_threadq **)&qs->cons,
+                                     (struct cleanq_threadq **)&qs->prod, cfg->slots);
+    }
+
+    bool compact = strstr(b, "-compact") != NULL;
+    if (strncmp(b, "ipcq", 4) == 0 || strcmp(b, "debugq") == 0 || strcmp(b, "batchq") == 0) {
+        struct cleanq_ipcq_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.slots = cfg->slots;
+        attr.compact = compact;
+
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&qs->cons, name, true, &attr);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        err = cleanq_ipcq_create_with_attr((struct cleanq_ipcq **)&qs->prod, name, false, &attr);
+    } else if (strncmp(b, "ffq", 3) == 0) {
+        struct cleanq_ffq_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.slots = cfg->slots;
+        attr.compact = compact;
+
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&qs->cons, name, true, &attr);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        err = cleanq_ffq_create_with_attr((struct cleanq_ffq **)&qs->prod, name, false, &attr);
+    } else if (strcmp(b, "virtq") == 0) {
+        struct cleanq_virtq_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.slots = cfg->slots;
+
+        err = cleanq_virtq_create_with_attr((struct cleanq_virtq **)&qs->cons, name, true, &attr);
+        if (err_is_fail(err)) {
+            return err;
+        }
+        err = cleanq_virtq_create_with_attr((struct cleanq_virtq **)&qs->prod, name, false,
+                                            &attr);
+    } else {
+        return CLEANQ_ERR_INIT_QUEUE;
+    }
+
+    if (err_is_fail(err)) {
+        cleanq_destroy(qs->cons);
+        return err;
+    }
+
+    /* the debug queue checks the ownership of the buffers of the producer */
+    if (strcmp(b, "debugq") == 0) {
+        qs->inner = qs->prod;
+        err = cleanq_debugq_create((struct cleanq_debugq **)&qs->prod, qs->inner);
+        if (err_is_fail(err)) {
+            cleanq_destroy(qs->inner);
+            cleanq_destroy(qs->cons);
+            return err;
+        }
+    }
+
+    /* the batch queue turns the single enqueues of the producer into batches */
+    if (strcmp(b, "batchq") == 0) {
+        qs->inner = qs->prod;
+        err = cleanq_batchq_create((struct cleanq_batchq **)&qs->prod, qs->inner);
+        if (err_is_fail(err)) {
+            cleanq_destroy(qs->inner);
+            cleanq_destroy(qs->cons);
+            return err;
+        }
+    }
+
+    return CLEANQ_ERR_OK;
+}
+
+
+/**
+ * @brief destroys the queues of a run
+ *
+ * @param qs    the queues to destroy
+ */
+static void destroy_queues(struct bench_queues *qs)
+{
+    cleanq_destroy(qs->prod);
+    if (qs->inner) {
+        cleanq_destroy(qs->inner);
+    }
+    if (qs->cons) {
+        cleanq_destroy(qs->cons);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Producer and Consumer
+ * ================================================================================================
+ */
+
+
+static void pin(cpu_set_t *cpus)
+{
+    if (cpus && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus)) {
+        fprintf(stderr, "cleanq-bench: failed to pin thread\n");
+    }
+}
+
+
+/**
+ * @brief the consumer, sends back all buffers it receives after reading their payload
+ */
+static void *consumer(void *arg)
+{
+    struct bench_run *run = arg;
+    struct bench_config *cfg = run->cfg;
+    struct cleanq *q = run->qs.cons;
+    struct cleanq_buf *bufs = calloc(cfg->batch, sizeof(struct cleanq_buf));
+    volatile uint64_t sink = 0;
+
+    pin(cfg->consumer_cpus);
+
+    while (!run->stop) {
+        size_t n;
+        if (cleanq_dequeue_batch(q, bufs, cfg->batch, &n) != CLEANQ_ERR_OK) {
+            if (cfg->yield) {
+                sched_yield();
+            }
+            continue;
+        }
+
+        /* touch the payload like a real consumer would */
+        for (size_t i = 0; i < n; i++) {
+            uint64_t *p = (uint64_t *)((uint8_t *)run->mem.vaddr + bufs[i].offset);
+            for (size_t w = 0; w < cfg->payload / sizeof(uint64_t); w++) {
+                sink += p[w];
+            }
+        }
+
+        size_t sent = 0;
+        while (sent < n && !run->stop) {
+            size_t m;
+            errval_t err = cleanq_enqueue_batch(q, bufs + sent, n - sent, &m);
+            if (err == CLEANQ_ERR_OK) {
+                sent += m;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                run->failed = true;
+                run->stop = true;
+            } else if (cfg->yield) {
+                sched_yield();
+            }
+        }
+    }
+
+    free(bufs);
+
+    return NULL;
+}
+
+
+/**
+ * @brief the producer, keeps the buffers in flight and records their round trip time
+ */
+static void *producer(void *arg)
+{
+    struct bench_run *run = arg;
+    struct bench_config *cfg = run->cfg;
+    struct cleanq *q = run->qs.prod;
+    size_t inflight = cfg->inflight;
+
+    size_t *free_bufs = malloc(inflight * sizeof(size_t));
+    uint64_t *sent_at = calloc(inflight, sizeof(uint64_t));
+    struct cleanq_buf *bufs = calloc(cfg->batch, sizeof(struct cleanq_buf));
+    size_t num_free = inflight;
+
+    pin(cfg->producer_cpus);
+
+    for (size_t i = 0; i < inflight; i++) {
+        free_bufs[i] = inflight - 1 - i;
+    }
+
+    size_t warmup = cfg->rounds / 10;
+    size_t target = warmup + cfg->rounds;
+    size_t completed = 0;
+    double start = now_s();
+
+    while (completed < target && !run->failed) {
+        bool progress = false;
+
+        /* send as many free buffers as the batch allows */
+        size_t k = (num_free < cfg->batch) ? num_free : cfg->batch;
+        if (k > 0) {
+            uint64_t now = tsc();
+            for (size_t i = 0; i < k; i++) {
+                size_t idx = free_bufs[num_free - 1 - i];
+                uint8_t *p = (uint8_t *)run->mem.vaddr + idx * run->bufsize;
+                memset(p, (int)completed, cfg->payload);
+
+                bufs[i].rid = run->rid;
+                bufs[i].offset = idx * run->bufsize;
+                bufs[i].length = run->bufsize;
+                bufs[i].valid_data = 0;
+                bufs[i].valid_length = cfg->payload;
+                bufs[i].flags = 0;
+                sent_at[idx] = now;
+            }
+
+            size_t m;
+            errval_t err = cleanq_enqueue_batch(q, bufs, k, &m);
+            if (err == CLEANQ_ERR_OK) {
+                num_free -= m;
+                progress = true;
+            } else if (err != CLEANQ_ERR_QUEUE_FULL) {
+                run->failed = true;
+            }
+        }
+
+        /* collect the buffers that came back */
+        size_t n;
+        if (cleanq_dequeue_batch(q, bufs, cfg->batch, &n) == CLEANQ_ERR_OK) {
+            uint64_t now = tsc();
+            for (size_t i = 0; i < n; i++) {
+                size_t idx = bufs[i].offset / run->bufsize;
+                if (completed >= warmup && completed < target) {
+                    run->samples[completed - warmup] = now - sent_at[idx];
+                }
+                free_bufs[num_free++] = idx;
+
+                if (++completed == warmup) {
+                    start = now_s();
+                }
+            }
+            progress = true;
+        }
+
+        if (!progress && cfg->yield) {
+            sched_yield();
+        }
+    }
+
+    run->seconds = now_s() - start;
+
+    /* collect the buffers still in flight so that the region can be deregistered */
+    while (num_free < inflight && !run->failed) {
+        size_t n;
+        if (cleanq_dequeue_batch(q, bufs, cfg->batch, &n) == CLEANQ_ERR_OK) {
+            num_free += n;
+        } else if (cfg->yield) {
+            sched_yield();
+        }
+    }
+
+    run->stop = true;
+
+    free(bufs);
+    free(sent_at);
+    free(free_bufs);
+
+    return NULL;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief does a single run
+ *
+ * @param cfg   the configuration of the run
+ * @param res   returns the results
+ *
+ * @returns CLEANQ_ERR_OK on success
+ */
+static errval_t bench_run(struct bench_config *cfg, struct bench_result *res)
+{
+    errval_t err;
+    struct bench_run run;
+
+    memset(&run, 0, sizeof(run));
+    memset(res, 0, sizeof(*res));
+    run.cfg = cfg;
+
+    err = create_queues(&run.qs, cfg);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    /* the loopback queue has a fixed size, and the consumer can't hold more than a ring */
+    size_t slots = cfg->slots;
+    if (run.qs.cons == NULL) {
+        uint64_t s;
+        cleanq_control(run.qs.prod, CLEANQ_CTRL_STATS, CLEANQ_STAT_SLOTS, &s);
+        slots = s ? s : 64;
+    }
+
+    struct bench_config c = *cfg;
+    if (c.inflight == 0 || c.inflight > slots) {
+        c.inflight = slots;
+    }
+    run.cfg = &c;
+    res->inflight = c.inflight;
+
+    run.bufsize = (cfg->payload + MIN_BUFSIZE - 1) & ~(size_t)(MIN_BUFSIZE - 1);
+    run.mem.len = c.inflight * run.bufsize;
+    run.mem.vaddr = aligned_alloc(4096, (run.mem.len + 4095) & ~(size_t)4095);
+    run.mem.paddr = (uint64_t)run.mem.vaddr;
+    run.samples = malloc(cfg->rounds * sizeof(uint64_t));
+    if (run.mem.vaddr == NULL || run.samples == NULL) {
+        err = CLEANQ_ERR_MALLOC_FAIL;
+        goto cleanup;
+    }
+    memset(run.mem.vaddr, 0, run.mem.len);
+
+    err = cleanq_register(run.qs.prod, run.mem, &run.rid);
+    if (err_is_fail(err)) {
+        goto cleanup;
+    }
+
+    if (cfg->op_latency) {
+        cleanq_control(run.qs.prod, CLEANQ_CTRL_HISTOGRAM, 1, NULL);
+    }
+
+    pthread_t cons;
+    if (run.qs.cons) {
+        pthread_create(&cons, NULL, consumer, &run);
+    }
+
+    producer(&run);
+
+    if (run.qs.cons) {
+        pthread_join(cons, NULL);
+    }
+
+    if (run.failed) {
+        err = CLEANQ_ERR_INVALID_BUFFER_ARGS;
+        goto cleanup;
+    }
+
+    res->seconds = run.seconds;
+
+    qsort(run.samples, cfg->rounds, sizeof(uint64_t), cmp_u64);
+    res->rtt_p50 = (uint64_t)(run.samples[cfg->rounds / 2] / tsc_per_ns);
+    res->rtt_p99 = (uint64_t)(run.samples[cfg->rounds * 99 / 100] / tsc_per_ns);
+    res->rtt_p999 = (uint64_t)(run.samples[cfg->rounds * 999 / 1000] / tsc_per_ns);
+    res->rtt_max = (uint64_t)(run.samples[cfg->rounds - 1] / tsc_per_ns);
+
+    cleanq_get_latency(run.qs.prod, CLEANQ_HIST_ENQUEUE, &res->enq);
+    cleanq_get_latency(run.qs.prod, CLEANQ_HIST_DEQUEUE, &res->deq);
+    cleanq_get_stats(run.qs.prod, &res->stats);
+
+    if (run.qs.inner) {
+        /* the debug and batch queues have no ring, the wrapped queue samples the occupancy */
+        struct cleanq_stats inner;
+        cleanq_get_stats(run.qs.inner, &inner);
+        res->stats.occupancy_hwm = inner.occupancy_hwm;
+        if (strcmp(cfg->backend, "debugq") == 0) {
+            res->debug_errors = cleanq_debugq_get_errors((struct cleanq_debugq *)run.qs.prod);
+        }
+    }
+
+    struct capref cap;
+    err = cleanq_deregister(run.qs.prod, run.rid, &cap);
+
+cleanup:
+    destroy_queues(&run.qs);
+    free(run.samples);
+    free(run.mem.vaddr);
+
+    return err;
+}
+
+
+/*
+ * ================================================================================================
+ * Output
+ * ================================================================================================
+ */
+
+
+///< the output formats
+typedef enum { FORMAT_JSON, FORMAT_CSV } bench_format_t;
+
+
+static void print_header(bench_format_t format)
+{
+    if (format == FORMAT_JSON) {
+        printf("[\n");
+        return;
+    }
+
+    printf("backend,slots,batch,payload,inflight,rounds,seconds,mops,mb_per_s,"
+           "rtt_p50_ns,rtt_p99_ns,rtt_p999_ns,rtt_max_ns,"
+           "enq_p50_cycles,enq_p99_cycles,deq_p50_cycles,deq_p99_cycles,"
+           "enqueue_full,dequeue_empty,occupancy_hwm,debug_errors\n");
+}
+
+
+static void print_result(bench_format_t format, struct bench_config *cfg,
+                         struct bench_result *res, bool first)
+{
+    double mops = (double)cfg->rounds / res->seconds / 1e6;
+    double mbps = (double)cfg->rounds * (double)cfg->payload / res->seconds / 1e6;
+
+    if (format == FORMAT_CSV) {
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%.6f,%.3f,%.1f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+               "%lu,%lu\n",
+               cfg->backend, cfg->slots, cfg->batch, cfg->payload, res->inflight, cfg->rounds,
+               res->seconds, mops, mbps, res->rtt_p50, res->rtt_p99, res->rtt_p999, res->rtt_max,
+               res->enq.p50, res->enq.p99, res->deq.p50, res->deq.p99, res->stats.enqueue_full,
+               res->stats.dequeue_empty, res->stats.occupancy_hwm, res->debug_errors);
+        return;
+    }
+
+    printf("%s  {\"backend\": \"%s\", \"slots\": %zu, \"batch\": %zu, \"payload\": %zu, "
+           "\"inflight\": %zu, \"rounds\": %zu, \"seconds\": %.6f, \"mops\": %.3f, "
+           "\"mb_per_s\": %.1f,\n",
+           first ? "" : ",\n", cfg->backend, cfg->slots, cfg->batch, cfg->payload, res->inflight,
+           cfg->rounds, res->seconds, mops, mbps);
+    printf("   \"rtt_ns\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu},\n",
+           res->rtt_p50, res->rtt_p99, res->rtt_p999, res->rtt_max);
+    printf("   \"enq_cycles\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu},\n", res->enq.p50,
+           res->enq.p99, res->enq.p999);
+    printf("   \"deq_cycles\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu},\n", res->deq.p50,
+           res->deq.p99, res->deq.p999);
+    printf("   \"enqueue_full\": %lu, \"dequeue_empty\": %lu, \"occupancy_hwm\": %lu, "
+           "\"debug_errors\": %lu}",
+           res->stats.enqueue_full, res->stats.dequeue_empty, res->stats.occupancy_hwm,
+           res->debug_errors);
+    fflush(stdout);
+}
+
+
+static void print_footer(bench_format_t format)
+{
+    if (format == FORMAT_JSON) {
+        printf("\n]\n");
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Main
+ * ================================================================================================
+ */
+
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -b, --backends LIST        loopback,threadq,ipcq,ipcq-compact,ffq,ffq-compact,"
+            "virtq,debugq,batchq\n"
+            "  -s, --slots LIST           ring sizes to sweep (default 64), loopback has 64 "
+            "slots\n"
+            "  -B, --batch LIST           batch sizes to sweep (default 1)\n"
+            "  -p, --payload LIST         payload sizes in bytes to sweep (default 64)\n"
+            "  -i, --inflight N           buffers in flight (default: the ring size)\n"
+            "  -r, --rounds N             measured round trips per run (default %d)\n"
+            "  -P, --producer-cpu LIST    pin the producer to these cpus, e.g. 0 or 0-3\n"
+            "  -C, --consumer-cpu LIST    pin the consumer to these cpus\n"
+            "      --producer-node N      pin the producer to the cpus of a NUMA node\n"
+            "      --consumer-node N      pin the consumer to the cpus of a NUMA node\n"
+            "  -f, --format json|csv      output format (default json)\n"
+            "  -y, --yield                yield the cpu on empty polls, for shared cores\n"
+            "  -l, --op-latency           record the cost of the enqueue and dequeue calls\n",
+            prog, DEFAULT_ROUNDS);
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "backends", required_argument, NULL, 'b' },
+        { "slots", required_argument, NULL, 's' },
+        { "batch", required_argument, NULL, 'B' },
+        { "payload", required_argument, NULL, 'p' },
+        { "inflight", required_argument, NULL, 'i' },
+        { "rounds", required_argument, NULL, 'r' },
+        { "producer-cpu", required_argument, NULL, 'P' },
+        { "consumer-cpu", required_argument, NULL, 'C' },
+        { "producer-node", required_argument, NULL, 'N' },
+        { "consumer-node", required_argument, NULL, 'M' },
+        { "format", required_argument, NULL, 'f' },
+        { "yield", no_argument, NULL, 'y' },
+        { "op-latency", no_argument, NULL, 'l' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    char *backends = strdup("loopback,ipcq,ffq,debugq");
+    struct sweep slots = { { 64 }, 1 };
+    struct sweep batch = { { 1 }, 1 };
+    struct sweep payload = { { 64 }, 1 };
+    bench_format_t format = FORMAT_JSON;
+    cpu_set_t producer_cpus, consumer_cpus;
+
+    struct bench_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.rounds = DEFAULT_ROUNDS;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:s:B:p:i:r:P:C:f:ylh", options, NULL)) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'b':
+            free(backends);
+            backends = strdup(optarg);
+            break;
+        case 's':
+            ok = parse_sweep(&slots, optarg);
+            break;
+        case 'B':
+            ok = parse_sweep(&batch, optarg);
+            break;
+        case 'p':
+            ok = parse_sweep(&payload, optarg);
+            break;
+        case 'i':
+            cfg.inflight = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            cfg.rounds = strtoul(optarg, NULL, 0);
+            ok = cfg.rounds > 0;
+            break;
+        case 'P':
+            ok = parse_cpulist(&producer_cpus, optarg);
+            cfg.producer_cpus = &producer_cpus;
+            break;
+        case 'C':
+            ok = parse_cpulist(&consumer_cpus, optarg);
+            cfg.consumer_cpus = &consumer_cpus;
+            break;
+        case 'N':
+            ok = node_cpus(&producer_cpus, strtoul(optarg, NULL, 0));
+            cfg.producer_cpus = &producer_cpus;
+            break;
+        case 'M':
+            ok = node_cpus(&consumer_cpus, strtoul(optarg, NULL, 0));
+            cfg.consumer_cpus = &consumer_cpus;
+            break;
+        case 'f':
+            ok = strcmp(optarg, "json") == 0 || strcmp(optarg, "csv") == 0;
+            format = (strcmp(optarg, "csv") == 0) ? FORMAT_CSV : FORMAT_JSON;
+            break;
+        case 'y':
+            cfg.yield = true;
+            break;
+        case 'l':
+            cfg.op_latency = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            ok = false;
+            break;
+        }
+
+        if (!ok) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    calibrate_tsc();
+
+    int ret = EXIT_SUCCESS;
+    bool first = true;
+    print_header(format);
+
+    char *save;
+    for (char *b = strtok_r(backends, ",", &save); b; b = strtok_r(NULL, ",", &save)) {
+        for (size_t s = 0; s < slots.num; s++) {
+            for (size_t k = 0; k < batch.num; k++) {
+                for (size_t p = 0; p < payload.num; p++) {
+                    struct bench_result res;
+                    cfg.backend = b;
+                    cfg.slots = slots.values[s];
+                    cfg.batch = batch.values[k];
+                    cfg.payload = payload.values[p];
+
+                    errval_t err = bench_run(&cfg, &res);
+                    if (err_is_fail(err)) {
+                        fprintf(stderr,
+                                "cleanq-bench: %s slots=%zu batch=%zu payload=%zu failed (%u)\n",
+                                b, cfg.slots, cfg.batch, cfg.payload, err);
+                        ret = EXIT_FAILURE;
+                        continue;
+                    }
+
+                    print_result(format, &cfg, &res, first);
+                    first = false;
+                }
+            }
+        }
+    }
+
+    print_footer(format);
+    free(backends);
+
+    return ret;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/stats.h>
+
+
+/*
+ * cleanq-top: shows the statistics of the shared memory queues of all processes on the system.
+ * The statistics are mapped read-only, the queues are not affected.
+ */
+
+
+///< the directory where the shared memory objects live
+#define SHM_DIR "/dev/shm"
+
+///< the default refresh interval in milliseconds
+#define DEFAULT_INTERVAL_MS 1000
+
+
+///< a queue shown by the monitor
+struct queue_entry
+{
+    ///< the mapped statistics of the queue
+    struct cleanq_stats_view view;
+
+    ///< the values of the previous refresh
+    struct cleanq_stats prev[2];
+
+    ///< whether the queue was found in the current refresh
+    bool seen;
+};
+
+
+///< the queues shown by the monitor
+static struct queue_entry *queues;
+
+///< the number of queues
+static size_t num_queues;
+
+
+/*
+ * ================================================================================================
+ * Tracking the Queues
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief copies the statistics of an endpoint out of the shared memory
+ *
+ * @param dst   the copy
+ * @param src   the statistics in shared memory
+ */
+static void snapshot(struct cleanq_stats *dst, const volatile struct cleanq_stats *src)
+{
+    dst->enqueues = src->enqueues;
+    dst->dequeues = src->dequeues;
+    dst->enqueue_full = src->enqueue_full;
+    dst->dequeue_empty = src->dequeue_empty;
+    dst->enqueue_bytes = src->enqueue_bytes;
+    dst->dequeue_bytes = src->dequeue_bytes;
+    dst->occupancy_hwm = src->occupancy_hwm;
+    dst->slots = src->slots;
+    dst->pid = src->pid;
+}
+
+
+/**
+ * @brief adds a queue to the monitor unless it is already shown
+ *
+ * @param name  the name of the shared memory object
+ */
+static void track_queue(const char *name)
+{
+    for (size_t i = 0; i < num_queues; i++) {
+        if (strcmp(queues[i].view.name, name) == 0) {
+            queues[i].seen = true;
+            return;
+        }
+    }
+
+    struct cleanq_stats_view view;
+    if (err_is_fail(cleanq_stats_attach(&view, name))) {
+        return;
+    }
+
+    struct queue_entry *q = realloc(queues, (num_queues + 1) * sizeof(struct queue_entry));
+    if (q == NULL) {
+        cleanq_stats_detach(&view);
+        return;
+    }
+
+    queues = q;
+    q = &queues[num_queues++];
+    q->view = view;
+    q->seen = true;
+    snapshot(&q->prev[CLEANQ_STATS_CREATOR], view.endpoint[CLEANQ_STATS_CREATOR]);
+    snapshot(&q->prev[CLEANQ_STATS_ATTACHER], view.endpoint[CLEANQ_STATS_ATTACHER]);
+}
+
+
+/**
+ * @brief adds all queues found in the shared memory directory
+ */
+static void scan_queues(void)
+{
+    DIR *dir = opendir(SHM_DIR);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "/%s", de->d_name);
+        track_queue(name);
+    }
+
+    closedir(dir);
+}
+
+
+/**
+ * @brief removes the queues that have disappeared since the last scan
+ */
+static void drop_unseen_queues(void)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < num_queues; i++) {
+        if (queues[i].seen) {
+            queues[n++] = queues[i];
+        } else {
+            cleanq_stats_detach(&queues[i].view);
+        }
+    }
+
+    num_queues = n;
+}
+
+
+/*
+ * ================================================================================================
+ * Output
+ * ================================================================================================
+ */
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * @brief prints one line for an endpoint of a queue
+ *
+ * @param q     the queue
+ * @param ep    the endpoint, CLEANQ_STATS_CREATOR or CLEANQ_STATS_ATTACHER
+ * @param dt    the time since the previous refresh in seconds
+ */
+static void print_endpoint(struct queue_entry *q, int ep, double dt)
+{
+    struct cleanq_stats cur;
+    struct cleanq_stats *prev = &q->prev[ep];
+    snapshot(&cur, q->view.endpoint[ep]);
+
+    if (cur.pid == 0) {
+        printf("%-24s %-5s %-2s %8s\n", q->view.name, q->view.backend,
+               ep == CLEANQ_STATS_CREATOR ? "c" : "a", "-");
+        return;
+    }
+
+    /* the endpoint may have been recreated, don't show negative rates */
+    if (cur.pid != prev->pid || cur.enqueues < prev->enqueues || cur.dequeues < prev->dequeues) {
+        memset(prev, 0, sizeof(*prev));
+    }
+
+    double enq = (double)(cur.enqueues - prev->enqueues) / dt;
+    double deq = (double)(cur.dequeues - prev->dequeues) / dt;
+    double txmb = (double)(cur.enqueue_bytes - prev->enqueue_bytes) / dt / 1e6;
+    double rxmb = (double)(cur.dequeue_bytes - prev->dequeue_bytes) / dt / 1e6;
+    double full = (double)(cur.enqueue_full - prev->enqueue_full) / dt;
+    double empty = (double)(cur.dequeue_empty - prev->dequeue_empty) / dt;
+
+    printf("%-24s %-5s %-2s %8lu %12.0f %12.0f %9.1f %9.1f %10.0f %10.0f %8lu/%lu\n",
+           q->view.name, q->view.backend, ep == CLEANQ_STATS_CREATOR ? "c" : "a", cur.pid, enq,
+           deq, txmb, rxmb, full, empty, cur.occupancy_hwm, cur.slots);
+
+    *prev = cur;
+}
+
+
+/**
+ * @brief prints the statistics of all queues
+ *
+ * @param dt        the time since the previous refresh in seconds
+ * @param clear     clear the screen first
+ */
+static void print_queues(double dt, bool clear)
+{
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+
+    printf("%-24s %-5s %-2s %8s %12s %12s %9s %9s %10s %10s %10s\n", "QUEUE", "TYPE", "EP",
+           "PID", "ENQ/s", "DEQ/s", "TX MB/s", "RX MB/s", "FULL/s", "EMPTY/s", "HWM/SLOTS");
+
+    for (size_t i = 0; i < num_queues; i++) {
+        print_endpoint(&queues[i], CLEANQ_STATS_CREATOR, dt);
+        print_endpoint(&queues[i], CLEANQ_STATS_ATTACHER, dt);
+    }
+
+    fflush(stdout);
+}
+
+
+/*
+ * ================================================================================================
+ * Main
+ * ================================================================================================
+ */
+
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-i interval_ms] [-n iterations] [queue...]\n", prog);
+    printf("  Shows the statistics of the CleanQ shared memory queues. Without queue names,\n");
+    printf("  all queues in " SHM_DIR " are shown. FULL/s is the rate of enqueues that found\n");
+    printf("  the ring full, EMPTY/s the rate of dequeues that found nothing.\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long interval_ms = DEFAULT_INTERVAL_MS;
+    unsigned long iterations = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (interval_ms == 0) {
+        interval_ms = DEFAULT_INTERVAL_MS;
+    }
+
+    bool clear = isatty(STDOUT_FILENO);
+    double last = now_s();
+
+    for (unsigned long it = 0; iterations == 0 || it < iterations; it++) {
+        usleep(interval_ms * 1000);
+
+        for (size_t i = 0; i < num_queues; i++) {
+            queues[i].seen = false;
+        }
+
+        if (optind < argc) {
+            for (int i = optind; i < argc; i++) {
+                /* the names of shared memory objects start with a slash */
+                char name[NAME_MAX + 2];
+                snprintf(name, sizeof(name), "%s%s", argv[i][0] == '/' ? "" : "/", argv[i]);
+                track_queue(name);
+            }
+        } else {
+            scan_queues();
+        }
+
+        drop_unseen_queues();
+
+        double now = now_s();
+        print_queues(now - last, clear);
+        last = now;
+    }
+
+    for (size_t i = 0; i < num_queues; i++) {
+        cleanq_stats_detach(&queues[i].view);
+    }
+    free(queues);
+
+    return EXIT_SUCCESS;
+}
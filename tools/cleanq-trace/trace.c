@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020 ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached license file.
+ * if you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. attn: systems group.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cleanq/cleanq.h>
+#include <cleanq/trace.h>
+
+
+/*
+ * cleanq-trace: converts the trace rings written by cleanq_trace_save() or kept in shared memory
+ * objects by cleanq_trace_start() into a trace in the Chrome JSON format, which chrome://tracing
+ * and ui.perfetto.dev open, or into a line per event. The rings of several processes are merged
+ * into one trace, their timestamps are converted to CLOCK_MONOTONIC.
+ */
+
+
+///< the output formats
+enum format {
+    FORMAT_JSON,
+    FORMAT_TEXT,
+};
+
+
+///< a mapped trace ring
+struct ring
+{
+    ///< the header of the ring
+    const struct cleanq_trace_hdr *hdr;
+
+    ///< the events of the ring
+    const struct cleanq_trace_event *events;
+
+    ///< the size of the mapping
+    size_t size;
+};
+
+
+/*
+ * ================================================================================================
+ * Reading the Rings
+ * ================================================================================================
+ */
+
+
+/**
+ * @brief maps a trace ring from a file or a shared memory object
+ *
+ * @param ring  the ring to fill in
+ * @param name  the path of the file, or the name of the shared memory object
+ *
+ * @returns true on success
+ */
+static bool ring_map(struct ring *ring, const char *name)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        /* the names of shared memory objects start with a slash */
+        char shm[NAME_MAX + 2];
+        snprintf(shm, sizeof(shm), "%s%s", name[0] == '/' ? "" : "/", name);
+        fd = shm_open(shm, O_RDONLY, 0);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "cleanq-trace: %s: not found\n", name);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cleanq_trace_hdr)) {
+        fprintf(stderr, "cleanq-trace: %s: not a trace\n", name);
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "cleanq-trace: %s: could not be mapped\n", name);
+        return false;
+    }
+
+    const struct cleanq_trace_hdr *hdr = mem;
+    size_t need = sizeof(struct cleanq_trace_hdr)
+                  + hdr->events * sizeof(struct cleanq_trace_event);
+    if (hdr->magic != CLEANQ_TRACE_MAGIC || hdr->version != CLEANQ_TRACE_VERSION
+        || hdr->event_size != sizeof(struct cleanq_trace_event) || hdr->tsc_hz == 0
+        || hdr->events == 0 || (size_t)st.st_size < need) {
+        fprintf(stderr, "cleanq-trace: %s: not a trace of this version\n", name);
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    ring->hdr = hdr;
+    ring->events = (const struct cleanq_trace_event *)(hdr + 1);
+    ring->size = st.st_size;
+
+    return true;
+}
+
+
+/**
+ * @brief converts a timestamp of a ring to CLOCK_MONOTONIC
+ *
+ * @param hdr   the header of the ring
+ * @param tsc   the timestamp counter
+ *
+ * @returns the time in microseconds
+ */
+static double ring_time_us(const struct cleanq_trace_hdr *hdr, uint64_t tsc)
+{
+    double delta = (double)(int64_t)(tsc - hdr->tsc_base);
+    return ((double)hdr->mono_ns + delta * 1e9 / (double)hdr->tsc_hz) / 1e3;
+}
+
+
+/*
+ * ================================================================================================
+ * Writing the Trace
+ * ================================================================================================
+ */
+
+
+///< the names of the operations
+static const char *op_names[] = {
+    [CLEANQ_TRACE_ENQUEUE] = "enqueue",   [CLEANQ_TRACE_DEQUEUE] = "dequeue",
+    [CLEANQ_TRACE_REGISTER] = "register", [CLEANQ_TRACE_DEREGISTER] = "deregister",
+    [CLEANQ_TRACE_FULL] = "full",         [CLEANQ_TRACE_EMPTY] = "empty",
+};
+
+
+/**
+ * @brief writes a string as a JSON string
+ *
+ * @param out   the output
+ * @param s     the string
+ * @param max   the maximum length of the string
+ */
+static void json_string(FILE *out, const char *s, size_t max)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < max && s[i]; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+
+/**
+ * @brief writes the events of a ring
+ *
+ * @param out       the output
+ * @param ring      the ring
+ * @param format    the output format
+ * @param first     whether no JSON event has been written so far, updated
+ */
+static void ring_write(FILE *out, const struct ring *ring, enum format format, bool *first)
+{
+    const struct cleanq_trace_hdr *hdr = ring->hdr;
+
+    /* the ring holds the last events, older ones have been overwritten */
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t start = (head > hdr->events) ? head - hdr->events : 0;
+    if (start) {
+        fprintf(stderr, "cleanq-trace: %.64s: the oldest %lu events have been overwritten\n",
+                hdr->label, start);
+    }
+
+    if (format == FORMAT_JSON) {
+        fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":",
+                *first ? "" : ",\n", hdr->pid);
+        json_string(out, hdr->label, sizeof(hdr->label));
+        fprintf(out, "}}");
+        *first = false;
+    }
+
+    for (uint64_t i = start; i < head; i++) {
+        const struct cleanq_trace_event *e = &ring->events[i & (hdr->events - 1)];
+        if (e->op < CLEANQ_TRACE_ENQUEUE || e->op > CLEANQ_TRACE_EMPTY) {
+            /* being recorded right now */
+            continue;
+        }
+
+        double ts = ring_time_us(hdr, e->tsc);
+        double dur = (double)e->cycles * 1e6 / (double)hdr->tsc_hz;
+
+        if (format == FORMAT_TEXT) {
+            fprintf(out, "%.3f %.3f %lu %u %.64s %s rid=%u offset=%lu length=%u err=%u\n", ts, dur,
+                    hdr->pid, e->tid, hdr->label, op_names[e->op], e->rid, e->offset, e->length,
+                    e->err);
+            continue;
+        }
+
+        /* full and empty are instants, the other operations have a duration */
+        bool instant = (e->op == CLEANQ_TRACE_FULL || e->op == CLEANQ_TRACE_EMPTY);
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"cleanq\",\"pid\":%lu,\"tid\":%u,\"ts\":%.3f,",
+                op_names[e->op], hdr->pid, e->tid, ts);
+        if (instant) {
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\",");
+        } else {
+            fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,", dur);
+        }
+        fprintf(out, "\"args\":{\"rid\":%u,\"offset\":%lu,\"length\":%u,\"err\":%u}}", e->rid,
+                e->offset, e->length, e->err);
+    }
+}
+
+
+/*
+ * ================================================================================================
+ * Main
+ * ================================================================================================
+ */
+
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-f json|text] [-o output] trace...\n", prog);
+    printf("  Converts CleanQ trace rings into a Chrome JSON trace for chrome://tracing or\n");
+    printf("  ui.perfetto.dev, or into a line per event. A trace is a file written by\n");
+    printf("  cleanq_trace_save() or the name of a shared memory object of a running trace.\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    enum format format = FORMAT_JSON;
+    const char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int num = argc - optind;
+    struct ring *rings = calloc(num, sizeof(struct ring));
+    if (rings == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num; i++) {
+        if (!ring_map(&rings[i], argv[optind + i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "cleanq-trace: %s: could not be created\n", output);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool first = true;
+    if (format == FORMAT_JSON) {
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    }
+    for (int i = 0; i < num; i++) {
+        ring_write(out, &rings[i], format, &first);
+    }
+    if (format == FORMAT_JSON) {
+        fprintf(out, "\n]}\n");
+    }
+
+    for (int i = 0; i < num; i++) {
+        munmap((void *)rings[i].hdr, rings[i].size);
+    }
+    free(rings);
+
+    return fclose(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}